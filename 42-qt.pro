@@ -95,6 +95,19 @@ contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     QTPLUGIN += qcncodecs qjpcodecs qtwcodecs qkrcodecs qtaccessiblewidgets
 }
 
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 signature verification)
+    DEFINES += USE_SECP256K1
+    LIBS += -lsecp256k1
+}
+
+# use: qmake "USE_ZLIB=1"
+contains(USE_ZLIB, 1) {
+    message(Building with zlib compression of peer messages)
+    DEFINES += USE_ZLIB
+    LIBS += -lz
+}
+
 contains(USE_LEVELDB, 1) {
     message(Building with LevelDB transaction index)
     DEFINES += USE_LEVELDB
@@ -143,6 +156,8 @@ contains(USE_ASM, 1) {
     contains(USE_SSE2, 1) {
         message(Using SSE2 intrinsic scrypt implementation & generic sha256 implementation)
         SOURCES += src/crypto/scrypt/intrin/scrypt-sse2.cpp
+        SOURCES += src/crypto/sha256/intrin/sha256-sse2.cpp src/crypto/sha256/intrin/sha256-avx2.cpp src/crypto/sha256/intrin/sha256-shani.cpp
+        SOURCES += src/crypto/scrypt/intrin/scrypt-lanes-sse2.cpp src/crypto/scrypt/intrin/scrypt-lanes-avx2.cpp
         DEFINES += USE_SSE2
         QMAKE_CXXFLAGS += -msse2
         QMAKE_CFLAGS += -msse2
@@ -152,6 +167,12 @@ contains(USE_ASM, 1) {
     }
 }
 
+# SHA256 and stake kernel hashing, vectorized and hardware implementations are selected at runtime
+SOURCES += src/crypto/sha256/generic/sha256-generic.cpp
+
+# batch header hashing, scrypt lanes are selected at runtime, and per-thread scrypt scratchpads
+SOURCES += src/crypto/scrypt/generic/scrypt-lanes.cpp src/crypto/scrypt/generic/scrypt-scratchpad.cpp
+
 # regenerate src/build.h
 !windows|contains(USE_BUILD_INFO, 1) {
     genbuild.depends = FORCE
@@ -199,6 +220,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/checkpoints.h \
     src/compat.h \
     src/coincontrol.h \
+    src/scheduler.h \
+    src/metrics.h \
     src/sync.h \
     src/util.h \
     src/timestamps.h \
@@ -207,6 +230,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/kernel.h \
     src/kernel_worker.h \
     src/scrypt.h \
+    src/sha256.h \
     src/serialize.h \
     src/main.h \
     src/miner.h \
@@ -220,6 +244,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/txsketch.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -244,6 +269,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/jsonwriter.h \
+    src/jsonreader.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -257,17 +284,23 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/notificator.h \
     src/qt/qtipcserver.h \
     src/allocators.h \
+    src/lockedpool.h \
     src/ui_interface.h \
     src/qt/rpcconsole.h \
     src/version.h \
     src/ntp.h \
     src/netbase.h \
+    src/netpoll.h \
     src/clientversion.h \
     src/qt/multisigaddressentry.h \
     src/qt/multisiginputentry.h \
     src/qt/multisigdialog.h \
     src/qt/secondauthdialog.h \
     src/ies.h \
+    src/uint256map.h \
+    src/prevector.h \
+    src/notify.h \
+    src/walletnotify.h \
     src/ipcollector.h
 
 SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
@@ -290,6 +323,9 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/kernelrecord.cpp \
     src/alert.cpp \
     src/version.cpp \
+    src/lockedpool.cpp \
+    src/scheduler.cpp \
+    src/metrics.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/netbase.cpp \
@@ -300,6 +336,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/miner.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/netpoll.cpp \
     src/stun.cpp \
     src/irc.cpp \
     src/checkpoints.cpp \
@@ -321,6 +358,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/transactionview.cpp \
     src/qt/walletmodel.cpp \
     src/bitcoinrpc.cpp \
+    src/jsonreader.cpp \
     src/rpccrypt.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
@@ -350,6 +388,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/base58.cpp \
     src/cryptogram.cpp \
     src/ecies.cpp \
+    src/walletnotify.cpp \
     src/ipcollector.cpp
 
 RESOURCES += \
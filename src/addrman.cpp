@@ -5,8 +5,27 @@
 #include "addrman.h"
 #include "hash.h"
 
+#include <set>
+
 using namespace std;
 
+// Buckets hold at most a few dozen ids, searched in place
+static bool BucketContains(const std::vector<int>& vBucket, int nId)
+{
+    return std::find(vBucket.begin(), vBucket.end(), nId) != vBucket.end();
+}
+
+// Removes nId by moving the last id into its place
+static bool BucketErase(std::vector<int>& vBucket, int nId)
+{
+    std::vector<int>::iterator it = std::find(vBucket.begin(), vBucket.end(), nId);
+    if (it == vBucket.end())
+        return false;
+    *it = vBucket.back();
+    vBucket.pop_back();
+    return true;
+}
+
 int CAddrInfo::GetTriedBucket(const std::vector<unsigned char> &nKey) const
 {
     CDataStream ss1(SER_GETHASH, 0);
@@ -75,17 +94,45 @@ double CAddrInfo::GetChance(int64_t nNow) const
     for (int n=0; n<nAttempts; n++)
         fChance /= 1.5;
 
+    // prefer the peers that were fast and useful before
+    fChance *= GetQuality();
+
     return fChance;
 }
 
+double CAddrInfo::GetQuality() const
+{
+    double fQuality = 1.0;
+
+    // 250 ms round trip is average, faster is better
+    if (nPingUsec > 0)
+        fQuality *= 2.0 / (1.0 + nPingUsec / 250000.0);
+
+    // up to twice for sending 100 kB/s, or all the blocks
+    fQuality *= 1.0 + std::min(1.0, nBytesPerSec / 100000.0);
+    fQuality *= 1.0 + std::min(1.0, nBlocksPerHour / 60.0);
+
+    return std::max(0.25, std::min(4.0, fQuality));
+}
+
+void CAddrMan::ClearBuckets()
+{
+    vvTried.assign(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>());
+    for (BucketVector::iterator it = vvTried.begin(); it != vvTried.end(); it++)
+        it->reserve(ADDRMAN_TRIED_BUCKET_SIZE);
+    vvNew.assign(ADDRMAN_NEW_BUCKET_COUNT, std::vector<int>());
+    for (BucketVector::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+        it->reserve(ADDRMAN_NEW_BUCKET_SIZE);
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    AddrMap::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    InfoMap::iterator it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return NULL;
@@ -94,13 +141,13 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
 CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId)
 {
     int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    CAddrInfo& info = mapInfo.insert(std::make_pair(nId, CAddrInfo(addr, addrSource))).first->second;
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    info.nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &info;
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -150,13 +197,15 @@ int CAddrMan::SelectTried(int nKBucket)
 int CAddrMan::ShrinkNew(int nUBucket)
 {
     assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    std::vector<int> &vNew = vvNew[nUBucket];
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (unsigned int i = 0; i < vNew.size(); i++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
+        int nId = vNew[i];
+        InfoMap::iterator it = mapInfo.find(nId);
+        assert(it != mapInfo.end());
+        CAddrInfo &info = it->second;
         if (info.IsTerrible())
         {
             if (--info.nRefCount == 0)
@@ -164,51 +213,52 @@ int CAddrMan::ShrinkNew(int nUBucket)
                 SwapRandom(info.nRandomPos, vRandom.size()-1);
                 vRandom.pop_back();
                 mapAddr.erase(info);
-                mapInfo.erase(*it);
+                mapInfo.erase(it);
                 nNew--;
             }
-            vNew.erase(it);
+            vNew[i] = vNew.back();
+            vNew.pop_back();
             return 0;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
-    int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    int nOldestPos = -1;
+    CAddrInfo *pinfoOldest = NULL;
+    for (int n = 0; n < 4; n++)
     {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
+        int nPos = GetRandInt(vNew.size());
+        InfoMap::iterator it = mapInfo.find(vNew[nPos]);
+        assert(it != mapInfo.end());
+        if (!pinfoOldest || it->second.nTime < pinfoOldest->nTime)
         {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
+            nOldestPos = nPos;
+            pinfoOldest = &it->second;
         }
-        nI++;
     }
-    assert(mapInfo.count(nOldest) == 1);
-    CAddrInfo &info = mapInfo[nOldest];
-    if (--info.nRefCount == 0)
+    int nOldest = vNew[nOldestPos];
+    if (--pinfoOldest->nRefCount == 0)
     {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
+        SwapRandom(pinfoOldest->nRandomPos, vRandom.size()-1);
         vRandom.pop_back();
-        mapAddr.erase(info);
+        mapAddr.erase(*pinfoOldest);
         mapInfo.erase(nOldest);
         nNew--;
     }
-    vNew.erase(nOldest);
+    vNew[nOldestPos] = vNew.back();
+    vNew.pop_back();
 
     return 1;
 }
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
-    assert(vvNew[nOrigin].count(nId) == 1);
+    assert(BucketContains(vvNew[nOrigin], nId));
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (BucketVector::iterator it = vvNew.begin(); it != vvNew.end() && info.nRefCount > 0; it++)
     {
-        if ((*it).erase(nId))
+        if (BucketErase(*it, nId))
             info.nRefCount--;
     }
     nNew--;
@@ -234,7 +284,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     // find which new bucket it belongs to
     assert(mapInfo.count(vTried[nPos]) == 1);
     int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
+    std::vector<int> &vNew = vvNew[nUBucket];
 
     // remove the to-be-replaced tried entry from the tried set
     CAddrInfo& infoOld = mapInfo[vTried[nPos]];
@@ -246,10 +296,10 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
     {
         // if so, move it back there
-        vNew.insert(vTried[nPos]);
+        vNew.push_back(vTried[nPos]);
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
-        vvNew[nOrigin].insert(vTried[nPos]);
+        vvNew[nOrigin].push_back(vTried[nPos]);
     }
     nNew++;
 
@@ -292,8 +342,7 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
     for (unsigned int n = 0; n < vvNew.size(); n++)
     {
         int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
+        if (BucketContains(vvNew[nB], nId))
         {
             nUBucket = nB;
             break;
@@ -357,13 +406,13 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
-    if (!vNew.count(nId))
+    std::vector<int> &vNew = vvNew[nUBucket];
+    if (!BucketContains(vNew, nId))
     {
         pinfo->nRefCount++;
         if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        vNew.push_back(nId);
     }
     return fNew;
 }
@@ -416,14 +465,11 @@ CAddress CAddrMan::Select_(int nUnkBias)
         for ( ; ; )
         {
             int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
+            std::vector<int> &vNew = vvNew[nUBucket];
             if (vNew.size() == 0) continue;
             int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
+            assert(mapInfo.count(vNew[nPos]) == 1);
+            CAddrInfo &info = mapInfo[vNew[nPos]];
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -439,7 +485,7 @@ int CAddrMan::Check_()
 
     if (vRandom.size() != nTried + nNew) return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (InfoMap::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
     {
         int n = (*it).first;
         CAddrInfo &info = (*it).second;
@@ -475,8 +521,8 @@ int CAddrMan::Check_()
 
     for (int n=0; n<vvNew.size(); n++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        std::vector<int> &vNew = vvNew[n];
+        for (std::vector<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
         {
             if (!mapNew.count(*it)) return -12;
             if (--mapNew[*it] == 0)
@@ -509,7 +555,7 @@ void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
 
 void CAddrMan::GetOnlineAddr_(std::vector<CAddrInfo> &vAddr)
 {
-    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (InfoMap::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
     {
         CAddrInfo addr = it->second;
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < nOneDay);
@@ -537,3 +583,29 @@ void CAddrMan::Connected_(const CService &addr, int64_t nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+// Exponential moving average, a new sample weighs a quarter
+static int64_t AverageIn(int64_t nAverage, int64_t nSample)
+{
+    return nAverage == 0 ? nSample : (3 * nAverage + nSample) / 4;
+}
+
+void CAddrMan::Quality_(const CService &addr, int64_t nPingUsec, int64_t nBytesPerSec, int64_t nBlocksPerHour)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    if (nPingUsec > 0)
+        info.nPingUsec = AverageIn(info.nPingUsec, nPingUsec);
+    info.nBytesPerSec = AverageIn(info.nBytesPerSec, nBytesPerSec);
+    info.nBlocksPerHour = AverageIn(info.nBlocksPerHour, nBlocksPerHour);
+}
@@ -8,11 +8,15 @@
 #include "protocol.h"
 #include "util.h"
 #include "sync.h"
+#include "uint256map.h"
 
 
+#include <algorithm>
 #include <map>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -32,6 +36,13 @@ private:
     // connection attempts since last successful attempt
     int nAttempts;
 
+    // connection quality, averaged over the past connections (0 if unknown):
+    // round trip time in microseconds, bytes received per second and
+    // blocks delivered per hour
+    int64_t nPingUsec;
+    int64_t nBytesPerSec;
+    int64_t nBlocksPerHour;
+
     // reference count in new sets (memory only)
     int nRefCount;
 
@@ -51,6 +62,13 @@ public:
         READWRITE(source);
         READWRITE(nLastSuccess);
         READWRITE(nAttempts);
+        // nVersion is the peers.dat format here, quality came with version 1
+        if (nVersion >= 1)
+        {
+            READWRITE(nPingUsec);
+            READWRITE(nBytesPerSec);
+            READWRITE(nBlocksPerHour);
+        }
     )
 
     void Init()
@@ -58,6 +76,9 @@ public:
         nLastSuccess = 0;
         nLastTry = 0;
         nAttempts = 0;
+        nPingUsec = 0;
+        nBytesPerSec = 0;
+        nBlocksPerHour = 0;
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
@@ -91,6 +112,9 @@ public:
     // Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
 
+    // How much better than an unknown peer it served us, from 0.25 to 4
+    double GetQuality() const;
+
 };
 
 // Stochastic address manager
@@ -161,9 +185,26 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// peers.dat format version, 1 added the connection quality
+#define ADDRMAN_VERSION 1
+// room to reserve per address when serializing, a little more than it takes
+#define ADDRMAN_SERIALIZED_ENTRY_SIZE 128
+
+/** SaltedHasher for the network address index */
+class SaltedNetAddrHasher : public SaltedHasher
+{
+public:
+    size_t operator()(const CNetAddr& addr) const { return Mix(addr.GetCheapHash()); }
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
+public:
+    typedef boost::unordered_map<int, CAddrInfo> InfoMap;
+    typedef boost::unordered_map<CNetAddr, int, SaltedNetAddrHasher> AddrMap;
+    typedef std::vector<std::vector<int> > BucketVector;
+
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -175,10 +216,10 @@ private:
     int nIdCount;
 
     // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    InfoMap mapInfo;
 
     // find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    AddrMap mapAddr;
 
     // randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -187,13 +228,16 @@ private:
     int nTried;
 
     // list of "tried" buckets
-    std::vector<std::vector<int> > vvTried;
+    BucketVector vvTried;
 
     // number of (unique) "new" entries
     int nNew;
 
-    // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    // list of "new" buckets, unordered, an nId at most once in each
+    BucketVector vvNew;
+
+    // Empty buckets with room for a full one, so they never reallocate
+    void ClearBuckets();
 
 protected:
 
@@ -244,6 +288,9 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Average in the quality of a connection.
+    void Quality_(const CService &addr, int64_t nPingUsec, int64_t nBytesPerSec, int64_t nBlocksPerHour);
+
 public:
 
     typedef std::map<int, int> MapUnkIds; // For MSVC macro
@@ -251,7 +298,7 @@ public:
             (
             LOCK(cs);
                 unsigned char 
-                    nVersion = 0;
+                    nVersion = ADDRMAN_VERSION;
 
                 READWRITE(nVersion);
                 READWRITE(nKey);
@@ -270,7 +317,7 @@ public:
                     MapUnkIds mapUnkIds;
                     int
                         nIds = 0;
-                    for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                    for (InfoMap::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
                     {
                         if (nIds == nNew)
                             break; // this means nNew was wrong, oh ow
@@ -286,7 +333,7 @@ public:
                         }
                     }
                     nIds = 0;
-                    for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                    for (InfoMap::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
                     {
                         if (nIds == nTried) 
                             break; /* this means nTried was wrong, oh ow */
@@ -301,19 +348,19 @@ public:
                         }
                     }
                     for (
-                         std::vector<std::set<int> >::iterator it = am->vvNew.begin(); 
+                         BucketVector::iterator it = am->vvNew.begin(); 
                          it != am->vvNew.end(); 
                          it++
                         )
                     {
-                        std::set<int> 
+                        std::vector<int> 
                             &vNew = (*it);
 
                         int 
                             nSize = int( vNew.size() );
 
                         READWRITE(nSize);
-                        for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
+                        for (std::vector<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
                         {
                         int 
                             nIndex = mapUnkIds[*it2];
@@ -331,16 +378,7 @@ public:
                     am->mapInfo.clear();
                     am->mapAddr.clear();
                     am->vRandom.clear();
-                    am->vvTried = 
-                        std::vector<std::vector<int> >(
-                                                        ADDRMAN_TRIED_BUCKET_COUNT, 
-                                                        std::vector<int>(0)
-                                                      );
-                    am->vvNew = 
-                        std::vector<std::set<int> >(
-                                                    ADDRMAN_NEW_BUCKET_COUNT, 
-                                                    std::set<int>()
-                                                   );
+                    am->ClearBuckets();
                     for (int n = 0; n < am->nNew; n++)
                     {
                         CAddrInfo 
@@ -352,7 +390,7 @@ public:
                         am->vRandom.push_back(n);
                         if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
                         {
-                            am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
+                            am->vvNew[info.GetNewBucket(am->nKey)].push_back(n);
                             info.nRefCount++;
                         }
                     }
@@ -389,8 +427,8 @@ public:
                     am->nTried -= nLost;
                     for (int b = 0; b < nUBuckets; b++)
                     {
-                        std::set<int> 
-                            &vNew = am->vvNew[b];
+                        std::vector<int> 
+                            &vNew = am->vvNew[b % ADDRMAN_NEW_BUCKET_COUNT];
 
                         int 
                             nSize = 0;
@@ -408,11 +446,13 @@ public:
 
                             if (
                                 (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT) && 
-                                (info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                                (info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) &&
+                                (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE) &&
+                                (std::find(vNew.begin(), vNew.end(), nIndex) == vNew.end())
                                )
                             {
                                 info.nRefCount++;
-                                vNew.insert(nIndex);
+                                vNew.push_back(nIndex);
                             }
                         }
                     }
@@ -420,8 +460,10 @@ public:
             )
 
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan() : vRandom(0)
     {
+         ClearBuckets();
+
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
 
@@ -431,11 +473,25 @@ public:
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
         return (int) vRandom.size();
     }
 
+    // Estimated memory of the tables, see getmemoryinfo
+    void GetMemoryUsage(CMemoryUsage& usage) const
+    {
+        LOCK(cs);
+        usage.nEntries = vRandom.size();
+        usage.nUsage = mapInfo.size() * (sizeof(InfoMap::value_type) + MEMORY_HASH_NODE) +
+                       mapAddr.size() * (sizeof(AddrMap::value_type) + MEMORY_HASH_NODE) +
+                       vRandom.capacity() * sizeof(int);
+        for (unsigned int n = 0; n < vvTried.size(); n++)
+            usage.nUsage += sizeof(vvTried[n]) + vvTried[n].capacity() * sizeof(int);
+        for (unsigned int n = 0; n < vvNew.size(); n++)
+            usage.nUsage += sizeof(vvNew[n]) + vvNew[n].capacity() * sizeof(int);
+    }
+
     // Consistency check
     void Check()
     {
@@ -551,6 +607,17 @@ public:
             Check();
         }
     }
+
+    // Record how a connection to this address did, to favor it if it was good.
+    void Quality(const CService &addr, int64_t nPingUsec, int64_t nBytesPerSec, int64_t nBlocksPerHour)
+    {
+        {
+            LOCK(cs);
+            Check();
+            Quality_(addr, nPingUsec, nBytesPerSec, nBlocksPerHour);
+            Check();
+        }
+    }
 };
 
 #endif
@@ -16,6 +16,13 @@ using namespace std;
 map<uint256, CAlert> mapAlerts;
 CCriticalSection cs_mapAlerts;
 
+// Alerts turned down before, so copies relayed by other peers are turned
+//   down again without verifying the signature. Keyed by the hash of the
+//   message and signature together, GetHash() doesn't cover the signature
+//   and a bad signature must not shut out the genuine alert.
+static set<uint256> setRejectedAlerts;
+static const unsigned int MAX_REJECTED_ALERTS = 1000;
+
 static const char* pszMainKey = "04c97d0030cd9054e9823ed911c26b94c1633f03bf3c46f277cb5cc49d717e71d46fa33d8202c95e900f1861532a01384504432edeeb5296f9558f06c08bebab41";
 
 // TestNet alerts pubKey
@@ -168,6 +175,34 @@ CAlert CAlert::getAlertByHash(const uint256 &hash)
 }
 
 bool CAlert::ProcessAlert()
+{
+    uint256 hashSigned = SerializeHash(*this);
+    {
+        LOCK(cs_mapAlerts);
+        if (setRejectedAlerts.count(hashSigned))
+            return false;
+
+        // Same message as an accepted alert: take the verified copy
+        map<uint256, CAlert>::iterator mi = mapAlerts.find(GetHash());
+        if (mi != mapAlerts.end())
+        {
+            *this = mi->second;
+            return IsInEffect();
+        }
+    }
+
+    if (!CheckAlert())
+    {
+        LOCK(cs_mapAlerts);
+        if (setRejectedAlerts.size() >= MAX_REJECTED_ALERTS)
+            setRejectedAlerts.clear();
+        setRejectedAlerts.insert(hashSigned);
+        return false;
+    }
+    return true;
+}
+
+bool CAlert::CheckAlert()
 {
     if (!CheckSignature())
         return false;
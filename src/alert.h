@@ -90,6 +90,7 @@ public:
     bool AppliesToMe() const;
     bool RelayTo(CNode* pnode) const;
     bool CheckSignature() const;
+    bool CheckAlert();
     bool ProcessAlert();
 
     /*
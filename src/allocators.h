@@ -9,6 +9,7 @@
 #include <string>
 #include <boost/thread/mutex.hpp>
 #include <map>
+#include <new>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
 #ifdef WIN32
@@ -31,6 +32,8 @@
 #include <unistd.h> // for sysconf
 #endif
 
+#include "lockedpool.h"
+
 /**
  * Thread-safe class to keep track of locked (ie, non-swappable) memory pages.
  *
@@ -39,8 +42,8 @@
  * those functions are used naively. This class simulates stacking memory locks by keeping a counter per page.
  *
  * @note By using a map from each page base address to lock count, this class is optimized for
- * small objects that span up to a few pages, mostly smaller than a page. To support large allocations,
- * something like an interval tree would be the preferred data structure.
+ * small objects that span up to a few pages, mostly smaller than a page. It is only used for key
+ * buffers embedded in other objects (see CCrypter), secure_allocator takes its memory from LockedPool.
  */
 template <class Locker> class LockedPageManagerBase
 {
@@ -180,6 +183,9 @@ private:
 // Allocator that locks its contents from being paged
 // out of memory and clears its contents before deletion.
 //
+// Memory comes from LockedPool, whose arenas are locked once when they are
+// created, so allocations do not cost an mlock/munlock call each.
+//
 template<typename T>
 struct secure_allocator : public std::allocator<T>
 {
@@ -202,10 +208,9 @@ struct secure_allocator : public std::allocator<T>
 
     T* allocate(std::size_t n, const void *hint = 0)
     {
-        T *p;
-        p = std::allocator<T>::allocate(n, hint);
-        if (p != NULL)
-            LockedPageManager::instance.LockRange(p, sizeof(T) * n);
+        T *p = static_cast<T*>(LockedPool::Instance().Alloc(sizeof(T) * n));
+        if (p == NULL)
+            throw std::bad_alloc();
         return p;
     }
 
@@ -214,9 +219,8 @@ struct secure_allocator : public std::allocator<T>
         if (p != NULL)
         {
             OPENSSL_cleanse(p, sizeof(T) * n);
-            LockedPageManager::instance.UnlockRange(p, sizeof(T) * n);
+            LockedPool::Instance().Free(p);
         }
-        std::allocator<T>::deallocate(p, n);
     }
 };
 
@@ -224,6 +228,10 @@ struct secure_allocator : public std::allocator<T>
 //
 // Allocator that clears its contents before deletion.
 //
+// Clearing can be turned off for a container that only ever holds public
+// data. The setting travels with the container's allocator, and buffers are
+// plain heap memory either way, so any instance may free any buffer.
+//
 template<typename T>
 struct zero_after_free_allocator : public std::allocator<T>
 {
@@ -236,17 +244,18 @@ struct zero_after_free_allocator : public std::allocator<T>
     typedef typename base::reference reference;
     typedef typename base::const_reference const_reference;
     typedef typename base::value_type value_type;
-    zero_after_free_allocator() throw() {}
-    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a) {}
+    bool fZero;
+    zero_after_free_allocator(bool fZeroIn = true) throw() : fZero(fZeroIn) {}
+    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a), fZero(a.fZero) {}
     template <typename U>
-    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a) {}
+    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a), fZero(a.fZero) {}
     ~zero_after_free_allocator() throw() {}
     template<typename _Other> struct rebind
     { typedef zero_after_free_allocator<_Other> other; };
 
     void deallocate(T* p, std::size_t n)
     {
-        if (p != NULL)
+        if (p != NULL && fZero)
             OPENSSL_cleanse(p, sizeof(T) * n);
         std::allocator<T>::deallocate(p, n);
     }
@@ -13,8 +13,12 @@
 // - Double-clicking selects the whole number as one word if it's all alphanumeric.
 //
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 #include "bignum.h"
 #include "key.h"
@@ -23,44 +27,103 @@
 
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+// Digit values of base58 characters, -1 for everything else
+static const signed char mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8,-1,-1,-1,-1,-1,-1,
+    -1, 9,10,11,12,13,14,15,16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29,30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39,40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54,55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+// 58^5 is the largest power of 58 that fits 32 bits, the conversions below
+// move five digits per pass over 32-bit limbs of the number
+static const uint32_t nBase58Pow5 = 656356768;
+
+// Numbers up to this many limbs are converted in buffers on the stack, which
+// covers every address, key and key view; longer data goes to the heap
+static const size_t BASE58_STACK_LIMBS = 32;
+
 // Encode a byte sequence as a base58-encoded string
 std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
-    CAutoBN_CTX pctx;
-    CBigNum bn58 = 58;
-    CBigNum bn0 = 0;
-
-    // Convert big endian data to little endian
-    // Extra zero at the end make sure bignum will interpret as a positive number
-    std::vector<unsigned char> vchTmp(pend-pbegin+1, 0);
-    reverse_copy(pbegin, pend, vchTmp.begin());
-
-    // Convert little endian data to bignum
-    CBigNum bn;
-    bn.setvch(vchTmp);
-
-    // Convert bignum to std::string
-    std::string str;
-    // Expected size increase from base58 conversion is approximately 137%
-    // use 138% to be safe
-    str.reserve((pend - pbegin) * 138 / 100 + 1);
-    CBigNum dv;
-    CBigNum rem;
-    while (bn > bn0)
+    // Leading zeroes encoded as base58 zeros
+    size_t nZeros = 0;
+    while (pbegin < pend && *pbegin == 0)
     {
-        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
-            throw bignum_error("EncodeBase58 : BN_div failed");
-        bn = dv;
-        unsigned int c = rem.getuint32();
-        str += pszBase58[c];
+        pbegin++;
+        nZeros++;
     }
 
-    // Leading zeroes encoded as base58 zeros
-    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
-        str += pszBase58[0];
+    // Big endian limbs, the first one takes what doesn't divide into four bytes
+    size_t nSize = pend - pbegin;
+    size_t nLimbs = (nSize + 3) / 4;
+    // Expected size increase from base58 conversion is approximately 137%,
+    // use 138% and leave room for the zeros of the last five digits
+    size_t nMaxDigits = nSize * 138 / 100 + 6;
+
+    uint32_t pnStack[BASE58_STACK_LIMBS];
+    unsigned char pchStack[BASE58_STACK_LIMBS * 4 * 138 / 100 + 6];
+    std::vector<uint32_t> vnHeap;
+    std::vector<unsigned char> vchHeap;
+    uint32_t* pn = pnStack;
+    unsigned char* pch = pchStack;
+    if (nLimbs > BASE58_STACK_LIMBS)
+    {
+        vnHeap.resize(nLimbs);
+        vchHeap.resize(nMaxDigits);
+        pn = &vnHeap[0];
+        pch = &vchHeap[0];
+    }
+
+    for (size_t i = 0, nByte = (nSize + 3) % 4 + 1; i < nLimbs; i++, nByte = 4)
+    {
+        uint32_t n = 0;
+        for (size_t j = 0; j < nByte; j++)
+            n = (n << 8) | *pbegin++;
+        pn[i] = n;
+    }
+
+    // Digits come out least significant first
+    size_t nDigits = 0;
+    size_t nStart = 0;
+    while (nStart < nLimbs)
+    {
+        uint64_t nRem = 0;
+        for (size_t i = nStart; i < nLimbs; i++)
+        {
+            uint64_t nCur = (nRem << 32) | pn[i];
+            pn[i] = (uint32_t)(nCur / nBase58Pow5);
+            nRem = nCur % nBase58Pow5;
+        }
+        while (nStart < nLimbs && pn[nStart] == 0)
+            nStart++;
+        for (int j = 0; j < 5; j++)
+        {
+            pch[nDigits++] = nRem % 58;
+            nRem /= 58;
+        }
+    }
+    while (nDigits > 0 && pch[nDigits - 1] == 0)
+        nDigits--;
 
-    // Convert little endian std::string to big endian
-    reverse(str.begin(), str.end());
+    std::string str(nZeros + nDigits, pszBase58[0]);
+    for (size_t i = 0; i < nDigits; i++)
+        str[nZeros + i] = pszBase58[pch[nDigits - 1 - i]];
+
+    // The data may be a secret key
+    OPENSSL_cleanse(pch, nMaxDigits);
     return str;
 }
 
@@ -74,47 +137,70 @@ std::string EncodeBase58(const std::vector<unsigned char>& vch)
 // returns true if decoding is successful
 bool DecodeBase58(const char* psz, std::vector<unsigned char>& vchRet)
 {
-    CAutoBN_CTX pctx;
     vchRet.clear();
-    CBigNum bn58 = 58;
-    CBigNum bn = 0;
-    CBigNum bnChar;
     while (isspace(*psz))
         psz++;
 
-    // Convert big endian string to bignum
-    for (const char* p = psz; *p; p++)
+    // Restore leading zeros
+    size_t nZeros = 0;
+    while (*psz == pszBase58[0])
     {
-        const char* p1 = strchr(pszBase58, *p);
-        if (p1 == NULL)
-        {
-            while (isspace(*p))
-                p++;
-            if (*p != '\0')
-                return false;
-            break;
-        }
-        bnChar.setuint32((uint32_t)(p1 - pszBase58));
-        if (!BN_mul(&bn, &bn, &bn58, pctx))
-            throw bignum_error("DecodeBase58 : BN_mul failed");
-        bn += bnChar;
+        psz++;
+        nZeros++;
     }
 
-    // Get bignum as little endian data
-    std::vector<unsigned char> vchTmp = bn.getvch();
+    // Only whitespace may follow the digits
+    const char* pend = psz;
+    while (mapBase58[(unsigned char)*pend] != -1)
+        pend++;
+    for (const char* p = pend; *p; p++)
+        if (!isspace(*p))
+            return false;
 
-    // Trim off sign byte if present
-    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
-        vchTmp.erase(vchTmp.end()-1);
+    // Little endian limbs, 58^n is a bit below 2^(5.86n)
+    size_t nDigits = pend - psz;
+    size_t nMaxLimbs = nDigits * 733 / 1000 / 4 + 2;
 
-    // Restore leading zeros
-    int nLeadingZeros = 0;
-    for (const char* p = psz; *p == pszBase58[0]; p++)
-        nLeadingZeros++;
-    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+    uint32_t pnStack[BASE58_STACK_LIMBS];
+    std::vector<uint32_t> vnHeap;
+    uint32_t* pn = pnStack;
+    if (nMaxLimbs > BASE58_STACK_LIMBS)
+    {
+        vnHeap.resize(nMaxLimbs);
+        pn = &vnHeap[0];
+    }
 
-    // Convert little endian data to big endian
-    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    // Convert big endian string to limbs, five digits at a time
+    size_t nLimbs = 0;
+    for (const char* p = psz; p < pend; )
+    {
+        uint32_t nMul = 1;
+        uint64_t nCarry = 0;
+        for (int j = 0; j < 5 && p < pend; j++, p++)
+        {
+            nMul *= 58;
+            nCarry = nCarry * 58 + mapBase58[(unsigned char)*p];
+        }
+        for (size_t i = 0; i < nLimbs; i++)
+        {
+            nCarry += (uint64_t)pn[i] * nMul;
+            pn[i] = (uint32_t)nCarry;
+            nCarry >>= 32;
+        }
+        if (nCarry)
+            pn[nLimbs++] = (uint32_t)nCarry;
+    }
+
+    // Big endian data without leading zeros of the number
+    size_t nBytes = nLimbs * 4;
+    while (nBytes > 0 && (pn[(nBytes - 1) / 4] >> (8 * ((nBytes - 1) % 4)) & 0xff) == 0)
+        nBytes--;
+    vchRet.assign(nZeros + nBytes, 0);
+    for (size_t i = 0; i < nBytes; i++)
+        vchRet[vchRet.size() - 1 - i] = pn[i / 4] >> (8 * (i % 4));
+
+    // The data may be a secret key
+    OPENSSL_cleanse(pn, nLimbs * sizeof(uint32_t));
     return true;
 }
 
@@ -233,6 +319,71 @@ bool DecodeBase58Check(const std::string& str, std::vector<unsigned char>& vchRe
         return 0;
     }
 
+    // Wallet views list the same addresses over and over, so the string forms
+    //   of the ones that are hashes are kept, oldest dropped first. Secrets
+    //   and pubkey pairs never get here.
+    class CAddressStringCache
+    {
+    private:
+        typedef std::pair<unsigned char, uint160> key_type;
+        static const size_t nMaxEntries = 8192;
+
+        boost::mutex cs;
+        std::map<key_type, std::string> mapStrings;
+        std::deque<key_type> vOrder;
+
+    public:
+        bool Get(const key_type& key, std::string& str)
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            std::map<key_type, std::string>::const_iterator it = mapStrings.find(key);
+            if (it == mapStrings.end())
+                return false;
+            str = it->second;
+            return true;
+        }
+
+        void Add(const key_type& key, const std::string& str)
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            if (!mapStrings.insert(std::make_pair(key, str)).second)
+                return;
+            vOrder.push_back(key);
+            if (vOrder.size() > nMaxEntries)
+            {
+                mapStrings.erase(vOrder.front());
+                vOrder.pop_front();
+            }
+        }
+    };
+
+    static CAddressStringCache addressStringCache;
+
+    std::string CBitcoinAddress::ToString() const
+    {
+        switch (nVersion)
+        {
+            case PUBKEY_ADDRESS:
+            case SCRIPT_ADDRESS:
+            case PUBKEY_ADDRESS_TEST:
+            case SCRIPT_ADDRESS_TEST:
+                break;
+            default:
+                return CBase58Data::ToString();
+        }
+        if (vchData.size() != 20)
+            return CBase58Data::ToString();
+
+        std::pair<unsigned char, uint160> key(nVersion, uint160(vchData));
+        std::string str;
+        if (!addressStringCache.Get(key, str))
+        {
+            str = CBase58Data::ToString();
+            addressStringCache.Add(key, str);
+        }
+        return str;
+    }
+
     bool CBitcoinAddress::Set(const CKeyID &id) {
         SetData(fTestNet ? PUBKEY_ADDRESS_TEST : PUBKEY_ADDRESS, &id, 20);
         return true;
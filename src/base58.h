@@ -142,6 +142,10 @@ public:
         SetString(pszAddress);
     }
 
+    // Same as CBase58Data::ToString, but key and script hash addresses are
+    //   encoded once and then served from a cache
+    std::string ToString() const;
+
     CTxDestination Get() const;
     bool GetKeyID(CKeyID &keyID) const;
     bool IsScript() const;
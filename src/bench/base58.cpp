@@ -0,0 +1,43 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "base58.h"
+
+#include <vector>
+
+// 32 bytes, the size of a hash or a private key
+static std::vector<unsigned char> FixedData()
+{
+    std::vector<unsigned char> vch(32);
+    for (int i = 0; i < 32; i++)
+        vch[i] = (unsigned char)(i * 17 + 3);
+    return vch;
+}
+
+static void Base58Encode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch = FixedData();
+    while (state.KeepRunning())
+        EncodeBase58(vch);
+}
+
+static void Base58CheckEncode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch = FixedData();
+    while (state.KeepRunning())
+        EncodeBase58Check(vch);
+}
+
+static void Base58Decode(benchmark::State& state)
+{
+    std::string str = EncodeBase58(FixedData());
+    std::vector<unsigned char> vch;
+    while (state.KeepRunning())
+        DecodeBase58(str, vch);
+}
+
+BENCHMARK(Base58Encode);
+BENCHMARK(Base58CheckEncode);
+BENCHMARK(Base58Decode);
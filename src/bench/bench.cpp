@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "util.h"
+
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+namespace benchmark {
+
+State::State(const string& strNameIn, int64_t nMaxElapsedIn) :
+    strName(strNameIn), nMaxElapsed(nMaxElapsedIn), nBeginTime(0), nLastTime(0),
+    dMinTime(numeric_limits<double>::max()), dMaxTime(0), nCount(0), nCountMask(0)
+{
+}
+
+bool State::KeepRunning()
+{
+    if (nCount & nCountMask)
+    {
+        ++nCount;
+        return true;
+    }
+
+    int64_t nNow = GetTimeMicros();
+    if (nCount == 0)
+        nBeginTime = nNow;
+    else
+    {
+        int64_t nElapsed = nNow - nLastTime;
+        double dElapsedOne = (double)nElapsed / (nCountMask + 1);
+        if (dElapsedOne < dMinTime)
+            dMinTime = dElapsedOne;
+        if (dElapsedOne > dMaxTime)
+            dMaxTime = dElapsedOne;
+
+        if (nElapsed * 128 < nMaxElapsed)
+        {
+            // Far too fast to time with the clock's resolution: read the clock
+            // 8x less often and start over, so the restart is not measured
+            nCountMask = ((nCountMask << 3) | 7) & ((1ULL << 60) - 1);
+            nCount = 0;
+            dMinTime = numeric_limits<double>::max();
+            dMaxTime = 0;
+            return true;
+        }
+        if (nElapsed * 16 < nMaxElapsed)
+        {
+            uint64_t nNewCountMask = ((nCountMask << 1) | 1) & ((1ULL << 60) - 1);
+            if ((nCount & nNewCountMask) == 0)
+                nCountMask = nNewCountMask;
+        }
+    }
+    nLastTime = nNow;
+    ++nCount;
+
+    if (nNow - nBeginTime < nMaxElapsed)
+        return true;
+    --nCount;
+
+    // Times in nanoseconds per iteration
+    double dAverage = (double)(nNow - nBeginTime) / nCount;
+    cout << strName << "," << nCount << fixed << setprecision(1)
+         << "," << dMinTime * 1000 << "," << dMaxTime * 1000 << "," << dAverage * 1000 << endl;
+    return false;
+}
+
+BenchRunner::BenchmarkMap& BenchRunner::Benchmarks()
+{
+    // Not a plain static member, BENCHMARK() runs from static initializers
+    static BenchmarkMap benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const string& strName, BenchFunction func)
+{
+    Benchmarks().insert(make_pair(strName, func));
+}
+
+void BenchRunner::RunAll(const string& strFilter, int64_t nMaxElapsed)
+{
+    cout << "# Benchmark,iterations,min (ns),max (ns),average (ns)" << endl;
+    for (BenchmarkMap::iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == string::npos)
+            continue;
+        State state(it->first, nMaxElapsed);
+        it->second(state);
+    }
+}
+
+}
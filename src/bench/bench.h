@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/* Micro-benchmarks of the hot code paths, run by bench_42.
+ *
+ * A benchmark does its setup, then repeats the code to time as long as
+ * KeepRunning() says so:
+ *
+ * static void CodeToTime(benchmark::State& state)
+ * {
+ *     ... setup ...
+ *     while (state.KeepRunning())
+ *     {
+ *         ... code to time ...
+ *     }
+ * }
+ * BENCHMARK(CodeToTime);
+ *
+ * The inputs must not depend on the clock or on random numbers, so that
+ * the results of two builds on the same machine can be compared.
+ */
+namespace benchmark {
+
+class State
+{
+public:
+    State(const std::string& strNameIn, int64_t nMaxElapsedIn);
+
+    bool KeepRunning();
+
+private:
+    std::string strName;
+    int64_t nMaxElapsed; // microseconds
+    int64_t nBeginTime;
+    int64_t nLastTime;
+    double dMinTime; // per iteration, microseconds
+    double dMaxTime;
+    uint64_t nCount;
+    // The clock is read every nCountMask + 1 iterations
+    uint64_t nCountMask;
+};
+
+typedef boost::function<void(State&)> BenchFunction;
+
+class BenchRunner
+{
+public:
+    BenchRunner(const std::string& strName, BenchFunction func);
+
+    // Run the benchmarks with strFilter in their name, each for about
+    // nMaxElapsed microseconds, and print one CSV line per benchmark
+    static void RunAll(const std::string& strFilter, int64_t nMaxElapsed);
+
+private:
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& Benchmarks();
+};
+
+}
+
+// BENCHMARK(foo) registers foo under the name "foo"
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif
@@ -0,0 +1,65 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "db.h"
+#include "scrypt.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <iostream>
+#include <limits>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+extern void noui_connect();
+extern int ReplayBlocks(const boost::filesystem::path& pathSource, int nFrom, int nTo);
+extern int SimulateStaking(unsigned int nInputs);
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        cout << "Usage: bench_42 [-filter=<substring>] [-time=<milliseconds>]\n"
+                "       bench_42 -replay=<datadir> [-from=<height>] [-to=<height>] [-par=<n>] [-dbcache=<n>]\n"
+                "       bench_42 -stakesim=<inputs> [-bits=<hex>] [-interval=<seconds>] [-passes=<n>] [-stakethreads=<n>]\n\n"
+                "Runs the micro-benchmarks with <substring> in their name, each for\n"
+                "about <milliseconds> (default: 1000), and prints the results as CSV.\n\n"
+                "With -replay, connects the blocks of the block files of <datadir> to a\n"
+                "new chain and times the blocks from -from (default: 1) to -to (default:\n"
+                "all). -replayscripts=0 skips the scripts below the last checkpoint,\n"
+                "as the node does.\n\n"
+                "With -stakesim, fills the stake miner's map with <inputs> synthetic\n"
+                "outputs and scans it -passes times (default: 10) over -interval\n"
+                "seconds (default: 60) against -bits (default: 1c00ffff).\n\n"
+                "The scratch data directory is created in -scratchdir (default: the\n"
+                "temporary directory) and removed when done.\n";
+        return 0;
+    }
+
+    // The database benchmarks, and debug.log, go to a fresh data directory
+    boost::filesystem::path pathScratch = mapArgs.count("-scratchdir") ? boost::filesystem::path(mapArgs["-scratchdir"]) : boost::filesystem::temp_directory_path();
+    boost::filesystem::path pathTemp = pathScratch / boost::filesystem::unique_path("bench_42_%%%%-%%%%-%%%%");
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    noui_connect();
+
+    // Results of different builds are only comparable with the same backends
+    cout << "# scrypt: " << scrypt_blockhash_impl() << ", sha256 kernel: " << sha256_kernel_impl() << endl;
+
+    int nRet = 0;
+    if (mapArgs.count("-replay"))
+        nRet = ReplayBlocks(mapArgs["-replay"], GetArgInt("-from", 1), GetArgInt("-to", std::numeric_limits<int>::max()));
+    else if (mapArgs.count("-stakesim"))
+        nRet = SimulateStaking(GetArgInt("-stakesim", 0) > 0 ? GetArgInt("-stakesim", 0) : 10000);
+    else
+        benchmark::BenchRunner::RunAll(GetArg("-filter", ""), GetArg("-time", 1000) * 1000);
+
+    bitdb.Flush(true);
+    boost::filesystem::remove_all(pathTemp);
+    return nRet;
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "util.h"
+#include "kernel_worker.h"
+#include "scrypt.h"
+
+#include <string.h>
+
+// Block header sized input, the nonce is changed between hashes
+static void FillHeader(uint8_t *header, uint8_t nSeed)
+{
+    for (int i = 0; i < 80; i++)
+        header[i] = (uint8_t)(i * 7 + nSeed);
+}
+
+// One header hashed with the backend chosen at build time
+static void ScryptBlockHash(benchmark::State& state)
+{
+    uint8_t header[80];
+    FillHeader(header, 0);
+    uint32_t nNonce = 0;
+    while (state.KeepRunning())
+    {
+        memcpy(&header[76], &nNonce, 4);
+        scrypt_blockhash(header);
+        nNonce++;
+    }
+}
+
+// Eight headers at once over the lanes of the core selected at runtime
+static void ScryptBlockHashBatch8(benchmark::State& state)
+{
+    uint8_t headers[8][80];
+    const uint8_t *pinputs[8];
+    uint256 hashes[8];
+    for (int i = 0; i < 8; i++)
+    {
+        FillHeader(headers[i], i);
+        pinputs[i] = headers[i];
+    }
+    uint32_t nNonce = 0;
+    while (state.KeepRunning())
+    {
+        for (int i = 0; i < 8; i++)
+            memcpy(&headers[i][76], &nNonce, 4);
+        scrypt_blockhash_n(pinputs, hashes, 8);
+        nNonce++;
+    }
+}
+
+// The kernel of a 1000 coin input, 90 days old, against a target it
+// practically never meets, so every timestamp of the interval is hashed
+static const uint32_t KERNEL_BITS = 0x1c00ffff;
+static const int64_t KERNEL_VALUE = 1000 * COIN;
+static const uint32_t KERNEL_TIME = 1500000000;
+static const uint32_t KERNEL_INPUT_TIME = KERNEL_TIME - 90 * 24 * 60 * 60;
+static const uint32_t KERNEL_INTERVAL = 4096;
+
+static void FillKernel(unsigned char *kernel)
+{
+    for (int i = 0; i < 28; i++)
+        kernel[i] = (unsigned char)(i * 13 + 5);
+}
+
+// Forward scan of 4096 timestamps, as done by the kernel search threads
+static void KernelWorkerDo(benchmark::State& state)
+{
+    unsigned char kernel[28];
+    FillKernel(kernel);
+    while (state.KeepRunning())
+    {
+        KernelWorker worker(kernel, KERNEL_BITS, KERNEL_INPUT_TIME, KERNEL_VALUE, KERNEL_TIME, KERNEL_TIME + KERNEL_INTERVAL);
+        worker.Do();
+    }
+}
+
+// Backward scan of 4096 timestamps, as done by the minter
+static void ScanKernelBackward4096(benchmark::State& state)
+{
+    unsigned char kernel[28];
+    FillKernel(kernel);
+    std::pair<uint256, uint32_t> solution;
+    while (state.KeepRunning())
+    {
+        std::pair<uint32_t, uint32_t> interval(KERNEL_TIME + KERNEL_INTERVAL, KERNEL_TIME);
+        ScanKernelBackward(kernel, KERNEL_BITS, KERNEL_INPUT_TIME, KERNEL_VALUE, interval, solution);
+    }
+}
+
+BENCHMARK(ScryptBlockHash);
+BENCHMARK(ScryptBlockHashBatch8);
+BENCHMARK(KernelWorkerDo);
+BENCHMARK(ScanKernelBackward4096);
@@ -0,0 +1,117 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "util.h"
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+// Reads the blocks of blk0001.dat, blk0002.dat... of another data directory
+//   and feeds them to ProcessBlock until the best chain reaches nTo. Blocks
+//   above nFrom are timed, the ones below only bring the chain there.
+int ReplayBlocks(const boost::filesystem::path& pathSource, int nFrom, int nTo)
+{
+    // -par as the node sizes it, with the submitting thread as one of the workers
+    nScriptCheckThreads = GetArgInt("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads = boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    for (int n = 0; n < nScriptCheckThreads - 1; n++)
+    {
+        NewThread(ThreadScriptCheck, NULL);
+        NewThread(ThreadBlockCheck, NULL);
+    }
+
+    // Below the last checkpoint the node skips the scripts, which would leave
+    //   nothing for -par to do
+    fCheckpointScripts = GetBoolArg("-replayscripts", true);
+
+    if (!LoadBlockIndex())
+    {
+        cerr << "Error: failed to create the scratch block index" << endl;
+        return 1;
+    }
+
+    cout << "# replay of blocks " << nFrom << "-" << nTo << " from " << pathSource.string()
+         << ", script threads: " << nScriptCheckThreads << ", dbcache: " << GetArgInt("-dbcache", 25) << " MB"
+         << ", scripts below checkpoints: " << (fCheckpointScripts ? "verified" : "skipped") << endl;
+
+    bool fTiming = false;
+    int nStartHeight = 0;
+    int64_t nStartTime = 0;
+    int64_t nTransactions = 0;
+    CConnectStats statsStart;
+    for (unsigned int nFile = 1; nBestHeight < nTo && !fRequestShutdown; nFile++)
+    {
+        boost::filesystem::path pathFile = pathSource / strprintf("blk%04u.dat", nFile);
+        FILE* file = fopen(pathFile.string().c_str(), "rb");
+        if (!file)
+            break;
+        CAutoFile blkdat(file, SER_DISK, CLIENT_VERSION);
+        while (nBestHeight < nTo && !fRequestShutdown)
+        {
+            unsigned char pchMagic[4];
+            unsigned int nSize;
+            CBlock block;
+            try {
+                blkdat >> FLATDATA(pchMagic) >> nSize;
+                // The space preallocated at the end of the last file is zeroes
+                if (memcmp(pchMagic, pchMessageStart, sizeof(pchMagic)) != 0 || nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                    break;
+                blkdat >> block;
+            }
+            catch (const std::exception&) {
+                break;
+            }
+
+            if (!fTiming && nBestHeight >= nFrom - 1)
+            {
+                fTiming = true;
+                nStartHeight = nBestHeight;
+                statsStart = connectStats;
+                nStartTime = GetTimeMicros();
+            }
+
+            LOCK(cs_main);
+            int nHeightBefore = nBestHeight;
+            ProcessBlock(NULL, &block);
+            if (fTiming && nBestHeight > nHeightBefore)
+                nTransactions += block.vtx.size();
+        }
+    }
+    int64_t nElapsed = fTiming ? GetTimeMicros() - nStartTime : 0;
+    ThreadScriptCheckQuit();
+
+    if (!fTiming || nBestHeight <= nStartHeight)
+    {
+        cerr << "Error: the source block files end at height " << nBestHeight << endl;
+        return 1;
+    }
+
+    // Transactions of orphans connected later are counted with the block that
+    //   connected them, close enough for the throughput
+    int nBlocks = nBestHeight - nStartHeight;
+    int64_t nInputs = connectStats.nScriptInputs - statsStart.nScriptInputs;
+    int64_t nFetch = connectStats.nFetchInputs - statsStart.nFetchInputs;
+    int64_t nScripts = connectStats.nScriptChecks - statsStart.nScriptChecks;
+    int64_t nCommit = connectStats.nTxDBCommit - statsStart.nTxDBCommit;
+    int64_t nSetBest = connectStats.nSetBestChain - statsStart.nSetBestChain;
+    double dSeconds = nElapsed * 0.000001;
+
+    cout << "# blocks,transactions,script inputs,seconds,blocks/s,transactions/s,script inputs/s,"
+            "FetchInputs (s),script checks (s),txdb commit (s),rest of SetBestChain (s),outside SetBestChain (s)" << endl;
+    cout << nBlocks << "," << nTransactions << "," << nInputs << fixed << setprecision(3)
+         << "," << dSeconds << "," << nBlocks / dSeconds << "," << nTransactions / dSeconds << "," << nInputs / dSeconds
+         << "," << nFetch * 0.000001 << "," << nScripts * 0.000001 << "," << nCommit * 0.000001
+         << "," << (nSetBest - nFetch - nScripts - nCommit) * 0.000001 << "," << (nElapsed - nSetBest) * 0.000001 << endl;
+    return 0;
+}
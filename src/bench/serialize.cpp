@@ -0,0 +1,90 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "script.h"
+
+// Two inputs with signature sized scripts, two pay-to-pubkey-hash outputs
+static CTransaction MakeTransaction(int n)
+{
+    CTransaction tx;
+    tx.nTime = 1500000000 + n;
+    for (int i = 0; i < 2; i++)
+    {
+        CTxIn txin(COutPoint(uint256((uint64_t)n * 2 + i + 1), i));
+        txin.scriptSig << std::vector<unsigned char>(72, (unsigned char)n) << std::vector<unsigned char>(33, (unsigned char)i);
+        tx.vin.push_back(txin);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(CKeyID(uint160((uint64_t)n * 2 + i)));
+        tx.vout.push_back(CTxOut((n + 1) * COIN, scriptPubKey));
+    }
+    return tx;
+}
+
+// A block of 1000 such transactions, about 400 kB
+static CBlock MakeBlock()
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.nTime = 1500000000;
+    block.nBits = 0x1c00ffff;
+    for (int i = 0; i < 1000; i++)
+        block.vtx.push_back(MakeTransaction(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.vchBlockSig.assign(72, 0x30);
+    return block;
+}
+
+static void SerializeTransaction(benchmark::State& state)
+{
+    CTransaction tx = MakeTransaction(0);
+    while (state.KeepRunning())
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+    }
+}
+
+static void DeserializeTransaction(benchmark::State& state)
+{
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << MakeTransaction(0);
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssTx);
+        CTransaction tx;
+        ss >> tx;
+    }
+}
+
+static void SerializeBlock(benchmark::State& state)
+{
+    CBlock block = MakeBlock();
+    while (state.KeepRunning())
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+    }
+}
+
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeBlock();
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssBlock);
+        CBlock block;
+        ss >> block;
+    }
+}
+
+BENCHMARK(SerializeTransaction);
+BENCHMARK(DeserializeTransaction);
+BENCHMARK(SerializeBlock);
+BENCHMARK(DeserializeBlock);
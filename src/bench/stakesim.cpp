@@ -0,0 +1,55 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "miner.h"
+#include "util.h"
+
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+
+// Times the stake miner over a synthetic wallet of nInputs outputs: how long
+//   filling the inputs map takes and how much memory it holds, and whether a
+//   scan pass keeps up with the time it covers
+int SimulateStaking(unsigned int nInputs)
+{
+    // -stakethreads as the node sizes it, with the miner as one of the workers
+    nStakeScanThreads = GetArgInt("-stakethreads", 1);
+    if (nStakeScanThreads <= 0)
+        nStakeScanThreads = boost::thread::hardware_concurrency();
+    if (nStakeScanThreads <= 1)
+        nStakeScanThreads = 0;
+    else if (nStakeScanThreads > MAX_STAKESCAN_THREADS)
+        nStakeScanThreads = MAX_STAKESCAN_THREADS;
+    for (int n = 0; n < nStakeScanThreads - 1; n++)
+        NewThread(ThreadStakeScan, NULL);
+
+    uint32_t nBits = strtoul(GetArg("-bits", "1c00ffff").c_str(), NULL, 16);
+    uint32_t nInterval = GetArgInt("-interval", 60);
+    unsigned int nPasses = GetArgInt("-passes", 10);
+
+    cout << "# stake miner over " << nInputs << " inputs, bits " << strprintf("%08x", nBits)
+         << ", " << nPasses << " passes of " << nInterval << " s, scanning threads: " << nStakeScanThreads << endl;
+
+    CStakeSimResult result;
+    bool fOk = SimulateStakeMiner(nInputs, nBits, nInterval, nPasses, result);
+    ThreadStakeScanQuit();
+    if (!fOk || result.nPasses == 0)
+    {
+        cerr << "Error: stake miner simulation failed" << endl;
+        return 1;
+    }
+
+    // A pass has to be done well within the seconds it covers, or the miner
+    //   falls behind and skips timestamps
+    double dAveragePass = result.nScanTime * 0.000001 / result.nPasses;
+    cout << "# inputs,fill (ms),map memory (kB),seconds per pass,average pass (s),longest pass (s),"
+            "pass time / seconds covered,kernels/s,solutions" << endl;
+    cout << nInputs << fixed << setprecision(3) << "," << result.nFillTime * 0.001 << "," << result.nMapMemory / 1024
+         << "," << result.nIntervalCovered << "," << dAveragePass << "," << result.nMaxPassTime * 0.000001
+         << "," << dAveragePass / result.nIntervalCovered << "," << setprecision(0) << result.nHashes / (result.nScanTime * 0.000001)
+         << "," << result.nSolutions << endl;
+    return 0;
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "main.h"
+#include "txdb.h"
+
+// Transaction index lookups in a fresh database of 10000 entries, at
+// positions from a fixed linear congruential sequence
+static const unsigned int TXDB_ENTRIES = 10000;
+
+static uint256 EntryHash(unsigned int n)
+{
+    uint256 hash((uint64_t)n + 1);
+    hash ^= uint256((uint64_t)n * 0x9e3779b97f4a7c15ULL) << 128;
+    return hash;
+}
+
+static void TxDBReadTxIndex(benchmark::State& state)
+{
+    CTxDB txdb("cr+");
+    txdb.TxnBegin();
+    for (unsigned int i = 0; i < TXDB_ENTRIES; i++)
+        txdb.UpdateTxIndex(EntryHash(i), CTxIndex(CDiskTxPos(1, i, i), 2));
+    txdb.TxnCommit();
+
+    uint32_t nRand = 1;
+    CTxIndex txindex;
+    while (state.KeepRunning())
+    {
+        nRand = nRand * 1103515245 + 12345;
+        txdb.ReadTxIndex(EntryHash(nRand % TXDB_ENTRIES), txindex);
+    }
+    txdb.Close();
+}
+
+BENCHMARK(TxDBReadTxIndex);
@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+static CKey FixedKey()
+{
+    CSecret vchSecret(32);
+    for (int i = 0; i < 32; i++)
+        vchSecret[i] = (unsigned char)(i + 1);
+    CKey key;
+    key.SetSecret(vchSecret, true);
+    return key;
+}
+
+// Spends nInputs outputs paying to scriptPubKey, to two outputs
+static CTransaction MakeSpend(const CScript& scriptPubKey, int nInputs)
+{
+    CTransaction tx;
+    tx.nTime = 1500000000;
+    for (int i = 0; i < nInputs; i++)
+        tx.vin.push_back(CTxIn(COutPoint(uint256((uint64_t)i + 1), i)));
+    tx.vout.push_back(CTxOut(50 * COIN, scriptPubKey));
+    tx.vout.push_back(CTxOut(25 * COIN, scriptPubKey));
+    return tx;
+}
+
+// Signature hash of the first of ten inputs
+static void SignatureHashAll(benchmark::State& state)
+{
+    CKey key = FixedKey();
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction tx = MakeSpend(scriptPubKey, 10);
+    while (state.KeepRunning())
+        SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL);
+}
+
+// Pay-to-pubkey-hash input through the script interpreter and CheckSig.
+// NOCACHE keeps the result out of the signature cache, so every round
+// verifies the signature again.
+static void VerifyScriptP2PKH(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    CKey key = FixedKey();
+    keystore.AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction tx = MakeSpend(scriptPubKey, 1);
+    if (!SignSignature(keystore, scriptPubKey, tx, 0))
+        return;
+    while (state.KeepRunning())
+        VerifyScript(tx.vin[0].scriptSig, scriptPubKey, tx, 0, STRICT_FLAGS | SCRIPT_VERIFY_NOCACHE, 0);
+}
+
+// Bare ECDSA verification
+static void PubKeyVerify(benchmark::State& state)
+{
+    CKey key = FixedKey();
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = pubkey.GetHash();
+    std::vector<unsigned char> vchSig;
+    if (!key.Sign(hash, vchSig))
+        return;
+    while (state.KeepRunning())
+        pubkey.Verify(hash, vchSig);
+}
+
+BENCHMARK(SignatureHashAll);
+BENCHMARK(VerifyScriptP2PKH);
+BENCHMARK(PubKeyVerify);
@@ -9,7 +9,10 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "jsonreader.h"
 #include "db.h"
+#include "metrics.h"
+#include "miner.h"
 
 #undef printf
 #include <boost/asio.hpp>
@@ -23,6 +26,7 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <deque>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -38,7 +42,7 @@ static std::string strRPCUserColonPass;
 
 const Object emptyobj;
 
-void ThreadRPCServer3(void* parg);
+void ThreadRPCWorker(void* parg);
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -109,6 +113,44 @@ Value ValueFromAmount(int64_t amount)
     return (double)amount / (double)COIN;
 }
 
+// Can't be the name of a member of anything a handler returns otherwise
+static const std::string strRawJSONKey("\0rawjson", 8);
+
+Value RawJSON(const CJSONWriter& writer)
+{
+    Object obj;
+    obj.push_back(Pair(strRawJSONKey, writer.str()));
+    return obj;
+}
+
+bool IsRawJSON(const Value& value)
+{
+    return value.type() == obj_type && value.get_obj().size() == 1 &&
+           value.get_obj()[0].name_ == strRawJSONKey;
+}
+
+string WriteRPCValue(const Value& value, bool fPretty)
+{
+    if (!IsRawJSON(value))
+        return write_string(value, fPretty);
+
+    const string& strJSON = value.get_obj()[0].value_.get_str();
+    if (!fPretty)
+        return strJSON;
+    Value valParsed;
+    ReadJSON(strJSON, valParsed);
+    return write_string(valParsed, true);
+}
+
+void AppendJSON(Object& obj, const CJSONWriter& writer)
+{
+    Value valParsed;
+    if (!ReadJSON(writer.str(), valParsed) || valParsed.type() != obj_type)
+        throw runtime_error("AppendJSON() : not an object");
+    BOOST_FOREACH(const Pair& pair, valParsed.get_obj())
+        obj.push_back(pair);
+}
+
 std::string HexBits(unsigned int nBits)
 {
     union {
@@ -226,32 +268,392 @@ Value stop(const Array& params, bool fHelp)
     return "42 server stopping";
 }
 
+static void NoRPCWalletCleanup(CWallet*) { }
+static boost::thread_specific_ptr<CWallet> ptrRPCWallet(NoRPCWalletCleanup);
+
+CWallet* GetRPCWallet()
+{
+    CWallet* pwallet = ptrRPCWallet.get();
+    return pwallet ? pwallet : pwalletMain;
+}
+
+// Makes the wallet of a call the one GetRPCWallet returns while it runs
+class CRPCWalletScope
+{
+private:
+    CWallet* pwalletPrev;
+
+public:
+    CRPCWalletScope(CWallet* pwallet) : pwalletPrev(ptrRPCWallet.get())
+    {
+        ptrRPCWallet.reset(pwallet);
+    }
+
+    ~CRPCWalletScope()
+    {
+        ptrRPCWallet.reset(pwalletPrev);
+    }
+};
+
+// Timings of the calls of one RPC method since startup
+class CRPCCallTime
+{
+public:
+    // under 100us, 1ms, 10ms, 100ms, 1s, and longer
+    static const int BUCKETS = 6;
+
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalUsec;
+    int64_t nMaxUsec;
+    uint64_t vBuckets[BUCKETS];
+    // cs_main and cs_wallet, for the methods the table locks for
+    int64_t nLockWaitUsec;
+    int64_t nMaxLockWaitUsec;
+
+    CRPCCallTime() : nCalls(0), nErrors(0), nTotalUsec(0), nMaxUsec(0), nLockWaitUsec(0), nMaxLockWaitUsec(0)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+            vBuckets[i] = 0;
+    }
+
+    void Add(int64_t nUsec, int64_t nWaitUsec, bool fError)
+    {
+        nCalls++;
+        if (fError)
+            nErrors++;
+        nTotalUsec += nUsec;
+        nMaxUsec = std::max(nMaxUsec, nUsec);
+        nLockWaitUsec += nWaitUsec;
+        nMaxLockWaitUsec = std::max(nMaxLockWaitUsec, nWaitUsec);
+        int nBucket = 0;
+        for (int64_t nLimit = 100; nBucket < BUCKETS - 1 && nUsec >= nLimit; nLimit *= 10)
+            nBucket++;
+        vBuckets[nBucket]++;
+    }
+};
+
+static CCriticalSection cs_mapRPCCallTimes;
+static map<string, CRPCCallTime> mapRPCCallTimes;
+
+// Commands whose parameters are kept out of the slow call log
+static const char* const pszSecretRPCCommands[] =
+{
+    "walletpassphrase", "walletpassphrasechange", "encryptwallet", "importprivkey",
+    "importmalleablekey", "dumppem", "signrawtransaction",
+};
+
+static void RecordRPCCall(const string& strMethod, const Array& params, const string& strPeer,
+                          int64_t nUsec, int64_t nWaitUsec, bool fError)
+{
+    {
+        LOCK(cs_mapRPCCallTimes);
+        mapRPCCallTimes[strMethod].Add(nUsec, nWaitUsec, fError);
+    }
+
+    int64_t nSlowMs = GetArg("-rpcslowlog", 0);
+    if (nSlowMs <= 0 || nUsec < nSlowMs * 1000)
+        return;
+
+    string strParams;
+    BOOST_FOREACH(const char* pszCommand, pszSecretRPCCommands)
+        if (strMethod == pszCommand)
+            strParams = "(hidden)";
+    if (strParams.empty())
+    {
+        strParams = write_string(Value(params), false);
+        if (strParams.size() > 1000)
+            strParams = strParams.substr(0, 1000) + "...";
+    }
+    printf("Slow RPC call %s from %s took %.3fms (%.3fms waiting for locks)%s: %s\n",
+        strMethod.c_str(), strPeer.empty() ? "local" : strPeer.c_str(), nUsec / 1000.0, nWaitUsec / 1000.0,
+        fError ? ", failed" : "", strParams.c_str());
+}
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats [method]\n"
+            "Returns, for each RPC method called since startup, the number of calls\n"
+            "and errors and how long the calls took.\n"
+            "\"calltimes\" counts calls taken under 0.1ms, 1ms, 10ms, 100ms, 1s, and longer.\n"
+            "\"lockwaitms\" is the time spent waiting for cs_main and the wallet lock\n"
+            "by the methods which run under them as a whole.");
+
+    map<string, CRPCCallTime> mapTimes;
+    {
+        LOCK(cs_mapRPCCallTimes);
+        if (params.size() > 0)
+        {
+            map<string, CRPCCallTime>::iterator mi = mapRPCCallTimes.find(params[0].get_str());
+            if (mi != mapRPCCallTimes.end())
+                mapTimes.insert(*mi);
+        }
+        else
+            mapTimes = mapRPCCallTimes;
+    }
+
+    Object ret;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCCallTime)& item, mapTimes)
+    {
+        const CRPCCallTime& times = item.second;
+        Object obj;
+        obj.push_back(Pair("calls", (int64_t)times.nCalls));
+        obj.push_back(Pair("errors", (int64_t)times.nErrors));
+        obj.push_back(Pair("callms", times.nTotalUsec / 1000.0));
+        obj.push_back(Pair("avgcallms", times.nTotalUsec / 1000.0 / times.nCalls));
+        obj.push_back(Pair("maxcallms", times.nMaxUsec / 1000.0));
+        if (times.nLockWaitUsec > 0)
+        {
+            obj.push_back(Pair("lockwaitms", times.nLockWaitUsec / 1000.0));
+            obj.push_back(Pair("maxlockwaitms", times.nMaxLockWaitUsec / 1000.0));
+        }
+        Array arrBuckets;
+        for (int i = 0; i < CRPCCallTime::BUCKETS; i++)
+            arrBuckets.push_back((int64_t)times.vBuckets[i]);
+        obj.push_back(Pair("calltimes", arrBuckets));
+        ret.push_back(Pair(item.first, obj));
+    }
+    return ret;
+}
+
+static bool CompareLockWait(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    return a.nWaitUsec > b.nWaitUsec;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getlockstats [count=50] [reset=false]\n"
+            "Returns the <count> places in the code that waited longest for a lock,\n"
+            "with the number of times the lock was taken there and had to wait for\n"
+            "another thread, and the time spent waiting for and holding it.\n"
+            "Only available in builds with -DDEBUG_LOCKSTATS.\n"
+            "With reset the totals start over after they are returned.");
+
+#ifndef DEBUG_LOCKSTATS
+    throw JSONRPCError(RPC_MISC_ERROR, "Lock statistics are not compiled in, build with -DDEBUG_LOCKSTATS");
+#endif
+
+    unsigned int nCount = 50;
+    if (params.size() > 0)
+        nCount = std::max(params[0].get_int(), 0);
+    bool fReset = (params.size() > 1 && params[1].get_bool());
+
+    std::vector<CLockSiteStats> vStats;
+    GetLockStats(vStats);
+    if (fReset)
+        ResetLockStats();
+
+    // One place may be recorded by several files that include it
+    map<string, CLockSiteStats> mapSites;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        CLockSiteStats& site = mapSites[stats.strName + " " + stats.strFile + ":" + itostr(stats.nLine)];
+        if (site.nLocks == 0)
+        {
+            site = stats;
+            continue;
+        }
+        site.nLocks += stats.nLocks;
+        site.nContended += stats.nContended;
+        site.nWaitUsec += stats.nWaitUsec;
+        site.nMaxWaitUsec = std::max(site.nMaxWaitUsec, stats.nMaxWaitUsec);
+        site.nHoldUsec += stats.nHoldUsec;
+        site.nMaxHoldUsec = std::max(site.nMaxHoldUsec, stats.nMaxHoldUsec);
+    }
+    vStats.clear();
+    BOOST_FOREACH(const PAIRTYPE(string, CLockSiteStats)& item, mapSites)
+        vStats.push_back(item.second);
+    std::sort(vStats.begin(), vStats.end(), CompareLockWait);
+    if (vStats.size() > nCount)
+        vStats.resize(nCount);
+
+    Array ret;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        Object obj;
+        obj.push_back(Pair("lock", stats.strName));
+        obj.push_back(Pair("site", stats.strFile + ":" + itostr(stats.nLine)));
+        obj.push_back(Pair("locks", (int64_t)stats.nLocks));
+        obj.push_back(Pair("contended", (int64_t)stats.nContended));
+        obj.push_back(Pair("waitms", stats.nWaitUsec / 1000.0));
+        obj.push_back(Pair("maxwaitms", stats.nMaxWaitUsec / 1000.0));
+        obj.push_back(Pair("holdms", stats.nHoldUsec / 1000.0));
+        obj.push_back(Pair("maxholdms", stats.nMaxHoldUsec / 1000.0));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+static bool CompareProfileScopeTime(const CProfileScopeStats& a, const CProfileScopeStats& b)
+{
+    return a.nTotalUsec > b.nTotalUsec;
+}
+
+Value getthreadstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getthreadstats [count=50] [reset=false]\n"
+            "Returns, for each kind of thread, the threads running and exited and the\n"
+            "CPU and wall time they used since startup. \"cpuload\" is the CPU time\n"
+            "over the wall time, the CPU time is -1 where the platform doesn't tell it.\n"
+            "In builds with -DDEBUG_PROFILE, \"scopes\" has the <count> PROFILE_SCOPE\n"
+            "places that took the longest, with reset their totals start over after\n"
+            "they are returned.");
+
+    std::vector<CThreadStats> vThreads;
+    GetThreadStats(vThreads);
+
+    Object objThreads;
+    BOOST_FOREACH(const CThreadStats& stats, vThreads)
+    {
+        Object obj;
+        obj.push_back(Pair("running", stats.nRunning));
+        obj.push_back(Pair("exited", stats.nExited));
+        obj.push_back(Pair("cpums", stats.nCPUTime >= 0 ? stats.nCPUTime / 1000.0 : -1.0));
+        obj.push_back(Pair("wallms", stats.nWallTime / 1000.0));
+        if (stats.nCPUTime >= 0 && stats.nWallTime > 0)
+            obj.push_back(Pair("cpuload", (double)stats.nCPUTime / stats.nWallTime));
+        objThreads.push_back(Pair(stats.strName, obj));
+    }
+
+    Object ret;
+    ret.push_back(Pair("threads", objThreads));
+
+#ifdef DEBUG_PROFILE
+    unsigned int nCount = 50;
+    if (params.size() > 0)
+        nCount = std::max(params[0].get_int(), 0);
+    bool fReset = (params.size() > 1 && params[1].get_bool());
+
+    std::vector<CProfileScopeStats> vScopes;
+    GetProfileScopeStats(vScopes);
+    if (fReset)
+        ResetProfileScopeStats();
+    std::sort(vScopes.begin(), vScopes.end(), CompareProfileScopeTime);
+    if (vScopes.size() > nCount)
+        vScopes.resize(nCount);
+
+    Array arrScopes;
+    BOOST_FOREACH(const CProfileScopeStats& stats, vScopes)
+    {
+        Object obj;
+        obj.push_back(Pair("scope", stats.strName));
+        obj.push_back(Pair("site", stats.strFile + ":" + itostr(stats.nLine)));
+        obj.push_back(Pair("calls", (int64_t)stats.nCalls));
+        obj.push_back(Pair("ms", stats.nTotalUsec / 1000.0));
+        obj.push_back(Pair("avgms", stats.nTotalUsec / 1000.0 / stats.nCalls));
+        obj.push_back(Pair("maxms", stats.nMaxUsec / 1000.0));
+        arrScopes.push_back(obj);
+    }
+    ret.push_back(Pair("scopes", arrScopes));
+#endif
+
+    return ret;
+}
+
+Value getstartuptimes(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getstartuptimes\n"
+            "Returns the phases of the startup in the order they ended, with the\n"
+            "milliseconds each took. Phases may nest, \"block index\" includes the\n"
+            "LevelDB phases, \"wallet\" includes \"wallet keys\" and \"startup\" is\n"
+            "the whole initialization.");
+
+    std::vector<std::pair<std::string, int64_t> > vPhases;
+    GetStartupPhases(vPhases);
+
+    Array ret;
+    for (unsigned int i = 0; i < vPhases.size(); i++)
+    {
+        Object obj;
+        obj.push_back(Pair("phase", vPhases[i].first));
+        obj.push_back(Pair("ms", vPhases[i].second));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns the estimated heap memory of the main containers of each subsystem:\n"
+            "the bytes they take, computed from their element counts and sizes, the\n"
+            "number of elements and the configured limit, 0 if there is none.\n"
+            "Allocator overhead and fragmentation are not included, so \"total\" stays\n"
+            "below the resident size of the process. The send queues of \"peers\" share\n"
+            "buffers with \"relay\". Only the limit of \"leveldb\" is known, its block\n"
+            "cache and write buffers.");
+
+    MemoryUsageMap mapUsage;
+    GetChainMemoryUsage(mapUsage);
+    GetNetMemoryUsage(mapUsage);
+    {
+        CMemoryUsage& wallet = mapUsage["wallet"];
+        LOCK(cs_setpwalletRegistered);
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->GetMemoryUsage(wallet);
+    }
+
+    Object ret;
+    uint64_t nTotal = 0;
+    BOOST_FOREACH(const PAIRTYPE(string, CMemoryUsage)& item, mapUsage)
+    {
+        Object obj;
+        obj.push_back(Pair("usage", item.second.nUsage));
+        obj.push_back(Pair("entries", item.second.nEntries));
+        obj.push_back(Pair("limit", item.second.nLimit));
+        ret.push_back(Pair(item.first, obj));
+        nTotal += item.second.nUsage;
+    }
+    ret.push_back(Pair("total", nTotal));
+    return ret;
+}
+
 
 
 //
 // Call Table
 //
 
-
+// Commands marked unlocked are not run under cs_main and cs_wallet by
+// execute. They take what locks they need themselves, if any.
 static const CRPCCommand vRPCCommands[] =
 { //  name                      function                 safemd  unlocked
   //  ------------------------  -----------------------  ------  --------
     { "help",                       &help,                        true,   true },
     { "stop",                       &stop,                        true,   true },
-    { "getbestblockhash",           &getbestblockhash,            true,   false },
-    { "getblockcount",              &getblockcount,               true,   false },
+    { "getrpcstats",                &getrpcstats,                 true,   true  },
+    { "getlockstats",               &getlockstats,                true,   true  },
+    { "getthreadstats",             &getthreadstats,              true,   true  },
+    { "getstartuptimes",            &getstartuptimes,             true,   true  },
+    { "getmemoryinfo",              &getmemoryinfo,               true,   true  },
+    { "getbestblockhash",           &getbestblockhash,            true,   true  },
+    { "getblockcount",              &getblockcount,               true,   true  },
     { "getconnectioncount",         &getconnectioncount,          true,   false },
     { "getaddrmaninfo",             &getaddrmaninfo,              true,   false },
     { "getpeerinfo",                &getpeerinfo,                 true,   false },
     { "addnode",                    &addnode,                     true,   true  },
     { "getaddednodeinfo",           &getaddednodeinfo,            true,   true  },
-    { "getdifficulty",              &getdifficulty,               true,   false },
-    { "getinfo",                    &getinfo,                     true,   false },
+    { "getdifficulty",              &getdifficulty,               true,   true  },
+    { "getinfo",                    &getinfo,                     true,   true  },
     { "getsubsidy",                 &getsubsidy,                  true,   false },
-    { "getmininginfo",              &getmininginfo,               true,   false },
+    { "getmininginfo",              &getmininginfo,               true,   true  },
+    { "getstakeminerinfo",          &getstakeminerinfo,           true,   true  },
     { "scaninput",                  &scaninput,                   true,   true },
+    { "scaninputs",                 &scaninputs,                  true,   true },
     { "getnewaddress",              &getnewaddress,               true,   false },
     { "getnettotals",               &getnettotals,                true,   true  },
+    { "getmessagestats",            &getmessagestats,             true,   true  },
     { "ntptime",                    &ntptime,                     true,   true  },
     { "getaccountaddress",          &getaccountaddress,           true,   false },
     { "setaccount",                 &setaccount,                  true,   false },
@@ -259,6 +661,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getaddressesbyaccount",      &getaddressesbyaccount,       true,   false },
     { "sendtoaddress",              &sendtoaddress,               false,  false },
     { "mergecoins",                 &mergecoins,                  false,  false },
+    { "getmergestatus",             &getmergestatus,              true,   true  },
     { "getreceivedbyaddress",       &getreceivedbyaddress,        false,  false },
     { "getreceivedbyaccount",       &getreceivedbyaccount,        false,  false },
     { "listreceivedbyaddress",      &listreceivedbyaddress,       false,  false },
@@ -277,40 +680,49 @@ static const CRPCCommand vRPCCommands[] =
     { "sendmany",                   &sendmany,                    false,  false },
     { "addmultisigaddress",         &addmultisigaddress,          false,  false },
     { "addredeemscript",            &addredeemscript,             false,  false },
-    { "getrawmempool",              &getrawmempool,               true,   false },
-    { "getblock",                   &getblock,                    false,  false },
-    { "getblockbynumber",           &getblockbynumber,            false,  false },
+    { "getrawmempool",              &getrawmempool,               true,   true  },
+    { "getmempoolinfo",             &getmempoolinfo,              true,   true  },
+    { "getblock",                   &getblock,                    false,  true  },
+    { "getblockbynumber",           &getblockbynumber,            false,  true  },
     { "dumpblock",                  &dumpblock,                   false,  false },
     { "dumpblockbynumber",          &dumpblockbynumber,           false,  false },
-    { "getblockhash",               &getblockhash,                false,  false },
+    { "getblockhash",               &getblockhash,                false,  true  },
     { "gettransaction",             &gettransaction,              false,  false },
     { "listtransactions",           &listtransactions,            false,  false },
     { "listaddressgroupings",       &listaddressgroupings,        false,  false },
     { "signmessage",                &signmessage,                 false,  false },
-    { "verifymessage",              &verifymessage,               false,  false },
+    { "verifymessage",              &verifymessage,               false,  true  },
     { "getwork",                    &getwork,                     true,   false },
     { "getworkex",                  &getworkex,                   true,   false },
     { "listaccounts",               &listaccounts,                false,  false },
     { "settxfee",                   &settxfee,                    false,  false },
-    { "getblocktemplate",           &getblocktemplate,            true,   false },
+    { "getblocktemplate",           &getblocktemplate,            true,   true  },
     { "submitblock",                &submitblock,                 false,  false },
     { "listsinceblock",             &listsinceblock,              false,  false },
+    { "waitfortx",                  &waitfortx,                   true,   true  },
+    { "waitforblock",               &waitforblock,                true,   true  },
+    { "waitfornewtx",               &waitfornewtx,                true,   true  },
     { "dumpprivkey",                &dumpprivkey,                 false,  false },
     { "dumppem",                    &dumppem,                     true,   false },
-    { "dumpwallet",                 &dumpwallet,                  true,   false },
-    { "importwallet",               &importwallet,                false,  false },
+    { "dumpwallet",                 &dumpwallet,                  true,   true  },
+    { "importwallet",               &importwallet,                false,  true  },
     { "importprivkey",              &importprivkey,               false,  false },
     { "importaddress",              &importaddress,               false,  true  },
     { "removeaddress",              &removeaddress,               false,  true  },
     { "listunspent",                &listunspent,                 false,  false },
     { "getrawtransaction",          &getrawtransaction,           false,  false },
-    { "createrawtransaction",       &createrawtransaction,        false,  false },
-    { "decoderawtransaction",       &decoderawtransaction,        false,  false },
+    { "getaddresstxids",            &getaddresstxids,             false,  false },
+    { "getspentinfo",               &getspentinfo,                false,  false },
+    { "createrawtransaction",       &createrawtransaction,        false,  true  },
+    { "decoderawtransaction",       &decoderawtransaction,        false,  true  },
     { "createmultisig",             &createmultisig,              false,  false },
-    { "decodescript",               &decodescript,                false,  false },
+    { "decodescript",               &decodescript,                false,  true  },
     { "signrawtransaction",         &signrawtransaction,          false,  false },
-    { "sendrawtransaction",         &sendrawtransaction,          false,  false },
+    { "sendrawtransaction",         &sendrawtransaction,          false,  true  },
     { "getcheckpoint",              &getcheckpoint,               true,   false },
+    { "dumpstakemodifiers",         &dumpstakemodifiers,          true,   false },
+    { "dumputxoset",                &dumputxoset,                 true,   false },
+    { "verifyutxoset",              &verifyutxoset,               true,   false },
     { "reservebalance",             &reservebalance,              false,  true},
     { "checkwallet",                &checkwallet,                 false,  true},
     { "repairwallet",               &repairwallet,                false,  true},
@@ -319,6 +731,7 @@ static const CRPCCommand vRPCCommands[] =
     { "newmalleablekey",            &newmalleablekey,             false,  false},
     { "adjustmalleablekey",         &adjustmalleablekey,          false,  false},
     { "adjustmalleablepubkey",      &adjustmalleablepubkey,       false,  false},
+    { "adjustmalleablepubkeys",     &adjustmalleablepubkeys,      false,  false},
     { "listmalleableviews",         &listmalleableviews,          false,  false},
     { "dumpmalleablekey",           &dumpmalleablekey,            false,  false},
     { "importmalleablekey",         &importmalleablekey,          true,   false },
@@ -326,6 +739,8 @@ static const CRPCCommand vRPCCommands[] =
     { "decryptdata",                &decryptdata,                 false,  false },
     { "encryptmessage",             &encryptmessage,              false,  false },
     { "decryptmessage",             &decryptmessage,              false,  false },
+    { "encryptmessages",            &encryptmessages,             false,  false },
+    { "decryptmessages",            &decryptmessages,             false,  false },
     { "sendalert",                  &sendalert,                   false,  false},
 };
 
@@ -378,6 +793,33 @@ string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
+static string HTTPReplyHeader(int nStatus, size_t nContentLength, bool keepalive, const char* pszContentType)
+{
+    const char *cStatus;
+         if (nStatus == HTTP_OK) cStatus = "OK";
+    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
+    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
+    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
+    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
+    else cStatus = "";
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %" PRIszu "\r\n"
+            "Content-Type: %s\r\n"
+            "Server: 42-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        cStatus,
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        nContentLength,
+        pszContentType,
+        FormatFullVersion().c_str());
+}
+
 static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
@@ -397,29 +839,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
-    return strprintf(
-            "HTTP/1.1 %d %s\r\n"
-            "Date: %s\r\n"
-            "Connection: %s\r\n"
-            "Content-Length: %" PRIszu "\r\n"
-            "Content-Type: application/json\r\n"
-            "Server: 42-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
-        nStatus,
-        cStatus,
-        rfc1123Time().c_str(),
-        keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+    return HTTPReplyHeader(nStatus, strMsg.size(), keepalive, "application/json") + strMsg;
 }
 
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
@@ -463,15 +883,28 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+// Method, URI and minor HTTP version of a request
+static void ReadHTTPRequestLine(std::basic_istream<char>& stream, string& strMethodRet, string& strURIRet, int& nProtoRet)
+{
+    string str;
+    getline(stream, str);
+    vector<string> vWords;
+    istringstream iss(str);
+    copy(istream_iterator<string>(iss), istream_iterator<string>(), back_inserter(vWords));
+    strMethodRet = vWords.size() > 0 ? vWords[0] : "";
+    strURIRet = vWords.size() > 1 ? vWords[1] : "";
+    nProtoRet = 0;
+    const char *ver = strstr(str.c_str(), "HTTP/1.");
+    if (ver != NULL)
+        nProtoRet = atoi(ver+7);
+}
+
+// Headers and body, after the status or request line
+static int ReadHTTPMessage(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet, int nProto)
 {
     mapHeadersRet.clear();
     strMessageRet.clear();
 
-    // Read status
-    int nProto = 0;
-    int nStatus = ReadHTTPStatus(stream, nProto);
-
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
     if (nLen < 0 || nLen > (int)MAX_SIZE)
@@ -495,6 +928,17 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
             mapHeadersRet["connection"] = "close";
     }
 
+    return HTTP_OK;
+}
+
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+{
+    // Read status
+    int nProto = 0;
+    int nStatus = ReadHTTPStatus(stream, nProto);
+
+    if (ReadHTTPMessage(stream, mapHeadersRet, strMessageRet, nProto) != HTTP_OK)
+        return HTTP_INTERNAL_SERVER_ERROR;
     return nStatus;
 }
 
@@ -527,22 +971,17 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     return write_string(Value(request), false) + "\n";
 }
 
-Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
+// Written by hand so a raw JSON result is spliced in without a parse
+static string JSONRPCReplyText(const Value& result, const Value& error, const Value& id)
 {
-    Object reply;
-    if (error.type() != null_type)
-        reply.push_back(Pair("result", Value::null));
-    else
-        reply.push_back(Pair("result", result));
-    reply.push_back(Pair("error", error));
-    reply.push_back(Pair("id", id));
-    return reply;
+    return "{\"result\":" + (error.type() != null_type ? string("null") : WriteRPCValue(result, false)) +
+           ",\"error\":" + write_string(error, false) +
+           ",\"id\":" + write_string(id, false) + "}";
 }
 
 string JSONRPCReply(const Value& result, const Value& error, const Value& id)
 {
-    Object reply = JSONRPCReplyObj(result, error, id);
-    return write_string(Value(reply), false) + "\n";
+    return JSONRPCReplyText(result, error, id) + "\n";
 }
 
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
@@ -636,13 +1075,55 @@ private:
 class AcceptedConnection
 {
 public:
+    bool fUseSSL;
+
     virtual ~AcceptedConnection() {}
 
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Hand it to the workers once its next request starts coming in
+    virtual void WaitForRequest() = 0;
 };
 
+// Connections with a request coming in, for the -rpcthreads workers. Between
+// requests, keep-alive connections wait in the listener's io_service instead
+// of holding a worker.
+static std::deque<AcceptedConnection*> queueRPCConnections;
+static CWaitableCriticalSection cs_RPCConnections;
+static boost::condition_variable condRPCConnections;
+
+static void QueueRPCConnection(AcceptedConnection* conn)
+{
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_RPCConnections);
+        if (queueRPCConnections.size() < (size_t)GetArgInt("-rpcworkqueue", 16))
+        {
+            queueRPCConnections.push_back(conn);
+            condRPCConnections.notify_one();
+            return;
+        }
+    }
+
+    printf("ThreadRPCServer work queue full, turning away %s\n", conn->peer_address_to_string().c_str());
+    // Only reply if we're not using SSL, so the handshake doesn't hold up the listener
+    if (!conn->fUseSSL)
+        conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false) << std::flush;
+    conn->close();
+    delete conn;
+}
+
+static void RPCRequestReady(AcceptedConnection* conn, const boost::system::error_code& error)
+{
+    if (error || fShutdown)
+    {
+        conn->close();
+        delete conn;
+        return;
+    }
+    QueueRPCConnection(conn);
+}
+
 template <typename Protocol>
 class AcceptedConnectionImpl : public AcceptedConnection
 {
@@ -655,6 +1136,7 @@ public:
         _d(sslStream, fUseSSL),
         _stream(_d)
     {
+        this->fUseSSL = fUseSSL;
     }
 
     virtual std::iostream& stream()
@@ -672,6 +1154,15 @@ public:
         _stream.close();
     }
 
+    virtual void WaitForRequest()
+    {
+        // A pipelined request may be read in already
+        if (_stream.rdbuf()->in_avail() > 0)
+            QueueRPCConnection(this);
+        else
+            sslStream.lowest_layer().async_read_some(asio::null_buffers(), boost::bind(&RPCRequestReady, this, _1));
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -770,11 +1261,9 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // queue it for the workers once the request comes in
+    else
+        conn->WaitForRequest();
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
@@ -899,6 +1388,11 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    int nThreads = std::max(1, GetArgInt("-rpcthreads", 4));
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadRPCWorker, NULL))
+            printf("Error: NewThread(ThreadRPCWorker) failed\n");
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
@@ -947,138 +1441,431 @@ void JSONRequest::parse(const Value& valRequest)
         throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
 }
 
-static Object JSONRPCExecOne(const Value& req)
+static string JSONRPCExecOne(const Value& req, const string& strPeer, CWallet* pwallet)
 {
-    Object rpc_result;
+    string rpc_result;
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        Value result = tableRPC.execute(jreq.strMethod, jreq.params, strPeer, pwallet);
+        rpc_result = JSONRPCReplyText(result, Value::null, jreq.id);
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        rpc_result = JSONRPCReplyText(Value::null, objError, jreq.id);
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        rpc_result = JSONRPCReplyText(Value::null,
+                                      JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
     }
 
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+// Commands that change nothing, so a run of them in a batch may be
+// executed side by side
+static const char* const pszReadOnlyRPCCommands[] =
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    "getbestblockhash", "getblockcount", "getconnectioncount", "getpeerinfo",
+    "getdifficulty", "getinfo", "getmininginfo", "getnettotals", "getblock",
+    "getblockbynumber", "getblockhash", "getrawmempool", "getmempoolinfo", "getrawtransaction",
+    "gettransaction", "getaddresstxids", "getspentinfo", "decoderawtransaction",
+    "decodescript", "createrawtransaction", "validateaddress", "verifymessage", "getbalance",
+    "getreceivedbyaddress", "getreceivedbyaccount", "listunspent", "getcheckpoint",
+};
 
-    return write_string(Value(ret), false) + "\n";
+static bool IsReadOnlyRPCRequest(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    Value valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    BOOST_FOREACH(const char* pszCommand, pszReadOnlyRPCCommands)
+        if (valMethod.get_str() == pszCommand)
+            return true;
+    return false;
 }
 
-static CCriticalSection cs_THREAD_RPCHANDLER;
+class CRPCBatchRun
+{
+public:
+    const Array& vReq;
+    const string& strPeer;
+    CWallet* pwallet;
+    std::vector<string>& vResults;
+    unsigned int nNext;
+    unsigned int nEnd;
+    CCriticalSection cs;
+
+    CRPCBatchRun(const Array& vReqIn, const string& strPeerIn, CWallet* pwalletIn, std::vector<string>& vResultsIn, unsigned int nBegin, unsigned int nEndIn) :
+        vReq(vReqIn), strPeer(strPeerIn), pwallet(pwalletIn), vResults(vResultsIn), nNext(nBegin), nEnd(nEndIn) {}
+
+    void Do()
+    {
+        for ( ; ; )
+        {
+            unsigned int i;
+            {
+                LOCK(cs);
+                if (nNext >= nEnd)
+                    return;
+                i = nNext++;
+            }
+            vResults[i] = JSONRPCExecOne(vReq[i], strPeer, pwallet);
+        }
+    }
+};
 
-void ThreadRPCServer3(void* parg)
+static string JSONRPCExecBatch(const Array& vReq, const string& strPeer, CWallet* pwallet)
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("42-rpchand");
+    std::vector<string> vResults(vReq.size());
+    unsigned int nMaxThreads = std::max(1, GetArgInt("-rpcthreads", 4));
 
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size())
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        // Anything that may change state runs alone, in order
+        if (!IsReadOnlyRPCRequest(vReq[reqIdx]))
+        {
+            vResults[reqIdx] = JSONRPCExecOne(vReq[reqIdx], strPeer, pwallet);
+            reqIdx++;
+            continue;
+        }
+
+        // A run of read-only requests is shared out with up to -rpcthreads
+        // helpers, this thread being one of them
+        unsigned int nEnd = reqIdx;
+        while (nEnd < vReq.size() && IsReadOnlyRPCRequest(vReq[nEnd]))
+            nEnd++;
+
+        CRPCBatchRun run(vReq, strPeer, pwallet, vResults, reqIdx, nEnd);
+        unsigned int nThreads = std::min(nMaxThreads, nEnd - reqIdx);
+        boost::thread_group group;
+        for (unsigned int i = 1; i < nThreads; i++)
+            group.create_thread(boost::bind(&CRPCBatchRun::Do, &run));
+        run.Do();
+        group.join_all();
+
+        reqIdx = nEnd;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
-    bool fRun = true;
-    for ( ; ; )
+    string strReply = "[";
+    for (unsigned int i = 0; i < vResults.size(); i++)
+    {
+        if (i > 0)
+            strReply += ",";
+        strReply += vResults[i];
+    }
+    return strReply + "]\n";
+}
+
+static CCriticalSection cs_THREAD_RPCHANDLER;
+
+//
+// REST: with -rest, GET /rest/<resource>.<bin|hex> serves chain data in its
+// serialized form. No authentication, it is all public.
+//
+//   block/<hash>              the block as it lies in the block file
+//   tx/<txid>                 a transaction from the index or the memory pool
+//   headers/<count>/<hash>    up to <count> headers of the best chain from
+//                             <hash> on, as sent in a headers message
+//
+static const int MAX_REST_HEADERS = 2000;
+
+static bool RESTReply(AcceptedConnection *conn, int nStatus, const string& strData, const char* pszContentType, bool fKeepAlive)
+{
+    conn->stream() << HTTPReplyHeader(nStatus, strData.size(), fKeepAlive, pszContentType);
+    conn->stream().write(strData.data(), strData.size());
+    conn->stream() << std::flush;
+    return fKeepAlive && conn->stream().good();
+}
+
+static bool RESTError(AcceptedConnection *conn, int nStatus, const string& strMessage, bool fKeepAlive)
+{
+    return RESTReply(conn, nStatus, strMessage + "\n", "text/plain", fKeepAlive);
+}
+
+static bool ParseRESTHash(const string& str, uint256& hashRet)
+{
+    if (str.size() != 64 || !IsHex(str))
+        return false;
+    hashRet.SetHex(str);
+    return true;
+}
+
+static bool HandleRESTRequest(AcceptedConnection *conn, const string& strURI, bool fKeepAlive)
+{
+    string strPath = strURI.substr(strlen("/rest/"));
+    string::size_type nDot = strPath.rfind('.');
+    string strFormat = (nDot != string::npos) ? strPath.substr(nDot + 1) : "";
+    if (strFormat != "bin" && strFormat != "hex")
+        return RESTError(conn, HTTP_BAD_REQUEST, "Output format must be .bin or .hex", fKeepAlive);
+    strPath.erase(nDot);
+
+    vector<string> vPath;
+    boost::split(vPath, strPath, boost::is_any_of("/"));
+
+    string strData;
+    uint256 hash;
+    if (vPath.size() == 2 && vPath[0] == "block")
     {
-        if (fShutdown || !fRun)
+        if (!ParseRESTHash(vPath[1], hash))
+            return RESTError(conn, HTTP_BAD_REQUEST, "Invalid hash", fKeepAlive);
+
+        unsigned int nFile, nBlockPos;
         {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi == mapBlockIndex.end())
+                return RESTError(conn, HTTP_NOT_FOUND, "Block not found", fKeepAlive);
+            nFile = mi->second->nFile;
+            nBlockPos = mi->second->nBlockPos;
         }
-        map<string, string> mapHeaders;
-        string strRequest;
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        // Read outside cs_main, the position of a block doesn't change
+        if (!ReadRawBlockFromDisk(nFile, nBlockPos, strData))
+            return RESTError(conn, HTTP_NOT_FOUND, "Block not available on disk", fKeepAlive);
+    }
+    else if (vPath.size() == 2 && vPath[0] == "tx")
+    {
+        if (!ParseRESTHash(vPath[1], hash))
+            return RESTError(conn, HTTP_BAD_REQUEST, "Invalid hash", fKeepAlive);
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+        CTransaction tx;
+        uint256 hashBlock = 0;
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            LOCK(cs_main);
+            if (!GetTransaction(hash, tx, hashBlock))
+                return RESTError(conn, HTTP_NOT_FOUND, "Transaction not found", fKeepAlive);
         }
-        if (!HTTPAuthorized(mapHeaders))
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        strData.assign(ssTx.begin(), ssTx.end());
+    }
+    else if (vPath.size() == 3 && vPath[0] == "headers")
+    {
+        int nCount = atoi(vPath[1]);
+        if (nCount < 1 || nCount > MAX_REST_HEADERS)
+            return RESTError(conn, HTTP_BAD_REQUEST, strprintf("Header count must be 1 to %d", MAX_REST_HEADERS), fKeepAlive);
+        if (!ParseRESTHash(vPath[2], hash))
+            return RESTError(conn, HTTP_BAD_REQUEST, "Invalid hash", fKeepAlive);
+
+        CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                Sleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi == mapBlockIndex.end())
+                return RESTError(conn, HTTP_NOT_FOUND, "Block not found", fKeepAlive);
+            for (CBlockIndex* pindex = mi->second; pindex && nCount > 0; pindex = pindex->pnext, nCount--)
+                ssHeaders << pindex->GetBlockHeader();
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        strData.assign(ssHeaders.begin(), ssHeaders.end());
+    }
+    else
+        return RESTError(conn, HTTP_NOT_FOUND, "Unknown resource", fKeepAlive);
 
-        JSONRequest jreq;
-        try
+    if (strFormat == "hex")
+        return RESTReply(conn, HTTP_OK, HexStr(strData.begin(), strData.end()) + "\n", "text/plain", fKeepAlive);
+    return RESTReply(conn, HTTP_OK, strData, "application/octet-stream", fKeepAlive);
+}
+
+//
+// Metrics: with -metrics, GET /metrics returns the counters and gauges of the
+// node in the Prometheus text format. Everything is read from statistics with
+// locks of their own, a scrape never waits for cs_main. No authentication,
+// like /rest/.
+//
+static bool HandleMetricsRequest(AcceptedConnection *conn, bool fKeepAlive)
+{
+    string strData = FormatMetrics();
+
+    AppendMetric(strData, "fortytwo_net_received_bytes_total", "counter", "Bytes received from peers", CNode::GetTotalBytesRecv());
+    AppendMetric(strData, "fortytwo_net_sent_bytes_total", "counter", "Bytes sent to peers", CNode::GetTotalBytesSent());
+
+    CStakeMinerStats stake = GetStakeMinerStats();
+    AppendMetric(strData, "fortytwo_stake_kernels_total", "counter", "Stake kernels hashed", stake.nHashes);
+    AppendMetric(strData, "fortytwo_stake_scan_seconds_total", "counter", "Time spent scanning for stake kernels", stake.nScanTime * 0.000001);
+    AppendMetric(strData, "fortytwo_stake_scan_passes_total", "counter", "Stake kernel scan passes", stake.nPasses);
+
+    map<string, CRPCCallTime> mapTimes;
+    {
+        LOCK(cs_mapRPCCallTimes);
+        mapTimes = mapRPCCallTimes;
+    }
+    const char* pszHelpCalls = "RPC calls by method";
+    const char* pszHelpErrors = "Failed RPC calls by method";
+    const char* pszHelpSeconds = "Time spent in RPC calls by method";
+    string strCalls, strErrors, strSeconds;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCCallTime)& item, mapTimes)
+    {
+        string strLabels = "method=\"" + item.first + "\"";
+        AppendMetric(strCalls, "fortytwo_rpc_calls_total", "counter", pszHelpCalls, item.second.nCalls, strLabels);
+        AppendMetric(strErrors, "fortytwo_rpc_errors_total", "counter", pszHelpErrors, item.second.nErrors, strLabels);
+        AppendMetric(strSeconds, "fortytwo_rpc_call_seconds_total", "counter", pszHelpSeconds, item.second.nTotalUsec * 0.000001, strLabels);
+        pszHelpCalls = pszHelpErrors = pszHelpSeconds = NULL;
+    }
+    strData += strCalls + strErrors + strSeconds;
+
+    return RESTReply(conn, HTTP_OK, strData, "text/plain; version=0.0.4", fKeepAlive);
+}
+
+// Serve one request, false if the connection is to be closed
+static bool HandleRPCRequest(AcceptedConnection *conn)
+{
+    map<string, string> mapHeaders;
+    string strMethod, strURI, strRequest;
+    int nProto = 0;
+
+    ReadHTTPRequestLine(conn->stream(), strMethod, strURI, nProto);
+    if (ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto) != HTTP_OK)
+        return false;
+
+    // The client closed a keep-alive connection
+    if (conn->stream().eof() && strMethod.empty())
+        return false;
+
+    if (strMethod == "GET" && boost::starts_with(strURI, "/rest/"))
+    {
+        if (!GetBoolArg("-rest"))
+            return RESTError(conn, HTTP_FORBIDDEN, "REST is disabled, start with -rest", false);
+        return HandleRESTRequest(conn, strURI, mapHeaders["connection"] != "close");
+    }
+
+    if (strMethod == "GET" && strURI == "/metrics")
+    {
+        if (!GetBoolArg("-metrics"))
+            return RESTError(conn, HTTP_FORBIDDEN, "Metrics are disabled, start with -metrics", false);
+        return HandleMetricsRequest(conn, mapHeaders["connection"] != "close");
+    }
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            Sleep(250);
+
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    bool fRun = (mapHeaders["connection"] != "close");
+
+    JSONRequest jreq;
+    try
+    {
+        // Calls sent to /wallet/<file> are for that wallet, the rest for pwalletMain
+        CWallet* pwallet = NULL;
+        if (boost::starts_with(strURI, "/wallet/"))
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+            pwallet = GetWalletByName(strURI.substr(8));
+            if (!pwallet)
+                throw JSONRPCError(RPC_WALLET_ERROR, "Requested wallet is not loaded");
+        }
 
-            string strReply;
+        // Parse request
+        Value valRequest;
+        if (!ReadJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+        string strReply;
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params, conn->peer_address_to_string(), pwallet);
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array(), conn->peer_address_to_string(), pwallet);
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+    return fRun && conn->stream().good();
+}
+
+void ThreadRPCWorker(void* parg)
+{
+    // Make this thread recognisable as the RPC handler
+    RenameThread("42-rpchand");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+    while (!fShutdown)
+    {
+        AcceptedConnection *conn = NULL;
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs_RPCConnections);
+            while (queueRPCConnections.empty() && !fShutdown)
+                condRPCConnections.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if (fShutdown)
+                break;
+            conn = queueRPCConnections.front();
+            queueRPCConnections.pop_front();
         }
-        catch (Object& objError)
+
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            LOCK(cs_THREAD_RPCHANDLER);
+            vnThreadsRunning[THREAD_RPCHANDLER]++;
         }
-        catch (std::exception& e)
+        bool fKeepAlive = false;
+        try
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            fKeepAlive = HandleRPCRequest(conn);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCWorker()");
+        }
+        if (fKeepAlive && !fShutdown)
+            conn->WaitForRequest();
+        else
+        {
+            conn->close();
+            delete conn;
+        }
+        {
+            LOCK(cs_THREAD_RPCHANDLER);
+            vnThreadsRunning[THREAD_RPCHANDLER]--;
         }
     }
 
-    delete conn;
+    // Connections still waiting are just closed
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_RPCConnections);
+    while (!queueRPCConnections.empty())
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]--;
+        AcceptedConnection *conn = queueRPCConnections.front();
+        queueRPCConnections.pop_front();
+        conn->close();
+        delete conn;
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, const std::string& strPeer, CWallet* pwallet) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1091,6 +1878,9 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    CRPCWalletScope scope(pwallet ? pwallet : pwalletMain);
+    int64_t nStart = GetTimeMicros();
+    int64_t nWaitUsec = 0;
     try
     {
         // Execute
@@ -1099,16 +1889,24 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
             if (pcmd->unlocked)
                 result = pcmd->actor(params, false);
             else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
+                LOCK2(cs_main, GetRPCWallet()->cs_wallet);
+                nWaitUsec = GetTimeMicros() - nStart;
                 result = pcmd->actor(params, false);
             }
         }
+        RecordRPCCall(strMethod, params, strPeer, GetTimeMicros() - nStart, nWaitUsec, false);
         return result;
     }
     catch (std::exception& e)
     {
+        RecordRPCCall(strMethod, params, strPeer, GetTimeMicros() - nStart, nWaitUsec, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, params, strPeer, GetTimeMicros() - nStart, nWaitUsec, true);
+        throw;
+    }
 }
 
 std::vector<std::string> CRPCTable::listCommands() const
@@ -1164,7 +1962,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -1186,7 +1984,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!ReadJSON(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -1228,6 +2026,10 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "dumpblockbynumber"      && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getlockstats"           && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "getthreadstats"         && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getthreadstats"         && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "sendfrom"               && n > 2) ConvertTo<double>(params[2]);
@@ -1239,8 +2041,15 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "walletpassphrase"       && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "waitfortx"              && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "waitfortx"              && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "waitforblock"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "waitforblock"           && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "waitfornewtx"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "waitfornewtx"           && n > 1) ConvertTo<int64_t>(params[1]);
 
     if (strMethod == "scaninput"              && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "scaninputs"             && n > 0) ConvertTo<Object>(params[0]);
 
     if (strMethod == "sendalert"              && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "sendalert"              && n > 3) ConvertTo<int64_t>(params[3]);
@@ -1254,10 +2063,16 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "reservebalance"         && n > 1) ConvertTo<double>(params[1]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<Array>(params[1]);
+    if (strMethod == "encryptmessages"        && n > 1) ConvertTo<Array>(params[1]);
+    if (strMethod == "adjustmalleablepubkeys" && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "decryptmessages"        && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "listunspent"            && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listunspent"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
+    if (strMethod == "listunspent"            && n > 3) ConvertTo<Object>(params[3]);
+    if (strMethod == "getrawmempool"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "createmultisig"         && n > 0) ConvertTo<int64_t>(params[0]);
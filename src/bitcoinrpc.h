@@ -11,6 +11,7 @@
 #include <map>
 
 class CBlockIndex;
+class CWallet;
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
@@ -18,6 +19,7 @@ class CBlockIndex;
 
 #include "util.h"
 #include "checkpoints.h"
+#include "jsonwriter.h"
 
 // HTTP status codes
 enum HTTPStatusCode
@@ -27,7 +29,8 @@ enum HTTPStatusCode
     HTTP_UNAUTHORIZED          = 401,
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
-    HTTP_INTERNAL_SERVER_ERROR = 500
+    HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503
 };
 
 // Bitcoin RPC error codes
@@ -115,10 +118,12 @@ public:
      * Execute a method.
      * @param method   Method to execute
      * @param params   Array of arguments (JSON objects)
+     * @param strPeer  Address of the client, for the slow call log
+     * @param pwallet  Wallet the call is for, NULL for pwalletMain
      * @returns Result of the call.
      * @throws an exception (json_spirit::Value) when an error happens.
      */
-    json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+    json_spirit::Value execute(const std::string &method, const json_spirit::Array &params, const std::string& strPeer = "", CWallet* pwallet = NULL) const;
 	
     /**
     * Returns a list of registered commands
@@ -129,15 +134,25 @@ public:
 
 extern const CRPCTable tableRPC;
 
-extern int64_t nWalletUnlockTime;
+// The wallet the call running on this thread is for: the one named by the
+// /wallet/<file> URI it was sent to, or pwalletMain
+extern CWallet* GetRPCWallet();
 extern int64_t AmountFromValue(const json_spirit::Value& value);
 extern json_spirit::Value ValueFromAmount(int64_t amount);
 extern double GetDifficulty(const CBlockIndex* blockindex = NULL);
+extern double GetTipDifficulty(const CBlockIndex* blockindex);
 
 extern double GetPoWMHashPS();
 extern double GetPoSKernelPS();
 
 extern std::string HexBits(unsigned int nBits);
+
+// A handler returns RawJSON(writer) to have the text it wrote sent as is
+extern json_spirit::Value RawJSON(const CJSONWriter& writer);
+extern bool IsRawJSON(const json_spirit::Value& value);
+extern std::string WriteRPCValue(const json_spirit::Value& value, bool fPretty);
+// Add the members of the object the writer holds
+extern void AppendJSON(json_spirit::Object& obj, const CJSONWriter& writer);
 extern std::string HelpRequiringPassphrase();
 extern void EnsureWalletIsUnlocked();
 
@@ -162,13 +177,16 @@ extern json_spirit::Value importprivkey(const json_spirit::Array& params, bool f
 extern json_spirit::Value importaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value removeaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmessagestats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value ntptime(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value sendalert(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getsubsidy(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmininginfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getstakeminerinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value scaninput(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value scaninputs(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblocktemplate(const json_spirit::Array& params, bool fHelp);
@@ -196,6 +214,7 @@ extern json_spirit::Value listtransactions(const json_spirit::Array& params, boo
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value waitfortx(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value backupwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value keypoolrefill(const json_spirit::Array& params, bool fHelp);
@@ -212,9 +231,11 @@ extern json_spirit::Value repairwallet(const json_spirit::Array& params, bool fH
 extern json_spirit::Value resendwallettransactions(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value makekeypair(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value mergecoins(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmergestatus(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value newmalleablekey(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value adjustmalleablekey(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value adjustmalleablepubkey(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value adjustmalleablepubkeys(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listmalleableviews(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpmalleablekey(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importmalleablekey(const json_spirit::Array& params, bool fHelp);
@@ -224,8 +245,12 @@ extern json_spirit::Value encryptdata(const json_spirit::Array& params, bool fHe
 extern json_spirit::Value decryptdata(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value encryptmessage(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decryptmessage(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value encryptmessages(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value decryptmessages(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
@@ -239,11 +264,17 @@ extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool f
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value waitforblock(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value waitfornewtx(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpblockbynumber(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumpstakemodifiers(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumputxoset(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value verifyutxoset(const json_spirit::Array& params, bool fHelp);
 
 #endif
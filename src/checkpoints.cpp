@@ -81,14 +81,14 @@ namespace Checkpoints
         return checkpoints.rbegin()->second.second;
     }
 
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+    CBlockIndex* GetLastCheckpoint(const uint256map<CBlockIndex*>& mapBlockIndex)
     {
         MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
 
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
         {
             const uint256& hash = i.second.first;
-            std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
+            uint256map<CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
             if (t != mapBlockIndex.end())
                 return t->second;
         }
@@ -110,7 +110,7 @@ namespace Checkpoints
         if (!mapBlockIndex.count(hashSyncCheckpoint))
             error("GetSyncCheckpoint: block index missing for current sync-checkpoint %s", hashSyncCheckpoint.ToString().c_str());
         else
-            return mapBlockIndex[hashSyncCheckpoint];
+            return LookupBlockIndex(hashSyncCheckpoint);
         return NULL;
     }
 
@@ -122,8 +122,8 @@ namespace Checkpoints
         if (!mapBlockIndex.count(hashCheckpoint))
             return error("ValidateSyncCheckpoint: block index missing for received sync-checkpoint %s", hashCheckpoint.ToString().c_str());
 
-        CBlockIndex* pindexSyncCheckpoint = mapBlockIndex[hashSyncCheckpoint];
-        CBlockIndex* pindexCheckpointRecv = mapBlockIndex[hashCheckpoint];
+        CBlockIndex* pindexSyncCheckpoint = LookupBlockIndex(hashSyncCheckpoint);
+        CBlockIndex* pindexCheckpointRecv = LookupBlockIndex(hashCheckpoint);
 
         if (pindexCheckpointRecv->nHeight <= pindexSyncCheckpoint->nHeight)
         {
@@ -190,7 +190,7 @@ namespace Checkpoints
             }
 
             CTxDB txdb;
-            CBlockIndex* pindexCheckpoint = mapBlockIndex[hashPendingCheckpoint];
+            CBlockIndex* pindexCheckpoint = LookupBlockIndex(hashPendingCheckpoint);
             if (!pindexCheckpoint->IsInMainChain())
             {
                 CBlock block;
@@ -242,7 +242,7 @@ namespace Checkpoints
         LOCK(cs_hashSyncCheckpoint);
         // sync-checkpoint should always be accepted block
         assert(mapBlockIndex.count(hashSyncCheckpoint));
-        const CBlockIndex* pindexSync = mapBlockIndex[hashSyncCheckpoint];
+        const CBlockIndex* pindexSync = LookupBlockIndex(hashSyncCheckpoint);
 
         if (nHeight > pindexSync->nHeight)
         {
@@ -279,15 +279,15 @@ namespace Checkpoints
     {
         LOCK(cs_hashSyncCheckpoint);
         const uint256& hash = mapCheckpoints.rbegin()->second.first;
-        if (mapBlockIndex.count(hash) && !mapBlockIndex[hash]->IsInMainChain())
+        if (mapBlockIndex.count(hash) && !LookupBlockIndex(hash)->IsInMainChain())
         {
             // checkpoint block accepted but not yet in main chain
             printf("ResetSyncCheckpoint: SetBestChain to hardened checkpoint %s\n", hash.ToString().c_str());
             CTxDB txdb;
             CBlock block;
-            if (!block.ReadFromDisk(mapBlockIndex[hash]))
+            if (!block.ReadFromDisk(LookupBlockIndex(hash)))
                 return error("ResetSyncCheckpoint: ReadFromDisk failed for hardened checkpoint %s", hash.ToString().c_str());
-            if (!block.SetBestChain(txdb, mapBlockIndex[hash]))
+            if (!block.SetBestChain(txdb, LookupBlockIndex(hash)))
             {
                 return error("ResetSyncCheckpoint: SetBestChain failed for hardened checkpoint %s", hash.ToString().c_str());
             }
@@ -308,7 +308,7 @@ namespace Checkpoints
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, mapCheckpoints)
         {
             const uint256& hash = i.second.first;
-            if (mapBlockIndex.count(hash) && mapBlockIndex[hash]->IsInMainChain())
+            if (mapBlockIndex.count(hash) && LookupBlockIndex(hash)->IsInMainChain())
             {
                 if (!WriteSyncCheckpoint(hash))
                     return error("ResetSyncCheckpoint: failed to write sync checkpoint %s", hash.ToString().c_str());
@@ -384,7 +384,7 @@ namespace Checkpoints
         LOCK(cs_hashSyncCheckpoint);
         // sync-checkpoint should always be accepted block
         assert(mapBlockIndex.count(hashSyncCheckpoint));
-        const CBlockIndex* pindexSync = mapBlockIndex[hashSyncCheckpoint];
+        const CBlockIndex* pindexSync = LookupBlockIndex(hashSyncCheckpoint);
         return (nBestHeight >= pindexSync->nHeight + nCoinbaseMaturity ||
                 pindexSync->GetBlockTime() + nStakeMinAge < GetAdjustedTime());
     }
@@ -398,6 +398,21 @@ std::string CSyncCheckpoint::strMasterPrivKey = "";
 // ppcoin: verify signature of sync-checkpoint message
 bool CSyncCheckpoint::CheckSignature()
 {
+    // Every peer relays the current checkpoint, copies of it and of the
+    // pending one are taken from the verified messages
+    {
+        LOCK(Checkpoints::cs_hashSyncCheckpoint);
+        const CSyncCheckpoint* pverified[] = { &Checkpoints::checkpointMessage, &Checkpoints::checkpointMessagePending };
+        for (unsigned int i = 0; i < ARRAYLEN(pverified); i++)
+        {
+            if (!pverified[i]->IsNull() && vchMsg == pverified[i]->vchMsg && vchSig == pverified[i]->vchSig)
+            {
+                *this = *pverified[i];
+                return true;
+            }
+        }
+    }
+
     CPubKey key(ParseHex(CSyncCheckpoint::strMasterPubKey));
     if (!key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig))
         return error("CSyncCheckpoint::CheckSignature() : verify signature failed");
@@ -413,7 +428,12 @@ bool CSyncCheckpoint::ProcessSyncCheckpoint(CNode* pfrom)
 {
     if (!CheckSignature())
         return false;
+    return AcceptSyncCheckpoint(pfrom);
+}
 
+// checkpoint with a verified signature, needs cs_main
+bool CSyncCheckpoint::AcceptSyncCheckpoint(CNode* pfrom)
+{
     LOCK(Checkpoints::cs_hashSyncCheckpoint);
     if (!mapBlockIndex.count(hashCheckpoint))
     {
@@ -436,7 +456,7 @@ bool CSyncCheckpoint::ProcessSyncCheckpoint(CNode* pfrom)
         return false;
 
     CTxDB txdb;
-    CBlockIndex* pindexCheckpoint = mapBlockIndex[hashCheckpoint];
+    CBlockIndex* pindexCheckpoint = LookupBlockIndex(hashCheckpoint);
     if (!pindexCheckpoint->IsInMainChain())
     {
         // checkpoint chain received but not yet main chain
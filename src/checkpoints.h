@@ -7,6 +7,7 @@
 #include <map>
 #include "util.h"
 #include "net.h"
+#include "uint256map.h"
 
 // max 1 hour before latest block
 static const int64_t CHECKPOINT_MAX_SPAN = nOneHour;
@@ -47,7 +48,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const uint256map<CBlockIndex*>& mapBlockIndex);
 
     // Returns last checkpoint timestamp
     unsigned int GetLastCheckpointTime();
@@ -153,6 +154,7 @@ public:
 
     bool CheckSignature();
     bool ProcessSyncCheckpoint(CNode* pfrom);
+    bool AcceptSyncCheckpoint(CNode* pfrom);
 };
 
 #endif
@@ -25,9 +25,25 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Pending verifications are spread over several shards, each with its own
+  * lock. Every worker takes batches from its home shard and steals from the
+  * others once it runs dry, so the workers don't contend on a single lock.
+  * The shared mutex only guards the counters and is held for O(1) time.
   */
 template<typename T> class CCheckQueue {
 private:
+    // Number of independently locked parts of the queue
+    static const unsigned int nShards = 16;
+
+    // A part of the queue with its own lock.
+    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
+    struct CShard {
+        boost::mutex mutex;
+        std::vector<T> queue;
+    };
+    CShard shards[nShards];
+
     // Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -40,13 +56,6 @@ private:
     // Quit method blocks on this until all workers are gone
     boost::condition_variable condQuit;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    // The number of workers (including the master) that are idle.
-    int nIdle;
-
     // The total number of workers (including the master).
     int nTotal;
 
@@ -58,35 +67,75 @@ private:
     // worker's own batches.
     unsigned int nTodo;
 
+    // Incremented by every Add, lets the workers find out whether
+    // the shards might have been refilled since they've been scanned
+    unsigned int nGeneration;
+
+    // Home shard of the next worker thread, the master uses the first one
+    unsigned int nNextShard;
+
     // Whether we're shutting down.
     bool fQuit;
 
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Take a batch of elements from the given shard
+    bool Take(unsigned int nShard, std::vector<T> &vChecks) {
+        CShard &shard = shards[nShard];
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (shard.queue.empty())
+            return false;
+        // Leave half of the shard to the other workers, so all of them finish
+        //   approximately simultaneously, but don't do batches smaller than 1
+        //   or larger than nBatchSize.
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)shard.queue.size() / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap jobs from the shard to the local batch vector instead of copying.
+            vChecks[i].swap(shard.queue.back());
+            shard.queue.pop_back();
+        }
+        return true;
+    }
+
+    // Take a batch from the home shard, or steal one from the others
+    bool TakeAny(unsigned int nHome, std::vector<T> &vChecks) {
+        for (unsigned int i = 0; i < nShards; i++)
+            if (Take((nHome + i) % nShards, vChecks))
+                return true;
+        return false;
+    }
+
     // Internal function that does bulk of the verification work.
     bool Loop(bool fMaster = false) {
         boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
+        unsigned int nHome;
+        unsigned int nSeen;
         bool fOk = true;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTotal++;
+            nHome = fMaster ? 0 : (nNextShard++ % nShards);
+            nSeen = nGeneration;
+        }
         do {
-            {
+            if (!TakeAny(nHome, vChecks)) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
+                // first do the clean-up of the previous batch (allowing us to do it in the same critsect)
                 if (nNow) {
                     fAllOk &= fOk;
                     nTodo -= nNow;
+                    nNow = 0;
                     if (nTodo == 0 && !fMaster)
                         // We processed the last element; inform the master he can exit and return the result
                         condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
+                // Nothing left in the shards which have been scanned, sleep unless something has been added since then
+                if (nSeen == nGeneration) {
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         if (nTotal==0)
@@ -98,26 +147,25 @@ private:
                         // return the current status
                         return fRet;
                     }
-                    nIdle++;
                     cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
                 }
+                nSeen = nGeneration;
+                continue;
+            }
+            if (nNow) {
+                // account for the previous batch
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fAllOk &= fOk;
+                nTodo -= nNow;
+                if (nTodo == 0 && !fMaster)
+                    condMaster.notify_one();
+                fOk = fAllOk;
+            } else {
                 // Check whether we need to do work at all
+                boost::unique_lock<boost::mutex> lock(mutex);
                 fOk = fAllOk;
             }
+            nNow = vChecks.size();
             // execute work
             BOOST_FOREACH(T &check, vChecks)
                 if (fOk)
@@ -130,7 +178,7 @@ private:
 public:
     // Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+        nTotal(0), fAllOk(true), nTodo(0), nGeneration(0), nNextShard(1), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     // Worker thread
     void Thread() {
@@ -144,15 +192,30 @@ public:
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        unsigned int nUsed;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Spread the checks over the home shards of the running workers and the master
+            nUsed = std::max(1U, std::min((unsigned int)nShards, (unsigned int)nTotal + 1));
+            // They must be accounted before any worker can take them
+            nTodo += vChecks.size();
         }
-        nTodo += vChecks.size();
+        unsigned int nPart = (vChecks.size() + nUsed - 1) / nUsed;
+        for (unsigned int nShard = 0, nPos = 0; nPos < vChecks.size(); nShard++) {
+            CShard &shard = shards[nShard];
+            boost::unique_lock<boost::mutex> lock(shard.mutex);
+            for (unsigned int nEnd = std::min((unsigned int)vChecks.size(), nPos + nPart); nPos < nEnd; nPos++) {
+                shard.queue.push_back(T());
+                vChecks[nPos].swap(shard.queue.back());
+            }
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGeneration++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -172,10 +235,12 @@ public:
         Quit();
     }
 
+    // Workers may still be scanning the empty shards after the master has
+    //   returned, but they hold no jobs then, so only the pending ones matter
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 };
 
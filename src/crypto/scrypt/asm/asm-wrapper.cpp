@@ -8,11 +8,10 @@ extern "C" void scrypt_core(uint32_t *X, uint32_t *V);
  */
 uint256 scrypt_blockhash(const uint8_t* input)
 {
-    uint8_t scratchpad[SCRYPT_BUFFER_SIZE];
     uint32_t X[32];
     uint256 result = 0;
 
-    uint32_t *V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    uint32_t *V = (uint32_t *)scrypt_scratchpad(SCRYPT_BUFFER_SIZE);
 
     PKCS5_PBKDF2_HMAC((const char*)input, 80, input, 80, 1, EVP_sha256(), 128, (unsigned char *)X);
     scrypt_core(X, V);
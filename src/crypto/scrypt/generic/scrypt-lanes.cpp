@@ -0,0 +1,177 @@
+/*
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * Batch header hashing over lane-interleaved scrypt cores: NEON here,
+ * SSE2 and AVX2 in the intrinsic implementations. Does the runtime
+ * selection of the core and falls back to scrypt_blockhash() one by one.
+ */
+
+#include <algorithm>
+#include "scrypt.h"
+
+#ifdef USE_SSE2
+#define SCRYPT_LANES_4WAY scrypt_core_4way_sse2
+void scrypt_core_4way_sse2(uint32_t *X, uint32_t *V);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_SCRYPT
+bool scrypt_avx2_supported();
+void scrypt_core_8way_avx2(uint32_t *X, uint32_t *V);
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCRYPT_LANES_4WAY scrypt_core_4way_neon
+
+#define ROTL(x, n) vorrq_u32(vshlq_n_u32(x, n), vshrq_n_u32(x, 32 - (n)))
+
+static inline void xor_salsa8_4way(uint32x4_t B[16], const uint32x4_t Bx[16])
+{
+    uint32x4_t x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = veorq_u32(B[i], Bx[i]);
+
+    for (int i = 0; i < 8; i += 2)
+    {
+#define Q(a, b, c, n) x[a] = veorq_u32(x[a], ROTL(vaddq_u32(x[b], x[c]), n))
+        /* Operate on columns. */
+        Q( 4,  0, 12,  7); Q( 9,  5,  1,  7); Q(14, 10,  6,  7); Q( 3, 15, 11,  7);
+        Q( 8,  4,  0,  9); Q(13,  9,  5,  9); Q( 2, 14, 10,  9); Q( 7,  3, 15,  9);
+        Q(12,  8,  4, 13); Q( 1, 13,  9, 13); Q( 6,  2, 14, 13); Q(11,  7,  3, 13);
+        Q( 0, 12,  8, 18); Q( 5,  1, 13, 18); Q(10,  6,  2, 18); Q(15, 11,  7, 18);
+
+        /* Operate on rows. */
+        Q( 1,  0,  3,  7); Q( 6,  5,  4,  7); Q(11, 10,  9,  7); Q(12, 15, 14,  7);
+        Q( 2,  1,  0,  9); Q( 7,  6,  5,  9); Q( 8, 11, 10,  9); Q(13, 12, 15,  9);
+        Q( 3,  2,  1, 13); Q( 4,  7,  6, 13); Q( 9,  8, 11, 13); Q(14, 13, 12, 13);
+        Q( 0,  3,  2, 18); Q( 5,  4,  7, 18); Q(10,  9,  8, 18); Q(15, 14, 13, 18);
+#undef Q
+    }
+
+    for (int i = 0; i < 16; i++)
+        B[i] = vaddq_u32(B[i], x[i]);
+}
+
+#undef ROTL
+
+// Word k of lane l lives at X[k * 4 + l], as in the SSE2 core
+static void scrypt_core_4way_neon(uint32_t *X, uint32_t *V)
+{
+    uint32x4_t XV[32];
+    for (int k = 0; k < 32; k++)
+        XV[k] = vld1q_u32(&X[k * 4]);
+
+    for (int i = 0; i < 1024; i++)
+    {
+        for (int k = 0; k < 32; k++)
+            vst1q_u32(&V[(i * 32 + k) * 4], XV[k]);
+        xor_salsa8_4way(&XV[0], &XV[16]);
+        xor_salsa8_4way(&XV[16], &XV[0]);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        // Each lane reads a row of its own
+        for (int k = 0; k < 32; k++)
+            vst1q_u32(&X[k * 4], XV[k]);
+        for (int l = 0; l < 4; l++)
+        {
+            const uint32_t *Vj = &V[(X[16 * 4 + l] & 1023) * 32 * 4 + l];
+            for (int k = 0; k < 32; k++)
+                X[k * 4 + l] ^= Vj[k * 4];
+        }
+        for (int k = 0; k < 32; k++)
+            XV[k] = vld1q_u32(&X[k * 4]);
+        xor_salsa8_4way(&XV[0], &XV[16]);
+        xor_salsa8_4way(&XV[16], &XV[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        vst1q_u32(&X[k * 4], XV[k]);
+}
+#endif
+
+static inline uint32_t le32dec(const void *pp)
+{
+    const uint8_t *p = (uint8_t const *)pp;
+    return ((uint32_t)(p[0]) + ((uint32_t)(p[1]) << 8) +
+    ((uint32_t)(p[2]) << 16) + ((uint32_t)(p[3]) << 24));
+}
+
+static inline void le32enc(void *pp, uint32_t x)
+{
+    uint8_t *p = (uint8_t *)pp;
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = (x >> 24) & 0xff;
+}
+
+// Hash up to nLanes inputs with one run of a lane-interleaved core, the
+//   lanes left over repeat the last input
+static void scrypt_blockhash_lanes(void (*core)(uint32_t *, uint32_t *), unsigned int nLanes,
+                                   uint32_t *X, uint32_t *V, const uint8_t *const *pinputs, uint256 *phashes, unsigned int n)
+{
+    uint8_t B[128];
+    for (unsigned int l = 0; l < nLanes; l++)
+    {
+        const uint8_t *input = pinputs[l < n ? l : n - 1];
+        PKCS5_PBKDF2_HMAC((const char*)input, 80, input, 80, 1, EVP_sha256(), 128, B);
+        for (unsigned int k = 0; k < 32; k++)
+            X[k * nLanes + l] = le32dec(&B[k * 4]);
+    }
+
+    core(X, V);
+
+    for (unsigned int l = 0; l < n; l++)
+    {
+        for (unsigned int k = 0; k < 32; k++)
+            le32enc(&B[k * 4], X[k * nLanes + l]);
+        phashes[l] = 0;
+        PKCS5_PBKDF2_HMAC((const char*)pinputs[l], 80, B, 128, 1, EVP_sha256(), 32, (unsigned char*)&phashes[l]);
+    }
+}
+
+void scrypt_blockhash_n(const uint8_t *const *pinputs, uint256 *phashes, unsigned int n)
+{
+    unsigned int nDone = 0;
+
+#ifdef SCRYPT_LANES_4WAY
+    // A batch pays off once most of its lanes are busy
+    unsigned int nLanes = 4;
+#ifdef USE_AVX2_SCRYPT
+    static const bool fAVX2 = scrypt_avx2_supported();
+    if (fAVX2)
+        nLanes = 8;
+#endif
+    if (n >= 3)
+    {
+        // The scalar tail below takes the same scratchpad over, X and V are
+        //   done with by then
+        uint32_t *X = (uint32_t *)scrypt_scratchpad((32 + 1024 * 32) * 4 * nLanes);
+        uint32_t *V = X + 32 * nLanes;
+#ifdef USE_AVX2_SCRYPT
+        for (; fAVX2 && n - nDone >= 6; nDone += std::min(8u, n - nDone))
+            scrypt_blockhash_lanes(scrypt_core_8way_avx2, 8, X, V, pinputs + nDone, phashes + nDone, std::min(8u, n - nDone));
+#endif
+        for (; n - nDone >= 3; nDone += std::min(4u, n - nDone))
+            scrypt_blockhash_lanes(SCRYPT_LANES_4WAY, 4, X, V, pinputs + nDone, phashes + nDone, std::min(4u, n - nDone));
+    }
+#endif
+
+    for (; nDone < n; nDone++)
+        phashes[nDone] = scrypt_blockhash(pinputs[nDone]);
+}
+
+const char *scrypt_blockhash_impl()
+{
+#ifdef USE_SSE2
+#ifdef USE_AVX2_SCRYPT
+    if (scrypt_avx2_supported())
+        return "avx2";
+#endif
+    return "sse2";
+#elif defined(SCRYPT_LANES_4WAY)
+    return "neon";
+#else
+    return "generic";
+#endif
+}
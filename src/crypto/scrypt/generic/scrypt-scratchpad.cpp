@@ -0,0 +1,87 @@
+/*
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * Per-thread scrypt scratchpads. A thread hashing many headers keeps
+ * its V array mapped and warm instead of setting up a fresh 128KB one
+ * for every hash.
+ */
+
+#include <stdlib.h>
+#ifdef WIN32
+#include <malloc.h>
+#endif
+#include <new>
+#include <boost/thread/tss.hpp>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include "scrypt.h"
+
+#ifdef MADV_HUGEPAGE
+// Large enough scratchpads, the batch ones, go on a huge page where the
+//   kernel has them, their rows are read in random order
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+#endif
+
+class CScryptScratchpad
+{
+private:
+    void *pBuffer;
+    size_t nSize;
+
+    void Free()
+    {
+#ifdef WIN32
+        _aligned_free(pBuffer);
+#else
+        free(pBuffer);
+#endif
+        pBuffer = NULL;
+        nSize = 0;
+    }
+
+public:
+    CScryptScratchpad() : pBuffer(NULL), nSize(0) {}
+    ~CScryptScratchpad() { Free(); }
+
+    void *Get(size_t nMinSize)
+    {
+        if (nMinSize <= nSize)
+            return pBuffer;
+        Free();
+#ifdef MADV_HUGEPAGE
+        if (nMinSize >= HUGE_PAGE_SIZE / 2)
+        {
+            size_t nAlloc = (nMinSize + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            if (posix_memalign(&pBuffer, HUGE_PAGE_SIZE, nAlloc) != 0)
+                pBuffer = NULL;
+            else
+            {
+                madvise(pBuffer, nAlloc, MADV_HUGEPAGE);
+                nSize = nAlloc;
+                return pBuffer;
+            }
+        }
+#endif
+#ifdef WIN32
+        pBuffer = _aligned_malloc(nMinSize, 64);
+#else
+        if (posix_memalign(&pBuffer, 64, nMinSize) != 0)
+            pBuffer = NULL;
+#endif
+        if (!pBuffer)
+            throw std::bad_alloc();
+        nSize = nMinSize;
+        return pBuffer;
+    }
+};
+
+static boost::thread_specific_ptr<CScryptScratchpad> ptrScratchpad;
+
+void *scrypt_scratchpad(size_t nSize)
+{
+    if (!ptrScratchpad.get())
+        ptrScratchpad.reset(new CScryptScratchpad());
+    return ptrScratchpad->Get(nSize);
+}
@@ -0,0 +1,85 @@
+/*
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * 8-way AVX2 implementation of the scrypt core for batch header hashing,
+ * laid out as the SSE2 one with eight lanes. It is compiled without -mavx2
+ * and only used if CPU support is detected at runtime.
+ */
+
+#include "scrypt.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+bool scrypt_avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline __m256i ROTL(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+static inline void xor_salsa8_8way(__m256i B[16], const __m256i Bx[16])
+{
+    __m256i x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+
+    for (int i = 0; i < 8; i += 2)
+    {
+#define Q(a, b, c, n) x[a] = _mm256_xor_si256(x[a], ROTL(_mm256_add_epi32(x[b], x[c]), n))
+        /* Operate on columns. */
+        Q( 4,  0, 12,  7); Q( 9,  5,  1,  7); Q(14, 10,  6,  7); Q( 3, 15, 11,  7);
+        Q( 8,  4,  0,  9); Q(13,  9,  5,  9); Q( 2, 14, 10,  9); Q( 7,  3, 15,  9);
+        Q(12,  8,  4, 13); Q( 1, 13,  9, 13); Q( 6,  2, 14, 13); Q(11,  7,  3, 13);
+        Q( 0, 12,  8, 18); Q( 5,  1, 13, 18); Q(10,  6,  2, 18); Q(15, 11,  7, 18);
+
+        /* Operate on rows. */
+        Q( 1,  0,  3,  7); Q( 6,  5,  4,  7); Q(11, 10,  9,  7); Q(12, 15, 14,  7);
+        Q( 2,  1,  0,  9); Q( 7,  6,  5,  9); Q( 8, 11, 10,  9); Q(13, 12, 15,  9);
+        Q( 3,  2,  1, 13); Q( 4,  7,  6, 13); Q( 9,  8, 11, 13); Q(14, 13, 12, 13);
+        Q( 0,  3,  2, 18); Q( 5,  4,  7, 18); Q(10,  9,  8, 18); Q(15, 14, 13, 18);
+#undef Q
+    }
+
+    for (int i = 0; i < 16; i++)
+        B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+// X holds 32 * 8 words and V 1024 * 32 * 8 words, both 32-byte aligned
+void scrypt_core_8way_avx2(uint32_t *X, uint32_t *V)
+{
+    __m256i *XV = (__m256i *)X;
+    __m256i *VV = (__m256i *)V;
+
+    for (int i = 0; i < 1024; i++)
+    {
+        for (int k = 0; k < 32; k++)
+            VV[i * 32 + k] = XV[k];
+        xor_salsa8_8way(&XV[0], &XV[16]);
+        xor_salsa8_8way(&XV[16], &XV[0]);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        // Each lane reads a row of its own
+        for (int l = 0; l < 8; l++)
+        {
+            const uint32_t *Vj = &V[(X[16 * 8 + l] & 1023) * 32 * 8 + l];
+            for (int k = 0; k < 32; k++)
+                X[k * 8 + l] ^= Vj[k * 8];
+        }
+        xor_salsa8_8way(&XV[0], &XV[16]);
+        xor_salsa8_8way(&XV[16], &XV[0]);
+    }
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * 4-way SSE2 implementation of the scrypt core for batch header hashing.
+ * Word k of lane l lives at X[k * 4 + l], each vector holds one word of
+ * all four hashes, so salsa20/8 needs no shuffles.
+ */
+
+#include <emmintrin.h>
+#include "scrypt.h"
+
+static inline __m128i ROTL(__m128i x, int n)
+{
+    return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+static inline void xor_salsa8_4way(__m128i B[16], const __m128i Bx[16])
+{
+    __m128i x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = _mm_xor_si128(B[i], Bx[i]);
+
+    for (int i = 0; i < 8; i += 2)
+    {
+#define Q(a, b, c, n) x[a] = _mm_xor_si128(x[a], ROTL(_mm_add_epi32(x[b], x[c]), n))
+        /* Operate on columns. */
+        Q( 4,  0, 12,  7); Q( 9,  5,  1,  7); Q(14, 10,  6,  7); Q( 3, 15, 11,  7);
+        Q( 8,  4,  0,  9); Q(13,  9,  5,  9); Q( 2, 14, 10,  9); Q( 7,  3, 15,  9);
+        Q(12,  8,  4, 13); Q( 1, 13,  9, 13); Q( 6,  2, 14, 13); Q(11,  7,  3, 13);
+        Q( 0, 12,  8, 18); Q( 5,  1, 13, 18); Q(10,  6,  2, 18); Q(15, 11,  7, 18);
+
+        /* Operate on rows. */
+        Q( 1,  0,  3,  7); Q( 6,  5,  4,  7); Q(11, 10,  9,  7); Q(12, 15, 14,  7);
+        Q( 2,  1,  0,  9); Q( 7,  6,  5,  9); Q( 8, 11, 10,  9); Q(13, 12, 15,  9);
+        Q( 3,  2,  1, 13); Q( 4,  7,  6, 13); Q( 9,  8, 11, 13); Q(14, 13, 12, 13);
+        Q( 0,  3,  2, 18); Q( 5,  4,  7, 18); Q(10,  9,  8, 18); Q(15, 14, 13, 18);
+#undef Q
+    }
+
+    for (int i = 0; i < 16; i++)
+        B[i] = _mm_add_epi32(B[i], x[i]);
+}
+
+// X holds 32 * 4 words and V 1024 * 32 * 4 words, both 16-byte aligned
+void scrypt_core_4way_sse2(uint32_t *X, uint32_t *V)
+{
+    __m128i *XV = (__m128i *)X;
+    __m128i *VV = (__m128i *)V;
+
+    for (int i = 0; i < 1024; i++)
+    {
+        for (int k = 0; k < 32; k++)
+            VV[i * 32 + k] = XV[k];
+        xor_salsa8_4way(&XV[0], &XV[16]);
+        xor_salsa8_4way(&XV[16], &XV[0]);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        // Each lane reads a row of its own
+        for (int l = 0; l < 4; l++)
+        {
+            const uint32_t *Vj = &V[(X[16 * 4 + l] & 1023) * 32 * 4 + l];
+            for (int k = 0; k < 32; k++)
+                X[k * 4 + l] ^= Vj[k * 4];
+        }
+        xor_salsa8_4way(&XV[0], &XV[16]);
+        xor_salsa8_4way(&XV[16], &XV[0]);
+    }
+}
@@ -101,8 +101,7 @@ static inline void xor_salsa8_sse2(__m128i B[4], const __m128i Bx[4])
 
 uint256 scrypt_blockhash(const uint8_t* input)
 {
-    uint8_t scratchpad[SCRYPT_BUFFER_SIZE];
-    __m128i *V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    __m128i *V = (__m128i *)scrypt_scratchpad(SCRYPT_BUFFER_SIZE);
 
     uint8_t B[128];
     void *const tmp = const_cast<uint8_t*>(input);
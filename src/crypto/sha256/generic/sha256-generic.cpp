@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2016 The NovaCoin developers
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * Generic SHA256 implementation of the stake kernel hashing and of the
+ * general purpose SHA256, also does the runtime selection of vectorized
+ * and hardware accelerated implementations.
+ */
+
+#include <string.h>
+#include "sha256.h"
+
+extern const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+extern const uint32_t sha256_h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#ifdef USE_SSE2
+void sha256d_kernel_4way_sse2(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint32_t hashes[][8]);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_KERNEL
+bool sha256_avx2_supported();
+void sha256d_kernel_8way_avx2(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint32_t hashes[][8]);
+void sha256d64_8way_avx2(const uint8_t *in, uint32_t hashes[][8]);
+#define USE_SHANI
+bool sha256_shani_supported();
+void sha256_transform_shani(uint32_t *s, const uint8_t *chunk, size_t blocks);
+#endif
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define USE_ARMV8_SHA2
+#include <arm_neon.h>
+#endif
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define Ch(x, y, z) ((x & (y ^ z)) ^ z)
+#define Maj(x, y, z) ((x & y) | (z & (x | y)))
+#define S0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ (x >> 3))
+#define s1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10))
+
+static inline uint32_t be32dec(const void *pp)
+{
+    const uint8_t *p = (uint8_t const *)pp;
+    return ((uint32_t)(p[3]) + ((uint32_t)(p[2]) << 8) +
+    ((uint32_t)(p[1]) << 16) + ((uint32_t)(p[0]) << 24));
+}
+
+static inline void be32enc(void *pp, uint32_t x)
+{
+    uint8_t *p = (uint8_t *)pp;
+    p[3] = x & 0xff;
+    p[2] = (x >> 8) & 0xff;
+    p[1] = (x >> 16) & 0xff;
+    p[0] = (x >> 24) & 0xff;
+}
+
+// Run rounds [nBegin, 64) of compression over the state S using message schedule W
+static void sha256_rounds(uint32_t S[8], uint32_t W[64], int nBegin)
+{
+    for (int i = 16; i < 64; i++)
+        W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+
+    uint32_t a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+    for (int i = nBegin; i < 64; i++)
+    {
+        uint32_t t1 = h + S1(e) + Ch(e, f, g) + sha256_k[i] + W[i];
+        uint32_t t2 = S0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    S[0] = a; S[1] = b; S[2] = c; S[3] = d; S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+#ifdef USE_ARMV8_SHA2
+// Four rounds with message words M
+#define QROUND(i, M) \
+    TMP0 = vaddq_u32(M, vld1q_u32(&sha256_k[4 * (i)])); \
+    TMP2 = STATE0; \
+    STATE0 = vsha256hq_u32(STATE0, STATE1, TMP0); \
+    STATE1 = vsha256h2q_u32(STATE1, TMP2, TMP0)
+
+// Schedule the words 16 after M0 from the three groups following it
+#define SCHED(M0, M1, M2, M3) M0 = vsha256su1q_u32(vsha256su0q_u32(M0, M1), M2, M3)
+
+static void sha256_transform_armv8(uint32_t *s, const uint8_t *chunk, size_t blocks)
+{
+    uint32x4_t STATE0 = vld1q_u32(&s[0]), STATE1 = vld1q_u32(&s[4]);
+    uint32x4_t ABCD_SAVE, EFGH_SAVE, TMP0, TMP2, M0, M1, M2, M3;
+
+    for (; blocks > 0; blocks--, chunk += 64)
+    {
+        ABCD_SAVE = STATE0;
+        EFGH_SAVE = STATE1;
+
+        M0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(chunk + 0)));
+        M1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(chunk + 16)));
+        M2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(chunk + 32)));
+        M3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(chunk + 48)));
+
+        QROUND(0, M0); QROUND(1, M1); QROUND(2, M2); QROUND(3, M3);
+        for (int i = 4; i < 16; i += 4)
+        {
+            SCHED(M0, M1, M2, M3); QROUND(i, M0);
+            SCHED(M1, M2, M3, M0); QROUND(i + 1, M1);
+            SCHED(M2, M3, M0, M1); QROUND(i + 2, M2);
+            SCHED(M3, M0, M1, M2); QROUND(i + 3, M3);
+        }
+
+        STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+        STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+    }
+
+    vst1q_u32(&s[0], STATE0);
+    vst1q_u32(&s[4], STATE1);
+}
+
+#undef QROUND
+#undef SCHED
+#endif
+
+static void sha256_transform_generic(uint32_t *s, const uint8_t *chunk, size_t blocks)
+{
+    uint32_t W[64], S[8];
+    for (; blocks > 0; blocks--, chunk += 64)
+    {
+        for (int i = 0; i < 16; i++)
+            W[i] = be32dec(chunk + 4 * i);
+        for (int i = 0; i < 8; i++)
+            S[i] = s[i];
+        sha256_rounds(S, W, 0);
+        for (int i = 0; i < 8; i++)
+            s[i] += S[i];
+    }
+}
+
+typedef void (*sha256_transform_fn)(uint32_t *s, const uint8_t *chunk, size_t blocks);
+
+static sha256_transform_fn sha256_select_transform()
+{
+#ifdef USE_SHANI
+    if (sha256_shani_supported())
+        return sha256_transform_shani;
+#endif
+#ifdef USE_ARMV8_SHA2
+    return sha256_transform_armv8;
+#endif
+    return sha256_transform_generic;
+}
+
+static inline void sha256_transform(uint32_t *s, const uint8_t *chunk, size_t blocks)
+{
+    static const sha256_transform_fn transform = sha256_select_transform();
+    transform(s, chunk, blocks);
+}
+
+// Whether the compression is done by the SHA instructions of the CPU
+static bool sha256_hw_transform()
+{
+    return sha256_select_transform() != sha256_transform_generic;
+}
+
+void sha256_kernel_init(sha256_kernel_ctx *ctx, const uint8_t *kernel)
+{
+    uint32_t a = sha256_h[0], b = sha256_h[1], c = sha256_h[2], d = sha256_h[3],
+             e = sha256_h[4], f = sha256_h[5], g = sha256_h[6], h = sha256_h[7];
+
+    // Message words 0..5 don't depend on timestamp, so the first six rounds are done only once
+    for (int i = 0; i < 6; i++)
+    {
+        ctx->W[i] = be32dec(kernel + 4 * i);
+
+        uint32_t t1 = h + S1(e) + Ch(e, f, g) + sha256_k[i] + ctx->W[i];
+        uint32_t t2 = S0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] = a; ctx->state[1] = b; ctx->state[2] = c; ctx->state[3] = d;
+    ctx->state[4] = e; ctx->state[5] = f; ctx->state[6] = g; ctx->state[7] = h;
+}
+
+static void sha256d_kernel_1way(const sha256_kernel_ctx *ctx, uint32_t nTimeTx, uint32_t hash[8])
+{
+    uint32_t W[64], S[8];
+
+    // First hash: 28 bytes of kernel, the padding and length
+    for (int i = 0; i < 6; i++)
+        W[i] = ctx->W[i];
+    W[6] = be32dec(&nTimeTx);
+    W[7] = 0x80000000;
+    for (int i = 8; i < 15; i++)
+        W[i] = 0;
+    W[15] = 28 * 8;
+
+    for (int i = 0; i < 8; i++)
+        S[i] = ctx->state[i];
+    sha256_rounds(S, W, 6);
+
+    // Second hash: 32 bytes of the first one, the padding and length
+    for (int i = 0; i < 8; i++)
+        W[i] = S[i] + sha256_h[i];
+    W[8] = 0x80000000;
+    for (int i = 9; i < 15; i++)
+        W[i] = 0;
+    W[15] = 32 * 8;
+
+    for (int i = 0; i < 8; i++)
+        S[i] = sha256_h[i];
+    sha256_rounds(S, W, 0);
+
+    for (int i = 0; i < 8; i++)
+        hash[i] = S[i] + sha256_h[i];
+}
+
+// The same with the SHA instructions, they do the whole 64 rounds faster
+//   than the scalar code does the last 58
+static void sha256d_kernel_1way_hw(const sha256_kernel_ctx *ctx, uint32_t nTimeTx, uint32_t hash[8])
+{
+    uint8_t block[64] = { 0 };
+    for (int i = 0; i < 6; i++)
+        be32enc(block + 4 * i, ctx->W[i]);
+    memcpy(block + 24, &nTimeTx, 4);
+    block[28] = 0x80;
+    block[63] = 28 * 8;
+
+    uint32_t S[8];
+    for (int i = 0; i < 8; i++)
+        S[i] = sha256_h[i];
+    sha256_transform(S, block, 1);
+
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < 8; i++)
+        be32enc(block + 4 * i, S[i]);
+    block[32] = 0x80;
+    block[62] = (32 * 8) >> 8;
+
+    for (int i = 0; i < 8; i++)
+        hash[i] = sha256_h[i];
+    sha256_transform(hash, block, 1);
+}
+
+void sha256d_kernel_n(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint256 *phashes, unsigned int n)
+{
+    uint32_t hashes[SHA256_KERNEL_LANES][8];
+    unsigned int nDone = 0;
+    static const bool fHW = sha256_hw_transform();
+
+#ifdef USE_SSE2
+#ifdef USE_AVX2_KERNEL
+    static const bool fAVX2 = sha256_avx2_supported();
+    if (fAVX2 && n == 8)
+    {
+        sha256d_kernel_8way_avx2(ctx, pnTimeTx, hashes);
+        nDone = 8;
+    }
+#endif
+    for (; !fHW && nDone + 4 <= n; nDone += 4)
+        sha256d_kernel_4way_sse2(ctx, pnTimeTx + nDone, hashes + nDone);
+#endif
+
+    for (; nDone < n; nDone++)
+    {
+        if (fHW)
+            sha256d_kernel_1way_hw(ctx, pnTimeTx[nDone], hashes[nDone]);
+        else
+            sha256d_kernel_1way(ctx, pnTimeTx[nDone], hashes[nDone]);
+    }
+
+    // Convert state words into the byte order of SHA256() output
+    for (unsigned int i = 0; i < n; i++)
+        for (int j = 0; j < 8; j++)
+            be32enc((uint8_t *)&phashes[i] + 4 * j, hashes[i][j]);
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+    for (int i = 0; i < 8; i++)
+        ctx->state[i] = sha256_h[i];
+    ctx->nBytes = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t nBuffered = ctx->nBytes % 64;
+    ctx->nBytes += len;
+
+    if (nBuffered > 0)
+    {
+        size_t nCopy = 64 - nBuffered < len ? 64 - nBuffered : len;
+        memcpy(ctx->buf + nBuffered, p, nCopy);
+        p += nCopy;
+        len -= nCopy;
+        if (nBuffered + nCopy < 64)
+            return;
+        sha256_transform(ctx->state, ctx->buf, 1);
+    }
+
+    // Whole blocks straight from the input
+    if (len >= 64)
+    {
+        sha256_transform(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    if (len > 0)
+        memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t *hash)
+{
+    static const uint8_t pad[64] = { 0x80 };
+    uint8_t sizedesc[8];
+    uint64_t nBits = ctx->nBytes << 3;
+    be32enc(sizedesc, (uint32_t)(nBits >> 32));
+    be32enc(sizedesc + 4, (uint32_t)nBits);
+
+    sha256_update(ctx, pad, 1 + ((119 - (ctx->nBytes % 64)) % 64));
+    sha256_update(ctx, sizedesc, 8);
+
+    for (int i = 0; i < 8; i++)
+        be32enc(hash + 4 * i, ctx->state[i]);
+}
+
+void sha256(const void *data, size_t len, uint8_t *hash)
+{
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, hash);
+}
+
+static void sha256d64_1way(uint8_t *out, const uint8_t *in)
+{
+    // Padding block of a 64-byte message, and the one of a 32-byte digest
+    //   with the digest written in front of it
+    static const uint8_t pad64[64] = { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0 };
+    uint8_t buf[64] = { 0 };
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+
+    uint32_t S[8];
+    for (int i = 0; i < 8; i++)
+        S[i] = sha256_h[i];
+    sha256_transform(S, in, 1);
+    sha256_transform(S, pad64, 1);
+    for (int i = 0; i < 8; i++)
+        be32enc(buf + 4 * i, S[i]);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = sha256_h[i];
+    sha256_transform(S, buf, 1);
+    for (int i = 0; i < 8; i++)
+        be32enc(out + 4 * i, S[i]);
+}
+
+void sha256d64(uint8_t *out, const uint8_t *in, size_t n)
+{
+#ifdef USE_AVX2_KERNEL
+    // The SHA extensions are faster than eight AVX2 lanes
+    static const bool fAVX2 = sha256_avx2_supported() && !sha256_shani_supported();
+    if (fAVX2)
+    {
+        uint32_t hashes[8][8];
+        for (; n >= 8; n -= 8, in += 8 * 64)
+        {
+            sha256d64_8way_avx2(in, hashes);
+            for (int i = 0; i < 8; i++, out += 32)
+                for (int j = 0; j < 8; j++)
+                    be32enc(out + 4 * j, hashes[i][j]);
+        }
+    }
+#endif
+
+    for (; n > 0; n--, in += 64, out += 32)
+        sha256d64_1way(out, in);
+}
+
+const char *sha256_impl()
+{
+#ifdef USE_SHANI
+    if (sha256_shani_supported())
+        return "shani";
+#endif
+#ifdef USE_ARMV8_SHA2
+    return "armv8";
+#endif
+#ifdef USE_AVX2_KERNEL
+    if (sha256_avx2_supported())
+        return "generic, avx2 for merkle nodes";
+#endif
+    return "generic";
+}
+
+const char *sha256_kernel_impl()
+{
+#ifdef USE_SSE2
+#ifdef USE_AVX2_KERNEL
+    if (sha256_avx2_supported())
+        return sha256_hw_transform() ? "avx2 and shani" : "avx2";
+    if (sha256_hw_transform())
+        return "shani";
+#endif
+    return "sse2";
+#else
+    return sha256_hw_transform() ? sha256_impl() : "generic";
+#endif
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2016 The NovaCoin developers
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * 8-way AVX2 implementation of the stake kernel and merkle node hashing.
+ * It is compiled without -mavx2 and only used if CPU support is detected
+ * at runtime.
+ */
+
+#include "sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+bool sha256_avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+extern const uint32_t sha256_k[64];
+extern const uint32_t sha256_h[8];
+
+static inline __m256i ROTR(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+static inline __m256i Ch(__m256i x, __m256i y, __m256i z)
+{
+    return _mm256_xor_si256(_mm256_and_si256(x, _mm256_xor_si256(y, z)), z);
+}
+
+static inline __m256i Maj(__m256i x, __m256i y, __m256i z)
+{
+    return _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)));
+}
+
+static inline __m256i S0(__m256i x) { return _mm256_xor_si256(ROTR(x, 2), _mm256_xor_si256(ROTR(x, 13), ROTR(x, 22))); }
+static inline __m256i S1(__m256i x) { return _mm256_xor_si256(ROTR(x, 6), _mm256_xor_si256(ROTR(x, 11), ROTR(x, 25))); }
+static inline __m256i s0(__m256i x) { return _mm256_xor_si256(ROTR(x, 7), _mm256_xor_si256(ROTR(x, 18), _mm256_srli_epi32(x, 3))); }
+static inline __m256i s1(__m256i x) { return _mm256_xor_si256(ROTR(x, 17), _mm256_xor_si256(ROTR(x, 19), _mm256_srli_epi32(x, 10))); }
+
+static inline __m256i add4(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+    return _mm256_add_epi32(_mm256_add_epi32(a, b), _mm256_add_epi32(c, d));
+}
+
+static void sha256_rounds_8way(__m256i S[8], __m256i W[64], int nBegin)
+{
+    for (int i = 16; i < 64; i++)
+        W[i] = add4(s1(W[i - 2]), W[i - 7], s0(W[i - 15]), W[i - 16]);
+
+    __m256i a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+    for (int i = nBegin; i < 64; i++)
+    {
+        __m256i t1 = _mm256_add_epi32(add4(h, S1(e), Ch(e, f, g), _mm256_set1_epi32(sha256_k[i])), W[i]);
+        __m256i t2 = _mm256_add_epi32(S0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+    S[0] = a; S[1] = b; S[2] = c; S[3] = d; S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+static inline uint32_t bswap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+void sha256d_kernel_8way_avx2(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint32_t hashes[][8])
+{
+    __m256i W[64], S[8];
+
+    // First hash: 28 bytes of kernel, the padding and length
+    for (int i = 0; i < 6; i++)
+        W[i] = _mm256_set1_epi32(ctx->W[i]);
+    W[6] = _mm256_set_epi32(bswap32(pnTimeTx[7]), bswap32(pnTimeTx[6]), bswap32(pnTimeTx[5]), bswap32(pnTimeTx[4]),
+                            bswap32(pnTimeTx[3]), bswap32(pnTimeTx[2]), bswap32(pnTimeTx[1]), bswap32(pnTimeTx[0]));
+    W[7] = _mm256_set1_epi32(0x80000000);
+    for (int i = 8; i < 15; i++)
+        W[i] = _mm256_setzero_si256();
+    W[15] = _mm256_set1_epi32(28 * 8);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm256_set1_epi32(ctx->state[i]);
+    sha256_rounds_8way(S, W, 6);
+
+    // Second hash: 32 bytes of the first one, the padding and length
+    for (int i = 0; i < 8; i++)
+        W[i] = _mm256_add_epi32(S[i], _mm256_set1_epi32(sha256_h[i]));
+    W[8] = _mm256_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        W[i] = _mm256_setzero_si256();
+    W[15] = _mm256_set1_epi32(32 * 8);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm256_set1_epi32(sha256_h[i]);
+    sha256_rounds_8way(S, W, 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(S[i], _mm256_set1_epi32(sha256_h[i])));
+        for (int j = 0; j < 8; j++)
+            hashes[j][i] = lanes[j];
+    }
+}
+
+// Double SHA256 of eight 64-byte inputs, the merkle tree node pairs
+void sha256d64_8way_avx2(const uint8_t *in, uint32_t hashes[][8])
+{
+    __m256i W[64], S[8], T[8];
+    const uint32_t *pIn = (const uint32_t *)in;
+
+    // First hash, message block: the 64 bytes of every input
+    for (int i = 0; i < 16; i++)
+        W[i] = _mm256_set_epi32(bswap32(pIn[7 * 16 + i]), bswap32(pIn[6 * 16 + i]), bswap32(pIn[5 * 16 + i]), bswap32(pIn[4 * 16 + i]),
+                                bswap32(pIn[3 * 16 + i]), bswap32(pIn[2 * 16 + i]), bswap32(pIn[1 * 16 + i]), bswap32(pIn[0 * 16 + i]));
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm256_set1_epi32(sha256_h[i]);
+    sha256_rounds_8way(S, W, 0);
+    for (int i = 0; i < 8; i++)
+        T[i] = S[i] = _mm256_add_epi32(S[i], _mm256_set1_epi32(sha256_h[i]));
+
+    // Padding block with the length of 64 bytes
+    W[0] = _mm256_set1_epi32(0x80000000);
+    for (int i = 1; i < 15; i++)
+        W[i] = _mm256_setzero_si256();
+    W[15] = _mm256_set1_epi32(64 * 8);
+    sha256_rounds_8way(S, W, 0);
+
+    // Second hash: 32 bytes of the first one, the padding and length
+    for (int i = 0; i < 8; i++)
+        W[i] = _mm256_add_epi32(S[i], T[i]);
+    W[8] = _mm256_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        W[i] = _mm256_setzero_si256();
+    W[15] = _mm256_set1_epi32(32 * 8);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm256_set1_epi32(sha256_h[i]);
+    sha256_rounds_8way(S, W, 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(S[i], _mm256_set1_epi32(sha256_h[i])));
+        for (int j = 0; j < 8; j++)
+            hashes[j][i] = lanes[j];
+    }
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * SHA256 compression with the x86 SHA extensions. It is compiled without
+ * -msha and only used if CPU support is detected at runtime.
+ */
+
+#include "sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+
+bool sha256_shani_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid(1, eax, ebx, ecx, edx);
+    bool fSSE41 = (ecx & bit_SSE4_1) != 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return fSSE41 && (ebx & (1 << 29)) != 0;
+}
+
+#pragma GCC push_options
+#pragma GCC target("sha,sse4.1")
+#include <immintrin.h>
+
+extern const uint32_t sha256_k[64];
+
+// Four rounds with message words M, two per sha256rnds2
+#define QROUND(i, M) \
+    MSG = _mm_add_epi32(M, _mm_loadu_si128((const __m128i *)&sha256_k[4 * (i)])); \
+    STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG); \
+    MSG = _mm_shuffle_epi32(MSG, 0x0E); \
+    STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG)
+
+// First half of the schedule of the words 16 after A
+#define MSG1(A, B) A = _mm_sha256msg1_epu32(A, B)
+
+// Finish the words M from the two groups before it
+#define MSG2(M, P1, P2) M = _mm_sha256msg2_epu32(_mm_add_epi32(M, _mm_alignr_epi8(P1, P2, 4)), P1)
+
+void sha256_transform_shani(uint32_t *s, const uint8_t *chunk, size_t blocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i STATE0, STATE1, MSG, TMP, M0, M1, M2, M3, ABEF_SAVE, CDGH_SAVE;
+
+    // The instructions work on ABEF and CDGH halves of the state
+    TMP = _mm_loadu_si128((const __m128i *)&s[0]);
+    STATE1 = _mm_loadu_si128((const __m128i *)&s[4]);
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+    for (; blocks > 0; blocks--, chunk += 64)
+    {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(chunk + 0)), MASK);
+        M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(chunk + 16)), MASK);
+        M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(chunk + 32)), MASK);
+        M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(chunk + 48)), MASK);
+
+        // The next group is finished before msg1 overwrites the one it reads
+        QROUND(0, M0);
+        QROUND(1, M1); MSG1(M0, M1);
+        QROUND(2, M2); MSG1(M1, M2);
+        QROUND(3, M3); MSG2(M0, M3, M2); MSG1(M2, M3);
+        for (int i = 4; i < 12; i += 4)
+        {
+            QROUND(i, M0); MSG2(M1, M0, M3); MSG1(M3, M0);
+            QROUND(i + 1, M1); MSG2(M2, M1, M0); MSG1(M0, M1);
+            QROUND(i + 2, M2); MSG2(M3, M2, M1); MSG1(M1, M2);
+            QROUND(i + 3, M3); MSG2(M0, M3, M2); MSG1(M2, M3);
+        }
+        QROUND(12, M0); MSG2(M1, M0, M3); MSG1(M3, M0);
+        QROUND(13, M1); MSG2(M2, M1, M0);
+        QROUND(14, M2); MSG2(M3, M2, M1);
+        QROUND(15, M3);
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+    _mm_storeu_si128((__m128i *)&s[0], STATE0);
+    _mm_storeu_si128((__m128i *)&s[4], STATE1);
+}
+
+#undef QROUND
+#undef MSG1
+#undef MSG2
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2016 The NovaCoin developers
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ *
+ * 4-way SSE2 implementation of the stake kernel hashing.
+ */
+
+#include <emmintrin.h>
+#include "sha256.h"
+
+extern const uint32_t sha256_k[64];
+extern const uint32_t sha256_h[8];
+
+static inline __m128i ROTR(__m128i x, int n)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n));
+}
+
+static inline __m128i Ch(__m128i x, __m128i y, __m128i z)
+{
+    return _mm_xor_si128(_mm_and_si128(x, _mm_xor_si128(y, z)), z);
+}
+
+static inline __m128i Maj(__m128i x, __m128i y, __m128i z)
+{
+    return _mm_or_si128(_mm_and_si128(x, y), _mm_and_si128(z, _mm_or_si128(x, y)));
+}
+
+static inline __m128i S0(__m128i x) { return _mm_xor_si128(ROTR(x, 2), _mm_xor_si128(ROTR(x, 13), ROTR(x, 22))); }
+static inline __m128i S1(__m128i x) { return _mm_xor_si128(ROTR(x, 6), _mm_xor_si128(ROTR(x, 11), ROTR(x, 25))); }
+static inline __m128i s0(__m128i x) { return _mm_xor_si128(ROTR(x, 7), _mm_xor_si128(ROTR(x, 18), _mm_srli_epi32(x, 3))); }
+static inline __m128i s1(__m128i x) { return _mm_xor_si128(ROTR(x, 17), _mm_xor_si128(ROTR(x, 19), _mm_srli_epi32(x, 10))); }
+
+static inline __m128i add4(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    return _mm_add_epi32(_mm_add_epi32(a, b), _mm_add_epi32(c, d));
+}
+
+static void sha256_rounds_4way(__m128i S[8], __m128i W[64], int nBegin)
+{
+    for (int i = 16; i < 64; i++)
+        W[i] = add4(s1(W[i - 2]), W[i - 7], s0(W[i - 15]), W[i - 16]);
+
+    __m128i a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+    for (int i = nBegin; i < 64; i++)
+    {
+        __m128i t1 = _mm_add_epi32(add4(h, S1(e), Ch(e, f, g), _mm_set1_epi32(sha256_k[i])), W[i]);
+        __m128i t2 = _mm_add_epi32(S0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = _mm_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm_add_epi32(t1, t2);
+    }
+    S[0] = a; S[1] = b; S[2] = c; S[3] = d; S[4] = e; S[5] = f; S[6] = g; S[7] = h;
+}
+
+static inline uint32_t bswap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+void sha256d_kernel_4way_sse2(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint32_t hashes[][8])
+{
+    __m128i W[64], S[8];
+
+    // First hash: 28 bytes of kernel, the padding and length
+    for (int i = 0; i < 6; i++)
+        W[i] = _mm_set1_epi32(ctx->W[i]);
+    W[6] = _mm_set_epi32(bswap32(pnTimeTx[3]), bswap32(pnTimeTx[2]), bswap32(pnTimeTx[1]), bswap32(pnTimeTx[0]));
+    W[7] = _mm_set1_epi32(0x80000000);
+    for (int i = 8; i < 15; i++)
+        W[i] = _mm_setzero_si128();
+    W[15] = _mm_set1_epi32(28 * 8);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm_set1_epi32(ctx->state[i]);
+    sha256_rounds_4way(S, W, 6);
+
+    // Second hash: 32 bytes of the first one, the padding and length
+    for (int i = 0; i < 8; i++)
+        W[i] = _mm_add_epi32(S[i], _mm_set1_epi32(sha256_h[i]));
+    W[8] = _mm_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        W[i] = _mm_setzero_si128();
+    W[15] = _mm_set1_epi32(32 * 8);
+
+    for (int i = 0; i < 8; i++)
+        S[i] = _mm_set1_epi32(sha256_h[i]);
+    sha256_rounds_4way(S, W, 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(S[i], _mm_set1_epi32(sha256_h[i])));
+        for (int j = 0; j < 4; j++)
+            hashes[j][i] = lanes[j];
+    }
+}
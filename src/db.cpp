@@ -242,8 +242,89 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 }
 
 
+bool CDBEnv::BatchBegin(const std::string& strFile)
+{
+    LOCK(cs_db);
+    if (!fDbEnvInit)
+        return false;
+    std::map<std::string, CBatch>::iterator mi = mapBatch.find(strFile);
+    if (mi != mapBatch.end())
+    {
+        mi->second.nDepth++;
+        return true;
+    }
+    CBatch batch;
+    batch.ptxn = TxnBegin();
+    if (!batch.ptxn)
+        return false;
+    batch.nDepth = 1;
+    batch.nChildren = 0;
+    mapBatch[strFile] = batch;
+    return true;
+}
+
+bool CDBEnv::BatchEnd(const std::string& strFile)
+{
+    {
+        LOCK(cs_db);
+        std::map<std::string, CBatch>::iterator mi = mapBatch.find(strFile);
+        if (mi == mapBatch.end())
+            return false;
+        if (--mi->second.nDepth > 0)
+            return true;
+        if (mi->second.nChildren > 0)
+        {
+            // Can't happen with the handles of the batch owner, as they are gone by now
+            printf("CDBEnv::BatchEnd() : %d transactions still open on %s\n", mi->second.nChildren, strFile.c_str());
+        }
+        int ret = mi->second.ptxn->commit(0);
+        mapBatch.erase(mi);
+        if (ret != 0)
+            return error("CDBEnv::BatchEnd() : commit of %s failed, error %d", strFile.c_str(), ret);
+    }
+    dbenv.txn_checkpoint(0, 0, 0);
+    return true;
+}
+
+bool CDBEnv::BatchFlush(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CBatch>::iterator mi = mapBatch.find(strFile);
+    if (mi == mapBatch.end() || mi->second.nDepth > 1 || mi->second.nChildren > 0)
+        return false;
+    DbTxn* ptxn = TxnBegin();
+    if (!ptxn)
+        return false;
+    int ret = mi->second.ptxn->commit(0);
+    mi->second.ptxn = ptxn;
+    if (ret != 0)
+        return error("CDBEnv::BatchFlush() : commit of %s failed, error %d", strFile.c_str(), ret);
+    return true;
+}
+
+DbTxn* CDBEnv::GetBatchTxn(const std::string& strFile, bool fChild)
+{
+    LOCK(cs_db);
+    if (mapBatch.empty())
+        return NULL;
+    std::map<std::string, CBatch>::iterator mi = mapBatch.find(strFile);
+    if (mi == mapBatch.end())
+        return NULL;
+    if (fChild)
+        mi->second.nChildren++;
+    return mi->second.ptxn;
+}
+
+void CDBEnv::ReleaseBatchChild(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CBatch>::iterator mi = mapBatch.find(strFile);
+    if (mi != mapBatch.end())
+        mi->second.nChildren--;
+}
+
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), fBatchChild(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -318,10 +399,18 @@ void CDB::Close()
     if (!pdb)
         return;
     if (activeTxn)
-        activeTxn->abort();
+        TxnAbort();
     activeTxn = NULL;
     pdb = NULL;
 
+    // An open batch is checkpointed once, when it ends
+    if (bitdb.GetBatchTxn(strFile))
+    {
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -527,8 +616,11 @@ bool CAddrDB::Write(const CAddrMan& addr)
     RAND_bytes((unsigned char *)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
+    // serialize addresses, checksum data up to that point, then append csum.
+    // Only the serialization holds addrman's lock, into a buffer big enough
+    // that it isn't reallocated meanwhile; the rest works on this snapshot.
     CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.reserve(addr.size() * ADDRMAN_SERIALIZED_ENTRY_SIZE + ADDRMAN_NEW_BUCKET_COUNT * sizeof(int) + 1024);
     ssPeers << FLATDATA(pchMessageStart);
     ssPeers << addr;
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
@@ -571,13 +663,14 @@ bool CAddrDB::Read(CAddrMan& addr)
     int dataSize = fileSize - sizeof(uint256);
     //Don't try to resize to a negative number if file is small
     if ( dataSize < 0 ) dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
     uint256 hashIn;
 
-    // read data and checksum from file
+    // read data and checksum from file, straight into the stream
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.resize(dataSize);
     try {
-        filein.read((char *)&vchData[0], dataSize);
+        if (dataSize > 0)
+            filein.read(&ssPeers[0], dataSize);
         filein >> hashIn;
     }
     catch (const std::exception&) {
@@ -585,8 +678,6 @@ bool CAddrDB::Read(CAddrMan& addr)
     }
     filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
     if (hashIn != hashTmp)
@@ -611,3 +702,97 @@ bool CAddrDB::Read(CAddrMan& addr)
     return true;
 }
 
+
+//
+// CMempoolDB
+//
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+CMempoolDB::CMempoolDB()
+{
+    pathMempool = GetDataDir() / "mempool.dat";
+}
+
+bool CMempoolDB::Write(const std::vector<std::pair<CTransaction, int64_t> >& vTx)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mempool.dat.%04x", randv);
+
+    // serialize transactions, checksum data up to that point, then append csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << MEMPOOL_DUMP_VERSION;
+    ssMempool << vTx;
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CMempoolDB::Write() : open failed");
+
+    try {
+        fileout << ssMempool;
+    }
+    catch (const std::exception&) {
+        return error("CMempoolDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace existing mempool.dat, if any, with new mempool.dat.XXXX
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("CMempoolDB::Write() : Rename-into-place failed");
+
+    return true;
+}
+
+bool CMempoolDB::Read(std::vector<std::pair<CTransaction, int64_t> >& vTx)
+{
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CMempoolDB::Read() : open failed");
+
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0) dataSize = 0;
+    uint256 hashIn;
+
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool.resize(dataSize);
+    try {
+        if (dataSize > 0)
+            filein.read(&ssMempool[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (const std::exception&) {
+        return error("CMempoolDB::Read() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    if (hashIn != Hash(ssMempool.begin(), ssMempool.end()))
+        return error("CMempoolDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CMempoolDB::Read() : invalid network magic number");
+        ssMempool >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("CMempoolDB::Read() : unknown version %d", nVersion);
+        ssMempool >> vTx;
+    }
+    catch (const std::exception&) {
+        return error("CMempoolDB::Read() : I/O error or stream data corrupted");
+    }
+
+    return true;
+}
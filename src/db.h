@@ -26,6 +26,10 @@ class CWalletTx;
 
 extern unsigned int nWalletDBUpdated;
 
+// Count a wallet write and wake ThreadFlushWalletDB
+void MarkWalletDBUpdated();
+// Wake ThreadFlushWalletDB up, so it notices the shutdown
+void InterruptFlushWalletDB();
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 bool DumpWallet(CWallet* pwallet, const std::string& strDest);
@@ -81,14 +85,35 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
-    DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
+    DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC, DbTxn *parent=NULL)
     {
         DbTxn* ptxn = NULL;
-        int ret = dbenv.txn_begin(NULL, &ptxn, flags);
+        int ret = dbenv.txn_begin(parent, &ptxn, flags);
         if (!ptxn || ret != 0)
             return NULL;
         return ptxn;
     }
+
+    /*
+     * Write batches: while a batch is open on a file, the writes made to it through
+     * any handle go to the batch transaction, which is committed once, with a single
+     * checkpoint, when the outermost batch ends. Handle transactions become children
+     * of the batch one. Batches nest, only BatchFlush of the outermost one commits
+     * early, at points where the caller holds no cursor.
+     */
+    struct CBatch
+    {
+        DbTxn* ptxn;
+        int nDepth;
+        int nChildren;
+    };
+    std::map<std::string, CBatch> mapBatch;
+
+    bool BatchBegin(const std::string& strFile);
+    bool BatchEnd(const std::string& strFile);
+    bool BatchFlush(const std::string& strFile);
+    DbTxn* GetBatchTxn(const std::string& strFile, bool fChild=false);
+    void ReleaseBatchChild(const std::string& strFile);
 };
 
 extern CDBEnv bitdb;
@@ -101,6 +126,7 @@ protected:
     Db* pdb;
     std::string strFile;
     DbTxn *activeTxn;
+    bool fBatchChild; // activeTxn is a child of the batch transaction of the file
     bool fReadOnly;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
@@ -111,6 +137,8 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    DbTxn* GetTxn() { return activeTxn ? activeTxn : bitdb.GetBatchTxn(strFile); }
+
 protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
@@ -120,31 +148,32 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         Dbt datKey(&ssKey[0], (uint32_t)ssKey.size());
 
         // Read
         Dbt datValue;
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
+        int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
         memset(datKey.get_data(), 0, datKey.get_size());
         if (datValue.get_data() == NULL)
             return false;
 
         // Unserialize value
+        bool fOk = (ret == 0);
         try {
-            CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
+            CMemoryReader ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
         catch (const std::exception&) {
-            return false;
+            fOk = false;
         }
 
         // Clear and free memory
         memset(datValue.get_data(), 0, datValue.get_size());
         free(datValue.get_data());
-        return (ret == 0);
+        return fOk;
     }
 
     template<typename K, typename T>
@@ -157,18 +186,18 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         Dbt datKey(&ssKey[0], (uint32_t)ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
+        ssValue.reserve(ssValue.GetSerializeSize(value));
         ssValue << value;
         Dbt datValue(&ssValue[0], (uint32_t)ssValue.size());
 
         // Write
-        int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
 
         // Clear memory in case it was a private key
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -186,12 +215,12 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         Dbt datKey(&ssKey[0], (uint32_t)ssKey.size());
 
         // Erase
-        int ret = pdb->del(activeTxn, &datKey, 0);
+        int ret = pdb->del(GetTxn(), &datKey, 0);
 
         // Clear memory
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -206,12 +235,12 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         Dbt datKey(&ssKey[0], (uint32_t)ssKey.size());
 
         // Exists
-        int ret = pdb->exists(activeTxn, &datKey, 0);
+        int ret = pdb->exists(GetTxn(), &datKey, 0);
 
         // Clear memory
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -223,7 +252,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(GetTxn(), &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -273,10 +302,16 @@ public:
     {
         if (!pdb || activeTxn)
             return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
+        DbTxn* parent = bitdb.GetBatchTxn(strFile, true);
+        DbTxn* ptxn = bitdb.TxnBegin(DB_TXN_WRITE_NOSYNC, parent);
         if (!ptxn)
+        {
+            if (parent)
+                bitdb.ReleaseBatchChild(strFile);
             return false;
+        }
         activeTxn = ptxn;
+        fBatchChild = (parent != NULL);
         return true;
     }
 
@@ -286,6 +321,9 @@ public:
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
+        if (fBatchChild)
+            bitdb.ReleaseBatchChild(strFile);
+        fBatchChild = false;
         return (ret == 0);
     }
 
@@ -295,6 +333,9 @@ public:
             return false;
         int ret = activeTxn->abort();
         activeTxn = NULL;
+        if (fBatchChild)
+            bitdb.ReleaseBatchChild(strFile);
+        fBatchChild = false;
         return (ret == 0);
     }
 
@@ -324,4 +365,16 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Access to the memory pool dump (mempool.dat): transactions with the time
+ * they entered the pool, parents before children */
+class CMempoolDB
+{
+private:
+    boost::filesystem::path pathMempool;
+public:
+    CMempoolDB();
+    bool Write(const std::vector<std::pair<CTransaction, int64_t> >& vTx);
+    bool Read(std::vector<std::pair<CTransaction, int64_t> >& vTx);
+};
+
 #endif // BITCOIN_DB_H
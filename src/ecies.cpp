@@ -112,7 +112,7 @@ static EC_KEY * ecies_key_create(const EC_KEY *user, char *error) {
     return key;
 }
 
-static unsigned char *prepare_envelope_key(const ies_ctx_t *ctx, cryptogram_t *cryptogram, char *error)
+static unsigned char *prepare_envelope_key(const ies_ctx_t *ctx, unsigned char *key_data, char *error)
 {
 
     const size_t key_buf_len = envelope_key_len(ctx);
@@ -158,7 +158,7 @@ static unsigned char *prepare_envelope_key(const ies_ctx_t *ctx, cryptogram_t *c
         EC_KEY_get0_group(ephemeral),
         EC_KEY_get0_public_key(ephemeral),
         POINT_CONVERSION_COMPRESSED,
-        cryptogram_key_data(cryptogram),
+        key_data,
         ctx->stored_key_length,
         NULL);
     if (written_length == 0) {
@@ -230,6 +230,7 @@ static int store_cipher_body(
         EVP_CIPHER_CTX_cleanup(&cipher);
         return 0;
     }
+    len_sum += out_len;
 
     EVP_CIPHER_CTX_cleanup(&cipher);
 
@@ -286,15 +287,16 @@ cryptogram_t * ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, si
         return NULL;
     }
 
+    /* The padding adds a whole block to the data that fills the last one */
     cryptogram = cryptogram_alloc(ctx->stored_key_length,
                                   mac_length,
-                                  length + (length % block_length ? (block_length - (length % block_length)) : 0));
+                                  length + block_length - (length % block_length));
     if (!cryptogram) {
         SET_ERROR("Unable to allocate a cryptogram_t buffer to hold the encrypted result.");
         goto err;
     }
 
-    if ((envelope_key = prepare_envelope_key(ctx, cryptogram, error)) == NULL) {
+    if ((envelope_key = prepare_envelope_key(ctx, cryptogram_key_data(cryptogram), error)) == NULL) {
         goto err;
     }
 
@@ -321,7 +323,7 @@ cryptogram_t * ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, si
     return NULL;
 }
 
-static EC_KEY *ecies_key_create_public_octets(EC_KEY *user, unsigned char *octets, size_t length, char *error) {
+static EC_KEY *ecies_key_create_public_octets(EC_KEY *user, const unsigned char *octets, size_t length, char *error) {
 
     EC_KEY *key = NULL;
     EC_POINT *point = NULL;
@@ -374,7 +376,7 @@ static EC_KEY *ecies_key_create_public_octets(EC_KEY *user, unsigned char *octet
     return key;
 }
 
-unsigned char *restore_envelope_key(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, char *error)
+unsigned char *restore_envelope_key(const ies_ctx_t *ctx, const unsigned char *key_data, size_t key_length, char *error)
 {
 
     const size_t key_buf_len = envelope_key_len(ctx);
@@ -397,7 +399,7 @@ unsigned char *restore_envelope_key(const ies_ctx_t *ctx, const cryptogram_t *cr
         goto err;
     }
 
-    if (!(ephemeral = ecies_key_create_public_octets(user_copy, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), error))) {
+    if (!(ephemeral = ecies_key_create_public_octets(user_copy, key_data, key_length, error))) {
         goto err;
     }
 
@@ -533,7 +535,7 @@ unsigned char * ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogr
         goto err;
     }
 
-    envelope_key = restore_envelope_key(ctx, cryptogram, error);
+    envelope_key = restore_envelope_key(ctx, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), error);
     if (envelope_key == NULL) {
         goto err;
     }
@@ -553,6 +555,184 @@ unsigned char * ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogr
     return output;
 }
 
+void ies_stream_init(ies_stream_t *stream, const ies_ctx_t *ctx)
+{
+    stream->ctx = ctx;
+    EVP_CIPHER_CTX_init(&stream->cipher);
+    HMAC_CTX_init(&stream->hmac);
+    stream->tail_length = 0;
+}
+
+void ies_stream_cleanup(ies_stream_t *stream)
+{
+    EVP_CIPHER_CTX_cleanup(&stream->cipher);
+    HMAC_CTX_cleanup(&stream->hmac);
+    OPENSSL_cleanse(stream->tail, sizeof(stream->tail));
+}
+
+/* Keys the cipher and the MAC of the stream for the next message */
+static int stream_set_key(ies_stream_t *stream, const unsigned char *envelope_key, int encrypt, char *error)
+{
+    const ies_ctx_t *ctx = stream->ctx;
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+
+    /* For now we use an empty initialization vector. */
+    memset(iv, 0, EVP_MAX_IV_LENGTH);
+
+    if (EVP_CipherInit_ex(&stream->cipher, ctx->cipher, NULL, envelope_key, iv, encrypt) != 1) {
+        SET_OSSL_ERROR("Unable to initialize the symmetric cipher");
+        return 0;
+    }
+
+    if (HMAC_Init_ex(&stream->hmac, envelope_key + EVP_CIPHER_key_length(ctx->cipher), EVP_MD_size(ctx->md), ctx->md, NULL) != 1) {
+        SET_OSSL_ERROR("Unable to initialize the MAC");
+        return 0;
+    }
+
+    stream->tail_length = 0;
+    return 1;
+}
+
+int ecies_encrypt_begin(ies_stream_t *stream, unsigned char *key_data, char *error)
+{
+    unsigned char *envelope_key;
+    int ret;
+
+    if ((envelope_key = prepare_envelope_key(stream->ctx, key_data, error)) == NULL)
+        return 0;
+
+    ret = stream_set_key(stream, envelope_key, 1, error);
+
+    OPENSSL_cleanse(envelope_key, envelope_key_len(stream->ctx));
+    OPENSSL_free(envelope_key);
+    return ret;
+}
+
+int ecies_encrypt_update(ies_stream_t *stream, const unsigned char *data, size_t length, unsigned char *out, size_t *out_length, char *error)
+{
+    int out_len;
+
+    if (EVP_EncryptUpdate(&stream->cipher, out, &out_len, data, length) != 1
+        || HMAC_Update(&stream->hmac, out, out_len) != 1) {
+        SET_OSSL_ERROR("Error while trying to secure the data using the symmetric cipher");
+        return 0;
+    }
+
+    *out_length = out_len;
+    return 1;
+}
+
+int ecies_encrypt_end(ies_stream_t *stream, unsigned char *out, size_t *out_length, char *error)
+{
+    int out_len;
+    unsigned int mac_len;
+
+    if (EVP_EncryptFinal_ex(&stream->cipher, out, &out_len) != 1
+        || HMAC_Update(&stream->hmac, out, out_len) != 1) {
+        SET_OSSL_ERROR("Error while finalizing the data using the symmetric cipher");
+        return 0;
+    }
+
+    if (HMAC_Final(&stream->hmac, out + out_len, &mac_len) != 1) {
+        SET_OSSL_ERROR("Unable to generate tag");
+        return 0;
+    }
+
+    *out_length = out_len + mac_len;
+    return 1;
+}
+
+int ecies_decrypt_begin(ies_stream_t *stream, const unsigned char *key_data, size_t key_length, char *error)
+{
+    unsigned char *envelope_key;
+    int ret;
+
+    if ((envelope_key = restore_envelope_key(stream->ctx, key_data, key_length, error)) == NULL)
+        return 0;
+
+    ret = stream_set_key(stream, envelope_key, 0, error);
+
+    OPENSSL_cleanse(envelope_key, envelope_key_len(stream->ctx));
+    OPENSSL_free(envelope_key);
+    return ret;
+}
+
+/* Authenticates and decrypts a piece of the body */
+static int stream_decrypt_body(ies_stream_t *stream, const unsigned char *data, size_t length, unsigned char *out, size_t *out_length, char *error)
+{
+    int out_len;
+
+    if (length == 0)
+        return 1;
+
+    if (HMAC_Update(&stream->hmac, data, length) != 1
+        || EVP_DecryptUpdate(&stream->cipher, out + *out_length, &out_len, data, length) != 1) {
+        SET_OSSL_ERROR("Unable to decrypt");
+        return 0;
+    }
+
+    *out_length += out_len;
+    return 1;
+}
+
+int ecies_decrypt_update(ies_stream_t *stream, const unsigned char *data, size_t length, unsigned char *out, size_t *out_length, char *error)
+{
+    const size_t mac_length = EVP_MD_size(stream->ctx->md);
+    size_t total = stream->tail_length + length, body, from_tail;
+
+    *out_length = 0;
+
+    /* The body ends where the message does, so the last mac_length bytes
+     * are held back until more data shows they are not the tag */
+    if (total <= mac_length) {
+        memcpy(stream->tail + stream->tail_length, data, length);
+        stream->tail_length = total;
+        return 1;
+    }
+
+    body = total - mac_length;
+    from_tail = body < stream->tail_length ? body : stream->tail_length;
+    if (!stream_decrypt_body(stream, stream->tail, from_tail, out, out_length, error)
+        || !stream_decrypt_body(stream, data, body - from_tail, out, out_length, error))
+        return 0;
+
+    memmove(stream->tail, stream->tail + from_tail, stream->tail_length - from_tail);
+    memcpy(stream->tail + stream->tail_length - from_tail, data + body - from_tail, length - (body - from_tail));
+    stream->tail_length = mac_length;
+    return 1;
+}
+
+int ecies_decrypt_end(ies_stream_t *stream, unsigned char *out, size_t *out_length, char *error)
+{
+    const size_t mac_length = EVP_MD_size(stream->ctx->md);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int out_len;
+    int final_len;
+
+    if (stream->tail_length != mac_length) {
+        SET_ERROR("The message is too short");
+        return 0;
+    }
+
+    if (HMAC_Final(&stream->hmac, md, &out_len) != 1) {
+        SET_OSSL_ERROR("Unable to generate tag");
+        return 0;
+    }
+
+    if (out_len != mac_length || CRYPTO_memcmp(md, stream->tail, mac_length) != 0) {
+        SET_ERROR("MAC tag verification failed");
+        return 0;
+    }
+
+    if (EVP_DecryptFinal_ex(&stream->cipher, out, &final_len) != 1) {
+        SET_OSSL_ERROR("Unable to decrypt the data using the chosen symmetric cipher");
+        return 0;
+    }
+
+    *out_length = final_len;
+    return 1;
+}
+
 ies_ctx_t *create_context(EC_KEY *user_key)
 {
     try {
@@ -7,36 +7,36 @@
 #define BITCOIN_HASH_H
 
 #include "serialize.h"
+#include "sha256.h"
 #include "uint256.h"
 #include "version.h"
 
 #include <vector>
 
 #include <openssl/ripemd.h>
-#include <openssl/sha.h>
 
 template<typename T1>
 inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), hash1.begin());
+    sha256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), hash1.begin());
     uint256 hash2;
-    SHA256(hash1.begin(), hash1.size(), hash2.begin());
+    sha256(hash1.begin(), hash1.size(), hash2.begin());
     return hash2;
 }
 
 class CHashWriter
 {
 private:
-    SHA256_CTX ctx;
+    sha256_ctx ctx;
 
 public:
     int nType;
     int nVersion;
 
     void Init() {
-        SHA256_Init(&ctx);
+        sha256_init(&ctx);
     }
 
     CHashWriter(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {
@@ -44,16 +44,16 @@ public:
     }
 
     CHashWriter& write(const char *pch, size_t size) {
-        SHA256_Update(&ctx, pch, size);
+        sha256_update(&ctx, pch, size);
         return (*this);
     }
 
     // invalidates the object
     uint256 GetHash() {
         uint256 hash1;
-        SHA256_Final(hash1.begin(), &ctx);
+        sha256_final(&ctx, hash1.begin());
         uint256 hash2;
-        SHA256(hash1.begin(), hash1.size(), hash2.begin());
+        sha256(hash1.begin(), hash1.size(), hash2.begin());
         return hash2;
     }
 
@@ -71,13 +71,13 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end, const T2 p2begin, const T2
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final(hash1.begin(), &ctx);
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
+    sha256_update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
+    sha256_final(&ctx, hash1.begin());
     uint256 hash2;
-    SHA256(hash1.begin(), hash1.size(), hash2.begin());
+    sha256(hash1.begin(), hash1.size(), hash2.begin());
     return hash2;
 }
 
@@ -94,7 +94,7 @@ inline uint160 Hash160(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), hash1.begin());
+    sha256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), hash1.begin());
     uint160 hash2;
     RIPEMD160(hash1.begin(), hash1.size(), hash2.begin());
     return hash2;
@@ -105,4 +105,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+template<unsigned int N>
+inline uint160 Hash160(const prevector<N, unsigned char>& vch)
+{
+    return Hash160(vch.begin(), vch.end());
+}
+
 #endif
@@ -8,6 +8,8 @@
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 typedef struct {
     const EVP_CIPHER *cipher;
@@ -27,6 +29,16 @@ typedef struct {
 
 typedef unsigned char * cryptogram_t;
 
+/* State of a message encrypted or decrypted chunk by chunk, the cipher and
+ * MAC contexts are kept from one message to the next */
+typedef struct {
+    const ies_ctx_t *ctx;
+    EVP_CIPHER_CTX cipher;
+    HMAC_CTX hmac;
+    unsigned char tail[EVP_MAX_MD_SIZE]; /* decryption: the last bytes seen, the MAC tag at the end */
+    size_t tail_length;
+} ies_stream_t;
+
 void cryptogram_free(cryptogram_t *cryptogram);
 unsigned char * cryptogram_key_data(const cryptogram_t *cryptogram);
 unsigned char * cryptogram_mac_data(const cryptogram_t *cryptogram);
@@ -41,4 +53,18 @@ cryptogram_t * ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, si
 unsigned char * ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, size_t *length, char *error);
 ies_ctx_t *create_context(EC_KEY *user_key);
 
+void ies_stream_init(ies_stream_t *stream, const ies_ctx_t *ctx);
+void ies_stream_cleanup(ies_stream_t *stream);
+/* The ephemeral key goes to key_data, ctx->stored_key_length bytes */
+int ecies_encrypt_begin(ies_stream_t *stream, unsigned char *key_data, char *error);
+/* Up to length plus a cipher block of output */
+int ecies_encrypt_update(ies_stream_t *stream, const unsigned char *data, size_t length, unsigned char *out, size_t *out_length, char *error);
+/* Up to a cipher block and EVP_MAX_MD_SIZE of output */
+int ecies_encrypt_end(ies_stream_t *stream, unsigned char *out, size_t *out_length, char *error);
+int ecies_decrypt_begin(ies_stream_t *stream, const unsigned char *key_data, size_t key_length, char *error);
+/* Up to length plus EVP_MAX_MD_SIZE plus a cipher block of output */
+int ecies_decrypt_update(ies_stream_t *stream, const unsigned char *data, size_t length, unsigned char *out, size_t *out_length, char *error);
+/* Checks the MAC tag before the padding, up to a cipher block of output */
+int ecies_decrypt_end(ies_stream_t *stream, unsigned char *out, size_t *out_length, char *error);
+
 #endif /* _IES_H_ */
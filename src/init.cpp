@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "txdb.h"
 #include "walletdb.h"
+#include "walletnotify.h"
 #include "bitcoinrpc.h"
 #include "net.h"
 #include "init.h"
@@ -11,6 +12,10 @@
 #include "ipcollector.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernel.h"
+#include "miner.h"
+#include "sha256.h"
+#include "scheduler.h"
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -28,6 +33,7 @@ using namespace std;
 using namespace boost;
 
 CWallet* pwalletMain;
+std::vector<CWallet*> vpwallets;
 CClientUIInterface uiInterface;
 std::string strWalletFileName;
 bool fConfChange;
@@ -87,16 +93,39 @@ void Shutdown(void* parg)
         fShutdown = true;
         fRequestShutdown = true;
         nTransactionsUpdated++;
+        WakeSleepingThreads();
+        walletNotifyQueue.Interrupt();
+        InterruptFlushWalletDB();
+        blockNotifyHistory.Interrupt();
+        mempoolNotifyHistory.Interrupt();
 //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
-        bitdb.Flush(true);
+        scheduler.Stop();
+        {
+            // peers.dat and mempool.dat are plain files, write them while
+            // the database environment is flushed
+            boost::thread_group threads;
+            threads.create_thread(DumpAddresses);
+            if (GetBoolArg("-persistmempool", true))
+                threads.create_thread(DumpMempool);
+            bitdb.Flush(true);
+            threads.join_all();
+        }
         boost::filesystem::remove(GetPidFile());
-        UnregisterWallet(pwalletMain);
-        delete pwalletMain;
+        {
+            // Not while ThreadReacceptWalletTransactions is in a wallet
+            LOCK(cs_main);
+            BOOST_FOREACH(CWallet* pwallet, vpwallets)
+            {
+                UnregisterWallet(pwallet);
+                delete pwallet;
+            }
+        }
         NewThread(ExitTimeout, NULL);
         Sleep(50);
         printf("42 exited\n\n");
+        StopDebugLogWriter();
         fExit = true;
 #ifndef QT_GUI
         // ensure non-UI client gets exited here, but let Bitcoin-Qt reach 'return 0;' in bitcoin.cpp
@@ -112,6 +141,22 @@ void Shutdown(void* parg)
     }
 }
 
+// Put the wallet transactions not in a block yet back into the memory pool, in the
+// background so that large wallets don't hold up startup
+static void ThreadReacceptWalletTransactions(void* parg)
+{
+    // Make this thread recognisable as the wallet re-accepting thread
+    RenameThread("42-reaccept");
+
+    BOOST_FOREACH(CWallet* pwallet, vpwallets)
+    {
+        LOCK(cs_main);
+        if (fShutdown)
+            return;
+        pwallet->ReacceptWalletTransactions();
+    }
+}
+
 void HandleSIGTERM(int)
 {
     fRequestShutdown = true;
@@ -130,7 +175,8 @@ void HandleSIGHUP(int)
 //
 // Start
 //
-#if !defined(QT_GUI)
+// bench_42 links this file built with BENCH_42 and brings its own main()
+#if !defined(QT_GUI) && !defined(BENCH_42)
 bool AppInit(int argc, char* argv[])
 {
     bool fRet = false;
@@ -228,6 +274,38 @@ bool static Bind(const CService &addr, bool fError = true) {
     return true;
 }
 
+// CPU bound worker pools, each one is a queue with its own worker threads
+struct CWorkerPool
+{
+    const char* pszName;
+    const char* pszArg;
+    int nDefault;
+    int nMax;
+    int* pnThreads;
+    void (*pfnThread)(void*);
+    void (*pfnSiblingThread)(void*); // optional queue sharing the pool's cores
+};
+
+static const CWorkerPool workerPools[] =
+{
+    { "script verification",    "-par",          0, MAX_SCRIPTCHECK_THREADS, &nScriptCheckThreads, ThreadScriptCheck, ThreadBlockCheck },
+    { "stake kernel scanning",  "-stakethreads", 1, MAX_STAKESCAN_THREADS,   &nStakeScanThreads,   ThreadStakeScan,   NULL             },
+};
+
+// Thread groups that can be pinned to CPUs, by the names of their threads
+struct CThreadGroup
+{
+    const char* pszArg;
+    const char* pszThreadNames[2];
+};
+
+static const CThreadGroup threadGroups[] =
+{
+    { "-parcpus",   { "42-scriptch",  "42-blockch" } },
+    { "-stakecpus", { "42-stakescan", "42-miner"   } },
+    { "-netcpus",   { "42-net",       NULL         } },
+};
+
 // Core-specific options shared between UI and daemon
 std::string HelpMessage()
 {
@@ -236,8 +314,20 @@ std::string HelpMessage()
         "  -conf=<file>           " + _("Specify configuration file (default: 42.conf)") + "\n" +
         "  -pid=<file>            " + _("Specify pid file (default: 42d.pid)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
-        "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n" +
+        "  -wallet=<file>         " + _("Specify wallet file (within data directory), may be given more than once to load several wallets") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbwritebuffer=<n>     " + _("Set database write buffer size in megabytes (default: 4)") + "\n" +
+        "  -dbbulkwritebuffer=<n> " + _("Set database write buffer size in megabytes while far behind the network, compact once synced (default: 64, 0 = off)") + "\n" +
+        "  -dbmaxopenfiles=<n>    " + _("Set the maximum number of database files kept open (default: 1000)") + "\n" +
+        "  -dbblocksize=<n>       " + _("Set database block size in kilobytes (default: 4)") + "\n" +
+        "  -dbcompression         " + _("Compress database blocks (default: 1)") + "\n" +
+        "  -blockcache=<n>        " + _("Set the size of the cache of recently used blocks in megabytes (default: 16)") + "\n" +
+        "  -maxorphanblocks=<n>   " + _("Keep at most <n> MB of orphan blocks in memory (default: 40)") + "\n" +
+        "  -orphanspill=<n>       " + _("Move orphan blocks over the memory limit to disk, up to <n> MB (default: 0 = off)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool under <n> MB of memory, evicting the lowest fee rate packages (default: 300, 0 = no limit)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Drop transactions that have been in the memory pool for more than <n> hours (default: 72, 0 = never)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n" +
+        "  -maxrelaymem=<n>       " + _("Keep at most <n> MB of relayed messages for getdata requests (default: 64, 0 = no limit)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks5 proxy") + "\n" +
@@ -246,6 +336,14 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 4242 or testnet: 42420)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -msghandlers=<n>       " + _("Process the messages of different peers on <n> threads (1-16, default: 4)") + "\n" +
+        "  -invbatch=<n>          " + _("Most inventory entries in one message to a peer (default: 1000)") + "\n" +
+        "  -invrate=<n>           " + _("Transaction inventory sent to each peer, in bytes per second, 0 for no limit (default: 32000)") + "\n" +
+        "  -txrecon               " + _("Reconcile transactions with peers that support it instead of announcing each (default: 0)") + "\n" +
+#ifdef USE_ZLIB
+        "  -compressmsgs          " + _("Exchange blocks and transactions compressed with peers that support it (default: 1)") + "\n" +
+#endif
+        "  -maxuploadtarget=<n>   " + _("Try to keep upload under <n> MiB per 24h, by not serving old blocks past it, 0 for no limit (default: 0)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -288,20 +386,43 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 2121 or testnet: 21210)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Handle JSON-RPC requests on <n> threads (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Turn JSON-RPC connections away when <n> are waiting for a thread (default: 16)") + "\n" +
+        "  -rpcslowlog=<ms>       " + _("Log JSON-RPC calls taking at least <ms> milliseconds, with their parameters (default: 0, off)") + "\n" +
+        "  -rest                  " + _("Serve raw blocks, transactions and headers under /rest/ on the JSON-RPC port, without authentication") + "\n" +
+        "  -metrics               " + _("Serve counters and gauges in the Prometheus text format under /metrics on the JSON-RPC port, without authentication") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -peercollector=<cmd>     " + _("Execute command to collect peer addresses") + "\n" +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
+        "  -supportingtxids       " + _("Store only the txids of the unconfirmed ancestors of wallet transactions, looking them up when needed (default: 0)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -flushwalletdelay=<n>  " + _("Flush the wallet once it has had no writes for <n> seconds (default: 2)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -zapwallettxes         " + _("Clear list of wallet transactions (diagnostic tool; implies -rescan)") + "\n" +
+        "  -walletarchive=<n>     " + _("Archive the fully spent wallet transactions <n> blocks deep, keeping only their outputs in memory (default: 0 = off)") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
+        "  -assumevalid=<hash>    " + _("Skip script verification for the ancestors of this block") + "\n" +
+        "  -assumevalidheight=<n> " + _("Height of the -assumevalid block, other blocks at this height are rejected") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
-        "  -par=N                 " + _("Set the number of script verification threads (1-16, 0=auto, default: 0)") + "\n" +
+        "  -asynccheckblocks      " + _("Verify the blocks of -checkblocks in the background once the node is up") + "\n" +
+        "  -modifiersnapshot=<file> " + _("Take the stake modifiers below the last modifier checkpoint from a file written by dumpstakemodifiers") + "\n" +
+        "  -addrindex             " + _("Maintain an index of the transactions of every address (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of the inputs spending every output (default: 0)") + "\n" +
+        "  -threads=N             " + _("Set the number of cores shared by the automatically sized worker pools (default: all cores)") + "\n" +
+        "  -blockpipeline         " + _("Check received blocks while the previous ones are connected (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Download block headers ahead of the blocks and fetch the blocks from several peers (default: 1)") + "\n" +
+        "  -par=N                 " + _("Set the number of script and block verification threads (1-128, 0=auto, default: 0)") + "\n" +
+        "  -stakethreads=N        " + _("Set the number of stake kernel scanning threads (1-128, 0=auto, default: 1)") + "\n" +
+        "  -parcpus=<list>        " + _("Run the verification threads of -par only on these CPUs, e.g. 0-7,16-23 (default: any)") + "\n" +
+        "  -stakecpus=<list>      " + _("Run the stake miner and kernel scanning threads only on these CPUs (default: any)") + "\n" +
+        "  -netcpus=<list>        " + _("Run the network socket thread only on these CPUs (default: any)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -prune=<n>             " + _("Delete the old block files once their outputs are all spent, keeping about <n> MB of them (default: 0 = off)") + "\n" +
+        "  -reindex               " + _("Rebuild the block index from the local blk000?.dat files") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -348,11 +469,141 @@ bool DropBlockIndex()
     }
 }
 
+CWallet* GetWalletByName(const std::string& strName)
+{
+    BOOST_FOREACH(CWallet* pwallet, vpwallets)
+        if (pwallet->strWalletFile == strName)
+            return pwallet;
+    return NULL;
+}
+
+// Load, upgrade and rescan one wallet file and register it, errors which
+// stop the startup are added to strErrors
+static CWallet* LoadWalletFile(const std::string& strFile, std::ostringstream& strErrors)
+{
+    int64_t nStart;
+
+    if (GetBoolArg("-zapwallettxes", false)) {
+        uiInterface.InitMessage(_("Zapping all transactions from wallet..."));
+
+        CWallet* pwallet = new CWallet(strFile);
+        DBErrors nZapWalletRet = pwallet->ZapWalletTx();
+        delete pwallet;
+        if (nZapWalletRet != DB_LOAD_OK) {
+            uiInterface.InitMessage(_("Error loading wallet.dat: Wallet corrupted"));
+            return NULL;
+        }
+    }
+
+    uiInterface.InitMessage(_("Loading wallet..."));
+    printf("Loading wallet %s...\n", strFile.c_str());
+    nStart = GetTimeMillis();
+    bool fFirstRun = true;
+    CWallet* pwallet = new CWallet(strFile);
+    DBErrors nLoadWalletRet = pwallet->LoadWallet(fFirstRun);
+    LogStartupPhase("wallet keys", nStart);
+    if (nLoadWalletRet != DB_LOAD_OK)
+    {
+        if (nLoadWalletRet == DB_CORRUPT)
+            strErrors << _("Error loading wallet.dat: Wallet corrupted") << "\n";
+        else if (nLoadWalletRet == DB_NONCRITICAL_ERROR)
+        {
+            string msg(_("Warning: error reading wallet.dat! All keys read correctly, but transaction data"
+                         " or address book entries might be missing or incorrect."));
+            uiInterface.ThreadSafeMessageBox(msg, _("42"), CClientUIInterface::OK | CClientUIInterface::ICON_EXCLAMATION | CClientUIInterface::MODAL);
+        }
+        else if (nLoadWalletRet == DB_TOO_NEW)
+            strErrors << _("Error loading wallet.dat: Wallet requires newer version of 42") << "\n";
+        else if (nLoadWalletRet == DB_NEED_REWRITE)
+        {
+            strErrors << _("Wallet needed to be rewritten: restart 42 to complete") << "\n";
+            printf("%s", strErrors.str().c_str());
+            delete pwallet;
+            return NULL;
+        }
+        else
+            strErrors << _("Error loading wallet.dat") << "\n";
+    }
+
+    if (GetBoolArg("-upgradewallet", fFirstRun))
+    {
+        int nMaxVersion = GetArgInt("-upgradewallet", 0);
+        if (nMaxVersion == 0) // the -upgradewallet without argument case
+        {
+            printf("Performing wallet upgrade to %i\n", FEATURE_LATEST);
+            nMaxVersion = CLIENT_VERSION;
+            pwallet->SetMinVersion(FEATURE_LATEST); // permanently upgrade the wallet immediately
+        }
+        else
+            printf("Allowing wallet upgrade up to %i\n", nMaxVersion);
+        if (nMaxVersion < pwallet->GetVersion())
+            strErrors << _("Cannot downgrade wallet") << "\n";
+        pwallet->SetMaxVersion(nMaxVersion);
+    }
+
+    if (fFirstRun)
+    {
+        // Create new keyUser and set as default key
+        RandAddSeedPerfmon();
+
+        CPubKey newDefaultKey;
+        if (!pwallet->GetKeyFromPool(newDefaultKey, false))
+            strErrors << _("Cannot initialize keypool") << "\n";
+        pwallet->SetDefaultKey(newDefaultKey);
+        if (!pwallet->SetAddressBookName(pwallet->vchDefaultKey.GetID(), ""))
+            strErrors << _("Cannot write default address") << "\n";
+
+        CMalleableKeyView keyView = pwallet->GenerateNewMalleableKey();
+        CMalleableKey mKey;
+        if (!pwallet->GetMalleableKey(keyView, mKey))
+            strErrors << _("Unable to generate new malleable key");
+        if (!pwallet->SetAddressBookName(CBitcoinAddress(keyView.GetMalleablePubKey()), ""))
+            strErrors << _("Cannot write default address") << "\n";
+    }
+
+    printf("%s", strErrors.str().c_str());
+    LogStartupPhase("wallet", nStart);
+
+    RegisterWallet(pwallet);
+
+    CBlockIndex *pindexRescan = pindexBest;
+    if (GetBoolArg("-rescan"))
+        pindexRescan = pindexGenesisBlock;
+    else
+    {
+        CWalletDB walletdb(strFile);
+        CBlockLocator locator;
+        if (walletdb.ReadBestBlock(locator))
+            pindexRescan = locator.GetBlockIndex();
+    }
+    if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
+    {
+        uiInterface.InitMessage(_("Rescanning..."));
+        printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
+        nStart = GetTimeMillis();
+        pwallet->ScanForWalletTransactions(pindexRescan, true);
+        LogStartupPhase("rescan", nStart);
+    }
+
+    int nArchiveDepth = GetArg("-walletarchive", 0);
+    if (nArchiveDepth > 0)
+    {
+        nStart = GetTimeMillis();
+        pwallet->SetArchiveDepth(nArchiveDepth);
+        pwallet->ArchiveTransactions(nArchiveDepth);
+        LogStartupPhase("archive", nStart);
+    }
+
+    return pwallet;
+}
+
 /** Initialize bitcoin.
  *  @pre Parameters should be parsed and config file should be read.
  */
 bool AppInit2()
 {
+    int64_t nStartInit = GetTimeMillis();
+
     // ********************************************************* Step 1: setup
 #ifdef _MSC_VER
     // Turn off Microsoft heap dump noise
@@ -407,6 +658,40 @@ bool AppInit2()
 
     nNodeLifespan = GetArgUInt("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fBlockPipeline = GetBoolArg("-blockpipeline", true);
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    nMessageHandlerThreads = std::max(1, std::min(GetArgInt("-msghandlers", 4), MAX_MESSAGEHANDLER_THREADS));
+    nInvBatchSize = (unsigned int)std::max(1, std::min(GetArgInt("-invbatch", 1000), (int)MAX_INV_SZ));
+    nInvBytesPerSecond = std::max((int64_t)0, GetArg("-invrate", (int64_t)32000));
+    fTxReconcile = GetBoolArg("-txrecon", false);
+#ifdef USE_ZLIB
+    fCompressMessages = GetBoolArg("-compressmsgs", true);
+#endif
+    CNode::SetMaxOutboundTarget((uint64_t)std::max((int64_t)0, GetArg("-maxuploadtarget", (int64_t)0)) * 1024 * 1024);
+    nBlockCacheSize = (size_t)std::max(0, GetArgInt("-blockcache", 16)) * 1048576;
+    nMaxOrphanBlocksMemory = (uint64_t)std::max(1, GetArgInt("-maxorphanblocks", 40)) * 1048576;
+    nMaxOrphanBlocksDisk = (uint64_t)std::max(0, GetArgInt("-orphanspill", 0)) * 1048576;
+    nMaxMempoolSize = (uint64_t)std::max(0, GetArgInt("-maxmempool", 300)) * 1000000;
+    nMempoolExpiry = (int64_t)std::max(0, GetArgInt("-mempoolexpiry", 72)) * 60 * 60;
+    nMaxRelayMemory = (uint64_t)std::max(0, GetArgInt("-maxrelaymem", 64)) * 1048576;
+    nPruneTarget = GetArg("-prune", (int64_t)0) * 1024 * 1024;
+    if (nPruneTarget < 0)
+        nPruneTarget = 0;
+    if (nPruneTarget && nPruneTarget < MIN_PRUNE_TARGET)
+        return InitError(strprintf(_("-prune must be at least %d MB"), (int)(MIN_PRUNE_TARGET / 1024 / 1024)));
+    if (nPruneTarget)
+    {
+        // Peers cannot download the old blocks from us anymore
+        nLocalServices &= ~NODE_NETWORK;
+        if (GetBoolArg("-reindex"))
+            return InitError(_("-reindex cannot be used on pruned block files"));
+    }
+    fAddrIndex = GetBoolArg("-addrindex", false);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+#ifndef USE_LEVELDB
+    if (fAddrIndex || fSpentIndex)
+        return InitError(_("-addrindex and -spentindex require a LevelDB build"));
+#endif
     fUseMemoryLog = GetBoolArg("-memorylog", true);
 
     // Ping and address broadcast intervals
@@ -472,14 +757,46 @@ bool AppInit2()
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
-    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
-    nScriptCheckThreads = GetArgInt("-par", 0);
-    if (nScriptCheckThreads == 0)
-        nScriptCheckThreads = boost::thread::hardware_concurrency();
-    if (nScriptCheckThreads <= 1) 
-        nScriptCheckThreads = 0;
-    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
-        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    // Size the worker pools: explicitly configured ones get what they ask for,
+    // pools set to 0 (autodetect) share the rest of the -threads budget equally.
+    // Pool size of 0 means no concurrency, jobs are done by the submitting thread.
+    int nThreadBudget = GetArgInt("-threads", 0);
+    if (nThreadBudget <= 0)
+        nThreadBudget = boost::thread::hardware_concurrency();
+
+    int nAutoPools = 0;
+    for (unsigned int i = 0; i < ARRAYLEN(workerPools); i++)
+    {
+        const CWorkerPool& pool = workerPools[i];
+        *pool.pnThreads = GetArgInt(pool.pszArg, pool.nDefault);
+        if (*pool.pnThreads > 0)
+            nThreadBudget -= std::min(*pool.pnThreads, pool.nMax);
+        else
+            nAutoPools++;
+    }
+
+    for (unsigned int i = 0; i < ARRAYLEN(workerPools); i++)
+    {
+        const CWorkerPool& pool = workerPools[i];
+        if (*pool.pnThreads <= 0)
+            *pool.pnThreads = std::max(1, nThreadBudget / nAutoPools);
+        if (*pool.pnThreads <= 1)
+            *pool.pnThreads = 0;
+        else if (*pool.pnThreads > pool.nMax)
+            *pool.pnThreads = pool.nMax;
+    }
+
+    for (unsigned int i = 0; i < ARRAYLEN(threadGroups); i++)
+    {
+        const CThreadGroup& group = threadGroups[i];
+        if (!mapArgs.count(group.pszArg))
+            continue;
+        std::vector<int> vCPUs;
+        if (!ParseCPUList(mapArgs[group.pszArg], vCPUs))
+            return InitError(strprintf(_("Invalid CPU list for %s: '%s'"), group.pszArg, mapArgs[group.pszArg].c_str()));
+        for (unsigned int j = 0; j < ARRAYLEN(group.pszThreadNames) && group.pszThreadNames[j]; j++)
+            SetThreadCPUs(group.pszThreadNames[j], vCPUs);
+    }
 
     fDebug = GetBoolArg("-debug");
 
@@ -529,6 +846,7 @@ bool AppInit2()
     }
 
     fConfChange = GetBoolArg("-confchange", false);
+    fSupportingTxids = GetBoolArg("-supportingtxids", false);
 
     if (mapArgs.count("-mininput"))
     {
@@ -536,14 +854,35 @@ bool AppInit2()
             return InitError(strprintf(_("Invalid amount for -mininput=<amount>: '%s'"), mapArgs["-mininput"].c_str()));
     }
 
+    if (mapArgs.count("-assumevalid"))
+    {
+        std::string strHash = mapArgs["-assumevalid"];
+        if (strHash.size() != 64 || !IsHex(strHash))
+            return InitError(strprintf(_("Invalid block hash for -assumevalid=<hash>: '%s'"), strHash.c_str()));
+        hashAssumeValid.SetHex(strHash);
+        nAssumeValidHeight = GetArgInt("-assumevalidheight", -1);
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     std::string strDataDir = GetDataDir().string();
-    strWalletFileName = GetArg("-wallet", "wallet.dat");
+    // The first wallet is pwalletMain, the one the GUI and the miner use
+    std::vector<std::string> vWalletFiles;
+    if (mapMultiArgs.count("-wallet"))
+        vWalletFiles = mapMultiArgs["-wallet"];
+    else
+        vWalletFiles.push_back("wallet.dat");
+    strWalletFileName = vWalletFiles[0];
 
-    // strWalletFileName must be a plain filename without a directory
-    if (strWalletFileName != boost::filesystem::basename(strWalletFileName) + boost::filesystem::extension(strWalletFileName))
-        return InitError(strprintf(_("Wallet %s resides outside data directory %s."), strWalletFileName.c_str(), strDataDir.c_str()));
+    std::set<std::string> setWalletFiles;
+    BOOST_FOREACH(const std::string& strFile, vWalletFiles)
+    {
+        // Wallet files must be plain filenames without a directory
+        if (strFile != boost::filesystem::basename(strFile) + boost::filesystem::extension(strFile))
+            return InitError(strprintf(_("Wallet %s resides outside data directory %s."), strFile.c_str(), strDataDir.c_str()));
+        if (!setWalletFiles.insert(strFile).second)
+            return InitError(strprintf(_("Wallet %s is given more than once."), strFile.c_str()));
+    }
 
     // Make sure only a single Bitcoin process is using the data directory.
     boost::filesystem::path pathLockFile = GetDataDir() / ".lock";
@@ -577,9 +916,14 @@ bool AppInit2()
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartDebugLogWriter();
+    scheduler.Start(2);
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("42 version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using %s implementation of SHA256\n", sha256_impl());
+    printf("Using %s implementation of stake kernel hashing\n", sha256_kernel_impl());
+    printf("Using %s implementation of batch header hashing\n", scrypt_blockhash_impl());
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -588,16 +932,27 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "42 server starting\n");
 
-    if (nScriptCheckThreads) {
-        printf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
-            NewThread(ThreadScriptCheck, NULL);
+    // The submitting thread joins its pool as a worker, so one thread less is started
+    for (unsigned int i = 0; i < ARRAYLEN(workerPools); i++)
+    {
+        const CWorkerPool& pool = workerPools[i];
+        if (*pool.pnThreads == 0)
+            continue;
+
+        printf("Using %u threads for %s\n", *pool.pnThreads, pool.pszName);
+        for (int n = 0; n < *pool.pnThreads - 1; n++)
+        {
+            NewThread(pool.pfnThread, NULL);
+            if (pool.pfnSiblingThread)
+                NewThread(pool.pfnSiblingThread, NULL);
+        }
     }
 
     // ********************************************************* Step 5: verify database integrity
 
     uiInterface.InitMessage(_("Verifying database integrity..."));
 
+    int64_t nStartVerify = GetTimeMillis();
     if (!bitdb.Open(GetDataDir()))
     {
         string msg = strprintf(_("Error initializing database environment %s!"
@@ -606,27 +961,31 @@ bool AppInit2()
         return InitError(msg);
     }
 
-    if (GetBoolArg("-salvagewallet"))
+    BOOST_FOREACH(const std::string& strFile, vWalletFiles)
     {
-        // Recover readable keypairs:
-        if (!CWalletDB::Recover(bitdb, strWalletFileName, true))
-            return false;
-    }
+        if (GetBoolArg("-salvagewallet"))
+        {
+            // Recover readable keypairs:
+            if (!CWalletDB::Recover(bitdb, strFile, true))
+                return false;
+        }
 
-    if (filesystem::exists(GetDataDir() / strWalletFileName))
-    {
-        CDBEnv::VerifyResult r = bitdb.Verify(strWalletFileName, CWalletDB::Recover);
-        if (r == CDBEnv::RECOVER_OK)
+        if (filesystem::exists(GetDataDir() / strFile))
         {
-            string msg = strprintf(_("Warning: wallet.dat corrupt, data salvaged!"
-                                     " Original wallet.dat saved as wallet.{timestamp}.bak in %s; if"
-                                     " your balance or transactions are incorrect you should"
-                                     " restore from a backup."), strDataDir.c_str());
-            uiInterface.ThreadSafeMessageBox(msg, _("42"), CClientUIInterface::OK | CClientUIInterface::ICON_EXCLAMATION | CClientUIInterface::MODAL);
+            CDBEnv::VerifyResult r = bitdb.Verify(strFile, CWalletDB::Recover);
+            if (r == CDBEnv::RECOVER_OK)
+            {
+                string msg = strprintf(_("Warning: wallet.dat corrupt, data salvaged!"
+                                         " Original wallet.dat saved as wallet.{timestamp}.bak in %s; if"
+                                         " your balance or transactions are incorrect you should"
+                                         " restore from a backup."), strDataDir.c_str());
+                uiInterface.ThreadSafeMessageBox(msg, _("42"), CClientUIInterface::OK | CClientUIInterface::ICON_EXCLAMATION | CClientUIInterface::MODAL);
+            }
+            if (r == CDBEnv::RECOVER_FAIL)
+                return InitError(_("wallet.dat corrupt, salvage failed"));
         }
-        if (r == CDBEnv::RECOVER_FAIL)
-            return InitError(_("wallet.dat corrupt, salvage failed"));
     }
+    LogStartupPhase("wallet check", nStartVerify);
 
     // ********************************************************* Step 6: network initialization
 
@@ -771,6 +1130,21 @@ bool AppInit2()
     }
 
 
+    fReindex = GetBoolArg("-reindex");
+    if (fReindex)
+    {
+#ifdef USE_LEVELDB
+        // Only the index goes, the block files are read again below
+        printf("Removing the block index for -reindex\n");
+        filesystem::remove_all(GetDataDir() / "txleveldb");
+#else
+        return InitError(_("-reindex requires a LevelDB build"));
+#endif
+    }
+
+    if (mapArgs.count("-modifiersnapshot") && !LoadStakeModifierSnapshot(mapArgs["-modifiersnapshot"]))
+        return InitError(strprintf(_("Error loading the stake modifier snapshot %s"), mapArgs["-modifiersnapshot"].c_str()));
+
     printf("Loading block index...\n");
     bool fLoaded = false;
     int64_t nStart;
@@ -810,7 +1184,7 @@ bool AppInit2()
         printf("Shutdown requested. Exiting.\n");
         return false;
     }
-    printf(" block index %15" PRId64 "ms\n", GetTimeMillis() - nStart);
+    LogStartupPhase("block index", nStart);
 
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
@@ -822,7 +1196,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strMatch.compare(hash.ToString()) == 0)
@@ -841,112 +1215,39 @@ bool AppInit2()
         return false;
     }
 
-    // ********************************************************* Step 8: load wallet
-
-    if (GetBoolArg("-zapwallettxes", false)) {
-        uiInterface.InitMessage(_("Zapping all transactions from wallet..."));
-
-        pwalletMain = new CWallet(strWalletFileName);
-        DBErrors nZapWalletRet = pwalletMain->ZapWalletTx();
-        if (nZapWalletRet != DB_LOAD_OK) {
-            uiInterface.InitMessage(_("Error loading wallet.dat: Wallet corrupted"));
-            return false;
-        }
-        delete pwalletMain;
-        pwalletMain = NULL;
-    }
-
-    uiInterface.InitMessage(_("Loading wallet..."));
-    printf("Loading wallet...\n");
-    nStart = GetTimeMillis();
-    std::ostringstream strErrors;
-    bool fFirstRun = true;
-    pwalletMain = new CWallet(strWalletFileName);
-    DBErrors nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
-    if (nLoadWalletRet != DB_LOAD_OK)
+    if (fReindex)
     {
-        if (nLoadWalletRet == DB_CORRUPT)
-            strErrors << _("Error loading wallet.dat: Wallet corrupted") << "\n";
-        else if (nLoadWalletRet == DB_NONCRITICAL_ERROR)
-        {
-            string msg(_("Warning: error reading wallet.dat! All keys read correctly, but transaction data"
-                         " or address book entries might be missing or incorrect."));
-            uiInterface.ThreadSafeMessageBox(msg, _("42"), CClientUIInterface::OK | CClientUIInterface::ICON_EXCLAMATION | CClientUIInterface::MODAL);
-        }
-        else if (nLoadWalletRet == DB_TOO_NEW)
-            strErrors << _("Error loading wallet.dat: Wallet requires newer version of 42") << "\n";
-        else if (nLoadWalletRet == DB_NEED_REWRITE)
-        {
-            strErrors << _("Wallet needed to be rewritten: restart 42 to complete") << "\n";
-            printf("%s", strErrors.str().c_str());
-            return InitError(strErrors.str());
-        }
-        else
-            strErrors << _("Error loading wallet.dat") << "\n";
+        uiInterface.InitMessage(_("Reindexing block files..."));
+        if (!ReindexBlockFiles())
+            return InitError(_("Error reindexing the block files"));
+        fReindex = false;
     }
 
-    if (GetBoolArg("-upgradewallet", fFirstRun))
-    {
-        int nMaxVersion = GetArgInt("-upgradewallet", 0);
-        if (nMaxVersion == 0) // the -upgradewallet without argument case
-        {
-            printf("Performing wallet upgrade to %i\n", FEATURE_LATEST);
-            nMaxVersion = CLIENT_VERSION;
-            pwalletMain->SetMinVersion(FEATURE_LATEST); // permanently upgrade the wallet immediately
-        }
-        else
-            printf("Allowing wallet upgrade up to %i\n", nMaxVersion);
-        if (nMaxVersion < pwalletMain->GetVersion())
-            strErrors << _("Cannot downgrade wallet") << "\n";
-        pwalletMain->SetMaxVersion(nMaxVersion);
-    }
+    PruneBlockFiles();
 
-    if (fFirstRun)
+    if (!InitOptionalIndexes())
+        return InitError(_("Error building the address and spent output indexes"));
+    if (fRequestShutdown)
     {
-        // Create new keyUser and set as default key
-        RandAddSeedPerfmon();
-
-        CPubKey newDefaultKey;
-        if (!pwalletMain->GetKeyFromPool(newDefaultKey, false))
-            strErrors << _("Cannot initialize keypool") << "\n";
-        pwalletMain->SetDefaultKey(newDefaultKey);
-        if (!pwalletMain->SetAddressBookName(pwalletMain->vchDefaultKey.GetID(), ""))
-            strErrors << _("Cannot write default address") << "\n";
-
-        CMalleableKeyView keyView = pwalletMain->GenerateNewMalleableKey();
-        CMalleableKey mKey;
-        if (!pwalletMain->GetMalleableKey(keyView, mKey))
-            strErrors << _("Unable to generate new malleable key");
-        if (!pwalletMain->SetAddressBookName(CBitcoinAddress(keyView.GetMalleablePubKey()), ""))
-            strErrors << _("Cannot write default address") << "\n";
+        printf("Shutdown requested. Exiting.\n");
+        return false;
     }
 
-    printf("%s", strErrors.str().c_str());
-    printf(" wallet      %15" PRId64 "ms\n", GetTimeMillis() - nStart);
-
-    RegisterWallet(pwalletMain);
+    // ********************************************************* Step 8: load wallet
 
-    CBlockIndex *pindexRescan = pindexBest;
-    if (GetBoolArg("-rescan"))
-        pindexRescan = pindexGenesisBlock;
-    else
-    {
-        CWalletDB walletdb(strWalletFileName);
-        CBlockLocator locator;
-        if (walletdb.ReadBestBlock(locator))
-            pindexRescan = locator.GetBlockIndex();
-    }
-    if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
+    std::ostringstream strErrors;
+    BOOST_FOREACH(const std::string& strFile, vWalletFiles)
     {
-        uiInterface.InitMessage(_("Rescanning..."));
-        printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
-        nStart = GetTimeMillis();
-        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
-        printf(" rescan      %15" PRId64 "ms\n", GetTimeMillis() - nStart);
+        CWallet* pwallet = LoadWalletFile(strFile, strErrors);
+        if (!pwallet)
+            return strErrors.str().empty() ? false : InitError(strErrors.str());
+        vpwallets.push_back(pwallet);
     }
+    pwalletMain = vpwallets[0];
 
     // ********************************************************* Step 9: import blocks
 
+    nStart = GetTimeMillis();
     if (mapArgs.count("-loadblock"))
     {
         uiInterface.InitMessage(_("Importing blockchain data file."));
@@ -971,6 +1272,7 @@ bool AppInit2()
             RenameOver(pathBootstrap, pathBootstrapOld);
         }
     }
+    LogStartupPhase("import", nStart);
 
     // ********************************************************* Step 10: load peers
 
@@ -984,8 +1286,8 @@ bool AppInit2()
             printf("Invalid or missing peers.dat; recreating\n");
     }
 
-    printf("Loaded %i addresses from peers.dat  %" PRId64 "ms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+    printf("Loaded %i addresses from peers.dat\n", addrman.size());
+    LogStartupPhase("peers.dat", nStart);
 
     // ********************************************************* Step 11: start node
 
@@ -1007,6 +1309,17 @@ bool AppInit2()
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
+    if (!GetArg("-walletnotify", "").empty())
+        NewThread(ThreadWalletNotify, NULL);
+
+    if (GetBoolArg("-persistmempool", true))
+        NewThread(ThreadLoadMempool, NULL);
+
+#ifdef USE_LEVELDB
+    if (GetBoolArg("-asynccheckblocks"))
+        NewThread(ThreadCheckBlocks, NULL);
+#endif
+
     // ********************************************************* Step 13: IP collection thread
     strCollectorCommand = GetArg("-peercollector", "");
     if (!fTestNet && strCollectorCommand != "")
@@ -1015,12 +1328,13 @@ bool AppInit2()
 
     uiInterface.InitMessage(_("Done loading"));
     printf("Done loading\n");
+    LogStartupPhase("startup", nStartInit);
 
     if (!strErrors.str().empty())
         return InitError(strErrors.str());
 
-     // Add wallet transactions that aren't already in a block to mapTransactions
-    pwalletMain->ReacceptWalletTransactions();
+    // Add wallet transactions that aren't already in a block to mapTransactions
+    NewThread(ThreadReacceptWalletTransactions, NULL);
 
 #if !defined(QT_GUI)
     // Loop until process is exit()ed from shutdown() function,
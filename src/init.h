@@ -8,7 +8,10 @@
 #include "wallet.h"
 
 extern CWallet* pwalletMain;
+// Every loaded wallet, pwalletMain first
+extern std::vector<CWallet*> vpwallets;
 extern std::string strWalletFileName;
+CWallet* GetWalletByName(const std::string& strName);
 void StartShutdown();
 void Shutdown(void* parg);
 bool AppInit2();
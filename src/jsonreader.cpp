@@ -0,0 +1,283 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonreader.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace json_spirit;
+using namespace std;
+
+// Deeper nesting than any RPC call needs would only run the stack down
+static const int MAX_JSON_DEPTH = 512;
+
+class CJSONReader
+{
+private:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    void SkipSpace()
+    {
+        while (p < pend && isspace((unsigned char)*p))
+            p++;
+    }
+
+    bool Literal(const char* psz)
+    {
+        size_t nLen = strlen(psz);
+        if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return 0;
+    }
+
+    // Escapes decode as json_spirit does: \u and \x give a single char, which
+    // is how its writer sends bytes it considers non-printable
+    bool ParseString(string& strRet)
+    {
+        if (p >= pend || *p != '"')
+            return false;
+        const char* pstart = ++p;
+        while (p < pend && *p != '"' && *p != '\\')
+            p++;
+        strRet.assign(pstart, p);
+
+        while (p < pend && *p != '"')
+        {
+            if (*p != '\\')
+            {
+                pstart = p;
+                while (p < pend && *p != '"' && *p != '\\')
+                    p++;
+                strRet.append(pstart, p);
+                continue;
+            }
+            if (++p >= pend)
+                return false;
+            switch (*p)
+            {
+                case 't':  strRet += '\t'; break;
+                case 'b':  strRet += '\b'; break;
+                case 'f':  strRet += '\f'; break;
+                case 'n':  strRet += '\n'; break;
+                case 'r':  strRet += '\r'; break;
+                case '\\': strRet += '\\'; break;
+                case '/':  strRet += '/';  break;
+                case '"':  strRet += '"';  break;
+                case 'x':
+                    if (pend - p >= 3)
+                    {
+                        strRet += (char)((HexDigit(p[1]) << 4) + HexDigit(p[2]));
+                        p += 2;
+                    }
+                    break;
+                case 'u':
+                    if (pend - p >= 5)
+                    {
+                        strRet += (char)((HexDigit(p[1]) << 12) + (HexDigit(p[2]) << 8) +
+                                         (HexDigit(p[3]) << 4) + HexDigit(p[4]));
+                        p += 4;
+                    }
+                    break;
+            }
+            p++;
+        }
+        if (p >= pend)
+            return false;
+        p++;
+        return true;
+    }
+
+    // Reals need a point or an exponent, other numbers are int64 or, past
+    // its range, uint64
+    bool ParseNumber(Value& valueRet)
+    {
+        const char* pstart = p;
+        bool fNegative = false;
+        if (p < pend && (*p == '-' || *p == '+'))
+            fNegative = (*p++ == '-');
+
+        const char* pdigits = p;
+        while (p < pend && isdigit((unsigned char)*p))
+            p++;
+        bool fDigits = (p > pdigits);
+        bool fReal = false;
+        if (p < pend && *p == '.')
+        {
+            fReal = true;
+            const char* pfraction = ++p;
+            while (p < pend && isdigit((unsigned char)*p))
+                p++;
+            fDigits = fDigits || (p > pfraction);
+        }
+        if (!fDigits)
+            return false;
+        if (p < pend && (*p == 'e' || *p == 'E'))
+        {
+            const char* pexp = p + 1;
+            if (pexp < pend && (*pexp == '-' || *pexp == '+'))
+                pexp++;
+            if (pexp < pend && isdigit((unsigned char)*pexp))
+            {
+                fReal = true;
+                p = pexp;
+                while (p < pend && isdigit((unsigned char)*p))
+                    p++;
+            }
+        }
+
+        if (fReal)
+        {
+            string strNumber(pstart, p);
+            valueRet = Value(strtod(strNumber.c_str(), NULL));
+            return true;
+        }
+
+        uint64_t n = 0;
+        for (const char* pc = pdigits; pc < p; pc++)
+        {
+            unsigned int nDigit = *pc - '0';
+            if (n > (UINT64_MAX - nDigit) / 10)
+                return false;
+            n = n * 10 + nDigit;
+        }
+        if (fNegative)
+        {
+            if (n > (uint64_t)INT64_MAX + 1)
+                return false;
+            valueRet = Value((int64_t)(0 - n));
+        }
+        else if (n <= (uint64_t)INT64_MAX)
+            valueRet = Value((int64_t)n);
+        else
+            valueRet = Value(n);
+        return true;
+    }
+
+    bool ParseArray(Value& valueRet)
+    {
+        p++;
+        valueRet = Array();
+        Array& array = valueRet.get_array();
+        SkipSpace();
+        if (p < pend && *p == ']')
+        {
+            p++;
+            return true;
+        }
+        for ( ; ; )
+        {
+            // Parsed in place, so nested values aren't copied
+            array.push_back(Value());
+            if (!ParseValue(array.back()))
+                return false;
+            SkipSpace();
+            if (p >= pend)
+                return false;
+            if (*p == ']')
+            {
+                p++;
+                return true;
+            }
+            if (*p++ != ',')
+                return false;
+        }
+    }
+
+    bool ParseObject(Value& valueRet)
+    {
+        p++;
+        valueRet = Object();
+        Object& obj = valueRet.get_obj();
+        SkipSpace();
+        if (p < pend && *p == '}')
+        {
+            p++;
+            return true;
+        }
+        for ( ; ; )
+        {
+            SkipSpace();
+            obj.push_back(Pair(string(), Value()));
+            if (!ParseString(obj.back().name_))
+                return false;
+            SkipSpace();
+            if (p >= pend || *p++ != ':')
+                return false;
+            if (!ParseValue(obj.back().value_))
+                return false;
+            SkipSpace();
+            if (p >= pend)
+                return false;
+            if (*p == '}')
+            {
+                p++;
+                return true;
+            }
+            if (*p++ != ',')
+                return false;
+        }
+    }
+
+public:
+    CJSONReader(const string& str) : p(str.data()), pend(str.data() + str.size()), nDepth(0) {}
+
+    bool ParseValue(Value& valueRet)
+    {
+        SkipSpace();
+        if (p >= pend)
+            return false;
+
+        switch (*p)
+        {
+            case '"':
+            {
+                string str;
+                if (!ParseString(str))
+                    return false;
+                valueRet = Value(str);
+                return true;
+            }
+            case '{':
+            case '[':
+            {
+                if (++nDepth > MAX_JSON_DEPTH)
+                    return false;
+                bool fRet = (*p == '{') ? ParseObject(valueRet) : ParseArray(valueRet);
+                nDepth--;
+                return fRet;
+            }
+            case 't':
+                valueRet = Value(true);
+                return Literal("true");
+            case 'f':
+                valueRet = Value(false);
+                return Literal("false");
+            case 'n':
+                valueRet = Value();
+                return Literal("null");
+        }
+        return ParseNumber(valueRet);
+    }
+};
+
+bool ReadJSON(const string& str, Value& valueRet)
+{
+    CJSONReader reader(str);
+    return reader.ParseValue(valueRet);
+}
@@ -0,0 +1,16 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONREADER_H
+#define BITCOIN_JSONREADER_H
+
+#include <string>
+
+#include "json/json_spirit_value.h"
+
+/** Parse the JSON value at the start of str, like json_spirit's read_string
+ * and giving the same values, without going through Boost.Spirit. Used for
+ * RPC bodies, where large hex strings made the Spirit grammar slow. */
+bool ReadJSON(const std::string& str, json_spirit::Value& valueRet);
+
+#endif
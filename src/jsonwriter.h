@@ -0,0 +1,162 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONWRITER_H
+#define BITCOIN_JSONWRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+
+/** Writes JSON text straight into a string, for RPC replies too large to be
+ * worth building as a json_spirit tree first. Output is the same as
+ * json_spirit's compact write_string. Commas go in by themselves:
+ *
+ *     writer.BeginObject();
+ *     writer.Key("height").Int(nHeight);
+ *     writer.Key("tx").BeginArray();
+ *     ...
+ */
+class CJSONWriter
+{
+private:
+    std::string strJSON;
+    // One per open object or array, true until it has a member
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+
+    void Separate()
+    {
+        if (fAfterKey)
+            fAfterKey = false;
+        else if (!vEmpty.empty())
+        {
+            if (!vEmpty.back())
+                strJSON += ',';
+            vEmpty.back() = false;
+        }
+    }
+
+    void Quote(const std::string& str)
+    {
+        strJSON += '"';
+        strJSON += json_spirit::add_esc_chars(str);
+        strJSON += '"';
+    }
+
+public:
+    CJSONWriter() : fAfterKey(false) {}
+
+    void reserve(size_t nSize) { strJSON.reserve(nSize); }
+    const std::string& str() const { return strJSON; }
+
+    CJSONWriter& BeginObject()
+    {
+        Separate();
+        strJSON += '{';
+        vEmpty.push_back(true);
+        return *this;
+    }
+
+    CJSONWriter& EndObject()
+    {
+        strJSON += '}';
+        vEmpty.pop_back();
+        return *this;
+    }
+
+    CJSONWriter& BeginArray()
+    {
+        Separate();
+        strJSON += '[';
+        vEmpty.push_back(true);
+        return *this;
+    }
+
+    CJSONWriter& EndArray()
+    {
+        strJSON += ']';
+        vEmpty.pop_back();
+        return *this;
+    }
+
+    CJSONWriter& Key(const std::string& strKey)
+    {
+        Separate();
+        Quote(strKey);
+        strJSON += ':';
+        fAfterKey = true;
+        return *this;
+    }
+
+    CJSONWriter& String(const std::string& str)
+    {
+        Separate();
+        Quote(str);
+        return *this;
+    }
+
+    CJSONWriter& Int(int64_t n)
+    {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%lld", (long long)n);
+        Separate();
+        strJSON += buf;
+        return *this;
+    }
+
+    CJSONWriter& UInt(uint64_t n)
+    {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+        Separate();
+        strJSON += buf;
+        return *this;
+    }
+
+    // Fixed with 8 decimals, as json_spirit writes reals
+    CJSONWriter& Real(double d)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.8f", d);
+        Separate();
+        strJSON += buf;
+        return *this;
+    }
+
+    CJSONWriter& Bool(bool f)
+    {
+        Separate();
+        strJSON += f ? "true" : "false";
+        return *this;
+    }
+
+    CJSONWriter& Null()
+    {
+        Separate();
+        strJSON += "null";
+        return *this;
+    }
+
+    // JSON text written before, by another writer
+    CJSONWriter& Raw(const std::string& strRawJSON)
+    {
+        Separate();
+        strJSON += strRawJSON;
+        return *this;
+    }
+
+    // A piece that was built as a json_spirit value after all
+    CJSONWriter& Value(const json_spirit::Value& value)
+    {
+        Separate();
+        strJSON += json_spirit::write_string(value, false);
+        return *this;
+    }
+};
+
+#endif
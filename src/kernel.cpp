@@ -85,45 +85,46 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// Candidate block of the stake modifier selection
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    uint256 hashSelection;
+    const CBlockIndex* pindex;
+    bool fSelected;
+
+    // Candidates are ordered by timestamp, then by block hash
+    bool operator<(const CModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hashBlock < other.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(const vector<CModifierCandidate>& vSortedByTimestamp,
+    int64_t nSelectionIntervalStop, size_t& nSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    for (size_t i = 0; i < vSortedByTimestamp.size(); i++)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        const CModifierCandidate& candidate = vSortedByTimestamp[i];
+        if (fSelected && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && candidate.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = pindex;
+            hashBest = candidate.hashSelection;
+            nSelected = i;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = pindex;
+            hashBest = candidate.hashSelection;
+            nSelected = i;
         }
     }
     if (fDebug && GetBoolArg("-printstakemodifier"))
@@ -193,14 +194,33 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
     }
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / nStakeTargetSpacing);
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        candidate.fSelected = false;
+
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier, it doesn't change between the
+        // selection rounds, so it's calculated only once per candidate
+        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : candidate.hashBlock;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -210,18 +230,19 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        size_t nSelected;
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, nSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = vSortedByTimestamp[nSelected].pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        // exclude the selected block from the following rounds
+        vSortedByTimestamp[nSelected].fSelected = true;
         if (fDebug && GetBoolArg("-printstakemodifier"))
             printf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
@@ -240,11 +261,13 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CModifierCandidate& candidate, vSortedByTimestamp)
         {
+            if (!candidate.fSelected)
+                continue;
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(candidate.pindex->nHeight - nHeightFirstCandidate, 1, candidate.pindex->IsProofOfStake()? "S" : "W");
         }
         printf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -258,14 +281,50 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
     return true;
 }
 
+// Kernel stake modifiers which have already been found for the blocks
+struct CStakeModifierCacheEntry
+{
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    const CBlockIndex* pindexLast; // last block visited by the search
+};
+
+static const unsigned int MAX_STAKE_MODIFIER_CACHE_SIZE = 100000;
+
+static CCriticalSection cs_StakeModifierCache;
+static map<uint256, CStakeModifierCacheEntry> mapStakeModifierCache;
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
+
+    {
+        // Search result stays valid until the blocks it has walked through are
+        //   disconnected, and they are all in the main chain while the last one is.
+        LOCK(cs_StakeModifierCache);
+        map<uint256, CStakeModifierCacheEntry>::iterator mi = mapStakeModifierCache.find(hashBlockFrom);
+        if (mi != mapStakeModifierCache.end())
+        {
+            const CStakeModifierCacheEntry& entry = mi->second;
+            if (entry.pindexLast->IsInMainChain())
+            {
+                nStakeModifier = entry.nStakeModifier;
+                nStakeModifierHeight = entry.nStakeModifierHeight;
+                nStakeModifierTime = entry.nStakeModifierTime;
+                return true;
+            }
+
+            // Invalidated by reorganization
+            mapStakeModifierCache.erase(mi);
+        }
+    }
+
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexFrom = LookupBlockIndex(hashBlockFrom);
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -289,6 +348,19 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    {
+        LOCK(cs_StakeModifierCache);
+        if (mapStakeModifierCache.size() >= MAX_STAKE_MODIFIER_CACHE_SIZE)
+            mapStakeModifierCache.clear();
+
+        CStakeModifierCacheEntry& entry = mapStakeModifierCache[hashBlockFrom];
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
+        entry.pindexLast = pindex;
+    }
+
     return true;
 }
 
@@ -300,6 +372,32 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
     return GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
 }
 
+bool CheckStakeTarget(const uint256& hashProofOfStake, uint32_t nBits, int64_t nValueIn, int64_t nTimeWeight, uint256* pTargetProofOfStake)
+{
+    uint256 bnTargetPerCoinDay;
+    bool fNegative, fOverflow;
+    bnTargetPerCoinDay.SetCompact(nBits, &fNegative, &fOverflow);
+
+    // Magnitudes and signs are kept apart, the divisions truncate toward zero
+    //   like the signed arithmetic of value * weight / COIN / nOneDay does
+    uint256 bnCoinDayWeight = uint256(nValueIn < 0 ? 0 - (uint64_t)nValueIn : (uint64_t)nValueIn);
+    bnCoinDayWeight *= uint256(nTimeWeight < 0 ? 0 - (uint64_t)nTimeWeight : (uint64_t)nTimeWeight);
+    bnCoinDayWeight = bnCoinDayWeight / COIN / nOneDay;
+    bool fWeightNegative = (nValueIn < 0) != (nTimeWeight < 0);
+
+    // A target that doesn't fit is truncated to its low bits, which may be zero
+    bool fZero = bnCoinDayWeight == 0 || (bnTargetPerCoinDay == 0 && !fOverflow);
+    bool fProductOverflow = bnCoinDayWeight.MulOverflow(bnTargetPerCoinDay) || (fOverflow && !fZero);
+    bool fProductNegative = !fZero && fWeightNegative != fNegative;
+
+    if (pTargetProofOfStake)
+        *pTargetProofOfStake = bnCoinDayWeight;
+
+    if (fProductNegative)
+        return false;
+    return fProductOverflow || hashProofOfStake <= bnCoinDayWeight;
+}
+
 
 // ppcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
@@ -322,23 +420,18 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-bool CheckStakeKernelHash(uint32_t nBits, const CBlock& blockFrom, uint32_t nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, uint32_t nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(uint32_t nBits, const CBlockIndex* pindexFrom, uint32_t nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, uint32_t nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
-    uint32_t nTimeBlockFrom = blockFrom.GetBlockTime();
+    uint32_t nTimeBlockFrom = pindexFrom->GetBlockTime();
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
 
-    uint256 hashBlockFrom = blockFrom.GetHash();
-
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / nOneDay;
-    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+    uint256 hashBlockFrom = pindexFrom->GetBlockHash();
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -352,13 +445,14 @@ bool CheckStakeKernelHash(uint32_t nBits, const CBlock& blockFrom, uint32_t nTxP
 
     ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
+    bool fMeetsTarget = CheckStakeTarget(hashProofOfStake, nBits, nValueIn, GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx), &targetProofOfStake);
     if (fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016" PRIx64 " at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
             nStakeModifier, nStakeModifierHeight,
             DateTimeStrFormat(nStakeModifierTime).c_str(),
-            mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()).c_str());
+            pindexFrom->nHeight,
+            DateTimeStrFormat(pindexFrom->GetBlockTime()).c_str());
         printf("CheckStakeKernelHash() : check modifier=0x%016" PRIx64 " nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashTarget=%s hashProof=%s\n",
             nStakeModifier,
             nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
@@ -366,15 +460,15 @@ bool CheckStakeKernelHash(uint32_t nBits, const CBlock& blockFrom, uint32_t nTxP
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!fMeetsTarget)
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
         printf("CheckStakeKernelHash() : using modifier 0x%016" PRIx64 " at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
             nStakeModifier, nStakeModifierHeight, 
             DateTimeStrFormat(nStakeModifierTime).c_str(),
-            mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()).c_str());
+            pindexFrom->nHeight,
+            DateTimeStrFormat(pindexFrom->GetBlockTime()).c_str());
         printf("CheckStakeKernelHash() : pass modifier=0x%016" PRIx64 " nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashTarget=%s hashProof=%s\n",
             nStakeModifier,
             nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, prevout.n, nTimeTx,
@@ -428,6 +522,54 @@ bool ScanKernelForward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxT
     return true;
 }
 
+// Inputs queue shared by the batch scanning workers
+struct CKernelScanQueue
+{
+    CCriticalSection cs;
+    std::vector<CKernelScanJob> *pvJobs;
+    uint32_t nBits;
+    size_t nNext;
+};
+
+static void KernelScanThread(CKernelScanQueue *pqueue)
+{
+    while (!fShutdown)
+    {
+        CKernelScanJob *pjob;
+        {
+            LOCK(pqueue->cs);
+            if (pqueue->nNext >= pqueue->pvJobs->size())
+                return;
+            pjob = &(*pqueue->pvJobs)[pqueue->nNext++];
+        }
+
+        KernelWorker worker(&pjob->kernel[0], pqueue->nBits, pjob->nInputTxTime, pjob->nValueIn, pjob->interval.first, pjob->interval.second);
+        worker.Do();
+        pjob->solutions = worker.GetSolutions();
+
+        if (fDebug && !pjob->solutions.empty())
+            printf("ScanKernelsForward() : %" PRIszu " solutions found for %s:%u\n", pjob->solutions.size(), pjob->prevout.hash.ToString().c_str(), pjob->prevout.n);
+    }
+}
+
+// Scan given kernels for solutions
+void ScanKernelsForward(std::vector<CKernelScanJob> &vJobs, uint32_t nBits, unsigned int nThreads)
+{
+    CKernelScanQueue queue;
+    queue.pvJobs = &vJobs;
+    queue.nBits = nBits;
+    queue.nNext = 0;
+
+    // Every worker scans whole intervals of the inputs it has taken, there is no use in idle threads
+    nThreads = std::max(1U, std::min(nThreads, (unsigned int)vJobs.size()));
+
+    boost::thread_group group;
+    for (unsigned int i = 0; i < nThreads; i++)
+        group.create_thread(boost::bind(&KernelScanThread, &queue));
+
+    group.join_all();
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -452,31 +594,36 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
     if (!VerifySignature(txPrev, tx, 0, MANDATORY_SCRIPT_VERIFY_FLAGS, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str()));
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
+    // Find block header
+    const CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexFrom)
+        return fDebug? error("CheckProofOfStake() : block of previous transaction not indexed") : false; // unable to find block of previous transaction
 
-    if (!CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(nBits, pindexFrom, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str())); // may occur during initial download or if behind on block chain sync
 
     return true;
 }
 
-// Get stake modifier checksum
-uint32_t GetStakeModifierChecksum(const CBlockIndex* pindex)
+// Hash previous checksum with flags, hashProofOfStake and nStakeModifier
+static uint32_t StakeModifierChecksum(const CBlockIndex* pindexPrev, unsigned int nFlags, const uint256& hashProofOfStake, uint64_t nStakeModifier)
 {
-    assert (pindex->pprev || pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
-    // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
     CDataStream ss(SER_GETHASH, 0);
-    if (pindex->pprev)
-        ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    if (pindexPrev)
+        ss << pindexPrev->nStakeModifierChecksum;
+    ss << nFlags << hashProofOfStake << nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return static_cast<uint32_t>(hashChecksum.Get64());
 }
 
+// Get stake modifier checksum
+uint32_t GetStakeModifierChecksum(const CBlockIndex* pindex)
+{
+    assert (pindex->pprev || pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return StakeModifierChecksum(pindex->pprev, pindex->nFlags, pindex->hashProofOfStake, pindex->nStakeModifier);
+}
+
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, uint32_t nStakeModifierChecksum)
 {
@@ -486,3 +633,113 @@ bool CheckStakeModifierCheckpoints(int nHeight, uint32_t nStakeModifierChecksum)
         return nStakeModifierChecksum == checkpoints[nHeight];
     return true;
 }
+
+//
+// Stake modifier snapshot: the modifiers and checksums of the best chain up
+// to the last modifier checkpoint, written by dumpstakemodifiers. A node
+// syncing from scratch with -modifiersnapshot takes the modifier of a block
+// from it instead of selecting one from the blocks of the previous
+// interval. Its checksum is worked out as usual and has to match the one of
+// the snapshot, which covers the whole checksum chain below it, so a block
+// off the snapshot's chain gets its modifier computed. The checkpoints
+// still check the result.
+//
+struct CStakeModifierSnapshotEntry
+{
+    uint64_t nStakeModifier;
+    uint32_t nChecksum;
+    bool fGenerated;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nStakeModifier);
+        READWRITE(nChecksum);
+        READWRITE(fGenerated);
+    )
+};
+
+static std::vector<CStakeModifierSnapshotEntry> vStakeModifierSnapshot;
+
+static int GetLastModifierCheckpointHeight()
+{
+    MapModifierCheckpoints& checkpoints = (fTestNet ? mapStakeModifierCheckpointsTestNet : mapStakeModifierCheckpoints);
+    return checkpoints.rbegin()->first;
+}
+
+bool WriteStakeModifierSnapshot(const std::string& strFile, int& nHeightRet)
+{
+    nHeightRet = std::min(nBestHeight, GetLastModifierCheckpointHeight());
+    std::vector<CStakeModifierSnapshotEntry> vEntries(nHeightRet + 1);
+    for (CBlockIndex* pindex = FindBlockByHeight(nHeightRet); pindex; pindex = pindex->pprev)
+    {
+        CStakeModifierSnapshotEntry& entry = vEntries[pindex->nHeight];
+        entry.nStakeModifier = pindex->nStakeModifier;
+        entry.nChecksum = pindex->nStakeModifierChecksum;
+        entry.fGenerated = pindex->GeneratedStakeModifier();
+    }
+
+    // Laid out like peers.dat, with a hash of everything before it at the end
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchMessageStart) << vEntries;
+    ss << Hash(ss.begin(), ss.end());
+
+    CAutoFile fileout = CAutoFile(fopen(strFile.c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteStakeModifierSnapshot() : open failed");
+    try {
+        fileout << ss;
+    }
+    catch (const std::exception&) {
+        return error("WriteStakeModifierSnapshot() : I/O error");
+    }
+    return true;
+}
+
+bool LoadStakeModifierSnapshot(const std::string& strFile)
+{
+    CAutoFile filein = CAutoFile(fopen(strFile.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadStakeModifierSnapshot() : open failed");
+
+    unsigned char pchMsgTmp[4];
+    std::vector<CStakeModifierSnapshotEntry> vEntries;
+    uint256 hashIn;
+    try {
+        filein >> FLATDATA(pchMsgTmp) >> vEntries >> hashIn;
+    }
+    catch (const std::exception&) {
+        return error("LoadStakeModifierSnapshot() : I/O error or stored data corrupted");
+    }
+    if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+        return error("LoadStakeModifierSnapshot() : made for a different network");
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchMsgTmp) << vEntries;
+    if (hashIn != Hash(ss.begin(), ss.end()))
+        return error("LoadStakeModifierSnapshot() : checksum mismatch, data corrupted");
+
+    // Nothing past the checkpoints is taken, and what is below has to agree
+    // with them
+    if ((int)vEntries.size() > GetLastModifierCheckpointHeight() + 1)
+        vEntries.resize(GetLastModifierCheckpointHeight() + 1);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        if (!CheckStakeModifierCheckpoints(i, vEntries[i].nChecksum))
+            return error("LoadStakeModifierSnapshot() : does not match the checkpoint at height %u", i);
+
+    vStakeModifierSnapshot.swap(vEntries);
+    printf("Loaded the stake modifiers of %" PRIszu " blocks from %s\n", vStakeModifierSnapshot.size(), strFile.c_str());
+    return true;
+}
+
+bool GetSnapshotStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier)
+{
+    if (!pindex->pprev || pindex->nHeight >= (int)vStakeModifierSnapshot.size())
+        return false;
+    const CStakeModifierSnapshotEntry& entry = vStakeModifierSnapshot[pindex->nHeight];
+    unsigned int nFlags = pindex->nFlags | (entry.fGenerated ? CBlockIndex::BLOCK_STAKE_MODIFIER : 0);
+    if (StakeModifierChecksum(pindex->pprev, nFlags, pindex->hashProofOfStake, entry.nStakeModifier) != entry.nChecksum)
+        return false;
+    nStakeModifier = entry.nStakeModifier;
+    fGeneratedStakeModifier = entry.fGenerated;
+    return true;
+}
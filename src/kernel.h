@@ -29,11 +29,29 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier);
 
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, uint32_t nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, uint32_t nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, uint32_t nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, uint32_t nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+
+// Check whether hashProofOfStake meets the target per coin day weighted by the
+//   coin day weight of the input, the weighted target is stored in pTargetProofOfStake
+bool CheckStakeTarget(const uint256& hashProofOfStake, uint32_t nBits, int64_t nValueIn, int64_t nTimeWeight, uint256* pTargetProofOfStake=NULL);
 
 // Scan given kernel for solutions
 bool ScanKernelForward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, std::pair<uint32_t, uint32_t> &SearchInterval, std::vector<std::pair<uint256, uint32_t> > &solutions);
 
+// Static part of kernel and search interval of a single input, used by ScanKernelsForward
+struct CKernelScanJob
+{
+    COutPoint prevout;
+    std::vector<unsigned char> kernel;
+    uint32_t nInputTxTime;
+    int64_t nValueIn;
+    std::pair<uint32_t, uint32_t> interval;
+    std::vector<std::pair<uint256, uint32_t> > solutions;
+};
+
+// Scan given kernels for solutions, distributing the inputs between nThreads workers
+void ScanKernelsForward(std::vector<CKernelScanJob> &vJobs, uint32_t nBits, unsigned int nThreads);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -44,6 +62,17 @@ uint32_t GetStakeModifierChecksum(const CBlockIndex* pindex);
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, uint32_t nStakeModifierChecksum);
 
+// Write the stake modifiers of the best chain up to the last modifier
+// checkpoint to a snapshot file, nHeightRet is the last height written
+bool WriteStakeModifierSnapshot(const std::string& strFile, int& nHeightRet);
+
+// Load a snapshot written by WriteStakeModifierSnapshot, for -modifiersnapshot
+bool LoadStakeModifierSnapshot(const std::string& strFile);
+
+// The modifier of a new block from the snapshot, false if there is none or
+// the checksum chain of the block differs from the snapshot's
+bool GetSnapshotStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
+
 // Get time weight using supplied timestamps
 inline int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
 {
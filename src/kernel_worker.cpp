@@ -2,14 +2,14 @@
 #include <inttypes.h>
 
 #include "uint256.h"
-#include "bignum.h"
 #include "kernel.h"
 #include "kernel_worker.h"
+#include "sha256.h"
 
 using namespace std;
 
 KernelWorker::KernelWorker(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, uint32_t nIntervalBegin, uint32_t nIntervalEnd) 
-        : kernel(kernel), nBits(nBits), nInputTxTime(nInputTxTime), bnValueIn(nValueIn), nIntervalBegin(nIntervalBegin), nIntervalEnd(nIntervalEnd)
+        : kernel(kernel), nBits(nBits), nInputTxTime(nInputTxTime), nValueIn(nValueIn), nIntervalBegin(nIntervalBegin), nIntervalEnd(nIntervalEnd)
     {
         solutions = vector<std::pair<uint256,uint32_t> >();
     }
@@ -18,46 +18,40 @@ void KernelWorker::Do_generic()
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-    // Compute maximum possible target to filter out majority of obviously insufficient hashes
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-    uint256 nMaxTarget = (bnTargetPerCoinDay * bnValueIn * nStakeMaxAge / COIN / nOneDay).getuint256();
+    // Weight grows with time, so the target at the end of interval is the
+    //   maximum one, it's used to filter out majority of obviously insufficient hashes
+    uint256 nMaxTarget = GetMaxStakeTarget(GetStakeTargetPerSecond(nBits, nValueIn), nInputTxTime, nIntervalEnd);
+    if (nMaxTarget == 0)
+        return;
 
-    SHA256_CTX ctx, workerCtx;
-    // Init new sha256 context and update it
-    //   with first 24 bytes of kernel
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, kernel, 8 + 16);
-    workerCtx = ctx; // save context
+    // Precalculate hashing context for the static part of kernel
+    sha256_kernel_ctx ctx;
+    sha256_kernel_init(&ctx, kernel);
 
-    // Sha256 result buffer
-    uint32_t hashProofOfStake[8];
-    uint256 *pnHashProofOfStake = (uint256 *)&hashProofOfStake;
+    // Timestamps and kernel hashes of the current batch
+    uint32_t vTimeTx[SHA256_KERNEL_LANES];
+    uint256 vHashProofOfStake[SHA256_KERNEL_LANES];
 
     // Search forward in time from the given timestamp
     // Stopping search in case of shutting down
-    for (uint32_t nTimeTx=nIntervalBegin, nMaxTarget32 = nMaxTarget.Get32(7); nTimeTx<nIntervalEnd && !fShutdown; nTimeTx++)
+    for (uint32_t nTimeTx=nIntervalBegin; nTimeTx<nIntervalEnd && !fShutdown; )
     {
-        // Complete first hashing iteration
-        uint256 hash1;
-        SHA256_Update(&ctx, (unsigned char*)&nTimeTx, 4);
-        SHA256_Final((unsigned char*)&hash1, &ctx);
-
-        // Restore context
-        ctx = workerCtx;
-
-        // Finally, calculate kernel hash
-        SHA256((unsigned char*)&hash1, sizeof(hashProofOfStake), (unsigned char*)&hashProofOfStake);
-
-        // Skip if hash doesn't satisfy the maximum target
-        if (hashProofOfStake[7] > nMaxTarget32)
-            continue;
-
-        CBigNum bnCoinDayWeight = bnValueIn * GetWeight((int64_t)nInputTxTime, (int64_t)nTimeTx) / COIN / nOneDay;
-        CBigNum bnTargetProofOfStake = bnCoinDayWeight * bnTargetPerCoinDay;
+        // Calculate kernel hashes for the batch of timestamps at once
+        unsigned int nLanes = std::min((uint32_t)SHA256_KERNEL_LANES, nIntervalEnd - nTimeTx);
+        for (unsigned int i = 0; i < nLanes; i++)
+            vTimeTx[i] = nTimeTx + i;
+        sha256d_kernel_n(&ctx, vTimeTx, vHashProofOfStake, nLanes);
+        nTimeTx += nLanes;
+
+        for (unsigned int i = 0; i < nLanes; i++)
+        {
+            // Skip if hash doesn't satisfy the maximum target
+            if (vHashProofOfStake[i] > nMaxTarget)
+                continue;
 
-        if (bnTargetProofOfStake >= CBigNum(*pnHashProofOfStake))
-            solutions.push_back(std::pair<uint256,uint32_t>(*pnHashProofOfStake, nTimeTx));
+            if (CheckStakeTarget(vHashProofOfStake[i], nBits, nValueIn, GetWeight((int64_t)nInputTxTime, (int64_t)vTimeTx[i])))
+                solutions.push_back(std::pair<uint256,uint32_t>(vHashProofOfStake[i], vTimeTx[i]));
+        }
     }
 }
 
@@ -71,54 +65,107 @@ vector<pair<uint256,uint32_t> >& KernelWorker::GetSolutions()
     return solutions;
 }
 
-// Scan given kernel for solutions
+uint256 GetStakeTargetPerSecond(uint32_t nBits, int64_t nValueIn)
+{
+    uint256 bnTargetPerCoinDay;
+    bool fNegative, fOverflow;
+    bnTargetPerCoinDay.SetCompact(nBits, &fNegative, &fOverflow);
+
+    // Such inputs never meet a nonzero target
+    if (fNegative || nValueIn <= 0)
+        return 0;
+    if (fOverflow)
+        return ~uint256(0);
+
+    // Rounded up, so multiplying by the weight never gives less than
+    //   the exact value*weight/COIN/nOneDay*target calculated by CheckStakeTarget.
+    //   Split by the divisor so that only the quotient part can overflow.
+    const uint256 bnDivisor = uint256(COIN * nOneDay);
+    uint256 bnQuot = bnTargetPerCoinDay / bnDivisor;
+    uint256 bnRem = bnTargetPerCoinDay - bnQuot * bnDivisor;
+    if (bnQuot.MulOverflow(uint256(nValueIn)))
+        return ~uint256(0);
+
+    uint256 bnTargetPerSecond = bnQuot + bnRem * nValueIn / bnDivisor + 1;
+    if (bnTargetPerSecond < bnQuot)
+        return ~uint256(0);
+
+    return bnTargetPerSecond;
+}
+
+uint256 GetMaxStakeTarget(const uint256 &nTargetPerSecond, uint32_t nInputTxTime, uint32_t nTimeTx)
+{
+    int64_t nWeight = GetWeight((int64_t)nInputTxTime, (int64_t)nTimeTx);
+    if (nWeight <= 0)
+        return 0;
+
+    // 256 x 32 bits multiplication, saturating on overflow
+    uint32_t pn[8];
+    uint64_t nCarry = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        nCarry += (uint64_t)nTargetPerSecond.Get32(i) * (uint64_t)nWeight;
+        pn[i] = (uint32_t)nCarry;
+        nCarry >>= 32;
+    }
+    if (nCarry != 0)
+        return ~uint256(0);
 
+    uint256 nMaxTarget;
+    memcpy(nMaxTarget.begin(), pn, sizeof(pn));
+    return nMaxTarget;
+}
+
+// Scan given kernel for solutions
 bool ScanKernelBackward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, std::pair<uint32_t, uint32_t> &SearchInterval, std::pair<uint256, uint32_t> &solution)
 {
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
+    return ScanKernelBackward(kernel, nBits, nInputTxTime, nValueIn, GetStakeTargetPerSecond(nBits, nValueIn), SearchInterval, solution);
+}
+
+bool ScanKernelBackward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, const uint256 &nTargetPerSecond, std::pair<uint32_t, uint32_t> &SearchInterval, std::pair<uint256, uint32_t> &solution)
+{
+    // Weight is maximal at the beginning of backward search, skip the
+    //   input without hashing if it can't meet the target in this interval
+    uint256 nMaxTarget = GetMaxStakeTarget(nTargetPerSecond, nInputTxTime, SearchInterval.first);
+    if (nMaxTarget == 0)
+        return false;
 
-    CBigNum bnValueIn(nValueIn);
+    // Most significant word of the maximum target, the only comparison done for the majority of hashes
+    uint64_t nMaxTarget64 = nMaxTarget.Get64(3);
 
-    // Get maximum possible target to filter out the majority of obviously insufficient hashes
-    uint256 nMaxTarget = (bnTargetPerCoinDay * bnValueIn * nStakeMaxAge / COIN / nOneDay).getuint256();
+    // Precalculate hashing context for the static part of kernel
+    sha256_kernel_ctx ctx;
+    sha256_kernel_init(&ctx, kernel);
 
-    SHA256_CTX ctx, workerCtx;
-    // Init new sha256 context and update it
-    //   with first 24 bytes of kernel
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, kernel, 8 + 16);
-    workerCtx = ctx; // save context
+    // Timestamps and kernel hashes of the current batch
+    uint32_t vTimeTx[SHA256_KERNEL_LANES];
+    uint256 vHashProofOfStake[SHA256_KERNEL_LANES];
 
     // Search backward in time from the given timestamp
     // Stopping search in case of shutting down
-    for (uint32_t nTimeTx=SearchInterval.first; nTimeTx>SearchInterval.second && !fShutdown; nTimeTx--)
+    for (uint32_t nTimeTx=SearchInterval.first; nTimeTx>SearchInterval.second && !fShutdown; )
     {
-        // Complete first hashing iteration
-        uint256 hash1;
-        SHA256_Update(&ctx, (unsigned char*)&nTimeTx, 4);
-        SHA256_Final((unsigned char*)&hash1, &ctx);
-
-        // Restore context
-        ctx = workerCtx;
-
-        // Finally, calculate kernel hash
-        uint256 hashProofOfStake;
-        SHA256((unsigned char*)&hash1, sizeof(hashProofOfStake), (unsigned char*)&hashProofOfStake);
-
-        // Skip if hash doesn't satisfy the maximum target
-        if (hashProofOfStake > nMaxTarget)
-            continue;
-
-        CBigNum bnCoinDayWeight = bnValueIn * GetWeight((int64_t)nInputTxTime, (int64_t)nTimeTx) / COIN / nOneDay;
-        CBigNum bnTargetProofOfStake = bnCoinDayWeight * bnTargetPerCoinDay;
-
-        if (bnTargetProofOfStake >= CBigNum(hashProofOfStake))
+        // Calculate kernel hashes for the batch of timestamps at once
+        unsigned int nLanes = std::min((uint32_t)SHA256_KERNEL_LANES, nTimeTx - SearchInterval.second);
+        for (unsigned int i = 0; i < nLanes; i++)
+            vTimeTx[i] = nTimeTx - i;
+        sha256d_kernel_n(&ctx, vTimeTx, vHashProofOfStake, nLanes);
+        nTimeTx -= nLanes;
+
+        // Check them in the same order they would be scanned one by one
+        for (unsigned int i = 0; i < nLanes; i++)
         {
-            solution.first = hashProofOfStake;
-            solution.second = nTimeTx;
+            // Skip if hash doesn't satisfy the maximum target
+            if (vHashProofOfStake[i].Get64(3) > nMaxTarget64 || vHashProofOfStake[i] > nMaxTarget)
+                continue;
+
+            if (CheckStakeTarget(vHashProofOfStake[i], nBits, nValueIn, GetWeight((int64_t)nInputTxTime, (int64_t)vTimeTx[i])))
+            {
+                solution.first = vHashProofOfStake[i];
+                solution.second = vTimeTx[i];
 
-            return true;
+                return true;
+            }
         }
     }
 
@@ -23,14 +23,21 @@ private:
     uint8_t *kernel;
     uint32_t nBits;
     uint32_t nInputTxTime;
-    CBigNum  bnValueIn;
+    int64_t  nValueIn;
 
     // Interval boundaries.
     uint32_t nIntervalBegin;
     uint32_t nIntervalEnd;
 };
 
+// Upper bound of the kernel target per second of coin age, depends only on nBits and amount
+uint256 GetStakeTargetPerSecond(uint32_t nBits, int64_t nValueIn);
+
+// Upper bound of the kernel target for the timestamps up to nTimeTx, zero if input can't stake yet
+uint256 GetMaxStakeTarget(const uint256 &nTargetPerSecond, uint32_t nInputTxTime, uint32_t nTimeTx);
+
 // Scan given kernel for solutions
 bool ScanKernelBackward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, std::pair<uint32_t, uint32_t> &SearchInterval, std::pair<uint256, uint32_t> &solution);
+bool ScanKernelBackward(unsigned char *kernel, uint32_t nBits, uint32_t nInputTxTime, int64_t nValueIn, const uint256 &nTargetPerSecond, std::pair<uint32_t, uint32_t> &SearchInterval, std::pair<uint256, uint32_t> &solution);
 
 #endif // NOVACOIN_KERNELWORKER_H
\ No newline at end of file
@@ -2,8 +2,16 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <deque>
 #include <map>
+#include <set>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+#include <openssl/crypto.h>
 #include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/obj_mac.h>
@@ -11,6 +19,165 @@
 #include "key.h"
 #include "base58.h"
 
+#ifdef USE_SECP256K1
+#include <openssl/rand.h>
+#include <secp256k1.h>
+
+// One libsecp256k1 context serves the whole process, it is read-only once created
+static const secp256k1_context *Secp256k1Context()
+{
+    static secp256k1_context *ctx = NULL;
+    static boost::once_flag flag = BOOST_ONCE_INIT;
+    struct Init {
+        static void Create()
+        {
+            ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY | SECP256K1_CONTEXT_SIGN);
+            unsigned char vchSeed[32];
+            RAND_bytes(vchSeed, sizeof(vchSeed));
+            // Blinding only hardens signing, verification does not depend on it
+            secp256k1_context_randomize(ctx, vchSeed);
+            OPENSSL_cleanse(vchSeed, sizeof(vchSeed));
+        }
+    };
+    boost::call_once(&Init::Create, flag);
+    return ctx;
+}
+
+// libsecp256k1 only takes strict DER, while OpenSSL has always accepted a lot of
+// malformed encodings. This parses the same signatures OpenSSL did, so switching
+// the verifier does not change which transactions are valid.
+static bool ParseLaxDER(const secp256k1_context *ctx, secp256k1_ecdsa_signature *sig, const unsigned char *input, size_t inputlen)
+{
+    size_t rpos, rlen, spos, slen;
+    size_t pos = 0;
+    size_t lenbyte;
+    unsigned char tmpsig[64] = {0};
+    int overflow = 0;
+
+    // Hack to initialize sig with a correctly-parsed but invalid signature
+    secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+
+    // Sequence tag byte
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+
+    // Sequence length bytes
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        pos += lenbyte;
+    }
+
+    // Integer tag byte for R
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+
+    // Integer length for R
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        rlen = 0;
+        while (lenbyte > 0) {
+            rlen = (rlen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        rlen = lenbyte;
+    }
+    if (rlen > inputlen - pos)
+        return false;
+    rpos = pos;
+    pos += rlen;
+
+    // Integer tag byte for S
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+
+    // Integer length for S
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        slen = 0;
+        while (lenbyte > 0) {
+            slen = (slen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        slen = lenbyte;
+    }
+    if (slen > inputlen - pos)
+        return false;
+    spos = pos;
+
+    // Ignore leading zeroes in R
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    // Copy R value
+    if (rlen > 32)
+        overflow = 1;
+    else
+        memcpy(tmpsig + 32 - rlen, input + rpos, rlen);
+
+    // Ignore leading zeroes in S
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    // Copy S value
+    if (slen > 32)
+        overflow = 1;
+    else
+        memcpy(tmpsig + 64 - slen, input + spos, slen);
+
+    if (!overflow)
+        overflow = !secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+    if (overflow) {
+        // Overwrite the result again with a correctly-parsed but invalid
+        // signature if parsing failed.
+        memset(tmpsig, 0, 64);
+        secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+    }
+    return true;
+}
+
+bool CPubKey::IsFullyValid() const
+{
+    secp256k1_pubkey pubkey;
+    return IsValid() && secp256k1_ec_pubkey_parse(Secp256k1Context(), &pubkey, &vbytes[0], size());
+}
+#endif
+
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
@@ -370,6 +537,24 @@ CPubKey CKey::GetPubKey() const
 bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 {
     vchSig.clear();
+#ifdef USE_SECP256K1
+    // RFC6979 nonces, and the result is already low S
+    const secp256k1_context *ctx = Secp256k1Context();
+    CSecret vchSecret = GetSecret();
+    secp256k1_ecdsa_signature sig;
+    if (!secp256k1_ecdsa_sign(ctx, &sig, (const unsigned char*)&hash, &vchSecret[0], secp256k1_nonce_function_rfc6979, NULL))
+        return false;
+    size_t nSize = 72;
+    vchSig.resize(nSize);
+    secp256k1_ecdsa_signature_serialize_der(ctx, &vchSig[0], &nSize, &sig);
+    vchSig.resize(nSize);
+    // Testing our new signature
+    if (!GetPubKey().Verify(hash, vchSig)) {
+        vchSig.clear();
+        return false;
+    }
+    return true;
+#else
     ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
     if (sig==NULL)
         return false;
@@ -393,6 +578,7 @@ bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
         return false;
     }
     return true;
+#endif
 }
 
 // create a compact signature (65 bytes), which allows reconstructing the used public key
@@ -492,28 +678,104 @@ bool CPubKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>
     return fSuccessful;
 }
 
+#ifndef USE_SECP256K1
+// Decoded keys of the signers seen most often, stake and pool keys mostly.
+// A key is only admitted on its second sighting so that one-off keys from
+// ordinary transactions do not push the frequent ones out.
+class CPubKeyCache
+{
+private:
+    typedef std::map<CPubKey, boost::shared_ptr<EC_KEY> > map_type;
+
+    static const size_t nMaxKeys = 1000;
+    static const size_t nMaxSeen = 20000;
+
+    boost::mutex cs;
+    map_type mapKeys;
+    std::deque<CPubKey> vOrder;
+    std::set<CPubKey> setSeen;
+
+public:
+    boost::shared_ptr<EC_KEY> Get(const CPubKey& key)
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        map_type::const_iterator it = mapKeys.find(key);
+        if (it == mapKeys.end())
+            return boost::shared_ptr<EC_KEY>();
+        return it->second;
+    }
+
+    void Add(const CPubKey& key, const boost::shared_ptr<EC_KEY>& pkey)
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (setSeen.insert(key).second)
+        {
+            if (setSeen.size() > nMaxSeen)
+            {
+                setSeen.clear();
+                setSeen.insert(key);
+            }
+            return;
+        }
+        if (!mapKeys.insert(std::make_pair(key, pkey)).second)
+            return;
+        setSeen.erase(key);
+        vOrder.push_back(key);
+        if (vOrder.size() > nMaxKeys)
+        {
+            mapKeys.erase(vOrder.front());
+            vOrder.pop_front();
+        }
+    }
+};
+
+static CPubKeyCache pubKeyCache;
+#endif
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const
 {
     if (vchSig.empty() || !IsValid())
         return false;
 
-    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
-    ECDSA_SIG *norm_sig = ECDSA_SIG_new();
+#ifdef USE_SECP256K1
+    const secp256k1_context *ctx = Secp256k1Context();
+    secp256k1_pubkey pubkey;
+    secp256k1_ecdsa_signature sig;
+    if (!secp256k1_ec_pubkey_parse(ctx, &pubkey, &vbytes[0], size()))
+        return false;
+    if (!ParseLaxDER(ctx, &sig, &vchSig[0], vchSig.size()))
+        return false;
+    // OpenSSL accepts high S, libsecp256k1 only verifies the lower form
+    secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+    return secp256k1_ecdsa_verify(ctx, &sig, (const unsigned char*)&hash, &pubkey) == 1;
+#else
+    // Keys already in the cache skip o2i_ECPublicKey, everything else is decoded here
+    boost::shared_ptr<EC_KEY> pkey = pubKeyCache.Get(*this);
+    bool fCached = pkey.get() != NULL;
+    if (!fCached)
+    {
+        EC_KEY *pnew = EC_KEY_new_by_curve_name(NID_secp256k1);
+        assert(pnew);
+        const uint8_t* pbegin = &vbytes[0];
+        // Trying to parse public key
+        if (!o2i_ECPublicKey(&pnew, &pbegin, size()))
+        {
+            EC_KEY_free(pnew);
+            return false;
+        }
+        pkey.reset(pnew, EC_KEY_free);
+    }
 
+    ECDSA_SIG *norm_sig = ECDSA_SIG_new();
     assert(norm_sig);
-    assert(pkey);
 
     bool ret = false;
     do
     {
         int derlen;
         uint8_t *norm_der = NULL;
-        const uint8_t* pbegin = &vbytes[0];
         const uint8_t* sigptr = &vchSig[0];
 
-        // Trying to parse public key
-        if (!o2i_ECPublicKey(&pkey, &pbegin, size()))
-            break;
         // New versions of OpenSSL are rejecting a non-canonical DER signatures, de/re-serialize first.
         if (d2i_ECDSA_SIG(&norm_sig, &sigptr, vchSig.size()) == NULL)
             break;
@@ -521,14 +783,19 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
             break;
 
         // -1 = error, 0 = bad sig, 1 = good
-        ret = ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), norm_der, derlen, pkey) == 1;
+        ret = ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), norm_der, derlen, pkey.get()) == 1;
         OPENSSL_free(norm_der);
     } while(false);
 
     ECDSA_SIG_free(norm_sig);
-    EC_KEY_free(pkey);
+
+    // Only offered after a verify has run on it, so any per-key data OpenSSL
+    // sets up lazily exists before other threads can share the key
+    if (!fCached)
+        pubKeyCache.Add(*this, pkey);
 
     return ret;
+#endif
 }
 
 bool CPubKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
@@ -555,19 +822,38 @@ bool CKey::IsValid()
     return GetPubKey() == key2.GetPubKey();
 }
 
+// The curve used by the malleable key code. Multiples of the generator are
+// precomputed once, so G*m doesn't go through the generic multiplication.
+// It is never modified afterwards and is shared between threads.
+static const EC_GROUP *PrecomputedGroup()
+{
+    static EC_GROUP *group = NULL;
+    static boost::once_flag flag = BOOST_ONCE_INIT;
+    struct Init {
+        static void Create()
+        {
+            EC_GROUP *groupNew = EC_GROUP_new_by_curve_name(NID_secp256k1);
+            BN_CTX *ctx = BN_CTX_new();
+            if (groupNew && ctx && EC_GROUP_precompute_mult(groupNew, ctx))
+                group = groupNew;
+            else if (groupNew)
+                EC_GROUP_free(groupNew);
+            if (ctx) BN_CTX_free(ctx);
+        }
+    };
+    boost::call_once(&Init::Create, flag);
+    if (!group)
+        throw key_error("PrecomputedGroup() : unable to set up secp256k1 group");
+    return group;
+}
+
 CPoint::CPoint()
 {
     std::string err;
-    group = NULL;
+    group = PrecomputedGroup();
     point = NULL;
     ctx   = NULL;
 
-    group = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    if (!group) {
-        err = "EC_KEY_new_by_curve_name failed.";
-        goto finish;
-    }
-
     point = EC_POINT_new(group);
     if (!point) {
         err = "EC_POINT_new failed.";
@@ -583,7 +869,6 @@ CPoint::CPoint()
     return;
 
 finish:
-    if (group) EC_GROUP_free(group);
     if (point) EC_POINT_free(point);
     throw std::runtime_error(std::string("CPoint::CPoint() :  - ") + err);
 }
@@ -597,7 +882,6 @@ bool CPoint::operator!=(const CPoint &a)
 CPoint::~CPoint()
 {
     if (point) EC_POINT_free(point);
-    if (group) EC_GROUP_free(group);
     if (ctx)   BN_CTX_free(ctx);
 }
 
@@ -631,7 +915,7 @@ bool CPoint::getBytes(std::vector<unsigned char> &vchBytes)
 // ECC multiplication by specified multiplier
 bool CPoint::ECMUL(const CBigNum &bnMultiplier)
 {
-    if (!EC_POINT_mul(group, point, NULL, point, &bnMultiplier, NULL)) {
+    if (!EC_POINT_mul(group, point, NULL, point, &bnMultiplier, ctx)) {
         printf("CPoint::ECMUL() : EC_POINT_mul failed");
         return false;
     }
@@ -642,7 +926,8 @@ bool CPoint::ECMUL(const CBigNum &bnMultiplier)
 // Calculate G*m + q
 bool CPoint::ECMULGEN(const CBigNum &bnMultiplier, const CPoint &qPoint)
 {
-    if (!EC_POINT_mul(group, point, &bnMultiplier, qPoint.point, BN_value_one(), NULL)) {
+    if (!EC_POINT_mul(group, point, &bnMultiplier, NULL, NULL, ctx) ||
+        !EC_POINT_add(group, point, point, qPoint.point, ctx)) {
         printf("CPoint::ECMULGEN() : EC_POINT_mul failed.");
         return false;
     }
@@ -655,9 +940,15 @@ bool CPoint::ECMULGEN(const CBigNum &bnMultiplier, const CPoint &qPoint)
 void CMalleablePubKey::GetVariant(CPubKey &R, CPubKey &vchPubKeyVariant)
 {
     EC_KEY *eckey = NULL;
-    eckey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    eckey = EC_KEY_new();
     if (eckey == NULL) {
-        throw key_error("CMalleablePubKey::GetVariant() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CMalleablePubKey::GetVariant() : EC_KEY_new failed");
+    }
+
+    // The copy keeps the generator multiples, so G*r is computed from them
+    if (!EC_KEY_set_group(eckey, PrecomputedGroup())) {
+        EC_KEY_free(eckey);
+        throw key_error("CMalleablePubKey::GetVariant() : EC_KEY_set_group failed");
     }
 
     // Use standard key generation function to get r and R values.
@@ -1158,6 +1449,244 @@ bool CMalleableKeyView::CheckKeyVariant(const CPubKey &R, const CPubKey &vchPubK
     return true;
 }
 
+CMalleableKeyChecker::CMalleableKeyChecker()
+{
+    group = PrecomputedGroup();
+}
+
+CMalleableKeyChecker::~CMalleableKeyChecker()
+{
+    for (unsigned int i = 0; i < vH.size(); i++)
+        EC_POINT_free(vH[i]);
+}
+
+bool CMalleableKeyChecker::AddView(const CMalleableKeyView &view)
+{
+    if (!view.IsValid())
+        return false;
+
+    EC_POINT *point_H = EC_POINT_new(group);
+    if (!point_H)
+        return false;
+    if (!EC_POINT_oct2point(group, point_H, view.vchPubKeyH.begin(), view.vchPubKeyH.size(), NULL)) {
+        EC_POINT_free(point_H);
+        return false;
+    }
+
+    CBigNum bnl;
+    bnl.setBytes(std::vector<unsigned char>(view.vchSecretL.begin(), view.vchSecretL.end()));
+
+    vViews.push_back(view);
+    vL.push_back(bnl);
+    vH.push_back(point_H);
+    return true;
+}
+
+// Same computation as CMalleableKeyView::CheckKeyVariant, which reports failures
+//   to decode, but undecodable candidates are just not ours here
+bool CMalleableKeyChecker::Check(const CPubKey &R, const CPubKey &vchPubKeyVariant, CMalleableKeyView *pview) const
+{
+    if (vViews.empty() || !R.IsValid() || !vchPubKeyVariant.IsValid())
+        return false;
+
+    bool fFound = false;
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *point_R = EC_POINT_new(group);
+    EC_POINT *point_P = EC_POINT_new(group);
+    EC_POINT *point_Rl = EC_POINT_new(group);
+    EC_POINT *point_Ps = EC_POINT_new(group);
+    if (!ctx || !point_R || !point_P || !point_Rl || !point_Ps)
+        goto finish;
+
+    if (!EC_POINT_oct2point(group, point_R, R.begin(), R.size(), ctx) ||
+        !EC_POINT_oct2point(group, point_P, vchPubKeyVariant.begin(), vchPubKeyVariant.size(), ctx))
+        goto finish;
+
+    // Infinity points are senseless
+    if (EC_POINT_is_at_infinity(group, point_P))
+        goto finish;
+
+    for (unsigned int i = 0; i < vViews.size() && !fFound; i++)
+    {
+        // Calculate Hash(R*l)
+        if (!EC_POINT_mul(group, point_Rl, NULL, point_R, &vL[i], ctx))
+            continue;
+        unsigned char pchRl[33];
+        if (EC_POINT_point2oct(group, point_Rl, POINT_CONVERSION_COMPRESSED, pchRl, sizeof(pchRl), ctx) != sizeof(pchRl))
+            continue;
+        CBigNum bnHash;
+        bnHash.setuint160(Hash160(pchRl, pchRl + sizeof(pchRl)));
+
+        // Calculate Ps = Hash(R*l)*G + H
+        if (!EC_POINT_mul(group, point_Ps, &bnHash, NULL, NULL, ctx) ||
+            !EC_POINT_add(group, point_Ps, point_Ps, vH[i], ctx))
+            continue;
+        if (EC_POINT_is_at_infinity(group, point_Ps))
+            continue;
+
+        if (EC_POINT_cmp(group, point_Ps, point_P, ctx) == 0) {
+            fFound = true;
+            if (pview)
+                *pview = vViews[i];
+        }
+    }
+
+finish:
+    if (point_Ps) EC_POINT_free(point_Ps);
+    if (point_Rl) EC_POINT_free(point_Rl);
+    if (point_P) EC_POINT_free(point_P);
+    if (point_R) EC_POINT_free(point_R);
+    if (ctx) BN_CTX_free(ctx);
+    return fFound;
+}
+
+CMalleableVariantGenerator::CMalleableVariantGenerator(const CMalleablePubKey &mpk)
+{
+    std::string err;
+    group = PrecomputedGroup();
+    point_H = NULL;
+
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *point_L = EC_POINT_new(group);
+    point_H = EC_POINT_new(group);
+    if (!ctx || !point_L || !point_H) {
+        err = "allocation failed";
+        goto finish;
+    }
+
+    if (!mpk.IsValid() ||
+        !EC_POINT_oct2point(group, point_L, mpk.pubKeyL.begin(), mpk.pubKeyL.size(), ctx) ||
+        !EC_POINT_oct2point(group, point_H, mpk.pubKeyH.begin(), mpk.pubKeyH.size(), ctx)) {
+        err = "unable to decode L and H values";
+        goto finish;
+    }
+
+    // Row i holds L*j*16^i for j = 1..15, point_L walks through L*16^i
+    vLTable.reserve(WINDOWS * (WINDOW_SIZE - 1));
+    for (int i = 0; i < WINDOWS && err.empty(); i++)
+    {
+        for (int j = 1; j < WINDOW_SIZE; j++)
+        {
+            EC_POINT *point = EC_POINT_new(group);
+            if (!point) {
+                err = "allocation failed";
+                break;
+            }
+            vLTable.push_back(point);
+            if (!(j == 1 ? EC_POINT_copy(point, point_L) : EC_POINT_add(group, point, vLTable[vLTable.size() - 2], point_L, ctx))) {
+                err = "EC_POINT_add failed";
+                break;
+            }
+        }
+        if (err.empty() && !EC_POINT_add(group, point_L, vLTable.back(), point_L, ctx))
+            err = "EC_POINT_add failed";
+    }
+
+    // Affine coordinates make the additions in GetVariant cheaper
+    if (err.empty() && !EC_POINTs_make_affine(group, vLTable.size(), &vLTable[0], ctx))
+        err = "EC_POINTs_make_affine failed";
+
+finish:
+    if (point_L) EC_POINT_free(point_L);
+    if (ctx) BN_CTX_free(ctx);
+    if (!err.empty()) {
+        for (unsigned int i = 0; i < vLTable.size(); i++)
+            EC_POINT_free(vLTable[i]);
+        if (point_H) EC_POINT_free(point_H);
+        throw key_error("CMalleableVariantGenerator::CMalleableVariantGenerator() : " + err);
+    }
+}
+
+CMalleableVariantGenerator::~CMalleableVariantGenerator()
+{
+    for (unsigned int i = 0; i < vLTable.size(); i++)
+        EC_POINT_free(vLTable[i]);
+    EC_POINT_free(point_H);
+}
+
+// Same computation as CMalleablePubKey::GetVariant
+void CMalleableVariantGenerator::GetVariant(CPubKey &R, CPubKey &vchPubKeyVariant) const
+{
+    std::string err;
+    CBigNum bnOrder, bnr, bnHash;
+    unsigned char pchr[32], pchR[33], pchLr[33], pchP[33];
+
+    BN_CTX *ctx = BN_CTX_new();
+    EC_POINT *point_R = EC_POINT_new(group);
+    EC_POINT *point_Lr = EC_POINT_new(group);
+    EC_POINT *point_P = EC_POINT_new(group);
+    if (!ctx || !point_R || !point_Lr || !point_P) {
+        err = "allocation failed";
+        goto finish;
+    }
+
+    // Random r in [1, n-1], R = G*r
+    if (!EC_GROUP_get_order(group, &bnOrder, ctx)) {
+        err = "EC_GROUP_get_order failed";
+        goto finish;
+    }
+    do {
+        if (!BN_rand_range(&bnr, &bnOrder)) {
+            err = "BN_rand_range failed";
+            goto finish;
+        }
+    } while (BN_is_zero(&bnr));
+
+    if (!EC_POINT_mul(group, point_R, &bnr, NULL, NULL, ctx) ||
+        EC_POINT_point2oct(group, point_R, POINT_CONVERSION_COMPRESSED, pchR, sizeof(pchR), ctx) != sizeof(pchR)) {
+        err = "unable to calculate R value";
+        goto finish;
+    }
+
+    // L*r, adding one table entry per nonzero nibble of r
+    memset(pchr, 0, sizeof(pchr));
+    BN_bn2bin(&bnr, pchr + sizeof(pchr) - BN_num_bytes(&bnr));
+    if (!EC_POINT_set_to_infinity(group, point_Lr)) {
+        err = "EC_POINT_set_to_infinity failed";
+        goto finish;
+    }
+    for (int i = 0; i < WINDOWS; i++)
+    {
+        int nNibble = (pchr[sizeof(pchr) - 1 - i / 2] >> (4 * (i & 1))) & 0x0f;
+        if (nNibble && !EC_POINT_add(group, point_Lr, point_Lr, vLTable[i * (WINDOW_SIZE - 1) + nNibble - 1], ctx)) {
+            err = "EC_POINT_add failed";
+            goto finish;
+        }
+    }
+    if (EC_POINT_point2oct(group, point_Lr, POINT_CONVERSION_COMPRESSED, pchLr, sizeof(pchLr), ctx) != sizeof(pchLr)) {
+        err = "unable to convert Lr value";
+        goto finish;
+    }
+
+    // P = Hash(L*r)*G + H
+    bnHash.setuint160(Hash160(pchLr, pchLr + sizeof(pchLr)));
+    if (!EC_POINT_mul(group, point_P, &bnHash, NULL, NULL, ctx) ||
+        !EC_POINT_add(group, point_P, point_P, point_H, ctx)) {
+        err = "unable to calculate P value";
+        goto finish;
+    }
+    if (EC_POINT_is_at_infinity(group, point_P)) {
+        err = "P is infinity";
+        goto finish;
+    }
+    if (EC_POINT_point2oct(group, point_P, POINT_CONVERSION_COMPRESSED, pchP, sizeof(pchP), ctx) != sizeof(pchP)) {
+        err = "unable to convert P value";
+        goto finish;
+    }
+
+    R = CPubKey(std::vector<unsigned char>(pchR, pchR + sizeof(pchR)));
+    vchPubKeyVariant = CPubKey(std::vector<unsigned char>(pchP, pchP + sizeof(pchP)));
+
+finish:
+    OPENSSL_cleanse(pchr, sizeof(pchr));
+    if (point_P) EC_POINT_free(point_P);
+    if (point_Lr) EC_POINT_free(point_Lr);
+    if (point_R) EC_POINT_free(point_R);
+    if (ctx) BN_CTX_free(ctx);
+    if (!err.empty())
+        throw key_error("CMalleableVariantGenerator::GetVariant() : " + err);
+}
+
 std::string CMalleableKeyView::ToString() const
 {
     CDataStream ssKey(SER_NETWORK, PROTOCOL_VERSION);
@@ -1202,60 +1731,158 @@ bool CMalleableKeyView::IsValid() const
 
 void CPubKey::EncryptData(const std::vector<unsigned char>& data, std::vector<unsigned char>& encrypted)
 {
-    ies_ctx_t *ctx;
-    char error[1024] = "Unknown error";
-    cryptogram_t *cryptogram;
+    CDataEncryptor encryptor(*this);
+    encryptor.Encrypt(data, encrypted);
+}
+
+void CKey::DecryptData(const std::vector<unsigned char>& encrypted, std::vector<unsigned char>& data)
+{
+    CDataDecryptor decryptor(*this);
+    decryptor.Decrypt(encrypted, data);
+}
 
-    const unsigned char* pbegin = &vbytes[0];
-    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
-    if (!o2i_ECPublicKey(&pkey, &pbegin, size()))
+CDataEncryptor::CDataEncryptor(const CPubKey& pubKey)
+{
+    const unsigned char* pbegin = pubKey.begin();
+    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (!o2i_ECPublicKey(&pkey, &pbegin, pubKey.size()))
+    {
+        EC_KEY_free(pkey);
         throw key_error("Unable to parse EC key");
+    }
 
     ctx = create_context(pkey);
-    if (!EC_KEY_get0_public_key(ctx->user_key))
-        throw key_error("Given EC key is not public key");
-
-    cryptogram = ecies_encrypt(ctx, (unsigned char*)&data[0], data.size(), error);
-    if (cryptogram == NULL) {
-        delete ctx;
-        ctx = NULL;
-        throw key_error(std::string("Error in encryption: %s") + error);
+    if (ctx == NULL)
+    {
+        EC_KEY_free(pkey);
+        throw key_error("Unable to create encryption context");
     }
+    ies_stream_init(&stream, ctx);
+}
 
-    encrypted.resize(cryptogram_data_sum_length(cryptogram));
-    unsigned char *key_data = cryptogram_key_data(cryptogram);
-    memcpy(&encrypted[0], key_data, encrypted.size());
-    cryptogram_free(cryptogram);
+CDataEncryptor::~CDataEncryptor()
+{
+    ies_stream_cleanup(&stream);
     delete ctx;
+    EC_KEY_free(pkey);
 }
 
-void CKey::DecryptData(const std::vector<unsigned char>& encrypted, std::vector<unsigned char>& data)
+void CDataEncryptor::Begin(std::vector<unsigned char>& encrypted)
 {
-    ies_ctx_t *ctx;
     char error[1024] = "Unknown error";
-    cryptogram_t *cryptogram;
-    size_t length;
-    unsigned char *decrypted;
+    size_t nOffset = encrypted.size();
+    encrypted.resize(nOffset + ctx->stored_key_length);
+    if (!ecies_encrypt_begin(&stream, &encrypted[nOffset], error))
+        throw key_error(std::string("Error in encryption: ") + error);
+}
 
-    ctx = create_context(pkey);
-    if (!EC_KEY_get0_private_key(ctx->user_key))
-        throw key_error("Given EC key is not private key");
+void CDataEncryptor::Update(const unsigned char* pdata, size_t nLength, std::vector<unsigned char>& encrypted)
+{
+    char error[1024] = "Unknown error";
+    size_t nOffset = encrypted.size(), nWritten;
+    encrypted.resize(nOffset + nLength + EVP_MAX_BLOCK_LENGTH);
+    if (!ecies_encrypt_update(&stream, pdata, nLength, &encrypted[nOffset], &nWritten, error))
+        throw key_error(std::string("Error in encryption: ") + error);
+    encrypted.resize(nOffset + nWritten);
+}
 
-    size_t key_length = ctx->stored_key_length;
-    size_t mac_length = EVP_MD_size(ctx->md);
-    cryptogram = cryptogram_alloc(key_length, mac_length, encrypted.size() - key_length - mac_length);
+void CDataEncryptor::End(std::vector<unsigned char>& encrypted)
+{
+    char error[1024] = "Unknown error";
+    size_t nOffset = encrypted.size(), nWritten;
+    encrypted.resize(nOffset + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE);
+    if (!ecies_encrypt_end(&stream, &encrypted[nOffset], &nWritten, error))
+        throw key_error(std::string("Error in encryption: ") + error);
+    encrypted.resize(nOffset + nWritten);
+}
+
+void CDataEncryptor::Encrypt(const std::vector<unsigned char>& data, std::vector<unsigned char>& encrypted)
+{
+    encrypted.clear();
+    encrypted.reserve(ctx->stored_key_length + data.size() + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE);
+    Begin(encrypted);
+    if (!data.empty())
+        Update(&data[0], data.size(), encrypted);
+    End(encrypted);
+}
+
+CDataDecryptor::CDataDecryptor(const CKey& key)
+{
+    if (!key.pkey || !EC_KEY_get0_private_key(key.pkey))
+        throw key_error("Given EC key is not private key");
+    pkey = EC_KEY_dup(key.pkey);
+    if (pkey == NULL)
+        throw key_error("Unable to copy EC key");
 
-    memcpy(cryptogram_key_data(cryptogram), &encrypted[0], encrypted.size());
+    ctx = create_context(pkey);
+    if (ctx == NULL)
+    {
+        EC_KEY_free(pkey);
+        throw key_error("Unable to create decryption context");
+    }
+    ies_stream_init(&stream, ctx);
+    fStarted = false;
+}
 
-    decrypted = ecies_decrypt(ctx, cryptogram, &length, error);
-    cryptogram_free(cryptogram);
+CDataDecryptor::~CDataDecryptor()
+{
+    ies_stream_cleanup(&stream);
     delete ctx;
+    EC_KEY_free(pkey);
+}
 
-    if (decrypted == NULL) {
-        throw key_error(std::string("Error in decryption: %s") + error);
+void CDataDecryptor::Begin()
+{
+    vchEphemeralKey.clear();
+    fStarted = false;
+}
+
+void CDataDecryptor::Update(const unsigned char* pdata, size_t nLength, std::vector<unsigned char>& data)
+{
+    char error[1024] = "Unknown error";
+    if (!fStarted)
+    {
+        size_t nTake = std::min(nLength, ctx->stored_key_length - vchEphemeralKey.size());
+        vchEphemeralKey.insert(vchEphemeralKey.end(), pdata, pdata + nTake);
+        pdata += nTake;
+        nLength -= nTake;
+        if (vchEphemeralKey.size() < ctx->stored_key_length)
+            return;
+        if (!ecies_decrypt_begin(&stream, &vchEphemeralKey[0], vchEphemeralKey.size(), error))
+            throw key_error(std::string("Error in decryption: ") + error);
+        fStarted = true;
     }
 
-    data.resize(length);
-    memcpy(&data[0], decrypted, length);
-    free(decrypted);
+    size_t nOffset = data.size(), nWritten;
+    data.resize(nOffset + nLength + EVP_MAX_MD_SIZE + EVP_MAX_BLOCK_LENGTH);
+    if (!ecies_decrypt_update(&stream, pdata, nLength, &data[nOffset], &nWritten, error))
+        throw key_error(std::string("Error in decryption: ") + error);
+    data.resize(nOffset + nWritten);
+}
+
+void CDataDecryptor::End(std::vector<unsigned char>& data)
+{
+    char error[1024] = "Unknown error";
+    if (!fStarted)
+        throw key_error("Error in decryption: the message is too short");
+    fStarted = false;
+    vchEphemeralKey.clear();
+
+    size_t nOffset = data.size(), nWritten;
+    data.resize(nOffset + EVP_MAX_BLOCK_LENGTH);
+    if (!ecies_decrypt_end(&stream, &data[nOffset], &nWritten, error))
+        throw key_error(std::string("Error in decryption: ") + error);
+    data.resize(nOffset + nWritten);
+}
+
+void CDataDecryptor::Decrypt(const std::vector<unsigned char>& encrypted, std::vector<unsigned char>& data)
+{
+    // The tag is checked before any of the plain text is returned
+    std::vector<unsigned char> vchPlain;
+    vchPlain.reserve(encrypted.size());
+    Begin();
+    if (!encrypted.empty())
+        Update(&encrypted[0], encrypted.size(), vchPlain);
+    End(vchPlain);
+    data.swap(vchPlain);
 }
@@ -181,6 +181,9 @@ public:
     }
 
     //! fully validate whether this is a valid public key (more expensive than IsValid())
+#ifdef USE_SECP256K1
+    bool IsFullyValid() const;
+#else
     bool IsFullyValid() const
     {
         const unsigned char* pbegin = &vbytes[0];
@@ -192,6 +195,7 @@ public:
         }
         return false;
     }
+#endif
 
     //! Check whether this is a compressed public key.
     bool IsCompressed() const
@@ -264,13 +268,71 @@ public:
 
     // Decrypt data
     void DecryptData(const std::vector<unsigned char>& encrypted, std::vector<unsigned char>& data);
+
+    friend class CDataDecryptor;
+};
+
+/** Encrypts data to one public key in the EncryptData format.
+ *
+ * The key is decoded and the cipher and MAC contexts are set up once, so a
+ * message costs little more than the ephemeral key it still gets. A message
+ * may also be given in chunks between Begin and End, each call appends its
+ * part of the output.
+ */
+class CDataEncryptor
+{
+private:
+    EC_KEY* pkey;
+    ies_ctx_t* ctx;
+    ies_stream_t stream;
+
+    CDataEncryptor(const CDataEncryptor&);
+    CDataEncryptor& operator=(const CDataEncryptor&);
+
+public:
+    CDataEncryptor(const CPubKey& pubKey);
+    ~CDataEncryptor();
+
+    void Encrypt(const std::vector<unsigned char>& data, std::vector<unsigned char>& encrypted);
+
+    void Begin(std::vector<unsigned char>& encrypted);
+    void Update(const unsigned char* pdata, size_t nLength, std::vector<unsigned char>& encrypted);
+    void End(std::vector<unsigned char>& encrypted);
+};
+
+/** Decrypts data encrypted to one private key, see CDataEncryptor.
+ *
+ * Given in chunks, the plain text comes out before the MAC tag at the end
+ * of the message is checked, it must be thrown away if End fails.
+ */
+class CDataDecryptor
+{
+private:
+    EC_KEY* pkey;
+    ies_ctx_t* ctx;
+    ies_stream_t stream;
+    std::vector<unsigned char> vchEphemeralKey; // gathered from the first chunks
+    bool fStarted;
+
+    CDataDecryptor(const CDataDecryptor&);
+    CDataDecryptor& operator=(const CDataDecryptor&);
+
+public:
+    CDataDecryptor(const CKey& key);
+    ~CDataDecryptor();
+
+    void Decrypt(const std::vector<unsigned char>& encrypted, std::vector<unsigned char>& data);
+
+    void Begin();
+    void Update(const unsigned char* pdata, size_t nLength, std::vector<unsigned char>& data);
+    void End(std::vector<unsigned char>& data);
 };
 
 class CPoint
 {
 private:
     EC_POINT *point;
-    EC_GROUP* group;
+    const EC_GROUP* group;
     BN_CTX* ctx;
 
 public:
@@ -302,6 +364,7 @@ private:
     CPubKey pubKeyL;
     CPubKey pubKeyH;
     friend class CMalleableKey;
+    friend class CMalleableVariantGenerator;
 
     static const unsigned char CURRENT_VERSION = 1;
 
@@ -431,6 +494,68 @@ public:
     bool CheckKeyVariant(const CPubKey &R, const CPubKey &vchPubKeyVariant) const;
 
     bool operator <(const CMalleableKeyView& kv) const { return vchPubKeyH.GetID() < kv.vchPubKeyH.GetID(); }
+
+    friend class CMalleableKeyChecker;
+};
+
+/** Checks key variants against a set of malleable key views at once.
+ *
+ * The views are decoded once when added, and all of them share the curve
+ * with the multiples of the generator precomputed, so checking a variant
+ * decodes R and P once and then costs a multiplication of R and one of the
+ * generator per view. Check doesn't modify the object, several threads may
+ * run it at the same time.
+ */
+class CMalleableKeyChecker
+{
+private:
+    const EC_GROUP* group;
+    std::vector<CMalleableKeyView> vViews;
+    std::vector<CBigNum> vL;
+    std::vector<EC_POINT*> vH;
+
+    CMalleableKeyChecker(const CMalleableKeyChecker&);
+    CMalleableKeyChecker& operator=(const CMalleableKeyChecker&);
+
+public:
+    CMalleableKeyChecker();
+    ~CMalleableKeyChecker();
+
+    bool AddView(const CMalleableKeyView &view);
+
+    // Whether vchPubKeyVariant is a variant of one of the views, which is stored in pview
+    bool Check(const CPubKey &R, const CPubKey &vchPubKeyVariant, CMalleableKeyView *pview=NULL) const;
+
+    size_t size() const { return vViews.size(); }
+};
+
+/** Generates variants of one malleable public key.
+ *
+ * L is decoded once and L*j*16^i is tabulated for every 4-bit window of the
+ * multiplier, so L*r costs at most 64 additions instead of a generic
+ * multiplication. Building the table costs about as much as four variants,
+ * so this pays off when many variants are needed for the same key.
+ * GetVariant doesn't modify the object, several threads may run it at the
+ * same time.
+ */
+class CMalleableVariantGenerator
+{
+private:
+    static const int WINDOWS = 64;
+    static const int WINDOW_SIZE = 16;
+
+    const EC_GROUP* group;
+    EC_POINT* point_H;
+    std::vector<EC_POINT*> vLTable;
+
+    CMalleableVariantGenerator(const CMalleableVariantGenerator&);
+    CMalleableVariantGenerator& operator=(const CMalleableVariantGenerator&);
+
+public:
+    CMalleableVariantGenerator(const CMalleablePubKey &mpk);
+    ~CMalleableVariantGenerator();
+
+    void GetVariant(CPubKey &R, CPubKey &vchPubKeyVariant) const;
 };
 
 #endif
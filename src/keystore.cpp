@@ -7,8 +7,67 @@
 #include "script.h"
 #include "base58.h"
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
 extern bool fWalletUnlockMintOnly;
 
+// Encrypting or decrypting a whole wallet costs an EC multiplication per key,
+//   so large wallets are split over the cores. job(nStart, nStep) handles every
+//   nStep-th key starting with nStart.
+static void RunKeyJobs(const boost::function<void (unsigned int, unsigned int)>& job, size_t nKeys)
+{
+    unsigned int nThreads = 1;
+    if (nKeys >= 1000)
+        nThreads = std::max(1U, std::min(boost::thread::hardware_concurrency(), 16U));
+
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(job, i, nThreads));
+    job(0, nThreads);
+    threads.join_all();
+}
+
+static void EncryptKeysPart(CKeyingMaterial* pMasterKey, const std::vector<const KeyMap::value_type*>* pvKeys,
+                            std::vector<std::pair<CPubKey, std::vector<unsigned char> > >* pvCrypted, std::vector<char>* pvOk,
+                            unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < pvKeys->size(); i += nStep)
+    {
+        CKey key;
+        if (!key.SetSecret((*pvKeys)[i]->second.first, (*pvKeys)[i]->second.second))
+            continue;
+        const CPubKey vchPubKey = key.GetPubKey();
+        bool fCompressed;
+        if (!EncryptSecret(*pMasterKey, key.GetSecret(fCompressed), vchPubKey.GetHash(), (*pvCrypted)[i].second))
+            continue;
+        (*pvCrypted)[i].first = vchPubKey;
+        (*pvOk)[i] = true;
+    }
+}
+
+// Unlike Unlock, which samples a single key, this checks every key against its public key
+static void DecryptKeysPart(const CKeyingMaterial* pMasterKey, const std::vector<const CryptedKeyMap::value_type*>* pvCrypted,
+                            std::vector<CSecret>* pvSecrets, std::vector<char>* pvOk,
+                            unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < pvCrypted->size(); i += nStep)
+    {
+        const CPubKey &vchPubKey = (*pvCrypted)[i]->second.first;
+        const std::vector<unsigned char> &vchCryptedSecret = (*pvCrypted)[i]->second.second;
+        CSecret& vchSecret = (*pvSecrets)[i];
+        if (!DecryptSecret(*pMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+            continue;
+        if (vchSecret.size() != 32)
+            continue;
+        CKey key;
+        if (!key.SetSecret(vchSecret, vchPubKey.IsCompressed()) || key.GetPubKey() != vchPubKey)
+            continue;
+        (*pvOk)[i] = true;
+    }
+}
+
 bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
 {
     CKey key;
@@ -34,6 +93,7 @@ bool CBasicKeyStore::AddMalleableKey(const CMalleableKeyView& keyView, const CSe
     {
         LOCK(cs_KeyStore);
         mapMalleableKeys[CMalleableKeyView(keyView)] = vchSecretH;
+        pMalleableChecker.reset();
     }
     return true;
 }
@@ -242,6 +302,7 @@ bool CCryptoKeyStore::AddCryptedMalleableKey(const CMalleableKeyView& keyView, c
             return false;
 
         mapCryptedMalleableKeys[CMalleableKeyView(keyView)] = vchCryptedSecretH;
+        pMalleableChecker.reset();
     }
     return true;
 }
@@ -252,24 +313,27 @@ bool CCryptoKeyStore::CreatePrivKey(const CPubKey &pubKeyVariant, const CPubKey
         LOCK(cs_KeyStore);
         if (!IsCrypted())
             return CBasicKeyStore::CreatePrivKey(pubKeyVariant, R, privKey);
+    }
 
-        for (CryptedMalleableKeyMap::const_iterator mi = mapCryptedMalleableKeys.begin(); mi != mapCryptedMalleableKeys.end(); mi++)
+    CMalleableKeyView view;
+    if (!CheckOwnership(pubKeyVariant, R, view))
+        return true;
+    {
+        LOCK(cs_KeyStore);
+        CryptedMalleableKeyMap::const_iterator mi = mapCryptedMalleableKeys.find(view);
+        if (mi != mapCryptedMalleableKeys.end())
         {
-            if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-            {
-                const CPubKey H = mi->first.GetMalleablePubKey().GetH();
-
-                CSecret vchSecretH;
-                if (!DecryptSecret(vMasterKey, mi->second, H.GetHash(), vchSecretH))
-                    return false;
-                if (vchSecretH.size() != 32)
-                    return false;
-
-                CMalleableKey mKey = mi->first.GetMalleableKey(vchSecretH);
-                return mKey.CheckKeyVariant(R, pubKeyVariant, privKey);
-            }
-        }
+            const CPubKey H = mi->first.GetMalleablePubKey().GetH();
+
+            CSecret vchSecretH;
+            if (!DecryptSecret(vMasterKey, mi->second, H.GetHash(), vchSecretH))
+                return false;
+            if (vchSecretH.size() != 32)
+                return false;
 
+            CMalleableKey mKey = mi->first.GetMalleableKey(vchSecretH);
+            return mKey.CheckKeyVariant(R, pubKeyVariant, privKey);
+        }
     }
     return true;
 }
@@ -349,17 +413,22 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             return false;
 
         fUseCrypto = true;
-        BOOST_FOREACH(KeyMap::value_type& mKey, mapKeys)
+
+        std::vector<const KeyMap::value_type*> vKeys;
+        vKeys.reserve(mapKeys.size());
+        BOOST_FOREACH(const KeyMap::value_type& mKey, mapKeys)
+            vKeys.push_back(&mKey);
+
+        std::vector<std::pair<CPubKey, std::vector<unsigned char> > > vCrypted(vKeys.size());
+        std::vector<char> vOk(vKeys.size(), false);
+        RunKeyJobs(boost::bind(&EncryptKeysPart, &vMasterKeyIn, &vKeys, &vCrypted, &vOk, _1, _2), vKeys.size());
+
+        // The wallet writes the keys to disk here, so this part stays serial
+        for (unsigned int i = 0; i < vCrypted.size(); i++)
         {
-            CKey key;
-            if (!key.SetSecret(mKey.second.first, mKey.second.second))
-                return false;
-            const CPubKey vchPubKey = key.GetPubKey();
-            std::vector<unsigned char> vchCryptedSecret;
-            bool fCompressed;
-            if (!EncryptSecret(vMasterKeyIn, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
+            if (!vOk[i])
                 return false;
-            if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            if (!AddCryptedKey(vCrypted[i].first, vCrypted[i].second))
                 return false;
         }
         mapKeys.clear();
@@ -385,22 +454,21 @@ bool CCryptoKeyStore::DecryptKeys(const CKeyingMaterial& vMasterKeyIn)
         if (!IsCrypted())
             return false;
 
-        CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
-        {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CSecret vchSecret;
-            if(!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-                return false;
-            if (vchSecret.size() != 32)
-                return false;
-            CKey key;
-            key.SetSecret(vchSecret);
-            key.SetCompressedPubKey(vchPubKey.IsCompressed());
-            if (!CBasicKeyStore::AddKey(key))
+        std::vector<const CryptedKeyMap::value_type*> vCrypted;
+        vCrypted.reserve(mapCryptedKeys.size());
+        BOOST_FOREACH(const CryptedKeyMap::value_type& mKey, mapCryptedKeys)
+            vCrypted.push_back(&mKey);
+
+        std::vector<CSecret> vSecrets(vCrypted.size());
+        std::vector<char> vOk(vCrypted.size(), false);
+        RunKeyJobs(boost::bind(&DecryptKeysPart, &vMasterKeyIn, &vCrypted, &vSecrets, &vOk, _1, _2), vCrypted.size());
+
+        // Nothing is changed unless every key decrypted correctly
+        for (unsigned int i = 0; i < vOk.size(); i++)
+            if (!vOk[i])
                 return false;
-        }
+        for (unsigned int i = 0; i < vCrypted.size(); i++)
+            mapKeys[vCrypted[i]->first] = make_pair(vSecrets[i], vCrypted[i]->second.first.IsCompressed());
 
         mapCryptedKeys.clear();
 
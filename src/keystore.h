@@ -7,6 +7,7 @@
 
 #include "crypter.h"
 #include "sync.h"
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/variant.hpp>
 
@@ -90,6 +91,22 @@ protected:
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
 
+    // Checker of the malleable key views, dropped whenever a view is added.
+    //   The checks run on a shared copy, without cs_KeyStore held.
+    mutable boost::shared_ptr<CMalleableKeyChecker> pMalleableChecker;
+
+    template<typename M> boost::shared_ptr<CMalleableKeyChecker> GetMalleableChecker(const M& mapViews) const
+    {
+        LOCK(cs_KeyStore);
+        if (!pMalleableChecker)
+        {
+            pMalleableChecker.reset(new CMalleableKeyChecker());
+            for (typename M::const_iterator mi = mapViews.begin(); mi != mapViews.end(); mi++)
+                pMalleableChecker->AddView(mi->first);
+        }
+        return pMalleableChecker;
+    }
+
 public:
     bool AddKey(const CKey& key);
     bool AddMalleableKey(const CMalleableKeyView& keyView, const CSecret &vchSecretH);
@@ -149,47 +166,27 @@ public:
 
     bool CheckOwnership(const CPubKey &pubKeyVariant, const CPubKey &R) const
     {
-        {
-            LOCK(cs_KeyStore);
-            for (MalleableKeyMap::const_iterator mi = mapMalleableKeys.begin(); mi != mapMalleableKeys.end(); mi++)
-            {
-                if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-                    return true;
-            }
-        }
-        return false;
+        return GetMalleableChecker(mapMalleableKeys)->Check(R, pubKeyVariant);
     }
 
     bool CheckOwnership(const CPubKey &pubKeyVariant, const CPubKey &R, CMalleableKeyView &view) const
     {
-        {
-            LOCK(cs_KeyStore);
-            for (MalleableKeyMap::const_iterator mi = mapMalleableKeys.begin(); mi != mapMalleableKeys.end(); mi++)
-            {
-                if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-                {
-                    view = mi->first;
-                    return true;
-                }
-            }
-        }
-        return false;
+        return GetMalleableChecker(mapMalleableKeys)->Check(R, pubKeyVariant, &view);
     }
 
     bool CreatePrivKey(const CPubKey &pubKeyVariant, const CPubKey &R, CKey &privKey) const
     {
+        CMalleableKeyView view;
+        if (!CheckOwnership(pubKeyVariant, R, view))
+            return false;
         {
             LOCK(cs_KeyStore);
-            for (MalleableKeyMap::const_iterator mi = mapMalleableKeys.begin(); mi != mapMalleableKeys.end(); mi++)
-            {
-                if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-                {
-                    CMalleableKey mKey = mi->first.GetMalleableKey(mi->second);
-                    return mKey.CheckKeyVariant(R, pubKeyVariant, privKey);
-                }
-            }
+            MalleableKeyMap::const_iterator mi = mapMalleableKeys.find(view);
+            if (mi == mapMalleableKeys.end())
+                return false;
+            CMalleableKey mKey = mi->first.GetMalleableKey(mi->second);
+            return mKey.CheckKeyVariant(R, pubKeyVariant, privKey);
         }
-        return false;
     }
 
     void ListMalleableViews(std::list<CMalleableKeyView> &malleableViewList) const
@@ -246,6 +243,16 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // copies the master key, for encrypting outside of the lock; false if there is none
+    bool GetMasterKey(CKeyingMaterial& vMasterKeyOut) const
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted() || vMasterKey.empty())
+            return false;
+        vMasterKeyOut = vMasterKey;
+        return true;
+    }
+
 public:
     CCryptoKeyStore() : fUseCrypto(false) { }
 
@@ -304,35 +311,21 @@ public:
 
     bool CheckOwnership(const CPubKey &pubKeyVariant, const CPubKey &R) const
     {
-        {
-            LOCK(cs_KeyStore);
-            if (!IsCrypted())
-                return CBasicKeyStore::CheckOwnership(pubKeyVariant, R);
-            for (CryptedMalleableKeyMap::const_iterator mi = mapCryptedMalleableKeys.begin(); mi != mapCryptedMalleableKeys.end(); mi++)
-            {
-                if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-                    return true;
-            }
-        }
-        return false;
+        CMalleableKeyView view;
+        return CheckOwnership(pubKeyVariant, R, view);
     }
 
     bool CheckOwnership(const CPubKey &pubKeyVariant, const CPubKey &R, CMalleableKeyView &view) const
     {
+        boost::shared_ptr<CMalleableKeyChecker> pChecker;
         {
             LOCK(cs_KeyStore);
             if (!IsCrypted())
-                return CBasicKeyStore::CheckOwnership(pubKeyVariant, R, view);
-            for (CryptedMalleableKeyMap::const_iterator mi = mapCryptedMalleableKeys.begin(); mi != mapCryptedMalleableKeys.end(); mi++)
-            {
-                if (mi->first.CheckKeyVariant(R, pubKeyVariant))
-                {
-                    view = mi->first;
-                    return true;
-                }
-            }
+                pChecker = GetMalleableChecker(mapMalleableKeys);
+            else
+                pChecker = GetMalleableChecker(mapCryptedMalleableKeys);
         }
-        return false;
+        return pChecker->Check(R, pubKeyVariant, &view);
     }
 
     bool CheckOwnership(const CMalleablePubKey &mpk)
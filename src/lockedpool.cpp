@@ -0,0 +1,197 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lockedpool.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread/once.hpp>
+
+// windows.h and sys/mman.h come in through allocators.h
+#if !defined(WIN32) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+using namespace std;
+
+LockedArena::LockedArena(void *base, size_t size, size_t alignment):
+    pbegin((char*)base), pend((char*)base + size), nAlignment(alignment), nUsed(0)
+{
+    mapFree[pbegin] = size;
+}
+
+void* LockedArena::Alloc(size_t size)
+{
+    // Round up so that every chunk stays aligned
+    size = (std::max(size, (size_t)1) + nAlignment - 1) & ~(nAlignment - 1);
+
+    for (ChunkMap::iterator it = mapFree.begin(); it != mapFree.end(); ++it)
+    {
+        if (it->second < size)
+            continue;
+        char *p = it->first;
+        size_t nLeft = it->second - size;
+        mapFree.erase(it);
+        if (nLeft > 0)
+            mapFree[p + size] = nLeft;
+        mapUsed[p] = size;
+        nUsed += size;
+        return p;
+    }
+    return NULL;
+}
+
+void LockedArena::Free(void *ptr)
+{
+    ChunkMap::iterator it = mapUsed.find((char*)ptr);
+    assert(it != mapUsed.end()); // Cannot free a chunk that was not allocated here
+    char *p = it->first;
+    size_t size = it->second;
+    mapUsed.erase(it);
+    nUsed -= size;
+
+    // Merge with the free chunk after this one and the one before it
+    ChunkMap::iterator next = mapFree.lower_bound(p);
+    if (next != mapFree.end() && p + size == next->first)
+    {
+        size += next->second;
+        mapFree.erase(next++);
+    }
+    if (next != mapFree.begin())
+    {
+        ChunkMap::iterator prev = next;
+        --prev;
+        if (prev->first + prev->second == p)
+        {
+            prev->second += size;
+            return;
+        }
+    }
+    mapFree.insert(next, make_pair(p, size));
+}
+
+void* LockedPool::AllocatePages(size_t len, bool& fLocked)
+{
+    void *addr;
+#ifdef WIN32
+    addr = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (addr == NULL)
+        return NULL;
+    fLocked = VirtualLock(addr, len) != 0;
+#else
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    fLocked = mlock(addr, len) == 0;
+#ifdef MADV_DONTDUMP
+    // Keep key material out of core dumps as well
+    madvise(addr, len, MADV_DONTDUMP);
+#endif
+#endif
+    return addr;
+}
+
+void LockedPool::FreePages(void *addr, size_t len, bool fLocked)
+{
+#ifdef WIN32
+    if (fLocked)
+        VirtualUnlock(addr, len);
+    VirtualFree(addr, 0, MEM_RELEASE);
+#else
+    if (fLocked)
+        munlock(addr, len);
+    munmap(addr, len);
+#endif
+}
+
+bool LockedPool::NewArena(size_t size)
+{
+    // Round up to whole pages
+    size_t nPageSize = GetSystemPageSize();
+    size = std::max(size, (size_t)ARENA_SIZE);
+    size = (size + nPageSize - 1) & ~(nPageSize - 1);
+
+    bool fLocked = false;
+    void *addr = AllocatePages(size, fLocked);
+    if (addr == NULL)
+        return false;
+    if (!fLocked && !fLockWarned)
+    {
+        printf("WARNING: LockedPool: could not lock %" PRIszu " bytes of memory, key material may be swapped to disk. "
+               "Raising the locked memory limit (ulimit -l) avoids this.\n", size);
+        fLockWarned = true;
+    }
+    arenas.push_back(Arena(addr, size, fLocked));
+    return true;
+}
+
+void* LockedPool::Alloc(size_t size)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    BOOST_FOREACH(Arena& a, arenas)
+    {
+        void *p = a.arena.Alloc(size);
+        if (p != NULL)
+            return p;
+    }
+    if (!NewArena(size + ARENA_ALIGN))
+        return NULL;
+    return arenas.back().arena.Alloc(size);
+}
+
+void LockedPool::Free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    boost::mutex::scoped_lock lock(mutex);
+
+    for (std::list<Arena>::iterator it = arenas.begin(); it != arenas.end(); ++it)
+    {
+        if (!it->arena.Contains(ptr))
+            continue;
+        it->arena.Free(ptr);
+        // Hand spare arenas back, the first one stays for the next unlock
+        if (it->arena.IsEmpty() && it != arenas.begin())
+        {
+            FreePages(it->base, it->size, it->fLocked);
+            arenas.erase(it);
+        }
+        return;
+    }
+    assert(!"LockedPool::Free: pointer not allocated by the pool");
+}
+
+size_t LockedPool::GetUsedBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    size_t n = 0;
+    BOOST_FOREACH(const Arena& a, arenas)
+        n += a.arena.GetUsed();
+    return n;
+}
+
+size_t LockedPool::GetArenaBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    size_t n = 0;
+    BOOST_FOREACH(const Arena& a, arenas)
+        n += a.size;
+    return n;
+}
+
+LockedPool* LockedPool::pinstance = NULL;
+static boost::once_flag lockedPoolOnce = BOOST_ONCE_INIT;
+
+void LockedPool::CreateInstance()
+{
+    // Deliberately leaked, see Instance()
+    pinstance = new LockedPool();
+}
+
+LockedPool& LockedPool::Instance()
+{
+    boost::call_once(lockedPoolOnce, CreateInstance);
+    return *pinstance;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LOCKEDPOOL_H
+#define BITCOIN_LOCKEDPOOL_H
+
+#include <stddef.h>
+#include <list>
+#include <map>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * First-fit allocator inside one contiguous region of memory.
+ *
+ * The bookkeeping is kept outside the region, so the region itself only ever
+ * holds the caller's data. Adjacent free chunks are merged on free.
+ * Not thread-safe, LockedPool serializes access.
+ */
+class LockedArena
+{
+public:
+    LockedArena(void *base, size_t size, size_t alignment);
+
+    /** Allocate size bytes, NULL if there is no chunk large enough */
+    void* Alloc(size_t size);
+    /** Free a chunk returned by Alloc */
+    void Free(void *ptr);
+
+    bool Contains(void *ptr) const { return ptr >= pbegin && ptr < pend; }
+    bool IsEmpty() const { return mapUsed.empty(); }
+    size_t GetUsed() const { return nUsed; }
+    size_t GetSize() const { return pend - pbegin; }
+
+private:
+    char *pbegin;
+    char *pend;
+    size_t nAlignment;
+    size_t nUsed;
+    // chunk start -> chunk size
+    typedef std::map<char*, size_t> ChunkMap;
+    ChunkMap mapFree;
+    ChunkMap mapUsed;
+};
+
+/**
+ * Pool of locked (ie, non-swappable) memory for secure_allocator.
+ *
+ * Memory is taken from the OS in arenas of ARENA_SIZE bytes that are locked
+ * once when they are created, so allocating and freeing key material costs no
+ * system calls. A request larger than ARENA_SIZE gets an arena of its own.
+ * Arenas other than the first are given back to the OS when they become empty.
+ *
+ * If the OS refuses to lock an arena (for example because of RLIMIT_MEMLOCK)
+ * the memory is still used, and a warning is logged once.
+ */
+class LockedPool
+{
+public:
+    static const size_t ARENA_SIZE = 256 * 1024;
+    static const size_t ARENA_ALIGN = 16;
+
+    /** Allocate size bytes of locked memory, NULL if the OS is out of memory */
+    void* Alloc(size_t size);
+    /** Free memory returned by Alloc. The caller must wipe it first. */
+    void Free(void *ptr);
+
+    // Diagnostics
+    size_t GetUsedBytes();
+    size_t GetArenaBytes();
+
+    /** The process-wide pool. It is never destroyed, so secure containers
+     * in static objects can still be freed during shutdown. */
+    static LockedPool& Instance();
+
+private:
+    struct Arena
+    {
+        LockedArena arena;
+        void *base;
+        size_t size;
+        bool fLocked;
+        Arena(void *baseIn, size_t sizeIn, bool fLockedIn):
+            arena(baseIn, sizeIn, ARENA_ALIGN), base(baseIn), size(sizeIn), fLocked(fLockedIn) {}
+    };
+
+    boost::mutex mutex;
+    std::list<Arena> arenas;
+    bool fLockWarned;
+
+    static LockedPool* pinstance;
+
+    LockedPool(): fLockWarned(false) {}
+    static void CreateInstance();
+    bool NewArena(size_t size);
+    static void* AllocatePages(size_t len, bool& fLocked);
+    static void FreePages(void *addr, size_t len, bool fLocked);
+};
+
+#endif
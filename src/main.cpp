@@ -11,9 +11,16 @@
 #include "ui_interface.h"
 #include "checkqueue.h"
 #include "kernel.h"
+#include "txsketch.h"
+#include "miner.h"
+#include "scheduler.h"
+#include "metrics.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include "main.h"
 
@@ -26,18 +33,27 @@ CCriticalSection cs_setpwalletRegistered;
 set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
+CSharedCriticalSection cs_blockIndex;
 
 CTxMemPool mempool;
+CNotifyHistory blockNotifyHistory(1000);
+CNotifyHistory mempoolNotifyHistory(10000);
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20); // proof of stake target limit
+// Block index entries are packed together in slabs and live as long as the node
+static const size_t BLOCKINDEX_SLAB_SIZE = 4096;
+static vector<CBlockIndex*> vBlockIndexSlabs;
+static size_t nBlockIndexSlabUsed = BLOCKINDEX_SLAB_SIZE;
+static CCriticalSection cs_BlockIndexSlabs;
+
+uint256 bnProofOfWorkLimit(~uint256(0) >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
+uint256 bnProofOfStakeLimit(~uint256(0) >> 20); // proof of stake target limit
 uint256 nPoWBase = uint256("0x00000000ffff0000000000000000000000000000000000000000000000000000"); // difficulty-1 target
 
-CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
+uint256 bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
 
 unsigned int nStakeMinAge = 42 * nOneHour; // 42 hours as zero time weight
 unsigned int nStakeMaxAge = INT_MAX; // 'unlimited' full weight
@@ -55,16 +71,60 @@ uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+size_t nBlockCacheSize = 16 * 1048576;
+bool fBlockPipeline = true;
+bool fHeadersFirst = true;
+
+uint256 hashAssumeValid = 0; // -assumevalid, blocks below it are connected without script checks
+int nAssumeValidHeight = -1;
+int64_t nAssumeValidSkipped = 0; // blocks connected without script checks
+
+bool fAddrIndex = false; // -addrindex, index the transactions of every address
+bool fSpentIndex = false; // -spentindex, index the spender of every output
+bool fReindex = false; // -reindex, the block index is rebuilt from the block files
+int64_t nPruneTarget = 0; // -prune, target size of the block files in bytes, 0 to keep them all
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+OrphanBlockMap mapOrphanBlocks;
+boost::unordered_multimap<uint256, CBlock*, SaltedHasher> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+uint64_t nMaxOrphanBlocksMemory = 40 * 1048576; // -maxorphanblocks
+uint64_t nMaxOrphanBlocksDisk = 0; // -orphanspill, 0 to drop the orphans over the limit instead
+uint64_t nMaxMempoolSize = 300 * 1000000; // -maxmempool, 0 for no limit
+int64_t nMempoolExpiry = 72 * 60 * 60; // -mempoolexpiry, 0 to keep transactions until mined
+bool fCheckpointScripts = false; // verify the scripts below the last checkpoint too
+CConnectStats connectStats; // updated under cs_main
+
+// Orphan block bookkeeping, see LimitOrphanBlocks()
+struct COrphanBlockInfo
+{
+    unsigned int nSize;
+    int64_t nTimeReceived;
+    CService addrFrom;
+    bool fSpilled; // transactions moved to disk, only the header is in memory
+    bool fProofOfStake;
+    pair<COutPoint, unsigned int> proofOfStake;
+};
+static map<uint256, COrphanBlockInfo> mapOrphanBlockInfo;
+static map<CService, uint64_t> mapOrphanBytesByPeer;
+static uint64_t nOrphanBlocksMemory = 0;
+static uint64_t nOrphanBlocksDisk = 0;
 map<uint256, uint256> mapProofOfStake;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// Transactions whose inputs are missing, with who sent them and when they
+// are given up on, see LimitOrphanTxSize()
+struct COrphanTx
+{
+    CTransaction tx;
+    CService addrFrom;
+    unsigned int nSize;
+    int64_t nTimeExpire;
+};
+boost::unordered_map<uint256, COrphanTx, SaltedHasher> mapOrphanTransactions;
+boost::unordered_map<COutPoint, set<uint256>, SaltedOutPointHasher> mapOrphanTransactionsByPrev; // orphans spending each outpoint
+static map<CService, uint64_t> mapOrphanTxBytesByPeer;
+static uint64_t nOrphanTxBytes = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -177,7 +237,7 @@ void ResendWalletTransactions(bool fForceResend)
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransaction& tx, const CService& addrFrom)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -188,8 +248,7 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The orphans as a whole are held to MAX_ORPHAN_TX_BYTES as well.
 
     size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
 
@@ -199,40 +258,81 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    // A peer can't take the room of the others
+    uint64_t& nPeerBytes = mapOrphanTxBytesByPeer[addrFrom];
+    if (nPeerBytes + nSize > MAX_ORPHAN_TX_PEER_BYTES)
+    {
+        if (nPeerBytes == 0)
+            mapOrphanTxBytesByPeer.erase(addrFrom);
+        printf("ignoring orphan tx %s, too many from %s\n", hash.ToString().substr(0,10).c_str(), addrFrom.ToString().c_str());
+        return false;
+    }
+    nPeerBytes += nSize;
+    nOrphanTxBytes += nSize;
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.addrFrom = addrFrom;
+    orphan.nSize = nSize;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    printf("stored orphan tx %s (mapsz %" PRIszu ")\n", hash.ToString().substr(0,10).c_str(),
-        mapOrphanTransactions.size());
+    printf("stored orphan tx %s (mapsz %" PRIszu ", %" PRIu64 " bytes)\n", hash.ToString().substr(0,10).c_str(),
+        mapOrphanTransactions.size(), nOrphanTxBytes);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    boost::unordered_map<uint256, COrphanTx, SaltedHasher>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        boost::unordered_map<COutPoint, set<uint256>, SaltedOutPointHasher>::iterator mi = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (mi == mapOrphanTransactionsByPrev.end())
+            continue;
+        mi->second.erase(hash);
+        if (mi->second.empty())
+            mapOrphanTransactionsByPrev.erase(mi);
     }
-    mapOrphanTransactions.erase(hash);
+
+    map<CService, uint64_t>::iterator pi = mapOrphanTxBytesByPeer.find(orphan.addrFrom);
+    if (pi != mapOrphanTxBytesByPeer.end() && (pi->second -= orphan.nSize) == 0)
+        mapOrphanTxBytesByPeer.erase(pi);
+    nOrphanTxBytes -= orphan.nSize;
+    mapOrphanTransactions.erase(it);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+
+    // Drop the expired ones now and then
+    static int64_t nNextSweep = 0;
+    int64_t nNow = GetTime();
+    if (nNow >= nNextSweep)
+    {
+        vector<uint256> vExpired;
+        for (boost::unordered_map<uint256, COrphanTx, SaltedHasher>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            if (it->second.nTimeExpire <= nNow)
+                vExpired.push_back(it->first);
+        BOOST_FOREACH(const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxBytes > nMaxBytes)
+    {
+        // Evict a random orphan, the first one from a random bucket on
+        size_t nBuckets = mapOrphanTransactions.bucket_count();
+        size_t nBucket = GetRand(nBuckets);
+        while (mapOrphanTransactions.bucket_size(nBucket) == 0)
+            nBucket = (nBucket + 1) % nBuckets;
+        EraseOrphanTx(mapOrphanTransactions.begin(nBucket)->first);
         ++nEvicted;
     }
     return nEvicted;
@@ -407,6 +507,9 @@ bool CTransaction::AreInputsStandard(const MapPrevTx& mapInputs) const
 unsigned int
 CTransaction::GetLegacySigOpCount() const
 {
+    if (fCached)
+        return nLegacySigOpsCached;
+
     unsigned int nSigOps = 0;
     if (!IsCoinBase())
     {
@@ -465,7 +568,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     const CBlockIndex* pindex = (*mi).second;
@@ -582,8 +685,27 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree, enum G
 }
 
 
+static bool VerifyScriptChecks(std::vector<CScriptCheck> &vChecks);
+
+// Keep the fetched inputs of a transaction entering the pool, so building blocks
+// doesn't have to read them again
+static void GetMempoolPrevOuts(const CTransaction& tx, MapPrevTx& mapInputs, vector<CTxMemPoolPrevOut>& vPrevOuts)
+{
+    vPrevOuts.clear();
+    vPrevOuts.reserve(tx.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        const CTransaction& txPrev = mapInputs[txin.prevout.hash].second;
+        CBlockIndex* pindex = NULL;
+        if (txindex.pos != CDiskTxPos(1,1,1))
+            pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        vPrevOuts.push_back(CTxMemPoolPrevOut(txPrev, txin.prevout.n, pindex));
+    }
+}
+
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, std::vector<CScriptCheck>* pvChecks)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -634,6 +756,8 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
+    int64_t nFees = 0;
+    vector<CTxMemPoolPrevOut> vPrevOuts;
     if (fCheckInputs)
     {
         MapPrevTx mapInputs;
@@ -656,8 +780,9 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        GetMempoolPrevOuts(tx, mapInputs, vPrevOuts);
 
         // Don't accept it if it can't get into a block
         int64_t txMinFee = tx.GetMinFee(1000, true, GMF_RELAY, nSize);
@@ -693,16 +818,52 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, STRICT_FLAGS))
+        // Signatures of multi-input transactions are verified on the script check threads.
+        std::vector<CScriptCheck> vChecks;
+        bool fParallel = nScriptCheckThreads && tx.vin.size() > 1;
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, STRICT_FLAGS, pvChecks ? pvChecks : fParallel ? &vChecks : NULL))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+
+        if (!pvChecks && fParallel && !VerifyScriptChecks(vChecks))
+        {
+            // Repeat the checks inline to tell strict flags failures from the invalid signatures
+            map<uint256, CTxIndex> mapUnused2;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapUnused2, CDiskTxPos(1,1,1), pindexBest, false, false, true, STRICT_FLAGS))
+                return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
+            return error("CTxMemPool::accept() : script checks failed %s", hash.ToString().substr(0,10).c_str());
+        }
+    }
+    else
+    {
+        // Only the fee and the inputs are wanted, for the indexes and block building
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        {
+            nFees = std::max((int64_t)0, tx.GetValueIn(mapInputs)-tx.GetValueOut());
+            GetMempoolPrevOuts(tx, mapInputs, vPrevOuts);
+        }
     }
 
-    // Store transaction in memory
+    // Store transaction in memory, dropping expired ones and making room by
+    // evicting the lowest fee rate packages
     {
         LOCK(cs);
-        addUnchecked(hash, tx);
+        string strReason;
+        if (!CheckPackageLimits(tx, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), strReason))
+            return error("CTxMemPool::accept() : %s, %s not accepted", strReason.c_str(), hash.ToString().substr(0,10).c_str());
+        addUnchecked(hash, tx, nFees, vPrevOuts);
+        if (nMempoolExpiry)
+            Expire(GetTime() - nMempoolExpiry);
+        if (nMaxMempoolSize && nTotalUsage > nMaxMempoolSize)
+        {
+            TrimToSize(nMaxMempoolSize);
+            if (!mapTx.count(hash))
+                return error("CTxMemPool::accept() : mempool full, %s not accepted", hash.ToString().substr(0,10).c_str());
+        }
     }
 
     printf("CTxMemPool::accept() : accepted %s (poolsz %" PRIszu ")\n",
@@ -716,7 +877,31 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+size_t GetTransactionMemoryUsage(const CTransaction& tx)
+{
+    size_t nUsage = sizeof(CTransaction) + tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.allocated_memory();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.allocated_memory();
+    return nUsage;
+}
+
+// Rough heap memory taken by a pool transaction: its scripts and vectors, its
+// resolved inputs, and the nodes of the maps and indexes holding it
+static size_t GetMempoolTxUsage(const CTransaction& tx, const vector<CTxMemPoolPrevOut>& vPrevOuts)
+{
+    size_t nUsage = sizeof(uint256) + GetTransactionMemoryUsage(tx) + MEMORY_TREE_NODE;
+    nUsage += sizeof(uint256) + sizeof(CTxMemPoolEntry) + MEMORY_TREE_NODE;
+    nUsage += 4 * (sizeof(std::pair<double, uint256>) + MEMORY_TREE_NODE);
+    nUsage += tx.vin.size() * (sizeof(COutPoint) + sizeof(CInPoint) + MEMORY_TREE_NODE);
+    nUsage += vPrevOuts.capacity() * sizeof(CTxMemPoolPrevOut);
+    BOOST_FOREACH(const CTxMemPoolPrevOut& prevout, vPrevOuts)
+        nUsage += prevout.txout.scriptPubKey.allocated_memory();
+    return nUsage;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee, const std::vector<CTxMemPoolPrevOut>& vPrevOuts)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -725,12 +910,46 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+
+        CTxMemPoolEntry entry(nFee, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), GetTime(), nBestHeight);
+        entry.vPrevOuts = vPrevOuts;
+        entry.nUsage = GetMempoolTxUsage(mapTx[hash], entry.vPrevOuts);
+        entry.ComputePriority(nBestHeight);
+
+        // Sum up the package, and add this one to the descendants of its ancestors
+        vector<uint256> vAncestors;
+        queryAncestors(hash, vAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, vAncestors)
+        {
+            CTxMemPoolEntry& entryAncestor = mapEntry[hashAncestor];
+            entry.nFeesWithAncestors += entryAncestor.nFee;
+            entry.nSizeWithAncestors += entryAncestor.nTxSize;
+            entry.nCountWithAncestors++;
+
+            setByDescendantFeeRate.erase(make_pair(entryAncestor.GetDescendantFeeRate(), hashAncestor));
+            entryAncestor.nFeesWithDescendants += entry.nFee;
+            entryAncestor.nSizeWithDescendants += entry.nTxSize;
+            entryAncestor.nCountWithDescendants++;
+            setByDescendantFeeRate.insert(make_pair(entryAncestor.GetDescendantFeeRate(), hashAncestor));
+        }
+
+        mapEntry[hash] = entry;
+        setByFeeRate.insert(make_pair(entry.GetFeeRate(), hash));
+        setByTime.insert(make_pair(entry.nTime, hash));
+        setByAncestorFeeRate.insert(make_pair(entry.GetAncestorFeeRate(), hash));
+        setByDescendantFeeRate.insert(make_pair(entry.GetDescendantFeeRate(), hash));
+        nTotalTxSize += entry.nTxSize;
+        nTotalUsage += entry.nUsage;
+        SetMetric(METRIC_MEMPOOL_TRANSACTIONS, mapTx.size());
+        SetMetric(METRIC_MEMPOOL_BYTES, nTotalTxSize);
+        BlockTemplateAddTx(hash);
     }
+    mempoolNotifyHistory.Push(hash);
     return true;
 }
 
 
-bool CTxMemPool::remove(CTransaction &tx)
+bool CTxMemPool::remove(CTransaction &tx, CBlockIndex* pindexBlock)
 {
     // Remove transaction from memory pool
     {
@@ -738,10 +957,65 @@ bool CTxMemPool::remove(CTransaction &tx)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
+            const CTxMemPoolEntry& entry = mapEntry[hash];
+
+            // Its spenders now have a confirmed input, which starts aging
+            if (pindexBlock)
+            {
+                for (unsigned int i = 0; i < tx.vout.size(); i++)
+                {
+                    map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    if (it == mapNextTx.end())
+                        continue;
+                    CTxMemPoolEntry& entrySpender = mapEntry[it->second.ptx->GetHash()];
+                    if (entrySpender.vPrevOuts.size() != it->second.ptx->vin.size())
+                        continue;
+                    entrySpender.vPrevOuts[it->second.n] = CTxMemPoolPrevOut(tx, i, pindexBlock);
+                    entrySpender.AddConfirmedInput(tx.vout[i].nValue, pindexBlock->nHeight);
+                }
+            }
+
+            // Neither do the descendants of its ancestors
+            vector<uint256> vAncestors;
+            queryAncestors(hash, vAncestors);
+            BOOST_FOREACH(const uint256& hashAncestor, vAncestors)
+            {
+                CTxMemPoolEntry& entryAncestor = mapEntry[hashAncestor];
+                setByDescendantFeeRate.erase(make_pair(entryAncestor.GetDescendantFeeRate(), hashAncestor));
+                entryAncestor.nFeesWithDescendants -= entry.nFee;
+                entryAncestor.nSizeWithDescendants -= entry.nTxSize;
+                entryAncestor.nCountWithDescendants--;
+                setByDescendantFeeRate.insert(make_pair(entryAncestor.GetDescendantFeeRate(), hashAncestor));
+            }
+
+            // The packages of its descendants don't include it anymore
+            vector<uint256> vDescendants;
+            queryDescendants(hash, vDescendants);
+            BOOST_FOREACH(const uint256& hashDescendant, vDescendants)
+            {
+                CTxMemPoolEntry& entryDescendant = mapEntry[hashDescendant];
+                setByAncestorFeeRate.erase(make_pair(entryDescendant.GetAncestorFeeRate(), hashDescendant));
+                entryDescendant.nFeesWithAncestors -= entry.nFee;
+                entryDescendant.nSizeWithAncestors -= entry.nTxSize;
+                entryDescendant.nCountWithAncestors--;
+                setByAncestorFeeRate.insert(make_pair(entryDescendant.GetAncestorFeeRate(), hashDescendant));
+            }
+
+            setByFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+            setByTime.erase(make_pair(entry.nTime, hash));
+            setByAncestorFeeRate.erase(make_pair(entry.GetAncestorFeeRate(), hash));
+            setByDescendantFeeRate.erase(make_pair(entry.GetDescendantFeeRate(), hash));
+            nTotalTxSize -= entry.nTxSize;
+            nTotalUsage -= entry.nUsage;
+            mapEntry.erase(hash);
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
             nTransactionsUpdated++;
+            SetMetric(METRIC_MEMPOOL_TRANSACTIONS, mapTx.size());
+            SetMetric(METRIC_MEMPOOL_BYTES, nTotalTxSize);
+            BlockTemplateRemoveTx(hash);
         }
     }
     return true;
@@ -752,7 +1026,17 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByFeeRate.clear();
+    setByTime.clear();
+    setByAncestorFeeRate.clear();
+    setByDescendantFeeRate.clear();
+    nTotalTxSize = 0;
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
+    SetMetric(METRIC_MEMPOOL_TRANSACTIONS, 0);
+    SetMetric(METRIC_MEMPOOL_BYTES, 0);
+    BlockTemplateClear();
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -761,10 +1045,263 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+// Transactions in the pool the given one spends from, directly or not
+void CTxMemPool::queryAncestors(const uint256& hash, std::vector<uint256>& vAncestors)
+{
+    vAncestors.clear();
+
+    LOCK(cs);
+    set<uint256> setSeen;
+    vector<uint256> vToVisit;
+    vToVisit.push_back(hash);
+    while (!vToVisit.empty())
+    {
+        TxMap::iterator mi = mapTx.find(vToVisit.back());
+        vToVisit.pop_back();
+        if (mi == mapTx.end())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+        {
+            if (mapTx.count(txin.prevout.hash) && setSeen.insert(txin.prevout.hash).second)
+            {
+                vAncestors.push_back(txin.prevout.hash);
+                vToVisit.push_back(txin.prevout.hash);
+            }
+        }
+    }
+}
+
+// Walks the in-pool ancestors of a transaction not yet in the pool, giving up
+// as soon as a limit is passed, so that adding and removing it stays cheap
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, unsigned int nSize, std::string& strReason)
+{
+    LOCK(cs);
+    set<uint256> setSeen;
+    vector<uint256> vToVisit;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapTx.count(txin.prevout.hash) && setSeen.insert(txin.prevout.hash).second)
+            vToVisit.push_back(txin.prevout.hash);
+
+    uint64_t nSizeWithAncestors = nSize;
+    while (!vToVisit.empty())
+    {
+        uint256 hashAncestor = vToVisit.back();
+        vToVisit.pop_back();
+        if (setSeen.size() + 1 > MEMPOOL_MAX_ANCESTORS)
+        {
+            strReason = strprintf("too many unconfirmed ancestors [limit: %u]", MEMPOOL_MAX_ANCESTORS);
+            return false;
+        }
+
+        const CTxMemPoolEntry& entry = mapEntry[hashAncestor];
+        nSizeWithAncestors += entry.nTxSize;
+        if (nSizeWithAncestors > MEMPOOL_MAX_ANCESTOR_SIZE)
+        {
+            strReason = strprintf("exceeds ancestor size limit [limit: %u]", MEMPOOL_MAX_ANCESTOR_SIZE);
+            return false;
+        }
+        if (entry.nCountWithDescendants + 1 > MEMPOOL_MAX_DESCENDANTS)
+        {
+            strReason = strprintf("too many descendants for tx %s [limit: %u]", hashAncestor.ToString().substr(0,10).c_str(), MEMPOOL_MAX_DESCENDANTS);
+            return false;
+        }
+        if (entry.nSizeWithDescendants + nSize > MEMPOOL_MAX_DESCENDANT_SIZE)
+        {
+            strReason = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashAncestor.ToString().substr(0,10).c_str(), MEMPOOL_MAX_DESCENDANT_SIZE);
+            return false;
+        }
+
+        BOOST_FOREACH(const CTxIn& txin, mapTx[hashAncestor].vin)
+            if (mapTx.count(txin.prevout.hash) && setSeen.insert(txin.prevout.hash).second)
+                vToVisit.push_back(txin.prevout.hash);
+    }
+    return true;
+}
+
+// Transactions in the pool spending from the given one, directly or not
+void CTxMemPool::queryDescendants(const uint256& hash, std::vector<uint256>& vDescendants)
+{
+    vDescendants.clear();
+
+    LOCK(cs);
+    set<uint256> setSeen;
+    vector<uint256> vToVisit;
+    vToVisit.push_back(hash);
+    while (!vToVisit.empty())
+    {
+        uint256 hashVisit = vToVisit.back();
+        vToVisit.pop_back();
+        for (map<COutPoint, CInPoint>::iterator mi = mapNextTx.lower_bound(COutPoint(hashVisit, 0));
+             mi != mapNextTx.end() && mi->first.hash == hashVisit; ++mi)
+        {
+            uint256 hashSpender = mi->second.ptx->GetHash();
+            if (setSeen.insert(hashSpender).second)
+            {
+                vDescendants.push_back(hashSpender);
+                vToVisit.push_back(hashSpender);
+            }
+        }
+    }
+}
+
+// Remove a transaction with everything spending from it, returns how many went
+unsigned int CTxMemPool::removeWithDescendants(const uint256& hash)
+{
+    LOCK(cs);
+    if (!mapTx.count(hash))
+        return 0;
+    vector<uint256> vRemove;
+    queryDescendants(hash, vRemove);
+    vRemove.insert(vRemove.begin(), hash);
+
+    // Deepest first, so the remaining descendants aren't adjusted for nothing
+    BOOST_REVERSE_FOREACH(const uint256& hashRemove, vRemove)
+    {
+        CTransaction tx = mapTx[hashRemove];
+        remove(tx);
+    }
+    return vRemove.size();
+}
+
+// Evict the packages with the lowest fee rate, each a transaction with what spends
+// from it, until the pool takes no more than nSizeLimit bytes of memory.
+// Returns the number of transactions evicted.
+unsigned int CTxMemPool::TrimToSize(uint64_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (nTotalUsage > nSizeLimit && !setByDescendantFeeRate.empty())
+        nEvicted += removeWithDescendants(setByDescendantFeeRate.begin()->second);
+    if (nEvicted)
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, poolsz %" PRIszu "\n", nEvicted, mapTx.size());
+    return nEvicted;
+}
+
+// Drop the transactions that entered the pool before nTime, with their descendants.
+// Returns the number of transactions removed.
+unsigned int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    unsigned int nExpired = 0;
+    while (!setByTime.empty() && setByTime.begin()->first < nTime)
+        nExpired += removeWithDescendants(setByTime.begin()->second);
+    if (nExpired)
+        printf("CTxMemPool::Expire() : expired %u transactions, poolsz %" PRIszu "\n", nExpired, mapTx.size());
+    return nExpired;
+}
+
+// Give a transaction the time it first entered the pool, before a restart
+void CTxMemPool::SetEntryTime(const uint256& hash, int64_t nTime)
+{
+    LOCK(cs);
+    EntryMap::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    setByTime.erase(make_pair(mi->second.nTime, hash));
+    mi->second.nTime = nTime;
+    setByTime.insert(make_pair(nTime, hash));
+}
+
+// Replace the inputs of an entry by a fresh look up and recompute its priority
+void CTxMemPool::SetPrevOuts(const uint256& hash, const std::vector<CTxMemPoolPrevOut>& vPrevOuts, int nBestHeight)
+{
+    LOCK(cs);
+    EntryMap::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry& entry = mi->second;
+    nTotalUsage -= entry.nUsage;
+    entry.vPrevOuts = vPrevOuts;
+    entry.nUsage = GetMempoolTxUsage(mapTx[hash], entry.vPrevOuts);
+    nTotalUsage += entry.nUsage;
+    entry.ComputePriority(nBestHeight);
+}
+
+// Set once mempool.dat has been loaded, a partly loaded pool isn't dumped over it
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Fewest ancestors first puts parents before their children
+    vector<pair<unsigned int, uint256> > vOrder;
+    vector<pair<CTransaction, int64_t> > vTx;
+    {
+        LOCK(mempool.cs);
+        vOrder.reserve(mempool.mapEntry.size());
+        for (CTxMemPool::EntryMap::iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+            vOrder.push_back(make_pair(mi->second.nCountWithAncestors, mi->first));
+        sort(vOrder.begin(), vOrder.end());
+
+        vTx.reserve(vOrder.size());
+        for (unsigned int i = 0; i < vOrder.size(); i++)
+            vTx.push_back(make_pair(mempool.mapTx[vOrder[i].second], mempool.mapEntry[vOrder[i].second].nTime));
+    }
+
+    CMempoolDB mdb;
+    if (!mdb.Write(vTx))
+        return false;
+
+    printf("Dumped %" PRIszu " transactions to mempool.dat  %" PRId64 "ms\n", vTx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadLoadMempool(void* parg)
+{
+    // Make this thread recognisable as the mempool loading thread
+    RenameThread("42-loadmempool");
+
+    int64_t nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64_t> > vTx;
+    CMempoolDB mdb;
+    if (!mdb.Read(vTx))
+    {
+        printf("Invalid or missing mempool.dat; starting with an empty memory pool\n");
+        fMempoolLoaded = true;
+        return;
+    }
+
+    // Each transaction is checked again like a new one, its signatures on
+    // the script checking threads
+    unsigned int nAccepted = 0, nExpired = 0, nFailed = 0;
+    int64_t nExpireBefore = nMempoolExpiry ? GetTime() - nMempoolExpiry : 0;
+    CTxDB txdb("r");
+    for (unsigned int i = 0; i < vTx.size() && !fShutdown; i++)
+    {
+        CTransaction& tx = vTx[i].first;
+        if (vTx[i].second < nExpireBefore)
+        {
+            nExpired++;
+            continue;
+        }
+
+        LOCK(cs_main);
+        if (tx.AcceptToMemoryPool(txdb, true))
+        {
+            mempool.SetEntryTime(tx.GetHash(), vTx[i].second);
+            nAccepted++;
+        }
+        else
+            nFailed++;
+    }
+
+    // Stopped halfway, keep the file for the next start
+    if (fShutdown)
+        return;
+    fMempoolLoaded = true;
+
+    printf("Loaded %u transactions from mempool.dat, %u expired, %u no longer valid  %" PRId64 "ms\n",
+           nAccepted, nExpired, nFailed, GetTimeMillis() - nStart);
+}
+
 
 
 
@@ -773,11 +1310,18 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
     if (hashBlock == 0 || nIndex == -1)
         return 0;
 
-    // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    // Find the block it claims to be in. Index entries are never freed, so the one
+    // found before is kept, and a reorganization is caught by the main chain check.
+    CBlockIndex* pindex = pindexCached;
+    if (!pindex || hashCached != hashBlock)
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return 0;
+        pindex = (*mi).second;
+        pindexCached = pindex;
+        hashCached = hashBlock;
+    }
     if (!pindex || !pindex->IsInMainChain())
         return 0;
 
@@ -826,11 +1370,14 @@ bool CMerkleTx::AcceptToMemoryPool()
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
+    // Looked up before taking mempool.cs, they may come from the wallet
+    vector<CMerkleTx> vtxSupporting;
+    GetSupportingTransactions(txdb, vtxSupporting);
 
     {
         LOCK(mempool.cs);
         // Add previous supporting transactions first
-        BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
+        BOOST_FOREACH(CMerkleTx& tx, vtxSupporting)
         {
             if (!(tx.IsCoinBase() || tx.IsCoinStake()))
             {
@@ -852,20 +1399,33 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = FindBlockByPos(pos.nFile, pos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
 }
 
+bool CAddrIndexKey::SetDestination(const CScript& scriptPubKey)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest))
+    {
+        nAddrType = ADDR_KEYID;
+        hashAddr = *keyID;
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest))
+    {
+        nAddrType = ADDR_SCRIPTID;
+        hashAddr = *scriptID;
+        return true;
+    }
+    return false;
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
@@ -883,9 +1443,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
         {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+            CBlockIndex* pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+            if (pindex)
+                hashBlock = pindex->GetBlockHash();
             return true;
         }
     }
@@ -904,75 +1464,385 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+// Block index entries by block file and position within it. The positions
+// of a file are sorted lazily, they are usually added in order anyway.
+struct CBlockFilePositions
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    vector<pair<unsigned int, CBlockIndex*> > vPos;
+    bool fSorted;
+
+    CBlockFilePositions() : fSorted(true) {}
+};
+static vector<CBlockFilePositions> vBlockIndexByPos;
+static CCriticalSection cs_BlockIndexByPos;
+
+// Block file new blocks are appended to, files below it may be pruned
+static unsigned int nCurrentBlockFile = 1;
+
+void AddBlockIndexPos(CBlockIndex* pindex)
+{
+    if ((pindex->nFile < 1) || (pindex->nFile == std::numeric_limits<uint32_t>::max()))
+        return;
+
+    LOCK(cs_BlockIndexByPos);
+    if (vBlockIndexByPos.size() <= pindex->nFile)
+        vBlockIndexByPos.resize(pindex->nFile + 1);
+    if (pindex->nFile > nCurrentBlockFile)
+        nCurrentBlockFile = pindex->nFile;
+    CBlockFilePositions& file = vBlockIndexByPos[pindex->nFile];
+    if (!file.vPos.empty() && file.vPos.back().first >= pindex->nBlockPos)
+        file.fSorted = false;
+    file.vPos.push_back(make_pair(pindex->nBlockPos, pindex));
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos)
 {
-    if (!fReadTransactions)
+    LOCK(cs_BlockIndexByPos);
+    if (nFile >= vBlockIndexByPos.size())
+        return NULL;
+    CBlockFilePositions& file = vBlockIndexByPos[nFile];
+    if (!file.fSorted)
     {
-        *this = pindex->GetBlockHeader();
-        return true;
+        sort(file.vPos.begin(), file.vPos.end());
+        file.fSorted = true;
     }
-    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
-        return false;
-    if (GetHash() != pindex->GetBlockHash())
-        return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
-    return true;
+    vector<pair<unsigned int, CBlockIndex*> >::const_iterator it =
+        lower_bound(file.vPos.begin(), file.vPos.end(), make_pair(nBlockPos, (CBlockIndex*)NULL));
+    if (it == file.vPos.end() || it->first != nBlockPos)
+        return NULL;
+    return it->second;
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+// Blocks of the best chain by height
+static vector<CBlockIndex*> vBestChainByHeight;
+
+void SetBestChainByHeight(CBlockIndex* pindexNew)
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    if (pindexNew == NULL)
+    {
+        vBestChainByHeight.clear();
+        return;
+    }
+    // Only the blocks above the fork with the previous best chain change
+    vBestChainByHeight.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex && vBestChainByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBestChainByHeight[pindex->nHeight] = pindex;
 }
 
-// ppcoin: find block wanted by given orphan block
-uint256 WantedByOrphan(const CBlock* pblockOrphan)
+static CCriticalSection cs_ChainTip;
+static boost::shared_ptr<const CChainTip> ptrChainTip(new CChainTip());
+
+boost::shared_ptr<const CChainTip> GetChainTip()
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrevBlock))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrevBlock];
-    return pblockOrphan->hashPrevBlock;
+    LOCK(cs_ChainTip);
+    return ptrChainTip;
 }
 
-// select stake target limit according to hard-coded conditions
-CBigNum inline GetProofOfStakeLimit(int nHeight, unsigned int nTime)
+static void PublishChainTip(const CBlockIndex* pindexNew)
 {
-    return bnProofOfStakeLimit;
-    return bnProofOfWorkLimit; // return bnProofOfWorkLimit of none matched
+    boost::shared_ptr<const CChainTip> ptrPrev = GetChainTip();
+    CChainTip* ptip = new CChainTip();
+    if (pindexNew)
+    {
+        ptip->pindex = pindexNew;
+        ptip->hashBlock = pindexNew->GetBlockHash();
+        ptip->nHeight = pindexNew->nHeight;
+        ptip->nMoneySupply = pindexNew->nMoneySupply;
+
+        // Carried over from the previous tip when this one extends it, as the
+        // last proof-of-work block may be far back
+        bool fExtends = (ptrPrev->pindex && ptrPrev->pindex == pindexNew->pprev);
+        if (pindexNew->IsProofOfWork() || !fExtends)
+            ptip->pindexLastPoW = GetLastBlockIndex(pindexNew, false);
+        else
+            ptip->pindexLastPoW = ptrPrev->pindexLastPoW;
+        if (pindexNew->IsProofOfStake() || !fExtends)
+            ptip->pindexLastPoS = GetLastBlockIndex(pindexNew, true);
+        else
+            ptip->pindexLastPoS = ptrPrev->pindexLastPoS;
+    }
+
+    LOCK(cs_ChainTip);
+    ptrChainTip.reset(ptip);
 }
 
-// miner's coin base reward
-int64_t GetProofOfWorkReward(int64_t nFees)
+CBlockIndex* LookupBlockIndex(const uint256& hash)
 {
-    int64_t nSubsidy = 0;
+    BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+    return mi == mapBlockIndex.end() ? NULL : mi->second;
+}
 
-    if(pindexBest->nHeight <= 419)
-        nSubsidy = 10 * CENT;
-	
-    else if (pindexBest->nHeight >= 420)
-        nSubsidy = 0 * COIN;
-	
-	if (fDebug && GetBoolArg("-printcreation"))
-        printf("GetProofOfWorkReward() : create=%s nSubsidy=%" PRId64 "\n", FormatMoney(nSubsidy).c_str(), nSubsidy);
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vBestChainByHeight.size())
+        return NULL;
+    return vBestChainByHeight[nHeight];
+}
+
+// Recently read and accepted blocks, within a budget of their serialized size.
+// The least recently used blocks are dropped first.
+class CBlockCache
+{
+private:
+    typedef std::list<std::pair<uint256, boost::shared_ptr<const CBlock> > > BlockList;
+    BlockList listBlocks; // most recently used first
+    std::map<uint256, BlockList::iterator> mapBlocks;
+    size_t nUsage;
+    CCriticalSection cs_blockcache;
+
+    static size_t Usage(const CBlock& block)
+    {
+        return ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    }
+
+public:
+    CBlockCache() : nUsage(0) {}
+
+    void GetMemoryUsage(CMemoryUsage& usage)
+    {
+        LOCK(cs_blockcache);
+        usage.nEntries = listBlocks.size();
+        usage.nUsage = nUsage + listBlocks.size() * (sizeof(BlockList::value_type) + sizeof(CBlock) + 2 * sizeof(void*) +
+                                                     sizeof(std::pair<const uint256, BlockList::iterator>) + MEMORY_TREE_NODE);
+        usage.nLimit = nBlockCacheSize;
+    }
+
+    bool Get(const uint256& hash, CBlock& block)
+    {
+        LOCK(cs_blockcache);
+        std::map<uint256, BlockList::iterator>::iterator mi = mapBlocks.find(hash);
+        if (mi == mapBlocks.end())
+            return false;
+        listBlocks.splice(listBlocks.begin(), listBlocks, mi->second);
+        block = *mi->second->second;
+        return true;
+    }
+
+    void Add(const uint256& hash, const CBlock& block)
+    {
+        if (nBlockCacheSize == 0)
+            return;
+        boost::shared_ptr<const CBlock> pblock(new CBlock(block));
+        size_t nBlockUsage = Usage(block);
+
+        LOCK(cs_blockcache);
+        if (mapBlocks.count(hash))
+            return;
+        listBlocks.push_front(make_pair(hash, pblock));
+        mapBlocks[hash] = listBlocks.begin();
+        nUsage += nBlockUsage;
+        while (nUsage > nBlockCacheSize && listBlocks.size() > 1)
+        {
+            nUsage -= Usage(*listBlocks.back().second);
+            mapBlocks.erase(listBlocks.back().first);
+            listBlocks.pop_back();
+        }
+    }
+};
+
+static CBlockCache blockcache;
+
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
+{
+    if (!fReadTransactions)
+    {
+        *this = pindex->GetBlockHeader();
+        return true;
+    }
+    if (blockcache.Get(pindex->GetBlockHash(), *this))
+        return true;
+    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
+        return false;
+    if (GetHash() != pindex->GetBlockHash())
+        return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
+    blockcache.Add(pindex->GetBlockHash(), *this);
+    return true;
+}
+
+uint256 static GetOrphanRoot(const CBlock* pblock)
+{
+    // Work back to the first block in the orphan chain
+    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
+        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
+    return pblock->GetHash();
+}
+
+// ppcoin: find block wanted by given orphan block
+uint256 WantedByOrphan(const CBlock* pblockOrphan)
+{
+    // Work back to the first block in the orphan chain
+    while (mapOrphanBlocks.count(pblockOrphan->hashPrevBlock))
+        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrevBlock];
+    return pblockOrphan->hashPrevBlock;
+}
+
+boost::filesystem::path static OrphanBlockPath(const uint256& hash)
+{
+    return GetDataDir() / "orphans" / hash.GetHex();
+}
+
+// Move the transactions of an orphan to disk, keeping the header in memory
+bool static SpillOrphanBlock(const uint256& hash, CBlock* pblock)
+{
+    static bool fOrphanDirReady = false;
+    try
+    {
+        if (!fOrphanDirReady)
+        {
+            // What an earlier run left is of no use
+            boost::filesystem::remove_all(GetDataDir() / "orphans");
+            boost::filesystem::create_directories(GetDataDir() / "orphans");
+            fOrphanDirReady = true;
+        }
+
+        CAutoFile fileout(fopen(OrphanBlockPath(hash).string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (!fileout)
+            return error("SpillOrphanBlock() : open failed");
+        fileout << *pblock;
+    }
+    catch (std::exception& e) {
+        return error("SpillOrphanBlock() : %s", e.what());
+    }
+
+    pblock->vtx.clear();
+    pblock->vMerkleTree.clear();
+    pblock->vchBlockSig.clear();
+    return true;
+}
+
+// Bring the transactions of a spilled orphan back
+bool static LoadOrphanBlock(const uint256& hash, CBlock* pblock)
+{
+    CAutoFile filein(fopen(OrphanBlockPath(hash).string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadOrphanBlock() : open failed");
+    try {
+        filein >> *pblock;
+    }
+    catch (std::exception& e) {
+        return error("LoadOrphanBlock() : %s", e.what());
+    }
+    return pblock->GetHash() == hash;
+}
+
+// Drop what is kept on an orphan besides the block itself
+void static ForgetOrphanBlockInfo(const uint256& hash)
+{
+    map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.find(hash);
+    if (it == mapOrphanBlockInfo.end())
+        return;
+    const COrphanBlockInfo& info = it->second;
+
+    if (info.fSpilled)
+    {
+        nOrphanBlocksDisk -= info.nSize;
+        boost::system::error_code ec;
+        boost::filesystem::remove(OrphanBlockPath(hash), ec);
+    }
+    else
+        nOrphanBlocksMemory -= info.nSize;
+
+    map<CService, uint64_t>::iterator mi = mapOrphanBytesByPeer.find(info.addrFrom);
+    if (mi != mapOrphanBytesByPeer.end() && (mi->second -= info.nSize) == 0)
+        mapOrphanBytesByPeer.erase(mi);
+
+    if (info.fProofOfStake)
+        setStakeSeenOrphan.erase(info.proofOfStake);
+    mapOrphanBlockInfo.erase(it);
+}
+
+// Evict an orphan, leaving its children in place
+void static EraseOrphanBlock(const uint256& hash)
+{
+    OrphanBlockMap::iterator it = mapOrphanBlocks.find(hash);
+    if (it == mapOrphanBlocks.end())
+        return;
+    CBlock* pblock = it->second;
+
+    typedef boost::unordered_multimap<uint256, CBlock*, SaltedHasher>::iterator prev_iterator;
+    pair<prev_iterator, prev_iterator> range = mapOrphanBlocksByPrev.equal_range(pblock->hashPrevBlock);
+    for (prev_iterator mi = range.first; mi != range.second; ++mi)
+    {
+        if (mi->second == pblock)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    ForgetOrphanBlockInfo(hash);
+    mapOrphanBlocks.erase(it);
+    delete pblock;
+}
+
+// Keep the orphans within -maxorphanblocks bytes of memory. Old orphans are
+// dropped, then the oldest of the peer that sent the most orphan bytes goes
+// first, to disk while -orphanspill has room, else away. Evicted blocks are
+// asked for again if still wanted.
+void static LimitOrphanBlocks()
+{
+    int64_t nExpire = GetTime() - ORPHAN_BLOCK_EXPIRY;
+    vector<uint256> vExpired;
+    for (map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.begin(); it != mapOrphanBlockInfo.end(); ++it)
+        if (it->second.nTimeReceived < nExpire)
+            vExpired.push_back(it->first);
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        EraseOrphanBlock(hash);
+
+    while (nOrphanBlocksMemory > nMaxOrphanBlocksMemory)
+    {
+        map<uint256, COrphanBlockInfo>::iterator itVictim = mapOrphanBlockInfo.end();
+        uint64_t nVictimPeerBytes = 0;
+        for (map<uint256, COrphanBlockInfo>::iterator it = mapOrphanBlockInfo.begin(); it != mapOrphanBlockInfo.end(); ++it)
+        {
+            if (it->second.fSpilled)
+                continue;
+            uint64_t nPeerBytes = mapOrphanBytesByPeer[it->second.addrFrom];
+            if (itVictim == mapOrphanBlockInfo.end() || nPeerBytes > nVictimPeerBytes ||
+                (nPeerBytes == nVictimPeerBytes && it->second.nTimeReceived < itVictim->second.nTimeReceived))
+            {
+                itVictim = it;
+                nVictimPeerBytes = nPeerBytes;
+            }
+        }
+        if (itVictim == mapOrphanBlockInfo.end())
+            break;
+
+        uint256 hash = itVictim->first;
+        COrphanBlockInfo& info = itVictim->second;
+        if (nOrphanBlocksDisk + info.nSize <= nMaxOrphanBlocksDisk && SpillOrphanBlock(hash, mapOrphanBlocks[hash]))
+        {
+            info.fSpilled = true;
+            nOrphanBlocksMemory -= info.nSize;
+            nOrphanBlocksDisk += info.nSize;
+        }
+        else
+        {
+            printf("LimitOrphanBlocks() : dropping orphan %s\n", hash.ToString().substr(0,20).c_str());
+            EraseOrphanBlock(hash);
+        }
+    }
+}
+
+// select stake target limit according to hard-coded conditions
+uint256 inline GetProofOfStakeLimit(int nHeight, unsigned int nTime)
+{
+    return bnProofOfStakeLimit;
+    return bnProofOfWorkLimit; // return bnProofOfWorkLimit of none matched
+}
+
+// miner's coin base reward
+int64_t GetProofOfWorkReward(int64_t nFees)
+{
+    int64_t nSubsidy = 0;
+
+    if(pindexBest->nHeight <= 419)
+        nSubsidy = 10 * CENT;
+	
+    else if (pindexBest->nHeight >= 420)
+        nSubsidy = 0 * COIN;
+	
+	if (fDebug && GetBoolArg("-printcreation"))
+        printf("GetProofOfWorkReward() : create=%s nSubsidy=%" PRId64 "\n", FormatMoney(nSubsidy).c_str(), nSubsidy);
 	
     return nSubsidy + nFees;
 }
@@ -1021,7 +1891,7 @@ unsigned int ComputeMaxBits(CBigNum bnTargetLimit, unsigned int nBase, int64_t n
 //
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime)
 {
-    return ComputeMaxBits(bnProofOfWorkLimit, nBase, nTime);
+    return ComputeMaxBits(CBigNum(bnProofOfWorkLimit), nBase, nTime);
 }
 
 //
@@ -1030,7 +1900,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime)
 //
 unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBlockTime)
 {
-    return ComputeMaxBits(GetProofOfStakeLimit(0, nBlockTime), nBase, nTime);
+    return ComputeMaxBits(CBigNum(GetProofOfStakeLimit(0, nBlockTime)), nBase, nTime);
 }
 
 
@@ -1047,7 +1917,7 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
     if (pindexLast == NULL)
         return bnProofOfWorkLimit.GetCompact(); // genesis block
 
-    CBigNum bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : GetProofOfStakeLimit(pindexLast->nHeight, pindexLast->nTime);
+    uint256 bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : GetProofOfStakeLimit(pindexLast->nHeight, pindexLast->nTime);
 
     const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
     if (pindexPrev->pprev == NULL)
@@ -1060,30 +1930,48 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    uint256 bnNew;
+    bool fNegative;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative);
     int64_t nTargetSpacing = fProofOfStake? nStakeTargetSpacing : min(GetTargetSpacingWorkMax(pindexLast->nHeight, pindexLast->nTime), (int64_t) nStakeTargetSpacing * (1 + pindexLast->nHeight - pindexPrev->nHeight));
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    int64_t nMul = (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing;
+    int64_t nDiv = (nInterval + 1) * nTargetSpacing;
 
-    if (bnNew > bnTargetLimit)
+    // bnNew * nMul / nDiv truncated toward zero, split into quotient and remainder
+    //   by nDiv first so that the product can't leave 256 bits unnoticed
+    if (nMul < 0)
+    {
+        fNegative = !fNegative;
+        nMul = -nMul;
+    }
+    uint256 bnQuot = bnNew / nDiv;
+    uint256 bnRem = bnNew - bnQuot * nDiv;
+    bool fOverflow = bnQuot.MulOverflow(uint256(nMul));
+    bnNew = bnQuot + bnRem * nMul / nDiv;
+    if (bnNew < bnQuot)
+        fOverflow = true;
+    if (fOverflow)
+        bnNew = ~uint256(0);
+
+    if (!fNegative && bnNew > bnTargetLimit)
         bnNew = bnTargetLimit;
 
-    return bnNew.GetCompact();
+    return bnNew.GetCompact(fNegative);
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1187,7 +2075,8 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                               const MapPrevTx* pmapPrefetched)
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1204,6 +2093,9 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (inputsRet.count(prevout.hash))
             continue; // Got it already
 
+        MapPrevTx::const_iterator mi = pmapPrefetched ? pmapPrefetched->find(prevout.hash) : MapPrevTx::const_iterator();
+        bool fPrefetched = pmapPrefetched && mi != pmapPrefetched->end();
+
         // Read txindex
         CTxIndex& txindex = inputsRet[prevout.hash].first;
         bool fFound = true;
@@ -1212,6 +2104,11 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             // Get txindex from current proposed changes
             txindex = mapTestPool.find(prevout.hash)->second;
         }
+        else if (fPrefetched)
+        {
+            // Already read by the caller
+            txindex = mi->second.first;
+        }
         else
         {
             // Read txindex from txdb
@@ -1234,6 +2131,11 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
+        else if (fPrefetched && mi->second.first.pos == txindex.pos)
+        {
+            // Get prev tx read ahead of time
+            txPrev = mi->second.second;
+        }
         else
         {
             // Get prev tx from disk
@@ -1261,6 +2163,80 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     return true;
 }
 
+// LevelDB orders the keys bytewise, uint256::operator< doesn't
+struct CompareHashBytes
+{
+    bool operator()(const uint256& a, const uint256& b) const
+    {
+        return memcmp(&a, &b, sizeof(a)) < 0;
+    }
+};
+
+struct CompareDiskTxPos
+{
+    bool operator()(const std::pair<CDiskTxPos, uint256>& a, const std::pair<CDiskTxPos, uint256>& b) const
+    {
+        if (a.first.nFile != b.first.nFile)
+            return a.first.nFile < b.first.nFile;
+        return a.first.nTxPos < b.first.nTxPos;
+    }
+};
+
+// Read the previous transactions of all the inputs of a block in one pass,
+//   the index entries in key order and then the transactions in file order.
+//   Inputs which can't be read here are left to FetchInputs.
+void static PrefetchInputs(CTxDB& txdb, const std::vector<CTransaction>& vtx, MapPrevTx& mapPrefetched)
+{
+    std::vector<uint256> vHashes;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vHashes.push_back(txin.prevout.hash);
+    }
+    std::sort(vHashes.begin(), vHashes.end(), CompareHashBytes());
+    vHashes.erase(std::unique(vHashes.begin(), vHashes.end()), vHashes.end());
+
+    // Outputs created in the same block aren't in txdb yet, they are just skipped
+    std::vector<std::pair<CDiskTxPos, uint256> > vPos;
+    vPos.reserve(vHashes.size());
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(hash, txindex) || txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        mapPrefetched[hash].first = txindex;
+        vPos.push_back(make_pair(txindex.pos, hash));
+    }
+    std::sort(vPos.begin(), vPos.end(), CompareDiskTxPos());
+
+    for (unsigned int i = 0; i < vPos.size(); )
+    {
+        unsigned int nFile = vPos[i].first.nFile;
+        CAutoFile filein = CAutoFile(NULL, SER_DISK, CLIENT_VERSION);
+        for ( ; i < vPos.size() && vPos[i].first.nFile == nFile; i++)
+        {
+            const uint256& hash = vPos[i].second;
+            bool fOk = ReadFromMappedBlockFile(nFile, vPos[i].first.nTxPos, mapPrefetched[hash].second, SER_DISK);
+            if (!fOk && !filein)
+                filein = OpenBlockFile(nFile, 0, "rb");
+            if (!fOk && filein && fseek(filein, vPos[i].first.nTxPos, SEEK_SET) == 0)
+            {
+                try {
+                    filein >> mapPrefetched[hash].second;
+                    fOk = true;
+                }
+                catch (const std::exception&) {
+                    filein.clear(0);
+                }
+            }
+            if (!fOk)
+                mapPrefetched.erase(hash);
+        }
+    }
+}
+
 const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const
 {
     MapPrevTx::const_iterator mi = inputs.find(input.prevout.hash);
@@ -1305,7 +2281,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHash.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
     return true;
 }
@@ -1357,6 +2333,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         if (pvChecks)
             pvChecks->reserve(vin.size());
 
+        boost::shared_ptr<const CSignatureHashContext> pSigHash;
+
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
@@ -1378,8 +2356,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (fScriptChecks)
             {
+                // Signature hashing data is computed once for all the inputs
+                if (!pSigHash && vin.size() > 1)
+                    pSigHash.reset(new CSignatureHashContext(*this));
+
                 // Verify signature
-                CScriptCheck check(txPrev, *this, i, flags, 0);
+                CScriptCheck check(txPrev, *this, i, flags, 0, pSigHash);
                 if (pvChecks)
                 {
                     pvChecks->push_back(CScriptCheck());
@@ -1495,8 +2477,68 @@ bool CTransaction::ClientConnectInputs()
 
 
 
+// Collect the address and spent output index entries of a transaction,
+// vPrevOut holds the outputs spent by its inputs in order
+static void GetOptionalIndexEntries(const CTransaction& tx, const vector<CTxOut>& vPrevOut, int nHeight,
+                                    vector<CAddrIndexKey>& vAddrIndex, vector<pair<COutPoint, CSpentIndexValue> >& vSpentIndex)
+{
+    uint256 hashTx = tx.GetHash();
+    CAddrIndexKey key;
+    key.hashTx = hashTx;
+    for (unsigned int i = 0; i < vPrevOut.size(); i++)
+    {
+        vSpentIndex.push_back(make_pair(tx.vin[i].prevout, CSpentIndexValue(hashTx, i, nHeight)));
+        if (key.SetDestination(vPrevOut[i].scriptPubKey))
+            vAddrIndex.push_back(key);
+    }
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (key.SetDestination(txout.scriptPubKey))
+            vAddrIndex.push_back(key);
+}
+
+// Read the outputs spent by a transaction of the best chain
+static bool ReadPrevOuts(CTxDB& txdb, const CTransaction& tx, vector<CTxOut>& vPrevOut)
+{
+    vPrevOut.clear();
+    if (tx.IsCoinBase())
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        CTransaction txPrev;
+        if (!txdb.ReadDiskTx(txin.prevout, txPrev) || txin.prevout.n >= txPrev.vout.size())
+            return error("ReadPrevOuts() : %s input not found", tx.GetHash().ToString().substr(0,10).c_str());
+        vPrevOut.push_back(txPrev.vout[txin.prevout.n]);
+    }
+    return true;
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Drop the optional index entries first, the transactions spent inside
+    // this block are not found anymore once their inputs are disconnected
+    if (fAddrIndex || fSpentIndex)
+    {
+        vector<CAddrIndexKey> vAddrIndex;
+        vector<pair<COutPoint, CSpentIndexValue> > vSpentIndex;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            vector<CTxOut> vPrevOut;
+            if (!ReadPrevOuts(txdb, tx, vPrevOut))
+                return error("DisconnectBlock() : ReadPrevOuts failed");
+            GetOptionalIndexEntries(tx, vPrevOut, pindex->nHeight, vAddrIndex, vSpentIndex);
+        }
+        if (fAddrIndex)
+        {
+            BOOST_FOREACH(const CAddrIndexKey& key, vAddrIndex)
+                if (!txdb.EraseAddrIndex(key))
+                    return error("DisconnectBlock() : EraseAddrIndex failed");
+        }
+        if (fSpentIndex)
+            for (unsigned int i = 0; i < vSpentIndex.size(); i++)
+                if (!txdb.EraseSpentIndex(vSpentIndex[i].first))
+                    return error("DisconnectBlock() : EraseSpentIndex failed");
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1521,6 +2563,98 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
+// Context-free checks of a single block transaction, the transaction hash
+//   and sigop count are stored in the slot given by CheckBlock. The block
+//   signature of a proof-of-stake block goes into the same batch.
+class CTxCheck
+{
+public:
+    struct Result
+    {
+        uint256 hash;
+        unsigned int nSigOps;
+        bool fChecked;
+        bool fValid;
+
+        Result() : nSigOps(0), fChecked(false), fValid(false) { }
+    };
+
+private:
+    const CTransaction *ptx;
+    const CBlock *pblock;
+    Result *pResult;
+
+public:
+    CTxCheck() : ptx(NULL), pblock(NULL), pResult(NULL) {}
+    CTxCheck(const CTransaction& txIn, Result& resultIn) : ptx(&txIn), pblock(NULL), pResult(&resultIn) { }
+    CTxCheck(const CBlock& blockIn, Result& resultIn) : ptx(NULL), pblock(&blockIn), pResult(&resultIn) { }
+
+    bool operator()() const {
+        if (pblock)
+        {
+            pResult->fValid = pblock->CheckBlockSignature();
+            pResult->fChecked = true;
+            return pResult->fValid;
+        }
+        pResult->hash = ptx->GetHash();
+        pResult->nSigOps = ptx->GetLegacySigOpCount();
+        pResult->fValid = ptx->CheckTransaction();
+        pResult->fChecked = true;
+        return pResult->fValid;
+    }
+
+    void swap(CTxCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(pblock, check.pblock);
+        std::swap(pResult, check.pResult);
+    }
+};
+
+// Transaction checks are cheap, so they are handed out in smaller batches
+static CCheckQueue<CTxCheck> txcheckqueue(16);
+static CWaitableCriticalSection cs_txcheckqueue;
+
+// Run the transaction checks of a block on the block check threads, small
+//   blocks and concurrent callers are checked inline
+static bool VerifyTxChecks(std::vector<CTxCheck> &vChecks)
+{
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_txcheckqueue, boost::defer_lock);
+    if (!nScriptCheckThreads || vChecks.size() < 8 || !lock.try_lock())
+    {
+        BOOST_FOREACH(const CTxCheck &check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    CCheckQueueControl<CTxCheck> control(&txcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+// Only one master can use the queue at a time. ConnectBlock blocks on
+//   this lock, VerifyScriptChecks only tries it.
+static CWaitableCriticalSection cs_scriptcheckqueue;
+
+// Verify given checks on the script check threads, or inline on the calling
+//   thread while a block holds the queue. Either way every check is done
+//   when it returns; nothing is left running for the caller to wait on.
+static bool VerifyScriptChecks(std::vector<CScriptCheck> &vChecks)
+{
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_scriptcheckqueue, boost::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        BOOST_FOREACH(const CScriptCheck &check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 void ThreadScriptCheck(void*) {
     vnThreadsRunning[THREAD_SCRIPTCHECK]++;
     RenameThread("42-scriptch");
@@ -1528,12 +2662,39 @@ void ThreadScriptCheck(void*) {
     vnThreadsRunning[THREAD_SCRIPTCHECK]--;
 }
 
+void ThreadBlockCheck(void*) {
+    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+    RenameThread("42-blockch");
+    txcheckqueue.Thread();
+    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+}
+
 void ThreadScriptCheckQuit() {
     scriptcheckqueue.Quit();
+    txcheckqueue.Quit();
+}
+
+// Whether the block is an ancestor of the -assumevalid block, in which case
+//   its scripts are not verified. Everything else is still checked, and
+//   nothing is skipped until the -assumevalid block itself is known.
+bool static IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashAssumeValid);
+    if (mi == mapBlockIndex.end())
+        return false;
+
+    const CBlockIndex* pindexAssumed = mi->second;
+    if (pindex->nHeight >= pindexAssumed->nHeight)
+        return false;
+    return pindexAssumed->GetAncestor(pindex->nHeight) == pindex;
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
+    PROFILE_SCOPE("ConnectBlock");
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
         return false;
@@ -1551,7 +2712,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     // two in the chain that violate it. This prevents exploiting the issue against nodes in their
     // initial block download.
     bool fEnforceBIP30 = true; // Always active in 42
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = fCheckpointScripts || pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    if (fScriptChecks && IsAssumedValid(pindex))
+    {
+        fScriptChecks = false;
+        if (!fJustCheck)
+            nAssumeValidSkipped++;
+    }
 
     //// issue here: it doesn't know the version
     unsigned int nTxPos;
@@ -1563,8 +2730,23 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    boost::unique_lock<CWaitableCriticalSection> lockQueue(cs_scriptcheckqueue, boost::defer_lock);
+    if (fScriptChecks && nScriptCheckThreads)
+        lockQueue.lock();
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
+    // Read the inputs of the whole block at once, it saves random disk reads
+    int64_t nTimeStart = GetTimeMicros();
+    MapPrevTx mapPrefetched;
+    PrefetchInputs(txdb, vtx, mapPrefetched);
+    int64_t nTimeFetch = GetTimeMicros() - nTimeStart;
+    int64_t nTimeScripts = 0;
+
+    // Entries of the optional indexes, written along with the txindex changes
+    bool fOptionalIndexes = !fJustCheck && (fAddrIndex || fSpentIndex);
+    vector<CAddrIndexKey> vAddrIndex;
+    vector<pair<COutPoint, CSpentIndexValue> > vSpentIndex;
+
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1596,8 +2778,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         else
         {
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+            nTimeStart = GetTimeMicros();
+            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid, &mapPrefetched))
                 return false;
+            nTimeFetch += GetTimeMicros() - nTimeStart;
 
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
@@ -1622,16 +2806,38 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             }
 
             std::vector<CScriptCheck> vChecks;
+            nTimeStart = GetTimeMicros();
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fScriptChecks, nFlags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+            nTimeScripts += GetTimeMicros() - nTimeStart;
+            if (fScriptChecks && !fJustCheck)
+                connectStats.nScriptInputs += tx.vin.size();
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        if (fOptionalIndexes)
+        {
+            vector<CTxOut> vPrevOut;
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    vPrevOut.push_back(mapInputs[txin.prevout.hash].second.vout[txin.prevout.n]);
+            }
+            GetOptionalIndexEntries(tx, vPrevOut, pindex->nHeight, vAddrIndex, vSpentIndex);
+        }
     }
 
+    nTimeStart = GetTimeMicros();
     if (!control.Wait())
         return DoS(100, false);
+    nTimeScripts += GetTimeMicros() - nTimeStart;
+    if (!fJustCheck)
+    {
+        connectStats.nFetchInputs += nTimeFetch;
+        connectStats.nScriptChecks += nTimeScripts;
+    }
 
     if (IsProofOfWork())
     {
@@ -1665,6 +2871,17 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    if (fAddrIndex)
+    {
+        BOOST_FOREACH(const CAddrIndexKey& key, vAddrIndex)
+            if (!txdb.WriteAddrIndex(key, pindex->nHeight))
+                return error("ConnectBlock() : WriteAddrIndex failed");
+    }
+    if (fSpentIndex)
+        for (unsigned int i = 0; i < vSpentIndex.size(); i++)
+            if (!txdb.WriteSpentIndex(vSpentIndex[i].first, vSpentIndex[i].second))
+                return error("ConnectBlock() : WriteSpentIndex failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1683,20 +2900,67 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     return true;
 }
 
-bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
+// Put the transactions of disconnected blocks back into the memory pool in the
+// given order, checked against the new best chain. The signatures of the whole
+// batch are verified at once on the script checking threads.
+static void ResurrectTransactions(CTxDB& txdb, vector<CTransaction>& vResurrect)
 {
-    printf("REORGANIZE\n");
+    int64_t nStart = GetTimeMicros();
 
-    // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
+    // The checks point into vResurrect, which stays as it is until they are done
+    vector<vector<CScriptCheck> > vTxChecks(vResurrect.size());
+    vector<CScriptCheck> vChecks;
+    unsigned int nAccepted = 0;
+    for (unsigned int i = 0; i < vResurrect.size(); i++)
+    {
+        if (!mempool.accept(txdb, vResurrect[i], true, NULL, &vTxChecks[i]))
+        {
+            vTxChecks[i].clear();
+            continue;
+        }
+        vChecks.insert(vChecks.end(), vTxChecks[i].begin(), vTxChecks[i].end());
+        nAccepted++;
+    }
+
+    unsigned int nRemoved = 0;
+    if (!VerifyScriptChecks(vChecks))
+    {
+        // Find the culprits, what spends from them goes too
+        for (unsigned int i = 0; i < vResurrect.size(); i++)
+        {
+            BOOST_FOREACH(const CScriptCheck& check, vTxChecks[i])
+            {
+                if (!check())
+                {
+                    printf("ResurrectTransactions() : script checks failed %s\n", vResurrect[i].GetHash().ToString().substr(0,10).c_str());
+                    nRemoved += mempool.removeWithDescendants(vResurrect[i].GetHash());
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("ResurrectTransactions() : %u of %" PRIszu " transactions accepted, %u removed for bad signatures  %.2fms\n",
+           nAccepted, vResurrect.size(), nRemoved, (GetTimeMicros() - nStart) * 0.001);
+}
+
+bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
+{
+    printf("REORGANIZE\n");
+
+    // Find the fork, jump to the same height first
+    CBlockIndex* pfork = pindexBest;
+    CBlockIndex* plonger = pindexNew;
+    if (plonger->nHeight > pfork->nHeight)
+        plonger = plonger->GetAncestor(pfork->nHeight);
+    else
+        pfork = pfork->GetAncestor(plonger->nHeight);
+    if (plonger == NULL || pfork == NULL)
+        return error("Reorganize() : broken chain of block indexes");
     while (pfork != plonger)
     {
-        while (plonger->nHeight > pfork->nHeight)
-            if ((plonger = plonger->pprev) == NULL)
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
+        if ((plonger = plonger->pprev) == NULL)
+            return error("Reorganize() : plonger->pprev is null");
         if ((pfork = pfork->pprev) == NULL)
             return error("Reorganize() : pfork->pprev is null");
     }
@@ -1716,7 +2980,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("REORGANIZE: Connect %" PRIszu " blocks; %s..%s\n", vConnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->GetBlockHash().ToString().substr(0,20).c_str());
 
     // Disconnect shorter branch
-    vector<CTransaction> vResurrect;
+    vector<vector<CTransaction> > vResurrectBlocks;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
@@ -1726,9 +2990,10 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
 
         // Queue memory transactions to resurrect
+        vResurrectBlocks.push_back(vector<CTransaction>());
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             if (!(tx.IsCoinBase() || tx.IsCoinStake()))
-                vResurrect.push_back(tx);
+                vResurrectBlocks.back().push_back(tx);
     }
 
     // Connect longer branch
@@ -1756,24 +3021,31 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
 
-    // Disconnect shorter branch
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = NULL;
+    {
+        WRITE_LOCK(cs_blockIndex);
 
-    // Connect longer branch
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = pindex;
+        // Disconnect shorter branch
+        BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = NULL;
 
-    // Resurrect memory transactions that were in the disconnected branch
-    BOOST_FOREACH(CTransaction& tx, vResurrect)
-        tx.AcceptToMemoryPool(txdb, false);
+        // Connect longer branch
+        BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = pindex;
+    }
 
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete)
         mempool.remove(tx);
 
+    // Resurrect memory transactions that were in the disconnected branch, oldest
+    // block first so parents come before their children
+    vector<CTransaction> vResurrect;
+    BOOST_REVERSE_FOREACH(const vector<CTransaction>& vBlockTx, vResurrectBlocks)
+        vResurrect.insert(vResurrect.end(), vBlockTx.begin(), vBlockTx.end());
+    ResurrectTransactions(txdb, vResurrect);
+
     printf("REORGANIZE: done\n");
 
     return true;
@@ -1792,21 +3064,28 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
+    int64_t nTimeStart = GetTimeMicros();
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
+    connectStats.nTxDBCommit += GetTimeMicros() - nTimeStart;
 
     // Add to current best branch
-    pindexNew->pprev->pnext = pindexNew;
+    {
+        WRITE_LOCK(cs_blockIndex);
+        pindexNew->pprev->pnext = pindexNew;
+    }
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+        mempool.remove(tx, pindexNew);
 
     return true;
 }
 
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
+    PROFILE_SCOPE("SetBestChain");
+    int64_t nTimeStart = GetTimeMicros();
     uint256 hash = GetHash();
 
     if (!txdb.TxnBegin())
@@ -1876,16 +3155,29 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     {
         const CBlockLocator locator(pindexNew);
         ::SetBestChain(locator);
+        txdb.CompactAfterBulkLoad();
     }
 
     // New best block
-    hashBestChain = hash;
-    pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexNew->nChainTrust;
+    {
+        WRITE_LOCK(cs_blockIndex);
+        hashBestChain = hash;
+        pindexBest = pindexNew;
+        SetBestChainByHeight(pindexNew);
+        nBestHeight = pindexBest->nHeight;
+        nBestChainTrust = pindexNew->nChainTrust;
+    }
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    PublishChainTip(pindexBest);
+    int64_t nTimeConnect = GetTimeMicros() - nTimeStart;
+    connectStats.nSetBestChain += nTimeConnect;
+    SetMetric(METRIC_BLOCK_HEIGHT, nBestHeight);
+    SetMetric(METRIC_BLOCK_TIME, pindexBest->GetBlockTime());
+    AddMetric(METRIC_BLOCKS_CONNECTED, 1);
+    AddMetric(METRIC_BLOCK_CONNECT_TIME, nTimeConnect);
+    SetMetric(METRIC_LAST_BLOCK_CONNECT_TIME, nTimeConnect);
+    blockNotifyHistory.Push(hashBestChain);
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -1918,7 +3210,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!fIsInitialDownload && !strCmd.empty())
     {
         boost::replace_all(strCmd, "%s", hashBestChain.GetHex());
-        boost::thread t(runCommand, strCmd); // thread runs free
+        scheduler.Schedule(boost::bind(runCommand, strCmd));
     }
 
     return true;
@@ -1949,11 +3241,11 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const
         if (nTime < txPrev.nTime)
             return false;  // Transaction timestamp violation
 
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            return false; // unable to read block of previous transaction
-        if (block.GetBlockTime() + nStakeMinAge > nTime)
+        // Find block header
+        CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        if (!pindexFrom)
+            return false; // unable to find block of previous transaction
+        if (pindexFrom->GetBlockTime() + nStakeMinAge > nTime)
             continue; // only count coins meeting min age requirement
 
         int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
@@ -2000,15 +3292,15 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = AllocBlockIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
 
     // ppcoin: compute chain trust score
@@ -2026,10 +3318,11 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         pindexNew->hashProofOfStake = mapProofOfStake[hash];
     }
 
-    // ppcoin: compute stake modifier
+    // ppcoin: compute stake modifier, unless -modifiersnapshot has it
     uint64_t nStakeModifier = 0;
     bool fGeneratedStakeModifier = false;
-    if (!ComputeNextStakeModifier(pindexNew, nStakeModifier, fGeneratedStakeModifier))
+    if (!GetSnapshotStakeModifier(pindexNew, nStakeModifier, fGeneratedStakeModifier) &&
+        !ComputeNextStakeModifier(pindexNew, nStakeModifier, fGeneratedStakeModifier))
         return error("AddToBlockIndex() : ComputeNextStakeModifier() failed");
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
     pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
@@ -2037,10 +3330,14 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    {
+        WRITE_LOCK(cs_blockIndex);
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    pindexNew->phashBlock = &((*mi).first);
+    AddBlockIndexPos(pindexNew);
 
     // Write to disk block index
     CTxDB txdb;
@@ -2090,12 +3387,6 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (!vtx[0].IsCoinBase())
         return DoS(100, error("CheckBlock() : first tx is not coinbase"));
 
-    if (!vtx[0].CheckTransaction())
-        return DoS(vtx[0].nDoS, error("CheckBlock() : CheckTransaction failed on coinbase"));
-
-    uniqueTx.insert(vtx[0].GetHash());
-    nSigOps += vtx[0].GetLegacySigOpCount();
-
     if (fProofOfStake)
     {
         // Proof-of-STake related checkings. Note that we know here that 1st transactions is coinstake. We don't need 
@@ -2112,16 +3403,6 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         // Check coinstake timestamp
         if (GetBlockTime() != (int64_t)vtx[1].nTime)
             return DoS(50, error("CheckBlock() : coinstake timestamp violation nTimeBlock=%" PRId64 " nTimeTx=%u", GetBlockTime(), vtx[1].nTime));
-
-        // 42: check proof-of-stake block signature
-        if (fCheckSig && !CheckBlockSignature())
-            return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
-
-        if (!vtx[1].CheckTransaction())
-            return DoS(vtx[1].nDoS, error("CheckBlock() : CheckTransaction failed on coinstake"));
-
-        uniqueTx.insert(vtx[1].GetHash());
-        nSigOps += vtx[1].GetLegacySigOpCount();
     }
     else
     {
@@ -2155,16 +3436,51 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         // Check transaction timestamp
         if (GetBlockTime() < (int64_t)tx.nTime)
             return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
+    }
 
-        // Check transaction consistency
-        if (!tx.CheckTransaction())
-            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
+    // Check transaction consistency, hash the transactions and count
+    //   their sigops, in parallel when the block check threads are running
+    std::vector<CTxCheck::Result> vResults(vtx.size());
+    std::vector<CTxCheck> vChecks;
+    vChecks.reserve(vtx.size() + 1);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        vChecks.push_back(CTxCheck(vtx[i], vResults[i]));
+
+    // 42: check proof-of-stake block signature alongside the transactions.
+    //   It is the most expensive check, the queue hands out the last jobs
+    //   first so it is added at the end.
+    CTxCheck::Result sigResult;
+    if (fProofOfStake && fCheckSig)
+        vChecks.push_back(CTxCheck(*this, sigResult));
+
+    if (!VerifyTxChecks(vChecks))
+    {
+        if (sigResult.fChecked && !sigResult.fValid)
+            return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            // Checks after the first failure may have been skipped
+            if (!vResults[i].fChecked || vResults[i].fValid)
+                continue;
+            if (i == 0)
+                return DoS(vtx[0].nDoS, error("CheckBlock() : CheckTransaction failed on coinbase"));
+            if (i == 1 && fProofOfStake)
+                return DoS(vtx[1].nDoS, error("CheckBlock() : CheckTransaction failed on coinstake"));
+            return DoS(vtx[i].nDoS, error("CheckBlock() : CheckTransaction failed"));
+        }
+        return error("CheckBlock() : CheckTransaction failed");
+    }
 
+    std::vector<uint256> vHashes;
+    vHashes.reserve(vtx.size());
+    BOOST_FOREACH(const CTxCheck::Result& result, vResults)
+    {
         // Add transaction hash into list of unique transaction IDs
-        uniqueTx.insert(tx.GetHash());
+        uniqueTx.insert(result.hash);
+        vHashes.push_back(result.hash);
 
         // Calculate sigops count
-        nSigOps += tx.GetLegacySigOpCount();
+        nSigOps += result.nSigOps;
     }
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
@@ -2176,14 +3492,14 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
-    // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    // Check merkle root, the leaves are already hashed
+    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree(vHashes))
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
 }
 
-bool CBlock::AcceptBlock()
+bool CBlock::AcceptBlock(unsigned int nFileIn, unsigned int nBlockPosIn)
 {
     // Check for duplicate
     uint256 hash = GetHash();
@@ -2191,7 +3507,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2223,6 +3539,10 @@ bool CBlock::AcceptBlock()
     if (!Checkpoints::CheckHardened(nHeight, hash))
         return DoS(100, error("AcceptBlock() : rejected by hardened checkpoint lock-in at %d", nHeight));
 
+    // Nothing but the -assumevalid block is accepted at its height
+    if (nHeight == nAssumeValidHeight && hash != hashAssumeValid)
+        return DoS(100, error("AcceptBlock() : rejected by -assumevalid block at %d", nHeight));
+
     bool cpSatisfies = Checkpoints::CheckSync(hash, pindexPrev);
 
     // Check that the block satisfies synchronized checkpoint
@@ -2238,24 +3558,52 @@ bool CBlock::AcceptBlock()
         !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
         return DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
 
-    // Write block to history file
-    if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
-        return error("AcceptBlock() : out of disk space");
-    unsigned int nFile = std::numeric_limits<unsigned int>::max();
-    unsigned int nBlockPos = 0;
-    if (!WriteToDisk(nFile, nBlockPos))
-        return error("AcceptBlock() : WriteToDisk failed");
+    // Write block to history file, unless it is stored there already
+    unsigned int nFile = nFileIn;
+    unsigned int nBlockPos = nBlockPosIn;
+    if (nFile == std::numeric_limits<unsigned int>::max())
+    {
+        if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
+            return error("AcceptBlock() : out of disk space");
+        if (!WriteToDisk(nFile, nBlockPos))
+            return error("AcceptBlock() : WriteToDisk failed");
+        blockcache.Add(hash, *this);
+    }
     if (!AddToBlockIndex(nFile, nBlockPos))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
+    // Look for block files to prune whenever a new one is started
+    static unsigned int nLastPruneFile = 0;
+    if (nPruneTarget && nFile != nLastPruneFile)
+    {
+        nLastPruneFile = nFile;
+        PruneBlockFiles();
+    }
+
     // Relay inventory, but don't relay old inventory during initial block download
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that can rebuild it from their memory pool get it at once, in compact form
+        CInv inv(MSG_BLOCK, hash);
+        bool fCompact = !IsInitialBlockDownload();
+        CSendBuffer pmsgCompact;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (fCompact && pnode->nVersion >= COMPACT_BLOCKS_VERSION)
+            {
+                if (!pnode->AddInventoryKnown(inv))
+                    continue;
+                if (!pmsgCompact)
+                    pmsgCompact = MakeSendBuffer("cmpctblock", CCompactBlock(*this));
+                pnode->PushSendBuffer(pmsgCompact);
+            }
+            else
+                pnode->PushInventory(inv);
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2264,12 +3612,80 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Compute what height to jump back to with the pskip pointer
+static inline int GetSkipHeight(int height)
+{
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height)
+    {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= height))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        }
+        else
+        {
+            if (pindexWalk->pprev == NULL)
+                return NULL;
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+// 2^256 / (bnTarget + 1) without leaving 256 bits, zero for targets
+//   that don't fit either
+static uint256 GetTargetTrust(const uint256& bnTarget, bool fOverflow)
+{
+    if (fOverflow)
+        return 0;
+    if (bnTarget == ~uint256(0))
+        return 1;
+    return (~bnTarget / (bnTarget + 1)) + 1;
+}
+
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || bnTarget == 0)
         return 0;
 
     // Return 1 for the first 12 blocks
@@ -2280,11 +3696,11 @@ uint256 CBlockIndex::GetBlockTrust() const
 
     if(IsProofOfStake())
     {
-        CBigNum bnNewTrust = (CBigNum(1)<<256) / (bnTarget+1);
+        uint256 bnNewTrust = GetTargetTrust(bnTarget, fOverflow);
 
         // Return 1/3 of score if parent block is not the PoW block
         if (!pprev->IsProofOfWork())
-            return (bnNewTrust / 3).getuint256();
+            return bnNewTrust / 3;
 
         int nPoWCount = 0;
 
@@ -2298,24 +3714,27 @@ uint256 CBlockIndex::GetBlockTrust() const
 
         // Return 1/3 of score if less than 3 PoW blocks found
         if (nPoWCount < 3)
-            return (bnNewTrust / 3).getuint256();
+            return bnNewTrust / 3;
 
-        return bnNewTrust.getuint256();
+        return bnNewTrust;
     }
     else
     {
         // Calculate work amount for block
-        CBigNum bnPoWTrust = CBigNum(nPoWBase) / (bnTarget+1);
+        uint256 bnPoWTrust = (fOverflow || bnTarget == ~uint256(0)) ? uint256(0) : nPoWBase / (bnTarget+1);
 
         // Set nPowTrust to 1 if PoW difficulty is too low
         if (bnPoWTrust < 1)
             bnPoWTrust = 1;
 
-        CBigNum bnLastBlockTrust = CBigNum(pprev->nChainTrust - pprev->pprev->nChainTrust);
+        // 2/3 of the previous block score, 2 * x / 3 without the doubling overflowing
+        uint256 bnLastBlockTrust = pprev->nChainTrust - pprev->pprev->nChainTrust;
+        uint256 bnThird = bnLastBlockTrust / 3;
+        uint256 bnLastTwoThirds = bnThird * 2 + (bnLastBlockTrust - bnThird * 3) * 2 / 3;
 
         // Return nPoWTrust + 2/3 of previous block score if two parent blocks are not PoS blocks
         if (!(pprev->IsProofOfStake() && pprev->pprev->IsProofOfStake()))
-            return (bnPoWTrust + 2 * bnLastBlockTrust / 3).getuint256();
+            return bnPoWTrust + bnLastTwoThirds;
 
         int nPoSCount = 0;
 
@@ -2329,17 +3748,17 @@ uint256 CBlockIndex::GetBlockTrust() const
 
         // Return nPoWTrust + 2/3 of previous block score if less than 7 PoS blocks found
         if (nPoSCount < 7)
-            return (bnPoWTrust + 2 * bnLastBlockTrust / 3).getuint256();
+            return bnPoWTrust + bnLastTwoThirds;
 
-        bnTarget.SetCompact(pprev->nBits);
+        bnTarget.SetCompact(pprev->nBits, &fNegative, &fOverflow);
 
-        if (bnTarget <= 0)
+        if (fNegative || bnTarget == 0)
             return 0;
 
-        CBigNum bnNewTrust = (CBigNum(1)<<256) / (bnTarget+1);
+        uint256 bnNewTrust = GetTargetTrust(bnTarget, fOverflow);
 
         // Return nPoWTrust + full trust score for previous block nBits
-        return (bnPoWTrust + bnNewTrust).getuint256();
+        return bnPoWTrust + bnNewTrust;
     }
 }
 
@@ -2374,172 +3793,1172 @@ bool static IsCanonicalBlockSignature(CBlock* pblock)
     return IsDERSignature(pblock->vchBlockSig);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// Context-free part of ProcessBlock, doesn't need cs_main
+bool static PreCheckBlock(CBlock* pblock)
 {
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
-
-    // Check that block isn't listed as unconditionally banned.
-    if (!Checkpoints::CheckBanned(hash)) {
-        if (pfrom)
-            pfrom->Misbehaving(100);
-        return error("ProcessBlock() : block %s is rejected by hard-coded banlist", hash.GetHex().substr(0,20).c_str());
-    }
-
-    // Check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
-
     // Strip the garbage from newly received blocks, if we found some
     if (!IsCanonicalBlockSignature(pblock)) {
         if (!ReserealizeBlockSignature(pblock))
-            printf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+            printf("WARNING: PreCheckBlock() : ReserealizeBlockSignature FAILED\n");
     }
 
     // Preliminary checks
-    if (!pblock->CheckBlock(true, true, (pblock->nTime > Checkpoints::GetLastCheckpointTime())))
-        return error("ProcessBlock() : CheckBlock FAILED");
+    return pblock->CheckBlock(true, true, (pblock->nTime > Checkpoints::GetLastCheckpointTime()));
+}
 
-    // ppcoin: verify hash target and signature of coinstake tx
-    if (pblock->IsProofOfStake())
+// Headers-first synchronization: the headers are fetched ahead of the blocks,
+//   then the blocks along the best header chain are asked from the peers
+//   that have them, a window at a time
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const int MAX_HEADERS_AHEAD = 50000;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_FLIGHT = 16;
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+static const int64_t BLOCK_STALL_TIMEOUT = 10;
+static const int MAX_BLOCK_FAILURES = 3;
+static const unsigned int MAX_INVALID_HEADERS = 1000;
+
+bool static IsBlockPipelined(const uint256& hash);
+
+// Raise the ban score of the peer at addr, if it is still connected
+void static MisbehavingPeer(const CService& addr, int howmuch)
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-        if (!CheckProofOfStake(pblock->vtx[1], pblock->nBits, hashProofOfStake, targetProofOfStake))
+        if ((CService)pnode->addr == addr)
         {
-            printf("WARNING: ProcessBlock(): check proof-of-stake failed for block %s\n", hash.ToString().c_str());
-            return false; // do not error here as we expect this during initial block download
+            pnode->Misbehaving(howmuch);
+            break;
         }
-        if (!mapProofOfStake.count(hash)) // add to mapProofOfStake
-            mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
+}
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+// Needs cs_main
+class CHeaderChain
+{
+private:
+    struct CHeader
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        CBigNum bnNewBlock;
-        bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
-
-        if (pblock->IsProofOfStake())
-            bnRequired.SetCompact(ComputeMinStake(GetLastBlockIndex(pcheckpoint, true)->nBits, deltaTime, pblock->nTime));
-        else
-            bnRequired.SetCompact(ComputeMinWork(GetLastBlockIndex(pcheckpoint, false)->nBits, deltaTime));
+        uint256 hashPrev;
+        int nHeight;
+        unsigned int nTime;
+        uint256 nChainTrust; // claimed by the targets, see GetClaimedTrust
+        CService addrFrom;   // the peer that sent it
+    };
+
+    struct CBlockRequest
+    {
+        CNode* pnode; // released with PeerGone() before the node is deleted
+        int64_t nTime;
+    };
+
+    std::map<uint256, CHeader> mapHeaders; // headers of the blocks we don't have yet
+    std::deque<uint256> vBest;             // best header chain past the blocks we have
+    int nBestBase;                         // height of vBest.front()
+    std::map<uint256, CBlockRequest> mapRequested;
+
+    // The best chain is the one claiming the most trust by its targets, the
+    //   proof-of-work of its headers is checked as they come in, proof-of-stake
+    //   only once the blocks do. A block of it that fails to validate or to come in a few times
+    //   takes its branch down, and the blocks are then also asked for with
+    //   getblocks, from another peer than the one that sent the headers.
+    std::map<uint256, int> mapFailures;
+    std::set<uint256> setInvalid;
+    bool fGetBlocksFallback;
+    CService addrDropped;
+
+    // The trust a header claims by its target, without the adjustments for
+    //   the kinds of the blocks before it that GetBlockTrust makes
+    static uint256 GetClaimedTrust(const uint256& bnTarget, bool fProofOfStake)
+    {
+        if (fProofOfStake)
+            return GetTargetTrust(bnTarget, false);
+        uint256 bnPoWTrust = (bnTarget == ~uint256(0)) ? uint256(0) : nPoWBase / (bnTarget+1);
+        return bnPoWTrust < 1 ? uint256(1) : bnPoWTrust;
+    }
 
-        if (bnNewBlock > bnRequired)
+    int64_t GetMedianTimePast(uint256 hash) const
+    {
+        std::vector<int64_t> vTimes;
+        while ((int)vTimes.size() < CBlockIndex::nMedianTimeSpan)
         {
-            if (pfrom)
-                pfrom->Misbehaving(100);
-            return error("ProcessBlock() : block with too little %s", pblock->IsProofOfStake()? "proof-of-stake" : "proof-of-work");
+            std::map<uint256, CHeader>::const_iterator mi = mapHeaders.find(hash);
+            if (mi == mapHeaders.end())
+                break;
+            vTimes.push_back(mi->second.nTime);
+            hash = mi->second.hashPrev;
         }
+        BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+        for (CBlockIndex* pindex = (mi == mapBlockIndex.end() ? NULL : mi->second);
+             pindex && (int)vTimes.size() < CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+            vTimes.push_back(pindex->GetBlockTime());
+        if (vTimes.empty())
+            return 0;
+        std::sort(vTimes.begin(), vTimes.end());
+        return vTimes[vTimes.size() / 2];
     }
 
-    // ppcoin: ask for pending sync-checkpoint if any
-    if (!IsInitialBlockDownload())
-        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
-
-    // If don't already have its previous block, shunt it off to holding area until we get it
-    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    void SetBest(const uint256& hash, const CHeader& header)
     {
-        printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        // ppcoin: check proof-of-stake
-        if (pblock->IsProofOfStake())
+        if (!vBest.empty() && vBest.back() == header.hashPrev)
         {
-            // Limited duplicity on stake: prevents block flood attack
-            // Duplicate stake allowed only when there is orphan child block
-            if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
-            else
-                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+            vBest.push_back(hash);
+            return;
         }
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Switched to another branch of headers
+        vBest.clear();
+        for (uint256 hashWalk = hash; ; )
         {
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            std::map<uint256, CHeader>::const_iterator mi = mapHeaders.find(hashWalk);
+            if (mi == mapHeaders.end())
+                break;
+            vBest.push_front(hashWalk);
+            hashWalk = mi->second.hashPrev;
         }
-        return true;
+        nBestBase = header.nHeight - (int)vBest.size() + 1;
     }
 
-    // Store to disk
-    if (!pblock->AcceptBlock())
-        return error("ProcessBlock() : AcceptBlock FAILED");
-
-    // Recursively process any orphan blocks that depended on this one
-    vector<uint256> vWorkQueue;
-    vWorkQueue.push_back(hash);
-    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    // Drop the headers leading through hashBad, then take the best of the rest
+    void DropBranch(const uint256& hashBad)
     {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        if (setInvalid.size() >= MAX_INVALID_HEADERS)
+            setInvalid.clear();
+        setInvalid.insert(hashBad);
+
+        std::map<uint256, bool> mapValid;
+        std::map<uint256, CHeader> mapKeep;
+        for (std::map<uint256, CHeader>::const_iterator it = mapHeaders.begin(); it != mapHeaders.end(); ++it)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
-            delete pblockOrphan;
+            std::vector<uint256> vPath;
+            uint256 hashWalk = it->first;
+            bool fValid;
+            for ( ; ; )
+            {
+                std::map<uint256, bool>::const_iterator vi = mapValid.find(hashWalk);
+                if (vi != mapValid.end())
+                {
+                    fValid = vi->second;
+                    break;
+                }
+                if (setInvalid.count(hashWalk))
+                {
+                    fValid = false;
+                    break;
+                }
+                std::map<uint256, CHeader>::const_iterator hi = mapHeaders.find(hashWalk);
+                if (hi == mapHeaders.end())
+                {
+                    fValid = mapBlockIndex.count(hashWalk) > 0;
+                    break;
+                }
+                vPath.push_back(hashWalk);
+                hashWalk = hi->second.hashPrev;
+            }
+            BOOST_FOREACH(const uint256& hash, vPath)
+                mapValid[hash] = fValid;
+            if (fValid)
+                mapKeep.insert(*it);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
-    }
+        mapHeaders.swap(mapKeep);
 
-    printf("ProcessBlock: ACCEPTED\n");
+        for (std::map<uint256, CBlockRequest>::iterator mi = mapRequested.begin(); mi != mapRequested.end(); )
+        {
+            if (!mapHeaders.count(mi->first))
+            {
+                mi->second.pnode->nBlocksInFlight--;
+                mapRequested.erase(mi++);
+            }
+            else
+                ++mi;
+        }
+        for (std::map<uint256, int>::iterator mi = mapFailures.begin(); mi != mapFailures.end(); )
+        {
+            if (!mapHeaders.count(mi->first))
+                mapFailures.erase(mi++);
+            else
+                ++mi;
+        }
 
-    // ppcoin: if responsible for sync-checkpoint send it
-    if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
-        Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
+        vBest.clear();
+        nBestBase = 0;
+        std::map<uint256, CHeader>::const_iterator itBest = mapHeaders.end();
+        for (std::map<uint256, CHeader>::const_iterator it = mapHeaders.begin(); it != mapHeaders.end(); ++it)
+            if (itBest == mapHeaders.end() || it->second.nChainTrust > itBest->second.nChainTrust)
+                itBest = it;
+        if (itBest != mapHeaders.end())
+            SetBest(itBest->first, itBest->second);
+    }
 
-    return true;
-}
+    // Forget the headers of the blocks that came in, and the side branches
+    //   once they take too much room
+    void Prune()
+    {
+        while (!vBest.empty() && mapBlockIndex.count(vBest.front()))
+        {
+            mapFailures.erase(vBest.front());
+            mapHeaders.erase(vBest.front());
+            vBest.pop_front();
+            nBestBase++;
+        }
+        if (mapHeaders.size() > vBest.size() + MAX_HEADERS_AHEAD)
+        {
+            std::map<uint256, CHeader> mapKeep;
+            BOOST_FOREACH(const uint256& hash, vBest)
+                mapKeep.insert(*mapHeaders.find(hash));
+            mapHeaders.swap(mapKeep);
+        }
+    }
 
-// ppcoin: check block signature
-bool CBlock::CheckBlockSignature() const
-{
-    if (vchBlockSig.empty())
-        return false;
+public:
+    CHeaderChain() : nBestBase(0), fGetBlocksFallback(false) {}
 
-    txnouttype whichType;
-    vector<valtype> vSolutions;
-    if (!Solver(vtx[1].vout[1].scriptPubKey, whichType, vSolutions))
-        return false;
+    void GetMemoryUsage(CMemoryUsage& usage) const
+    {
+        usage.nEntries = mapHeaders.size();
+        usage.nUsage = mapHeaders.size() * (sizeof(std::pair<const uint256, CHeader>) + MEMORY_TREE_NODE) +
+                       vBest.size() * sizeof(uint256) +
+                       mapRequested.size() * (sizeof(std::pair<const uint256, CBlockRequest>) + MEMORY_TREE_NODE) +
+                       mapFailures.size() * (sizeof(std::pair<const uint256, int>) + MEMORY_TREE_NODE) +
+                       setInvalid.size() * (sizeof(uint256) + MEMORY_TREE_NODE);
+    }
 
-    if (whichType == TX_PUBKEY)
+    int GetBestHeight() const
     {
-        valtype& vchPubKey = vSolutions[0];
-        CPubKey key(vchPubKey);
-        if (!key.IsValid())
-            return false;
-        return key.Verify(GetHash(), vchBlockSig);
+        return vBest.empty() ? nBestHeight : std::max(nBestHeight, nBestBase + (int)vBest.size() - 1);
     }
 
-    return false;
-}
+    bool Contains(const uint256& hash) const
+    {
+        return mapHeaders.count(hash) > 0;
+    }
 
-bool CheckDiskSpace(uint64_t nAdditionalBytes)
-{
-    uint64_t nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+    uint256 GetBestTrust() const
+    {
+        if (vBest.empty())
+            return nBestChainTrust;
+        std::map<uint256, CHeader>::const_iterator mi = mapHeaders.find(vBest.back());
+        return std::max(nBestChainTrust, mi->second.nChainTrust);
+    }
 
-    // Check for nMinDiskSpace bytes (currently 50MB)
-    if (nFreeBytesAvailable < nMinDiskSpace + nAdditionalBytes)
+    // A block of the header chain was invalid, or went unanswered
+    void BlockFailed(const uint256& hash)
     {
-        fShutdown = true;
-        string strMessage("Warning: Disk space is low!");
+        std::map<uint256, CHeader>::const_iterator mi = mapHeaders.find(hash);
+        if (mi == mapHeaders.end() || ++mapFailures[hash] < MAX_BLOCK_FAILURES)
+            return;
+
+        printf("CHeaderChain : block %d %s failed %d times, dropping its headers from %s\n", mi->second.nHeight,
+               hash.ToString().substr(0,20).c_str(), MAX_BLOCK_FAILURES, mi->second.addrFrom.ToString().c_str());
+        addrDropped = mi->second.addrFrom;
+        MisbehavingPeer(addrDropped, 50);
+        DropBranch(hash);
+        fGetBlocksFallback = true;
+    }
+
+    // Headers are checked as far as they can be without the transactions.
+    //   A header meeting its own target is taken for proof-of-work, any other
+    //   for proof-of-stake, which is only checked once the block itself comes in.
+    bool AcceptHeaders(CNode* pfrom, const std::vector<CBlock>& vHeaders, int& nDoS, int& nLastHeight)
+    {
+        nDoS = 0;
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+        {
+            const CBlock& header = vHeaders[i];
+            uint256 hash = header.GetHash();
+            if (i > 0 && header.hashPrevBlock != vHeaders[i-1].GetHash())
+            {
+                nDoS = 20;
+                return error("AcceptHeaders() : header %s not in sequence", hash.ToString().substr(0,20).c_str());
+            }
+
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi != mapBlockIndex.end())
+            {
+                nLastHeight = mi->second->nHeight;
+                continue;
+            }
+            std::map<uint256, CHeader>::iterator it = mapHeaders.find(hash);
+            if (it != mapHeaders.end())
+            {
+                nLastHeight = it->second.nHeight;
+                continue;
+            }
+
+            if (setInvalid.count(hash) || setInvalid.count(header.hashPrevBlock))
+            {
+                nDoS = 20;
+                return error("AcceptHeaders() : header %s of a dropped branch", hash.ToString().substr(0,20).c_str());
+            }
+
+            uint256 bnTarget;
+            bool fNegative, fOverflow;
+            bnTarget.SetCompact(header.nBits, &fNegative, &fOverflow);
+            if (fNegative || fOverflow || bnTarget == 0 || bnTarget > std::max(bnProofOfWorkLimit, bnProofOfStakeLimit))
+            {
+                nDoS = 20;
+                return error("AcceptHeaders() : header %s nBits below minimum", hash.ToString().substr(0,20).c_str());
+            }
+            bool fProofOfWork = bnTarget <= bnProofOfWorkLimit && hash <= bnTarget;
+
+            CHeader entry;
+            entry.hashPrev = header.hashPrevBlock;
+            entry.nTime = header.nTime;
+            entry.addrFrom = pfrom->addr;
+            if ((mi = mapBlockIndex.find(header.hashPrevBlock)) != mapBlockIndex.end())
+            {
+                // On top of a block we have, the target is known exactly
+                const CBlockIndex* pindexPrev = mi->second;
+                if (fProofOfWork && header.nBits != GetNextTargetRequired(pindexPrev, false))
+                    fProofOfWork = false;
+                if (!fProofOfWork && header.nBits != GetNextTargetRequired(pindexPrev, true))
+                {
+                    nDoS = 20;
+                    return error("AcceptHeaders() : header %s incorrect difficulty", hash.ToString().substr(0,20).c_str());
+                }
+                entry.nHeight = pindexPrev->nHeight + 1;
+                entry.nChainTrust = pindexPrev->nChainTrust;
+            }
+            else if ((it = mapHeaders.find(header.hashPrevBlock)) != mapHeaders.end())
+            {
+                entry.nHeight = it->second.nHeight + 1;
+                entry.nChainTrust = it->second.nChainTrust;
+            }
+            else
+                return error("AcceptHeaders() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+            if (!fProofOfWork && bnTarget > bnProofOfStakeLimit)
+            {
+                nDoS = 20;
+                return error("AcceptHeaders() : header %s proof-of-stake target above the limit", hash.ToString().substr(0,20).c_str());
+            }
+            entry.nChainTrust += GetClaimedTrust(bnTarget, !fProofOfWork);
+
+            // Don't let a peer fill up memory far ahead of the chain
+            if (entry.nHeight > nBestHeight + 2 * MAX_HEADERS_AHEAD)
+                return true;
+
+            if (!Checkpoints::CheckHardened(entry.nHeight, hash))
+            {
+                nDoS = 100;
+                return error("AcceptHeaders() : rejected by hardened checkpoint at %d", entry.nHeight);
+            }
+            if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+                return error("AcceptHeaders() : header timestamp too far in the future");
+            if (header.GetBlockTime() <= GetMedianTimePast(header.hashPrevBlock))
+            {
+                nDoS = 20;
+                return error("AcceptHeaders() : header timestamp too early");
+            }
+
+            mapHeaders[hash] = entry;
+            nLastHeight = entry.nHeight;
+            if (entry.nChainTrust > GetBestTrust())
+                SetBest(hash, entry);
+        }
+        return true;
+    }
+
+    CBlockLocator GetLocator() const
+    {
+        std::vector<uint256> vHave;
+        int nStep = 1;
+        for (int i = (int)vBest.size() - 1; i >= 0; i -= nStep)
+        {
+            vHave.push_back(vBest[i]);
+            if (vHave.size() > 10)
+                nStep *= 2;
+        }
+        CBlockLocator locator(pindexBest);
+        locator.Prepend(vHave);
+        return locator;
+    }
+
+    bool IsRequested(const uint256& hash) const
+    {
+        return mapRequested.count(hash) > 0;
+    }
+
+    void BlockReceived(const uint256& hash)
+    {
+        std::map<uint256, CBlockRequest>::iterator mi = mapRequested.find(hash);
+        if (mi == mapRequested.end())
+            return;
+        mi->second.pnode->nBlocksInFlight--;
+        mapRequested.erase(mi);
+    }
+
+    // Give up on whatever was asked from a peer that is going away
+    void PeerGone(CNode* pnode)
+    {
+        for (std::map<uint256, CBlockRequest>::iterator mi = mapRequested.begin(); mi != mapRequested.end(); )
+        {
+            if (mi->second.pnode == pnode)
+                mapRequested.erase(mi++);
+            else
+                ++mi;
+        }
+        pnode->nBlocksInFlight = 0;
+    }
+
+    // Pick the next blocks to ask this peer for
+    void GetBlocksToDownload(CNode* pto, std::vector<CInv>& vGetData)
+    {
+        Prune();
+
+        // Requests that went unanswered are given to whoever asks next
+        int64_t nNow = GetTime();
+        std::vector<uint256> vTimedOut;
+        for (std::map<uint256, CBlockRequest>::iterator mi = mapRequested.begin(); mi != mapRequested.end(); )
+        {
+            CNode* pnode = mi->second.pnode;
+            if (pnode->fDisconnect || nNow - mi->second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+            {
+                if (!pnode->fDisconnect)
+                    vTimedOut.push_back(mi->first);
+                pnode->nBlocksInFlight--;
+                mapRequested.erase(mi++);
+            }
+            else
+                ++mi;
+        }
+        BOOST_FOREACH(const uint256& hash, vTimedOut)
+            BlockFailed(hash);
+
+        if (fGetBlocksFallback && (CService)pto->addr != addrDropped)
+        {
+            fGetBlocksFallback = false;
+            pto->PushGetBlocks(pindexBest, uint256(0));
+        }
+
+        int nPeerHeight = std::max(pto->nStartingHeight, pto->nBestKnownHeight);
+
+        // The lowest missing block holds up all the ones after it, so if the
+        //   peer it was asked from is slow about it, it goes to this one
+        for (unsigned int i = 0; i < vBest.size() && nBestBase + (int)i <= nPeerHeight; i++)
+        {
+            const uint256& hash = vBest[i];
+            if (mapOrphanBlocks.count(hash) || IsBlockPipelined(hash))
+                continue;
+            std::map<uint256, CBlockRequest>::iterator mi = mapRequested.find(hash);
+            if (mi != mapRequested.end() && mi->second.pnode != pto &&
+                nNow - mi->second.nTime > BLOCK_STALL_TIMEOUT && pto->nBlocksInFlight < MAX_BLOCKS_IN_FLIGHT)
+            {
+                printf("block %d %s stalled at %s, asking %s\n", nBestBase + i, hash.ToString().substr(0,20).c_str(),
+                       mi->second.pnode->addr.ToString().c_str(), pto->addr.ToString().c_str());
+                mi->second.pnode->nBlocksInFlight--;
+                mi->second.pnode->nBlocksStalled++;
+                mi->second.pnode = pto;
+                mi->second.nTime = nNow;
+                pto->nBlocksInFlight++;
+                vGetData.push_back(CInv(MSG_BLOCK, hash));
+            }
+            break;
+        }
+
+        // A peer that stalled the download gets fewer blocks at once
+        int nMaxInFlight = pto->nBlocksStalled > 0 ? MAX_BLOCKS_IN_FLIGHT / 4 : MAX_BLOCKS_IN_FLIGHT;
+        for (unsigned int i = 0; i < vBest.size() && pto->nBlocksInFlight < nMaxInFlight; i++)
+        {
+            int nHeight = nBestBase + i;
+            if (nHeight > nBestHeight + BLOCK_DOWNLOAD_WINDOW || nHeight > nPeerHeight)
+                break;
+            const uint256& hash = vBest[i];
+            if (mapRequested.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || IsBlockPipelined(hash))
+                continue;
+
+            CBlockRequest request;
+            request.pnode = pto;
+            request.nTime = nNow;
+            mapRequested[hash] = request;
+            pto->nBlocksInFlight++;
+            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            if (fDebugNet)
+                printf("requesting block %d %s from %s\n", nHeight, hash.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+        }
+    }
+};
+
+static CHeaderChain headerchain;
+
+void ReleaseBlockRequests(CNode* pnode)
+{
+    headerchain.PeerGone(pnode);
+}
+
+void GetChainMemoryUsage(MemoryUsageMap& mapUsage)
+{
+    {
+        LOCK(cs_main);
+
+        CMemoryUsage& blockindex = mapUsage["blockindex"];
+        blockindex.nEntries = mapBlockIndex.size();
+        blockindex.nUsage = mapBlockIndex.allocated_memory() + mapBlockIndex.size() * sizeof(CBlockIndex);
+
+        headerchain.GetMemoryUsage(mapUsage["headers"]);
+
+        // The blocks themselves are counted by their size, as they are limited
+        CMemoryUsage& orphanblocks = mapUsage["orphanblocks"];
+        orphanblocks.nEntries = mapOrphanBlocks.size();
+        orphanblocks.nUsage = nOrphanBlocksMemory + mapOrphanBlocks.size() *
+            (sizeof(CBlock) + sizeof(OrphanBlockMap::value_type) + MEMORY_HASH_NODE +
+             sizeof(std::pair<const uint256, CBlock*>) + MEMORY_HASH_NODE +
+             sizeof(std::pair<const uint256, COrphanBlockInfo>) + MEMORY_TREE_NODE);
+        orphanblocks.nLimit = nMaxOrphanBlocksMemory;
+
+        CMemoryUsage& orphantxs = mapUsage["orphantxs"];
+        orphantxs.nEntries = mapOrphanTransactions.size();
+        for (boost::unordered_map<uint256, COrphanTx, SaltedHasher>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            orphantxs.nUsage += sizeof(uint256) + sizeof(COrphanTx) - sizeof(CTransaction) + GetTransactionMemoryUsage(it->second.tx) + MEMORY_HASH_NODE;
+        for (boost::unordered_map<COutPoint, set<uint256>, SaltedOutPointHasher>::const_iterator it = mapOrphanTransactionsByPrev.begin(); it != mapOrphanTransactionsByPrev.end(); ++it)
+            orphantxs.nUsage += sizeof(COutPoint) + sizeof(set<uint256>) + MEMORY_HASH_NODE + it->second.size() * (sizeof(uint256) + MEMORY_TREE_NODE);
+        orphantxs.nLimit = MAX_ORPHAN_TX_BYTES;
+    }
+
+    {
+        CMemoryUsage& pool = mapUsage["mempool"];
+        LOCK(mempool.cs);
+        pool.nEntries = mempool.mapTx.size();
+        pool.nUsage = mempool.nTotalUsage;
+        pool.nLimit = nMaxMempoolSize;
+    }
+
+    blockcache.GetMemoryUsage(mapUsage["blockcache"]);
+    CTxDB::GetMemoryUsage(mapUsage);
+}
+
+bool static ProcessBlockInner(CNode* pfrom, CBlock* pblock, bool fCheckedBlock, unsigned int nFile, unsigned int nBlockPos);
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    if (ProcessBlockInner(pfrom, pblock, fCheckedBlock, nFile, nBlockPos))
+        return true;
+    if (pblock->nDoS > 0)
+        headerchain.BlockFailed(pblock->GetHash());
+    return false;
+}
+
+bool static ProcessBlockInner(CNode* pfrom, CBlock* pblock, bool fCheckedBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    PROFILE_SCOPE("ProcessBlock");
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    headerchain.BlockReceived(hash);
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", LookupBlockIndex(hash)->nHeight, hash.ToString().substr(0,20).c_str());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
+
+    // Check that block isn't listed as unconditionally banned.
+    if (!Checkpoints::CheckBanned(hash)) {
+        if (pfrom)
+            pfrom->Misbehaving(100);
+        return error("ProcessBlock() : block %s is rejected by hard-coded banlist", hash.GetHex().substr(0,20).c_str());
+    }
+
+    // Check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
+
+    // Strip the garbage and run the preliminary checks, unless it was done
+    //   already by the block pipeline
+    if (!fCheckedBlock && !PreCheckBlock(pblock))
+        return error("ProcessBlock() : CheckBlock FAILED");
+
+    // ppcoin: verify hash target and signature of coinstake tx
+    if (pblock->IsProofOfStake())
+    {
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        if (!CheckProofOfStake(pblock->vtx[1], pblock->nBits, hashProofOfStake, targetProofOfStake))
+        {
+            printf("WARNING: ProcessBlock(): check proof-of-stake failed for block %s\n", hash.ToString().c_str());
+            return false; // do not error here as we expect this during initial block download
+        }
+        if (!mapProofOfStake.count(hash)) // add to mapProofOfStake
+            mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
+    }
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        CBigNum bnNewBlock;
+        bnNewBlock.SetCompact(pblock->nBits);
+        CBigNum bnRequired;
+
+        if (pblock->IsProofOfStake())
+            bnRequired.SetCompact(ComputeMinStake(GetLastBlockIndex(pcheckpoint, true)->nBits, deltaTime, pblock->nTime));
+        else
+            bnRequired.SetCompact(ComputeMinWork(GetLastBlockIndex(pcheckpoint, false)->nBits, deltaTime));
+
+        if (bnNewBlock > bnRequired)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(100);
+            return error("ProcessBlock() : block with too little %s", pblock->IsProofOfStake()? "proof-of-stake" : "proof-of-work");
+        }
+    }
+
+    // ppcoin: ask for pending sync-checkpoint if any
+    if (!IsInitialBlockDownload())
+        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+
+    // If don't already have its previous block, shunt it off to holding area until we get it
+    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    {
+        printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
+        // ppcoin: check proof-of-stake
+        if (pblock->IsProofOfStake())
+        {
+            // Limited duplicity on stake: prevents block flood attack
+            // Duplicate stake allowed only when there is orphan child block
+            if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
+            else
+                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+        }
+        CBlock* pblock2 = new CBlock(*pblock);
+        mapOrphanBlocks.insert(make_pair(hash, pblock2));
+        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+
+        COrphanBlockInfo& info = mapOrphanBlockInfo[hash];
+        info.nSize = ::GetSerializeSize(*pblock2, SER_NETWORK, PROTOCOL_VERSION);
+        info.nTimeReceived = GetTime();
+        info.addrFrom = pfrom ? (CService)pfrom->addr : CService();
+        info.fSpilled = false;
+        info.fProofOfStake = pblock2->IsProofOfStake();
+        if (info.fProofOfStake)
+            info.proofOfStake = pblock2->GetProofOfStake();
+        nOrphanBlocksMemory += info.nSize;
+        mapOrphanBytesByPeer[info.addrFrom] += info.nSize;
+
+        // Ask this guy to fill in what we're missing, unless the
+        //   headers have it covered already
+        if (pfrom && !headerchain.Contains(hash))
+        {
+            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // ppcoin: getblocks may not obtain the ancestor block rejected
+            // earlier by duplicate-stake check so we ask for it again directly
+            if (!IsInitialBlockDownload())
+                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+        }
+        LimitOrphanBlocks();
+        return true;
+    }
+
+    // Store to disk
+    if (!pblock->AcceptBlock(nFile, nBlockPos))
+        return error("ProcessBlock() : AcceptBlock FAILED");
+
+    // Recursively process any orphan blocks that depended on this one
+    vector<uint256> vWorkQueue;
+    vWorkQueue.push_back(hash);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        uint256 hashPrev = vWorkQueue[i];
+        typedef boost::unordered_multimap<uint256, CBlock*, SaltedHasher>::iterator prev_iterator;
+        pair<prev_iterator, prev_iterator> range = mapOrphanBlocksByPrev.equal_range(hashPrev);
+        for (prev_iterator mi = range.first; mi != range.second; ++mi)
+        {
+            CBlock* pblockOrphan = (*mi).second;
+            uint256 hashOrphan = pblockOrphan->GetHash();
+            bool fSpilled = mapOrphanBlockInfo.count(hashOrphan) && mapOrphanBlockInfo[hashOrphan].fSpilled;
+            if ((!fSpilled || LoadOrphanBlock(hashOrphan, pblockOrphan)) && pblockOrphan->AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
+            ForgetOrphanBlockInfo(hashOrphan);
+            mapOrphanBlocks.erase(hashOrphan);
+            delete pblockOrphan;
+        }
+        mapOrphanBlocksByPrev.erase(hashPrev);
+    }
+
+    printf("ProcessBlock: ACCEPTED\n");
+    if (pfrom)
+    {
+        pfrom->nBlocksDelivered++;
+        pfrom->nLastBlockTime = GetTime();
+    }
+
+    // ppcoin: if responsible for sync-checkpoint send it
+    if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
+        Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
+
+    return true;
+}
+
+// Self-staked blocks are pushed in compact form to this many of the fastest peers
+//   before they are connected locally
+static const unsigned int STAKE_RELAY_PEERS = 8;
+
+static bool CompareNodeMinPing(const CNode* a, const CNode* b)
+{
+    return (a->nMinPingUsec ? a->nMinPingUsec : std::numeric_limits<int64_t>::max()) <
+           (b->nMinPingUsec ? b->nMinPingUsec : std::numeric_limits<int64_t>::max());
+}
+
+// Run the context-free checks of a block staked by this node and announce it at
+//   once, the peers reconstruct it from their memory pools while we connect it.
+//   Peers left out get the usual announcement from AcceptBlock. Needs cs_main.
+bool RelayStakedBlock(CBlock* pblock)
+{
+    if (!PreCheckBlock(pblock))
+        return error("RelayStakedBlock() : CheckBlock FAILED");
+
+    if (IsInitialBlockDownload() || pblock->hashPrevBlock != hashBestChain)
+        return true;
+
+    CInv inv(MSG_BLOCK, pblock->GetHash());
+    CSendBuffer pmsgCompact;
+    unsigned int nRelayed = 0;
+    {
+        LOCK(cs_vNodes);
+        vector<CNode*> vPeers;
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fSuccessfullyConnected && !pnode->fDisconnect && pnode->nVersion >= COMPACT_BLOCKS_VERSION &&
+                (pnode->nStartingHeight == -1 || nBestHeight > pnode->nStartingHeight - 2000))
+                vPeers.push_back(pnode);
+        sort(vPeers.begin(), vPeers.end(), CompareNodeMinPing);
+
+        BOOST_FOREACH(CNode* pnode, vPeers)
+        {
+            if (nRelayed >= STAKE_RELAY_PEERS)
+                break;
+            if (!pnode->AddInventoryKnown(inv))
+                continue;
+            if (!pmsgCompact)
+                pmsgCompact = MakeSendBuffer("cmpctblock", CCompactBlock(*pblock));
+            pnode->PushSendBuffer(pmsgCompact);
+            nRelayed++;
+        }
+    }
+
+    if (fDebugNet)
+        printf("RelayStakedBlock() : block %s pushed to %u peers\n", inv.hash.ToString().substr(0,20).c_str(), nRelayed);
+
+    return true;
+}
+
+// Block download pipeline: the message handler deserializes and checks the
+//   received blocks without holding cs_main, while the connector thread
+//   accepts and connects them in the order of arrival
+struct CPipelinedBlock
+{
+    uint256 hash;
+    CBlock* pblock;
+    CNode* pfrom;
+};
+
+static const unsigned int MAX_PIPELINE_BLOCKS = 64;
+static const unsigned int MAX_PIPELINE_BATCH = 16;
+
+static std::deque<CPipelinedBlock> queueBlockPipeline;
+static std::set<uint256> setBlockPipeline;
+static CWaitableCriticalSection cs_BlockPipeline;
+static boost::condition_variable condBlockPipeline;
+
+bool static IsBlockPipelined(const uint256& hash)
+{
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_BlockPipeline);
+    return setBlockPipeline.count(hash) > 0;
+}
+
+// The connector is behind, the handlers leave the blocks in the receive
+//   queues of their peers and come back to them on the next round
+bool static IsBlockPipelineFull()
+{
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_BlockPipeline);
+    return queueBlockPipeline.size() >= MAX_PIPELINE_BLOCKS;
+}
+
+// Handle a "block" message outside of cs_main
+bool static PipelineBlock(CNode* pfrom, CDataStream& vRecv)
+{
+    auto_ptr<CBlock> pblock(new CBlock());
+    vRecv >> *pblock;
+    pblock->CacheHash();
+    uint256 hashBlock = pblock->GetHash();
+
+    printf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
+
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    // Another peer has sent it already
+    if (IsBlockPipelined(hashBlock))
+        return true;
+
+    if (!PreCheckBlock(pblock.get()))
+    {
+        LOCK(cs_main);
+        if (pblock->nDoS)
+        {
+            pfrom->Misbehaving(pblock->nDoS);
+            headerchain.BlockFailed(hashBlock);
+        }
+        return error("PipelineBlock() : CheckBlock FAILED");
+    }
+
+    {
+        // Never waits here: the handlers check IsBlockPipelineFull before
+        //   taking a block, so the queue only runs over by a block per handler
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_BlockPipeline);
+        if (fShutdown || !setBlockPipeline.insert(hashBlock).second)
+            return true;
+
+        CPipelinedBlock entry;
+        entry.hash = hashBlock;
+        entry.pblock = pblock.release();
+        entry.pfrom = pfrom->AddRef();
+        queueBlockPipeline.push_back(entry);
+    }
+    condBlockPipeline.notify_all();
+
+    return true;
+}
+
+void ThreadBlockConnector(void* parg)
+{
+    vnThreadsRunning[THREAD_BLOCKCONNECT]++;
+    RenameThread("42-blockconn");
+
+    std::vector<CPipelinedBlock> vBatch;
+    while (!fShutdown || !vBatch.empty())
+    {
+        if (!vBatch.empty())
+        {
+            // Connect the whole batch in one go, so the blocks ahead of the
+            //   tip don't wait for cs_main one by one
+            LOCK(cs_main);
+            BOOST_FOREACH(CPipelinedBlock& entry, vBatch)
+            {
+                if (fShutdown)
+                    break;
+                try
+                {
+                    if (ProcessBlock(entry.pfrom, entry.pblock, true))
+                        mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, entry.hash));
+                    if (entry.pblock->nDoS) entry.pfrom->Misbehaving(entry.pblock->nDoS);
+                }
+                catch (std::exception& e) {
+                    PrintExceptionContinue(&e, "ThreadBlockConnector()");
+                }
+            }
+        }
+
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_BlockPipeline);
+        BOOST_FOREACH(CPipelinedBlock& entry, vBatch)
+        {
+            setBlockPipeline.erase(entry.hash);
+            entry.pfrom->Release();
+            delete entry.pblock;
+        }
+        vBatch.clear();
+
+        while (queueBlockPipeline.empty() && !fShutdown)
+            condBlockPipeline.timed_wait(lock, boost::posix_time::milliseconds(100));
+
+        // Blocks left at shutdown are just dropped, they will be downloaded again
+        while (!queueBlockPipeline.empty() && (vBatch.size() < MAX_PIPELINE_BATCH || fShutdown))
+        {
+            vBatch.push_back(queueBlockPipeline.front());
+            queueBlockPipeline.pop_front();
+        }
+        lock.unlock();
+        condBlockPipeline.notify_all();
+    }
+
+    vnThreadsRunning[THREAD_BLOCKCONNECT]--;
+}
+
+void ThreadBlockConnectorQuit()
+{
+    condBlockPipeline.notify_all();
+}
+
+
+//
+// Transaction submission
+//
+
+struct CTxSubmission
+{
+    CTransaction tx;
+    uint256 hash;
+    TxSubmitCallback callback;
+    CNode* pfrom; // not held, the callback keeps the reference
+};
+
+static const unsigned int MAX_TXSUBMIT_BATCH = 1000;
+// Peers wait with their transactions once they have this many queued, and all
+// of them do once the queue holds MAX_TXSUBMIT_QUEUE
+static const unsigned int MAX_TXSUBMIT_PEER = 100;
+static const unsigned int MAX_TXSUBMIT_QUEUE = 5000;
+
+static std::deque<CTxSubmission> queueTxSubmit;
+static std::map<CNode*, unsigned int> mapTxSubmitPeer;
+static bool fTxSubmitStopped = false;
+static CWaitableCriticalSection cs_TxSubmit;
+static boost::condition_variable condTxSubmit;
+
+bool IsTxSubmitQueueFull(CNode* pfrom)
+{
+    boost::unique_lock<CWaitableCriticalSection> lock(cs_TxSubmit);
+    if (queueTxSubmit.size() >= MAX_TXSUBMIT_QUEUE)
+        return true;
+    std::map<CNode*, unsigned int>::iterator mi = mapTxSubmitPeer.find(pfrom);
+    return mi != mapTxSubmitPeer.end() && mi->second >= MAX_TXSUBMIT_PEER;
+}
+
+void SubmitTransaction(const CTransaction& tx, const TxSubmitCallback& callback, CNode* pfrom)
+{
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs_TxSubmit);
+        if (!fTxSubmitStopped)
+        {
+            queueTxSubmit.push_back(CTxSubmission());
+            CTxSubmission& submission = queueTxSubmit.back();
+            submission.tx = tx;
+            submission.hash = tx.GetHash();
+            submission.callback = callback;
+            submission.pfrom = pfrom;
+            if (pfrom)
+                mapTxSubmitPeer[pfrom]++;
+            lock.unlock();
+            condTxSubmit.notify_all();
+            return;
+        }
+    }
+
+    // Shutting down, nothing gets in anymore
+    LOCK(cs_main);
+    callback(tx, CTxSubmitResult());
+}
+
+// Result of a submission somebody is waiting for
+class CTxSubmitFuture
+{
+private:
+    CWaitableCriticalSection cs;
+    boost::condition_variable cond;
+    bool fDone;
+    CTxSubmitResult result;
+
+public:
+    CTxSubmitFuture() : fDone(false) {}
+
+    void Set(const CTxSubmitResult& resultIn)
+    {
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs);
+            result = resultIn;
+            fDone = true;
+        }
+        cond.notify_all();
+    }
+
+    CTxSubmitResult Get()
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(cs);
+        while (!fDone)
+            cond.wait(lock);
+        return result;
+    }
+};
+
+static void SetTxSubmitFuture(boost::shared_ptr<CTxSubmitFuture> pfuture, const CTransaction& tx, const CTxSubmitResult& result)
+{
+    pfuture->Set(result);
+}
+
+CTxSubmitResult SubmitTransactionAndWait(const CTransaction& tx)
+{
+    boost::shared_ptr<CTxSubmitFuture> pfuture(new CTxSubmitFuture());
+    SubmitTransaction(tx, boost::bind(&SetTxSubmitFuture, pfuture, _1, _2));
+    return pfuture->Get();
+}
+
+// Accept a batch under one hold of cs_main. Transactions queued before the
+// parents they spend get another go when one of those goes in, and the
+// signatures of the whole batch are checked at once on the script checking threads.
+static void ProcessTxSubmissions(std::vector<CTxSubmission>& vBatch)
+{
+    LOCK(cs_main);
+    CTxDB txdb("r");
+
+    // The checks point into vBatch, which stays as it is until they are done
+    vector<CTxSubmitResult> vResult(vBatch.size());
+    vector<vector<CScriptCheck> > vTxChecks(vBatch.size());
+    vector<CScriptCheck> vChecks;
+    vector<bool> vWaiting(vBatch.size(), false);
+    multimap<uint256, unsigned int> mapWaiting;
+    deque<unsigned int> queueTry;
+    for (unsigned int i = 0; i < vBatch.size(); i++)
+        queueTry.push_back(i);
+    while (!queueTry.empty())
+    {
+        unsigned int i = queueTry.front();
+        queueTry.pop_front();
+        if (vResult[i].fAccepted)
+            continue;
+        bool fMissingInputs = false;
+        if (mempool.accept(txdb, vBatch[i].tx, true, &fMissingInputs, &vTxChecks[i]))
+        {
+            vResult[i].fAccepted = true;
+            vResult[i].fMissingInputs = false;
+            vChecks.insert(vChecks.end(), vTxChecks[i].begin(), vTxChecks[i].end());
+
+            // Retry those in the batch waiting for this one
+            pair<multimap<uint256, unsigned int>::iterator, multimap<uint256, unsigned int>::iterator> range = mapWaiting.equal_range(vBatch[i].hash);
+            for (multimap<uint256, unsigned int>::iterator mi = range.first; mi != range.second; ++mi)
+                queueTry.push_back(mi->second);
+            mapWaiting.erase(range.first, range.second);
+        }
+        else
+        {
+            vTxChecks[i].clear();
+            vResult[i].fMissingInputs = fMissingInputs;
+            if (fMissingInputs && !vWaiting[i])
+            {
+                vWaiting[i] = true;
+                set<uint256> setPrev;
+                BOOST_FOREACH(const CTxIn& txin, vBatch[i].tx.vin)
+                    if (setPrev.insert(txin.prevout.hash).second)
+                        mapWaiting.insert(make_pair(txin.prevout.hash, i));
+            }
+        }
+    }
+
+    if (!VerifyScriptChecks(vChecks))
+    {
+        // Take the culprits out with what spends from them, then try them
+        // once more on their own for the exact error and DoS score
+        for (unsigned int i = 0; i < vBatch.size(); i++)
+        {
+            BOOST_FOREACH(const CScriptCheck& check, vTxChecks[i])
+            {
+                if (!check())
+                {
+                    mempool.removeWithDescendants(vBatch[i].hash);
+                    mempool.accept(txdb, vBatch[i].tx, true, NULL);
+                    break;
+                }
+            }
+        }
+        LOCK(mempool.cs);
+        for (unsigned int i = 0; i < vBatch.size(); i++)
+            if (vResult[i].fAccepted)
+                vResult[i].fAccepted = mempool.exists(vBatch[i].hash);
+    }
+
+    for (unsigned int i = 0; i < vBatch.size(); i++)
+    {
+        CTxSubmission& submission = vBatch[i];
+        if (vResult[i].fAccepted)
+        {
+            SyncWithWallets(submission.tx, NULL, true);
+            RelayTransaction(submission.tx, submission.hash);
+        }
+        vResult[i].nDoS = submission.tx.nDoS;
+        try
+        {
+            submission.callback(submission.tx, vResult[i]);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ProcessTxSubmissions()");
+        }
+    }
+}
+
+void ThreadTxSubmit(void* parg)
+{
+    vnThreadsRunning[THREAD_TXSUBMIT]++;
+    RenameThread("42-txsubmit");
+
+    std::vector<CTxSubmission> vBatch;
+    while (true)
+    {
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(cs_TxSubmit);
+            while (queueTxSubmit.empty() && !fShutdown)
+                condTxSubmit.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if (fShutdown)
+            {
+                // What is left fails, so nobody waits for it forever
+                fTxSubmitStopped = true;
+                vBatch.assign(queueTxSubmit.begin(), queueTxSubmit.end());
+                queueTxSubmit.clear();
+                mapTxSubmitPeer.clear();
+                break;
+            }
+            while (!queueTxSubmit.empty() && vBatch.size() < MAX_TXSUBMIT_BATCH)
+            {
+                vBatch.push_back(queueTxSubmit.front());
+                queueTxSubmit.pop_front();
+                CNode* pfrom = vBatch.back().pfrom;
+                if (pfrom && --mapTxSubmitPeer[pfrom] == 0)
+                    mapTxSubmitPeer.erase(pfrom);
+            }
+        }
+
+        try
+        {
+            ProcessTxSubmissions(vBatch);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxSubmit()");
+        }
+        vBatch.clear();
+    }
+
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(CTxSubmission& submission, vBatch)
+            submission.callback(submission.tx, CTxSubmitResult());
+    }
+
+    vnThreadsRunning[THREAD_TXSUBMIT]--;
+}
+
+void ThreadTxSubmitQuit()
+{
+    condTxSubmit.notify_all();
+}
+
+// ppcoin: check block signature
+bool CBlock::CheckBlockSignature() const
+{
+    if (vchBlockSig.empty())
+        return false;
+
+    txnouttype whichType;
+    vector<valtype> vSolutions;
+    if (!Solver(vtx[1].vout[1].scriptPubKey, whichType, vSolutions))
+        return false;
+
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+        CPubKey key(vchPubKey);
+        if (!key.IsValid())
+            return false;
+        return key.Verify(GetHash(), vchBlockSig);
+    }
+
+    return false;
+}
+
+bool CheckDiskSpace(uint64_t nAdditionalBytes)
+{
+    uint64_t nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+
+    // Check for nMinDiskSpace bytes (currently 50MB)
+    if (nFreeBytesAvailable < nMinDiskSpace + nAdditionalBytes)
+    {
+        fShutdown = true;
+        string strMessage("Warning: Disk space is low!");
         strMiscWarning = strMessage;
         printf("*** %s\n", strMessage.c_str());
         uiInterface.ThreadSafeMessageBox(strMessage, "42", CClientUIInterface::OK | CClientUIInterface::ICON_EXCLAMATION | CClientUIInterface::MODAL);
@@ -2564,16 +4983,137 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
     {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        {
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+// Memory mapped block files, the most recently used last
+struct CMappedBlockFile
+{
+    unsigned int nFile;
+    boost::shared_ptr<boost::interprocess::mapped_region> pregion;
+};
+static const size_t MAX_MAPPED_BLOCK_FILES = 8;
+static list<CMappedBlockFile> listMappedBlockFiles;
+static CCriticalSection cs_MappedBlockFiles;
+
+// Drop the mapping of a block file, the readers holding it keep it alive
+static void UnmapBlockFile(unsigned int nFile)
+{
+    LOCK(cs_MappedBlockFiles);
+    for (list<CMappedBlockFile>::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it)
+    {
+        if (it->nFile == nFile)
+        {
+            listMappedBlockFiles.erase(it);
+            return;
+        }
+    }
+}
+
+bool MapBlockFile(unsigned int nFile, size_t nMinSize, boost::shared_ptr<void>& pHandle, const char*& pBegin, size_t& nSize)
+{
+    // Block files are too large to map many of them in a 32-bit address space
+    if (sizeof(void*) < 8)
+        return false;
+    if ((nFile < 1) || (nFile == std::numeric_limits<uint32_t>::max()))
+        return false;
+
+    LOCK(cs_MappedBlockFiles);
+    for (list<CMappedBlockFile>::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it)
+    {
+        if (it->nFile != nFile)
+            continue;
+        if (it->pregion->get_size() >= nMinSize)
+        {
+            listMappedBlockFiles.splice(listMappedBlockFiles.end(), listMappedBlockFiles, it);
+            pHandle = it->pregion;
+            pBegin = (const char*)it->pregion->get_address();
+            nSize = it->pregion->get_size();
+            return true;
+        }
+        // Map it again, the file has grown since
+        listMappedBlockFiles.erase(it);
+        break;
+    }
+
+    filesystem::path pathFile = BlockFilePath(nFile);
+    boost::system::error_code ec;
+    uintmax_t nFileSize = filesystem::file_size(pathFile, ec);
+    if (ec || nFileSize < nMinSize)
+        return false;
+
+    CMappedBlockFile mapped;
+    mapped.nFile = nFile;
+    try {
+        boost::interprocess::file_mapping mapping(pathFile.string().c_str(), boost::interprocess::read_only);
+        mapped.pregion.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only, 0, (size_t)nFileSize));
+    }
+    catch (const std::exception& e) {
+        printf("MapBlockFile() : mapping %s failed: %s\n", pathFile.string().c_str(), e.what());
+        return false;
+    }
+    listMappedBlockFiles.push_back(mapped);
+    if (listMappedBlockFiles.size() > MAX_MAPPED_BLOCK_FILES)
+        listMappedBlockFiles.pop_front();
+
+    pHandle = mapped.pregion;
+    pBegin = (const char*)mapped.pregion->get_address();
+    nSize = mapped.pregion->get_size();
+    return true;
+}
+
+// Each block in a file follows the message start and its size
+static bool ReadRawBlockHeader(const unsigned char* pch, unsigned int& nSizeRet)
+{
+    if (memcmp(pch, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return false;
+    nSizeRet = pch[4] | (pch[5] << 8) | (pch[6] << 16) | ((unsigned int)pch[7] << 24);
+    return nSizeRet <= MAX_SIZE;
+}
+
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, std::string& strRet)
+{
+    if (nBlockPos < 8)
+        return false;
+    unsigned int nBlockSize;
+
+    boost::shared_ptr<void> pHandle;
+    const char* pBegin;
+    size_t nSize;
+    if (MapBlockFile(nFile, nBlockPos, pHandle, pBegin, nSize))
+    {
+        if (!ReadRawBlockHeader((const unsigned char*)pBegin + nBlockPos - 8, nBlockSize))
+            return error("ReadRawBlockFromDisk() : no block at %u:%u", nFile, nBlockPos);
+        if ((size_t)nBlockPos + nBlockSize <= nSize ||
+            MapBlockFile(nFile, (size_t)nBlockPos + nBlockSize, pHandle, pBegin, nSize))
         {
-            fclose(file);
-            return NULL;
+            strRet.assign(pBegin + nBlockPos, nBlockSize);
+            return true;
         }
     }
-    return file;
-}
 
-static unsigned int nCurrentBlockFile = 1;
+    FILE* file = OpenBlockFile(nFile, nBlockPos - 8, "rb");
+    if (!file)
+        return false;
+    unsigned char pchHeader[8];
+    bool fOk = (fread(pchHeader, 1, sizeof(pchHeader), file) == sizeof(pchHeader) &&
+                ReadRawBlockHeader(pchHeader, nBlockSize));
+    if (fOk)
+    {
+        strRet.resize(nBlockSize);
+        fOk = (nBlockSize == 0 || fread(&strRet[0], 1, nBlockSize, file) == nBlockSize);
+    }
+    fclose(file);
+    if (!fOk)
+        return error("ReadRawBlockFromDisk() : no block at %u:%u", nFile, nBlockPos);
+    return true;
+}
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
 {
@@ -2588,8 +5128,10 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
             fclose(file);
             return NULL;
         }
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB,
+        //   pruning nodes keep smaller files to delete them sooner
+        long nMaxFileSize = nPruneTarget ? (long)PRUNE_BLOCKFILE_SIZE : (long)(0x7F000000 - MAX_SIZE);
+        if (ftell(file) < nMaxFileSize)
         {
             nFileRet = nCurrentBlockFile;
             return file;
@@ -2599,16 +5141,152 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+// Whether every transaction of the best chain stored in the block file is
+//   fully spent, and its blocks are at most nMaxHeight high. The outputs
+//   still unspent are read from the block files by FetchInputs and by the
+//   kernel checks, so their blocks have to stay.
+static bool IsBlockFilePrunable(CTxDB& txdb, unsigned int nFile, int nMaxHeight)
+{
+    vector<CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_BlockIndexByPos);
+        if (nFile >= vBlockIndexByPos.size())
+            return true;
+        const vector<pair<unsigned int, CBlockIndex*> >& vPos = vBlockIndexByPos[nFile].vPos;
+        for (unsigned int i = 0; i < vPos.size(); i++)
+            vBlocks.push_back(vPos[i].second);
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+        if (pindex->nHeight > nMaxHeight)
+            return false;
+
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        if (!pindex->IsInMainChain())
+            continue;
+        CBlock block;
+        if (!block.ReadFromDisk(pindex->nFile, pindex->nBlockPos))
+            return false;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(tx.GetHash(), txindex))
+                continue;
+            if (txindex.pos.nFile != pindex->nFile || txindex.pos.nBlockPos != pindex->nBlockPos)
+                continue;
+            BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+                if (pos.IsNull())
+                    return false;
+        }
+    }
+    return true;
+}
+
+// Block files removed by PruneBlockFiles, in this run or an earlier one
+static std::set<unsigned int> setPrunedFiles;
+static CCriticalSection cs_PrunedFiles;
+
+bool IsBlockPruned(const CBlockIndex* pindex)
+{
+    LOCK(cs_PrunedFiles);
+    return setPrunedFiles.count(pindex->nFile) > 0;
+}
+
+void PruneBlockFiles()
+{
+    if (!nPruneTarget)
+        return;
+
+    // Files found to hold unspent outputs are checked again a day later
+    static map<unsigned int, int64_t> mapPruneChecked;
+
+    LOCK(cs_main);
+    uint64_t nTotalSize = 0;
+    vector<pair<unsigned int, uint64_t> > vFiles;
+    for (unsigned int nFile = 1; nFile <= nCurrentBlockFile; nFile++)
+    {
+        boost::system::error_code ec;
+        uintmax_t nSize = filesystem::file_size(BlockFilePath(nFile), ec);
+        if (ec)
+        {
+            if (nFile < nCurrentBlockFile)
+            {
+                LOCK(cs_PrunedFiles);
+                setPrunedFiles.insert(nFile);
+            }
+            continue;
+        }
+        nTotalSize += nSize;
+        if (nFile < nCurrentBlockFile)
+            vFiles.push_back(make_pair(nFile, (uint64_t)nSize));
+    }
+    if (nTotalSize <= (uint64_t)nPruneTarget)
+        return;
+
+    int nMaxHeight = nBestHeight - MIN_BLOCKS_TO_KEEP;
+    int64_t nNow = GetTime();
+    CTxDB txdb("r");
+    for (unsigned int i = 0; i < vFiles.size() && nTotalSize > (uint64_t)nPruneTarget; i++)
+    {
+        unsigned int nFile = vFiles[i].first;
+        map<unsigned int, int64_t>::iterator mi = mapPruneChecked.find(nFile);
+        if (mi != mapPruneChecked.end() && mi->second > nNow - nOneDay)
+            continue;
+        if (!IsBlockFilePrunable(txdb, nFile, nMaxHeight))
+        {
+            mapPruneChecked[nFile] = nNow;
+            continue;
+        }
+
+        UnmapBlockFile(nFile);
+        boost::system::error_code ec;
+        filesystem::remove(BlockFilePath(nFile), ec);
+        if (ec)
+        {
+            printf("PruneBlockFiles() : removing blk%04u.dat failed: %s\n", nFile, ec.message().c_str());
+            continue;
+        }
+        {
+            LOCK(cs_PrunedFiles);
+            setPrunedFiles.insert(nFile);
+        }
+        nTotalSize -= vFiles[i].second;
+        mapPruneChecked.erase(nFile);
+        printf("PruneBlockFiles() : removed blk%04u.dat (%" PRIu64 " bytes)\n", nFile, vFiles[i].second);
+    }
+}
+
+CBlockIndex* AllocBlockIndex()
+{
+    LOCK(cs_BlockIndexSlabs);
+    if (nBlockIndexSlabUsed == BLOCKINDEX_SLAB_SIZE)
+    {
+        vBlockIndexSlabs.push_back(new CBlockIndex[BLOCKINDEX_SLAB_SIZE]);
+        nBlockIndexSlabUsed = 0;
+    }
+    return &vBlockIndexSlabs.back()[nBlockIndexSlabUsed++];
+}
+
 void UnloadBlockIndex()
 {
-    mapBlockIndex.clear();
+    {
+        WRITE_LOCK(cs_blockIndex);
+        mapBlockIndex.clear();
+        nBestHeight = 0;
+        nBestChainTrust = 0;
+        hashBestChain = 0;
+        pindexBest = NULL;
+        SetBestChainByHeight(NULL);
+    }
     setStakeSeen.clear();
     pindexGenesisBlock = NULL;
-    nBestHeight = 0;
-    nBestChainTrust = 0;
     nBestInvalidTrust = 0;
-    hashBestChain = 0;
-    pindexBest = NULL;
+    PublishChainTip(NULL);
+    {
+        LOCK(cs_BlockIndexByPos);
+        vBlockIndexByPos.clear();
+    }
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -2633,6 +5311,7 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
+    PublishChainTip(pindexBest);
 
     //
     // Init with genesis block
@@ -2664,11 +5343,16 @@ bool LoadBlockIndex(bool fAllowNew)
         assert(block.GetHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
         assert(block.CheckBlock());
 
-        // Start new block file
-        unsigned int nFile;
-        unsigned int nBlockPos;
-        if (!block.WriteToDisk(nFile, nBlockPos))
-            return error("LoadBlockIndex() : writing genesis block to disk failed");
+        // Start new block file, or reuse the genesis block of the block
+        //   files being reindexed
+        unsigned int nFile = 1;
+        unsigned int nBlockPos = 2 * sizeof(unsigned int);
+        CBlock blockOnDisk;
+        if (!fReindex || !blockOnDisk.ReadFromDisk(nFile, nBlockPos) || blockOnDisk.GetHash() != block.GetHash())
+        {
+            if (!block.WriteToDisk(nFile, nBlockPos))
+                return error("LoadBlockIndex() : writing genesis block to disk failed");
+        }
         if (!block.AddToBlockIndex(nFile, nBlockPos))
             return error("LoadBlockIndex() : genesis block not accepted");
 
@@ -2725,11 +5409,85 @@ bool LoadBlockIndex(bool fAllowNew)
 
 
 
+bool InitOptionalIndexes()
+{
+    const string strNames[2] = { "addr", "spent" };
+    const bool fEnabled[2] = { fAddrIndex, fSpentIndex };
+    bool fBuild[2] = { false, false };
+
+    CTxDB txdb;
+    for (int i = 0; i < 2; i++)
+    {
+        bool fPresent;
+        txdb.ReadIndexFlag(strNames[i], fPresent);
+        if (fPresent == fEnabled[i])
+            continue;
+
+        // An index switched off misses the blocks connected meanwhile, so it
+        // is dropped here and built again from scratch once switched on
+        if (!txdb.WriteIndexFlag(strNames[i], false) || !txdb.EraseIndex(strNames[i]))
+            return error("InitOptionalIndexes() : failed to reset the %sindex", strNames[i].c_str());
+        fBuild[i] = fEnabled[i];
+    }
+    if (!fBuild[0] && !fBuild[1])
+        return true;
+
+    printf("InitOptionalIndexes() : building%s%s from the best chain\n",
+        fBuild[0] ? " -addrindex" : "", fBuild[1] ? " -spentindex" : "");
+    uiInterface.InitMessage(_("Building transaction indexes..."));
+
+    int64_t nStart = GetTimeMillis();
+    int nBlocks = 0;
+    for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+    {
+        // The flags are only written once done, an interrupted build starts
+        // over on the next run
+        if (fRequestShutdown)
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex->nFile, pindex->nBlockPos))
+            return error("InitOptionalIndexes() : block %s not found", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+
+        vector<CAddrIndexKey> vAddrIndex;
+        vector<pair<COutPoint, CSpentIndexValue> > vSpentIndex;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            vector<CTxOut> vPrevOut;
+            if (!ReadPrevOuts(txdb, tx, vPrevOut))
+                return false;
+            GetOptionalIndexEntries(tx, vPrevOut, pindex->nHeight, vAddrIndex, vSpentIndex);
+        }
+
+        if (nBlocks % 1000 == 0)
+            txdb.TxnBegin();
+        if (fBuild[0])
+        {
+            BOOST_FOREACH(const CAddrIndexKey& key, vAddrIndex)
+                txdb.WriteAddrIndex(key, pindex->nHeight);
+        }
+        if (fBuild[1])
+            for (unsigned int i = 0; i < vSpentIndex.size(); i++)
+                txdb.WriteSpentIndex(vSpentIndex[i].first, vSpentIndex[i].second);
+        if (++nBlocks % 1000 == 0 && !txdb.TxnCommit())
+            return error("InitOptionalIndexes() : TxnCommit failed");
+    }
+    if (nBlocks % 1000 != 0 && !txdb.TxnCommit())
+        return error("InitOptionalIndexes() : TxnCommit failed");
+
+    for (int i = 0; i < 2; i++)
+        if (fBuild[i] && !txdb.WriteIndexFlag(strNames[i], true))
+            return error("InitOptionalIndexes() : WriteIndexFlag failed");
+
+    printf("InitOptionalIndexes() : indexed %d blocks in %" PRId64 "ms\n", nBlocks, GetTimeMillis() - nStart);
+    return true;
+}
+
 void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2799,64 +5557,219 @@ void PrintBlockTree()
     }
 }
 
+// Hashes a run of headers together, the vectorized scrypt cores take
+//   several of them per pass
+static void CacheBlockHashes(const std::vector<const CBlock*>& vpblock)
+{
+    if (vpblock.empty())
+        return;
+    std::vector<const uint8_t*> vpHeader(vpblock.size());
+    std::vector<uint256> vHash(vpblock.size());
+    for (unsigned int i = 0; i < vpblock.size(); i++)
+        vpHeader[i] = (const uint8_t*)&vpblock[i]->nVersion;
+    scrypt_blockhash_n(&vpHeader[0], &vHash[0], vpblock.size());
+    for (unsigned int i = 0; i < vpblock.size(); i++)
+        vpblock[i]->SetHash(vHash[i]);
+}
+
+// Block file loading: the blocks are cut out of the file serially, parsed
+//   and checked in parallel, then processed in file order under cs_main
+struct CLoadedBlock
+{
+    unsigned int nBlockPos;
+    std::vector<char> vData;
+    CBlock block;
+    bool fChecked;
+};
+
+static const unsigned int LOAD_BATCH_BLOCKS = 1024;
+static const size_t LOAD_BUFFER_SIZE = 8 << 20;
+
+// Parses every nStep-th block of the batch, starting with nStart
+static void ParseLoadedBlocks(std::vector<CLoadedBlock>* pvBlocks, unsigned int nStart, unsigned int nStep)
+{
+    std::vector<CLoadedBlock*> vpParsed;
+    std::vector<const CBlock*> vpblock;
+    for (unsigned int i = nStart; i < pvBlocks->size(); i += nStep)
+    {
+        CLoadedBlock& entry = (*pvBlocks)[i];
+        entry.fChecked = false;
+        try {
+            const char* pbegin = entry.vData.empty() ? NULL : &entry.vData[0];
+            CMemoryReader ss(pbegin, pbegin + entry.vData.size(), SER_DISK, CLIENT_VERSION);
+            ss >> entry.block;
+            vpParsed.push_back(&entry);
+            vpblock.push_back(&entry.block);
+        }
+        catch (const std::exception&) {
+            printf("ParseLoadedBlocks() : deserialize error at position %u\n", entry.nBlockPos);
+        }
+        std::vector<char>().swap(entry.vData);
+    }
+
+    // Hash the whole share before checking it
+    CacheBlockHashes(vpblock);
+    BOOST_FOREACH(CLoadedBlock* pentry, vpParsed)
+        pentry->fChecked = PreCheckBlock(&pentry->block);
+}
+
+// Checks and processes a batch of blocks, nFile is the number of the local
+//   block file holding them or max() for an external file
+static int ProcessLoadedBlocks(std::vector<CLoadedBlock>& vBlocks, unsigned int nFile)
+{
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ParseLoadedBlocks, &vBlocks, i, nThreads));
+    ParseLoadedBlocks(&vBlocks, 0, nThreads);
+    threads.join_all();
+
+    int nLoaded = 0;
+    LOCK(cs_main);
+    BOOST_FOREACH(CLoadedBlock& entry, vBlocks)
+    {
+        if (fRequestShutdown)
+            break;
+        if (!entry.fChecked || mapBlockIndex.count(entry.block.GetHash()))
+            continue;
+        bool fLocal = (nFile != std::numeric_limits<unsigned int>::max());
+        if (ProcessBlock(NULL, &entry.block, true, nFile, fLocal ? entry.nBlockPos : 0))
+            nLoaded++;
+    }
+    vBlocks.clear();
+    return nLoaded;
+}
+
+// Drops the consumed part of the buffer and reads until it holds nNeed bytes
+//   past nScan, returns false at the end of the file
+static bool FillLoadBuffer(FILE* file, std::vector<char>& vBuf, size_t& nBufStart, size_t& nScan, size_t nNeed)
+{
+    if (vBuf.size() - nScan >= nNeed)
+        return true;
+    vBuf.erase(vBuf.begin(), vBuf.begin() + nScan);
+    nBufStart += nScan;
+    nScan = 0;
+    while (vBuf.size() < nNeed)
+    {
+        size_t nOld = vBuf.size();
+        vBuf.resize(nOld + std::max(LOAD_BUFFER_SIZE, nNeed - nOld));
+        size_t nRead = fread(&vBuf[nOld], 1, vBuf.size() - nOld, file);
+        vBuf.resize(nOld + nRead);
+        if (nRead == 0)
+            return false;
+        // The next chunk comes from the disk while this one is processed
+        FileReadAhead(file, ftell(file), LOAD_BUFFER_SIZE);
+    }
+    return true;
+}
+
+// Returns the first message start in [pbegin, pend) or pend, the candidates
+//   are found with memchr which checks many bytes at a time
+static const char* FindMessageStart(const char* pbegin, const char* pend)
+{
+    const size_t nLen = sizeof(pchMessageStart);
+    while ((size_t)(pend - pbegin) >= nLen)
+    {
+        const char* p = (const char*)memchr(pbegin, pchMessageStart[0], (pend - pbegin) - (nLen - 1));
+        if (p == NULL)
+            break;
+        if (memcmp(p, pchMessageStart, nLen) == 0)
+            return p;
+        pbegin = p + 1;
+    }
+    return pend;
+}
+
+static int LoadBlocksFromFile(FILE* file, unsigned int nFile)
+{
+    int nLoaded = 0;
+    std::vector<CLoadedBlock> vBlocks;
+    std::vector<char> vBuf;
+    size_t nBufStart = 0;
+    size_t nScan = 0;
+    while (!fRequestShutdown && FillLoadBuffer(file, vBuf, nBufStart, nScan, 2 * sizeof(unsigned int)))
+    {
+        // Find the next message start
+        const char* pend = &vBuf[0] + vBuf.size();
+        const char* p = FindMessageStart(&vBuf[0] + nScan, pend);
+        if (p == pend)
+        {
+            nScan = vBuf.size() - (sizeof(pchMessageStart) - 1);
+            if (!FillLoadBuffer(file, vBuf, nBufStart, nScan, sizeof(pchMessageStart)))
+                break;
+            continue;
+        }
+        nScan = (p - &vBuf[0]) + sizeof(pchMessageStart);
+
+        unsigned int nSize;
+        if (!FillLoadBuffer(file, vBuf, nBufStart, nScan, sizeof(nSize)))
+            break;
+        memcpy(&nSize, &vBuf[nScan], sizeof(nSize));
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            continue;
+        if (!FillLoadBuffer(file, vBuf, nBufStart, nScan, sizeof(nSize) + nSize))
+            break;
+
+        vBlocks.push_back(CLoadedBlock());
+        CLoadedBlock& entry = vBlocks.back();
+        entry.nBlockPos = nBufStart + nScan + sizeof(nSize);
+        entry.vData.assign(vBuf.begin() + nScan + sizeof(nSize), vBuf.begin() + nScan + sizeof(nSize) + nSize);
+        nScan += sizeof(nSize) + nSize;
+
+        if (vBlocks.size() >= LOAD_BATCH_BLOCKS)
+            nLoaded += ProcessLoadedBlocks(vBlocks, nFile);
+    }
+    if (!vBlocks.empty())
+        nLoaded += ProcessLoadedBlocks(vBlocks, nFile);
+    return nLoaded;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    try {
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        nLoaded = LoadBlocksFromFile(blkdat, std::numeric_limits<unsigned int>::max());
+    }
+    catch (const std::exception&) {
+        printf("%s() : Deserialize or I/O error caught during load\n",
+               BOOST_CURRENT_FUNCTION);
+    }
+    printf("Loaded %i blocks from external file in %" PRId64 "ms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
+bool ReindexBlockFiles()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // The optional indexes are maintained from the genesis block on
+    {
+        CTxDB txdb;
+        txdb.WriteIndexFlag("addr", fAddrIndex);
+        txdb.WriteIndexFlag("spent", fSpentIndex);
+    }
+
+    int nLoaded = 0;
+    for (unsigned int nFile = 1; !fRequestShutdown; nFile++)
     {
-        LOCK(cs_main);
+        FILE* file = OpenBlockFile(nFile, 0, "rb");
+        if (!file)
+            break;
+        printf("ReindexBlockFiles() : reindexing blk%04u.dat\n", nFile);
+        uiInterface.InitMessage(strprintf(_("Reindexing blk%04u.dat..."), nFile));
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != std::numeric_limits<uint32_t>::max() && blkdat.good() && !fRequestShutdown)
-            {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    size_t nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = std::numeric_limits<uint32_t>::max();
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == std::numeric_limits<uint32_t>::max())
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
-                }
-            }
+            CAutoFile blkdat(file, SER_DISK, CLIENT_VERSION);
+            nLoaded += LoadBlocksFromFile(blkdat, nFile);
         }
         catch (const std::exception&) {
-            printf("%s() : Deserialize or I/O error caught during load\n",
-                   BOOST_CURRENT_FUNCTION);
+            return error("ReindexBlockFiles() : I/O error in blk%04u.dat", nFile);
         }
     }
-    printf("Loaded %i blocks from external file in %" PRId64 "ms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+    printf("Reindexed %i blocks in %" PRId64 "ms\n", nLoaded, GetTimeMillis() - nStart);
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -2935,6 +5848,101 @@ string GetWarnings(string strFor)
 //
 
 
+// Blocks relayed in compact form, waiting for the transactions asked from
+//   the peer. Needs cs_main.
+struct CPartialBlock
+{
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+    int64_t nTime;
+    CService addrFrom;
+};
+
+static const int64_t PARTIAL_BLOCK_TIMEOUT = 60;
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static std::map<uint256, CPartialBlock> mapPartialBlocks;
+
+// Fill in the transactions of a compact block from the memory pool, the
+//   positions of those that aren't there are returned in vMissing
+bool static ReconstructBlock(const CCompactBlock& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    unsigned int nPrefilled = cmpctblock.vPrefilled.size();
+    map<uint64_t, unsigned int> mapPosition;
+    for (unsigned int i = 0; i < cmpctblock.vShortIds.size(); i++)
+        if (!mapPosition.insert(make_pair(cmpctblock.vShortIds[i], nPrefilled + i)).second)
+            return false;
+
+    block = cmpctblock.header;
+    block.vtx = cmpctblock.vPrefilled;
+    block.vtx.resize(nPrefilled + cmpctblock.vShortIds.size());
+    vector<bool> vHave(block.vtx.size(), false);
+    {
+        LOCK(mempool.cs);
+        for (CTxMemPool::TxMap::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            map<uint64_t, unsigned int>::iterator it = mapPosition.find(cmpctblock.GetShortId(mi->first));
+            if (it == mapPosition.end())
+                continue;
+            // Two transactions with the same short id, can't tell which one
+            if (vHave[it->second])
+                return false;
+            block.vtx[it->second] = mi->second;
+            vHave[it->second] = true;
+        }
+    }
+
+    vMissing.clear();
+    for (unsigned int i = nPrefilled; i < block.vtx.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return true;
+}
+
+// What can be checked of a compact block before its transactions are all
+//   there: the timestamp, the checkpoints, and the block signature or the
+//   proof-of-work. The previous block has to be known.
+bool static CheckCompactHeader(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    const CBlockIndex* pindexPrev = mapBlockIndex.find(block.hashPrevBlock)->second;
+
+    if (block.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("CheckCompactHeader() : block timestamp too far in the future");
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return block.DoS(20, error("CheckCompactHeader() : block timestamp too early"));
+    if (!Checkpoints::CheckHardened(pindexPrev->nHeight + 1, hash))
+        return block.DoS(100, error("CheckCompactHeader() : rejected by hardened checkpoint lock-in at %d", pindexPrev->nHeight + 1));
+
+    if (block.IsProofOfStake())
+    {
+        if (!block.CheckBlockSignature())
+            return block.DoS(100, error("CheckCompactHeader() : bad block signature"));
+    }
+    else if (!CheckProofOfWork(hash, block.nBits))
+        return block.DoS(50, error("CheckCompactHeader() : proof of work failed"));
+    return true;
+}
+
+bool static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+
+    // A short id matched the wrong transaction, fall back to the full block
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not rebuild, asking for all of it\n", inv.hash.ToString().substr(0,20).c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return false;
+    }
+
+    bool fAccepted = ProcessBlock(pfrom, &block);
+    if (fAccepted)
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    return fAccepted;
+}
+
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
@@ -2953,7 +5961,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               IsBlockPipelined(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2967,6 +5976,81 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0x1d, 0x05, 0x14, 0x0b };
 
+// Announce transactions that came out of a reconciliation round
+void static PushTxInventory(CNode* pnode, const vector<uint256>& vHash)
+{
+    vector<CInv> vInv;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        vInv.push_back(CInv(MSG_TX, hash));
+    for (size_t nPos = 0; nPos < vInv.size(); nPos += nInvBatchSize)
+        pnode->PushMessage("inv", vector<CInv>(vInv.begin() + nPos, vInv.begin() + min(vInv.size(), nPos + nInvBatchSize)));
+}
+
+// Carries on with a transaction from a peer once it is validated, cs_main is held
+void static ProcessSubmittedTx(CNode* pfrom, const CTransaction& tx, const CTxSubmitResult& result)
+{
+    uint256 hash = tx.GetHash();
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    if (result.fAccepted)
+    {
+        CTxDB txdb("r");
+        pfrom->nLastTxTime = GetTime();
+        mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+        vWorkQueue.push_back(hash);
+        vEraseQueue.push_back(hash);
+
+        // Recursively process any orphan transactions that depended on this one
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            uint256 hashPrev = vWorkQueue[i];
+            const CTransaction& txPrev = (i == 0) ? tx : mapOrphanTransactions[hashPrev].tx;
+            set<uint256> setSpenders;
+            for (unsigned int n = 0; n < txPrev.vout.size(); n++)
+            {
+                boost::unordered_map<COutPoint, set<uint256>, SaltedOutPointHasher>::iterator mi = mapOrphanTransactionsByPrev.find(COutPoint(hashPrev, n));
+                if (mi != mapOrphanTransactionsByPrev.end())
+                    setSpenders.insert(mi->second.begin(), mi->second.end());
+            }
+            BOOST_FOREACH(const uint256& orphanTxHash, setSpenders)
+            {
+                CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash].tx;
+                bool fMissingInputs2 = false;
+
+                if (orphanTx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
+                {
+                    printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                    SyncWithWallets(orphanTx, NULL, true);
+                    RelayTransaction(orphanTx, orphanTxHash);
+                    mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
+                    vWorkQueue.push_back(orphanTxHash);
+                    vEraseQueue.push_back(orphanTxHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    // invalid orphan
+                    vEraseQueue.push_back(orphanTxHash);
+                    printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                }
+            }
+        }
+
+        BOOST_FOREACH(const uint256& hashErase, vEraseQueue)
+            EraseOrphanTx(hashErase);
+    }
+    else if (result.fMissingInputs)
+    {
+        AddOrphanTx(tx, pfrom->addr);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_TX_BYTES);
+        if (nEvicted > 0)
+            printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+    if (result.nDoS) pfrom->Misbehaving(result.nDoS);
+    pfrom->Release();
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
@@ -3048,6 +6132,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Offer to reconcile transactions instead of announcing each
+        if (fTxReconcile && pfrom->nVersion >= TXRECON_VERSION)
+        {
+            LOCK(pfrom->cs_inventory);
+            while (pfrom->nReconSalt == 0)
+                RAND_bytes((unsigned char*)&pfrom->nReconSalt, sizeof(pfrom->nReconSalt));
+            pfrom->PushMessage("sendrecon", pfrom->nReconSalt);
+        }
+
+        // Offer to take blocks and transactions compressed. Compressed
+        // messages may come in from the moment this is sent.
+        if (fCompressMessages && pfrom->nVersion >= COMPRESS_VERSION)
+        {
+            vector<string> vMethods;
+            vMethods.push_back("zlib");
+            pfrom->fCompressRecv = true;
+            pfrom->PushMessage("sendcompress", vMethods);
+        }
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -3121,7 +6224,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // The first round trip, until the pings tell better
+        if (!pfrom->fInbound && pfrom->nVersionSentUsec && pfrom->nPingUsec == 0)
+            pfrom->nPingUsec = pfrom->nMinPingUsec = GetTimeMicros() - pfrom->nVersionSentUsec;
     }
 
 
@@ -3135,6 +6242,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return true;
         if (vAddr.size() > 1000)
         {
+            LOCK(cs_main);
             pfrom->Misbehaving(20);
             return error("message addr size() = %" PRIszu "", vAddr.size());
         }
@@ -3197,10 +6305,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             pfrom->Misbehaving(20);
             return error("message inv size() = %" PRIszu "", vInv.size());
         }
 
+        // What the peer knows about is kept per peer, the rest needs the chain
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
         // find last block in inv vector
         size_t nLastBlock = std::numeric_limits<size_t>::max();
         for (size_t nInv = 0; nInv < vInv.size(); nInv++) {
@@ -3216,7 +6331,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (fShutdown)
                 return true;
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             if (fDebug)
@@ -3230,7 +6344,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
-                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
+                pfrom->PushGetBlocks(LookupBlockIndex(inv.hash), uint256(0));
                 if (fDebug)
                     printf("force request: %s\n", inv.ToString().c_str());
             }
@@ -3263,13 +6377,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                // Send block from relay memory, or from disk
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    CSendBuffer pmsg = FindRelayMessage(inv);
+                    if (!pmsg)
+                    {
+                        // Past the upload target, old blocks are left for other nodes to serve
+                        if ((*mi).second->GetBlockTime() < GetAdjustedTime() - HISTORICAL_BLOCK_AGE && CNode::OutboundTargetReached())
+                        {
+                            printf("upload target reached, not sending historical block %s to %s\n", inv.hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+                            continue;
+                        }
+
+                        // Pruned ones are not there to send
+                        CBlock block;
+                        if (IsBlockPruned((*mi).second) || !block.ReadFromDisk((*mi).second))
+                        {
+                            printf("not sending block %s to %s, not in the block files\n", inv.hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+                            continue;
+                        }
+                        pmsg = MakeSendBuffer("block", block);
+
+                        // Recent blocks are asked for by most peers in turn
+                        if ((*mi).second->nHeight > nBestHeight - MAX_RELAY_BLOCK_DEPTH)
+                            AddRelayMessage(inv, pmsg);
+                    }
+                    pfrom->PushSendBuffer(pmsg);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3287,23 +6422,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             else if (inv.IsKnownType())
             {
                 // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
+                CSendBuffer pmsg = FindRelayMessage(inv);
+                if (pmsg)
+                    pfrom->PushSendBuffer(pmsg);
+                else if (inv.type == MSG_TX) {
+                    {
+                        LOCK(mempool.cs);
+                        if (mempool.exists(inv.hash))
+                            pmsg = MakeSendBuffer("tx", mempool.lookup(inv.hash));
                     }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    if (pmsg)
+                    {
+                        AddRelayMessage(inv, pmsg);
+                        pfrom->PushSendBuffer(pmsg);
                     }
                 }
             }
@@ -3355,13 +6486,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CSyncCheckpoint checkpoint;
         vRecv >> checkpoint;
 
-        if (checkpoint.ProcessSyncCheckpoint(pfrom))
+        // The signature is verified before taking cs_main
+        if (checkpoint.CheckSignature())
         {
-            // Relay
-            pfrom->hashCheckpointKnown = checkpoint.hashCheckpoint;
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                checkpoint.RelayTo(pnode);
+            LOCK(cs_main);
+            if (checkpoint.AcceptSyncCheckpoint(pfrom))
+            {
+                // Relay
+                pfrom->hashCheckpointKnown = checkpoint.hashCheckpoint;
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    checkpoint.RelayTo(pnode);
+            }
         }
     }
 
@@ -3375,7 +6511,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3389,7 +6525,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3401,70 +6537,53 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %" PRIszu "", vHeaders.size());
+        }
+
+        std::vector<const CBlock*> vpHeader;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+            vpHeader.push_back(&header);
+        CacheBlockHashes(vpHeader);
+
+        int nDoS = 0;
+        int nLastHeight = -1;
+        bool fAccepted = headerchain.AcceptHeaders(pfrom, vHeaders, nDoS, nLastHeight);
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+        pfrom->nBestKnownHeight = max(pfrom->nBestKnownHeight, nLastHeight);
+        printf("received %" PRIszu " headers, best header height %d\n", vHeaders.size(), headerchain.GetBestHeight());
+
+        // A full batch means there are more, they are asked for once the blocks catch up
+        if (fAccepted && vHeaders.size() == MAX_HEADERS_RESULTS)
+            pfrom->fGetHeaders = true;
+    }
+
+
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        // Reject malformed transactions before waiting for cs_main
+        if (!tx.CheckTransaction())
         {
-            SyncWithWallets(tx, NULL, true);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (orphanTx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            LOCK(cs_main);
+            if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+            return error("ProcessMessage() : CheckTransaction failed for tx %s", inv.hash.ToString().substr(0,10).c_str());
         }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+        // Validated on the submission thread, which carries on in ProcessSubmittedTx
+        SubmitTransaction(tx, boost::bind(&ProcessSubmittedTx, pfrom->AddRef(), _1, _2), pfrom);
     }
 
 
@@ -3486,6 +6605,274 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    // Transaction reconciliation. Between peers that both sent sendrecon, the
+    // transactions one would announce to the other are collected instead. Every
+    // RECON_INTERVAL the outbound side asks for a round with reqrecon, the
+    // inbound side answers with a sketch of its set, and the difference to the
+    // sketch of its own set tells the outbound side which transactions only
+    // it has, which it announces, and which only the peer has, which it asks
+    // the peer to announce with reconcildiff. Transactions both have are not
+    // announced at all. If the sketch was too small, both announce their set.
+    else if (strCommand == "sendrecon")
+    {
+        uint64_t nSalt;
+        vRecv >> nSalt;
+
+        LOCK(pfrom->cs_inventory);
+        if (pfrom->nReconSalt != 0 && !pfrom->fTxRecon)
+        {
+            pfrom->fTxRecon = true;
+            pfrom->nReconKey = pfrom->nReconSalt ^ nSalt;
+            pfrom->nNextReconTime = GetTimeMicros() + RECON_INTERVAL * 1000000;
+        }
+    }
+
+
+    else if (strCommand == "reqrecon")
+    {
+        uint32_t nTheirSize;
+        vRecv >> nTheirSize;
+
+        CTxSketch sketch;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->fTxRecon || !pfrom->fInbound)
+                return true;
+
+            // An unanswered round goes into this one
+            pfrom->mapReconSet.insert(pfrom->mapReconSnapshot.begin(), pfrom->mapReconSnapshot.end());
+            pfrom->mapReconSnapshot.clear();
+            pfrom->mapReconSnapshot.swap(pfrom->mapReconSet);
+
+            // Room for the expected difference: what the sizes don't explain
+            // is mostly transactions both have
+            uint32_t nOurSize = pfrom->mapReconSnapshot.size();
+            uint32_t nDiff = max(nOurSize, nTheirSize) - min(nOurSize, nTheirSize) + min(nOurSize, nTheirSize) / 8;
+            sketch = CTxSketch(min((uint32_t)MAX_SKETCH_CELLS, 2 * nDiff + 16));
+            for (map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.begin(); mi != pfrom->mapReconSnapshot.end(); ++mi)
+                sketch.Add(mi->first);
+        }
+        pfrom->PushMessage("sketch", sketch);
+    }
+
+
+    else if (strCommand == "sketch")
+    {
+        CTxSketch sketchTheirs;
+        vRecv >> sketchTheirs;
+        if (!sketchTheirs.IsValid() || sketchTheirs.size() > MAX_SKETCH_CELLS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message sketch size() = %u", sketchTheirs.size());
+        }
+
+        vector<uint256> vAnnounce;
+        vector<uint64_t> vOurs, vTheirs;
+        bool fDecoded = false;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->fTxRecon || !pfrom->fReconPending)
+                return true;
+            pfrom->fReconPending = false;
+
+            CTxSketch sketch(sketchTheirs.size());
+            for (map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.begin(); mi != pfrom->mapReconSnapshot.end(); ++mi)
+                sketch.Add(mi->first);
+            fDecoded = sketch.Subtract(sketchTheirs) && sketch.Decode(vOurs, vTheirs);
+            if (fDecoded)
+            {
+                BOOST_FOREACH(uint64_t nId, vOurs)
+                {
+                    map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.find(nId);
+                    if (mi != pfrom->mapReconSnapshot.end())
+                        vAnnounce.push_back(mi->second);
+                }
+            }
+            else
+            {
+                for (map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.begin(); mi != pfrom->mapReconSnapshot.end(); ++mi)
+                    vAnnounce.push_back(mi->second);
+                vTheirs.clear();
+            }
+            pfrom->mapReconSnapshot.clear();
+        }
+        if (fDebugNet)
+            printf("reconciliation with %s %s: %" PRIszu " ours, %" PRIszu " theirs\n", pfrom->addr.ToString().c_str(),
+                fDecoded ? "done" : "failed", vAnnounce.size(), vTheirs.size());
+
+        pfrom->PushMessage("reconcildiff", fDecoded, vTheirs);
+        PushTxInventory(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "reconcildiff")
+    {
+        bool fDecoded;
+        vector<uint64_t> vIds;
+        vRecv >> fDecoded >> vIds;
+
+        vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->fTxRecon || !pfrom->fInbound)
+                return true;
+            if (fDecoded)
+            {
+                BOOST_FOREACH(uint64_t nId, vIds)
+                {
+                    map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.find(nId);
+                    if (mi != pfrom->mapReconSnapshot.end())
+                        vAnnounce.push_back(mi->second);
+                }
+            }
+            else
+            {
+                for (map<uint64_t, uint256>::iterator mi = pfrom->mapReconSnapshot.begin(); mi != pfrom->mapReconSnapshot.end(); ++mi)
+                    vAnnounce.push_back(mi->second);
+            }
+            pfrom->mapReconSnapshot.clear();
+        }
+        PushTxInventory(pfrom, vAnnounce);
+    }
+
+
+    // The peer takes compressed messages, see CompressSendBuffer
+    else if (strCommand == "sendcompress")
+    {
+        vector<string> vMethods;
+        vRecv >> vMethods;
+
+        if (fCompressMessages && find(vMethods.begin(), vMethods.end(), "zlib") != vMethods.end())
+        {
+            LOCK(pfrom->cs_vSend);
+            pfrom->fCompressSend = true;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        printf("received compact block %s\n", hashBlock.ToString().substr(0,20).c_str());
+
+        int64_t nNow = GetTime();
+        for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+        {
+            if (nNow - mi->second.nTime > PARTIAL_BLOCK_TIMEOUT)
+                mapPartialBlocks.erase(mi++);
+            else
+                ++mi;
+        }
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || mapPartialBlocks.count(hashBlock))
+            return true;
+        if (cmpctblock.vPrefilled.empty() || ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE ||
+            cmpctblock.vPrefilled.size() + cmpctblock.vShortIds.size() > MAX_BLOCK_SIZE / 60)
+        {
+            pfrom->Misbehaving(20);
+            return error("message cmpctblock malformed");
+        }
+
+        // An orphan or a block with short id collisions is fetched whole
+        CBlock block;
+        vector<unsigned int> vMissing;
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock) || !ReconstructBlock(cmpctblock, block, vMissing))
+        {
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+
+        if (!CheckCompactHeader(block))
+        {
+            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+            return error("message cmpctblock %s rejected", hashBlock.ToString().substr(0,20).c_str());
+        }
+
+        if (vMissing.empty())
+            ProcessCompactBlock(pfrom, block);
+        else
+        {
+            if (fDebugNet)
+                printf("compact block %s misses %" PRIszu " of %" PRIszu " transactions\n", hashBlock.ToString().substr(0,20).c_str(), vMissing.size(), block.vtx.size());
+
+            // Only a few are kept waiting, from each peer and in all, the
+            //   others are asked for whole
+            unsigned int nFromPeer = 0;
+            for (map<uint256, CPartialBlock>::const_iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); ++mi)
+                if (mi->second.addrFrom == (CService)pfrom->addr)
+                    nFromPeer++;
+            if (nFromPeer >= MAX_PARTIAL_BLOCKS_PER_PEER || mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+            {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            CPartialBlock& partial = mapPartialBlocks[hashBlock];
+            partial.block = block;
+            partial.vMissing = vMissing;
+            partial.nTime = nNow;
+            partial.addrFrom = pfrom->addr;
+            pfrom->PushMessage("getblocktxn", hashBlock, vMissing);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hashBlock;
+        vector<unsigned int> vIndexes;
+        vRecv >> hashBlock >> vIndexes;
+
+        // Only recent blocks are served this way
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain() || mi->second->nHeight <= nBestHeight - MAX_RELAY_BLOCK_DEPTH)
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("getblocktxn : can't read block %s", hashBlock.ToString().substr(0,20).c_str());
+        vector<CTransaction> vtx;
+        BOOST_FOREACH(unsigned int n, vIndexes)
+        {
+            if (n >= block.vtx.size())
+            {
+                pfrom->Misbehaving(20);
+                return error("message getblocktxn index %u out of range", n);
+            }
+            vtx.push_back(block.vtx[n]);
+        }
+        pfrom->PushMessage("blocktxn", hashBlock, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hashBlock;
+        vector<CTransaction> vtx;
+        vRecv >> hashBlock >> vtx;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hashBlock);
+        if (mi == mapPartialBlocks.end() || mi->second.addrFrom != (CService)pfrom->addr)
+            return true;
+        CPartialBlock partial = mi->second;
+        mapPartialBlocks.erase(mi);
+
+        if (vtx.size() != partial.vMissing.size())
+        {
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+            return error("message blocktxn has %" PRIszu " transactions, %" PRIszu " asked", vtx.size(), partial.vMissing.size());
+        }
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            partial.block.vtx[partial.vMissing[i]] = vtx[i];
+        ProcessCompactBlock(pfrom, partial.block);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages. 
@@ -3495,7 +6882,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * nOneDay);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3585,23 +6975,47 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "pong")
+    {
+        int64_t nTimeReceived = GetTimeMicros();
+        uint64_t nonce = 0;
+        vRecv >> nonce;
+
+        // Pongs to keep-alive pings and unsolicited ones are ignored
+        if (nonce != 0 && nonce == pfrom->nPingNonceSent)
+        {
+            int64_t nPingUsec = nTimeReceived - pfrom->nPingUsecStart;
+            if (nPingUsec > 0)
+            {
+                pfrom->nPingUsec = nPingUsec;
+                if (pfrom->nMinPingUsec == 0 || nPingUsec < pfrom->nMinPingUsec)
+                    pfrom->nMinPingUsec = nPingUsec;
+            }
+            pfrom->nPingNonceSent = 0;
+        }
+    }
+
+
     else if (strCommand == "alert")
     {
         CAlert alert;
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(cs_mapAlerts);
+            fKnown = pfrom->setKnown.count(alertHash) > 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert())
             {
                 // Relay
+                LOCK2(cs_vNodes, cs_mapAlerts);
                 pfrom->setKnown.insert(alertHash);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
-                }
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    alert.RelayTo(pnode);
             }
             else {
                 // Small DoS penalty so peers that send us lots of
@@ -3610,6 +7024,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // This isn't a Misbehaving(100) (immediate ban) because the
                 // peer might be an older or different implementation with
                 // a different signature key, etc.
+                LOCK(cs_main);
                 pfrom->Misbehaving(10);
             }
         }
@@ -3631,13 +7046,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that don't need the chain state, or that lock cs_main themselves
+// for the part that does, so other peers' messages are handled meanwhile.
+// Alerts and checkpoints have their signatures verified outside of it.
+bool static NeedsMainLock(const string& strCommand)
+{
+    return !(strCommand == "ping" || strCommand == "pong" || strCommand == "addr" || strCommand == "inv" || strCommand == "tx" ||
+             strCommand == "alert" || strCommand == "checkpoint");
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
+    PROFILE_SCOPE("ProcessMessages");
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%u messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -3648,75 +7070,64 @@ bool ProcessMessages(CNode* pfrom)
     //  (x) data
     //
 
-    for ( ; ; )
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end())
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // The header was checked as it came in, and the payload hashed
+        CNetMessage& msg = *it;
+        if (!msg.IsComplete())
+            break;
+
+        // Blocks wait in the receive queue while the pipeline is full, the
+        //   handler goes on with the other peers meanwhile
+        if (fBlockPipeline && pfrom->nVersion != 0 && msg.hdr.GetCommand() == "block" && IsBlockPipelineFull())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %" PRIpdd " BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
+        // Transactions wait while the peer has its share of the submission
+        //   queue, and the peer isn't read from until they go on
+        if (pfrom->nVersion != 0 && msg.hdr.GetCommand() == "tx")
         {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
+            pfrom->fPauseRecv = IsTxSubmitQueueFull(pfrom);
+            if (pfrom->fPauseRecv)
+                break;
         }
-        string strCommand = hdr.GetCommand();
+        it++;
 
-        // Message size
+        CMessageHeader& hdr = msg.hdr;
+        string strCommand = hdr.GetCommand();
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
+        pfrom->RecordRecv(strCommand, CMessageHeader::HEADER_SIZE + (msg.nCompressedSize ? msg.nCompressedSize : nMessageSize));
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (!msg.fChecksumOk)
         {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR hdr.nChecksum=%08x\n",
+               strCommand.c_str(), nMessageSize, hdr.nChecksum);
             continue;
         }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
+        int64_t nMainWaitUsec = 0, nMainHeldUsec = 0;
         try
         {
+            if (strCommand == "block" && fBlockPipeline && pfrom->nVersion != 0)
+                fRet = PipelineBlock(pfrom, vMsg);
+            else if (!NeedsMainLock(strCommand) && pfrom->nVersion != 0)
+                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            else
             {
                 LOCK(cs_main);
+                int64_t nLocked = GetTimeMicros();
+                nMainWaitUsec = nLocked - nProcessStart;
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                nMainHeldUsec = GetTimeMicros() - nLocked;
             }
             if (fShutdown)
                 return true;
@@ -3744,17 +7155,23 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        RecordProcessTime(strCommand, GetTimeMicros() - nProcessStart, nMainWaitUsec, nMainHeldUsec);
+
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
-    vRecv.Compact();
+    // Drop the handled messages
+    for (std::deque<CNetMessage>::iterator mi = pfrom->vRecvMsg.begin(); mi != it; ++mi)
+        pfrom->nRecvSize -= CMessageHeader::HEADER_SIZE + mi->hdr.nMessageSize;
+    pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
     return true;
 }
 
 
 bool SendMessages(CNode* pto)
 {
+    PROFILE_SCOPE("SendMessages");
     TRY_LOCK(cs_main, lockMain);
     if (lockMain) {
         // Current time in microseconds
@@ -3764,9 +7181,22 @@ bool SendMessages(CNode* pto)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > nPingInterval && pto->vSend.empty()) {
+        // Timed ping, to peers that answer with a pong. Older ones just get a
+        // keep-alive ping with a nonce of zero.
+        if (pto->nVersion > BIP0031_VERSION) {
+            if (pto->nPingNonceSent == 0 && nNow - pto->nPingUsecStart > PING_INTERVAL * 1000000) {
+                while (pto->nPingNonceSent == 0)
+                    RAND_bytes((unsigned char*)&pto->nPingNonceSent, sizeof(pto->nPingNonceSent));
+                pto->nPingUsecStart = GetTimeMicros();
+                pto->PushMessage("ping", pto->nPingNonceSent);
+            }
+            else if (pto->nPingNonceSent != 0 && nNow - pto->nPingUsecStart > PING_TIMEOUT * 1000000) {
+                printf("ping timeout, disconnecting %s\n", pto->addr.ToString().c_str());
+                pto->fDisconnect = true;
+                return true;
+            }
+        }
+        else if (pto->nLastSend && GetTime() - pto->nLastSend > nPingInterval && pto->nSendSize == 0) {
             uint64_t nonce = 0;
             pto->PushMessage("ping", nonce);
         }
@@ -3774,7 +7204,16 @@ bool SendMessages(CNode* pto)
         // Start block sync
         if (pto->fStartSync) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            if (fHeadersFirst)
+                pto->fGetHeaders = true;
+            else
+                pto->PushGetBlocks(pindexBest, uint256(0));
+        }
+
+        // Headers, as long as they are not too far ahead of the blocks
+        if (pto->fGetHeaders && headerchain.GetBestHeight() < nBestHeight + MAX_HEADERS_AHEAD) {
+            pto->fGetHeaders = false;
+            pto->PushMessage("getheaders", headerchain.GetLocator(), uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3791,78 +7230,112 @@ bool SendMessages(CNode* pto)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, 30);
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrNew;
             {
-                if (pto->setAddrKnown.insert(addr).second)
-                {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
+                LOCK(pto->cs_addrKnown);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddrNew.size(); nStart += 1000)
+            {
+                vector<CAddress> vAddr(vAddrNew.begin() + nStart, vAddrNew.begin() + min(nStart + 1000, vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
         //
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             bool fSendTrickle = false;
             if (pto->nNextInvSend < nNow) {
                 fSendTrickle = true;
                 pto->nNextInvSend = PoissonNextSend(nNow, 5);
             }
+
+            // Transaction inventory is shaped to nInvBytesPerSecond, with
+            // bursts of up to ten seconds' worth
+            static const int64_t INV_ENTRY_SIZE = 36;
+            size_t nTxBudget = std::numeric_limits<size_t>::max();
+            if (nInvBytesPerSecond > 0) {
+                if (pto->nInvBudgetTime == 0)
+                    pto->nInvBudgetTime = nNow;
+                pto->nInvBudget = min(nInvBytesPerSecond * 10, pto->nInvBudget + (nNow - pto->nInvBudgetTime) * nInvBytesPerSecond / 1000000);
+                pto->nInvBudgetTime = nNow;
+                nTxBudget = pto->nInvBudget / INV_ENTRY_SIZE;
+            }
+
+            static uint256 hashSalt;
+            if (hashSalt == 0)
+                hashSalt = GetRandHash();
+
+            size_t nTxSent = 0;
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            deque<CInv> vInvWait;
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                // Left to the next reconciliation round, unless too many wait
+                if (inv.type == MSG_TX && pto->fTxRecon && pto->mapReconSet.size() < MAX_RECON_SET)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
+                    pto->mapReconSet[pto->GetReconShortId(inv.hash)] = inv.hash;
+                    pto->filterInventoryKnown.insert(inv.hash);
+                    continue;
+                }
 
-                    if (fTrickleWait)
+                if (inv.type == MSG_TX)
+                {
+                    // trickle out tx inv to protect privacy, 1/4 of them
+                    // blast to all immediately
+                    if (!fSendTrickle)
+                    {
+                        uint256 hashRand = inv.hash ^ hashSalt;
+                        hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                        if ((hashRand & 3) != 0)
+                        {
+                            vInvWait.push_back(inv);
+                            continue;
+                        }
+                    }
+                    if (nTxSent >= nTxBudget)
                     {
                         vInvWait.push_back(inv);
                         continue;
                     }
+                    nTxSent++;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+            }
+            pto->vInventoryToSend.swap(vInvWait);
+            if (nInvBytesPerSecond > 0)
+                pto->nInvBudget -= nTxSent * INV_ENTRY_SIZE;
+
+            // Ask outbound peers for a reconciliation round. What a round
+            // left unanswered for a whole interval held is announced instead.
+            if (pto->fTxRecon && !pto->fInbound && pto->nNextReconTime < nNow)
+            {
+                if (pto->fReconPending)
+                    for (map<uint64_t, uint256>::iterator mi = pto->mapReconSnapshot.begin(); mi != pto->mapReconSnapshot.end(); ++mi)
+                        vInv.push_back(CInv(MSG_TX, mi->second));
+                pto->mapReconSnapshot.swap(pto->mapReconSet);
+                pto->mapReconSet.clear();
+                pto->fReconPending = true;
+                pto->nNextReconTime = nNow + RECON_INTERVAL * 1000000;
+                pto->PushMessage("reqrecon", (uint32_t)pto->mapReconSnapshot.size());
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
+        for (size_t nPos = 0; nPos < vInv.size(); nPos += nInvBatchSize)
+            pto->PushMessage("inv", vector<CInv>(vInv.begin() + nPos, vInv.begin() + min(vInv.size(), nPos + nInvBatchSize)));
 
 
         //
@@ -3873,7 +7346,7 @@ bool SendMessages(CNode* pto)
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            if (!AlreadyHave(txdb, inv) && !(inv.type == MSG_BLOCK && headerchain.IsRequested(inv.hash)))
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
@@ -3883,10 +7356,16 @@ bool SendMessages(CNode* pto)
                     pto->PushMessage("getdata", vGetData);
                     vGetData.clear();
                 }
-                mapAlreadyAskedFor[inv] = nNow;
+                AskedForMap::const_iterator it = mapAlreadyAskedFor.find(inv);
+                if (it != mapAlreadyAskedFor.end())
+                    mapAlreadyAskedFor.update(it, nNow);
+                else
+                    mapAlreadyAskedFor.insert(make_pair(inv, nNow));
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (fHeadersFirst)
+            headerchain.GetBlocksToDownload(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -3901,13 +7380,16 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
-        mapBlockIndex.clear();
+        {
+            WRITE_LOCK(cs_blockIndex);
+            mapBlockIndex.clear();
+        }
+        BOOST_FOREACH(CBlockIndex* pslab, vBlockIndexSlabs)
+            delete[] pslab;
+        vBlockIndexSlabs.clear();
 
         // orphan blocks
-        std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
+        OrphanBlockMap::iterator it2 = mapOrphanBlocks.begin();
         for (; it2 != mapOrphanBlocks.end(); it2++)
             delete (*it2).second;
         mapOrphanBlocks.clear();
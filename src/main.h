@@ -13,11 +13,17 @@
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
+#include "uint256map.h"
+#include "notify.h"
 
 #include <limits>
 #include <list>
 #include <map>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -30,6 +36,9 @@ class CInv;
 class CRequestTracker;
 class CNode;
 
+typedef uint256map<CBlockIndex*> BlockMap;
+typedef boost::unordered_map<uint256, CBlock*, SaltedHasher> OrphanBlockMap;
+
 //
 // Global state
 //
@@ -38,7 +47,24 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const uint64_t MAX_ORPHAN_TX_BYTES = 5 * MAX_BLOCK_SIZE;
+static const uint64_t MAX_ORPHAN_TX_PEER_BYTES = MAX_ORPHAN_TX_BYTES / 10;
+// Orphan transactions are given up on after this long, checked every interval
+static const int64_t ORPHAN_TX_EXPIRE = 20 * 60;
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
+// Unconfirmed chains in the memory pool are limited to this many transactions
+// and bytes, counting the transaction itself, both up and down the chain
+static const unsigned int MEMPOOL_MAX_ANCESTORS = 25;
+static const unsigned int MEMPOOL_MAX_ANCESTOR_SIZE = 101000;
+static const unsigned int MEMPOOL_MAX_DESCENDANTS = 25;
+static const unsigned int MEMPOOL_MAX_DESCENDANT_SIZE = 101000;
+// Blocks this close to the best height are kept in relay memory when served
+static const int MAX_RELAY_BLOCK_DEPTH = 10;
+// Blocks older than this aren't served once -maxuploadtarget is reached
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+// Orphan blocks are dropped when their parents haven't come in this long
+static const int64_t ORPHAN_BLOCK_EXPIRY = 6 * 60 * 60;
 
 static const int64_t MIN_TX_FEE = 1;
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
@@ -50,7 +76,12 @@ static const int64_t MIN_TXOUT_AMOUNT = MIN_TX_FEE;
 
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 // Maximum number of script-checking threads allowed
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 128;
+// Blocks of the best chain kept by pruning nodes for reorganizations
+static const int MIN_BLOCKS_TO_KEEP = 2880;
+// Smallest -prune target, and block file size of pruning nodes
+static const int64_t MIN_PRUNE_TARGET = 512 * 1024 * 1024;
+static const unsigned int PRUNE_BLOCKFILE_SIZE = 128 * 1024 * 1024;
 
 static const uint256 hashGenesisBlock("0x000004cf6cc5eec2d2d564fa45c26278ed72014822a601c1ff02cd84d0ef63be");
 static const uint256 hashGenesisBlockTestNet("0x00000bc79a2049b1430c77d81fad3373070e65668b21792d298ae5dde3e7abb8");
@@ -60,7 +91,11 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 2 * nOneHour; } // up
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+// Guards mapBlockIndex, the best chain variables and the pnext links for
+// readers that don't hold cs_main. They are only changed under cs_main and
+// this lock held exclusively, so readers may take it shared instead.
+extern CSharedCriticalSection cs_blockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nNodeLifespan;
@@ -80,12 +115,43 @@ extern int64_t nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
-extern std::map<uint256, CBlock*> mapOrphanBlocks;
+extern OrphanBlockMap mapOrphanBlocks;
+// New best blocks and memory pool transactions, for the long polling RPC calls
+extern CNotifyHistory blockNotifyHistory;
+extern CNotifyHistory mempoolNotifyHistory;
 
 // Settings
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
 extern int nScriptCheckThreads;
+extern size_t nBlockCacheSize;
+extern bool fBlockPipeline;
+extern bool fHeadersFirst;
+extern uint256 hashAssumeValid;
+extern int nAssumeValidHeight;
+extern int64_t nAssumeValidSkipped;
+extern bool fAddrIndex;
+extern bool fSpentIndex;
+extern bool fReindex;
+extern int64_t nPruneTarget;
+extern uint64_t nMaxOrphanBlocksMemory;
+extern uint64_t nMaxOrphanBlocksDisk;
+extern uint64_t nMaxMempoolSize;
+extern int64_t nMempoolExpiry;
+extern bool fCheckpointScripts;
+
+// Time spent connecting blocks to the best chain, in microseconds, for bench_42 -replay
+struct CConnectStats
+{
+    int64_t nFetchInputs;   // PrefetchInputs and FetchInputs
+    int64_t nScriptChecks;  // ConnectInputs and waiting for the script check threads
+    int64_t nTxDBCommit;    // TxnCommit of the connected blocks
+    int64_t nSetBestChain;  // the whole of SetBestChain, the above included
+    int64_t nScriptInputs;  // inputs whose scripts were verified
+
+    CConnectStats() : nFetchInputs(0), nScriptChecks(0), nTxDBCommit(0), nSetBestChain(0), nScriptInputs(0) { }
+};
+extern CConnectStats connectStats;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -98,23 +164,137 @@ class CScriptCheck;
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock=false,
+                  unsigned int nFile=std::numeric_limits<unsigned int>::max(), unsigned int nBlockPos=0);
+bool RelayStakedBlock(CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+// Map a block file read-only, at least nMinSize bytes of it. The mapping stays
+// valid for as long as a copy of pHandle is held.
+bool MapBlockFile(unsigned int nFile, size_t nMinSize, boost::shared_ptr<void>& pHandle, const char*& pBegin, size_t& nSize);
+// The serialized block at nBlockPos as it lies in the file, without decoding it
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, std::string& strRet);
+
+// Unserialize an object straight from its position in a memory mapped block file
+template<typename T>
+bool ReadFromMappedBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType)
+{
+    boost::shared_ptr<void> pHandle;
+    const char* pBegin;
+    size_t nSize;
+    size_t nMinSize = (size_t)nPos + 1;
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        if (!MapBlockFile(nFile, nMinSize, pHandle, pBegin, nSize))
+            return false;
+        try {
+            CMemoryReader reader(pBegin + nPos, pBegin + nSize, nType, CLIENT_VERSION);
+            reader >> obj;
+            return true;
+        }
+        catch (const std::exception&) {
+            // The file may have grown past the mapping since
+            nMinSize = nSize + 1;
+        }
+    }
+    return false;
+}
 FILE* AppendBlockFile(unsigned int& nFileRet);
 
+// Allocate a block index entry, it is never freed
+CBlockIndex* AllocBlockIndex();
 void UnloadBlockIndex();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+// Return the index entry of a block, or NULL. Unlike mapBlockIndex[hash] it
+// never adds an entry, so readers holding cs_blockIndex shared can use it
+CBlockIndex* LookupBlockIndex(const uint256& hash);
+// Return the block of the best chain at the given height, or NULL
 CBlockIndex* FindBlockByHeight(int nHeight);
+// Update the height index of the best chain for a new best block
+void SetBestChainByHeight(CBlockIndex* pindexNew);
+
+/** The best chain as RPC reads it, published whole with each new best block
+ * so it can be read without cs_main. The index entries never get freed. */
+class CChainTip
+{
+public:
+    const CBlockIndex* pindex;
+    // Where the proof-of-work and proof-of-stake difficulties are read
+    const CBlockIndex* pindexLastPoW;
+    const CBlockIndex* pindexLastPoS;
+    uint256 hashBlock;
+    int nHeight;
+    int64_t nMoneySupply;
+
+    CChainTip() : pindex(NULL), pindexLastPoW(NULL), pindexLastPoS(NULL), hashBlock(0), nHeight(-1), nMoneySupply(0) {}
+};
+
+// The current tip, never NULL
+boost::shared_ptr<const CChainTip> GetChainTip();
+// Return the block index entry of the block stored at a disk position, or NULL
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos);
+// Register the disk position of a block index entry for FindBlockByPos
+void AddBlockIndexPos(CBlockIndex* pindex);
+// Build or drop the optional address and spent output indexes to match
+// -addrindex and -spentindex
+bool InitOptionalIndexes();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 bool LoadExternalBlockFile(FILE* fileIn);
+// Save the memory pool to mempool.dat, once it was loaded from there
+bool DumpMempool();
+// Refill the memory pool from mempool.dat, checking each transaction again
+void ThreadLoadMempool(void* parg);
+// Rebuild the block index from the local block files, for -reindex
+bool ReindexBlockFiles();
+// Delete the oldest block files not needed anymore, down to -prune
+void PruneBlockFiles();
+// Whether the block file of the block was removed by pruning
+bool IsBlockPruned(const CBlockIndex* pindex);
 
 // Run an instance of the script checking thread
 void ThreadScriptCheck(void* parg);
-// Stop the script checking threads
+// Run an instance of the block transaction checking thread
+void ThreadBlockCheck(void* parg);
+// Stop the script and block checking threads
 void ThreadScriptCheckQuit();
+// Run the thread connecting the pipelined blocks
+void ThreadBlockConnector(void* parg);
+// Wake up the block connector thread for shutdown
+void ThreadBlockConnectorQuit();
+// Forget the blocks asked from a peer, needs cs_main
+void ReleaseBlockRequests(CNode* pnode);
+// Estimated memory of the block index, the orphans, the memory pool and the caches
+void GetChainMemoryUsage(MemoryUsageMap& mapUsage);
+// Heap memory of a transaction held in a container, with its vectors and scripts
+size_t GetTransactionMemoryUsage(const CTransaction& tx);
+
+/** Outcome of a transaction submitted for validation */
+struct CTxSubmitResult
+{
+    bool fAccepted;
+    bool fMissingInputs;
+    int nDoS;
+
+    CTxSubmitResult() : fAccepted(false), fMissingInputs(false), nDoS(0) {}
+};
+
+/** Called on the submission thread, with cs_main held, once a transaction is done */
+typedef boost::function<void (const CTransaction&, const CTxSubmitResult&)> TxSubmitCallback;
+
+// Queue a transaction for the memory pool. Transactions queued together are
+// validated as one batch, accepted ones are synced with the wallets and relayed.
+// A peer's transactions are counted against its share of the queue.
+void SubmitTransaction(const CTransaction& tx, const TxSubmitCallback& callback, CNode* pfrom = NULL);
+// Whether the queue has no room for another transaction from the peer
+bool IsTxSubmitQueueFull(CNode* pfrom);
+// Queue a transaction and wait for the outcome, must not be called with cs_main held
+CTxSubmitResult SubmitTransactionAndWait(const CTransaction& tx);
+// Run the thread validating submitted transactions
+void ThreadTxSubmit(void* parg);
+// Wake up the submission thread for shutdown
+void ThreadTxSubmitQuit();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -247,6 +427,13 @@ public:
     }
 };
 
+/** SaltedHasher for unordered containers keyed by outpoints */
+class SaltedOutPointHasher : public SaltedHasher
+{
+public:
+    size_t operator()(const COutPoint& prevout) const { return Mix(prevout.hash.Get64(0) + prevout.n); }
+};
+
 
 
 
@@ -445,20 +632,56 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+protected:
+    // Hash, serialized size and legacy sigop count of a transaction that was
+    // read from a stream, worked out once as it is read. Copies keep them, so
+    // code that modifies a transaction it didn't build itself has to call
+    // ClearCache() after the change, or UpdateCache() once it is final.
+    uint256 hashCached;
+    unsigned int nSizeCached;
+    unsigned int nLegacySigOpsCached;
+    bool fCached;
+
+public:
     CTransaction()
     {
         SetNull();
     }
 
-    IMPLEMENT_SERIALIZE
-    (
-        READWRITE(this->nVersion);
+    // Same encoding as IMPLEMENT_SERIALIZE would give, written out to keep the
+    // cached size and fill the cache on reading
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        if (fCached)
+            return nSizeCached;
+        return sizeof(this->nVersion) + sizeof(nTime) + sizeof(nLockTime) +
+               ::GetSerializeSize(vin, nType, this->nVersion) +
+               ::GetSerializeSize(vout, nType, this->nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, this->nVersion, nType, nVersion);
         nVersion = this->nVersion;
-        READWRITE(nTime);
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
-    )
+        ::Serialize(s, nTime, nType, nVersion);
+        ::Serialize(s, vin, nType, nVersion);
+        ::Serialize(s, vout, nType, nVersion);
+        ::Serialize(s, nLockTime, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        fCached = false;
+        ::Unserialize(s, this->nVersion, nType, nVersion);
+        nVersion = this->nVersion;
+        ::Unserialize(s, nTime, nType, nVersion);
+        ::Unserialize(s, vin, nType, nVersion);
+        ::Unserialize(s, vout, nType, nVersion);
+        ::Unserialize(s, nLockTime, nType, nVersion);
+        UpdateCache();
+    }
 
     void SetNull()
     {
@@ -468,6 +691,23 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fCached = false;
+    }
+
+    // Work out the hash, size and sigops again and keep them, for a
+    // transaction that won't change any more
+    void UpdateCache()
+    {
+        fCached = false;
+        hashCached = SerializeHash(*this);
+        nSizeCached = GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
+        nLegacySigOpsCached = GetLegacySigOpCount();
+        fCached = true;
+    }
+
+    void ClearCache()
+    {
+        fCached = false;
     }
 
     bool IsNull() const
@@ -477,6 +717,8 @@ public:
 
     uint256 GetHash() const
     {
+        if (fCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
@@ -554,7 +796,8 @@ public:
     */
     bool AreInputsStandard(const MapPrevTx& mapInputs) const;
 
-    /** Count ECDSA signature operations the old-fashioned (pre-0.6) way
+    /** Count ECDSA signature operations the old-fashioned (pre-0.6) way,
+        a transaction read from a stream counts them once
         @return number of sigops this transaction's outputs will produce when spent
         @see CTransaction::FetchInputs
     */
@@ -604,6 +847,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet && ReadFromMappedBlockFile(pos.nFile, pos.nTxPos, *this, SER_DISK))
+            return true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -687,10 +933,12 @@ public:
      @param[in] fMiner	True if being called by CreateNewBlock
      @param[out] inputsRet	Pointers to this transaction's inputs
      @param[out] fInvalid	returns true if transaction is invalid
+     @param[in] pmapPrefetched	Previous transactions already read from txdb, may be NULL
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                     const MapPrevTx* pmapPrefetched = NULL);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -728,12 +976,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> pSigHash; // shared by the inputs of ptxTo
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& pSigHashIn = boost::shared_ptr<const CSignatureHashContext>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHash(pSigHashIn) { }
 
     bool operator()() const;
 
@@ -743,6 +993,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pSigHash.swap(check.pSigHash);
     }
 };
 
@@ -759,6 +1010,8 @@ public:
 
     // memory only
     mutable bool fMerkleVerified;
+    mutable CBlockIndex* pindexCached; // index entry of hashCached, found by the last depth query
+    mutable uint256 hashCached;
 
 
     CMerkleTx()
@@ -776,6 +1029,8 @@ public:
         hashBlock = 0;
         nIndex = -1;
         fMerkleVerified = false;
+        pindexCached = NULL;
+        hashCached = 0;
     }
 
 
@@ -856,6 +1111,98 @@ public:
 };
 
 
+/** Key of the optional address index (-addrindex): a transaction paying to
+ * or spending from a key or script hash.  The height of the block holding the
+ * transaction is stored as the value.
+ */
+class CAddrIndexKey
+{
+public:
+    enum
+    {
+        ADDR_KEYID = 1,
+        ADDR_SCRIPTID = 2,
+    };
+
+    unsigned char nAddrType;
+    uint160 hashAddr;
+    uint256 hashTx;
+
+    CAddrIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddrIndexKey(unsigned char nAddrTypeIn, const uint160& hashAddrIn, const uint256& hashTxIn)
+    {
+        nAddrType = nAddrTypeIn;
+        hashAddr = hashAddrIn;
+        hashTx = hashTxIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nAddrType);
+        READWRITE(hashAddr);
+        READWRITE(hashTx);
+    )
+
+    void SetNull()
+    {
+        nAddrType = 0;
+        hashAddr = 0;
+        hashTx = 0;
+    }
+
+    // Sets the address part of the key, returns false for scripts
+    // without a key or script hash destination.
+    bool SetDestination(const CScript& scriptPubKey);
+};
+
+
+/** Value of the optional spent output index (-spentindex): the input
+ * spending an outpoint and the height of its block.
+ */
+class CSpentIndexValue
+{
+public:
+    uint256 hashTx;
+    unsigned int nIn;
+    int nHeight;
+
+    CSpentIndexValue()
+    {
+        SetNull();
+    }
+
+    CSpentIndexValue(const uint256& hashTxIn, unsigned int nInIn, int nHeightIn)
+    {
+        hashTx = hashTxIn;
+        nIn = nInIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashTx);
+        READWRITE(nIn);
+        READWRITE(nHeight);
+    )
+
+    void SetNull()
+    {
+        hashTx = 0;
+        nIn = (unsigned int) -1;
+        nHeight = -1;
+    }
+
+    bool IsNull() const
+    {
+        return (nIn == (unsigned int) -1);
+    }
+};
+
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -887,6 +1234,11 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // Hash of the header as it was when hashed last, a changed header is hashed again
+    static const unsigned int HEADER_SIZE = 80;
+    mutable uint256 hashCached;
+    mutable unsigned char pchHashedHeader[HEADER_SIZE];
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -898,6 +1250,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            const_cast<CBlock*>(this)->hashCached = 0;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(hashPrevBlock);
@@ -930,6 +1284,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        hashCached = 0;
         nDoS = 0;
     }
 
@@ -940,7 +1295,23 @@ public:
 
     uint256 GetHash() const
     {
-        return scrypt_blockhash((const uint8_t*)&nVersion);
+        if (hashCached != 0 && memcmp(pchHashedHeader, &nVersion, HEADER_SIZE) == 0)
+            return hashCached;
+        SetHash(scrypt_blockhash((const uint8_t*)&nVersion));
+        return hashCached;
+    }
+
+    // Remember the hash of the current header, known from elsewhere
+    void SetHash(const uint256& hash) const
+    {
+        hashCached = hash;
+        memcpy(pchHashedHeader, &nVersion, HEADER_SIZE);
+    }
+
+    // Compute the hash ahead of the checks to come, e.g. outside of cs_main
+    void CacheHash() const
+    {
+        GetHash();
     }
 
     int64_t GetBlockTime() const
@@ -987,17 +1358,30 @@ public:
 
     uint256 BuildMerkleTree() const
     {
-        vMerkleTree.clear();
+        std::vector<uint256> vLeaves;
+        vLeaves.reserve(vtx.size());
         BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
+            vLeaves.push_back(tx.GetHash());
+        return BuildMerkleTree(vLeaves);
+    }
+
+    // Build the tree from already computed transaction hashes
+    uint256 BuildMerkleTree(const std::vector<uint256>& vLeaves) const
+    {
+        vMerkleTree = vLeaves;
         int j = 0;
         for (int nSize = (int)vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
+            // The pairs of a level lie next to each other, they are hashed in
+            //   one go, an odd last node is paired with itself
+            int nPairs = nSize / 2;
+            unsigned int nLevel = vMerkleTree.size();
+            vMerkleTree.resize(nLevel + (nSize + 1) / 2);
+            sha256d64(vMerkleTree[nLevel].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
             {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+                uint256 pair[2] = { vMerkleTree[j+nSize-1], vMerkleTree[j+nSize-1] };
+                sha256d64(vMerkleTree.back().begin(), pair[0].begin(), 1);
             }
             j += nSize;
         }
@@ -1066,19 +1450,23 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+        // Read block from the mapped file, or else through stdio
+        int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+        if (!ReadFromMappedBlockFile(nFile, nBlockPos, *this, nType))
+        {
+            SetNull();
 
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (const std::exception&) {
-            return error("%s() : deserialize or I/O error", BOOST_CURRENT_FUNCTION);
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            try {
+                filein >> *this;
+            }
+            catch (const std::exception&) {
+                return error("%s() : deserialize or I/O error", BOOST_CURRENT_FUNCTION);
+            }
         }
 
         // Check the header
@@ -1118,7 +1506,9 @@ public:
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
     bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
-    bool AcceptBlock();
+    // Stores the block, unless a disk position is given for a block that is
+    //   already in the block files
+    bool AcceptBlock(unsigned int nFileIn=std::numeric_limits<unsigned int>::max(), unsigned int nBlockPosIn=0);
     bool GetCoinAge(uint64_t& nCoinAge) const; // ppcoin: calculate total coin age spent in block
     bool CheckBlockSignature() const;
 
@@ -1144,6 +1534,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // some further ancestor, for GetAncestor
     uint32_t nFile;
     uint32_t nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
@@ -1180,6 +1571,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1205,6 +1597,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1244,6 +1637,8 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        if (phashBlock)
+            block.SetHash(*phashBlock);
         return block;
     }
 
@@ -1264,6 +1659,13 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Set pskip, pprev and nHeight must be set and pprev's own pskip built
+    void BuildSkip();
+
+    // Efficiently find the ancestor of this block at the given height
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     bool CheckIndex() const
     {
         return true;
@@ -1488,7 +1890,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1510,6 +1912,12 @@ public:
         vHave.clear();
     }
 
+    // Put the given hashes ahead of the ones it has, most recent first
+    void Prepend(const std::vector<uint256>& vHashes)
+    {
+        vHave.insert(vHave.begin(), vHashes.begin(), vHashes.end());
+    }
+
     bool IsNull()
     {
         return vHave.empty();
@@ -1524,8 +1932,9 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            if (pindex->nHeight < nStep)
+                break;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1539,7 +1948,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1558,7 +1967,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1574,7 +1983,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1596,24 +2005,229 @@ public:
 
 
 
+/** A new block as relayed to peers that likely have its transactions in
+ * their memory pool already: the header, salted short ids of the
+ * transactions, and in full the ones no memory pool has, the coinbase
+ * and the coinstake.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;                         // with the signature, without the transactions
+    uint64_t nKey;                         // salts the short ids, picked on each relay
+    std::vector<CTransaction> vPrefilled;  // the first transactions of the block
+    std::vector<uint64_t> vShortIds;       // the rest of them
 
+    CCompactBlock()
+    {
+        nKey = 0;
+    }
 
+    explicit CCompactBlock(const CBlock& block)
+    {
+        header.nVersion = block.nVersion;
+        header.hashPrevBlock = block.hashPrevBlock;
+        header.hashMerkleRoot = block.hashMerkleRoot;
+        header.nTime = block.nTime;
+        header.nBits = block.nBits;
+        header.nNonce = block.nNonce;
+        header.vchBlockSig = block.vchBlockSig;
+        nKey = GetRand(std::numeric_limits<uint64_t>::max());
 
+        unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            if (i < nPrefilled)
+                vPrefilled.push_back(block.vtx[i]);
+            else
+                vShortIds.push_back(GetShortId(block.vtx[i].GetHash()));
+        }
+    }
 
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nKey);
+        READWRITE(vPrefilled);
+        READWRITE(vShortIds);
+    )
+
+    uint64_t GetShortId(const uint256& hashTx) const
+    {
+        return Hash(BEGIN(nKey), END(nKey), hashTx.begin(), hashTx.end()).Get64() & 0xffffffffffffULL;
+    }
+};
+
+
+
+
+
+
+
+
+/** Output spent by a memory pool transaction, as resolved when it was accepted */
+class CTxMemPoolPrevOut
+{
+public:
+    CTxOut txout;
+    CBlockIndex* pindex;      // block holding it, NULL while it is in the pool too
+    uint32_t nTime;           // timestamp of the transaction holding it
+    bool fCoinBase;           // coinbase or coinstake, spendable once matured
+
+    CTxMemPoolPrevOut()
+    {
+        pindex = NULL;
+        nTime = 0;
+        fCoinBase = false;
+    }
+
+    CTxMemPoolPrevOut(const CTransaction& txPrev, unsigned int n, CBlockIndex* pindexIn)
+    {
+        txout = txPrev.vout[n];
+        pindex = pindexIn;
+        nTime = txPrev.nTime;
+        fCoinBase = txPrev.IsCoinBase() || txPrev.IsCoinStake();
+    }
+
+    // Still where it was found, index entries are never freed
+    bool IsConfirmed() const { return pindex && pindex->IsInMainChain(); }
+};
+
+/** Cached facts about a memory pool transaction. Its package is the transaction
+ * together with its ancestors still in the pool, which a block has to take along.
+ * Its descendants are what has to go along when it is evicted.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;
+    unsigned int nTxSize;
+    int64_t nTime;            // when it entered the pool
+    int nHeight;              // best height when it entered the pool
+    int64_t nFeesWithAncestors;
+    uint64_t nSizeWithAncestors;
+    unsigned int nCountWithAncestors;
+    int64_t nFeesWithDescendants;
+    uint64_t nSizeWithDescendants;
+    unsigned int nCountWithDescendants;
+    size_t nUsage;            // heap memory taken in the pool
+    std::vector<CTxMemPoolPrevOut> vPrevOuts; // one per input, empty if they weren't resolved
+    int nPriorityHeight;      // best height when dPrioritySum was computed
+    double dPrioritySum;      // sum(valuein * age) of the confirmed inputs at nPriorityHeight
+    int64_t nValueConfirmed;  // value of the confirmed inputs
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nTime = 0;
+        nHeight = 0;
+        nFeesWithAncestors = 0;
+        nSizeWithAncestors = 0;
+        nCountWithAncestors = 0;
+        nFeesWithDescendants = 0;
+        nSizeWithDescendants = 0;
+        nCountWithDescendants = 0;
+        nUsage = 0;
+        nPriorityHeight = 0;
+        dPrioritySum = 0;
+        nValueConfirmed = 0;
+    }
+
+    CTxMemPoolEntry(int64_t nFeeIn, unsigned int nTxSizeIn, int64_t nTimeIn, int nHeightIn)
+    {
+        nFee = nFeeIn;
+        nTxSize = nTxSizeIn;
+        nTime = nTimeIn;
+        nHeight = nHeightIn;
+        nFeesWithAncestors = nFee;
+        nSizeWithAncestors = nTxSize;
+        nCountWithAncestors = 1;
+        nFeesWithDescendants = nFee;
+        nSizeWithDescendants = nTxSize;
+        nCountWithDescendants = 1;
+        nUsage = 0;
+        nPriorityHeight = nHeight;
+        dPrioritySum = 0;
+        nValueConfirmed = 0;
+    }
+
+    // Fees per kilobyte
+    double GetFeeRate() const { return nFee * 1000.0 / nTxSize; }
+    double GetAncestorFeeRate() const { return nFeesWithAncestors * 1000.0 / nSizeWithAncestors; }
+    double GetDescendantFeeRate() const { return nFeesWithDescendants * 1000.0 / nSizeWithDescendants; }
+
+    // Priority is sum(valuein * age) / txsize, each confirmed input gets older by one per block
+    double GetPriority(int nBestHeight) const
+    {
+        return (dPrioritySum + (double)nValueConfirmed * (nBestHeight - nPriorityHeight)) / nTxSize;
+    }
+
+    // Sum up the confirmed inputs among vPrevOuts
+    void ComputePriority(int nBestHeight)
+    {
+        nPriorityHeight = nBestHeight;
+        dPrioritySum = 0;
+        nValueConfirmed = 0;
+        for (unsigned int i = 0; i < vPrevOuts.size(); i++)
+            if (vPrevOuts[i].IsConfirmed())
+                AddConfirmedInput(vPrevOuts[i].txout.nValue, vPrevOuts[i].pindex->nHeight);
+    }
+
+    // An input included in the block at nBlockHeight, one confirmation there
+    void AddConfirmedInput(int64_t nValue, int nBlockHeight)
+    {
+        dPrioritySum += (double)nValue * (1 + nPriorityHeight - nBlockHeight);
+        nValueConfirmed += nValue;
+    }
+};
 
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    typedef boost::unordered_map<uint256, CTransaction, SaltedHasher> TxMap;
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, SaltedHasher> EntryMap;
+
+    TxMap mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Entries and the indexes over them, lowest first
+    EntryMap mapEntry;
+    std::set<std::pair<double, uint256> > setByFeeRate;
+    std::set<std::pair<int64_t, uint256> > setByTime;
+    std::set<std::pair<double, uint256> > setByAncestorFeeRate;
+    std::set<std::pair<double, uint256> > setByDescendantFeeRate;
+    uint64_t nTotalTxSize;
+    uint64_t nTotalUsage;
+
+    CTxMemPool()
+    {
+        nTotalTxSize = 0;
+        nTotalUsage = 0;
+    }
+
+    // With pvChecks, the signature checks are handed to the caller instead of
+    // being done, who must remove the transaction again if they fail
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(CTransaction &tx);
+                bool fCheckInputs, bool* pfMissingInputs,
+                std::vector<CScriptCheck>* pvChecks = NULL);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee = 0,
+                      const std::vector<CTxMemPoolPrevOut>& vPrevOuts = std::vector<CTxMemPoolPrevOut>());
+    // With pindexBlock, the transaction was included in that block and its
+    // spenders in the pool get it as a confirmed input
+    bool remove(CTransaction &tx, CBlockIndex* pindexBlock = NULL);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void queryAncestors(const uint256& hash, std::vector<uint256>& vAncestors);
+    // False, with the reason, if adding tx would break the package limits
+    bool CheckPackageLimits(const CTransaction& tx, unsigned int nSize, std::string& strReason);
+    void queryDescendants(const uint256& hash, std::vector<uint256>& vDescendants);
+    unsigned int removeWithDescendants(const uint256& hash);
+    unsigned int TrimToSize(uint64_t nSizeLimit);
+    unsigned int Expire(int64_t nTime);
+    void SetEntryTime(const uint256& hash, int64_t nTime);
+    void SetPrevOuts(const uint256& hash, const std::vector<CTxMemPoolPrevOut>& vPrevOuts, int nBestHeight);
 
     size_t size()
     {
@@ -0,0 +1,89 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+#include "util.h"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+using namespace std;
+
+struct CMetricInfo
+{
+    const char* pszName;
+    const char* pszType;
+    const char* pszHelp;
+    double dScale;      // from the stored value to the exported unit
+};
+
+static const CMetricInfo metricInfo[METRIC_MAX] =
+{
+    { "fortytwo_block_height",               "gauge",   "Height of the best chain",                      1.0 },
+    { "fortytwo_block_time_seconds",         "gauge",   "Timestamp of the best block",                   1.0 },
+    { "fortytwo_blocks_connected_total",     "counter", "Blocks connected to the best chain",            1.0 },
+    { "fortytwo_block_connect_seconds_total","counter", "Time spent connecting blocks",                  0.000001 },
+    { "fortytwo_last_block_connect_seconds", "gauge",   "Time taken to connect the last block",          0.000001 },
+    { "fortytwo_mempool_transactions",       "gauge",   "Transactions in the memory pool",               1.0 },
+    { "fortytwo_mempool_bytes",              "gauge",   "Serialized size of the memory pool",            1.0 },
+    { "fortytwo_peers_inbound",              "gauge",   "Inbound peer connections",                      1.0 },
+    { "fortytwo_peers_outbound",             "gauge",   "Outbound peer connections",                     1.0 },
+    { "fortytwo_txindex_cache_hits_total",   "counter", "Transaction index lookups served by the cache", 1.0 },
+    { "fortytwo_txindex_cache_misses_total", "counter", "Transaction index lookups read from disk",      1.0 },
+};
+
+// On the heap, metrics are still updated by threads running at exit
+static boost::mutex* pmutexMetrics = NULL;
+static int64_t* pnMetrics = NULL;
+static boost::once_flag metricsInitFlag = BOOST_ONCE_INIT;
+
+static void InitMetrics()
+{
+    pmutexMetrics = new boost::mutex();
+    pnMetrics = new int64_t[METRIC_MAX]();
+}
+
+void SetMetric(metricId id, int64_t nValue)
+{
+    boost::call_once(InitMetrics, metricsInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexMetrics);
+    pnMetrics[id] = nValue;
+}
+
+void AddMetric(metricId id, int64_t nValue)
+{
+    boost::call_once(InitMetrics, metricsInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexMetrics);
+    pnMetrics[id] += nValue;
+}
+
+void AppendMetric(string& strOut, const string& strName, const char* pszType, const char* pszHelp,
+                  double dValue, const string& strLabels)
+{
+    if (pszHelp)
+    {
+        strOut += "# HELP " + strName + " " + pszHelp + "\n";
+        strOut += "# TYPE " + strName + " " + pszType + "\n";
+    }
+    strOut += strName;
+    if (!strLabels.empty())
+        strOut += "{" + strLabels + "}";
+    strOut += strprintf(" %.17g\n", dValue);
+}
+
+string FormatMetrics()
+{
+    boost::call_once(InitMetrics, metricsInitFlag);
+    int64_t vnMetrics[METRIC_MAX];
+    {
+        boost::mutex::scoped_lock lock(*pmutexMetrics);
+        for (int i = 0; i < METRIC_MAX; i++)
+            vnMetrics[i] = pnMetrics[i];
+    }
+
+    string strOut;
+    for (int i = 0; i < METRIC_MAX; i++)
+        AppendMetric(strOut, metricInfo[i].pszName, metricInfo[i].pszType, metricInfo[i].pszHelp, vnMetrics[i] * metricInfo[i].dScale);
+    return strOut;
+}
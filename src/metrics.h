@@ -0,0 +1,41 @@
+// Copyright (c) 2016 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+/** Counters and gauges of the node, kept up to date by the code they describe
+ *  so that the /metrics endpoint reads them without taking cs_main, mempool.cs
+ *  or cs_vNodes. Times are kept in microseconds. */
+enum metricId
+{
+    METRIC_BLOCK_HEIGHT,
+    METRIC_BLOCK_TIME,
+    METRIC_BLOCKS_CONNECTED,
+    METRIC_BLOCK_CONNECT_TIME,
+    METRIC_LAST_BLOCK_CONNECT_TIME,
+    METRIC_MEMPOOL_TRANSACTIONS,
+    METRIC_MEMPOOL_BYTES,
+    METRIC_PEERS_INBOUND,
+    METRIC_PEERS_OUTBOUND,
+    METRIC_TXINDEX_CACHE_HITS,
+    METRIC_TXINDEX_CACHE_MISSES,
+
+    METRIC_MAX
+};
+
+void SetMetric(metricId id, int64_t nValue);
+void AddMetric(metricId id, int64_t nValue);
+
+/** Appends one sample in the Prometheus text format, preceded by its HELP and
+ *  TYPE lines unless pszHelp is NULL, for the further samples of a family */
+void AppendMetric(std::string& strOut, const std::string& strName, const char* pszType, const char* pszHelp,
+                  double dValue, const std::string& strLabels = "");
+
+/** The metrics above in the Prometheus text format */
+std::string FormatMetrics();
+
+#endif
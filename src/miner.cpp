@@ -8,6 +8,10 @@
 #include "miner.h"
 #include "kernel.h"
 #include "kernel_worker.h"
+#include "checkqueue.h"
+#include "walletdb.h"
+
+#include <cmath>
 
 using namespace std;
 
@@ -19,6 +23,7 @@ using namespace std;
 int64_t nReserveBalance = 0;
 static unsigned int nMaxStakeSearchInterval = 60;
 uint64_t nStakeInputsMapSize = 0;
+int nStakeScanThreads = 0;
 
 int static FormatHashBlocks(void* pbuffer, unsigned int len)
 {
@@ -56,19 +61,183 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
+// What CreateNewBlock needs to know about a memory pool transaction. The inputs
+// are looked up once, when the transaction enters the pool or one of its memory
+// pool parents leaves it. The priority is kept by the memory pool entry, where a
+// new block on top only ages the confirmed inputs.
+class CTemplateTx
+{
+public:
+    uint256 hash;
+    bool fComputed;           // inputs have been looked up
+    bool fScriptsChecked;     // connected once already, signatures are good for any tip
+    unsigned int nTxSize;
+    unsigned int nLegacySigOps;
+    int nP2SHSigOps;          // -1 until counted, the outputs spent never change
+    double dFeePerKb;
+    set<uint256> setDependsOn; // memory pool transactions this one spends from
+
+    CTemplateTx(const uint256& hashIn = 0)
+    {
+        hash = hashIn;
+        fComputed = fScriptsChecked = false;
+        nTxSize = nLegacySigOps = 0;
+        nP2SHSigOps = -1;
+        dFeePerKb = 0;
+    }
+
+    double GetPriority(int nBestHeight) const
+    {
+        CTxMemPool::EntryMap::const_iterator mi = mempool.mapEntry.find(hash);
+        return mi == mempool.mapEntry.end() ? 0 : mi->second.GetPriority(nBestHeight);
+    }
+};
+
+// Block template state, kept in step with the memory pool and guarded by mempool.cs
+static map<uint256, CTemplateTx> mapTemplateTx;
+static map<uint256, set<uint256> > mapTemplateDependers;
+static uint256 hashTemplateBest = 0;
+
+// Forget the inputs of a template transaction, they are looked up again on the next block
+static void ResetTemplateTx(CTemplateTx& entry)
+{
+    BOOST_FOREACH(const uint256& hashParent, entry.setDependsOn)
+    {
+        map<uint256, set<uint256> >::iterator mi = mapTemplateDependers.find(hashParent);
+        if (mi == mapTemplateDependers.end())
+            continue;
+        mi->second.erase(entry.hash);
+        if (mi->second.empty())
+            mapTemplateDependers.erase(mi);
+    }
+    entry.setDependsOn.clear();
+    entry.fComputed = false;
+}
+
+void BlockTemplateAddTx(const uint256& hash)
+{
+    if (!mapTemplateTx.count(hash))
+        mapTemplateTx.insert(make_pair(hash, CTemplateTx(hash)));
+}
+
+void BlockTemplateRemoveTx(const uint256& hash)
+{
+    map<uint256, CTemplateTx>::iterator it = mapTemplateTx.find(hash);
+    if (it != mapTemplateTx.end())
+    {
+        ResetTemplateTx(it->second);
+        mapTemplateTx.erase(it);
+    }
+
+    // Its spenders now have an input in the chain, or none at all
+    map<uint256, set<uint256> >::iterator mi = mapTemplateDependers.find(hash);
+    if (mi == mapTemplateDependers.end())
+        return;
+    set<uint256> setDependers;
+    setDependers.swap(mi->second);
+    mapTemplateDependers.erase(mi);
+    BOOST_FOREACH(const uint256& hashDepender, setDependers)
+    {
+        it = mapTemplateTx.find(hashDepender);
+        if (it != mapTemplateTx.end())
+            ResetTemplateTx(it->second);
+    }
+}
+
+void BlockTemplateClear()
+{
+    mapTemplateTx.clear();
+    mapTemplateDependers.clear();
+}
+
+// Look up the inputs of a template transaction, false if some are missing. The
+// inputs the memory pool resolved on acceptance are used while they still hold,
+// the others are read from disk and handed back to the pool entry.
+static bool ComputeTemplateTx(CTxDB& txdb, const CTransaction& tx, CTemplateTx& entry, int nBestHeight)
+{
+    vector<CTxMemPoolPrevOut> vPrevOuts;
+    CTxMemPool::EntryMap::const_iterator me = mempool.mapEntry.find(entry.hash);
+    if (me != mempool.mapEntry.end() && me->second.vPrevOuts.size() == tx.vin.size())
+        vPrevOuts = me->second.vPrevOuts;
+    else
+        vPrevOuts.resize(tx.vin.size());
+    bool fUpdated = false;
+
+    int64_t nTotalIn = 0;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CTxIn& txin = tx.vin[i];
+
+        // Has to wait for dependencies
+        CTxMemPool::TxMap::iterator mi = mempool.mapTx.find(txin.prevout.hash);
+        if (mi != mempool.mapTx.end())
+        {
+            if (entry.setDependsOn.insert(txin.prevout.hash).second)
+                mapTemplateDependers[txin.prevout.hash].insert(entry.hash);
+            nTotalIn += mi->second.vout[txin.prevout.n].nValue;
+            if (vPrevOuts[i].txout.IsNull())
+            {
+                vPrevOuts[i] = CTxMemPoolPrevOut(mi->second, txin.prevout.n, NULL);
+                fUpdated = true;
+            }
+            continue;
+        }
+
+        int64_t nValueIn;
+        if (vPrevOuts[i].IsConfirmed())
+            nValueIn = vPrevOuts[i].txout.nValue;
+        else
+        {
+            // Read prev transaction
+            CTransaction txPrev;
+            CTxIndex txindex;
+            if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+            {
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                printf("ERROR: mempool transaction missing input\n");
+                if (fDebug) assert("mempool transaction missing input" == 0);
+                ResetTemplateTx(entry);
+                return false;
+            }
+            nValueIn = txPrev.vout[txin.prevout.n].nValue;
+
+            // The parent got mined or the chain moved, keep what was found
+            vPrevOuts[i] = CTxMemPoolPrevOut(txPrev, txin.prevout.n, FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos));
+            fUpdated = true;
+        }
+        nTotalIn += nValueIn;
+    }
+
+    // The pool entry sums up the priority of what was found
+    if (fUpdated)
+        mempool.SetPrevOuts(entry.hash, vPrevOuts, nBestHeight);
+
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    entry.nLegacySigOps = tx.GetLegacySigOpCount();
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    entry.dFeePerKb = double(nTotalIn-tx.GetValueOut()) / (double(entry.nTxSize)/1000.0);
+    entry.fComputed = true;
+    return true;
+}
+
+// Template transaction waiting for its memory pool parents to be added to the block
 class COrphan
 {
 public:
     CTransaction* ptx;
+    CTemplateTx* pentry;
     set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(CTransaction* ptxIn, CTemplateTx* pentryIn)
     {
         ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        pentry = pentryIn;
+        setDependsOn = pentry->setDependsOn;
     }
 };
 
@@ -78,7 +247,7 @@ uint64_t nLastBlockSize = 0;
 uint32_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, CTransaction*, CTemplateTx*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -176,6 +345,17 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
         CBlockIndex* pindexPrev = pindexBest;
         CTxDB txdb("r");
 
+        // Confirmed inputs only get older while the chain grows, a reorganization
+        // changes their depths in ways only a fresh look tells
+        if (hashTemplateBest != pindexPrev->GetBlockHash())
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(hashTemplateBest);
+            if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+                for (map<uint256, CTemplateTx>::iterator it = mapTemplateTx.begin(); it != mapTemplateTx.end(); ++it)
+                    ResetTemplateTx(it->second);
+            hashTemplateBest = pindexPrev->GetBlockHash();
+        }
+
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
@@ -183,72 +363,28 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (CTxMemPool::TxMap::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
             if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            map<uint256, CTemplateTx>::iterator it = mapTemplateTx.find(mi->first);
+            if (it == mapTemplateTx.end())
+                it = mapTemplateTx.insert(make_pair(mi->first, CTemplateTx(mi->first))).first;
+            CTemplateTx& entry = it->second;
+            if (!entry.fComputed && !ComputeTemplateTx(txdb, tx, entry, pindexPrev->nHeight))
+                continue;
 
-            if (porphan)
+            if (!entry.setDependsOn.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                vOrphan.push_back(COrphan(&tx, &entry));
+                COrphan* porphan = &vOrphan.back();
+                BOOST_FOREACH(const uint256& hashParent, entry.setDependsOn)
+                    mapDependers[hashParent].push_back(porphan);
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(entry.GetPriority(pindexPrev->nHeight), entry.dFeePerKb, &tx, &entry));
         }
 
         // Collect transactions into block
@@ -267,17 +403,18 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
             CTransaction& tx = *(vecPriority.front().get<2>());
+            CTemplateTx& entry = *(vecPriority.front().get<3>());
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = entry.nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
             // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+            unsigned int nTxSigOps = entry.nLegacySigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -314,13 +451,16 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
                 continue;
 
             // Sigops accumulation
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+            if (entry.nP2SHSigOps < 0)
+                entry.nP2SHSigOps = tx.GetP2SHSigOpCount(mapInputs);
+            nTxSigOps += entry.nP2SHSigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, !entry.fScriptsChecked, MANDATORY_SCRIPT_VERIFY_FLAGS))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+            entry.fScriptsChecked = true;
+            mapTestPoolTmp[entry.hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
             swap(mapTestPool, mapTestPoolTmp);
 
             // Added
@@ -333,11 +473,11 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
             if (fDebug && GetBoolArg("-printpriority"))
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       dPriority, dFeePerKb, entry.hash.ToString().c_str());
             }
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
+            const uint256& hash = entry.hash;
             if (mapDependers.count(hash))
             {
                 BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
@@ -347,7 +487,7 @@ CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txCoinStake)
                         porphan->setDependsOn.erase(hash);
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                            vecPriority.push_back(TxPriority(porphan->pentry->GetPriority(pindexPrev->nHeight), porphan->pentry->dFeePerKb, porphan->ptx, porphan->pentry));
                             std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                         }
                     }
@@ -398,6 +538,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].ClearCache();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -517,20 +658,332 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
             wallet.mapRequestCount[hashBlock] = 0;
         }
 
+        // Let the fastest peers have it while the block is being connected
+        if (!RelayStakedBlock(pblock))
+            return error("CheckStake() : RelayStakedBlock, block not valid");
+
         // Process this block the same as if we had received it from another node
-        if (!ProcessBlock(NULL, pblock))
+        if (!ProcessBlock(NULL, pblock, true))
             return error("CheckStake() : ProcessBlock, block not accepted");
     }
 
     return true;
 }
 
-// Precalculated SHA256 contexts and metadata
-// (txid, vout.n) => (kernel, (tx.nTime, nAmount))
-typedef std::map<std::pair<uint256, unsigned int>, std::pair<std::vector<unsigned char>, std::pair<uint32_t, uint64_t> > > MidstateMap;
+/** Precalculated kernels and metadata of the stake inputs.
+ *  Kernels, timestamps and amounts are kept in the contiguous arrays, so
+ *  scanning streams through memory instead of chasing the map nodes.
+ *  Entries are addressed by position, (txid, vout.n) index is used only
+ *  for lookups and the removal of inputs. Coinstake skeletons are kept
+ *  aside of the scanned arrays, they are read only for a found kernel.
+ */
+class CMidstateMap
+{
+public:
+    typedef std::pair<uint256, unsigned int> key_type;
+
+    // Static part of kernel: stake modifier, block time, tx offset, tx time and vout.n
+    static const unsigned int KERNEL_SIZE = 24;
+
+private:
+    std::vector<key_type> vKeys;
+    std::vector<unsigned char> vKernels;
+    std::vector<uint32_t> vTime;
+    std::vector<int64_t> vValue;
+    std::vector<uint256> vTargetPerSecond;
+    std::vector<CCoinStakeSkeleton> vSkeletons;
+    std::map<key_type, unsigned int> mapIndex;
+
+    // Difficulty the targets have been calculated for
+    uint32_t nTargetBits;
+
+    // Remove entry at the given position, the last entry takes its place
+    void erase_at(unsigned int nPos)
+    {
+        unsigned int nLast = vKeys.size() - 1;
+        if (nPos != nLast)
+        {
+            vKeys[nPos] = vKeys[nLast];
+            memcpy(&vKernels[nPos * KERNEL_SIZE], &vKernels[nLast * KERNEL_SIZE], KERNEL_SIZE);
+            vTime[nPos] = vTime[nLast];
+            vValue[nPos] = vValue[nLast];
+            vTargetPerSecond[nPos] = vTargetPerSecond[nLast];
+            vSkeletons[nPos] = vSkeletons[nLast];
+            mapIndex[vKeys[nPos]] = nPos;
+        }
+
+        vKeys.pop_back();
+        vKernels.resize(nLast * KERNEL_SIZE);
+        vTime.pop_back();
+        vValue.pop_back();
+        vTargetPerSecond.pop_back();
+        vSkeletons.pop_back();
+    }
+
+public:
+    CMidstateMap() : nTargetBits(0) { }
+
+    size_t size() const { return vKeys.size(); }
+    bool empty() const { return vKeys.empty(); }
+    bool count(const key_type &key) const { return mapIndex.count(key) > 0; }
+
+    const key_type &key(unsigned int nPos) const { return vKeys[nPos]; }
+    const unsigned char *kernel(unsigned int nPos) const { return &vKernels[nPos * KERNEL_SIZE]; }
+    uint32_t time(unsigned int nPos) const { return vTime[nPos]; }
+    int64_t value(unsigned int nPos) const { return vValue[nPos]; }
+    const uint256 &target(unsigned int nPos) const { return vTargetPerSecond[nPos]; }
+    const CCoinStakeSkeleton &skeleton(unsigned int nPos) const { return vSkeletons[nPos]; }
+
+    // Skeleton of the given input, NULL if there is no such input
+    const CCoinStakeSkeleton *skeleton(const key_type &key) const
+    {
+        std::map<key_type, unsigned int>::const_iterator mi = mapIndex.find(key);
+        return mi == mapIndex.end() ? NULL : &vSkeletons[mi->second];
+    }
+
+    // Recalculate per input targets if difficulty has been changed
+    void SetBits(uint32_t nBits)
+    {
+        if (nBits == nTargetBits)
+            return;
+
+        nTargetBits = nBits;
+        for (unsigned int nPos = 0; nPos < vValue.size(); nPos++)
+            vTargetPerSecond[nPos] = GetStakeTargetPerSecond(nBits, vValue[nPos]);
+    }
+
+    void clear()
+    {
+        vKeys.clear();
+        vKernels.clear();
+        vTime.clear();
+        vValue.clear();
+        vTargetPerSecond.clear();
+        vSkeletons.clear();
+        mapIndex.clear();
+    }
+
+    // (txid, vout.n) => (kernel, tx.nTime, nAmount, coinstake skeleton)
+    bool insert(const key_type &key, const std::vector<unsigned char> &kernel, uint32_t nTime, int64_t nValue, const CCoinStakeSkeleton &skeleton)
+    {
+        if (kernel.size() != KERNEL_SIZE || count(key))
+            return false;
+
+        mapIndex[key] = vKeys.size();
+        vKeys.push_back(key);
+        vKernels.insert(vKernels.end(), kernel.begin(), kernel.end());
+        vTime.push_back(nTime);
+        vValue.push_back(nValue);
+        vTargetPerSecond.push_back(nTargetBits ? GetStakeTargetPerSecond(nTargetBits, nValue) : uint256(0));
+        vSkeletons.push_back(skeleton);
+
+        return true;
+    }
+
+    // Approximate heap memory held by the map, the index nodes counted
+    //   with four pointers of allocator and tree overhead each
+    size_t MemoryUsage() const
+    {
+        size_t nUsage = vKeys.capacity() * sizeof(key_type) + vKernels.capacity() + vTime.capacity() * sizeof(uint32_t) +
+            vValue.capacity() * sizeof(int64_t) + vTargetPerSecond.capacity() * sizeof(uint256) +
+            vSkeletons.capacity() * sizeof(CCoinStakeSkeleton) +
+            mapIndex.size() * (sizeof(std::pair<const key_type, unsigned int>) + 4 * sizeof(void*));
+        for (unsigned int nPos = 0; nPos < vSkeletons.size(); nPos++)
+            nUsage += vSkeletons[nPos].scriptPubKeyKernel.capacity() + vSkeletons[nPos].scriptPubKeyOut.capacity();
+        return nUsage;
+    }
+
+    void erase(const key_type &key)
+    {
+        std::map<key_type, unsigned int>::iterator mi = mapIndex.find(key);
+        if (mi == mapIndex.end())
+            return;
+
+        unsigned int nPos = mi->second;
+        mapIndex.erase(mi);
+        erase_at(nPos);
+    }
+
+    // Remove all outputs of the given transaction
+    void erase(const uint256 &hash)
+    {
+        std::map<key_type, unsigned int>::iterator mi = mapIndex.lower_bound(make_pair(hash, 0U));
+        while (mi != mapIndex.end() && mi->first.first == hash)
+        {
+            unsigned int nPos = mi->second;
+            mapIndex.erase(mi++);
+            erase_at(nPos);
+        }
+    }
+};
+
+typedef CMidstateMap MidstateMap;
+
+static CCriticalSection cs_StakeMinerStats;
+static CStakeMinerStats stakeMinerStats;
+
+CStakeMinerStats GetStakeMinerStats()
+{
+    LOCK(cs_StakeMinerStats);
+    return stakeMinerStats;
+}
+
+// Account for the time spent in FillMap or UpdateMap
+static void UpdateMapStats(bool fFull, int64_t nStart, int64_t nLockWait)
+{
+    LOCK(cs_StakeMinerStats);
+    if (fFull)
+        stakeMinerStats.nFills++;
+    else
+        stakeMinerStats.nUpdates++;
+    stakeMinerStats.nLastFillTime = GetTimeMicros() - nStart;
+    stakeMinerStats.nLastLockWaitTime = nLockWait;
+    stakeMinerStats.nLockWaitTime += nLockWait;
+}
+
+// State of one stake miner thread, each wallet has a miner of its own
+class CStakeMinerState
+{
+public:
+    // Kernels calculated during previous runs of the stake miner
+    CStakeKernelCache kernelCache;
+    int64_t nLastKernelCacheWrite;
+    // Outputs which aren't suitable for staking yet, but may become so later
+    std::set<std::pair<uint256, unsigned int> > setPendingInputs;
+    uint32_t nLastCoinStakeSearchTime;
+    // This miner's part of nStakeInputsMapSize
+    uint64_t nMapSize;
+
+    CStakeMinerState() : nLastKernelCacheWrite(0), nLastCoinStakeSearchTime(GetAdjustedTime()), nMapSize(0) { }
+
+    void SetMapSize(uint64_t nSize)
+    {
+        LOCK(cs_StakeMinerStats);
+        nStakeInputsMapSize += nSize - nMapSize;
+        nMapSize = nSize;
+    }
+};
+
+// Load kernel cache from the wallet file
+void ReadKernelCache(CWallet *pwallet, CStakeMinerState &state)
+{
+    if (!pwallet->fFileBacked)
+        return;
+
+    if (!CWalletDB(pwallet->strWalletFile).ReadStakeKernelCache(state.kernelCache))
+        state.kernelCache.SetNull();
+
+    state.nLastKernelCacheWrite = GetTime();
+
+    if (fDebug)
+        printf("ReadKernelCache() : %" PRIszu " precalculated kernels have been loaded\n", state.kernelCache.mapKernels.size());
+}
+
+// Save kernels of the current inputs map into the wallet file
+void WriteKernelCache(CWallet *pwallet, CStakeMinerState &state, const MidstateMap &inputsMap)
+{
+    if (!pwallet->fFileBacked)
+        return;
+
+    // Forget kernels of the inputs which are not used anymore
+    for (std::map<std::pair<uint256, unsigned int>, std::pair<uint256, std::vector<unsigned char> > >::iterator it = state.kernelCache.mapKernels.begin(); it != state.kernelCache.mapKernels.end(); )
+    {
+        if (inputsMap.count(it->first))
+            it++;
+        else
+            state.kernelCache.mapKernels.erase(it++);
+    }
+
+    CWalletDB(pwallet->strWalletFile).WriteStakeKernelCache(state.kernelCache);
+    state.nLastKernelCacheWrite = GetTime();
+}
+
+enum StakeInputStatus
+{
+    STAKE_INPUT_ADDED,   // kernel has been added to the map
+    STAKE_INPUT_PENDING, // output may become usable later, e.g. after reaching min age
+    STAKE_INPUT_INVALID, // output can't be used for staking
+};
+
+// Calculate kernel of the given output and add it to inputs map
+static StakeInputStatus AddInput(CTxDB &txdb, CWallet *pwallet, CStakeMinerState &state, const CWalletTx *pcoin, unsigned int n, uint32_t nTime, MidstateMap &inputsMap, unsigned int &nCalculated)
+{
+    pair<uint256, uint32_t> key = make_pair(pcoin->GetHash(), n);
+
+    // Skip existent inputs
+    if (inputsMap.count(key))
+        return STAKE_INPUT_ADDED;
+
+    // Trying to parse scriptPubKey
+    txnouttype whichType;
+    vector<valtype> vSolutions;
+    if (!Solver(pcoin->vout[n].scriptPubKey, whichType, vSolutions))
+        return STAKE_INPUT_INVALID;
+
+    // Only support pay to public key and pay to address
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        return STAKE_INPUT_INVALID;
+
+    // Resolve the key and output script now, so a found kernel only needs to be signed
+    CCoinStakeSkeleton skeleton;
+    if (!pwallet->PrepareCoinStake(*pcoin, n, skeleton))
+        return STAKE_INPUT_INVALID;
+
+    // Try to use the previously calculated kernel
+    std::map<std::pair<uint256, unsigned int>, std::pair<uint256, std::vector<unsigned char> > >::const_iterator cached = state.kernelCache.mapKernels.find(key);
+    if (cached != state.kernelCache.mapKernels.end())
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(cached->second.first);
+        if (mi != mapBlockIndex.end() && mi->second->IsInMainChain())
+        {
+            // Only load coins meeting min age requirement
+            if (nStakeMinAge + mi->second->nTime > nTime - nMaxStakeSearchInterval)
+                return STAKE_INPUT_PENDING;
+
+            if (!inputsMap.insert(key, cached->second.second, pcoin->nTime, pcoin->vout[n].nValue, skeleton))
+                return STAKE_INPUT_INVALID;
+
+            return STAKE_INPUT_ADDED;
+        }
+    }
+
+    CTxIndex txindex;
+
+    // Load transaction index item
+    if (!txdb.ReadTxIndex(pcoin->GetHash(), txindex))
+        return STAKE_INPUT_PENDING;
+
+    // Find block header
+    const CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexFrom)
+        return STAKE_INPUT_PENDING;
+
+    // Only load coins meeting min age requirement
+    if (nStakeMinAge + pindexFrom->nTime > nTime - nMaxStakeSearchInterval)
+        return STAKE_INPUT_PENDING;
+
+    // Get stake modifier
+    uint64_t nStakeModifier = 0;
+    if (!GetKernelStakeModifier(pindexFrom->GetBlockHash(), nStakeModifier))
+        return STAKE_INPUT_PENDING;
+
+    // Build static part of kernel
+    CDataStream ssKernel(SER_GETHASH, 0);
+    ssKernel << nStakeModifier;
+    ssKernel << pindexFrom->nTime << (txindex.pos.nTxPos - txindex.pos.nBlockPos) << pcoin->nTime << n;
+
+    std::vector<unsigned char> vchKernel(ssKernel.begin(), ssKernel.end());
+    if (!inputsMap.insert(key, vchKernel, pcoin->nTime, pcoin->vout[n].nValue, skeleton))
+        return STAKE_INPUT_INVALID;
+
+    state.kernelCache.mapKernels[key] = make_pair(pindexFrom->GetBlockHash(), vchKernel);
+    nCalculated++;
+
+    return STAKE_INPUT_ADDED;
+}
 
 // Fill the inputs map with precalculated contexts and metadata
-bool FillMap(CWallet *pwallet, uint32_t nUpperTime, MidstateMap &inputsMap)
+bool FillMap(CWallet *pwallet, CStakeMinerState &state, uint32_t nUpperTime, MidstateMap &inputsMap)
 {
     // Choose coins to use
     int64_t nBalance = pwallet->GetBalance();
@@ -539,10 +992,15 @@ bool FillMap(CWallet *pwallet, uint32_t nUpperTime, MidstateMap &inputsMap)
         return false;
 
     uint32_t nTime = GetAdjustedTime();
+    int64_t nStart = GetTimeMicros();
 
     CTxDB txdb("r");
     {
         LOCK2(cs_main, pwallet->cs_wallet);
+        int64_t nLockWait = GetTimeMicros() - nStart;
+
+        // Full refill makes all previously queued wallet updates obsolete
+        pwallet->setStakeInputsUpdated.clear();
 
         CoinsSet setCoins;
         int64_t nValueIn = 0;
@@ -552,91 +1010,320 @@ bool FillMap(CWallet *pwallet, uint32_t nUpperTime, MidstateMap &inputsMap)
         if (setCoins.empty())
             return false;
 
-        CBlock block;
-        CTxIndex txindex;
+        // Cached kernels are valid only while the chain they were calculated against
+        //   hasn't been reorganized, stake modifiers depend on the following blocks.
+        if (state.kernelCache.hashBestBlock != 0)
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(state.kernelCache.hashBestBlock);
+            if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+                state.kernelCache.SetNull();
+        }
+        state.kernelCache.hashBestBlock = hashBestChain;
+
+        unsigned int nCalculated = 0;
 
         for(CoinsSet::const_iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
+            AddInput(txdb, pwallet, state, pcoin->first, pcoin->second, nTime, inputsMap, nCalculated);
+
+        // Remember the rest of our outputs, they will be examined again on the next blocks
+        state.setPendingInputs.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
         {
-            pair<uint256, uint32_t> key = make_pair(pcoin->first->GetHash(), pcoin->second);
+            const CWalletTx &wtx = it->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                pair<uint256, uint32_t> key = make_pair(it->first, i);
+                if (!wtx.IsSpent(i) && pwallet->IsMine(wtx.vout[i]) == MINE_SPENDABLE && !inputsMap.count(key))
+                    state.setPendingInputs.insert(key);
+            }
+        }
 
-            // Skip existent inputs
-            if (inputsMap.find(key) != inputsMap.end())
-                continue;
+        state.SetMapSize(inputsMap.size());
 
-            // Trying to parse scriptPubKey
-            txnouttype whichType;
-            vector<valtype> vSolutions;
-            if (!Solver(pcoin->first->vout[pcoin->second].scriptPubKey, whichType, vSolutions))
-                continue;
+        // Don't rewrite the cache more often than once per hour
+        if (nCalculated > 0 && GetTime() - state.nLastKernelCacheWrite > 60 * 60)
+            WriteKernelCache(pwallet, state, inputsMap);
 
-            // Only support pay to public key and pay to address
-            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                continue;
+        if (fDebug)
+            printf("FillMap() : Map of %" PRIszu " precalculated contexts has been created by stake miner\n", inputsMap.size());
+
+        UpdateMapStats(true, nStart, nLockWait);
+    }
 
-            // Load transaction index item
-            if (!txdb.ReadTxIndex(pcoin->first->GetHash(), txindex))
+    return true;
+}
+
+// Apply wallet updates to the inputs map and retry the pending outputs
+//   (only valid while whole balance is available for staking and chain hasn't been reorganized)
+bool UpdateMap(CWallet *pwallet, CStakeMinerState &state, uint32_t nUpperTime, MidstateMap &inputsMap)
+{
+    if (pwallet->GetBalance() <= nReserveBalance)
+        return false;
+
+    uint32_t nTime = GetAdjustedTime();
+    int64_t nStart = GetTimeMicros();
+
+    CTxDB txdb("r");
+    {
+        LOCK2(cs_main, pwallet->cs_wallet);
+        int64_t nLockWait = GetTimeMicros() - nStart;
+
+        std::set<uint256> setUpdated;
+        setUpdated.swap(pwallet->setStakeInputsUpdated);
+
+        // Forget about all outputs of the updated transactions, the valid ones will be queued again
+        BOOST_FOREACH(const uint256 &hash, setUpdated)
+        {
+            inputsMap.erase(hash);
+            state.setPendingInputs.erase(state.setPendingInputs.lower_bound(make_pair(hash, 0U)), state.setPendingInputs.upper_bound(make_pair(hash, std::numeric_limits<unsigned int>::max())));
+
+            map<uint256, CWalletTx>::const_iterator mi = pwallet->mapWallet.find(hash);
+            if (mi == pwallet->mapWallet.end())
                 continue;
 
-            // Read block header
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            const CWalletTx &wtx = mi->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                if (!wtx.IsSpent(i) && pwallet->IsMine(wtx.vout[i]) == MINE_SPENDABLE)
+                    state.setPendingInputs.insert(make_pair(hash, i));
+            }
+        }
+
+        state.kernelCache.hashBestBlock = hashBestChain;
+
+        unsigned int nCalculated = 0;
+
+        for (std::set<std::pair<uint256, unsigned int> >::iterator it = state.setPendingInputs.begin(); it != state.setPendingInputs.end(); )
+        {
+            map<uint256, CWalletTx>::const_iterator mi = pwallet->mapWallet.find(it->first);
+            if (mi == pwallet->mapWallet.end())
+            {
+                state.setPendingInputs.erase(it++);
                 continue;
+            }
 
-            // Only load coins meeting min age requirement
-            if (nStakeMinAge + block.nTime > nTime - nMaxStakeSearchInterval)
+            const CWalletTx *pcoin = &mi->second;
+            unsigned int n = it->second;
+
+            // Same rules as in SelectCoinsSimple
+            if (n >= pcoin->vout.size() || pcoin->IsSpent(n) || pcoin->vout[n].nValue < MIN_TX_FEE)
+            {
+                state.setPendingInputs.erase(it++);
                 continue;
+            }
 
-            // Get stake modifier
-            uint64_t nStakeModifier = 0;
-            if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
+            if (!pcoin->IsFinal() || pcoin->GetDepthInMainChain() < nCoinbaseMaturity * 10 || pcoin->GetBlocksToMaturity() > 0 || pcoin->nTime > nUpperTime)
+            {
+                it++;
                 continue;
+            }
+
+            if (AddInput(txdb, pwallet, state, pcoin, n, nTime, inputsMap, nCalculated) == STAKE_INPUT_PENDING)
+                it++;
+            else
+                state.setPendingInputs.erase(it++);
+        }
+
+        state.SetMapSize(inputsMap.size());
 
-            // Build static part of kernel
-            CDataStream ssKernel(SER_GETHASH, 0);
-            ssKernel << nStakeModifier;
-            ssKernel << block.nTime << (txindex.pos.nTxPos - txindex.pos.nBlockPos) << pcoin->first->nTime << pcoin->second;
+        // Don't rewrite the cache more often than once per hour
+        if (nCalculated > 0 && GetTime() - state.nLastKernelCacheWrite > 60 * 60)
+            WriteKernelCache(pwallet, state, inputsMap);
 
-            // (txid, vout.n) => (kernel, (tx.nTime, nAmount))
-            inputsMap[key] = make_pair(std::vector<unsigned char>(ssKernel.begin(), ssKernel.end()), make_pair(pcoin->first->nTime, pcoin->first->vout[pcoin->second].nValue));
+        if (fDebug && (nCalculated > 0 || !setUpdated.empty()))
+            printf("UpdateMap() : %" PRIszu " wallet updates applied, %u new contexts calculated, map size is %" PRIszu "\n", setUpdated.size(), nCalculated, inputsMap.size());
+
+        UpdateMapStats(false, nStart, nLockWait);
+    }
+
+    return !inputsMap.empty();
+}
+
+// Solution shared between the stake scanning threads
+struct CStakeScanResult
+{
+    CCriticalSection cs; // guards all of it, the workers read fFound too
+    bool fFound;
+    MidstateMap::key_type LuckyInput;
+    std::pair<uint256, uint32_t> solution;
+
+    CStakeScanResult() : fFound(false) { }
+};
+
+/** Closure representing the backward kernel scan of a single stake input.
+ *  It returns false once a solution is found, so the queue skips
+ *  the remaining inputs of this pass.
+ */
+class CStakeKernelCheck
+{
+private:
+    MidstateMap::key_type input;
+    unsigned char *kernel;
+    uint32_t nBits;
+    uint32_t nInputTxTime;
+    int64_t nValueIn;
+    uint256 nTargetPerSecond;
+    std::pair<uint32_t, uint32_t> interval;
+    CStakeScanResult *presult;
+
+public:
+    CStakeKernelCheck() : kernel(NULL), presult(NULL) { }
+    CStakeKernelCheck(const MidstateMap &inputsMap, unsigned int nPos, uint32_t nBitsIn, const std::pair<uint32_t, uint32_t> &intervalIn, CStakeScanResult *presultIn) :
+        input(inputsMap.key(nPos)), kernel((unsigned char *) inputsMap.kernel(nPos)), nBits(nBitsIn),
+        nInputTxTime(inputsMap.time(nPos)), nValueIn(inputsMap.value(nPos)), nTargetPerSecond(inputsMap.target(nPos)),
+        interval(intervalIn), presult(presultIn) { }
+
+    bool operator()()
+    {
+        // Another worker has already found a solution
+        {
+            LOCK(presult->cs);
+            if (presult->fFound)
+                return false;
         }
 
-        nStakeInputsMapSize = inputsMap.size();
+        std::pair<uint256, uint32_t> solution;
+        if (!ScanKernelBackward(kernel, nBits, nInputTxTime, nValueIn, nTargetPerSecond, interval, solution))
+            return true;
 
-        if (fDebug)
-            printf("FillMap() : Map of %" PRIu64 " precalculated contexts has been created by stake miner\n", nStakeInputsMapSize);
+        LOCK(presult->cs);
+        if (!presult->fFound)
+        {
+            presult->fFound = true;
+            presult->LuckyInput = input;
+            presult->solution = solution;
+        }
+
+        return false;
     }
 
-    return true;
+    void swap(CStakeKernelCheck &check)
+    {
+        std::swap(input, check.input);
+        std::swap(kernel, check.kernel);
+        std::swap(nBits, check.nBits);
+        std::swap(nInputTxTime, check.nInputTxTime);
+        std::swap(nValueIn, check.nValueIn);
+        std::swap(nTargetPerSecond, check.nTargetPerSecond);
+        std::swap(interval, check.interval);
+        std::swap(presult, check.presult);
+    }
+};
+
+static CCheckQueue<CStakeKernelCheck> stakescanqueue(32);
+// The queue takes one master at a time, and the miners of all wallets share it
+static CCriticalSection cs_stakescanqueue;
+
+void ThreadStakeScan(void*)
+{
+    vnThreadsRunning[THREAD_STAKESCAN]++;
+    RenameThread("42-stakescan");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    stakescanqueue.Thread();
+    vnThreadsRunning[THREAD_STAKESCAN]--;
+}
+
+void ThreadStakeScanQuit()
+{
+    stakescanqueue.Quit();
 }
 
 // Scan inputs map in order to find a solution
-bool ScanMap(const MidstateMap &inputsMap, uint32_t nBits, MidstateMap::key_type &LuckyInput, std::pair<uint256, uint32_t> &solution)
+bool ScanMap(CStakeMinerState &state, MidstateMap &inputsMap, uint32_t nBits, MidstateMap::key_type &LuckyInput, std::pair<uint256, uint32_t> &solution)
 {
-    static uint32_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    PROFILE_SCOPE("ScanMap");
+    uint32_t &nLastCoinStakeSearchTime = state.nLastCoinStakeSearchTime;
     uint32_t nSearchTime = GetAdjustedTime();
 
     if (inputsMap.size() > 0 && nSearchTime > nLastCoinStakeSearchTime)
     {
+        int64_t nPassStart = GetTimeMicros();
+        bool fFound = false;
+
         // Scanning interval (begintime, endtime)
         std::pair<uint32_t, uint32_t> interval;
 
         interval.first = nSearchTime;
         interval.second = nSearchTime - min(nSearchTime-nLastCoinStakeSearchTime, nMaxStakeSearchInterval);
 
-        // (txid, nout) => (kernel, (tx.nTime, nAmount))
-        for(MidstateMap::const_iterator input = inputsMap.begin(); input != inputsMap.end(); input++)
+        // Targets are recalculated only once per difficulty change
+        inputsMap.SetBits(nBits);
+
+        // Number of inputs which are old enough to be hashed in this interval
+        uint64_t nScanned = 0;
+
+        if (nStakeScanThreads)
         {
-            unsigned char *kernel = (unsigned char *) &input->second.first[0];
+            // Split the map across the stake scanning threads,
+            //   this thread joins them as a master worker
+            CStakeScanResult result;
+            std::vector<CStakeKernelCheck> vChecks;
+            vChecks.reserve(inputsMap.size());
+
+            for(unsigned int nPos = 0; nPos < inputsMap.size(); nPos++)
+            {
+                // Don't bother the workers with inputs which are too young for this interval
+                if (inputsMap.time(nPos) + nStakeMinAge >= interval.first)
+                    continue;
+
+                vChecks.push_back(CStakeKernelCheck(inputsMap, nPos, nBits, interval, &result));
+            }
+            nScanned = vChecks.size();
+
+            LOCK(cs_stakescanqueue);
+            CCheckQueueControl<CStakeKernelCheck> control(&stakescanqueue);
+            control.Add(vChecks);
+            control.Wait();
 
-            // scan(State, Bits, Time, Amount, ...)
-            if (ScanKernelBackward(kernel, nBits, input->second.second.first, input->second.second.second, interval, solution))
+            if (result.fFound)
             {
                 // Solution found
-                LuckyInput = input->first; // (txid, nout)
+                LuckyInput = result.LuckyInput; // (txid, nout)
+                solution = result.solution;
+                fFound = true;
+            }
+        }
+        else
+        {
+            // Walk through the kernel, time and amount arrays in order
+            for(unsigned int nPos = 0; nPos < inputsMap.size() && !fFound; nPos++)
+            {
+                unsigned char *kernel = (unsigned char *) inputsMap.kernel(nPos);
 
-                return true;
+                if (inputsMap.time(nPos) + nStakeMinAge < interval.first)
+                    nScanned++;
+
+                // scan(State, Bits, Time, Amount, ...)
+                if (ScanKernelBackward(kernel, nBits, inputsMap.time(nPos), inputsMap.value(nPos), inputsMap.target(nPos), interval, solution))
+                {
+                    // Solution found
+                    LuckyInput = inputsMap.key(nPos); // (txid, nout)
+                    fFound = true;
+                }
             }
         }
 
+        {
+            // Hashes are counted as if every input had been scanned over the whole
+            //   interval, search is interrupted only by solutions and shutdown
+            LOCK(cs_StakeMinerStats);
+            stakeMinerStats.nPasses++;
+            stakeMinerStats.nLastHashes = nScanned * (interval.first - interval.second);
+            stakeMinerStats.nHashes += stakeMinerStats.nLastHashes;
+            stakeMinerStats.nLastPassTime = GetTimeMicros() - nPassStart;
+            stakeMinerStats.nScanTime += stakeMinerStats.nLastPassTime;
+            stakeMinerStats.nLastIntervalRequested = nSearchTime - nLastCoinStakeSearchTime;
+            stakeMinerStats.nLastIntervalCovered = interval.first - interval.second;
+            if (stakeMinerStats.nLastIntervalRequested > stakeMinerStats.nLastIntervalCovered)
+                stakeMinerStats.nOverruns++;
+        }
+
+        if (fFound)
+            return true;
+
+        if (fShutdown)
+            return false;
+
         // Inputs map iteration can be big enough to consume few seconds while scanning.
         // We're using dynamical calculation of scanning interval in order to compensate this delay.
         nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
@@ -647,6 +1334,64 @@ bool ScanMap(const MidstateMap &inputsMap, uint32_t nBits, MidstateMap::key_type
     return false;
 }
 
+// Fill an inputs map with nInputs synthetic outputs and scan it nPasses times
+//   over nInterval seconds, as the stake miner does between two blocks
+bool SimulateStakeMiner(unsigned int nInputs, uint32_t nBits, uint32_t nInterval, unsigned int nPasses, CStakeSimResult &result)
+{
+    CStakeMinerState state;
+    MidstateMap inputsMap;
+    uint32_t nNow = GetAdjustedTime();
+
+    // Fixed pseudo-random sequence, so that runs can be compared. Input ages
+    //   are spread over 60 days past the minimum age, amounts log-uniformly
+    //   between 1 and 10000 coins.
+    uint64_t nRand = 42;
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        std::vector<unsigned char> vchKernel(MidstateMap::KERNEL_SIZE);
+        for (unsigned int j = 0; j < vchKernel.size(); j++)
+        {
+            nRand = nRand * 6364136223846793005ULL + 1442695040888963407ULL;
+            vchKernel[j] = (unsigned char)(nRand >> 56);
+        }
+        nRand = nRand * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t nAge = nStakeMinAge + (uint32_t)((nRand >> 32) % (60 * nOneDay));
+        nRand = nRand * 6364136223846793005ULL + 1442695040888963407ULL;
+        int64_t nValue = (int64_t)(COIN * pow(10.0, 4.0 * (nRand >> 11) / 9007199254740992.0));
+
+        CCoinStakeSkeleton skeleton;
+        skeleton.hashTx = uint256((uint64_t)i + 1);
+        skeleton.scriptPubKeyKernel << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+        skeleton.scriptPubKeyOut << std::vector<unsigned char>(33, 2) << OP_CHECKSIG;
+        if (!inputsMap.insert(make_pair(skeleton.hashTx, 0U), vchKernel, nNow - nAge, nValue, skeleton))
+            return false;
+    }
+    inputsMap.SetBits(nBits);
+    result.nFillTime = GetTimeMicros() - nStart;
+    result.nMapMemory = inputsMap.MemoryUsage();
+
+    CStakeMinerStats statsStart = GetStakeMinerStats();
+    for (unsigned int i = 0; i < nPasses && !fShutdown; i++)
+    {
+        state.nLastCoinStakeSearchTime = GetAdjustedTime() - nInterval;
+        MidstateMap::key_type LuckyInput;
+        std::pair<uint256, uint32_t> solution;
+        if (ScanMap(state, inputsMap, nBits, LuckyInput, solution))
+            result.nSolutions++;
+
+        CStakeMinerStats stats = GetStakeMinerStats();
+        result.nMaxPassTime = std::max(result.nMaxPassTime, stats.nLastPassTime);
+        result.nIntervalCovered = stats.nLastIntervalCovered;
+    }
+    CStakeMinerStats statsEnd = GetStakeMinerStats();
+    result.nPasses = statsEnd.nPasses - statsStart.nPasses;
+    result.nHashes = statsEnd.nHashes - statsStart.nHashes;
+    result.nScanTime = statsEnd.nScanTime - statsStart.nScanTime;
+
+    return true;
+}
+
 // Stake miner thread
 void ThreadStakeMiner(void* parg)
 {
@@ -655,12 +1400,19 @@ void ThreadStakeMiner(void* parg)
     // Make this thread recognisable as the mining thread
     RenameThread("42-miner");
     CWallet* pwallet = (CWallet*)parg;
+    CStakeMinerState state;
+
+    ReadKernelCache(pwallet, state);
 
     MidstateMap inputsMap;
-    if (!FillMap(pwallet, GetAdjustedTime(), inputsMap))
+    if (!FillMap(pwallet, state, GetAdjustedTime(), inputsMap))
         return;
 
+    // Save kernels which have been calculated during the startup
+    WriteKernelCache(pwallet, state, inputsMap);
+
     bool fTrySync = true;
+    bool fRefill = false;
 
     CBlockIndex* pindexPrev = pindexBest;
     uint32_t nBits = GetNextTargetRequired(pindexPrev, true);
@@ -682,7 +1434,7 @@ void ThreadStakeMiner(void* parg)
 
             while (pwallet->IsLocked())
             {
-                Sleep(1000);
+                InterruptibleSleep(1000);
                 if (fShutdown)
                     goto _endloop; // Don't be afraid to use a goto if that's the best option.
             }
@@ -691,7 +1443,7 @@ void ThreadStakeMiner(void* parg)
             {
                 fTrySync = true;
 
-                Sleep(1000);
+                InterruptibleSleep(1000);
                 if (fShutdown)
                     goto _endloop;
             }
@@ -702,23 +1454,24 @@ void ThreadStakeMiner(void* parg)
                 fTrySync = false;
                 if (vNodes.size() < 3 || nBestHeight < GetNumBlocksOfPeers())
                 {
-                    Sleep(1000);
+                    InterruptibleSleep(1000);
                     continue;
                 }
             }
 
-            if (ScanMap(inputsMap, nBits, LuckyInput, solution))
+            if (ScanMap(state, inputsMap, nBits, LuckyInput, solution))
             {
                 SetThreadPriority(THREAD_PRIORITY_NORMAL);
 
-                // Remove lucky input from the map
-                inputsMap.erase(inputsMap.find(LuckyInput));
+                // Take the prepared coinstake and remove lucky input from the map
+                CCoinStakeSkeleton skeleton = *inputsMap.skeleton(LuckyInput);
+                inputsMap.erase(LuckyInput);
 
                 CKey key;
                 CTransaction txCoinStake;
 
                 // Create new coinstake transaction
-                if (!pwallet->CreateCoinStake(LuckyInput.first, LuckyInput.second, solution.second, nBits, txCoinStake, key))
+                if (!pwallet->CreateCoinStake(skeleton, solution.second, nBits, txCoinStake, key))
                 {
                     string strMessage("Warning: Unable to create coinstake transaction, see debug.log for the details. Mining thread has been stopped.");
                     strMiscWarning = strMessage;
@@ -754,31 +1507,44 @@ void ThreadStakeMiner(void* parg)
 
                 CheckStake(pblock, *pwallet);
                 SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                Sleep(500);
+                InterruptibleSleep(500);
             }
 
             if (pindexPrev != pindexBest)
             {
-                // The best block has been changed, we need to refill the map
-                if (FillMap(pwallet, GetAdjustedTime(), inputsMap))
+                // The best block has been changed, we need to update the map. Incremental
+                //   update is possible only if previous best block is still in the main
+                //   chain and there is no reserved balance, otherwise refill the whole map.
+                bool fUpdated;
+                if (!fRefill && nReserveBalance == 0 && pindexPrev->IsInMainChain())
+                    fUpdated = UpdateMap(pwallet, state, GetAdjustedTime(), inputsMap);
+                else
+                    fUpdated = FillMap(pwallet, state, GetAdjustedTime(), inputsMap);
+
+                fRefill = !fUpdated;
+
+                if (fUpdated)
                 {
                     pindexPrev = pindexBest;
                     nBits = GetNextTargetRequired(pindexPrev, true);
                 }
                 else
                 {
-                    // Clear existent data if FillMap failed
+                    // Clear existent data if the map couldn't be updated
                     inputsMap.clear();
                 }
             }
 
-            Sleep(500);
+            InterruptibleSleep(500);
 
             _endloop:
                 (void)0; // do nothing
         }
         while(!fShutdown);
 
+        WriteKernelCache(pwallet, state, inputsMap);
+        state.SetMapSize(0);
+
         vnThreadsRunning[THREAD_MINTER]--;
     }
     catch (std::exception& e) {
@@ -9,9 +9,16 @@
 #include "main.h"
 #include "wallet.h"
 
+static const int MAX_STAKESCAN_THREADS = 128;
+
 /* Generate a new block, without valid proof-of-work/with provided proof-of-stake */
 CBlock* CreateNewBlock(CWallet* pwallet, CTransaction *txAdd=NULL);
 
+/** Keep the block template in step with the memory pool, called with mempool.cs held */
+void BlockTemplateAddTx(const uint256& hash);
+void BlockTemplateRemoveTx(const uint256& hash);
+void BlockTemplateClear();
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
@@ -27,7 +34,64 @@ bool CheckStake(CBlock* pblock, CWallet& wallet);
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
+/** Stake miner instrumentation, times are in microseconds */
+struct CStakeMinerStats
+{
+    uint64_t nPasses;              // ScanMap passes done
+    uint64_t nHashes;              // kernels hashed in total
+    uint64_t nScanTime;            // total wall time of the passes
+    uint64_t nLastHashes;          // kernels hashed during the last pass
+    int64_t nLastPassTime;         // wall time of the last pass
+    uint32_t nLastIntervalRequested; // seconds since previous pass
+    uint32_t nLastIntervalCovered;   // seconds actually scanned, limited by nMaxStakeSearchInterval
+    uint64_t nOverruns;            // passes which couldn't cover the requested interval
+    uint64_t nFills;               // full FillMap rebuilds
+    uint64_t nUpdates;             // incremental UpdateMap calls
+    int64_t nLastFillTime;         // duration of the last FillMap or UpdateMap call
+    int64_t nLockWaitTime;         // total time spent waiting for cs_main and cs_wallet
+    int64_t nLastLockWaitTime;     // wait for cs_main and cs_wallet in the last map refresh
+
+    CStakeMinerStats()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+/** Get a copy of the stake miner statistics */
+CStakeMinerStats GetStakeMinerStats();
+
+/** Outcome of SimulateStakeMiner, times are in microseconds */
+struct CStakeSimResult
+{
+    int64_t nFillTime;             // building the inputs map and its targets
+    size_t nMapMemory;             // approximate memory held by the inputs map
+    uint64_t nPasses;              // ScanMap passes done
+    uint64_t nHashes;              // kernels hashed
+    uint64_t nScanTime;            // total wall time of the passes
+    int64_t nMaxPassTime;          // longest pass
+    uint32_t nIntervalCovered;     // seconds scanned per pass
+    unsigned int nSolutions;       // passes ended by a kernel meeting the target
+
+    CStakeSimResult()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+/** Run the stake miner's map fill and scan over nInputs synthetic outputs,
+    for bench_42 -stakesim. Scans use the kernel scanning threads, if any. */
+bool SimulateStakeMiner(unsigned int nInputs, uint32_t nBits, uint32_t nInterval, unsigned int nPasses, CStakeSimResult &result);
+
 /** Stake miner thread */
 void ThreadStakeMiner(void* parg);
 
+/** Number of kernel scanning threads used by the stake miner (0 = scan on the miner thread) */
+extern int nStakeScanThreads;
+
+/** Run an instance of the stake kernel scanning thread */
+void ThreadStakeScan(void* parg);
+
+/** Stop the stake kernel scanning threads */
+void ThreadStakeScanQuit();
+
 #endif // MINER_H
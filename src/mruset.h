@@ -4,57 +4,176 @@
 #ifndef BITCOIN_MRUSET_H
 #define BITCOIN_MRUSET_H
 
-#include <set>
-#include <deque>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <vector>
 
-/** STL-like set container that only keeps the most recent N elements. */
-template <typename T> class mruset
+#include "uint256.h"
+#include "util.h"
+
+/** Set of the most recently inserted hashes in a fixed amount of memory.
+ * It is a pair of bloom filters, a hash goes into the newer one and is
+ * looked up in both; when the newer one is full, the older one is dropped.
+ * So it remembers between nElements/2 and nElements hashes, and may claim
+ * to have one it doesn't at the given rate. */
+class CRollingBloomFilter
 {
+private:
+    std::vector<uint64_t> vData[2]; // bits of the newer and the older filter
+    unsigned int nNewer;
+    unsigned int nEntries;          // in the newer filter
+    unsigned int nMaxEntries;
+    unsigned int nHashFuncs;
+    uint64_t nTweak1, nTweak2;      // keep the bit positions unknown to peers
+
+    unsigned int Bit(const uint256& hash, unsigned int n) const
+    {
+        uint64_t h1 = hash.Get64(0) ^ nTweak1;
+        uint64_t h2 = hash.Get64(1) ^ nTweak2;
+        return (h1 + n * h2) % (vData[0].size() * 64);
+    }
+
+    bool Test(unsigned int nFilter, const uint256& hash) const
+    {
+        for (unsigned int n = 0; n < nHashFuncs; n++)
+        {
+            unsigned int nBit = Bit(hash, n);
+            if (!(vData[nFilter][nBit >> 6] & ((uint64_t)1 << (nBit & 63))))
+                return false;
+        }
+        return true;
+    }
+
 public:
-    typedef T key_type;
-    typedef T value_type;
-    typedef typename std::set<T>::iterator iterator;
-    typedef typename std::set<T>::const_iterator const_iterator;
-    typedef typename std::set<T>::size_type size_type;
+    CRollingBloomFilter(unsigned int nElements, double nFPRate)
+    {
+        // Each filter holds half of the elements, and a lookup tries both
+        nMaxEntries = std::max(nElements / 2, 1u);
+        double nFilterFPRate = nFPRate / 2;
+        unsigned int nBits = (unsigned int)ceil(-(double)nMaxEntries * log(nFilterFPRate) / (log(2.0) * log(2.0)));
+        nHashFuncs = std::max(1, (int)((double)nBits / nMaxEntries * log(2.0) + 0.5));
+        vData[0].resize((nBits + 63) / 64);
+        vData[1].resize((nBits + 63) / 64);
+        nTweak1 = GetRand(std::numeric_limits<uint64_t>::max());
+        nTweak2 = GetRand(std::numeric_limits<uint64_t>::max()) | 1;
+        nNewer = 0;
+        nEntries = 0;
+    }
+
+    bool contains(const uint256& hash) const
+    {
+        return Test(nNewer, hash) || Test(1 - nNewer, hash);
+    }
+
+    // Returns false if it was (probably) there already
+    bool insert(const uint256& hash)
+    {
+        if (contains(hash))
+            return false;
+        if (nEntries == nMaxEntries)
+        {
+            nNewer = 1 - nNewer;
+            std::fill(vData[nNewer].begin(), vData[nNewer].end(), 0);
+            nEntries = 0;
+        }
+        for (unsigned int n = 0; n < nHashFuncs; n++)
+        {
+            unsigned int nBit = Bit(hash, n);
+            vData[nNewer][nBit >> 6] |= (uint64_t)1 << (nBit & 63);
+        }
+        nEntries++;
+        return true;
+    }
+
+    void clear()
+    {
+        std::fill(vData[0].begin(), vData[0].end(), 0);
+        std::fill(vData[1].begin(), vData[1].end(), 0);
+        nEntries = 0;
+    }
+
+    size_t allocated_memory() const
+    {
+        return (vData[0].capacity() + vData[1].capacity()) * sizeof(uint64_t);
+    }
+};
+
+/** STL-like map container that keeps at most N elements, dropping the
+ * one with the lowest value first. The elements are held in an M, which
+ * may be an unordered map; the values index them by key, so iterators
+ * into M are only kept for as long as a call lasts. */
+template <typename K, typename V, typename M = std::map<K, V> > class limitedmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef typename M::const_iterator const_iterator;
+    typedef typename M::size_type size_type;
 
 protected:
-    std::set<T> set;
-    std::deque<T> queue;
+    M map;
+    typedef typename M::iterator iterator;
+    std::multimap<V, K> rmap;
+    typedef typename std::multimap<V, K>::iterator rmap_iterator;
     size_type nMaxSize;
 
+    void erase_rmap(const iterator& it)
+    {
+        for (rmap_iterator rit = rmap.lower_bound(it->second); rit != rmap.upper_bound(it->second); ++rit)
+            if (rit->second == it->first)
+            {
+                rmap.erase(rit);
+                return;
+            }
+    }
+
 public:
-    mruset(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
-    iterator begin() const { return set.begin(); }
-    iterator end() const { return set.end(); }
-    size_type size() const { return set.size(); }
-    bool empty() const { return set.empty(); }
-    iterator find(const key_type& k) const { return set.find(k); }
-    size_type count(const key_type& k) const { return set.count(k); }
-    bool inline friend operator==(const mruset<T>& a, const mruset<T>& b) { return a.set == b.set; }
-    bool inline friend operator==(const mruset<T>& a, const std::set<T>& b) { return a.set == b; }
-    bool inline friend operator<(const mruset<T>& a, const mruset<T>& b) { return a.set < b.set; }
-    std::pair<iterator, bool> insert(const key_type& x)
+    limitedmap(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
+    const_iterator begin() const { return map.begin(); }
+    const_iterator end() const { return map.end(); }
+    size_type size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    const_iterator find(const key_type& k) const { return map.find(k); }
+    size_type count(const key_type& k) const { return map.count(k); }
+    void insert(const value_type& x)
     {
-        std::pair<iterator, bool> ret = set.insert(x);
+        std::pair<iterator, bool> ret = map.insert(x);
         if (ret.second)
         {
-            if (nMaxSize && queue.size() == nMaxSize)
+            if (nMaxSize && map.size() > nMaxSize)
             {
-                set.erase(queue.front());
-                queue.pop_front();
+                map.erase(rmap.begin()->second);
+                rmap.erase(rmap.begin());
             }
-            queue.push_back(x);
+            rmap.insert(std::make_pair(x.second, x.first));
         }
-        return ret;
+    }
+    void erase(const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            return;
+        erase_rmap(it);
+        map.erase(it);
+    }
+    void update(const_iterator itIn, const mapped_type& v)
+    {
+        iterator it = map.find(itIn->first);
+        erase_rmap(it);
+        it->second = v;
+        rmap.insert(std::make_pair(v, it->first));
     }
     size_type max_size() const { return nMaxSize; }
     size_type max_size(size_type s)
     {
         if (s)
-            while (queue.size() > s)
+            while (map.size() > s)
             {
-                set.erase(queue.front());
-                queue.pop_front();
+                map.erase(rmap.begin()->second);
+                rmap.erase(rmap.begin());
             }
         nMaxSize = s;
         return nMaxSize;
@@ -11,15 +11,28 @@
 #include "ui_interface.h"
 #include "miner.h"
 #include "ntp.h"
+#include "netpoll.h"
+#include "scheduler.h"
+#include "metrics.h"
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_ZLIB
+#include <zlib.h>
 #endif
 
 using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+// Most outbound connections being dialed at once
+static const unsigned int MAX_PARALLEL_DIALS = 8;
+// Seconds to wait for the DNS seeds
+static const int64_t DNS_SEED_TIMEOUT = 30;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -63,10 +76,13 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
-map<CInv, int64_t> mapAlreadyAskedFor;
+uint64_t nMaxRelayMemory = 64 * 1048576; // -maxrelaymem
+AskedForMap mapAlreadyAskedFor(MAX_ASKED_FOR);
+int nMessageHandlerThreads = 4;
+unsigned int nInvBatchSize = 1000;
+int64_t nInvBytesPerSecond = 32000;
+bool fTxReconcile = false;
+bool fCompressMessages = false;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -352,7 +368,7 @@ bool GetMyExternalIP(CNetAddr& ipRet)
     int rc = GetExternalIPbySTUN(rnd, &mapped, &srv);
     if(rc >= 0) {
         ipRet = CNetAddr(mapped.sin_addr);
-        printf("GetExternalIPbySTUN(%" PRIu64 ") returned %s in attempt %d; Server=%s\n", rnd, ipRet.ToStringIP().c_str(), rc, srv);
+        printf("GetExternalIPbySTUN(%" PRIu64 ") returned %s in round %d; Server=%s\n", rnd, ipRet.ToStringIP().c_str(), rc, srv);
         return true;
     }
     return false;
@@ -387,6 +403,258 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundTarget = 0;
+uint64_t CNode::nOutboundCycleBytes = 0;
+int64_t CNode::nOutboundCycleStart = 0;
+
+// Traffic and processing times by command, since startup
+static MessageTrafficMap mapTotalSent;
+static MessageTrafficMap mapTotalRecv;
+static ProcessTimeMap mapProcessTimes;
+static CCriticalSection cs_messageStats;
+
+// The first four bytes of the double SHA256 of a payload
+static unsigned int ChecksumOf(const uint256& hash)
+{
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum;
+}
+
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes, uint64_t nMaxSize, bool fAllowCompressed)
+{
+    // Copy as much of the header as we have
+    unsigned int nCopy = std::min((unsigned int)CMessageHeader::HEADER_SIZE - nHdrPos, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nCopy;
+
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e) {
+        return -1;
+    }
+
+    // A compressed payload starts with the size it unpacks to
+    if (hdr.nMessageSize & MESSAGE_SIZE_COMPRESSED)
+    {
+        hdr.nMessageSize &= ~MESSAGE_SIZE_COMPRESSED;
+        if (!fAllowCompressed || hdr.nMessageSize < sizeof(uint32_t))
+            return -1;
+        nCompressedSize = hdr.nMessageSize;
+    }
+
+    // Wrong network, garbage, or more than a message may hold: there is no
+    // telling where the next message would start
+    if (!hdr.IsValid())
+        return -1;
+    if (hdr.nMessageSize > nMaxSize)
+    {
+        printf("CNetMessage::ReadHeader() : (%s, %u bytes) over the receive buffer\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return -1;
+    }
+
+    vRecv.resize(hdr.nMessageSize);
+    fInData = true;
+    if (hdr.nMessageSize == 0)
+        fChecksumOk = (hdr.nChecksum == ChecksumOf(hasher.GetHash()));
+    return nCopy;
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = std::min(hdr.nMessageSize - nDataPos, nBytes);
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    hasher.write(pch, nCopy);
+    nDataPos += nCopy;
+    if (IsComplete())
+        fChecksumOk = (hdr.nChecksum == ChecksumOf(hasher.GetHash()));
+    return nCopy;
+}
+
+bool CNetMessage::Decompress(uint64_t nMaxSize)
+{
+#ifdef USE_ZLIB
+    uint32_t nSize;
+    memcpy(&nSize, &vRecv[0], sizeof(nSize));
+    if (nSize > MAX_SIZE || nSize > nMaxSize)
+        return false;
+
+    std::vector<char> vData(nSize);
+    uLongf nDataSize = nSize;
+    if (nSize > 0 && (uncompress((Bytef*)&vData[0], &nDataSize, (const Bytef*)&vRecv[sizeof(nSize)], vRecv.size() - sizeof(nSize)) != Z_OK || nDataSize != nSize))
+        return false;
+    vRecv.resize(nSize);
+    if (nSize > 0)
+        memcpy(&vRecv[0], &vData[0], nSize);
+    hdr.nMessageSize = nDataPos = nSize;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    while (nBytes > 0)
+    {
+        // Start a new message if the last one is complete
+        if (vRecvMsg.empty() || vRecvMsg.back().IsComplete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        int nUsed;
+        if (!msg.fInData)
+        {
+            uint64_t nLimit = nRecvSize + CMessageHeader::HEADER_SIZE;
+            uint64_t nMaxSize = ReceiveBufferSize() > nLimit ? ReceiveBufferSize() - nLimit : 0;
+            nUsed = msg.ReadHeader(pch, nBytes, nMaxSize, fCompressRecv);
+            if (nUsed < 0)
+            {
+                printf("ReceiveMsgBytes() : invalid message header from %s\n", addrName.c_str());
+                return false;
+            }
+
+            // The payload buffer is allocated in full with the header, so it
+            // counts against the receive buffer limit from now on
+            nRecvSize += nUsed;
+            if (msg.fInData)
+                nRecvSize += msg.hdr.nMessageSize;
+        }
+        else
+            nUsed = msg.ReadData(pch, nBytes);
+
+        // The checksum is of the payload as sent, a bad one is dropped by
+        // ProcessMessages
+        if (msg.nCompressedSize && msg.IsComplete() && msg.fChecksumOk)
+        {
+            uint64_t nLimit = nRecvSize - msg.nCompressedSize;
+            if (!msg.Decompress(ReceiveBufferSize() > nLimit ? ReceiveBufferSize() - nLimit : 0))
+            {
+                printf("ReceiveMsgBytes() : invalid compressed %s from %s\n", msg.hdr.GetCommand().c_str(), addrName.c_str());
+                return false;
+            }
+            nRecvSize = nLimit + msg.hdr.nMessageSize;
+        }
+
+        pch += nUsed;
+        nBytes -= nUsed;
+    }
+    return true;
+}
+
+CSendBuffer MakeSendBuffer(const char* pszCommand, const CDataStream& vPayload)
+{
+    CMessageHeader hdr(pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CPublicDataStream vHeader(SER_NETWORK, PROTOCOL_VERSION);
+    vHeader << hdr;
+
+    boost::shared_ptr<CSendMessage> pmsg(new CSendMessage());
+    pmsg->reserve(vHeader.size() + vPayload.size());
+    pmsg->insert(pmsg->end(), vHeader.begin(), vHeader.end());
+    pmsg->insert(pmsg->end(), vPayload.begin(), vPayload.end());
+    return pmsg;
+}
+
+#ifdef USE_ZLIB
+// Only blocks and transactions compress well, the rest is mostly hashes
+static bool IsCompressible(const std::vector<char>& vMsg)
+{
+    if (vMsg.size() < CMessageHeader::HEADER_SIZE + MIN_COMPRESS_SIZE)
+        return false;
+    const char* pszCommand = &vMsg[CMessageHeader::MESSAGE_START_SIZE];
+    static const char* ppszCommands[] = { "block", "tx", "blocktxn", "cmpctblock" };
+    for (unsigned int i = 0; i < sizeof(ppszCommands) / sizeof(ppszCommands[0]); i++)
+        if (strncmp(pszCommand, ppszCommands[i], CMessageHeader::COMMAND_SIZE) == 0)
+            return true;
+    return false;
+}
+
+// The message with its payload compressed, NULL if it doesn't get smaller
+static CSendBuffer CompressMessage(const std::vector<char>& vMsg)
+{
+    // Header, uncompressed size, zlib stream at its fastest level
+    const unsigned int nStart = CMessageHeader::HEADER_SIZE + sizeof(uint32_t);
+    uint32_t nSize = vMsg.size() - CMessageHeader::HEADER_SIZE;
+    uLongf nCompressedSize = compressBound(nSize);
+    boost::shared_ptr<CSendMessage> pcompressed(new CSendMessage(nStart + nCompressedSize));
+    std::vector<char>& vOut = *pcompressed;
+    if (compress2((Bytef*)&vOut[nStart], &nCompressedSize, (const Bytef*)&vMsg[CMessageHeader::HEADER_SIZE], nSize, Z_BEST_SPEED) != Z_OK ||
+        sizeof(nSize) + nCompressedSize >= nSize)
+        return CSendBuffer();
+    vOut.resize(nStart + nCompressedSize);
+    memcpy(&vOut[0], &vMsg[0], CMessageHeader::MESSAGE_SIZE_OFFSET);
+    memcpy(&vOut[CMessageHeader::HEADER_SIZE], &nSize, sizeof(nSize));
+
+    uint32_t nWireSize = (uint32_t)(sizeof(nSize) + nCompressedSize) | MESSAGE_SIZE_COMPRESSED;
+    memcpy(&vOut[CMessageHeader::MESSAGE_SIZE_OFFSET], &nWireSize, sizeof(nWireSize));
+    uint256 hash = Hash(vOut.begin() + CMessageHeader::HEADER_SIZE, vOut.end());
+    memcpy(&vOut[CMessageHeader::CHECKSUM_OFFSET], &hash, sizeof(uint32_t));
+    return pcompressed;
+}
+#endif
+
+CSendBuffer CompressSendBuffer(const CSendBuffer& pmsg)
+{
+#ifdef USE_ZLIB
+    const std::vector<char>& vMsg = *pmsg;
+    if (!IsCompressible(vMsg))
+        return pmsg;
+
+    // Peers sending the same message wait for the first one to compress it
+    LOCK(pmsg->cs_compressed);
+    if (!pmsg->fCompressed)
+    {
+        pmsg->pcompressed = CompressMessage(vMsg);
+        pmsg->fCompressed = true;
+    }
+    return pmsg->pcompressed ? pmsg->pcompressed : pmsg;
+#else
+    return pmsg;
+#endif
+}
+
+// Most buffers handed to the socket in one call
+static const unsigned int MAX_SEND_BUFFERS = 64;
+
+// Send as much of the queued messages as the socket takes in one call,
+// returns what send() would
+static int SocketSendData(CNode* pnode)
+{
+    unsigned int nBuffers = 0;
+    size_t nOffset = pnode->nSendOffset;
+#ifdef WIN32
+    WSABUF vBuf[MAX_SEND_BUFFERS];
+    for (std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++it, nBuffers++)
+    {
+        vBuf[nBuffers].buf = (char*)&(**it)[nOffset];
+        vBuf[nBuffers].len = (*it)->size() - nOffset;
+        nOffset = 0;
+    }
+    DWORD nSent = 0;
+    if (WSASend(pnode->hSocket, vBuf, nBuffers, &nSent, 0, NULL, NULL) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return (int)nSent;
+#else
+    struct iovec vBuf[MAX_SEND_BUFFERS];
+    for (std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++it, nBuffers++)
+    {
+        vBuf[nBuffers].iov_base = (void*)&(**it)[nOffset];
+        vBuf[nBuffers].iov_len = (*it)->size() - nOffset;
+        nOffset = 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vBuf;
+    msg.msg_iovlen = nBuffers;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -486,13 +754,10 @@ void CNode::CloseSocketDisconnect()
     {
         printf("disconnecting node %s\n", addrName.c_str());
         CloseSocket(hSocket);
-        vRecv.clear();
     }
 
-    // in case this fails, we'll empty the recv buffer when the CNode is deleted
-    TRY_LOCK(cs_vRecv, lockRecv);
-    if (lockRecv)
-        vRecv.clear();
+    // The received messages are left to Cleanup(), a message handler may
+    // be reading one of them right now
 
     // if this was the sync node, we'll need a new one
     if (this == pnodeSync)
@@ -501,6 +766,13 @@ void CNode::CloseSocketDisconnect()
 
 void CNode::Cleanup()
 {
+    // in case this fails, we'll empty the recv buffer when the CNode is deleted
+    TRY_LOCK(cs_vRecv, lockRecv);
+    if (lockRecv)
+    {
+        vRecvMsg.clear();
+        nRecvSize = 0;
+    }
 }
 
 
@@ -529,6 +801,7 @@ void CNode::PushVersion()
     }
 
     RAND_bytes((unsigned char*)&nLocalHostNonce, sizeof(nLocalHostNonce));
+    nVersionSentUsec = GetTimeMicros();
     printf("send version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", PROTOCOL_VERSION, nBestHeight, addrMe.ToString().c_str(), addrYou.ToString().c_str(), addr.ToString().c_str());
     PushMessage("version", PROTOCOL_VERSION, nLocalServices, nTime, addrYou, addrMe,
                 nLocalHostNonce, FormatSubVersion(CLIENT_NAME, CLIENT_VERSION, std::vector<string>()), nBestHeight);
@@ -538,6 +811,21 @@ void CNode::PushVersion()
 
 
 
+void CNode::RecordQuality()
+{
+    // Only the peers we chose to connect to are worth remembering
+    int64_t nNow = GetTime();
+    if (fInbound || !fSuccessfullyConnected || nNow - nQualityTime < 60)
+        return;
+
+    int64_t nElapsed = nNow - nQualityTime;
+    addrman.Quality(addr, nMinPingUsec, (int64_t)(nRecvBytes - nQualityRecvBytes) / nElapsed,
+                    (nBlocksDelivered - nQualityBlocks) * 3600 / nElapsed);
+    nQualityTime = nNow;
+    nQualityRecvBytes = nRecvBytes;
+    nQualityBlocks = nBlocksDelivered;
+}
+
 std::map<CNetAddr, int64_t> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
 
@@ -603,9 +891,19 @@ void CNode::copyStats(CNodeStats &stats)
     X(nReleaseTime);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(nBlocksInFlight);
     X(nSendBytes);
     X(nRecvBytes);
     stats.fSyncNode = (this == pnodeSync);
+    X(fCompressSend);
+    X(nPingUsec);
+    X(nMinPingUsec);
+    stats.nPingWaitUsec = nPingNonceSent ? GetTimeMicros() - nPingUsecStart : 0;
+    {
+        LOCK(cs_traffic);
+        X(mapSendTraffic);
+        X(mapRecvTraffic);
+    }
 }
 #undef X
 
@@ -640,10 +938,135 @@ void ThreadSocketHandler(void* parg)
 
 static list<CNode*> vNodesDisconnected;
 
+// Stop watching the socket the node was added to the poller with
+static void StopWatching(CSocketPoller& poller, map<CNode*, SOCKET>& mapWatched, map<CNode*, int>& mapReady, CNode* pnode)
+{
+    map<CNode*, SOCKET>::iterator mi = mapWatched.find(pnode);
+    if (mi != mapWatched.end())
+    {
+        poller.Remove(mi->second, pnode);
+        mapWatched.erase(mi);
+    }
+    mapReady.erase(pnode);
+}
+
+// Inbound peers that earn their slot are protected, the ones left are
+// candidates for eviction when a new peer wants in
+struct CEvictionCandidate
+{
+    CNode* pnode;
+    int64_t nTimeConnected;
+    int64_t nMinPingUsec;
+    int64_t nLastBlockTime;
+    int64_t nLastTxTime;
+    std::vector<unsigned char> vchGroup;
+};
+
+static bool ComparePing(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    // unknown pings count as the slowest
+    return (a.nMinPingUsec ? a.nMinPingUsec : std::numeric_limits<int64_t>::max()) >
+           (b.nMinPingUsec ? b.nMinPingUsec : std::numeric_limits<int64_t>::max());
+}
+
+static bool CompareBlockTime(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nLastBlockTime < b.nLastBlockTime;
+}
+
+static bool CompareTxTime(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nLastTxTime < b.nLastTxTime;
+}
+
+static bool CompareTimeConnected(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+// Make room for a new inbound peer by dropping the least useful one, returns
+// false if every inbound peer is worth keeping
+static bool EvictInboundConnection()
+{
+    vector<CEvictionCandidate> vCandidates;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (!pnode->fInbound || pnode->fDisconnect)
+                continue;
+            CEvictionCandidate candidate;
+            candidate.pnode = pnode;
+            candidate.nTimeConnected = pnode->nTimeConnected;
+            candidate.nMinPingUsec = pnode->nMinPingUsec;
+            candidate.nLastBlockTime = pnode->nLastBlockTime;
+            candidate.nLastTxTime = pnode->nLastTxTime;
+            candidate.vchGroup = pnode->addr.GetGroup();
+            vCandidates.push_back(candidate);
+        }
+    }
+
+    // Protect the 4 fastest peers, the 4 that last sent us a new block and
+    // the 4 that last sent us a new transaction, then the older half of the rest.
+    // Each sort puts the ones to protect at the end.
+    sort(vCandidates.begin(), vCandidates.end(), ComparePing);
+    vCandidates.erase(vCandidates.end() - min(4, (int)vCandidates.size()), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end(), CompareBlockTime);
+    vCandidates.erase(vCandidates.end() - min(4, (int)vCandidates.size()), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end(), CompareTxTime);
+    vCandidates.erase(vCandidates.end() - min(4, (int)vCandidates.size()), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end(), CompareTimeConnected);
+    vCandidates.erase(vCandidates.end() - vCandidates.size() / 2, vCandidates.end());
+    if (vCandidates.empty())
+        return false;
+
+    // Of the network group with the most candidates, drop the newest peer.
+    // The candidates are still ordered newest first.
+    map<vector<unsigned char>, int> mapGroupCount;
+    BOOST_FOREACH(const CEvictionCandidate& candidate, vCandidates)
+        mapGroupCount[candidate.vchGroup]++;
+    int nMostCount = 0;
+    vector<unsigned char> vchMostGroup;
+    for (map<vector<unsigned char>, int>::iterator mi = mapGroupCount.begin(); mi != mapGroupCount.end(); ++mi)
+    {
+        if (mi->second > nMostCount)
+        {
+            nMostCount = mi->second;
+            vchMostGroup = mi->first;
+        }
+    }
+
+    BOOST_FOREACH(const CEvictionCandidate& candidate, vCandidates)
+    {
+        if (candidate.vchGroup != vchMostGroup)
+            continue;
+        LOCK(cs_vNodes);
+        if (find(vNodes.begin(), vNodes.end(), candidate.pnode) == vNodes.end())
+            return false;
+        printf("evicting inbound peer %s\n", candidate.pnode->addr.ToString().c_str());
+        candidate.pnode->fDisconnect = true;
+        return true;
+    }
+    return false;
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     size_t nPrevNodeCount = 0;
+
+    // Sockets are watched by the poller, which reports when they become
+    // readable or writable. The readiness of each node is kept here until
+    // recv() or send() would block.
+    CSocketPoller poller;
+    map<CNode*, SOCKET> mapWatched;
+    map<CNode*, int> mapReady;
+    vector<CSocketEvent> vEvents;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && !poller.Add(hListenSocket, NULL, true))
+            printf("ThreadSocketHandler2() : unable to watch listening socket\n");
+
     for ( ; ; )
     {
         //
@@ -656,7 +1079,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -665,6 +1088,8 @@ void ThreadSocketHandler2(void* parg)
                     pnode->grantOutbound.Release();
 
                     // close socket and cleanup
+                    pnode->RecordQuality();
+                    StopWatching(poller, mapWatched, mapReady, pnode);
                     pnode->CloseSocketDisconnect();
                     pnode->Cleanup();
 
@@ -696,7 +1121,15 @@ void ThreadSocketHandler2(void* parg)
                                 {
                                     TRY_LOCK(pnode->cs_inventory, lockInv);
                                     if (lockInv)
-                                        fDelete = true;
+                                    {
+                                        // the block download keeps pointers to its peers
+                                        TRY_LOCK(cs_main, lockMain);
+                                        if (lockMain)
+                                        {
+                                            ReleaseBlockRequests(pnode);
+                                            fDelete = true;
+                                        }
+                                    }
                                 }
                             }
                         }
@@ -713,74 +1146,87 @@ void ThreadSocketHandler2(void* parg)
         {
             nPrevNodeCount = vNodes.size();
             uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+
+            int nInbound = 0;
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode->fInbound)
+                        nInbound++;
+                SetMetric(METRIC_PEERS_OUTBOUND, vNodes.size() - nInbound);
+            }
+            SetMetric(METRIC_PEERS_INBOUND, nInbound);
         }
 
 
         //
-        // Find which sockets have data to receive
+        // Watch new sockets, and forget those closed since
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
+                SOCKET hSocket = pnode->hSocket;
+                map<CNode*, SOCKET>::iterator mi = mapWatched.find(pnode);
+                if (mi == mapWatched.end() || mi->second != hSocket)
+                {
+                    StopWatching(poller, mapWatched, mapReady, pnode);
+                    if (hSocket == INVALID_SOCKET)
+                        continue;
+                    if (!poller.Add(hSocket, pnode))
+                    {
+                        printf("unable to watch socket of %s\n", pnode->addrName.c_str());
+                        pnode->CloseSocketDisconnect();
+                        continue;
+                    }
+                    mapWatched[pnode] = hSocket;
+                }
+                if (hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+
+                // select() only reports writes the poller was asked for
+                bool fWantWrite = false;
+                if (!(mapReady[pnode] & POLL_WRITE))
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    fWantWrite = lockSend && !pnode->vSendMsg.empty();
                 }
+                poller.WantWrite(hSocket, fWantWrite);
             }
         }
 
+
+        //
+        // Find which sockets are ready
+        //
+        int nTimeout = 50; // frequency to poll pnode->vSendMsg
+
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        bool fWait = poller.Wait(nTimeout, vEvents);
         vnThreadsRunning[THREAD_SOCKETHANDLER]++;
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
+        if (!fWait)
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %s\n", NetworkErrorString(nErr).c_str());
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
+            int nErr = WSAGetLastError();
+            printf("socket poll error %s\n", NetworkErrorString(nErr).c_str());
+            Sleep(nTimeout);
+        }
+
+        vector<SOCKET> vhListenReady;
+        BOOST_FOREACH(const CSocketEvent& event, vEvents)
+        {
+            if (event.pOwner == NULL)
+                vhListenReady.push_back(event.hSocket);
+            else
+                mapReady[(CNode*)event.pOwner] |= event.nFlags;
         }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenReady)
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -805,14 +1251,14 @@ void ThreadSocketHandler2(void* parg)
                 if (nErr != WSAEWOULDBLOCK)
                     printf("socket error accept failed: %s\n", NetworkErrorString(nErr).c_str());
             }
-            else if (nInbound >= GetArgInt("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+            else if (CNode::IsBanned(addr))
             {
-                printf("connection from %s dropped (overall limit)\n", addr.ToString().c_str());
+                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
                 CloseSocket(hSocket);
             }
-            else if (CNode::IsBanned(addr))
+            else if (nInbound >= GetArgInt("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS && !EvictInboundConnection())
             {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+                printf("connection from %s dropped (overall limit)\n", addr.ToString().c_str());
                 CloseSocket(hSocket);
             }
             else
@@ -848,17 +1294,17 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            int& nReady = mapReady[pnode];
+            if (nReady & (POLL_READ | POLL_ERROR))
             {
+                // A paused peer is read again once the message handler takes
+                // its messages, the poller keeps the read readiness until then
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
+                if (lockRecv && !pnode->fPauseRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    uint64_t nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
+                    if (pnode->nRecvSize > ReceiveBufferSize()) {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%" PRIszu " bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%" PRIu64 " bytes)\n", pnode->nRecvSize);
                         pnode->CloseSocketDisconnect();
                     }
                     else {
@@ -867,8 +1313,10 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            // Messages larger than the receive buffer are refused by
+                            // their header, before the payload is allocated
+                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                                pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
@@ -884,7 +1332,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                nReady &= ~(POLL_READ | POLL_ERROR);
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %s\n", NetworkErrorString(nErr).c_str());
@@ -900,18 +1350,32 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (nReady & POLL_WRITE)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (!pnode->vSendMsg.empty())
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        int nBytes = SocketSendData(pnode);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+                            // Drop the messages sent in full, the buffers themselves
+                            // are never moved
+                            pnode->nSendSize -= nBytes;
+                            size_t nLeft = nBytes;
+                            while (nLeft > 0)
+                            {
+                                size_t nFront = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                                if (nLeft < nFront)
+                                {
+                                    pnode->nSendOffset += nLeft;
+                                    break;
+                                }
+                                nLeft -= nFront;
+                                pnode->nSendOffset = 0;
+                                pnode->vSendMsg.pop_front();
+                            }
                             pnode->nLastSend = GetTime();
                             pnode->nSendBytes += nBytes;
                             pnode->RecordBytesSent(nBytes);
@@ -920,7 +1384,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                nReady &= ~POLL_WRITE;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -933,7 +1399,7 @@ void ThreadSocketHandler2(void* parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->nSendSize == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -991,6 +1457,43 @@ void ThreadDNSAddressSeed(void* parg)
     printf("ThreadDNSAddressSeed exited\n");
 }
 
+// Seeds still being looked up, and the addresses they gave so far
+static int nDNSSeedsPending = 0;
+static int nDNSSeedsFound = 0;
+static CCriticalSection cs_DNSSeeds;
+
+void static ThreadDNSSeedLookup(void* parg)
+{
+    RenameThread("42-dnslookup");
+    unsigned int seed_idx = (unsigned int)(size_t)parg;
+
+    vector<CAddress> vAdd;
+    try
+    {
+        vector<CNetAddr> vaddr;
+        if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
+        {
+            BOOST_FOREACH(CNetAddr& ip, vaddr)
+            {
+                CAddress addr = CAddress(CService(ip, GetDefaultPort()));
+                addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+                vAdd.push_back(addr);
+            }
+        }
+        if (!fShutdown && !vAdd.empty())
+            addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadDNSSeedLookup()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadDNSSeedLookup()");
+    }
+
+    LOCK(cs_DNSSeeds);
+    nDNSSeedsFound += vAdd.size();
+    nDNSSeedsPending--;
+}
+
 void ThreadDNSAddressSeed2(void* parg)
 {
     printf("ThreadDNSAddressSeed started\n");
@@ -1000,25 +1503,37 @@ void ThreadDNSAddressSeed2(void* parg)
     {
         printf("Loading addresses from DNS seeds (could take a while)\n");
 
+        // Look all the seeds up at once, each adding what it finds to addrman
+        int64_t nStart = GetTime();
         for (unsigned int seed_idx = 0; seed_idx < ARRAYLEN(strDNSSeed); seed_idx++) {
             if (HaveNameProxy()) {
                 AddOneShot(strDNSSeed[seed_idx][1]);
             } else {
-                vector<CNetAddr> vaddr;
-                vector<CAddress> vAdd;
-                if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
+                LOCK(cs_DNSSeeds);
+                nDNSSeedsPending++;
+                if (!NewThread(ThreadDNSSeedLookup, (void*)(size_t)seed_idx))
                 {
-                    BOOST_FOREACH(CNetAddr& ip, vaddr)
-                    {
-                        CAddress addr = CAddress(CService(ip, GetDefaultPort()));
-                        addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                        vAdd.push_back(addr);
-                        found++;
-                    }
+                    printf("Error: NewThread(ThreadDNSSeedLookup) failed\n");
+                    nDNSSeedsPending--;
                 }
-                addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
             }
         }
+
+        // Don't wait on dead seeds past the timeout; their lookups finish on their own
+        int nPending = 0;
+        while (!fShutdown)
+        {
+            {
+                LOCK(cs_DNSSeeds);
+                nPending = nDNSSeedsPending;
+                found = nDNSSeedsFound;
+            }
+            if (nPending == 0 || GetTime() - nStart >= DNS_SEED_TIMEOUT)
+                break;
+            Sleep(100);
+        }
+        if (nPending > 0)
+            printf("%d DNS seeds timed out\n", nPending);
     }
 
     printf("%d addresses found from DNS seeds\n", found);
@@ -1037,6 +1552,12 @@ void DumpAddresses()
 {
     int64_t nStart = GetTimeMillis();
 
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->RecordQuality();
+    }
+
     CAddrDB adb;
     adb.Write(addrman);
 
@@ -1044,36 +1565,6 @@ void DumpAddresses()
            addrman.size(), GetTimeMillis() - nStart);
 }
 
-void ThreadDumpAddress2(void* parg)
-{
-    printf("ThreadDumpAddress started\n");
-
-    vnThreadsRunning[THREAD_DUMPADDRESS]++;
-    while (!fShutdown)
-    {
-        DumpAddresses();
-        vnThreadsRunning[THREAD_DUMPADDRESS]--;
-        Sleep(600000);
-        vnThreadsRunning[THREAD_DUMPADDRESS]++;
-    }
-    vnThreadsRunning[THREAD_DUMPADDRESS]--;
-}
-
-void ThreadDumpAddress(void* parg)
-{
-    // Make this thread recognisable as the address dumping thread
-    RenameThread("42-adrdump");
-
-    try
-    {
-        ThreadDumpAddress2(parg);
-    }
-    catch (std::exception& e) {
-        PrintException(&e, "ThreadDumpAddress()");
-    }
-    printf("ThreadDumpAddress exited\n");
-}
-
 void ThreadOpenConnections(void* parg)
 {
     // Make this thread recognisable as the connection opening thread
@@ -1095,6 +1586,83 @@ void ThreadOpenConnections(void* parg)
     printf("ThreadOpenConnections exited\n");
 }
 
+// Outbound connections being dialed, with the network group of each, so a
+// destination is dialed once and the address selection keeps away from them
+static map<string, vector<unsigned char> > mapDialing;
+static CCriticalSection cs_mapDialing;
+
+class CDialRequest
+{
+public:
+    CAddress addr;
+    string strDest;
+    CSemaphoreGrant grant;
+    bool fOneShot;
+};
+
+// Dials run on a pool of their own, so a slow or dead address doesn't hold up
+// the others or the general scheduler
+static CScheduler dialScheduler("dial");
+
+void static ThreadDial(boost::shared_ptr<CDialRequest> preq)
+{
+    const char* pszDest = preq->strDest.empty() ? NULL : preq->strDest.c_str();
+
+    // OpenNetworkConnection doesn't count the time spent connecting
+    vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
+    try
+    {
+        if (!OpenNetworkConnection(preq->addr, &preq->grant, pszDest, preq->fOneShot) && preq->fOneShot && !fShutdown)
+            AddOneShot(preq->strDest);
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadDial()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadDial()");
+    }
+    vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
+
+    {
+        LOCK(cs_mapDialing);
+        mapDialing.erase(pszDest ? preq->strDest : preq->addr.ToStringIPPort());
+    }
+}
+
+// Dial on the dial pool. The grant goes with the request, and is released if
+// the connection fails or the request is dropped at shutdown.
+bool static OpenNetworkConnectionAsync(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest = NULL, bool fOneShot = false)
+{
+    if (fShutdown)
+        return false;
+
+    string strKey = strDest ? strDest : addrConnect.ToStringIPPort();
+    {
+        LOCK(cs_mapDialing);
+        if (mapDialing.size() >= MAX_PARALLEL_DIALS || mapDialing.count(strKey))
+            return false;
+        mapDialing[strKey] = strDest ? vector<unsigned char>() : addrConnect.GetGroup();
+    }
+
+    boost::shared_ptr<CDialRequest> preq(new CDialRequest());
+    preq->addr = addrConnect;
+    preq->strDest = strDest ? strDest : "";
+    preq->fOneShot = fOneShot;
+    if (grantOutbound)
+        grantOutbound->MoveTo(preq->grant);
+
+    dialScheduler.Schedule(boost::bind(ThreadDial, preq));
+    return true;
+}
+
+unsigned int static GetDialing(set<vector<unsigned char> >& setGroupsRet)
+{
+    LOCK(cs_mapDialing);
+    for (map<string, vector<unsigned char> >::iterator mi = mapDialing.begin(); mi != mapDialing.end(); ++mi)
+        if (!mi->second.empty())
+            setGroupsRet.insert(mi->second);
+    return mapDialing.size();
+}
+
 void static ProcessOneShot()
 {
     string strDest;
@@ -1108,7 +1676,7 @@ void static ProcessOneShot()
     CAddress addr;
     CSemaphoreGrant grant(*semOutbound, true);
     if (grant) {
-        if (!OpenNetworkConnection(addr, &grant, strDest.c_str(), true))
+        if (!OpenNetworkConnectionAsync(addr, &grant, strDest.c_str(), true))
             AddOneShot(strDest);
     }
 }
@@ -1126,15 +1694,15 @@ void ThreadOpenConnections2(void* parg)
             BOOST_FOREACH(string strAddr, mapMultiArgs["-connect"])
             {
                 CAddress addr;
-                OpenNetworkConnection(addr, NULL, strAddr.c_str());
+                OpenNetworkConnectionAsync(addr, NULL, strAddr.c_str());
                 for (int i = 0; i < 10 && i < nLoop; i++)
                 {
-                    Sleep(500);
+                    InterruptibleSleep(500);
                     if (fShutdown)
                         return;
                 }
             }
-            Sleep(500);
+            InterruptibleSleep(500);
         }
     }
 
@@ -1145,7 +1713,7 @@ void ThreadOpenConnections2(void* parg)
         ProcessOneShot();
 
         vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        Sleep(500);
+        InterruptibleSleep(500);
         vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
         if (fShutdown)
             return;
@@ -1157,6 +1725,12 @@ void ThreadOpenConnections2(void* parg)
         if (fShutdown)
             return;
 
+        // Wait for a dial to finish if as many as allowed are under way
+        set<vector<unsigned char> > setConnected;
+        int nOutbound = GetDialing(setConnected);
+        if (nOutbound >= (int)MAX_PARALLEL_DIALS)
+            continue;
+
         // Add seed nodes if IRC isn't working
         if (!IsLimited(NET_IPV4) && addrman.size()==0 && (GetTime() - nStart > 60) && !fTestNet)
         {
@@ -1194,10 +1768,9 @@ void ThreadOpenConnections2(void* parg)
         //
         CAddress addrConnect;
 
-        // Only connect out to one peer per network group (/16 for IPv4).
+        // Only connect out to one peer per network group (/16 for IPv4),
+        // counting the ones being dialed.
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
-        int nOutbound = 0;
-        set<vector<unsigned char> > setConnected;
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes) {
@@ -1243,7 +1816,7 @@ void ThreadOpenConnections2(void* parg)
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            OpenNetworkConnectionAsync(addrConnect, &grant);
     }
 }
 
@@ -1288,11 +1861,11 @@ void ThreadOpenAddedConnections2(void* parg)
             BOOST_FOREACH(string& strAddNode, lAddresses) {
                 CAddress addr;
                 CSemaphoreGrant grant(*semOutbound);
-                OpenNetworkConnection(addr, &grant, strAddNode.c_str());
+                OpenNetworkConnectionAsync(addr, &grant, strAddNode.c_str());
                 Sleep(500);
             }
             vnThreadsRunning[THREAD_ADDEDCONNECTIONS]--;
-            Sleep(120000); // Retry every 2 minutes
+            InterruptibleSleep(120000); // Retry every 2 minutes
             vnThreadsRunning[THREAD_ADDEDCONNECTIONS]++;
         }
         return;
@@ -1345,7 +1918,7 @@ void ThreadOpenAddedConnections2(void* parg)
             if (vserv.size() == 0)
                 continue;
             CSemaphoreGrant grant(*semOutbound);
-            OpenNetworkConnection(CAddress(vserv[i % vserv.size()]), &grant);
+            OpenNetworkConnectionAsync(CAddress(vserv[i % vserv.size()]), &grant);
             Sleep(500);
             if (fShutdown)
                 return;
@@ -1353,7 +1926,7 @@ void ThreadOpenAddedConnections2(void* parg)
         if (fShutdown)
             return;
         vnThreadsRunning[THREAD_ADDEDCONNECTIONS]--;
-        Sleep(120000); // Retry every 2 minutes
+        InterruptibleSleep(120000); // Retry every 2 minutes
         vnThreadsRunning[THREAD_ADDEDCONNECTIONS]++;
         if (fShutdown)
             return;
@@ -1398,6 +1971,8 @@ static int64_t NodeSyncScore(const CNode *pnode) {
     return pnode->nLastRecv;
 }
 
+// With -headersfirst the sync node only supplies the headers, the blocks
+// are asked from every peer that has them
 void static StartSync(const vector<CNode*> &vNodes) {
     CNode *pnodeNewSync = NULL;
     int64_t nBestScore = 0;
@@ -1447,6 +2022,9 @@ void ThreadMessageHandler(void* parg)
 
 void ThreadMessageHandler2(void* parg)
 {
+    // Handlers are numbered from 0, the first one also starts the block sync
+    size_t nHandler = (size_t)parg;
+
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
@@ -1463,18 +2041,25 @@ void ThreadMessageHandler2(void* parg)
             }
         }
 
-        if (!fHaveSyncNode)
+        if (!fHaveSyncNode && nHandler == 0)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Each handler starts at its own place in the list, so they don't
+        // all queue up on the same peers
+        if (!vNodesCopy.empty())
+            rotate(vNodesCopy.begin(), vNodesCopy.begin() + (nHandler * vNodesCopy.size() / nMessageHandlerThreads), vNodesCopy.end());
+
+        // Poll the connected nodes for messages. A peer is served by whichever
+        // handler holds its cs_vRecv, both ways, so its messages stay in order
+        // and are never handled by two threads at once.
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
+            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+            if (!lockRecv)
+                continue;
+
             // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
-            }
+            ProcessMessages(pnode);
             if (fShutdown)
                 return;
 
@@ -1497,7 +2082,7 @@ void ThreadMessageHandler2(void* parg)
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        InterruptibleSleep(100);
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1690,6 +2275,8 @@ void StartNode(void* parg)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", nPortZero), nLocalServices));
 
+    dialScheduler.Start(MAX_PARALLEL_DIALS);
+
     Discover();
 
     //
@@ -1722,16 +2309,25 @@ void StartNode(void* parg)
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        if (!NewThread(ThreadMessageHandler, (void*)(size_t)i))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
+
+    // Connect blocks received by the message handler
+    if (fBlockPipeline && !NewThread(ThreadBlockConnector, NULL))
+        printf("Error: NewThread(ThreadBlockConnector) failed\n");
+
+    // Validate the transactions submitted by peers and RPC
+    if (!NewThread(ThreadTxSubmit, NULL))
+        printf("Error: NewThread(ThreadTxSubmit) failed\n");
 
     // Dump network addresses
-    if (!NewThread(ThreadDumpAddress, NULL))
-        printf("Error; NewThread(ThreadDumpAddress) failed\n");
+    scheduler.ScheduleEvery(DumpAddresses, 10 * 60 * 1000);
 
-    // Mine proof-of-stake blocks in the background
-    if (!NewThread(ThreadStakeMiner, pwalletMain))
-        printf("Error: NewThread(ThreadStakeMiner) failed\n");
+    // Mine proof-of-stake blocks in the background, one miner for each wallet
+    BOOST_FOREACH(CWallet* pwallet, vpwallets)
+        if (!NewThread(ThreadStakeMiner, pwallet))
+            printf("Error: NewThread(ThreadStakeMiner) failed\n");
 
     // Trusted NTP server, it's localhost by default.
     strTrustedUpstream = GetArg("-ntp", "localhost");
@@ -1746,11 +2342,15 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    WakeSleepingThreads();
     int64_t nStart = GetTime();
     {
         LOCK(cs_main);
         ThreadScriptCheckQuit();
     }
+    ThreadStakeScanQuit();
+    ThreadBlockConnectorQuit();
+    ThreadTxSubmitQuit();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
@@ -1772,13 +2372,15 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_RPCHANDLER] > 0) printf("ThreadsRPCServer still running\n");
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
-    if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
     if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0)
+    if (vnThreadsRunning[THREAD_STAKESCAN] > 0) printf("ThreadStakeScan still running\n");
+    if (vnThreadsRunning[THREAD_BLOCKCONNECT] > 0) printf("ThreadBlockConnector still running\n");
+    if (vnThreadsRunning[THREAD_TXSUBMIT] > 0) printf("ThreadTxSubmit still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0 || vnThreadsRunning[THREAD_BLOCKCONNECT] > 0 || vnThreadsRunning[THREAD_TXSUBMIT] > 0)
         Sleep(20);
+    dialScheduler.Stop();
     Sleep(50);
-    DumpAddresses();
 
     return true;
 }
@@ -1822,8 +2424,8 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
+    CPublicDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(ss.GetSerializeSize(tx));
     ss << tx;
     RelayTransaction(tx, hash, ss);
 }
@@ -1831,21 +2433,155 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+
+    // Save original serialized message so newer versions are preserved
+    AddRelayMessage(inv, MakeSendBuffer("tx", ss));
+
+    RelayInventory(inv);
+}
+
+// Messages kept on the wire for the getdata requests of the next 15 minutes.
+// They expire by a time wheel: a bucket per minute of arrival, and the
+// bucket of the minute a quarter hour back is dropped as a whole when the
+// wheel turns to reuse it. Past nMaxRelayMemory bytes, the oldest messages
+// go early. The buffers are the ones the send queues hold, not copies.
+// Compressible ones are compressed as they come in, so that the compressed
+// form they keep for the peers is counted in the budget too.
+class CRelayMap
+{
+private:
+    static const int64_t RELAY_WHEEL_STEP = 60;
+    static const unsigned int RELAY_WHEEL_SLOTS = 16;
+
+    boost::unordered_map<CInv, CSendBuffer, SaltedInvHasher> mapMessages;
+    std::deque<CInv> vWheel[RELAY_WHEEL_SLOTS]; // in the order of arrival
+    int64_t nWheelStep;                         // of the newest bucket
+    uint64_t nBytes;
+    CCriticalSection cs;
+
+    // The message and its compressed form, which doesn't change once added
+    static uint64_t GetMessageBytes(const CSendBuffer& pmsg)
     {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        LOCK(pmsg->cs_compressed);
+        return pmsg->size() + (pmsg->pcompressed ? pmsg->pcompressed->size() : 0);
+    }
+
+    void EraseMessage(const CInv& inv)
+    {
+        boost::unordered_map<CInv, CSendBuffer, SaltedInvHasher>::iterator it = mapMessages.find(inv);
+        if (it == mapMessages.end())
+            return;
+        nBytes -= GetMessageBytes(it->second);
+        mapMessages.erase(it);
+    }
+
+    void DropBucket(std::deque<CInv>& vBucket)
+    {
+        BOOST_FOREACH(const CInv& inv, vBucket)
+            EraseMessage(inv);
+        vBucket.clear();
+    }
+
+    void Turn(int64_t nNow)
+    {
+        int64_t nStep = nNow / RELAY_WHEEL_STEP;
+        if (nStep - nWheelStep >= (int64_t)RELAY_WHEEL_SLOTS)
         {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
+            // Idle for longer than the whole wheel
+            for (unsigned int i = 0; i < RELAY_WHEEL_SLOTS; i++)
+                DropBucket(vWheel[i]);
+            nWheelStep = nStep;
+            return;
         }
+        while (nWheelStep < nStep)
+            DropBucket(vWheel[++nWheelStep % RELAY_WHEEL_SLOTS]);
+    }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+    // Oldest first, the message just added last of all
+    void TrimToBudget()
+    {
+        for (unsigned int i = 1; i <= RELAY_WHEEL_SLOTS && nBytes > nMaxRelayMemory; i++)
+        {
+            std::deque<CInv>& vBucket = vWheel[(nWheelStep + i) % RELAY_WHEEL_SLOTS];
+            while (!vBucket.empty() && nBytes > nMaxRelayMemory && mapMessages.size() > 1)
+            {
+                EraseMessage(vBucket.front());
+                vBucket.pop_front();
+            }
+        }
     }
 
-    RelayInventory(inv);
+public:
+    CRelayMap() : nWheelStep(0), nBytes(0) {}
+
+    void Add(const CInv& inv, const CSendBuffer& pmsg)
+    {
+        CompressSendBuffer(pmsg);
+
+        LOCK(cs);
+        Turn(GetTime());
+        if (!mapMessages.insert(std::make_pair(inv, pmsg)).second)
+            return;
+        nBytes += GetMessageBytes(pmsg);
+        vWheel[nWheelStep % RELAY_WHEEL_SLOTS].push_back(inv);
+        if (nMaxRelayMemory && nBytes > nMaxRelayMemory)
+            TrimToBudget();
+    }
+
+    CSendBuffer Find(const CInv& inv)
+    {
+        LOCK(cs);
+        boost::unordered_map<CInv, CSendBuffer, SaltedInvHasher>::const_iterator it = mapMessages.find(inv);
+        return it == mapMessages.end() ? CSendBuffer() : it->second;
+    }
+
+    void GetMemoryUsage(CMemoryUsage& usage)
+    {
+        LOCK(cs);
+        usage.nEntries = mapMessages.size();
+        usage.nUsage = nBytes + mapMessages.size() *
+            (sizeof(std::pair<const CInv, CSendBuffer>) + MEMORY_HASH_NODE + sizeof(CSendMessage) + 4 * sizeof(void*) + sizeof(CInv));
+        usage.nLimit = nMaxRelayMemory;
+    }
+};
+
+static CRelayMap relaymap;
+
+void AddRelayMessage(const CInv& inv, const CSendBuffer& pmsg)
+{
+    relaymap.Add(inv, pmsg);
+}
+
+CSendBuffer FindRelayMessage(const CInv& inv)
+{
+    return relaymap.Find(inv);
+}
+
+void GetNetMemoryUsage(MemoryUsageMap& mapUsage)
+{
+    relaymap.GetMemoryUsage(mapUsage["relay"]);
+
+    {
+        // The send queues share their buffers with the relay map and with
+        // each other, so the same message may be counted more than once
+        CMemoryUsage& peers = mapUsage["peers"];
+        LOCK(cs_vNodes);
+        peers.nEntries = vNodes.size();
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            peers.nUsage += sizeof(CNode) + pnode->nSendSize + pnode->nRecvSize + pnode->filterInventoryKnown.allocated_memory();
+            {
+                LOCK(pnode->cs_addrKnown);
+                peers.nUsage += pnode->setAddrKnown.size() * (sizeof(CAddress) + MEMORY_TREE_NODE) + pnode->vAddrToSend.capacity() * sizeof(CAddress);
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                peers.nUsage += pnode->vInventoryToSend.size() * sizeof(CInv);
+            }
+        }
+    }
+
+    addrman.GetMemoryUsage(mapUsage["addrman"]);
 }
 
 void CNode::RecordBytesRecv(uint64_t bytes)
@@ -1858,6 +2594,118 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    int64_t nNow = GetTime();
+    if (nNow - nOutboundCycleStart >= UPLOAD_TARGET_CYCLE)
+    {
+        nOutboundCycleStart = nNow;
+        nOutboundCycleBytes = 0;
+    }
+    nOutboundCycleBytes += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nTarget)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundTarget = nTarget;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTarget;
+}
+
+bool CNode::OutboundTargetReached()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return false;
+
+    // Keep enough back to send a full block to each outbound peer
+    uint64_t nReserve = (uint64_t)MAX_BLOCK_SIZE * MAX_OUTBOUND_CONNECTIONS;
+    return nOutboundCycleBytes + nReserve >= nMaxOutboundTarget;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return 0;
+    return nOutboundCycleBytes >= nMaxOutboundTarget ? 0 : nMaxOutboundTarget - nOutboundCycleBytes;
+}
+
+int64_t CNode::GetOutboundCycleTimeLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTarget == 0)
+        return 0;
+    return std::max((int64_t)0, nOutboundCycleStart + UPLOAD_TARGET_CYCLE - GetTime());
+}
+
+// Commands past the first MAX_TRAFFIC_COMMANDS are counted together, so a
+// peer can't grow the maps by making up commands
+static CMessageTraffic& TrafficEntry(MessageTrafficMap& mapTraffic, const std::string& strCommand)
+{
+    MessageTrafficMap::iterator mi = mapTraffic.find(strCommand);
+    if (mi != mapTraffic.end())
+        return mi->second;
+    if (mapTraffic.size() >= MAX_TRAFFIC_COMMANDS)
+        return mapTraffic["*other*"];
+    return mapTraffic[strCommand];
+}
+
+void CNode::RecordSend(const std::vector<char>& vMsg)
+{
+    if (vMsg.size() < CMessageHeader::HEADER_SIZE)
+        return;
+    const char* pszCommand = &vMsg[CMessageHeader::MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, pszCommand + strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+    {
+        LOCK(cs_traffic);
+        CMessageTraffic& traffic = TrafficEntry(mapSendTraffic, strCommand);
+        traffic.nMessages++;
+        traffic.nBytes += vMsg.size();
+    }
+    {
+        LOCK(cs_messageStats);
+        CMessageTraffic& traffic = TrafficEntry(mapTotalSent, strCommand);
+        traffic.nMessages++;
+        traffic.nBytes += vMsg.size();
+    }
+}
+
+void CNode::RecordRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_traffic);
+        CMessageTraffic& traffic = TrafficEntry(mapRecvTraffic, strCommand);
+        traffic.nMessages++;
+        traffic.nBytes += nBytes;
+    }
+    {
+        LOCK(cs_messageStats);
+        CMessageTraffic& traffic = TrafficEntry(mapTotalRecv, strCommand);
+        traffic.nMessages++;
+        traffic.nBytes += nBytes;
+    }
+}
+
+void RecordProcessTime(const std::string& strCommand, int64_t nUsec, int64_t nMainWaitUsec, int64_t nMainHeldUsec)
+{
+    LOCK(cs_messageStats);
+    ProcessTimeMap::iterator mi = mapProcessTimes.find(strCommand);
+    if (mi == mapProcessTimes.end())
+        mi = mapProcessTimes.insert(std::make_pair(mapProcessTimes.size() >= MAX_TRAFFIC_COMMANDS ? std::string("*other*") : strCommand, CProcessTime())).first;
+    mi->second.Add(nUsec, nMainWaitUsec, nMainHeldUsec);
+}
+
+void GetMessageStats(MessageTrafficMap& mapSentRet, MessageTrafficMap& mapRecvRet, ProcessTimeMap& mapTimesRet)
+{
+    LOCK(cs_messageStats);
+    mapSentRet = mapTotalSent;
+    mapRecvRet = mapTotalRecv;
+    mapTimesRet = mapProcessTimes;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -10,6 +10,8 @@
 #ifndef Q_MOC_RUN
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #endif
 #include <openssl/rand.h>
 
@@ -18,6 +20,7 @@
 #endif
 
 #include "mruset.h"
+#include "uint256map.h"
 #include "netbase.h"
 #include "addrman.h"
 #include "hash.h"
@@ -34,6 +37,50 @@ const uint16_t nPortZero = 0;
 inline uint64_t ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline uint64_t SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+class CSendMessage;
+
+/** A finished message, header included. It is never changed once queued, so
+ * the same buffer can wait in the send queues of many peers. */
+typedef boost::shared_ptr<const CSendMessage> CSendBuffer;
+
+class CSendMessage : public std::vector<char>
+{
+public:
+    // The compressed form, worked out by CompressSendBuffer for the first
+    // peer that takes compressed messages and kept for the others
+    mutable CCriticalSection cs_compressed;
+    mutable bool fCompressed;
+    mutable CSendBuffer pcompressed; // NULL if the message doesn't get smaller
+
+    CSendMessage() : fCompressed(false) {}
+    explicit CSendMessage(size_type n) : std::vector<char>(n), fCompressed(false) {}
+    template<typename InputIterator>
+    CSendMessage(InputIterator first, InputIterator last) : std::vector<char>(first, last), fCompressed(false) {}
+};
+
+CSendBuffer MakeSendBuffer(const char* pszCommand, const CDataStream& vPayload);
+// The message with its payload compressed, for a peer that takes compressed
+// messages, see "sendcompress". The message itself if it is not a block or
+// a transaction, or does not get smaller.
+CSendBuffer CompressSendBuffer(const CSendBuffer& pmsg);
+
+/** SaltedHasher for unordered containers keyed by inventory items */
+class SaltedInvHasher : public SaltedHasher
+{
+public:
+    size_t operator()(const CInv& inv) const { return Mix(inv.hash.Get64(0) + inv.type); }
+};
+
+typedef limitedmap<CInv, int64_t, boost::unordered_map<CInv, int64_t, SaltedInvHasher> > AskedForMap;
+
+template<typename T>
+CSendBuffer MakeSendBuffer(const char* pszCommand, const T& obj)
+{
+    CDataStream vPayload(SER_NETWORK, PROTOCOL_VERSION);
+    vPayload << obj;
+    return MakeSendBuffer(pszCommand, vPayload);
+}
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -47,6 +94,7 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void DumpAddresses();
 
 enum
 {
@@ -110,12 +158,14 @@ enum threadId
     THREAD_RPCLISTENER,
     THREAD_DNSSEED,
     THREAD_ADDEDCONNECTIONS,
-    THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_MINTER,
     THREAD_SCRIPTCHECK,
     THREAD_NTP,
     THREAD_IPCOLLECTOR,
+    THREAD_STAKESCAN,
+    THREAD_BLOCKCONNECT,
+    THREAD_TXSUBMIT,
 
     THREAD_MAX
 };
@@ -135,13 +185,93 @@ extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64_t> mapAlreadyAskedFor;
+extern uint64_t nMaxRelayMemory;
+extern AskedForMap mapAlreadyAskedFor;
+extern int nMessageHandlerThreads;
+extern unsigned int nInvBatchSize;
+extern int64_t nInvBytesPerSecond;
+extern bool fTxReconcile;
+extern bool fCompressMessages;
+
+static const int MAX_MESSAGEHANDLER_THREADS = 16;
+// Recent inventory remembered per peer, so it isn't announced to it again
+static const unsigned int INVENTORY_KNOWN_SIZE = 20000;
+// Most inventory queued for a peer
+static const unsigned int MAX_INV_QUEUE = 50000;
+// Most inventory remembered as requested, the oldest requests are forgotten
+static const unsigned int MAX_ASKED_FOR = 50000;
+// Seconds between timed pings, and before a missing pong drops the peer
+static const int64_t PING_INTERVAL = 2 * 60;
+static const int64_t PING_TIMEOUT = 20 * 60;
+// Most commands counted apart, per peer and in total; the rest share one entry
+static const unsigned int MAX_TRAFFIC_COMMANDS = 48;
+// Length of the -maxuploadtarget cycle, in seconds
+static const int64_t UPLOAD_TARGET_CYCLE = 24 * 60 * 60;
+// Seconds between transaction reconciliation rounds with an outbound peer
+static const int64_t RECON_INTERVAL = 8;
+// Most transactions waiting for a round, the rest are announced
+static const unsigned int MAX_RECON_SET = 10000;
+// Most cells of a reconciliation sketch
+static const unsigned int MAX_SKETCH_CELLS = 8192;
+// Set in the size field of a message whose payload is compressed
+static const unsigned int MESSAGE_SIZE_COMPRESSED = 0x80000000;
+// Smaller payloads are sent as they are
+static const unsigned int MIN_COMPRESS_SIZE = 256;
+
+
+
+
+/** Messages and bytes of one command, sent or received */
+class CMessageTraffic
+{
+public:
+    uint64_t nMessages;
+    uint64_t nBytes;
+
+    CMessageTraffic() : nMessages(0), nBytes(0) {}
+};
+typedef std::map<std::string, CMessageTraffic> MessageTrafficMap;
 
+/** Time taken to process the messages of one command */
+class CProcessTime
+{
+public:
+    // under 100us, 1ms, 10ms, 100ms, 1s, and longer
+    static const int BUCKETS = 6;
+
+    uint64_t nMessages;
+    int64_t nTotalUsec;
+    int64_t nMaxUsec;
+    uint64_t vBuckets[BUCKETS];
+    // cs_main, for the messages handled under it as a whole
+    int64_t nMainWaitUsec;
+    int64_t nMainHeldUsec;
+    int64_t nMaxMainHeldUsec;
+
+    CProcessTime() : nMessages(0), nTotalUsec(0), nMaxUsec(0), nMainWaitUsec(0), nMainHeldUsec(0), nMaxMainHeldUsec(0)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+            vBuckets[i] = 0;
+    }
 
+    void Add(int64_t nUsec, int64_t nWaitUsec, int64_t nHeldUsec)
+    {
+        nMessages++;
+        nTotalUsec += nUsec;
+        nMaxUsec = std::max(nMaxUsec, nUsec);
+        nMainWaitUsec += nWaitUsec;
+        nMainHeldUsec += nHeldUsec;
+        nMaxMainHeldUsec = std::max(nMaxMainHeldUsec, nHeldUsec);
+        int nBucket = 0;
+        for (int64_t nLimit = 100; nBucket < BUCKETS - 1 && nUsec >= nLimit; nLimit *= 10)
+            nBucket++;
+        vBuckets[nBucket]++;
+    }
+};
+typedef std::map<std::string, CProcessTime> ProcessTimeMap;
 
+void RecordProcessTime(const std::string& strCommand, int64_t nUsec, int64_t nMainWaitUsec, int64_t nMainHeldUsec);
+void GetMessageStats(MessageTrafficMap& mapSentRet, MessageTrafficMap& mapRecvRet, ProcessTimeMap& mapTimesRet);
 
 class CNodeStats
 {
@@ -157,14 +287,69 @@ public:
     int64_t nReleaseTime;
     int32_t nStartingHeight;
     int32_t nMisbehavior;
+    int nBlocksInFlight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
     bool fSyncNode;
+    bool fCompressSend;
+    int64_t nPingUsec;
+    int64_t nMinPingUsec;
+    int64_t nPingWaitUsec;
+    MessageTrafficMap mapSendTraffic;
+    MessageTrafficMap mapRecvTraffic;
 };
 
 
 
 
+/** A message being received. The header is parsed as soon as it is in, then
+ * the payload goes into a buffer of exactly its size and is hashed for the
+ * checksum as it arrives. */
+class CNetMessage
+{
+public:
+    bool fInData; // header is complete, reading the payload
+
+    CPublicDataStream hdrbuf; // header so far
+    CMessageHeader hdr;
+    unsigned int nHdrPos;
+
+    CPublicDataStream vRecv; // payload
+    unsigned int nDataPos;
+    CHashWriter hasher; // payload so far
+    bool fChecksumOk; // set once complete
+    unsigned int nCompressedSize; // of the payload as received, 0 if it was not compressed
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(CMessageHeader::HEADER_SIZE);
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+        fChecksumOk = false;
+        nCompressedSize = 0;
+    }
+
+    bool IsComplete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    // Return how many of the bytes were used, or -1 if the header is invalid
+    // or the payload would be larger than nMaxSize
+    int ReadHeader(const char* pch, unsigned int nBytes, uint64_t nMaxSize, bool fAllowCompressed);
+    int ReadData(const char* pch, unsigned int nBytes);
+    // Replace the complete compressed payload with what it holds, if that
+    // is no larger than nMaxSize
+    bool Decompress(uint64_t nMaxSize);
+};
+
 
 /** Information about a peer */
 class CNode
@@ -173,8 +358,16 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CPublicDataStream vSend; // the message being pushed
+    std::deque<CSendBuffer> vSendMsg; // messages waiting for the socket
+    size_t nSendOffset; // bytes of the first one already sent
+    uint64_t nSendSize; // bytes waiting in vSendMsg
+    std::deque<CNetMessage> vRecvMsg; // messages received, the last one maybe partial
+    uint64_t nRecvSize; // bytes held by vRecvMsg, payloads counted in full
+    int nRecvVersion;
+    bool fCompressSend; // the peer takes compressed messages, guarded by cs_vSend
+    bool fCompressRecv; // we told the peer we take them, guarded by cs_vRecv
+    bool fPauseRecv; // its transactions wait for the submission queue, guarded by cs_vRecv
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
     CCriticalSection cs_vSend;
@@ -197,6 +390,11 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
+
+    // traffic by command
+    MessageTrafficMap mapSendTraffic;
+    MessageTrafficMap mapRecvTraffic;
+    CCriticalSection cs_traffic;
 protected:
     int nRefCount;
 
@@ -214,11 +412,29 @@ public:
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
     int32_t nStartingHeight;
+    int32_t nBestKnownHeight; // from the headers it sent
+    int nBlocksInFlight;      // blocks asked from it, guarded by cs_main
+    int nBlocksStalled;       // times it held up the block download
+    int nBlocksDelivered;     // new blocks it sent us first
+
+    // connection quality, see RecordQuality()
+    int64_t nVersionSentUsec;
+    uint64_t nPingNonceSent;  // of the ping waiting for its pong, 0 if none
+    int64_t nPingUsecStart;
+    int64_t nPingUsec;        // last round trip time, 0 if not known yet
+    int64_t nMinPingUsec;
+    int64_t nLastBlockTime;   // when it last sent us a new block
+    int64_t nLastTxTime;      // when it last sent us a new transaction
+    int64_t nQualityTime;     // when the quality was last recorded
+    uint64_t nQualityRecvBytes;
+    int nQualityBlocks;
     bool fStartSync;
+    bool fGetHeaders;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
@@ -227,15 +443,33 @@ public:
     int64_t nNextInvSend;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    CRollingBloomFilter filterInventoryKnown;
+    std::deque<CInv> vInventoryToSend;
+    int64_t nInvBudget;     // bytes of tx inventory it may be sent now
+    int64_t nInvBudgetTime;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    // transaction reconciliation, see "sendrecon", guarded by cs_inventory
+    bool fTxRecon;
+    uint64_t nReconSalt;      // ours, 0 until sent
+    uint64_t nReconKey;       // both salts, keys the short ids
+    std::map<uint64_t, uint256> mapReconSet;      // for the next round
+    std::map<uint64_t, uint256> mapReconSnapshot; // of the round under way
+    bool fReconPending;       // a round was asked for, its answer is awaited
+    int64_t nNextReconTime;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.00001)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nRecvSize = 0;
+        nRecvVersion = MIN_PROTO_VERSION;
+        fCompressSend = false;
+        fCompressRecv = false;
+        fPauseRecv = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -260,14 +494,35 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nBestKnownHeight = -1;
+        nBlocksInFlight = 0;
+        nBlocksStalled = 0;
+        nBlocksDelivered = 0;
+        nVersionSentUsec = 0;
+        nPingNonceSent = 0;
+        nPingUsecStart = 0;
+        nPingUsec = 0;
+        nMinPingUsec = 0;
+        nLastBlockTime = 0;
+        nLastTxTime = 0;
+        nQualityTime = GetTime();
+        nQualityRecvBytes = 0;
+        nQualityBlocks = 0;
         nNextLocalAddrSend = 0;
         nNextAddrSend = 0;
         nNextInvSend = 0;
         fStartSync = false;
+        fGetHeaders = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size((size_t)SendBufferSize() / 1000);
+        nInvBudget = 0;
+        nInvBudgetTime = 0;
+        fTxRecon = false;
+        nReconSalt = 0;
+        nReconKey = 0;
+        fReconPending = false;
+        nNextReconTime = 0;
 
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
@@ -289,6 +544,12 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+
+    // Upload target, guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundTarget;
+    static uint64_t nOutboundCycleBytes;
+    static int64_t nOutboundCycleStart;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 public:
@@ -315,8 +576,19 @@ public:
 
 
 
+    // Add received bytes to vRecvMsg, false if the peer sent an invalid header
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -325,33 +597,54 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
 
 
-    void AddInventoryKnown(const CInv& inv)
+    // Returns false if it was known already
+    bool AddInventoryKnown(const CInv& inv)
     {
-        {
-            LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
-        }
+        LOCK(cs_inventory);
+        return filterInventoryKnown.insert(inv.hash);
     }
 
     void PushInventory(const CInv& inv)
     {
+        LOCK(cs_inventory);
+        if (filterInventoryKnown.contains(inv.hash))
+            return;
+        // A peer that can't keep up misses the oldest announcements
+        if (vInventoryToSend.size() >= MAX_INV_QUEUE)
+            vInventoryToSend.pop_front();
+        vInventoryToSend.push_back(inv);
+    }
+
+    void PushInventory(const std::vector<CInv>& vInv)
+    {
+        LOCK(cs_inventory);
+        BOOST_FOREACH(const CInv& inv, vInv)
         {
-            LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (filterInventoryKnown.contains(inv.hash))
+                continue;
+            if (vInventoryToSend.size() >= MAX_INV_QUEUE)
+                vInventoryToSend.pop_front();
+            vInventoryToSend.push_back(inv);
         }
     }
 
+    uint64_t GetReconShortId(const uint256& hash) const
+    {
+        return Hash(BEGIN(nReconKey), END(nReconKey), hash.begin(), hash.end()).Get64();
+    }
+
     void AskFor(const CInv& inv)
     {
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
-        int64_t& nRequestTime = mapAlreadyAskedFor[inv];
+        AskedForMap::const_iterator it = mapAlreadyAskedFor.find(inv);
+        int64_t nRequestTime = (it != mapAlreadyAskedFor.end()) ? it->second : 0;
         if (fDebugNet)
             printf("askfor %s   %" PRId64 " (%s)\n", inv.ToString().c_str(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime/1000000).c_str());
 
@@ -364,6 +657,10 @@ public:
 
         // Each retry is 2 minutes after the last
         nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
+        if (it != mapAlreadyAskedFor.end())
+            mapAlreadyAskedFor.update(it, nRequestTime);
+        else
+            mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
         mapAskFor.insert(std::make_pair(nRequestTime, inv));
     }
 
@@ -421,6 +718,15 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // Queue it in a buffer of its own
+        CSendBuffer pmsg(new CSendMessage(vSend.begin() + nHeaderStart, vSend.end()));
+        vSend.resize(nHeaderStart);
+        if (fCompressSend)
+            pmsg = CompressSendBuffer(pmsg);
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
+        RecordSend(*pmsg);
+
         nHeaderStart = -1;
         nMessageStart = std::numeric_limits<uint32_t>::max();
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -439,7 +745,13 @@ public:
 
 
 
+    // Count a queued message, or a received one, under its command
+    void RecordSend(const std::vector<char>& vMsg);
+    void RecordRecv(const std::string& strCommand, uint64_t nBytes);
+
     void PushVersion();
+    // Tell addrman how the connection did since the last time
+    void RecordQuality();
 
 
     void PushMessage(const char* pszCommand)
@@ -456,12 +768,15 @@ public:
         }
     }
 
+    // The messages below reserve their exact size once vSend is locked, so a
+    // large payload like a block doesn't grow the buffer step by step
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1));
             vSend << a1;
             EndMessage();
         }
@@ -478,6 +793,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2));
             vSend << a1 << a2;
             EndMessage();
         }
@@ -494,6 +810,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3));
             vSend << a1 << a2 << a3;
             EndMessage();
         }
@@ -510,6 +827,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4));
             vSend << a1 << a2 << a3 << a4;
             EndMessage();
         }
@@ -526,6 +844,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4) + vSend.GetSerializeSize(a5));
             vSend << a1 << a2 << a3 << a4 << a5;
             EndMessage();
         }
@@ -542,6 +861,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4) + vSend.GetSerializeSize(a5) + vSend.GetSerializeSize(a6));
             vSend << a1 << a2 << a3 << a4 << a5 << a6;
             EndMessage();
         }
@@ -558,6 +878,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4) + vSend.GetSerializeSize(a5) + vSend.GetSerializeSize(a6) + vSend.GetSerializeSize(a7));
             vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
             EndMessage();
         }
@@ -574,6 +895,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4) + vSend.GetSerializeSize(a5) + vSend.GetSerializeSize(a6) + vSend.GetSerializeSize(a7) + vSend.GetSerializeSize(a8));
             vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
             EndMessage();
         }
@@ -590,6 +912,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
+            vSend.reserve(vSend.size() + vSend.GetSerializeSize(a1) + vSend.GetSerializeSize(a2) + vSend.GetSerializeSize(a3) + vSend.GetSerializeSize(a4) + vSend.GetSerializeSize(a5) + vSend.GetSerializeSize(a6) + vSend.GetSerializeSize(a7) + vSend.GetSerializeSize(a8) + vSend.GetSerializeSize(a9));
             vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
             EndMessage();
         }
@@ -601,6 +924,26 @@ public:
     }
 
 
+    // Queue a message made by MakeSendBuffer, which may be shared with other peers.
+    // It is compressed outside of cs_vSend, and only once for all of them.
+    void PushSendBuffer(const CSendBuffer& pmsgIn)
+    {
+        bool fCompress;
+        {
+            LOCK(cs_vSend);
+            fCompress = fCompressSend;
+        }
+        CSendBuffer pmsg = fCompress ? CompressSendBuffer(pmsgIn) : pmsgIn;
+
+        LOCK(cs_vSend);
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
+        RecordSend(*pmsg);
+        if (fDebug)
+            printf("sending: queued buffer (%" PRIszu " bytes)\n", pmsg->size());
+    }
+
+
     void PushRequest(const char* pszCommand,
                      void (*fn)(void*, CDataStream&), void* param1)
     {
@@ -679,6 +1022,14 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // -maxuploadtarget, in bytes per cycle, 0 for none
+    static void SetMaxOutboundTarget(uint64_t nTarget);
+    static uint64_t GetMaxOutboundTarget();
+    // Whether the cycle's upload is used up, but for what the newest blocks need
+    static bool OutboundTargetReached();
+    static uint64_t GetOutboundTargetBytesLeft();
+    static int64_t GetOutboundCycleTimeLeft();
 };
 
 inline void RelayInventory(const CInv& inv)
@@ -691,9 +1042,23 @@ inline void RelayInventory(const CInv& inv)
     }
 }
 
+// Several at once, so that each peer gets them in one inv message
+inline void RelayInventory(const std::vector<CInv>& vInv)
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        pnode->PushInventory(vInv);
+}
+
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void AddRelayMessage(const CInv& inv, const CSendBuffer& pmsg);
+// The message kept for getdata requests, or null
+CSendBuffer FindRelayMessage(const CInv& inv);
+
+// Estimated memory of the relay map, the peers and the address manager
+void GetNetMemoryUsage(MemoryUsageMap& mapUsage);
 
 
 /** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
@@ -839,6 +839,14 @@ uint64_t CNetAddr::GetHash() const
     return nRet;
 }
 
+uint64_t CNetAddr::GetCheapHash() const
+{
+    uint64_t nHigh, nLow;
+    memcpy(&nHigh, &ip[0], sizeof(nHigh));
+    memcpy(&nLow, &ip[8], sizeof(nLow));
+    return nHigh ^ nLow;
+}
+
 // private extensions to enum Network, only returned by GetExtNetwork,
 // and only used in GetReachabilityFrom
 static const int NET_UNKNOWN = NET_MAX + 0;
@@ -68,6 +68,8 @@ class CNetAddr
         std::string ToStringIP() const;
         uint8_t GetByte(int n) const;
         uint64_t GetHash() const;
+        // The address folded to 64 bits, to be salted by hash tables
+        uint64_t GetCheapHash() const;
         bool GetInAddr(struct in_addr* pipv4Addr) const;
         std::vector<unsigned char> GetGroup() const;
         int GetReachabilityFrom(const CNetAddr *paddrPartner = NULL) const;
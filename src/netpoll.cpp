@@ -0,0 +1,303 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+#include "util.h"
+
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(USE_KQUEUE)
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+// Most events handled per wait, the rest are kept by the kernel for the next one
+static const int MAX_POLL_EVENTS = 512;
+
+#if defined(USE_EPOLL)
+
+CSocketPoller::CSocketPoller()
+{
+    fdPoll = epoll_create(MAX_POLL_EVENTS);
+    if (fdPoll == -1)
+        printf("CSocketPoller() : epoll_create failed with error %d\n", errno);
+}
+
+CSocketPoller::~CSocketPoller()
+{
+    if (fdPoll != -1)
+        close(fdPoll);
+}
+
+bool CSocketPoller::Add(SOCKET hSocket, void* pOwner, bool fListen)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = fListen ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLET);
+    event.data.fd = hSocket;
+
+    // The number may still be registered if its previous socket was closed
+    // while duplicated, so fall back to modifying it
+    if (epoll_ctl(fdPoll, EPOLL_CTL_ADD, hSocket, &event) == -1 &&
+        (errno != EEXIST || epoll_ctl(fdPoll, EPOLL_CTL_MOD, hSocket, &event) == -1))
+    {
+        printf("CSocketPoller::Add() : epoll_ctl failed with error %d\n", errno);
+        return false;
+    }
+    mapOwners[hSocket] = make_pair(pOwner, fListen);
+    return true;
+}
+
+void CSocketPoller::Remove(SOCKET hSocket, void* pOwner)
+{
+    map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.find(hSocket);
+    if (mi == mapOwners.end() || mi->second.first != pOwner)
+        return;
+    mapOwners.erase(mi);
+
+    // Fails if the socket was already closed, which removed it anyway
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(fdPoll, EPOLL_CTL_DEL, hSocket, &event);
+}
+
+void CSocketPoller::WantWrite(SOCKET hSocket, bool fWant)
+{
+}
+
+bool CSocketPoller::Wait(int nTimeout, vector<CSocketEvent>& vEventsRet)
+{
+    vEventsRet.clear();
+
+    struct epoll_event events[MAX_POLL_EVENTS];
+    int nEvents = epoll_wait(fdPoll, events, MAX_POLL_EVENTS, nTimeout);
+    if (nEvents == -1)
+        return errno == EINTR;
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.find(events[i].data.fd);
+        if (mi == mapOwners.end())
+            continue;
+
+        CSocketEvent event;
+        event.hSocket = mi->first;
+        event.pOwner = mi->second.first;
+        event.nFlags = 0;
+        if (events[i].events & EPOLLIN)
+            event.nFlags |= POLL_READ;
+        if (events[i].events & EPOLLOUT)
+            event.nFlags |= POLL_WRITE;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            event.nFlags |= POLL_ERROR;
+        vEventsRet.push_back(event);
+    }
+    return true;
+}
+
+#elif defined(USE_KQUEUE)
+
+CSocketPoller::CSocketPoller()
+{
+    fdPoll = kqueue();
+    if (fdPoll == -1)
+        printf("CSocketPoller() : kqueue failed with error %d\n", errno);
+}
+
+CSocketPoller::~CSocketPoller()
+{
+    if (fdPoll != -1)
+        close(fdPoll);
+}
+
+bool CSocketPoller::Add(SOCKET hSocket, void* pOwner, bool fListen)
+{
+    struct kevent change;
+    EV_SET(&change, hSocket, EVFILT_READ, fListen ? EV_ADD : (EV_ADD | EV_CLEAR), 0, 0, NULL);
+    if (kevent(fdPoll, &change, 1, NULL, 0, NULL) == -1)
+    {
+        printf("CSocketPoller::Add() : kevent failed with error %d\n", errno);
+        return false;
+    }
+    if (!fListen)
+    {
+        EV_SET(&change, hSocket, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        if (kevent(fdPoll, &change, 1, NULL, 0, NULL) == -1)
+        {
+            printf("CSocketPoller::Add() : kevent failed with error %d\n", errno);
+            EV_SET(&change, hSocket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+            kevent(fdPoll, &change, 1, NULL, 0, NULL);
+            return false;
+        }
+    }
+    mapOwners[hSocket] = make_pair(pOwner, fListen);
+    return true;
+}
+
+void CSocketPoller::Remove(SOCKET hSocket, void* pOwner)
+{
+    map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.find(hSocket);
+    if (mi == mapOwners.end() || mi->second.first != pOwner)
+        return;
+    bool fListen = mi->second.second;
+    mapOwners.erase(mi);
+
+    // Fails if the socket was already closed, which removed it anyway
+    struct kevent change;
+    EV_SET(&change, hSocket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(fdPoll, &change, 1, NULL, 0, NULL);
+    if (!fListen)
+    {
+        EV_SET(&change, hSocket, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(fdPoll, &change, 1, NULL, 0, NULL);
+    }
+}
+
+void CSocketPoller::WantWrite(SOCKET hSocket, bool fWant)
+{
+}
+
+bool CSocketPoller::Wait(int nTimeout, vector<CSocketEvent>& vEventsRet)
+{
+    vEventsRet.clear();
+
+    struct timespec timeout;
+    timeout.tv_sec = nTimeout / 1000;
+    timeout.tv_nsec = (nTimeout % 1000) * 1000000;
+
+    struct kevent events[MAX_POLL_EVENTS];
+    int nEvents = kevent(fdPoll, NULL, 0, events, MAX_POLL_EVENTS, &timeout);
+    if (nEvents == -1)
+        return errno == EINTR;
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.find((SOCKET)events[i].ident);
+        if (mi == mapOwners.end())
+            continue;
+
+        // The read and write filters of a socket come as separate events
+        CSocketEvent event;
+        event.hSocket = mi->first;
+        event.pOwner = mi->second.first;
+        event.nFlags = 0;
+        if (events[i].filter == EVFILT_READ)
+            event.nFlags |= POLL_READ;
+        if (events[i].filter == EVFILT_WRITE)
+            event.nFlags |= POLL_WRITE;
+        if (events[i].flags & (EV_EOF | EV_ERROR))
+            event.nFlags |= POLL_ERROR;
+        vEventsRet.push_back(event);
+    }
+    return true;
+}
+
+#else
+
+CSocketPoller::CSocketPoller()
+{
+}
+
+CSocketPoller::~CSocketPoller()
+{
+}
+
+bool CSocketPoller::Add(SOCKET hSocket, void* pOwner, bool fListen)
+{
+#ifdef WIN32
+    // Windows fd_sets hold up to FD_SETSIZE sockets of any number
+    if (!mapOwners.count(hSocket) && mapOwners.size() >= (size_t)FD_SETSIZE)
+#else
+    if (hSocket >= FD_SETSIZE)
+#endif
+    {
+        printf("CSocketPoller::Add() : socket %d over the select() limit of %d\n", (int)hSocket, (int)FD_SETSIZE);
+        return false;
+    }
+    mapOwners[hSocket] = make_pair(pOwner, fListen);
+    setWantWrite.erase(hSocket);
+    return true;
+}
+
+void CSocketPoller::Remove(SOCKET hSocket, void* pOwner)
+{
+    map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.find(hSocket);
+    if (mi == mapOwners.end() || mi->second.first != pOwner)
+        return;
+    mapOwners.erase(mi);
+    setWantWrite.erase(hSocket);
+}
+
+void CSocketPoller::WantWrite(SOCKET hSocket, bool fWant)
+{
+    if (!fWant)
+        setWantWrite.erase(hSocket);
+    else if (mapOwners.count(hSocket))
+        setWantWrite.insert(hSocket);
+}
+
+bool CSocketPoller::Wait(int nTimeout, vector<CSocketEvent>& vEventsRet)
+{
+    vEventsRet.clear();
+    if (mapOwners.empty())
+    {
+        Sleep(nTimeout);
+        return true;
+    }
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+    for (map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.begin(); mi != mapOwners.end(); ++mi)
+    {
+        FD_SET(mi->first, &fdsetRecv);
+        if (!mi->second.second)
+            FD_SET(mi->first, &fdsetError);
+        hSocketMax = max(hSocketMax, mi->first);
+    }
+    BOOST_FOREACH(SOCKET hSocket, setWantWrite)
+        FD_SET(hSocket, &fdsetSend);
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+        return WSAGetLastError() == WSAEINTR;
+
+    for (map<SOCKET, pair<void*, bool> >::iterator mi = mapOwners.begin(); mi != mapOwners.end(); ++mi)
+    {
+        CSocketEvent event;
+        event.hSocket = mi->first;
+        event.pOwner = mi->second.first;
+        event.nFlags = 0;
+        if (FD_ISSET(mi->first, &fdsetRecv))
+            event.nFlags |= POLL_READ;
+        if (FD_ISSET(mi->first, &fdsetSend))
+            event.nFlags |= POLL_WRITE;
+        if (FD_ISSET(mi->first, &fdsetError))
+            event.nFlags |= POLL_ERROR;
+        if (event.nFlags != 0)
+            vEventsRet.push_back(event);
+    }
+    return true;
+}
+
+#endif
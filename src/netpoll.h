@@ -0,0 +1,81 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETPOLL_H
+#define BITCOIN_NETPOLL_H
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "compat.h"
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define USE_KQUEUE 1
+#endif
+
+enum
+{
+    POLL_READ  = (1 << 0),
+    POLL_WRITE = (1 << 1),
+    POLL_ERROR = (1 << 2),
+};
+
+/** A socket which is ready, with the pointer it was added with */
+struct CSocketEvent
+{
+    SOCKET hSocket;
+    void* pOwner;
+    int nFlags;     // POLL_*
+};
+
+/** Readiness of the sockets of the network thread.
+ *
+ * With epoll (Linux) and kqueue (BSD, OS X) the peer sockets are watched
+ * edge-triggered for both directions: an event only says the socket became
+ * readable or writable, so the caller keeps it that way until recv() or send()
+ * would block. The set of sockets is kept by the kernel, so a wait costs the
+ * number of ready sockets, not the number of peers, and there is no
+ * FD_SETSIZE limit.
+ *
+ * Elsewhere select() is used over the added sockets, which are only watched
+ * for writes once WantWrite asks for it.
+ *
+ * Sockets may be closed by other threads before they are removed, and their
+ * number reused, so each one is added with its owner and only removed by it.
+ */
+class CSocketPoller
+{
+private:
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    int fdPoll;
+#else
+    std::set<SOCKET> setWantWrite;
+#endif
+    std::map<SOCKET, std::pair<void*, bool> > mapOwners; // owner, and whether it listens
+
+    CSocketPoller(const CSocketPoller&);
+    void operator=(const CSocketPoller&);
+
+public:
+    CSocketPoller();
+    ~CSocketPoller();
+
+    // Watch a peer socket for reads and writes, or a listening socket for
+    // connections (level-triggered, one accept per event is fine)
+    bool Add(SOCKET hSocket, void* pOwner, bool fListen = false);
+
+    // Stop watching the socket, unless it was added by someone else since
+    void Remove(SOCKET hSocket, void* pOwner);
+
+    // Only needed by select(): whether the socket is waiting to be writable
+    void WantWrite(SOCKET hSocket, bool fWant);
+
+    // Wait up to nTimeout milliseconds for the sockets to be ready
+    bool Wait(int nTimeout, std::vector<CSocketEvent>& vEventsRet);
+};
+
+#endif
@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NOTIFY_H
+#define BITCOIN_NOTIFY_H
+
+#include <deque>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "uint256.h"
+
+extern bool fShutdown;
+
+/** The latest hashes of some kind of event, numbered, for long polling RPC
+ * calls. A caller passes the number it has seen last and waits for the ones
+ * after it. Only the last nMaxHistory are kept.
+ */
+class CNotifyHistory
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    const unsigned int nMaxHistory;
+    uint64_t nSequence;             // number of the latest notification
+    std::deque<uint256> history;    // notifications nSequence - history.size() + 1 to nSequence
+
+public:
+    explicit CNotifyHistory(unsigned int nMaxHistoryIn) : nMaxHistory(nMaxHistoryIn), nSequence(0) { }
+
+    void Push(const uint256& hash)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            history.push_back(hash);
+            if (history.size() > nMaxHistory)
+                history.pop_front();
+            nSequence++;
+        }
+        cond.notify_all();
+    }
+
+    uint64_t GetSequence()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nSequence;
+    }
+
+    // Wait up to nTimeout milliseconds for notifications after nSince, which
+    // are returned oldest first. Returns the number of the latest one.
+    uint64_t Wait(uint64_t nSince, int64_t nTimeout, std::vector<uint256>& vHashRet, bool& fMissedRet)
+    {
+        vHashRet.clear();
+        fMissedRet = false;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        // A number from before a restart
+        if (nSince > nSequence)
+            nSince = 0;
+
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nTimeout);
+        while (nSequence <= nSince)
+        {
+            if (fShutdown || !cond.timed_wait(lock, timeout))
+                break;
+        }
+
+        if (nSequence > nSince)
+        {
+            uint64_t nFirst = nSequence - history.size() + 1;
+            if (nSince + 1 < nFirst)
+            {
+                // Older ones were forgotten already
+                fMissedRet = true;
+                nSince = nFirst - 1;
+            }
+            vHashRet.assign(history.begin() + (nSince + 1 - nFirst), history.end());
+        }
+        return nSequence;
+    }
+
+    // Wake the waiting threads up, so they notice the shutdown
+    void Interrupt()
+    {
+        cond.notify_all();
+    }
+};
+
+#endif
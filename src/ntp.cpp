@@ -325,9 +325,10 @@ bool InitWithRandom(SOCKET &sockfd, socklen_t &servlen, struct sockaddr *pcliadd
     return false;
 }
 
-int64_t DoReq(SOCKET sockfd, socklen_t servlen, struct sockaddr cliaddr) {
-
+// Seconds to wait for the answers of the servers asked
+static const int NTP_TIMEOUT = 10;
 
+static bool SetNonBlocking(SOCKET sockfd) {
 #ifdef WIN32
     u_long nOne = 1;
     if (ioctlsocket(sockfd, FIONBIO, &nOne) == SOCKET_ERROR) {
@@ -336,36 +337,45 @@ int64_t DoReq(SOCKET sockfd, socklen_t servlen, struct sockaddr cliaddr) {
     if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == SOCKET_ERROR) {
         printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
 #endif
-        return -2;
+        return false;
     }
+    return true;
+}
 
-    struct timeval timeout = {10, 0};
-    struct pkt *msg = new pkt;
-    struct pkt *prt  = new pkt;
-    time_t seconds_transmit;
-    int len = 48;
-
+static void InitRequest(struct pkt *msg) {
+    memset(msg, 0, sizeof(*msg));
     msg->li_vn_mode=227;
-    msg->stratum=0;
     msg->ppoll=4;
-    msg->precision=0;
-    msg->rootdelay=0;
-    msg->rootdispersion=0;
-
-    msg->ref.Ul_i.Xl_i=0;
-    msg->ref.Ul_f.Xl_f=0;
-    msg->org.Ul_i.Xl_i=0;
-    msg->org.Ul_f.Xl_f=0;
-    msg->rec.Ul_i.Xl_i=0;
-    msg->rec.Ul_f.Xl_f=0;
-    msg->xmt.Ul_i.Xl_i=0;
-    msg->xmt.Ul_f.Xl_f=0;
-
-    int retcode = sendto(sockfd, (char *) msg, len, 0, &cliaddr, servlen);
+}
+
+// Reads the answer waiting on the socket, returns its transmit time
+static int64_t ReadReply(SOCKET sockfd) {
+    struct pkt msg;
+    struct pkt prt;
+    time_t seconds_transmit;
+
+    if (recvfrom(sockfd, (char *) &msg, 48, 0, NULL, NULL) < 48) {
+        printf("recvfrom() error\n");
+        return -4;
+    }
+    ntohl_fp(&msg.xmt, &prt.xmt);
+    Ntp2Unix(prt.xmt.Ul_i.Xl_ui, seconds_transmit);
+
+    return seconds_transmit;
+}
+
+int64_t DoReq(SOCKET sockfd, socklen_t servlen, struct sockaddr cliaddr) {
+    if (!SetNonBlocking(sockfd))
+        return -2;
+
+    struct timeval timeout = {NTP_TIMEOUT, 0};
+    struct pkt msg;
+    InitRequest(&msg);
+
+    int retcode = sendto(sockfd, (char *) &msg, 48, 0, &cliaddr, servlen);
     if (retcode < 0) {
         printf("sendto() failed: %d\n", retcode);
-        seconds_transmit = -3;
-        goto _end;
+        return -3;
     }
 
     fd_set fdset;
@@ -375,20 +385,79 @@ int64_t DoReq(SOCKET sockfd, socklen_t servlen, struct sockaddr cliaddr) {
     retcode = select(sockfd + 1, &fdset, NULL, NULL, &timeout);
     if (retcode <= 0) {
         printf("recvfrom() error\n");
-        seconds_transmit = -4;
-        goto _end;
+        return -4;
     }
 
-    recvfrom(sockfd, (char *) msg, len, 0, NULL, NULL);
-    ntohl_fp(&msg->xmt, &prt->xmt);
-    Ntp2Unix(prt->xmt.Ul_i.Xl_ui, seconds_transmit);
+    return ReadReply(sockfd);
+}
+
+// Asks all the servers at once, each over its own socket, and waits for
+// their answers together, so a round takes one timeout at most rather than
+// one per server. The server address and transmit time of every answer
+// are appended to vTimes.
+static void NtpGetTimes(const std::vector<std::string> &vHostNames, std::vector<std::pair<CNetAddr, int64_t> > &vTimes) {
+    std::vector<SOCKET> vSockets;
+    std::vector<CNetAddr> vServers;
+    struct pkt msg;
+    InitRequest(&msg);
+
+    for (unsigned int i = 0; i < vHostNames.size(); i++) {
+        struct sockaddr cliaddr;
+        SOCKET sockfd;
+        socklen_t servlen;
+
+        if (!InitWithHost(vHostNames[i], sockfd, servlen, &cliaddr)) {
+            if (sockfd != INVALID_SOCKET)
+                CloseSocket(sockfd);
+            continue;
+        }
+        if (!SetNonBlocking(sockfd) || sendto(sockfd, (char *) &msg, 48, 0, &cliaddr, servlen) < 0) {
+            CloseSocket(sockfd);
+            continue;
+        }
+        vSockets.push_back(sockfd);
+        vServers.push_back(CNetAddr(((sockaddr_in *)&cliaddr)->sin_addr));
+    }
 
-    _end:
+    int64_t nDeadline = GetTimeMillis() + NTP_TIMEOUT * 1000;
+    unsigned int nPending = vSockets.size();
+    while (nPending > 0) {
+        int64_t nLeft = nDeadline - GetTimeMillis();
+        if (nLeft <= 0)
+            break;
 
-    delete msg;
-    delete prt;
+        struct timeval timeout;
+        timeout.tv_sec = nLeft / 1000;
+        timeout.tv_usec = (nLeft % 1000) * 1000;
 
-    return seconds_transmit;
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        SOCKET hSocketMax = 0;
+        for (unsigned int i = 0; i < vSockets.size(); i++) {
+            if (vSockets[i] == INVALID_SOCKET)
+                continue;
+            FD_SET(vSockets[i], &fdset);
+            hSocketMax = std::max(hSocketMax, vSockets[i]);
+        }
+
+        if (select(hSocketMax + 1, &fdset, NULL, NULL, &timeout) <= 0)
+            break;
+
+        for (unsigned int i = 0; i < vSockets.size(); i++) {
+            if (vSockets[i] == INVALID_SOCKET || !FD_ISSET(vSockets[i], &fdset))
+                continue;
+            int64_t nTime = ReadReply(vSockets[i]);
+            if (nTime >= 0)
+                vTimes.push_back(std::make_pair(vServers[i], nTime));
+            CloseSocket(vSockets[i]);
+            nPending--;
+        }
+    }
+
+    for (unsigned int i = 0; i < vSockets.size(); i++) {
+        if (vSockets[i] != INVALID_SOCKET)
+            CloseSocket(vSockets[i]);
+    }
 }
 
 int64_t NtpGetTime(CNetAddr& ip) {
@@ -483,12 +552,18 @@ void ThreadNtpSamples(void* parg) {
             // Now, trying to get 2-4 samples from random NTP servers.
             int nSamplesCount = 2 + GetRandInt(2);
 
-            for (int i = 0; i < nSamplesCount; i++) {
-                CNetAddr ip;
-                int64_t nClockOffset = NtpGetTime(ip) - GetTime();
+            std::vector<std::string> vHostNames;
+            for (int i = 0; i < nSamplesCount; i++)
+                vHostNames.push_back(NtpServers[GetRandInt(nServersCount)]);
+
+            std::vector<std::pair<CNetAddr, int64_t> > vTimes;
+            NtpGetTimes(vHostNames, vTimes);
+
+            for (unsigned int i = 0; i < vTimes.size(); i++) {
+                int64_t nClockOffset = vTimes[i].second - GetTime();
 
                 if (abs64(nClockOffset) < nMaxOffset) { // Skip the deliberately wrong timestamps
-                    printf("ThreadNtpSamples: new offset sample from %s, offset=%" PRId64 ".\n", ip.ToString().c_str(), nClockOffset);
+                    printf("ThreadNtpSamples: new offset sample from %s, offset=%" PRId64 ".\n", vTimes[i].first.ToString().c_str(), nClockOffset);
                     vTimeOffsets.input(nClockOffset);
                 }
             }
@@ -0,0 +1,299 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_PREVECTOR_H
+#define BITCOIN_PREVECTOR_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdint.h>
+
+#pragma pack(push, 1)
+/** Vector of trivially copyable elements that keeps up to N of them inside
+ * the object itself and only goes to the heap beyond that.
+ *
+ * It has the subset of the std::vector interface the code uses, with plain
+ * pointers as iterators. Like std::vector, any change of the size may move
+ * the elements and invalidate iterators, and unlike it, a range inserted or
+ * assigned must not come from the vector itself. The layout is packed so that the
+ * inline buffer and the size take N + 4 bytes, N must be large enough to
+ * hold a heap pointer and capacity when the elements are on the heap.
+ *
+ * nSize is the element count while the elements are inline, and N + 1 plus
+ * the element count once they have moved to the heap.
+ */
+template<unsigned int N, typename T>
+class prevector
+{
+public:
+    typedef size_t size_type;
+    typedef int32_t difference_type;
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+    union
+    {
+        char direct[sizeof(T) * N];
+        struct
+        {
+            char* indirect;
+            uint32_t capacity;
+        } heap;
+    } buf;
+    uint32_t nSize; // 32 bits to keep the layout packed, callers get size_t
+
+    bool is_direct() const { return nSize <= N; }
+    T* item_ptr(difference_type pos) { return (is_direct() ? (T*)buf.direct : (T*)buf.heap.indirect) + pos; }
+    const T* item_ptr(difference_type pos) const { return (is_direct() ? (const T*)buf.direct : (const T*)buf.heap.indirect) + pos; }
+
+    void change_capacity(size_type nNew)
+    {
+        if (nNew <= N)
+        {
+            if (!is_direct())
+            {
+                // Back inside, the size is at most N here
+                char* indirect = buf.heap.indirect;
+                size_type n = size();
+                memcpy(buf.direct, indirect, n * sizeof(T));
+                free(indirect);
+                nSize = n;
+            }
+        }
+        else if (!is_direct())
+        {
+            char* p = (char*)realloc(buf.heap.indirect, (size_t)nNew * sizeof(T));
+            if (p == NULL)
+                throw std::bad_alloc();
+            buf.heap.indirect = p;
+            buf.heap.capacity = nNew;
+        }
+        else
+        {
+            char* p = (char*)malloc((size_t)nNew * sizeof(T));
+            if (p == NULL)
+                throw std::bad_alloc();
+            memcpy(p, buf.direct, nSize * sizeof(T));
+            buf.heap.indirect = p;
+            buf.heap.capacity = nNew;
+            nSize += N + 1;
+        }
+    }
+
+    // Set the element count, the capacity must already hold it
+    void set_size(size_type n)
+    {
+        nSize = is_direct() ? n : n + N + 1;
+    }
+
+    // Make room for n more elements, growing by half to keep appends cheap
+    void grow(size_type n)
+    {
+        size_type nNew = size() + n;
+        if (nNew > capacity())
+            change_capacity(std::max(nNew, capacity() + capacity() / 2));
+    }
+
+    // Open a gap of n elements at pos and return where it is
+    T* make_gap(iterator pos, size_type n)
+    {
+        difference_type p = pos - begin();
+        grow(n);
+        T* ptr = item_ptr(p);
+        memmove(ptr + n, ptr, (size() - p) * sizeof(T));
+        set_size(size() + n);
+        return ptr;
+    }
+
+public:
+    prevector() : nSize(0) {}
+
+    explicit prevector(size_type n) : nSize(0)
+    {
+        resize(n);
+    }
+
+    prevector(size_type n, const T& val) : nSize(0)
+    {
+        change_capacity(n);
+        std::fill_n(item_ptr(0), n, val);
+        set_size(n);
+    }
+
+    template<typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : nSize(0)
+    {
+        assign(first, last);
+    }
+
+    prevector(const prevector& other) : nSize(0)
+    {
+        change_capacity(other.size());
+        memcpy(item_ptr(0), other.item_ptr(0), other.size() * sizeof(T));
+        set_size(other.size());
+    }
+
+    ~prevector()
+    {
+        if (!is_direct())
+            free(buf.heap.indirect);
+    }
+
+    prevector& operator=(const prevector& other)
+    {
+        if (&other != this)
+            assign(other.begin(), other.end());
+        return *this;
+    }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        size_type n = std::distance(first, last);
+        if (n > capacity())
+            change_capacity(n);
+        std::copy(first, last, item_ptr(0));
+        set_size(n);
+    }
+
+    size_type size() const { return is_direct() ? nSize : nSize - N - 1; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return is_direct() ? N : buf.heap.capacity; }
+    size_type max_size() const { return 0x7fffffff / sizeof(T) - N - 1; }
+
+    iterator begin() { return item_ptr(0); }
+    const_iterator begin() const { return item_ptr(0); }
+    iterator end() { return item_ptr(size()); }
+    const_iterator end() const { return item_ptr(size()); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    T& operator[](size_type pos) { return *item_ptr(pos); }
+    const T& operator[](size_type pos) const { return *item_ptr(pos); }
+    T& front() { return *item_ptr(0); }
+    const T& front() const { return *item_ptr(0); }
+    T& back() { return *item_ptr(size() - 1); }
+    const T& back() const { return *item_ptr(size() - 1); }
+    T* data() { return item_ptr(0); }
+    const T* data() const { return item_ptr(0); }
+
+    void reserve(size_type n)
+    {
+        if (n > capacity())
+            change_capacity(n);
+    }
+
+    void shrink_to_fit()
+    {
+        change_capacity(size());
+    }
+
+    void resize(size_type n)
+    {
+        if (n > capacity())
+            change_capacity(n);
+        if (n > size())
+            memset(item_ptr(size()), 0, (n - size()) * sizeof(T));
+        set_size(n);
+    }
+
+    void clear()
+    {
+        set_size(0);
+    }
+
+    void push_back(const T& val)
+    {
+        T v = val; // may live in this vector
+        grow(1);
+        *item_ptr(size()) = v;
+        set_size(size() + 1);
+    }
+
+    void pop_back()
+    {
+        set_size(size() - 1);
+    }
+
+    iterator insert(iterator pos, const T& val)
+    {
+        T v = val;
+        T* ptr = make_gap(pos, 1);
+        *ptr = v;
+        return ptr;
+    }
+
+    void insert(iterator pos, size_type n, const T& val)
+    {
+        T v = val;
+        std::fill_n(make_gap(pos, n), n, v);
+    }
+
+    template<typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last)
+    {
+        size_type n = std::distance(first, last);
+        std::copy(first, last, make_gap(pos, n));
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        difference_type p = first - begin();
+        memmove(first, last, (end() - last) * sizeof(T));
+        set_size(size() - (last - first));
+        return item_ptr(p);
+    }
+
+    void swap(prevector& other)
+    {
+        if (&other == this)
+            return;
+        char tmp[sizeof(*this)];
+        memcpy(tmp, this, sizeof(*this));
+        memcpy((void*)this, &other, sizeof(*this));
+        memcpy((void*)&other, tmp, sizeof(*this));
+    }
+
+    // Bytes used on the heap, for memory accounting
+    size_t allocated_memory() const
+    {
+        return is_direct() ? 0 : (size_t)buf.heap.capacity * sizeof(T);
+    }
+
+    friend bool operator==(const prevector& a, const prevector& b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+
+    friend bool operator!=(const prevector& a, const prevector& b)
+    {
+        return !(a == b);
+    }
+
+    friend bool operator<(const prevector& a, const prevector& b)
+    {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+};
+#pragma pack(pop)
+
+#endif
@@ -52,7 +52,8 @@ class CMessageHeader
             CHECKSUM_SIZE=sizeof(int),
 
             MESSAGE_SIZE_OFFSET=MESSAGE_START_SIZE+COMMAND_SIZE,
-            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE
+            CHECKSUM_OFFSET=MESSAGE_SIZE_OFFSET+MESSAGE_SIZE_SIZE,
+            HEADER_SIZE=CHECKSUM_OFFSET+CHECKSUM_SIZE
         };
         char pchMessageStart[MESSAGE_START_SIZE];
         char pchCommand[COMMAND_SIZE];
@@ -114,6 +115,7 @@ class CInv
         )
 
         friend bool operator<(const CInv& a, const CInv& b);
+        friend bool operator==(const CInv& a, const CInv& b);
 
         bool IsKnownType() const;
         const char* GetCommand() const;
@@ -21,6 +21,7 @@
 #include <QLocale>
 #include <QTranslator>
 #include <QSplashScreen>
+#include <QThread>
 #include <QLibraryInfo>
 #include <QSettings>
 
@@ -125,6 +126,13 @@ static void InitMessage(const std::string &message)
     }
 }
 
+static void ShowProgress(const std::string &title, int nProgress)
+{
+    // Only the rescans of the initialization run on the GUI thread, with the splash screen shown
+    if(splashref && QThread::currentThread() == QApplication::instance()->thread())
+        InitMessage(strprintf("%s %d%%", title.c_str(), nProgress));
+}
+
 static void QueueShutdown()
 {
     QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
@@ -200,6 +208,7 @@ int main(int argc, char *argv[])
     uiInterface.ThreadSafeAskFee.connect(ThreadSafeAskFee);
     uiInterface.ThreadSafeHandleURI.connect(ThreadSafeHandleURI);
     uiInterface.InitMessage.connect(InitMessage);
+    uiInterface.ShowProgress.connect(ShowProgress);
     uiInterface.QueueShutdown.connect(QueueShutdown);
     uiInterface.Translate.connect(Translate);
 
@@ -29,6 +29,32 @@ using namespace std;
 QList<qint64> CoinControlDialog::payAmounts;
 CCoinControl* CoinControlDialog::coinControl = new CCoinControl();
 
+// What updateLabels needs to know about an output, filled by updateView so
+// that toggling a checkbox does not look up every selected output again
+struct CoinControlInput
+{
+    int64_t nValue;
+    int nDepth;
+    unsigned int nBytes;
+};
+static map<COutPoint, CoinControlInput> mapInputCache;
+
+// estimated size of the input spending this output, 0 if unknown
+static unsigned int GetInputBytes(WalletModel *model, const CBitcoinAddress& address)
+{
+    if (address.IsPair())
+        return 213;
+    if (address.IsPubKey())
+    {
+        CPubKey pubkey;
+        CKeyID keyid;
+        if (address.GetKeyID(keyid) && model->getPubKey(keyid, pubkey))
+            return (pubkey.IsCompressed() ? 148 : 180);
+        return 148; // in all error cases, simply assume 148 here
+    }
+    return 0;
+}
+
 CoinControlDialog::CoinControlDialog(QWidget *parent) :
     QWidget(parent, DIALOGWINDOWHINTS),
     ui(new Ui::CoinControlDialog),
@@ -124,6 +150,10 @@ CoinControlDialog::CoinControlDialog(QWidget *parent) :
     ui->treeWidget->setColumnHidden(COLUMN_AMOUNT_INT64, true);   // store amount int64_t in this column, but don't show it
     ui->treeWidget->setColumnHidden(COLUMN_PRIORITY_INT64, true); // store priority int64_t in this column, but don't show it
 
+    // all rows have the same height, so the view does not need to measure
+    // every item of a large wallet to lay out the visible ones
+    ui->treeWidget->setUniformRowHeights(true);
+
     // default view is sorted by amount desc
     sortView(COLUMN_AMOUNT_INT64, Qt::DescendingOrder);
 }
@@ -454,10 +484,26 @@ void CoinControlDialog::updateLabels(WalletModel *model, QWidget* dialog)
     unsigned int nQuantity      = 0;
 
     vector<COutPoint> vCoinControl;
+    vector<COutPoint> vMissing;
     vector<COutput>   vOutputs;
     coinControl->ListSelected(vCoinControl);
-    model->getOutputs(vCoinControl, vOutputs);
 
+    BOOST_FOREACH(const COutPoint& outpt, vCoinControl)
+    {
+        map<COutPoint, CoinControlInput>::const_iterator it = mapInputCache.find(outpt);
+        if (it == mapInputCache.end())
+        {
+            vMissing.push_back(outpt);
+            continue;
+        }
+        nQuantity++;
+        nAmount += it->second.nValue;
+        dPriorityInputs += (double)it->second.nValue * (it->second.nDepth+1);
+        nBytesInputs += it->second.nBytes;
+    }
+
+    // outputs selected before the dialog listed them
+    model->getOutputs(vMissing, vOutputs);
     BOOST_FOREACH(const COutput& out, vOutputs)
     {
         // Quantity
@@ -472,19 +518,7 @@ void CoinControlDialog::updateLabels(WalletModel *model, QWidget* dialog)
         // Bytes
         CBitcoinAddress address;
         if(ExtractAddress(*pwalletMain, out.tx->vout[out.i].scriptPubKey, address))
-        {
-            if (address.IsPair())
-                nBytesInputs += 213;
-            else if (address.IsPubKey())
-            {
-                CPubKey pubkey;
-                CKeyID keyid;
-                if (address.GetKeyID(keyid) && model->getPubKey(keyid, pubkey))
-                    nBytesInputs += (pubkey.IsCompressed() ? 148 : 180);
-                else
-                    nBytesInputs += 148; // in all error cases, simply assume 148 here
-            }
-        }
+            nBytesInputs += GetInputBytes(model, address);
     }
 
     // calculation
@@ -587,6 +621,12 @@ void CoinControlDialog::updateView()
     map<QString, vector<COutput> > mapCoins;
     model->listCoins(mapCoins);
 
+    // The items are built detached from the view and inserted in one go at
+    // the end, so the view is not notified (and does not check the
+    // checkboxes through viewItemChanged) once per output
+    QList<QTreeWidgetItem*> listItems;
+    mapInputCache.clear();
+
     BOOST_FOREACH(PAIRTYPE(QString, vector<COutput>) coins, mapCoins)
     {
         QTreeWidgetItem *itemWalletAddress = new QTreeWidgetItem();
@@ -599,7 +639,7 @@ void CoinControlDialog::updateView()
         if (treeMode)
         {
             // wallet address
-            ui->treeWidget->addTopLevelItem(itemWalletAddress);
+            listItems.append(itemWalletAddress);
 
             itemWalletAddress->setFlags(flgTristate);
             itemWalletAddress->setCheckState(COLUMN_CHECKBOX,Qt::Unchecked);
@@ -613,23 +653,28 @@ void CoinControlDialog::updateView()
             // address
             itemWalletAddress->setText(COLUMN_ADDRESS, sWalletAddress);
         }
+        else
+            delete itemWalletAddress;
 
         int64_t nSum = 0;
         double dPrioritySum = 0;
         int nChildren = 0;
         int nInputSum = 0;
         uint64_t nTxWeight = 0, nTxWeightSum = 0;
+        QList<QTreeWidgetItem*> listChildren;
         BOOST_FOREACH(const COutput& out, coins.second)
         {
             int nInputSize = 148; // 180 if uncompressed public key
-            nSum += out.tx->vout[out.i].nValue;
-            model->getStakeWeightFromValue(out.tx->GetTxTime(), out.tx->vout[out.i].nValue, nTxWeight);
+            unsigned int nInputBytes = 0;
+            int64_t nValue = out.tx->vout[out.i].nValue;
+            nSum += nValue;
+            model->getStakeWeightFromValue(out.tx->GetTxTime(), nValue, nTxWeight);
             nTxWeightSum += nTxWeight;
             nChildren++;
 
-            QTreeWidgetItem *itemOutput;
-            if (treeMode)    itemOutput = new QTreeWidgetItem(itemWalletAddress);
-            else             itemOutput = new QTreeWidgetItem(ui->treeWidget);
+            QTreeWidgetItem *itemOutput = new QTreeWidgetItem();
+            if (treeMode)    listChildren.append(itemOutput);
+            else             listItems.append(itemOutput);
             itemOutput->setFlags(flgCheckbox);
             itemOutput->setCheckState(COLUMN_CHECKBOX,Qt::Unchecked);
 
@@ -645,13 +690,9 @@ void CoinControlDialog::updateView()
                 if (!treeMode || (!(sAddress == sWalletAddress)))
                     itemOutput->setText(COLUMN_ADDRESS, sAddress);
 
-                if (outputAddress.IsPubKey())
-                {
-                    CPubKey pubkey;
-                    CKeyID keyid;
-                    if (outputAddress.GetKeyID(keyid) && model->getPubKey(keyid, pubkey) && !pubkey.IsCompressed())
-                        nInputSize = 180;
-                }
+                nInputBytes = GetInputBytes(model, outputAddress);
+                if (nInputBytes == 180)
+                    nInputSize = 180;
             }
 
             // label
@@ -662,22 +703,17 @@ void CoinControlDialog::updateView()
                 itemOutput->setText(COLUMN_LABEL, tr("(change)"));
             }
             else if (!treeMode)
-            {
-                QString sLabel = model->getAddressTableModel()->labelForAddress(sAddress);
-                if (sLabel.isEmpty())
-                    sLabel = tr("(no label)");
-                itemOutput->setText(COLUMN_LABEL, sLabel); 
-            }
+                itemOutput->setText(COLUMN_LABEL, sWalletLabel);
 
             // amount
-            itemOutput->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, out.tx->vout[out.i].nValue));
-            itemOutput->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(out.tx->vout[out.i].nValue), 15, " ")); // padding so that sorting works correctly
+            itemOutput->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nValue));
+            itemOutput->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(nValue), 15, " ")); // padding so that sorting works correctly
 
             // date
             itemOutput->setText(COLUMN_DATE, QDateTime::fromTime_t(out.tx->GetTxTime()).toUTC().toString("yy-MM-dd hh:mm"));
 
             // immature PoS reward
-            if (out.tx->IsCoinStake() && out.tx->GetBlocksToMaturity() > 0 && out.tx->GetDepthInMainChain() > 0) {
+            if (out.tx->IsCoinStake() && out.nDepth > 0 && out.tx->GetBlocksToMaturity() > 0) {
               itemOutput->setBackground(COLUMN_CONFIRMATIONS, Qt::red);
               itemOutput->setDisabled(true);
             }
@@ -686,10 +722,10 @@ void CoinControlDialog::updateView()
             itemOutput->setText(COLUMN_CONFIRMATIONS, strPad(QString::number(out.nDepth), 8, " "));
 
             // priority
-            double dPriority = ((double)out.tx->vout[out.i].nValue  / (nInputSize + 78)) * (out.nDepth+1); // 78 = 2 * 34 + 10
+            double dPriority = ((double)nValue  / (nInputSize + 78)) * (out.nDepth+1); // 78 = 2 * 34 + 10
             itemOutput->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPriority));
             itemOutput->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPriority), 20, " "));
-            dPrioritySum += (double)out.tx->vout[out.i].nValue  * (out.nDepth+1);
+            dPrioritySum += (double)nValue  * (out.nDepth+1);
             nInputSum    += nInputSize;
 
             // List Mode Weight
@@ -702,6 +738,13 @@ void CoinControlDialog::updateView()
             // vout index
             itemOutput->setText(COLUMN_VOUT_INDEX, QString::number(out.i));
 
+            COutPoint outpt(txhash, out.i);
+            CoinControlInput input;
+            input.nValue = nValue;
+            input.nDepth = out.nDepth;
+            input.nBytes = nInputBytes;
+            mapInputCache[outpt] = input;
+
             // disable locked coins
             /*if (model->isLockedCoin(txhash, out.i))
             {
@@ -711,14 +754,21 @@ void CoinControlDialog::updateView()
                 itemOutput->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
             }*/
 
-            // set checkbox
+            // set checkbox, a disabled output cannot stay selected
             if (coinControl->IsSelected(txhash, out.i))
-                itemOutput->setCheckState(COLUMN_CHECKBOX,Qt::Checked);
+            {
+                if (itemOutput->isDisabled())
+                    coinControl->UnSelect(outpt);
+                else
+                    itemOutput->setCheckState(COLUMN_CHECKBOX,Qt::Checked);
+            }
         }
 
         // amount
         if (treeMode)
         {
+            itemWalletAddress->addChildren(listChildren);
+
             dPrioritySum = dPrioritySum / (nInputSum + 78);
             itemWalletAddress->setText(COLUMN_CHECKBOX, "(" + QString::number(nChildren) + ")");
             itemWalletAddress->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nSum));
@@ -726,16 +776,17 @@ void CoinControlDialog::updateView()
             itemWalletAddress->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPrioritySum));
             itemWalletAddress->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPrioritySum), 20, " "));
             itemWalletAddress->setText(COLUMN_WEIGHT, strPad(QString::number((uint64_t)nTxWeightSum),8," "));
-
         }
     }
 
+    ui->treeWidget->addTopLevelItems(listItems);
+
     // expand all partially selected
     if (treeMode)
     {
-        for (int i = 0; i < ui->treeWidget->topLevelItemCount(); i++)
-            if (ui->treeWidget->topLevelItem(i)->checkState(COLUMN_CHECKBOX) == Qt::PartiallyChecked)
-                ui->treeWidget->topLevelItem(i)->setExpanded(true);
+        foreach(QTreeWidgetItem *item, listItems)
+            if (item->checkState(COLUMN_CHECKBOX) == Qt::PartiallyChecked)
+                item->setExpanded(true);
     }
 
     // sort view
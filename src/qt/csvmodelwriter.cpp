@@ -1,9 +1,27 @@
 #include "csvmodelwriter.h"
+#include "walletmodel.h"
+#include "optionsmodel.h"
+#include "bitcoinunits.h"
+#include "transactionrecord.h"
+#include "transactionfilterproxy.h"
+#include "transactiontablemodel.h"
+
+#include "main.h"
+#include "wallet.h"
+#include "base58.h"
 
 #include <QAbstractItemModel>
+#include <QDateTime>
 #include <QFile>
 #include <QTextStream>
 
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// Wallet transactions decomposed per lock of the wallet
+static const int EXPORT_BATCH_SIZE = 1000;
+
 CSVModelWriter::CSVModelWriter(const QString &filename, QObject *parent) :
     QObject(parent),
     filename(filename), model(0)
@@ -86,3 +104,172 @@ bool CSVModelWriter::write()
     return file.error() == QFile::NoError;
 }
 
+/* Writes the file for CSVTransactionWriter on its own thread
+ */
+class CSVTransactionWorker
+{
+public:
+    CSVTransactionWorker(CSVTransactionWriter *parent, CWallet *wallet, int displayUnit):
+        parent(parent), wallet(wallet), displayUnit(displayUnit), cancelled(false)
+    {
+        thread = boost::thread(boost::bind(&CSVTransactionWorker::run, this));
+    }
+
+    ~CSVTransactionWorker()
+    {
+        cancel();
+        thread.join();
+    }
+
+    void cancel()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        cancelled = true;
+    }
+
+private:
+    CSVTransactionWriter *parent;
+    CWallet *wallet;
+    int displayUnit;
+    boost::thread thread;
+    boost::mutex mutex;
+    bool cancelled;
+
+    bool isCancelled()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return cancelled;
+    }
+
+    void run()
+    {
+        bool success = write();
+        QMetaObject::invokeMethod(parent, "finished", Qt::QueuedConnection,
+                                  Q_ARG(bool, success && !isCancelled()));
+    }
+
+    void writeRecord(QTextStream &out, const TransactionRecord &rec, const QString &label)
+    {
+        QString address = QString::fromStdString(rec.address);
+        qint64 amount = rec.credit + rec.debit;
+        QDateTime date = QDateTime::fromTime_t(static_cast<uint>(rec.time));
+        if(parent->filter && !parent->filter->acceptsRecord(rec.type, date, address, label, amount))
+            return;
+
+        bool confirmed = rec.status.confirmed &&
+            !(rec.type == TransactionRecord::Generated && rec.status.maturity != TransactionStatus::Mature);
+        writeValue(out, confirmed ? "true" : "false");
+        writeSep(out);
+        writeValue(out, date.toString(Qt::ISODate));
+        writeSep(out);
+        writeValue(out, TransactionTableModel::formatTxType(&rec));
+        writeSep(out);
+        writeValue(out, label);
+        writeSep(out);
+        writeValue(out, address);
+        writeSep(out);
+        writeValue(out, BitcoinUnits::format(displayUnit, amount));
+        writeSep(out);
+        writeValue(out, QString::fromStdString(rec.getTxID()));
+        writeNewline(out);
+    }
+
+    bool write()
+    {
+        QFile file(parent->filename);
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Text))
+            return false;
+        QTextStream out(&file);
+
+        // Header row
+        for(int i=0; i<parent->titles.size(); ++i)
+        {
+            if(i!=0)
+            {
+                writeSep(out);
+            }
+            writeValue(out, parent->titles[i]);
+        }
+        writeNewline(out);
+
+        // Only the time and hash of every transaction are kept, to write them
+        // in time order
+        std::vector<std::pair<int64_t, uint256> > vIndex;
+        {
+            LOCK(wallet->cs_wallet);
+            vIndex.reserve(wallet->mapWallet.size());
+            for(std::map<uint256, CWalletTx>::const_iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+                vIndex.push_back(std::make_pair(it->second.GetTxTime(), it->first));
+        }
+        std::sort(vIndex.begin(), vIndex.end());
+
+        int total = (int)vIndex.size();
+        for(int start = 0; start < total && !isCancelled(); start += EXPORT_BATCH_SIZE)
+        {
+            QList<TransactionRecord> records;
+            QStringList labels;
+            {
+                LOCK2(cs_main, wallet->cs_wallet);
+                for(int i = start; i < total && i < start + EXPORT_BATCH_SIZE; i++)
+                {
+                    std::map<uint256, CWalletTx>::const_iterator mi = wallet->mapWallet.find(vIndex[i].second);
+                    if(mi == wallet->mapWallet.end() || !TransactionRecord::showTransaction(mi->second))
+                        continue;
+                    QList<TransactionRecord> txRecords = TransactionRecord::decomposeTransaction(wallet, mi->second);
+                    for(int j = 0; j < txRecords.size(); j++)
+                    {
+                        TransactionRecord &rec = txRecords[j];
+                        rec.updateStatus(mi->second);
+                        std::map<CBitcoinAddress, std::string>::const_iterator ai = wallet->mapAddressBook.find(CBitcoinAddress(rec.address));
+                        labels.append(ai != wallet->mapAddressBook.end() ? QString::fromStdString(ai->second) : QString());
+                        records.append(rec);
+                    }
+                }
+            }
+
+            for(int i = 0; i < records.size(); i++)
+                writeRecord(out, records[i], labels[i]);
+
+            QMetaObject::invokeMethod(parent, "progress", Qt::QueuedConnection,
+                                      Q_ARG(int, std::min(start + EXPORT_BATCH_SIZE, total)), Q_ARG(int, total));
+        }
+
+        file.close();
+
+        return file.error() == QFile::NoError;
+    }
+};
+
+CSVTransactionWriter::CSVTransactionWriter(const QString &filename, WalletModel *walletModel, QObject *parent) :
+    QObject(parent),
+    filename(filename), walletModel(walletModel), filter(0), worker(0)
+{
+}
+
+CSVTransactionWriter::~CSVTransactionWriter()
+{
+    delete worker;
+}
+
+void CSVTransactionWriter::setTitles(const QStringList &titles)
+{
+    this->titles = titles;
+}
+
+void CSVTransactionWriter::setFilter(const TransactionFilterProxy *filter)
+{
+    this->filter = filter;
+}
+
+void CSVTransactionWriter::start()
+{
+    if(worker)
+        return;
+    worker = new CSVTransactionWorker(this, walletModel->getWallet(), walletModel->getOptionsModel()->getDisplayUnit());
+}
+
+void CSVTransactionWriter::cancel()
+{
+    if(worker)
+        worker->cancel();
+}
@@ -3,11 +3,16 @@
 
 #include <QObject>
 #include <QList>
+#include <QStringList>
 
 QT_BEGIN_NAMESPACE
 class QAbstractItemModel;
 QT_END_NAMESPACE
 
+class WalletModel;
+class TransactionFilterProxy;
+class CSVTransactionWorker;
+
 /** Export a Qt table model to a CSV file. This is useful for analyzing or post-processing the data in
     a spreadsheet.
  */
@@ -43,4 +48,48 @@ public slots:
 
 };
 
+/** Export the wallet's transactions to a CSV file, oldest first.
+
+    Unlike CSVModelWriter this does not go through the transaction table: the
+    wallet is read in batches on a worker thread, so exporting a large wallet
+    neither blocks the GUI nor needs the table to be fully loaded.
+    The columns are those of the transaction view's export: confirmed, date,
+    type, label, address, amount and ID.
+ */
+class CSVTransactionWriter : public QObject
+{
+    Q_OBJECT
+public:
+    CSVTransactionWriter(const QString &filename, WalletModel *walletModel, QObject *parent = 0);
+    ~CSVTransactionWriter();
+
+    /** Column titles of the header row */
+    void setTitles(const QStringList &titles);
+    /** Only export the transactions the filter accepts. The filter must not
+        change until finished() */
+    void setFilter(const TransactionFilterProxy *filter);
+
+    /** Start writing in the background, finished() tells the outcome */
+    void start();
+
+public slots:
+    /** Stop writing, finished(false) follows */
+    void cancel();
+
+signals:
+    /** Transactions handled so far out of total */
+    void progress(int done, int total);
+    /** The file was written completely (false on error or cancel) */
+    void finished(bool success);
+
+private:
+    QString filename;
+    WalletModel *walletModel;
+    QStringList titles;
+    const TransactionFilterProxy *filter;
+    CSVTransactionWorker *worker;
+
+    friend class CSVTransactionWorker;
+};
+
 #endif // CSVMODELWRITER_H
@@ -22,6 +22,9 @@
 #include <QDateTime>
 #include <QtAlgorithms>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 extern double GetDifficulty(const CBlockIndex* blockindex);
 
 static int column_alignments[] = {
@@ -50,138 +53,252 @@ struct TxLessThan
     }
 };
 
-class MintingTablePriv
+// Wallet transactions decomposed per cs_wallet lock while loading
+static const int LOAD_PAGE_SIZE = 1000;
+
+/* Decomposing wallet transactions into kernel records takes cs_wallet and
+ * looks at every output, which with thousands of stake inputs is too slow
+ * for the GUI thread. This thread does it, for the whole wallet at start and
+ * then for the transactions the wallet reports as changed, and hands back the
+ * unspent records of each transaction to replace the rows it had.
+ */
+class MintingTableWorker
 {
 public:
-    MintingTablePriv(CWallet *wallet, MintingTableModel *parent):
-        wallet(wallet),
-        parent(parent)
+    typedef std::pair<uint256, std::vector<KernelRecord> > Result;
+
+    MintingTableWorker(CWallet *wallet, MintingTableModel *parent):
+        wallet(wallet), parent(parent), loadAll(true), stop(false), resultsPosted(false)
     {
+        thread = boost::thread(boost::bind(&MintingTableWorker::run, this));
     }
+
+    ~MintingTableWorker()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    void post(const std::vector<uint256> &hashes)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pending.insert(pending.end(), hashes.begin(), hashes.end());
+        }
+        cond.notify_all();
+    }
+
+    void takeResults(std::vector<Result> &resultsRet)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        resultsRet.swap(results);
+        results.clear();
+        resultsPosted = false;
+    }
+
+private:
     CWallet *wallet;
     MintingTableModel *parent;
+    boost::thread thread;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<uint256> pending;
+    bool loadAll;
+    bool stop;
+    std::vector<Result> results;
+    bool resultsPosted;
+
+    bool stopping()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return stop;
+    }
 
-    QList<KernelRecord> cachedWallet;
+    static std::vector<KernelRecord> unspentRecords(CWallet *wallet, const CWalletTx &wtx)
+    {
+        std::vector<KernelRecord> records;
+        std::vector<KernelRecord> txList = KernelRecord::decomposeOutput(wallet, wtx);
+        BOOST_FOREACH(KernelRecord& kr, txList)
+            if(!kr.spent)
+                records.push_back(kr);
+        return records;
+    }
 
-    void refreshWallet()
+    void deliver(std::vector<Result> &newResults)
     {
-#ifdef WALLET_UPDATE_DEBUG
-        qDebug() << "refreshWallet";
-#endif
-        cachedWallet.clear();
+        if(newResults.empty())
+            return;
+        bool notify;
         {
-            LOCK(wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+            boost::unique_lock<boost::mutex> lock(mutex);
+            results.insert(results.end(), newResults.begin(), newResults.end());
+            notify = !resultsPosted;
+            resultsPosted = true;
+        }
+        // One queued call picks up everything delivered until it runs
+        if(notify)
+            QMetaObject::invokeMethod(parent, "applyResults", Qt::QueuedConnection);
+    }
+
+    void loadWallet()
+    {
+        uint256 hashNext = 0;
+        bool more = true;
+        while(more && !stopping())
+        {
+            std::vector<Result> page;
             {
-                std::vector<KernelRecord> txList = KernelRecord::decomposeOutput(wallet, it->second);
-                BOOST_FOREACH(KernelRecord& kr, txList) {
-                    if(!kr.spent) {
-                        cachedWallet.append(kr);
-                    }
+                LOCK(wallet->cs_wallet);
+                std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.lower_bound(hashNext);
+                for(int n = 0; it != wallet->mapWallet.end() && n < LOAD_PAGE_SIZE; ++it, ++n)
+                {
+                    std::vector<KernelRecord> records = unspentRecords(wallet, it->second);
+                    if(!records.empty())
+                        page.push_back(std::make_pair(it->first, records));
                 }
+                more = (it != wallet->mapWallet.end());
+                if(more)
+                    hashNext = it->first;
+            }
+            deliver(page);
+        }
+    }
+
+    void updateTransactions(const std::vector<uint256> &hashes)
+    {
+        std::vector<Result> updates;
+        {
+            LOCK(wallet->cs_wallet);
+
+            // The inputs of a changed transaction may have been spent by it
+            std::set<uint256> setHashes(hashes.begin(), hashes.end());
+            BOOST_FOREACH(const uint256 &hash, hashes)
+            {
+                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
+                if(mi != wallet->mapWallet.end())
+                    BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+                        setHashes.insert(txin.prevout.hash);
+            }
+
+            BOOST_FOREACH(const uint256 &hash, setHashes)
+            {
+                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
+                if(mi != wallet->mapWallet.end())
+                    updates.push_back(std::make_pair(hash, unspentRecords(wallet, mi->second)));
+                else
+                    updates.push_back(std::make_pair(hash, std::vector<KernelRecord>()));
+            }
+        }
+        deliver(updates);
+    }
 
+    void run()
+    {
+        RenameThread("42-mintingtable");
+        for( ; ; )
+        {
+            bool load;
+            std::vector<uint256> hashes;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while(!stop && !loadAll && pending.empty())
+                    cond.wait(lock);
+                if(stop)
+                    return;
+                load = loadAll;
+                loadAll = false;
+                hashes.swap(pending);
             }
+            // Changes reported before the load ends are decomposed again
+            // after it, as they are then
+            if(load)
+                loadWallet();
+            if(!hashes.empty())
+                updateTransactions(hashes);
         }
     }
+};
 
-    /* Update our model of the wallet incrementally, to synchronize our model of the wallet
-       with that of the core.
+class MintingTablePriv
+{
+public:
+    MintingTablePriv(CWallet *wallet, MintingTableModel *parent):
+        wallet(wallet),
+        parent(parent),
+        worker(wallet, parent)
+    {
+    }
+    CWallet *wallet;
+    MintingTableModel *parent;
+
+    // Sorted by transaction hash
+    QList<KernelRecord> cachedWallet;
 
-       Call with list of hashes of transactions that were added, removed or changed.
+    MintingTableWorker worker;
+
+    /* Replace the rows of each transaction the worker decomposed. While the
+     * wallet loads, the records come in hash order after everything in the
+     * model, they are appended in one go.
      */
-    void updateWallet(const QList<uint256> &updated)
+    void applyResults()
     {
-        // Walk through updated transactions, update model as needed.
-#ifdef WALLET_UPDATE_DEBUG
-        qDebug() << "updateWallet";
-#endif
-        // Sort update list, and iterate through it in reverse, so that model updates
-        //  can be emitted from end to beginning (so that earlier updates will not influence
-        // the indices of latter ones).
-        QList<uint256> updated_sorted = updated;
-        qSort(updated_sorted);
+        std::vector<MintingTableWorker::Result> results;
+        worker.takeResults(results);
 
+        QList<KernelRecord> toAppend;
+        BOOST_FOREACH(const MintingTableWorker::Result &result, results)
         {
-            LOCK(wallet->cs_wallet);
-            for(int update_idx = updated_sorted.size()-1; update_idx >= 0; --update_idx)
+            const uint256 &hash = result.first;
+            if(toAppend.isEmpty() ? (cachedWallet.isEmpty() || cachedWallet.last().hash < hash)
+                                  : toAppend.last().hash < hash)
             {
-                const uint256 &hash = updated_sorted.at(update_idx);
-                // Find transaction in wallet
-                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
-                bool inWallet = mi != wallet->mapWallet.end();
-                // Find bounds of this transaction in model
-                QList<KernelRecord>::iterator lower = qLowerBound(
-                    cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
-                QList<KernelRecord>::iterator upper = qUpperBound(
-                    cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
-                int lowerIndex = (lower - cachedWallet.begin());
-                int upperIndex = (upper - cachedWallet.begin());
-
-                // Determine if transaction is in model already
-                bool inModel = false;
-                if(lower != upper)
-                {
-                    inModel = true;
-                }
+                BOOST_FOREACH(const KernelRecord &rec, result.second)
+                    toAppend.append(rec);
+                continue;
+            }
+            appendRows(toAppend);
+
+            QList<KernelRecord>::iterator lower = qLowerBound(
+                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
+            QList<KernelRecord>::iterator upper = qUpperBound(
+                cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
+            int lowerIndex = (lower - cachedWallet.begin());
+            int upperIndex = (upper - cachedWallet.begin());
 
 #ifdef WALLET_UPDATE_DEBUG
-                qDebug() << "  " << QString::fromStdString(hash.ToString()) << inWallet << " " << inModel
-                        << lowerIndex << "-" << upperIndex;
+            qDebug() << "  " << QString::fromStdString(hash.ToString()) << lowerIndex << "-" << upperIndex
+                     << result.second.size();
 #endif
-
-                if(inWallet && !inModel)
-                {
-                    // Added -- insert at the right position
-                    std::vector<KernelRecord> toInsert =
-                            KernelRecord::decomposeOutput(wallet, mi->second);
-                    if(!toInsert.empty()) /* only if something to insert */
-                    {
-                        int insert_idx = lowerIndex;
-                        BOOST_FOREACH(const KernelRecord &rec, toInsert)
-                        {
-                            if(!rec.spent) 
-                            {
-                                parent->beginInsertRows(QModelIndex(), insert_idx, insert_idx);
-                                cachedWallet.insert(insert_idx, rec);
-                                parent->endInsertRows();
-                                insert_idx += 1;
-                            }
-                        }
-                    }
-                }
-                else if(!inWallet && inModel)
-                {
-                    // Removed -- remove entire transaction from table
-                    parent->beginRemoveRows(QModelIndex(), lowerIndex, upperIndex-1);
-                    cachedWallet.erase(lower, upper);
-                    parent->endRemoveRows();
-                }
-                else if(inWallet && inModel)
-                {               
-                    // Updated -- remove spent coins from table
-                    std::vector<KernelRecord> toCheck = KernelRecord::decomposeOutput(wallet, mi->second);
-                    BOOST_FOREACH(const KernelRecord &rec, toCheck)
-                    {
-                        if(rec.spent)
-                        {
-                            for(int i = 0; i < cachedWallet.size(); i++)
-                            {
-                                KernelRecord cachedRec = cachedWallet.at(i);
-                                if((rec.hash == cachedRec.hash)
-                                    && (rec.nTime == cachedRec.nTime)
-                                    && (rec.nValue == cachedRec.nValue))
-                                {
-                                    parent->beginRemoveRows(QModelIndex(), i, i);
-                                    cachedWallet.removeAt(i);
-                                    parent->endRemoveRows();
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                }
+            if(lower != upper)
+            {
+                parent->beginRemoveRows(QModelIndex(), lowerIndex, upperIndex-1);
+                cachedWallet.erase(lower, upper);
+                parent->endRemoveRows();
+            }
+            if(!result.second.empty())
+            {
+                parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+result.second.size()-1);
+                int insert_idx = lowerIndex;
+                BOOST_FOREACH(const KernelRecord &rec, result.second)
+                    cachedWallet.insert(insert_idx++, rec);
+                parent->endInsertRows();
             }
         }
+        appendRows(toAppend);
+    }
+
+    void appendRows(QList<KernelRecord> &toAppend)
+    {
+        if(toAppend.isEmpty())
+            return;
+        parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+toAppend.size()-1);
+        cachedWallet.append(toAppend);
+        parent->endInsertRows();
+        toAppend.clear();
     }
 
     int size()
@@ -226,7 +343,6 @@ MintingTableModel::MintingTableModel(CWallet *wallet, WalletModel *parent):
         priv(new MintingTablePriv(wallet, this))
 {
     columns << tr("Transaction") <<  tr("Address") << tr("Balance") << tr("Age") << tr("CoinDay") << tr("MintProbability");
-    priv->refreshWallet();
 
     QTimer *timer = new QTimer(this);
     connect(timer, SIGNAL(timeout()), this, SLOT(update()));
@@ -240,36 +356,21 @@ MintingTableModel::~MintingTableModel()
 
 void MintingTableModel::update()
 {
-    QList<uint256> updated;
-
-    // Check if there are changes to wallet map
+    // Hand the transactions the wallet changed to the worker
+    std::vector<uint256> updated;
     {
         TRY_LOCK(wallet->cs_wallet, lockWallet);
         if (lockWallet && !wallet->vMintingWalletUpdated.empty())
-        {
-            BOOST_FOREACH(uint256 hash, wallet->vMintingWalletUpdated)
-            {
-                updated.append(hash);
-
-                // Also check the inputs to remove spent outputs from the table if necessary
-                CWalletTx wtx;
-                if(wallet->GetTransaction(hash, wtx))
-                {
-                    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
-                    {
-                        updated.append(txin.prevout.hash);
-                    }
-                }
-            }
-            wallet->vMintingWalletUpdated.clear();
-        }
+            updated.swap(wallet->vMintingWalletUpdated);
     }
 
     if(!updated.empty())
-    {
-        priv->updateWallet(updated);
-        mintingProxyModel->invalidate(); // Force deletion of empty rows
-    }
+        priv->worker.post(updated);
+}
+
+void MintingTableModel::applyResults()
+{
+    priv->applyResults();
 }
 
 void MintingTableModel::setMintingProxyModel(MintingFilterProxy *mintingProxy)
@@ -56,6 +56,8 @@ private:
     QString formatTxPoSReward(KernelRecord *wtx) const;
 private slots:
     void update();
+    // Apply the records MintingTableWorker decomposed
+    void applyResults();
 
     friend class MintingTablePriv;
 };
@@ -422,6 +422,7 @@ void MultisigDialog::on_signTransactionButton_clicked()
         return;
     }
     CTransaction mergedTx(tx);
+    mergedTx.ClearCache();
 
     // Fetch previous transactions (inputs)
     std::map<COutPoint, CScript> mapPrevOut;
@@ -479,6 +480,7 @@ void MultisigDialog::on_signTransactionButton_clicked()
         txin.scriptSig.clear();
         SignSignature(*wallet, prevPubKey, mergedTx, i, SIGHASH_ALL);
         txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, tx.vin[i].scriptSig);
+        mergedTx.ClearCache();
         if(!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, true, 0))
         {
             fComplete = false;
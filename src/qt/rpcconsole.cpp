@@ -9,6 +9,7 @@
 #include <QTime>
 #include <QTimer>
 #include <QThread>
+#include <QAtomicInt>
 #include <QTextEdit>
 #include <QKeyEvent>
 #if QT_VERSION < 0x050000
@@ -24,6 +25,8 @@
 // TODO: receive errors and debug messages through ClientModel
 
 const int CONSOLE_HISTORY = 50;
+// Long replies are shown this many lines at a time, the rest on "more"
+const int CONSOLE_REPLY_LINES = 500;
 
 const QSize ICON_SIZE(24, 24);
 
@@ -40,6 +43,10 @@ const struct {
     {NULL, NULL}
 };
 
+// Requests up to this id were abandoned by the user, the executor skips the
+// ones it has not started yet
+static QAtomicInt nCancelledRequest(0);
+
 /* Object for executing console RPC commands in a separate thread.
 */
 class RPCExecutor: public QObject
@@ -47,9 +54,9 @@ class RPCExecutor: public QObject
     Q_OBJECT
 public slots:
     void start();
-    void request(const QString &command);
+    void request(int id, const QString &command);
 signals:
-    void reply(int category, const QString &command);
+    void reply(int id, int category, const QString &command);
 };
 
 #include "rpcconsole.moc"
@@ -143,16 +150,22 @@ bool parseCommandLine(std::vector<std::string> &args, const std::string &strComm
     }
 }
 
-void RPCExecutor::request(const QString &command)
+void RPCExecutor::request(int id, const QString &command)
 {
+    if(id <= nCancelledRequest.fetchAndAddOrdered(0))
+        return; // Abandoned while waiting behind a long call
+
     std::vector<std::string> args;
     if(!parseCommandLine(args, command.toStdString()))
     {
-        emit reply(RPCConsole::CMD_ERROR, QString("Parse error: unbalanced ' or \""));
+        emit reply(id, RPCConsole::CMD_ERROR, QString("Parse error: unbalanced ' or \""));
         return;
     }
     if(args.empty())
-        return; // Nothing to do
+    {
+        emit reply(id, RPCConsole::CMD_REPLY, QString());
+        return;
+    }
     try
     {
         std::string strPrint;
@@ -168,9 +181,9 @@ void RPCExecutor::request(const QString &command)
         else if (result.type() == json_spirit::str_type)
             strPrint = result.get_str();
         else
-            strPrint = write_string(result, true);
+            strPrint = WriteRPCValue(result, true);
 
-        emit reply(RPCConsole::CMD_REPLY, QString::fromStdString(strPrint));
+        emit reply(id, RPCConsole::CMD_REPLY, QString::fromStdString(strPrint));
     }
     catch (json_spirit::Object& objError)
     {
@@ -178,23 +191,26 @@ void RPCExecutor::request(const QString &command)
         {
             int code = find_value(objError, "code").get_int();
             std::string message = find_value(objError, "message").get_str();
-            emit reply(RPCConsole::CMD_ERROR, QString::fromStdString(message) + " (code " + QString::number(code) + ")");
+            emit reply(id, RPCConsole::CMD_ERROR, QString::fromStdString(message) + " (code " + QString::number(code) + ")");
         }
         catch(std::runtime_error &) // raised when converting to invalid type, i.e. missing code or message
         {   // Show raw JSON object
-            emit reply(RPCConsole::CMD_ERROR, QString::fromStdString(write_string(json_spirit::Value(objError), false)));
+            emit reply(id, RPCConsole::CMD_ERROR, QString::fromStdString(write_string(json_spirit::Value(objError), false)));
         }
     }
     catch (std::exception& e)
     {
-        emit reply(RPCConsole::CMD_ERROR, QString("Error: ") + QString::fromStdString(e.what()));
+        emit reply(id, RPCConsole::CMD_ERROR, QString("Error: ") + QString::fromStdString(e.what()));
     }
 }
 
 RPCConsole::RPCConsole(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::RPCConsole),
-    historyPtr(0)
+    historyPtr(0),
+    executor(0),
+    nLastRequest(0),
+    nLastReply(0)
 {
     ui->setupUi(this);
 
@@ -238,6 +254,14 @@ bool RPCConsole::eventFilter(QObject* obj, QEvent *event)
         {
         case Qt::Key_Up: if(obj == ui->lineEdit) { browseHistory(-1); return true; } break;
         case Qt::Key_Down: if(obj == ui->lineEdit) { browseHistory(1); return true; } break;
+        case Qt::Key_Escape:
+            // Abandon the running command rather than closing the window
+            if(obj == ui->lineEdit && nLastReply < nLastRequest)
+            {
+                cancelCommands();
+                return true;
+            }
+            break;
         case Qt::Key_PageUp: /* pass paging keys to messages widget */
         case Qt::Key_PageDown:
             if(obj == ui->lineEdit)
@@ -327,6 +351,7 @@ static QString categoryClass(int category)
 void RPCConsole::clear()
 {
     ui->messagesWidget->clear();
+    moreLines.clear();
 	history.clear();
 	historyPtr = 0;
     ui->lineEdit->clear();
@@ -354,7 +379,8 @@ void RPCConsole::clear()
 
     message(CMD_REPLY, (tr("Welcome to the 42 RPC console.") + "<br>" +
                         tr("Use up and down arrows to navigate history, and <b>Ctrl-L</b> to clear screen.") + "<br>" +
-                        tr("Type <b>help</b> for an overview of available commands.")), true);
+                        tr("Type <b>help</b> for an overview of available commands.") + "<br>" +
+                        tr("Press <b>Esc</b> to abandon a command that is still running.")), true);
 }
 
 void RPCConsole::message(int category, const QString &message, bool html)
@@ -373,6 +399,65 @@ void RPCConsole::message(int category, const QString &message, bool html)
     ui->messagesWidget->append(out);
 }
 
+void RPCConsole::reply(int id, int category, const QString &message)
+{
+    if(id > nLastReply)
+        nLastReply = id;
+    if(id <= nCancelledRequest.fetchAndAddOrdered(0))
+        return;
+
+    // Show the start of a long reply only, putting the whole text into the
+    // document at once can freeze the window for a long time
+    QStringList lines = message.split('\n');
+    if(category == CMD_REPLY && lines.size() > CONSOLE_REPLY_LINES)
+    {
+        moreLines = lines.mid(CONSOLE_REPLY_LINES);
+        lines.erase(lines.begin() + CONSOLE_REPLY_LINES, lines.end());
+        RPCConsole::message(category, lines.join("\n"));
+        showMoreHint();
+    }
+    else
+    {
+        moreLines.clear();
+        RPCConsole::message(category, message);
+    }
+}
+
+void RPCConsole::showMore()
+{
+    if(moreLines.isEmpty())
+    {
+        message(CMD_ERROR, tr("Nothing more to show."));
+        return;
+    }
+    int nShow = qMin(moreLines.size(), CONSOLE_REPLY_LINES);
+    message(CMD_REPLY, QStringList(moreLines.mid(0, nShow)).join("\n"));
+    moreLines.erase(moreLines.begin(), moreLines.begin() + nShow);
+    if(!moreLines.isEmpty())
+        showMoreHint();
+}
+
+void RPCConsole::showMoreHint()
+{
+    message(CMD_REPLY, tr("(%1 more lines, type <b>more</b> to show them)").arg(moreLines.size()), true);
+}
+
+void RPCConsole::cancelCommands()
+{
+    // An RPC call cannot be interrupted, so the executor thread is left to
+    // finish it on its own and further commands go to a new one
+    nCancelledRequest.fetchAndStoreOrdered(nLastRequest);
+    nLastReply = nLastRequest;
+    disconnect(this, 0, executor, 0);
+    disconnect(executor, 0, this, 0);
+    QMetaObject::invokeMethod(executor, "deleteLater", Qt::QueuedConnection);
+    executor->thread()->quit();
+    startExecutor();
+
+    message(CMD_ERROR, tr("Command abandoned, its result will not be shown."));
+    scrollToEnd();
+}
+
 void RPCConsole::setNumConnections(int count)
 {
     if (!clientModel)
@@ -400,10 +485,13 @@ void RPCConsole::on_lineEdit_returnPressed()
     QString cmd = ui->lineEdit->text();
     ui->lineEdit->clear();
 
-    if(!cmd.isEmpty())
+    if(!cmd.trimmed().isEmpty())
     {
         message(CMD_REQUEST, cmd);
-        emit cmdRequest(cmd);
+        if(cmd.trimmed() == "more")
+            showMore();
+        else
+            emit cmdRequest(++nLastRequest, cmd);
         // Remove command, if already in history
         history.removeOne(cmd);
         // Append command to history
@@ -434,15 +522,15 @@ void RPCConsole::browseHistory(int offset)
 void RPCConsole::startExecutor()
 {
     QThread* thread = new QThread;
-    RPCExecutor *executor = new RPCExecutor();
+    executor = new RPCExecutor();
     executor->moveToThread(thread);
 
     // Notify executor when thread started (in executor thread)
     connect(thread, SIGNAL(started()), executor, SLOT(start()));
     // Replies from executor object must go to this object
-    connect(executor, SIGNAL(reply(int,QString)), this, SLOT(message(int,QString)));
+    connect(executor, SIGNAL(reply(int,int,QString)), this, SLOT(reply(int,int,QString)));
     // Requests from this object must go to executor
-    connect(this, SIGNAL(cmdRequest(QString)), executor, SLOT(request(QString)));
+    connect(this, SIGNAL(cmdRequest(int,QString)), executor, SLOT(request(int,QString)));
     // On stopExecutor signal
     // - queue executor for deletion (in execution thread)
     // - quit the Qt event loop in the execution thread
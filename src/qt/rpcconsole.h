@@ -3,11 +3,13 @@
 
 #include <QWidget>
 #include <QCompleter>
+#include <QStringList>
 
 namespace Ui {
     class RPCConsole;
 }
 class ClientModel;
+class RPCExecutor;
 
 /** Local Bitcoin RPC console. */
 class RPCConsole: public QWidget
@@ -52,6 +54,8 @@ private slots:
 public slots:
     void clear();
     void message(int category, const QString &message, bool html = false);
+    /** Reply to console request id from the executor */
+    void reply(int id, int category, const QString &message);
     /** Set number of connections shown in the UI */
     void setNumConnections(int count);
     /** Set number of blocks shown in the UI */
@@ -63,7 +67,7 @@ public slots:
 signals:
     // For RPC command executor
     void stopExecutor();
-    void cmdRequest(const QString &command);
+    void cmdRequest(int id, const QString &command);
 
 private:
     static QString FormatBytes(quint64 bytes);
@@ -82,8 +86,17 @@ private:
     QStringList history;
     int historyPtr;
 	QCompleter *autoCompleter;
+    RPCExecutor *executor;
+    int nLastRequest;
+    int nLastReply;
+    /** Lines of the last reply not shown yet */
+    QStringList moreLines;
 
     void startExecutor();
+    /** Abandon the commands sent so far and start a new executor */
+    void cancelCommands();
+    void showMore();
+    void showMoreHint();
 };
 
 #endif // RPCCONSOLE_H
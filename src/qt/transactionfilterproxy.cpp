@@ -29,15 +29,20 @@ bool TransactionFilterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &
     QDateTime datetime = index.data(TransactionTableModel::DateRole).toDateTime();
     QString address = index.data(TransactionTableModel::AddressRole).toString();
     QString label = index.data(TransactionTableModel::LabelRole).toString();
-    qint64 amount = llabs(index.data(TransactionTableModel::AmountRole).toLongLong());
+    qint64 amount = index.data(TransactionTableModel::AmountRole).toLongLong();
 
+    return acceptsRecord(type, datetime, address, label, amount);
+}
+
+bool TransactionFilterProxy::acceptsRecord(int type, const QDateTime &datetime, const QString &address, const QString &label, qint64 amount) const
+{
     if(!(TYPE(type) & typeFilter))
         return false;
     if(datetime < dateFrom || datetime > dateTo)
         return false;
     if (!address.contains(addrPrefix, Qt::CaseInsensitive) && !label.contains(addrPrefix, Qt::CaseInsensitive))
         return false;
-    if(amount < minAmount)
+    if(llabs(amount) < minAmount)
         return false;
 
     return true;
@@ -32,6 +32,9 @@ public:
     void setLimit(int limit);
 
     int rowCount(const QModelIndex &parent = QModelIndex()) const;
+
+    /** Whether a transaction with these attributes passes the filter */
+    bool acceptsRecord(int type, const QDateTime &datetime, const QString &address, const QString &label, qint64 amount) const;
 protected:
     bool filterAcceptsRow(int source_row, const QModelIndex & source_parent) const;
 
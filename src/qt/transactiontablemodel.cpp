@@ -28,6 +28,9 @@ static int column_alignments[] = {
         Qt::AlignRight|Qt::AlignVCenter
     };
 
+// Wallet transactions decomposed per step of loading the table
+static const int LOAD_PAGE_SIZE = 1000;
+
 // Comparison operator for sort/binary search of model tx list
 struct TxLessThan
 {
@@ -51,7 +54,8 @@ class TransactionTablePriv
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent):
             wallet(wallet),
-            parent(parent)
+            parent(parent),
+            loading(false)
     {
     }
     CWallet *wallet;
@@ -63,20 +67,55 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* The wallet is loaded a page at a time, in hash order, from the event
+     * loop, so that a big wallet neither freezes the GUI nor holds cs_wallet
+     * while the table is built. While loading, the transactions before
+     * hashNextLoad are in the model, and the ones from it on are not yet.
+     */
+    bool loading;
+    uint256 hashNextLoad;
+
+    /* Start loading the wallet anew. Returns false if a load was already
+     * going on, it simply starts over.
      */
-    void refreshWallet()
+    bool startLoading()
     {
-        OutputDebugStringF("refreshWallet\n");
+        OutputDebugStringF("startLoading\n");
+        bool wasLoading = loading;
+        parent->beginResetModel();
         cachedWallet.clear();
+        parent->endResetModel();
+        loading = true;
+        hashNextLoad = 0;
+        return !wasLoading;
+    }
+
+    /* Add the next page of transactions to the model. Returns true if there
+     * are more to load.
+     */
+    bool loadPage()
+    {
+        QList<TransactionRecord> toInsert;
         {
             LOCK(wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+            std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.lower_bound(hashNextLoad);
+            for(int n = 0; it != wallet->mapWallet.end() && n < LOAD_PAGE_SIZE; ++it, ++n)
             {
                 if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+                    toInsert.append(TransactionRecord::decomposeTransaction(wallet, it->second));
             }
+            loading = (it != wallet->mapWallet.end());
+            if(loading)
+                hashNextLoad = it->first;
+        }
+        // All of the page sorts after what is loaded already
+        if(!toInsert.isEmpty())
+        {
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+toInsert.size()-1);
+            cachedWallet.append(toInsert);
+            parent->endInsertRows();
         }
+        return loading;
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -87,6 +126,10 @@ public:
     void updateWallet(const uint256 &hash, int status)
     {
         OutputDebugStringF("updateWallet %s %i\n", hash.ToString().c_str(), status);
+
+        // Not loaded yet, loadPage() will pick the transaction up as it is then
+        if(loading && !(hash < hashNextLoad))
+            return;
         {
             LOCK(wallet->cs_wallet);
 
@@ -225,7 +268,7 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
 {
     columns << QString() << tr("Date") << tr("Type") << tr("Address") << BitcoinUnits::getAmountColumnTitle(walletModel->getOptionsModel()->getDisplayUnit());
 
-    priv->refreshWallet();
+    loadTransactions();
 
     QTimer *timer = new QTimer(this);
     connect(timer, SIGNAL(timeout()), this, SLOT(updateConfirmations()));
@@ -270,8 +313,20 @@ void TransactionTableModel::updateConfirmations()
 
 void TransactionTableModel::refresh()
 {
-    priv->refreshWallet();
-    emit dataChanged(index(0, 0), index(priv->size() - 1, Amount));
+    loadTransactions();
+}
+
+void TransactionTableModel::loadTransactions()
+{
+    if(priv->startLoading())
+        loadNextPage();
+}
+
+void TransactionTableModel::loadNextPage()
+{
+    // Let the event loop run between pages
+    if(priv->loadPage())
+        QTimer::singleShot(0, this, SLOT(loadNextPage()));
 }
 
 int TransactionTableModel::rowCount(const QModelIndex &parent) const
@@ -366,7 +421,7 @@ QString TransactionTableModel::lookupAddress(const std::string &address, bool to
     return description;
 }
 
-QString TransactionTableModel::formatTxType(const TransactionRecord *wtx) const
+QString TransactionTableModel::formatTxType(const TransactionRecord *wtx)
 {
     switch(wtx->type)
     {
@@ -60,6 +60,8 @@ public:
     QVariant headerData(int section, Qt::Orientation orientation, int role) const;
     QModelIndex index(int row, int column, const QModelIndex & parent = QModelIndex()) const;
     void refresh();
+    /** Type of a record as shown in the table, safe to call from any thread */
+    static QString formatTxType(const TransactionRecord *wtx);
 private:
     CWallet* wallet;
     WalletModel *walletModel;
@@ -71,12 +73,15 @@ private:
     QVariant addressColor(const TransactionRecord *wtx) const;
     QString formatTxStatus(const TransactionRecord *wtx) const;
     QString formatTxDate(const TransactionRecord *wtx) const;
-    QString formatTxType(const TransactionRecord *wtx) const;
     QString formatTxToAddress(const TransactionRecord *wtx, bool tooltip) const;
     QString formatTxAmount(const TransactionRecord *wtx, bool showUnconfirmed=true) const;
     QString formatTooltip(const TransactionRecord *rec) const;
     QVariant txStatusDecoration(const TransactionRecord *wtx) const;
     QVariant txAddressDecoration(const TransactionRecord *wtx) const;
+    void loadTransactions();
+
+private slots:
+    void loadNextPage();
 
 public slots:
     void updateTransaction(const QString &hash, int status);
@@ -28,6 +28,7 @@
 #include <QApplication>
 #include <QClipboard>
 #include <QLabel>
+#include <QProgressDialog>
 #include <QDateTimeEdit>
 #include <QStyledItemDelegate>
 #include <QDesktopServices>
@@ -37,7 +38,7 @@
 
 TransactionView::TransactionView(QWidget *parent) :
     QWidget(parent), model(0), transactionProxyModel(0),
-    transactionView(0)
+    transactionView(0), exportProgressDialog(0)
 {
     // Build filter row
     setContentsMargins(0,0,0,0);
@@ -317,23 +318,48 @@ void TransactionView::exportClicked()
             tr("Export Transaction Data"), QString(),
             tr("Comma separated file (*.csv)"));
 
-    if (filename.isNull()) return;
+    if (filename.isNull() || exportProgressDialog) return;
+
+    // Read from the wallet in the background rather than from the table,
+    // which may still be loading on a large wallet
+    CSVTransactionWriter *writer = new CSVTransactionWriter(filename, model, this);
+    writer->setTitles(QStringList() << tr("Confirmed") << tr("Date") << tr("Type") << tr("Label")
+                                    << tr("Address") << tr("Amount") << tr("ID"));
+    writer->setFilter(transactionProxyModel);
+    exportFilename = filename;
+
+    // Modal, so the filter stays as it is until the export is done
+    QProgressDialog *progress = new QProgressDialog(tr("Exporting transactions..."), tr("Cancel"), 0, 0, this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    connect(writer, SIGNAL(progress(int,int)), this, SLOT(exportProgress(int,int)));
+    connect(writer, SIGNAL(finished(bool)), this, SLOT(exportFinished(bool)));
+    connect(progress, SIGNAL(canceled()), writer, SLOT(cancel()));
+    exportProgressDialog = progress;
+    writer->start();
+}
 
-    CSVModelWriter writer(filename);
+void TransactionView::exportProgress(int done, int total)
+{
+    if(!exportProgressDialog)
+        return;
+    exportProgressDialog->setMaximum(total);
+    exportProgressDialog->setValue(done);
+}
 
-    // name, column, role
-    writer.setModel(transactionProxyModel);
-    writer.addColumn(tr("Confirmed"), 0, TransactionTableModel::ConfirmedRole);
-    writer.addColumn(tr("Date"), 0, TransactionTableModel::DateRole);
-    writer.addColumn(tr("Type"), TransactionTableModel::Type, Qt::EditRole);
-    writer.addColumn(tr("Label"), 0, TransactionTableModel::LabelRole);
-    writer.addColumn(tr("Address"), 0, TransactionTableModel::AddressRole);
-    writer.addColumn(tr("Amount"), 0, TransactionTableModel::FormattedAmountRole);
-    writer.addColumn(tr("ID"), 0, TransactionTableModel::TxIDRole);
+void TransactionView::exportFinished(bool success)
+{
+    bool canceled = exportProgressDialog && exportProgressDialog->wasCanceled();
+    if(exportProgressDialog)
+    {
+        exportProgressDialog->deleteLater();
+        exportProgressDialog = 0;
+    }
+    sender()->deleteLater();
 
-    if(!writer.write())
+    if(!success && !canceled)
     {
-        QMessageBox::critical(this, tr("Error exporting"), tr("Could not write to file %1.").arg(filename),
+        QMessageBox::critical(this, tr("Error exporting"), tr("Could not write to file %1.").arg(exportFilename),
                               QMessageBox::Abort, QMessageBox::Abort);
     }
 }
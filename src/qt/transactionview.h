@@ -15,6 +15,7 @@ class QSignalMapper;
 class QMenu;
 class QFrame;
 class QDateTimeEdit;
+class QProgressDialog;
 QT_END_NAMESPACE
 
 /** Widget showing the transaction list for a wallet, including a filter row.
@@ -57,6 +58,9 @@ private:
     QDateTimeEdit *dateFrom;
     QDateTimeEdit *dateTo;
 
+    QProgressDialog *exportProgressDialog;
+    QString exportFilename;
+
     QWidget *createDateRangeWidget();
 
 private slots:
@@ -71,6 +75,8 @@ private slots:
     void copyTxID();
     void clearOrphans();
     void openThirdPartyTxUrl(QString url);
+    void exportProgress(int done, int total);
+    void exportFinished(bool success);
 
 signals:
     void doubleClicked(const QModelIndex&);
@@ -19,7 +19,7 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
     cachedBalance(0), cachedStake(0), cachedUnconfirmedBalance(0), cachedImmatureBalance(0),
     cachedNumTransactions(0),
     cachedEncryptionStatus(Unencrypted),
-    cachedNumBlocks(0)
+    fBalanceCheckPending(false)
 {
     fHaveWatchOnly = wallet->HaveWatchOnly();
 
@@ -27,12 +27,10 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
     mintingTableModel = new MintingTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
 
-    // This timer will be fired repeatedly to update the balance
-    pollTimer = new QTimer(this);
-    connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
-    pollTimer->start(MODEL_UPDATE_DELAY);
-
+    // Balances are refreshed on transaction and block notifications, the
+    // first check fills the cache
     subscribeToCoreSignals();
+    checkBalanceChanged();
 }
 
 WalletModel::~WalletModel()
@@ -88,22 +86,34 @@ void WalletModel::updateStatus()
         emit encryptionStatusChanged(newEncryptionStatus);
 }
 
-void WalletModel::pollBalanceChanged()
+void WalletModel::updateBlocks()
 {
-    if(nBestHeight != cachedNumBlocks)
-    {
-        // Balance and number of transactions might have changed
-        cachedNumBlocks = nBestHeight;
-        checkBalanceChanged();
-    }
+    // Stake maturity and confirmations depend on the tip
+    scheduleBalanceCheck();
+}
+
+void WalletModel::scheduleBalanceCheck()
+{
+    // A block or a rescan can queue many notifications at once, check
+    // the balance once after all of them have been handled
+    if(fBalanceCheckPending)
+        return;
+    fBalanceCheckPending = true;
+    QTimer::singleShot(0, this, SLOT(checkBalanceChanged()));
 }
 
 void WalletModel::checkBalanceChanged()
 {
-    qint64 newBalanceTotal=getBalance(), newBalanceWatchOnly=getBalanceWatchOnly();
-    qint64 newStake = getStake();
-    qint64 newUnconfirmedBalance = getUnconfirmedBalance();
-    qint64 newImmatureBalance = getImmatureBalance();
+    fBalanceCheckPending = false;
+
+    // One pass over the wallet's balance cache for all the totals
+    CWalletBalances balances;
+    wallet->GetBalances(balances);
+
+    qint64 newBalanceTotal = balances.nBalance, newBalanceWatchOnly = balances.nWatchOnlyBalance;
+    qint64 newStake = balances.nStake;
+    qint64 newUnconfirmedBalance = balances.nUnconfirmed;
+    qint64 newImmatureBalance = balances.nImmature;
 
     if(cachedBalance != newBalanceTotal || cachedStake != newStake || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance)
     {
@@ -113,6 +123,13 @@ void WalletModel::checkBalanceChanged()
         cachedImmatureBalance = newImmatureBalance;
         emit balanceChanged(newBalanceTotal, newBalanceWatchOnly, newStake, newUnconfirmedBalance, newImmatureBalance);
     }
+
+    int newNumTransactions = getNumTransactions();
+    if(cachedNumTransactions != newNumTransactions)
+    {
+        cachedNumTransactions = newNumTransactions;
+        emit numTransactionsChanged(newNumTransactions);
+    }
 }
 
 void WalletModel::updateTransaction(const QString &hash, int status)
@@ -121,14 +138,7 @@ void WalletModel::updateTransaction(const QString &hash, int status)
         transactionTableModel->updateTransaction(hash, status);
 
     // Balance and number of transactions might have changed
-    checkBalanceChanged();
-
-    int newNumTransactions = getNumTransactions();
-    if(cachedNumTransactions != newNumTransactions)
-    {
-        cachedNumTransactions = newNumTransactions;
-        emit numTransactionsChanged(newNumTransactions);
-    }
+    scheduleBalanceCheck();
 }
 
 void WalletModel::updateAddressBook(const QString &address, const QString &label, bool isMine, int status)
@@ -369,6 +379,11 @@ static void NotifyAddressBookChanged(WalletModel *walletmodel, CWallet *wallet,
                               Q_ARG(int, status));
 }
 
+static void NotifyBlocksChanged(WalletModel *walletmodel)
+{
+    QMetaObject::invokeMethod(walletmodel, "updateBlocks", Qt::QueuedConnection);
+}
+
 static void NotifyTransactionChanged(WalletModel *walletmodel, CWallet *wallet, const uint256 &hash, ChangeType status)
 {
     OutputDebugStringF("NotifyTransactionChanged %s status=%i\n", hash.GetHex().c_str(), status);
@@ -390,6 +405,7 @@ void WalletModel::subscribeToCoreSignals()
     wallet->NotifyAddressBookChanged.connect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5));
     wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
     wallet->NotifyWatchonlyChanged.connect(boost::bind(NotifyWatchonlyChanged, this, _1));
+    uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
 }
 
 void WalletModel::unsubscribeFromCoreSignals()
@@ -399,6 +415,7 @@ void WalletModel::unsubscribeFromCoreSignals()
     wallet->NotifyAddressBookChanged.disconnect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5));
     wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
     wallet->NotifyWatchonlyChanged.disconnect(boost::bind(NotifyWatchonlyChanged, this, _1));
+    uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
 }
 
 // WalletModel::UnlockContext implementation
@@ -157,12 +157,14 @@ private:
     qint64 cachedImmatureBalance;
     qint64 cachedNumTransactions;
     EncryptionStatus cachedEncryptionStatus;
-    int cachedNumBlocks;
-
-    QTimer *pollTimer;
+    bool fBalanceCheckPending;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
+    void scheduleBalanceCheck();
+
+private slots:
+    /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
     void checkBalanceChanged();
 
 public slots:
@@ -174,8 +176,8 @@ public slots:
     void updateAddressBook(const QString &address, const QString &label, bool isMine, int status);
     /* Watchonly added */
     void updateWatchOnlyFlag(bool fHaveWatchonly);
-    /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
-    void pollBalanceChanged();
+    /* New best block, stake and immature balances might have matured */
+    void updateBlocks();
 
 signals:
     // Signal that balance in wallet changed
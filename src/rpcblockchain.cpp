@@ -5,7 +5,13 @@
 
 #include "wallet.h"
 #include "bitcoinrpc.h"
+#include "kernel.h"
+#include "checkpoints.h"
+#include "hash.h"
+#include "txdb.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/utility/addressof.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <ostream>
@@ -47,7 +53,14 @@ double GetDifficulty(const CBlockIndex* blockindex)
     return dDiff;
 }
 
-double GetPoWMHashPS()
+// GetDifficulty() of an entry from the chain tip snapshot, without falling
+// back on pindexBest
+double GetTipDifficulty(const CBlockIndex* blockindex)
+{
+    return blockindex ? GetDifficulty(blockindex) : 1.0;
+}
+
+static double GetPoWMHashPSUncached()
 {
     int nPoWInterval = 72;
     int64_t nTargetSpacingWorkMin = 30, nTargetSpacingWork = 30;
@@ -71,14 +84,41 @@ double GetPoWMHashPS()
     return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
 }
 
+// Walks the whole chain under cs_main, so it is only redone for a new tip
+double GetPoWMHashPS()
+{
+    static CCriticalSection cs_cache;
+    static uint256 hashCached = 0;
+    static double dCached = 0;
+
+    uint256 hashTip = GetChainTip()->hashBlock;
+    {
+        LOCK(cs_cache);
+        if (hashTip != 0 && hashTip == hashCached)
+            return dCached;
+    }
+
+    double dResult;
+    {
+        LOCK(cs_main);
+        hashTip = hashBestChain;
+        dResult = GetPoWMHashPSUncached();
+    }
+
+    LOCK(cs_cache);
+    hashCached = hashTip;
+    dCached = dResult;
+    return dResult;
+}
+
 double GetPoSKernelPS()
 {
     int nPoSInterval = 72;
     double dStakeKernelsTriedAvg = 0;
     int nStakesHandled = 0, nStakesTime = 0;
 
-    CBlockIndex* pindex = pindexBest;;
-    CBlockIndex* pindexPrevStake = NULL;
+    const CBlockIndex* pindex = GetChainTip()->pindex;
+    const CBlockIndex* pindexPrevStake = NULL;
 
     while (pindex && nStakesHandled < nPoSInterval)
     {
@@ -99,55 +139,60 @@ double GetPoSKernelPS()
     return dStakeKernelsTriedAvg / nStakesTime;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+// The block from the block files, which may have been pruned
+static void ReadBlockForRPC(CBlock& block, const CBlockIndex* pindex)
 {
-    Object result;
-    result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
+    if (IsBlockPruned(pindex))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
+    if (!block.ReadFromDisk(pindex, true))
+        throw JSONRPCError(RPC_MISC_ERROR, "Can't read block from disk");
+}
+
+void BlockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Key("hash").String(blockindex->GetBlockHash().GetHex());
     CMerkleTx txGen(block.vtx[0]);
     txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0')));
+    writer.Key("confirmations").Int(txGen.GetDepthInMainChain());
+    writer.Key("size").Int(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Key("height").Int(blockindex->nHeight);
+    writer.Key("version").Int(block.nVersion);
+    writer.Key("merkleroot").String(block.hashMerkleRoot.GetHex());
+    writer.Key("mint").Real(ValueFromAmount(blockindex->nMint).get_real());
+    writer.Key("time").Int(block.GetBlockTime());
+    writer.Key("nonce").UInt(block.nNonce);
+    writer.Key("bits").String(HexBits(block.nBits));
+    writer.Key("difficulty").Real(GetDifficulty(blockindex));
+    writer.Key("blocktrust").String(leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+    writer.Key("chaintrust").String(leftTrim(blockindex->nChainTrust.GetHex(), '0'));
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+        writer.Key("previousblockhash").String(blockindex->pprev->GetBlockHash().GetHex());
     if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
-    Array txinfo;
+        writer.Key("nextblockhash").String(blockindex->pnext->GetBlockHash().GetHex());
+
+    writer.Key("flags").String(strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    writer.Key("proofhash").String(blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex());
+    writer.Key("entropybit").Int(blockindex->GetStakeEntropyBit());
+    writer.Key("modifier").String(strprintf("%016" PRIx64, blockindex->nStakeModifier));
+    writer.Key("modifierchecksum").String(strprintf("%08x", blockindex->nStakeModifierChecksum));
+    writer.Key("tx").BeginArray();
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
         {
             CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
             ssTx << tx;
-            string strHex = HexStr(ssTx.begin(), ssTx.end());
-
-            txinfo.push_back(strHex);
+            writer.String(HexStr(ssTx.begin(), ssTx.end()));
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.String(tx.GetHash().GetHex());
     }
-
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
 
     if ( block.IsProofOfStake() )
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
-
-    return result;
+        writer.Key("signature").String(HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
+    writer.EndObject();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -157,7 +202,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best block in the longest block chain.");
 
-    return hashBestChain.GetHex();
+    return GetChainTip()->hashBlock.GetHex();
 }
 
 Value getblockcount(const Array& params, bool fHelp)
@@ -167,7 +212,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainTip()->nHeight;
 }
 
 
@@ -178,9 +223,11 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the difficulty as a multiple of the minimum difficulty.");
 
+    boost::shared_ptr<const CChainTip> ptip = GetChainTip();
+
     Object obj;
-    obj.push_back(Pair("proof-of-work",        GetDifficulty()));
-    obj.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("proof-of-work",        GetTipDifficulty(ptip->pindexLastPoW)));
+    obj.push_back(Pair("proof-of-stake",       GetTipDifficulty(ptip->pindexLastPoS)));
     obj.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
     return obj;
 }
@@ -201,19 +248,191 @@ Value settxfee(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, returns an object of the transactions by id with their size, fee,\n"
+            "time and height of entry, priority, package and descendants, best package fee\n"
+            "rate first.");
+
+    if (params.size() > 0 && params[0].get_bool())
+    {
+        CJSONWriter writer;
+        writer.BeginObject();
+        {
+            LOCK(mempool.cs);
+            writer.reserve(mempool.mapEntry.size() * 256 + 2);
+            for (set<pair<double, uint256> >::reverse_iterator it = mempool.setByAncestorFeeRate.rbegin(); it != mempool.setByAncestorFeeRate.rend(); ++it)
+            {
+                const CTxMemPoolEntry& entry = mempool.mapEntry[it->second];
+                writer.Key(it->second.ToString()).BeginObject();
+                writer.Key("size").UInt(entry.nTxSize);
+                writer.Key("fee").Real(ValueFromAmount(entry.nFee).get_real());
+                writer.Key("time").Int(entry.nTime);
+                writer.Key("height").Int(entry.nHeight);
+                writer.Key("priority").Real(entry.GetPriority(nBestHeight));
+                writer.Key("ancestorcount").UInt(entry.nCountWithAncestors);
+                writer.Key("ancestorsize").UInt(entry.nSizeWithAncestors);
+                writer.Key("ancestorfees").Real(ValueFromAmount(entry.nFeesWithAncestors).get_real());
+                writer.Key("descendantcount").UInt(entry.nCountWithDescendants);
+                writer.Key("descendantsize").UInt(entry.nSizeWithDescendants);
+                writer.Key("descendantfees").Real(ValueFromAmount(entry.nFeesWithDescendants).get_real());
+                writer.EndObject();
+            }
+        }
+        writer.EndObject();
+        return RawJSON(writer);
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    CJSONWriter writer;
+    writer.reserve(vtxid.size() * 67 + 2);
+    writer.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        writer.String(hash.ToString());
+    writer.EndArray();
+
+    return RawJSON(writer);
+}
+
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the number, byte size and memory use of the memory pool transactions,\n"
+            "its limits and a histogram of their fee rates per kilobyte. Each bucket\n"
+            "holds the transactions from its fee rate up to the next one's.");
+
+    // Bucket bounds at 1, 2 and 5 times the powers of ten of the minimal fee
+    vector<int64_t> vBounds(1, 0);
+    for (int64_t nBound = MIN_TX_FEE; nBound <= COIN; nBound *= 10)
+    {
+        vBounds.push_back(nBound);
+        vBounds.push_back(nBound * 2);
+        vBounds.push_back(nBound * 5);
+    }
+    vector<uint64_t> vCount(vBounds.size(), 0), vBytes(vBounds.size(), 0);
+    vector<int64_t> vFees(vBounds.size(), 0);
+
+    Object obj;
+    {
+        LOCK(mempool.cs);
+        obj.push_back(Pair("size",       (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("bytes",      mempool.nTotalTxSize));
+        obj.push_back(Pair("usage",      mempool.nTotalUsage));
+
+        // Fee rate index is ordered, so the buckets fill one after another
+        unsigned int nBucket = 0;
+        for (set<pair<double, uint256> >::const_iterator it = mempool.setByFeeRate.begin(); it != mempool.setByFeeRate.end(); ++it)
+        {
+            while (nBucket + 1 < vBounds.size() && it->first >= vBounds[nBucket + 1])
+                nBucket++;
+            const CTxMemPoolEntry& entry = mempool.mapEntry[it->second];
+            vCount[nBucket]++;
+            vBytes[nBucket] += entry.nTxSize;
+            vFees[nBucket] += entry.nFee;
+        }
+    }
+    obj.push_back(Pair("maxmempool",     nMaxMempoolSize));
+    obj.push_back(Pair("mempoolexpiry",  nMempoolExpiry));
+
+    Array histogram;
+    for (unsigned int i = 0; i < vBounds.size(); i++)
+    {
+        if (vCount[i] == 0)
+            continue;
+        Object bucket;
+        bucket.push_back(Pair("feerate", ValueFromAmount(vBounds[i])));
+        bucket.push_back(Pair("count",   vCount[i]));
+        bucket.push_back(Pair("bytes",   vBytes[i]));
+        bucket.push_back(Pair("fees",    ValueFromAmount(vFees[i])));
+        histogram.push_back(bucket);
+    }
+    obj.push_back(Pair("feehistogram", histogram));
+
+    return obj;
+}
+
+// Sequence and timeout arguments of the long polls
+static void ParseWaitParams(const Array& params, uint64_t& nSinceRet, int64_t& nTimeoutRet)
+{
+    nSinceRet = 0;
+    if (params.size() > 0)
+    {
+        if (params[0].get_int64() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence");
+        nSinceRet = params[0].get_int64();
+    }
+    nTimeoutRet = 60;
+    if (params.size() > 1)
+        nTimeoutRet = params[1].get_int64();
+    if (nTimeoutRet < 0 || nTimeoutRet > 3600)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Timeout out of range");
+}
+
+Value waitforblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "waitforblock [sequence=0] [timeout=60]\n"
+            "Waits up to [timeout] seconds for a new best block after notification\n"
+            "number [sequence]. Returns the number of the latest notification, to pass\n"
+            "on to the next call, the best block hashes since [sequence], oldest first,\n"
+            "and the current best block. \"missed\" is true when some were already forgotten.");
+
+    uint64_t nSince;
+    int64_t nTimeout;
+    ParseWaitParams(params, nSince, nTimeout);
+
+    vector<uint256> vHash;
+    bool fMissed;
+    uint64_t nSequence = blockNotifyHistory.Wait(nSince, nTimeout * 1000, vHash, fMissed);
+    boost::shared_ptr<const CChainTip> ptip = GetChainTip();
+
+    Array blocks;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        blocks.push_back(hash.GetHex());
+
+    Object ret;
+    ret.push_back(Pair("sequence", (boost::int64_t)nSequence));
+    ret.push_back(Pair("blocks", blocks));
+    ret.push_back(Pair("missed", fMissed));
+    ret.push_back(Pair("hash", ptip->hashBlock.GetHex()));
+    ret.push_back(Pair("height", ptip->nHeight));
+    return ret;
+}
 
-    return a;
+Value waitfornewtx(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "waitfornewtx [sequence=0] [timeout=60]\n"
+            "Waits up to [timeout] seconds for transactions to enter the memory pool after\n"
+            "notification number [sequence]. Returns the number of the latest notification,\n"
+            "to pass on to the next call, and the txids added since [sequence], oldest first.\n"
+            "\"missed\" is true when some were already forgotten.");
+
+    uint64_t nSince;
+    int64_t nTimeout;
+    ParseWaitParams(params, nSince, nTimeout);
+
+    vector<uint256> vHash;
+    bool fMissed;
+    uint64_t nSequence = mempoolNotifyHistory.Wait(nSince, nTimeout * 1000, vHash, fMissed);
+
+    Array txids;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        txids.push_back(hash.GetHex());
+
+    Object ret;
+    ret.push_back(Pair("sequence", (boost::int64_t)nSequence));
+    ret.push_back(Pair("txids", txids));
+    ret.push_back(Pair("missed", fMissed));
+    return ret;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -223,6 +442,7 @@ Value getblockhash(const Array& params, bool fHelp)
             "getblockhash <index>\n"
             "Returns hash of block in best-block-chain at <index>.");
 
+    READ_LOCK(cs_blockIndex);
     int nHeight = params[0].get_int();
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
@@ -242,14 +462,18 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
+    READ_LOCK(cs_blockIndex);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    CBlockIndex* pblockindex = mi->second;
+    ReadBlockForRPC(block, pblockindex);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    CJSONWriter writer;
+    BlockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+    return RawJSON(writer);
 }
 
 Value getblockbynumber(const Array& params, bool fHelp)
@@ -260,19 +484,18 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "txinfo optional to print more detailed tx info\n"
             "Returns details of a block with given block-number.");
 
+    READ_LOCK(cs_blockIndex);
     int nHeight = params[0].get_int();
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    pblockindex = mapBlockIndex[*pblockindex->phashBlock];
-    block.ReadFromDisk(pblockindex, true);
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    ReadBlockForRPC(block, pblockindex);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    CJSONWriter writer;
+    BlockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+    return RawJSON(writer);
 }
 
 bool ExportBlock(const string& strBlockHash, const CDataStream& ssBlock)
@@ -310,10 +533,11 @@ Value dumpblock(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    ReadBlockForRPC(block, pblockindex);
 
     CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock.reserve(ssBlock.GetSerializeSize(block));
     ssBlock << block;
 
     if (params.size() > 1)
@@ -337,14 +561,11 @@ Value dumpblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    pblockindex = mapBlockIndex[*pblockindex->phashBlock];
-    block.ReadFromDisk(pblockindex, true);
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    ReadBlockForRPC(block, pblockindex);
 
     CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock.reserve(ssBlock.GetSerializeSize(block));
     ssBlock << block;
 
     if (params.size() > 1)
@@ -368,7 +589,7 @@ Value getcheckpoint(const Array& params, bool fHelp)
     CBlockIndex* pindexCheckpoint;
 
     result.push_back(Pair("synccheckpoint", Checkpoints::hashSyncCheckpoint.ToString().c_str()));
-    pindexCheckpoint = mapBlockIndex[Checkpoints::hashSyncCheckpoint];
+    pindexCheckpoint = LookupBlockIndex(Checkpoints::hashSyncCheckpoint);
     result.push_back(Pair("height", pindexCheckpoint->nHeight));
     result.push_back(Pair("timestamp", DateTimeStrFormat(pindexCheckpoint->GetBlockTime()).c_str()));
 
@@ -408,3 +629,222 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value dumpstakemodifiers(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumpstakemodifiers <destination>\n"
+            "Writes the stake modifiers of the best chain up to the last stake modifier\n"
+            "checkpoint to <destination>, for nodes syncing with -modifiersnapshot.\n"
+            "Returns the last height written.");
+
+    int nHeight;
+    if (!WriteStakeModifierSnapshot(params[0].get_str(), nHeight))
+        throw JSONRPCError(RPC_MISC_ERROR, "Error writing the stake modifier snapshot");
+    return nHeight;
+}
+
+// A transaction with unspent outputs, as written to the unspent output snapshot
+class CUnspentTxSnapshotEntry
+{
+public:
+    uint256 hash;
+    unsigned int nTime;
+    int nHeight;
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<std::pair<unsigned int, CTxOut> > vout;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(nTime);
+        READWRITE(nHeight);
+        READWRITE(fCoinBase);
+        READWRITE(fCoinStake);
+        READWRITE(vout);
+    )
+};
+
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+struct CUnspentTxSnapshotTotals
+{
+    uint64_t nTransactions;
+    uint64_t nOutputs;
+    int64_t nAmount;
+    bool fError;
+
+    CUnspentTxSnapshotTotals() : nTransactions(0), nOutputs(0), nAmount(0), fError(false) { }
+};
+
+// Adds the unspent outputs of one transaction index record to the snapshot,
+// and to the file if there is one. Empty outputs, like the first of a coin
+// stake, and OP_RETURN outputs can never be spent and are left out.
+static bool AddUnspentTx(CAutoFile* pfileout, CHashWriter* phasher, CUnspentTxSnapshotTotals* ptotals, const uint256& hash, const CTxIndex& txindex)
+{
+    bool fUnspent = false;
+    BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+        if (pos.IsNull())
+            fUnspent = true;
+    if (!fUnspent)
+        return true;
+
+    CTransaction tx;
+    CBlockIndex* pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindex || !tx.ReadFromDisk(txindex.pos) || tx.GetHash() != hash)
+    {
+        printf("AddUnspentTx() : cannot read transaction %s\n", hash.ToString().c_str());
+        ptotals->fError = true;
+        return false;
+    }
+
+    CUnspentTxSnapshotEntry entry;
+    entry.hash = hash;
+    entry.nTime = tx.nTime;
+    entry.nHeight = pindex->nHeight;
+    entry.fCoinBase = tx.IsCoinBase();
+    entry.fCoinStake = tx.IsCoinStake();
+    for (unsigned int i = 0; i < tx.vout.size() && i < txindex.vSpent.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!txindex.vSpent[i].IsNull() || txout.IsEmpty() || (txout.scriptPubKey.size() > 0 && txout.scriptPubKey[0] == OP_RETURN))
+            continue;
+        entry.vout.push_back(make_pair(i, txout));
+        ptotals->nAmount += txout.nValue;
+    }
+    if (entry.vout.empty())
+        return true;
+    ptotals->nTransactions++;
+    ptotals->nOutputs += entry.vout.size();
+
+    *phasher << entry;
+    if (pfileout)
+        *pfileout << entry;
+    return true;
+}
+
+// Walks the transaction index, the caller holds cs_main so that it stays at
+// the best block meanwhile
+static bool WalkUnspentTxs(CAutoFile* pfileout, CHashWriter& hasher, CUnspentTxSnapshotTotals& totals)
+{
+    CTxDB txdb("r");
+    if (!txdb.ForEachTxIndex(boost::bind(&AddUnspentTx, pfileout, &hasher, &totals, _1, _2)))
+        throw JSONRPCError(RPC_MISC_ERROR, "Unspent output snapshots need the LevelDB transaction index");
+    return !totals.fError;
+}
+
+Value dumputxoset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumputxoset <destination>\n"
+            "Writes the unspent transaction outputs at the best block to <destination>,\n"
+            "with a hash of their records to compare with other nodes.");
+
+    string strFile = params[0].get_str();
+    CAutoFile fileout = CAutoFile(fopen(strFile.c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + strFile);
+
+    int64_t nStart = GetTimeMillis();
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CUnspentTxSnapshotTotals totals;
+    try {
+        fileout << FLATDATA(pchMessageStart) << UTXO_SNAPSHOT_VERSION << nBestHeight << hashBestChain;
+        // CAutoFile overloads unary &
+        if (!WalkUnspentTxs(boost::addressof(fileout), hasher, totals))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the unspent outputs, see debug.log");
+
+        // The records end with a null hash
+        CUnspentTxSnapshotEntry end;
+        fileout << end.hash << totals.nTransactions << totals.nOutputs << totals.nAmount << hasher.GetHash();
+    }
+    catch (const std::ios_base::failure&) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Error writing " + strFile);
+    }
+    FileCommit(fileout);
+    printf("Wrote %" PRIu64 " unspent outputs of %" PRIu64 " transactions to %s in %" PRId64 "ms\n",
+        totals.nOutputs, totals.nTransactions, strFile.c_str(), GetTimeMillis() - nStart);
+
+    Object result;
+    result.push_back(Pair("height", nBestHeight));
+    result.push_back(Pair("bestblock", hashBestChain.GetHex()));
+    result.push_back(Pair("transactions", (boost::uint64_t)totals.nTransactions));
+    result.push_back(Pair("txouts", (boost::uint64_t)totals.nOutputs));
+    result.push_back(Pair("total_amount", ValueFromAmount(totals.nAmount)));
+    return result;
+}
+
+Value verifyutxoset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "verifyutxoset <source>\n"
+            "Checks an unspent output snapshot written by dumputxoset: its hash and\n"
+            "totals, whether its block is on the best chain and passes the checkpoints,\n"
+            "and, if this node is at that block, whether it has the same unspent outputs.");
+
+    string strFile = params[0].get_str();
+    CAutoFile filein = CAutoFile(fopen(strFile.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + strFile);
+
+    unsigned char pchMsgTmp[4];
+    int nVersion, nHeight;
+    uint256 hashBlock, hashIn;
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CUnspentTxSnapshotTotals totals, totalsIn;
+    try {
+        filein >> FLATDATA(pchMsgTmp) >> nVersion >> nHeight >> hashBlock;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            throw JSONRPCError(RPC_MISC_ERROR, "Snapshot made for a different network");
+        if (nVersion != UTXO_SNAPSHOT_VERSION)
+            throw JSONRPCError(RPC_MISC_ERROR, strprintf("Unknown snapshot version %d", nVersion));
+
+        while (true)
+        {
+            CUnspentTxSnapshotEntry entry;
+            filein >> entry.hash;
+            if (entry.hash == 0)
+                break;
+            filein >> entry.nTime >> entry.nHeight >> entry.fCoinBase >> entry.fCoinStake >> entry.vout;
+            hasher << entry;
+            totals.nTransactions++;
+            totals.nOutputs += entry.vout.size();
+            for (unsigned int i = 0; i < entry.vout.size(); i++)
+                totals.nAmount += entry.vout[i].second.nValue;
+        }
+        filein >> totalsIn.nTransactions >> totalsIn.nOutputs >> totalsIn.nAmount >> hashIn;
+    }
+    catch (const std::ios_base::failure&) {
+        throw JSONRPCError(RPC_MISC_ERROR, "I/O error or snapshot truncated");
+    }
+    uint256 hashRecords = hasher.GetHash();
+
+    Object result;
+    result.push_back(Pair("height", nHeight));
+    result.push_back(Pair("bestblock", hashBlock.GetHex()));
+    result.push_back(Pair("transactions", (boost::uint64_t)totals.nTransactions));
+    result.push_back(Pair("txouts", (boost::uint64_t)totals.nOutputs));
+    result.push_back(Pair("total_amount", ValueFromAmount(totals.nAmount)));
+    result.push_back(Pair("hash", hashRecords.GetHex()));
+    result.push_back(Pair("intact", hashRecords == hashIn && totals.nTransactions == totalsIn.nTransactions &&
+                                    totals.nOutputs == totalsIn.nOutputs && totals.nAmount == totalsIn.nAmount));
+
+    CBlockIndex* pindex = LookupBlockIndex(hashBlock);
+    result.push_back(Pair("inmainchain", pindex && pindex->IsInMainChain() && pindex->nHeight == nHeight));
+    result.push_back(Pair("checkpoints", Checkpoints::CheckHardened(nHeight, hashBlock)));
+
+    // Only the best block's set is in the transaction index
+    if (hashBlock == hashBestChain)
+    {
+        CHashWriter hasherLocal(SER_DISK, CLIENT_VERSION);
+        CUnspentTxSnapshotTotals totalsLocal;
+        if (!WalkUnspentTxs(NULL, hasherLocal, totalsLocal))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the unspent outputs, see debug.log");
+        result.push_back(Pair("matcheslocal", hasherLocal.GetHash() == hashRecords));
+    }
+    return result;
+}
@@ -11,6 +11,26 @@
 using namespace json_spirit;
 using namespace std;
 
+// The key of a wallet address, or a private key given as is
+static void GetDecryptionKey(const string& strKey, CKey& key)
+{
+    CBitcoinAddress addr(strKey);
+    if (addr.IsValid()) {
+        CKeyID keyID;
+        addr.GetKeyID(keyID);
+        if (!GetRPCWallet()->GetKey(keyID, key))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "We have no private key for this address");
+    }
+    else {
+        CBitcoinSecret vchSecret;
+        if (!vchSecret.SetString(strKey))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Provided private key is inconsistent.");
+        bool fCompressed;
+        CSecret secret = vchSecret.GetSecret(fCompressed);
+        key.SetSecret(secret, fCompressed);
+    }
+}
+
 Value encryptdata(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 2)
@@ -35,21 +55,7 @@ Value decryptdata(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
     CKey key;
-    CBitcoinAddress addr(params[0].get_str());
-    if (addr.IsValid()) {
-        CKeyID keyID;
-        addr.GetKeyID(keyID);
-        if (!pwalletMain->GetKey(keyID, key))
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "We have no private key for this address");
-    }
-    else {
-        CBitcoinSecret vchSecret;
-        if (!vchSecret.SetString(params[0].get_str()))
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Provided private key is inconsistent.");
-        bool fCompressed;
-        CSecret secret = vchSecret.GetSecret(fCompressed);
-        key.SetSecret(secret, fCompressed);
-    }
+    GetDecryptionKey(params[0].get_str(), key);
 
     vector<unsigned char> vchDecrypted;
     key.DecryptData(ParseHex(params[1].get_str()), vchDecrypted);
@@ -83,21 +89,7 @@ Value decryptmessage(const Array& params, bool fHelp)
     EnsureWalletIsUnlocked();
 
     CKey key;
-    CBitcoinAddress addr(params[0].get_str());
-    if (addr.IsValid()) {
-        CKeyID keyID;
-        addr.GetKeyID(keyID);
-        if (!pwalletMain->GetKey(keyID, key))
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "We have no private key for this address");
-    }
-    else {
-        CBitcoinSecret vchSecret;
-        if (!vchSecret.SetString(params[0].get_str()))
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Provided private key is inconsistent.");
-        bool fCompressed;
-        CSecret secret = vchSecret.GetSecret(fCompressed);
-        key.SetSecret(secret, fCompressed);
-    }
+    GetDecryptionKey(params[0].get_str(), key);
 
     vector<unsigned char> vchEncrypted;
     if (!DecodeBase58Check(params[1].get_str(), vchEncrypted))
@@ -107,3 +99,51 @@ Value decryptmessage(const Array& params, bool fHelp)
 
     return std::string((const char*)&vchDecrypted[0], vchDecrypted.size());
 }
+
+Value encryptmessages(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "encryptmessages <public key> <[\"message\",...]>\n"
+            "Encrypt many messages with provided public key, the key is set up once for all of them.\n");
+
+    CPubKey pubKey(ParseHex(params[0].get_str()));
+    CDataEncryptor encryptor(pubKey);
+
+    Array ret;
+    vector<unsigned char> vchEncrypted;
+    BOOST_FOREACH(const Value& message, params[1].get_array())
+    {
+        string strData = message.get_str();
+        encryptor.Encrypt(vector<unsigned char>(strData.begin(), strData.end()), vchEncrypted);
+        ret.push_back(EncodeBase58Check(vchEncrypted));
+    }
+
+    return ret;
+}
+
+Value decryptmessages(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "decryptmessages <42 address or private key> <[\"encrypted message\",...]>\n"
+            "Decrypt many message strings, the key is set up once for all of them.\n");
+
+    EnsureWalletIsUnlocked();
+
+    CKey key;
+    GetDecryptionKey(params[0].get_str(), key);
+    CDataDecryptor decryptor(key);
+
+    Array ret;
+    vector<unsigned char> vchEncrypted, vchDecrypted;
+    BOOST_FOREACH(const Value& message, params[1].get_array())
+    {
+        if (!DecodeBase58Check(message.get_str(), vchEncrypted))
+            throw runtime_error(strprintf("Incorrect string at position %" PRIszu, ret.size()));
+        decryptor.Decrypt(vchEncrypted, vchDecrypted);
+        ret.push_back(string(vchDecrypted.begin(), vchDecrypted.end()));
+    }
+
+    return ret;
+}
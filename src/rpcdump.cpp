@@ -2,7 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
-#include "init.h" // for pwalletMain
+#include "init.h" // for GetRPCWallet()
 #include "bitcoinrpc.h"
 #include "ui_interface.h"
 #include "base58.h"
@@ -65,26 +65,26 @@ Value importprivkey(const Array& params, bool fHelp)
     CKeyID keyid = key.GetPubKey().GetID();
     CBitcoinAddress addr = CBitcoinAddress(keyid);
     {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
+        LOCK2(cs_main, GetRPCWallet()->cs_wallet);
 
         // Don't throw error in case a key is already there
-        if (pwalletMain->HaveKey(keyid))
+        if (GetRPCWallet()->HaveKey(keyid))
             return Value::null;
 
-        pwalletMain->mapKeyMetadata[addr].nCreateTime = 1;
-        if (!pwalletMain->AddKey(key))
+        GetRPCWallet()->mapKeyMetadata[addr].nCreateTime = 1;
+        if (!GetRPCWallet()->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
 
-        pwalletMain->MarkDirty();
-        pwalletMain->SetAddressBookName(addr, strLabel);
+        GetRPCWallet()->MarkDirty();
+        GetRPCWallet()->SetAddressBookName(addr, strLabel);
 
         if (fRescan)
         {
             // whenever a key is imported, we need to scan the whole chain
-            pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+            GetRPCWallet()->nTimeFirstKey = 1; // 0 would be considered 'no value'
 
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
+            GetRPCWallet()->ScanForWalletTransactions(pindexGenesisBlock, true);
+            GetRPCWallet()->ReacceptWalletTransactions();
         }
     }
 
@@ -120,26 +120,26 @@ Value importaddress(const Array& params, bool fHelp)
         fRescan = params[2].get_bool();
 
     {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-        if (::IsMine(*pwalletMain, script) == MINE_SPENDABLE)
+        LOCK2(cs_main, GetRPCWallet()->cs_wallet);
+        if (::IsMine(*GetRPCWallet(), script) == MINE_SPENDABLE)
             throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
         // Don't throw error in case an address is already there
-        if (pwalletMain->HaveWatchOnly(script))
+        if (GetRPCWallet()->HaveWatchOnly(script))
             return Value::null;
 
-        pwalletMain->MarkDirty();
+        GetRPCWallet()->MarkDirty();
 
         if (address.IsValid())
-            pwalletMain->SetAddressBookName(address, strLabel);
+            GetRPCWallet()->SetAddressBookName(address, strLabel);
 
-        if (!pwalletMain->AddWatchOnly(script))
+        if (!GetRPCWallet()->AddWatchOnly(script))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
 
         if (fRescan)
         {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
+            GetRPCWallet()->ScanForWalletTransactions(pindexGenesisBlock, true);
+            GetRPCWallet()->ReacceptWalletTransactions();
         }
     }
 
@@ -171,17 +171,17 @@ Value removeaddress(const Array& params, bool fHelp)
     } else
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address or script");
 
-    if (::IsMine(*pwalletMain, script) == MINE_SPENDABLE)
+    if (::IsMine(*GetRPCWallet(), script) == MINE_SPENDABLE)
         throw JSONRPCError(RPC_WALLET_ERROR, "The wallet contains the private key for this address or script - can't remove it");
 
-    if (!pwalletMain->HaveWatchOnly(script))
+    if (!GetRPCWallet()->HaveWatchOnly(script))
         throw JSONRPCError(RPC_WALLET_ERROR, "The wallet does not contain this address or script");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    LOCK2(cs_main, GetRPCWallet()->cs_wallet);
 
-    pwalletMain->MarkDirty();
+    GetRPCWallet()->MarkDirty();
 
-    if (!pwalletMain->RemoveWatchOnly(script))
+    if (!GetRPCWallet()->RemoveWatchOnly(script))
         throw JSONRPCError(RPC_WALLET_ERROR, "Error removing address from wallet");
 
     return Value::null;
@@ -197,7 +197,7 @@ Value importwallet(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
-    if(!ImportWallet(pwalletMain, params[0].get_str().c_str()))
+    if(!ImportWallet(GetRPCWallet(), params[0].get_str().c_str()))
        throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
 
     return Value::null;
@@ -223,7 +223,7 @@ Value dumpprivkey(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to a key");
     CSecret vchSecret;
     bool fCompressed;
-    if (!pwalletMain->GetSecret(keyID, vchSecret, fCompressed))
+    if (!GetRPCWallet()->GetSecret(keyID, vchSecret, fCompressed))
         throw JSONRPCError(RPC_WALLET_ERROR, "Private key for address " + strAddress + " is not known");
     return CBitcoinSecret(vchSecret, fCompressed).ToString();
 }
@@ -251,7 +251,7 @@ Value dumppem(const Array& params, bool fHelp)
     CKeyID keyID;
     if (!address.GetKeyID(keyID))
         throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to a key");
-    if (!pwalletMain->GetPEM(keyID, params[1].get_str(), strPassKey))
+    if (!GetRPCWallet()->GetPEM(keyID, params[1].get_str(), strPassKey))
         throw JSONRPCError(RPC_WALLET_ERROR, "Error dumping key pair to file");
 
     return Value::null;
@@ -267,7 +267,7 @@ Value dumpwallet(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
-    if(!DumpWallet(pwalletMain, params[0].get_str().c_str() ))
+    if(!DumpWallet(GetRPCWallet(), params[0].get_str().c_str() ))
       throw JSONRPCError(RPC_WALLET_ERROR, "Error dumping wallet keys to file");
 
     return Value::null;
@@ -286,7 +286,7 @@ Value dumpmalleablekey(const Array& params, bool fHelp)
     CMalleableKeyView keyView;
     keyView.SetString(params[0].get_str());
 
-    if (!pwalletMain->GetMalleableKey(keyView, mKey))
+    if (!GetRPCWallet()->GetMalleableKey(keyView, mKey))
         throw runtime_error("There is no such item in the wallet");
 
     Object result;
@@ -313,7 +313,7 @@ Value importmalleablekey(const Array& params, bool fHelp)
 
     if (fSuccess)
     {
-        fSuccess = pwalletMain->AddKey(mKey);
+        fSuccess = GetRPCWallet()->AddKey(mKey);
         result.push_back(Pair("Successful", fSuccess));
         result.push_back(Pair("Address", CBitcoinAddress(mKey.GetMalleablePubKey()).ToString()));
         result.push_back(Pair("KeyView", CMalleableKeyView(mKey).ToString()));
@@ -49,13 +49,15 @@ Value getmininginfo(const Array& params, bool fHelp)
             "getmininginfo\n"
             "Returns an object containing mining-related information.");
 
+    boost::shared_ptr<const CChainTip> ptip = GetChainTip();
+
     Object obj, diff;
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blocks",        ptip->nHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
 
-    diff.push_back(Pair("proof-of-work",        GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",        GetTipDifficulty(ptip->pindexLastPoW)));
+    diff.push_back(Pair("proof-of-stake",       GetTipDifficulty(ptip->pindexLastPoS)));
     diff.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
     obj.push_back(Pair("difficulty",    diff));
 
@@ -63,7 +65,11 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("netmhashps",    GetPoWMHashPS()));
     obj.push_back(Pair("netstakeweight",GetPoSKernelPS()));
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
-    obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    {
+        LOCK(mempool.cs);
+        obj.push_back(Pair("pooledtx",      (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("pooledtxusage", mempool.nTotalUsage));
+    }
 
     obj.push_back(Pair("stakeinputs",   (uint64_t)nStakeInputsMapSize));
     obj.push_back(Pair("stakeinterest", (uint64_t)COIN_YEAR_REWARD));
@@ -71,32 +77,46 @@ Value getmininginfo(const Array& params, bool fHelp)
     return obj;
 }
 
-// scaninput '{"txid":"95d640426fe66de866a8cf2d0601d2c8cf3ec598109b4d4ffa7fd03dad6d35ce","difficulty":0.01, "days":10}'
-Value scaninput(const Array& params, bool fHelp)
+Value getstakeminerinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 1)
+    if (fHelp || params.size() != 0)
         throw runtime_error(
-            "scaninput '{\"txid\":\"txid\", \"vout\":[vout1, vout2, ..., voutN], \"difficulty\":difficulty, \"days\":days}'\n"
-            "Scan specified transaction or input for suitable kernel solutions.\n"
-            "    difficulty - upper limit for difficulty, current difficulty by default;\n"
-            "    days - time window, 90 days by default.\n"
-        );
-
-    RPCTypeCheck(params, boost::assign::list_of(obj_type));
-
-    Object scanParams = params[0].get_obj();
-
-    const Value& txid_v = find_value(scanParams, "txid");
-    if (txid_v.type() != str_type)
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing txid key");
-
-    string txid = txid_v.get_str();
-    if (!IsHex(txid))
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected hex txid");
+            "getstakeminerinfo\n"
+            "Returns an object containing stake miner instrumentation:\n"
+            "    hashespersec - kernels hashed per second during the last pass;\n"
+            "    passtime, avgpasstime - wall time of the last and of an average ScanMap pass, ms;\n"
+            "    intervalrequested, intervalcovered - seconds to scan in the last pass and seconds actually scanned;\n"
+            "    overruns - passes which couldn't cover the requested interval;\n"
+            "    filltime - duration of the last inputs map refresh, ms;\n"
+            "    lockwait, totallockwait - time spent waiting for cs_main and cs_wallet, ms.");
+
+    CStakeMinerStats stats = GetStakeMinerStats();
+
+    Object obj;
+    obj.push_back(Pair("stakeinputs",       (uint64_t)nStakeInputsMapSize));
+    obj.push_back(Pair("passes",            (uint64_t)stats.nPasses));
+    obj.push_back(Pair("hashes",            (uint64_t)stats.nHashes));
+    obj.push_back(Pair("hashespersec",      stats.nLastPassTime > 0 ? (double)stats.nLastHashes * 1000000 / stats.nLastPassTime : 0.0));
+    obj.push_back(Pair("avghashespersec",   stats.nScanTime > 0 ? (double)stats.nHashes * 1000000 / stats.nScanTime : 0.0));
+    obj.push_back(Pair("passtime",          (double)stats.nLastPassTime / 1000));
+    obj.push_back(Pair("avgpasstime",       stats.nPasses > 0 ? (double)stats.nScanTime / stats.nPasses / 1000 : 0.0));
+    obj.push_back(Pair("intervalrequested", (uint64_t)stats.nLastIntervalRequested));
+    obj.push_back(Pair("intervalcovered",   (uint64_t)stats.nLastIntervalCovered));
+    obj.push_back(Pair("overruns",          (uint64_t)stats.nOverruns));
+    obj.push_back(Pair("fills",             (uint64_t)stats.nFills));
+    obj.push_back(Pair("updates",           (uint64_t)stats.nUpdates));
+    obj.push_back(Pair("filltime",          (double)stats.nLastFillTime / 1000));
+    obj.push_back(Pair("lockwait",          (double)stats.nLastLockWaitTime / 1000));
+    obj.push_back(Pair("totallockwait",     (double)stats.nLockWaitTime / 1000));
+    obj.push_back(Pair("scanthreads",       nStakeScanThreads));
+    return obj;
+}
 
-    uint256 hash(txid);
-    int32_t nDays = 90;
-    uint32_t nBits = GetNextTargetRequired(pindexBest, true);
+// Difficulty and time window of the kernel scan
+static void ParseScanParams(const Object& scanParams, uint32_t& nBits, int32_t& nDays)
+{
+    nDays = 90;
+    nBits = GetNextTargetRequired(pindexBest, true);
 
     const Value& diff_v = find_value(scanParams, "difficulty");
     if (diff_v.type() == real_type || diff_v.type() == int_type)
@@ -118,7 +138,35 @@ Value scaninput(const Array& params, bool fHelp)
         if (nDays <= 0)
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, interval length must be greater than zero");
     }
+}
+
+// scaninput '{"txid":"95d640426fe66de866a8cf2d0601d2c8cf3ec598109b4d4ffa7fd03dad6d35ce","difficulty":0.01, "days":10}'
+Value scaninput(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "scaninput '{\"txid\":\"txid\", \"vout\":[vout1, vout2, ..., voutN], \"difficulty\":difficulty, \"days\":days}'\n"
+            "Scan specified transaction or input for suitable kernel solutions.\n"
+            "    difficulty - upper limit for difficulty, current difficulty by default;\n"
+            "    days - time window, 90 days by default.\n"
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
 
+    Object scanParams = params[0].get_obj();
+
+    const Value& txid_v = find_value(scanParams, "txid");
+    if (txid_v.type() != str_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing txid key");
+
+    string txid = txid_v.get_str();
+    if (!IsHex(txid))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected hex txid");
+
+    uint256 hash(txid);
+    int32_t nDays;
+    uint32_t nBits;
+    ParseScanParams(scanParams, nBits, nDays);
 
     CTransaction tx;
     uint256 hashBlock = 0;
@@ -164,26 +212,26 @@ Value scaninput(const Array& params, bool fHelp)
 
         CTxDB txdb("r");
 
-        CBlock block;
         CTxIndex txindex;
 
         // Load transaction index item
         if (!txdb.ReadTxIndex(tx.GetHash(), txindex))
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to read block index item");
 
-        // Read block header
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "CBlock::ReadFromDisk() failed");
+        // Find block header
+        const CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        if (!pindexFrom)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block of the transaction not found in the block index");
 
         uint64_t nStakeModifier = 0;
-        if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
+        if (!GetKernelStakeModifier(pindexFrom->GetBlockHash(), nStakeModifier))
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No kernel stake modifier generated yet");
 
         std::pair<uint32_t, uint32_t> interval;
         interval.first = GetTime();
         // Only count coins meeting min age requirement
-        if (nStakeMinAge + block.nTime > interval.first)
-            interval.first += (nStakeMinAge + block.nTime - interval.first);
+        if (nStakeMinAge + pindexFrom->nTime > interval.first)
+            interval.first += (nStakeMinAge + pindexFrom->nTime - interval.first);
         interval.second = interval.first + nDays * nOneDay;
 
         Array results;
@@ -201,7 +249,7 @@ Value scaninput(const Array& params, bool fHelp)
             // Build static part of kernel
             CDataStream ssKernel(SER_GETHASH, 0);
             ssKernel << nStakeModifier;
-            ssKernel << block.nTime << (txindex.pos.nTxPos - txindex.pos.nBlockPos) << tx.nTime << nOut;
+            ssKernel << pindexFrom->nTime << (txindex.pos.nTxPos - txindex.pos.nBlockPos) << tx.nTime << nOut;
             CDataStream::const_iterator itK = ssKernel.begin();
 
             std::vector<std::pair<uint256, uint32_t> > result;
@@ -228,6 +276,156 @@ Value scaninput(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
 }
 
+// scaninputs '{"inputs":[{"txid":"txid", "vout":n}, ...], "difficulty":0.01, "days":30, "threads":4}'
+Value scaninputs(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "scaninputs '{\"inputs\":[{\"txid\":\"txid\", \"vout\":n}, ...], \"difficulty\":difficulty, \"days\":days, \"threads\":threads}'\n"
+            "Scan specified inputs for suitable kernel solutions, inputs are scanned in parallel.\n"
+            "    difficulty - upper limit for difficulty, current difficulty by default;\n"
+            "    days - time window, 90 days by default;\n"
+            "    threads - number of scanning threads, one per core by default, at most " + itostr(MAX_STAKESCAN_THREADS) + ".\n"
+            "Inputs which are unknown, spent or too fresh to have a stake modifier are listed as skipped.\n"
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(obj_type));
+
+    Object scanParams = params[0].get_obj();
+
+    const Value& inputs_v = find_value(scanParams, "inputs");
+    if (inputs_v.type() != array_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing inputs key");
+
+    int32_t nDays;
+    uint32_t nBits;
+    ParseScanParams(scanParams, nBits, nDays);
+
+    unsigned int nThreads = boost::thread::hardware_concurrency();
+    const Value& threads_v = find_value(scanParams, "threads");
+    if (threads_v.type() == int_type)
+    {
+        int nThreadsParam = threads_v.get_int();
+        if (nThreadsParam <= 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, threads number must be greater than zero");
+        nThreads = nThreadsParam;
+    }
+    nThreads = std::max(1U, std::min(nThreads, (unsigned int)MAX_STAKESCAN_THREADS));
+
+    vector<COutPoint> vOutPoints;
+    BOOST_FOREACH(const Value& input, inputs_v.get_array())
+    {
+        if (input.type() != obj_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected object with txid and vout keys");
+
+        const Object& o = input.get_obj();
+
+        const Value& txid_v = find_value(o, "txid");
+        if (txid_v.type() != str_type || !IsHex(txid_v.get_str()))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected hex txid");
+
+        const Value& vout_v = find_value(o, "vout");
+        if (vout_v.type() != int_type || vout_v.get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be a non-negative number");
+
+        vOutPoints.push_back(COutPoint(uint256(txid_v.get_str()), vout_v.get_int()));
+    }
+
+    // Build static parts of the kernels
+    vector<CKernelScanJob> vJobs;
+    Array skipped;
+    {
+        LOCK(cs_main);
+
+        CTxDB txdb("r");
+        uint256 hashLast = 0;
+        CTransaction tx;
+        CTxIndex txindex;
+        const CBlockIndex* pindexFrom = NULL;
+        uint64_t nStakeModifier = 0;
+        string strError;
+
+        BOOST_FOREACH(const COutPoint& prevout, vOutPoints)
+        {
+            // Inputs of the same transaction share the transaction, block and modifier lookups
+            if (prevout.hash != hashLast)
+            {
+                hashLast = prevout.hash;
+                strError.clear();
+
+                if (!txdb.ReadTxIndex(prevout.hash, txindex) || !tx.ReadFromDisk(txindex.pos))
+                    strError = "Unable to find transaction in the blockchain";
+                else if ((pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos)) == NULL)
+                    strError = "Block of the transaction not found in the block index";
+                else if (!GetKernelStakeModifier(pindexFrom->GetBlockHash(), nStakeModifier))
+                    strError = "No kernel stake modifier generated yet";
+            }
+
+            // It doesn't make sense to scan spent or zero value inputs
+            string strOutputError = strError;
+            if (strOutputError.empty())
+            {
+                if (prevout.n >= tx.vout.size())
+                    strOutputError = "Output number is out of range";
+                else if (!txindex.vSpent[prevout.n].IsNull())
+                    strOutputError = "Output is spent";
+                else if (tx.vout[prevout.n].nValue == 0)
+                    strOutputError = "Output has zero value";
+            }
+
+            if (!strOutputError.empty())
+            {
+                Object item;
+                item.push_back(Pair("txid", prevout.hash.GetHex()));
+                item.push_back(Pair("vout", (int)prevout.n));
+                item.push_back(Pair("error", strOutputError));
+                skipped.push_back(item);
+                continue;
+            }
+
+            CKernelScanJob job;
+            job.prevout = prevout;
+            job.nInputTxTime = tx.nTime;
+            job.nValueIn = tx.vout[prevout.n].nValue;
+
+            // Only count coins meeting min age requirement
+            job.interval.first = std::max((uint32_t)GetTime(), nStakeMinAge + pindexFrom->nTime);
+            job.interval.second = job.interval.first + nDays * nOneDay;
+
+            CDataStream ssKernel(SER_GETHASH, 0);
+            ssKernel << nStakeModifier;
+            ssKernel << pindexFrom->nTime << (txindex.pos.nTxPos - txindex.pos.nBlockPos) << tx.nTime << prevout.n;
+            job.kernel.assign(ssKernel.begin(), ssKernel.end());
+
+            vJobs.push_back(job);
+        }
+    }
+
+    if (!vJobs.empty())
+        ScanKernelsForward(vJobs, nBits, nThreads);
+
+    Array results;
+    BOOST_FOREACH(const CKernelScanJob& job, vJobs)
+    {
+        BOOST_FOREACH(const PAIRTYPE(uint256, uint32_t) solution, job.solutions)
+        {
+            Object item;
+            item.push_back(Pair("txid", job.prevout.hash.GetHex()));
+            item.push_back(Pair("nout", (int)job.prevout.n));
+            item.push_back(Pair("hash", solution.first.GetHex()));
+            item.push_back(Pair("time", DateTimeStrFormat(solution.second)));
+
+            results.push_back(item);
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("solutions", results));
+    result.push_back(Pair("skipped", skipped));
+
+    return result;
+}
+
 Value getworkex(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -344,7 +542,11 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nNonce = pdata->nNonce;
 
         if(coinbase.size() == 0)
+        {
+            // An earlier submission may have read in the coinbase, with its hash
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+            pblock->vtx[0].ClearCache();
+        }
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
@@ -461,6 +663,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].ClearCache();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         return CheckWork(pblock, *pwalletMain, reservekey);
@@ -488,9 +691,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass in [params] to wait for the next template\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -503,6 +708,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -514,6 +720,33 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "42 is downloading blocks...");
 
+    // Long poll: the id names the tip and the memory pool state the caller's
+    // template was made for. Wait, without holding any lock, for a new tip,
+    // or for a minute if only the memory pool changed.
+    if (lpval.type() == str_type)
+    {
+        const std::string& strId = lpval.get_str();
+        if (strId.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatched(strId.substr(0, 64));
+        unsigned int nTransactionsUpdatedWatched = atoi(strId.substr(64));
+
+        int64_t nWaitStart = GetTime();
+        uint64_t nSequence = blockNotifyHistory.GetSequence();
+        while (!fShutdown && GetChainTip()->hashBlock == hashWatched)
+        {
+            if (nTransactionsUpdated != nTransactionsUpdatedWatched && GetTime() - nWaitStart >= 60)
+                break;
+            vector<uint256> vHash;
+            bool fMissed;
+            nSequence = blockNotifyHistory.Wait(nSequence, 10000, vHash, fMissed);
+        }
+        if (fShutdown)
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     static CReserveKey reservekey(pwalletMain);
 
     // Update block
@@ -521,6 +754,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
     static CBlockIndex* pindexPrev;
     static int64_t nStart;
     static CBlock* pblock;
+    // The parts which don't change until the next CreateNewBlock, written
+    // once for all the callers
+    static std::string strTransactionsJSON;
+    static std::string strLongPollId;
     if (pindexPrev != pindexBest ||
         (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
@@ -542,87 +779,86 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
+        CJSONWriter transactions;
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        CTxDB txdb("r");
+        transactions.BeginArray();
+        BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    CTxDB txdb("r");
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+            if (tx.IsCoinBase() || tx.IsCoinStake())
+                continue;
 
-        if (tx.IsCoinBase() || tx.IsCoinStake())
-            continue;
+            transactions.BeginObject();
 
-        Object entry;
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            transactions.Key("data").String(HexStr(ssTx.begin(), ssTx.end()));
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            transactions.Key("hash").String(txHash.GetHex());
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            MapPrevTx mapInputs;
+            map<uint256, CTxIndex> mapUnused;
+            bool fInvalid = false;
+            if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            {
+                transactions.Key("fee").Int(tx.GetValueIn(mapInputs) - tx.GetValueOut());
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            entry.push_back(Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
+                transactions.Key("depends").BeginArray();
+                BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+                {
+                    if (setTxIndex.count(inp.first))
+                        transactions.Int(setTxIndex[inp.first]);
+                }
+                transactions.EndArray();
 
-            Array deps;
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
-            {
-                if (setTxIndex.count(inp.first))
-                    deps.push_back(setTxIndex[inp.first]);
+                int64_t nSigOps = tx.GetLegacySigOpCount();
+                nSigOps += tx.GetP2SHSigOpCount(mapInputs);
+                transactions.Key("sigops").Int(nSigOps);
             }
-            entry.push_back(Pair("depends", deps));
 
-            int64_t nSigOps = tx.GetLegacySigOpCount();
-            nSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            entry.push_back(Pair("sigops", nSigOps));
+            transactions.EndObject();
         }
+        transactions.EndArray();
+        strTransactionsJSON = transactions.str();
+        strLongPollId = pindexPrevNew->GetBlockHash().GetHex() + strprintf("%u", nTransactionsUpdatedLast);
 
-        transactions.push_back(entry);
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrev = pindexPrevNew;
     }
 
-    Object aux;
-    aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
+    // Update nTime
+    pblock->UpdateTime(pindexPrev);
+    pblock->nNonce = 0;
 
     uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
-    }
-
-    Object result;
-    result.push_back(Pair("version", pblock->nVersion));
-    result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
-    result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
-    result.push_back(Pair("target", hashTarget.GetHex()));
-    result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
-    result.push_back(Pair("mutable", aMutable));
-    result.push_back(Pair("noncerange", "00000000ffffffff"));
-    result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
-    result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", (int64_t)pblock->nTime));
-    result.push_back(Pair("bits", HexBits(pblock->nBits)));
-    result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
-
-    return result;
+    CJSONWriter result;
+    result.reserve(strTransactionsJSON.size() + 1024);
+    result.BeginObject();
+    result.Key("version").Int(pblock->nVersion);
+    result.Key("previousblockhash").String(pblock->hashPrevBlock.GetHex());
+    result.Key("transactions").Raw(strTransactionsJSON);
+    result.Key("coinbaseaux").BeginObject();
+    result.Key("flags").String(HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end()));
+    result.EndObject();
+    result.Key("coinbasevalue").Int(pblock->vtx[0].vout[0].nValue);
+    result.Key("longpollid").String(strLongPollId);
+    result.Key("target").String(hashTarget.GetHex());
+    result.Key("mintime").Int(pindexPrev->GetMedianTimePast()+1);
+    result.Key("mutable").BeginArray().String("time").String("transactions").String("prevblock").EndArray();
+    result.Key("noncerange").String("00000000ffffffff");
+    result.Key("sigoplimit").Int(MAX_BLOCK_SIGOPS);
+    result.Key("sizelimit").Int(MAX_BLOCK_SIZE);
+    result.Key("curtime").Int(pblock->nTime);
+    result.Key("bits").String(HexBits(pblock->nBits));
+    result.Key("height").Int(pindexPrev->nHeight+1);
+    result.EndObject();
+
+    return RawJSON(result);
 }
 
 Value submitblock(const Array& params, bool fHelp)
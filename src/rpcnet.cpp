@@ -128,8 +128,25 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        if (stats.nPingUsec > 0)
+            obj.push_back(Pair("pingtime", stats.nPingUsec / 1e6));
+        if (stats.nMinPingUsec > 0)
+            obj.push_back(Pair("minping", stats.nMinPingUsec / 1e6));
+        if (stats.nPingWaitUsec > 0)
+            obj.push_back(Pair("pingwait", stats.nPingWaitUsec / 1e6));
+        obj.push_back(Pair("blocksinflight", stats.nBlocksInFlight));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
+        if (stats.fCompressSend)
+            obj.push_back(Pair("compressed", true));
+
+        Object objSent, objRecv;
+        BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, stats.mapSendTraffic)
+            objSent.push_back(Pair(item.first, (int64_t)item.second.nBytes));
+        BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, stats.mapRecvTraffic)
+            objRecv.push_back(Pair(item.first, (int64_t)item.second.nBytes));
+        obj.push_back(Pair("bytessent_per_msg", objSent));
+        obj.push_back(Pair("bytesrecv_per_msg", objRecv));
         ret.push_back(obj);
     }
 
@@ -344,9 +361,72 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", static_cast<uint64_t>(CNode::GetTotalBytesRecv())));
     obj.push_back(Pair("totalbytessent", static_cast<uint64_t>(CNode::GetTotalBytesSent())));
     obj.push_back(Pair("timemillis", static_cast<int64_t>(GetTimeMillis())));
+
+    Object objTarget;
+    objTarget.push_back(Pair("timeframe", UPLOAD_TARGET_CYCLE));
+    objTarget.push_back(Pair("target", (int64_t)CNode::GetMaxOutboundTarget()));
+    objTarget.push_back(Pair("target_reached", CNode::OutboundTargetReached()));
+    objTarget.push_back(Pair("bytes_left_in_cycle", (int64_t)CNode::GetOutboundTargetBytesLeft()));
+    objTarget.push_back(Pair("time_left_in_cycle", CNode::GetOutboundCycleTimeLeft()));
+    obj.push_back(Pair("uploadtarget", objTarget));
     return obj;
 }
 
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "Returns, for each message command since startup, the messages and bytes\n"
+            "sent and received, and how long the received ones took to process.\n"
+            "\"processtimes\" counts messages taken under 0.1ms, 1ms, 10ms, 100ms, 1s, and longer.\n"
+            "\"mainwaitms\" and \"mainheldms\" are the time spent waiting for and holding cs_main\n"
+            "by the messages handled under it as a whole.");
+
+    MessageTrafficMap mapSent, mapRecv;
+    ProcessTimeMap mapTimes;
+    GetMessageStats(mapSent, mapRecv, mapTimes);
+
+    set<string> setCommands;
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, mapSent)
+        setCommands.insert(item.first);
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, mapRecv)
+        setCommands.insert(item.first);
+
+    Object ret;
+    BOOST_FOREACH(const string& strCommand, setCommands)
+    {
+        Object obj;
+        const CMessageTraffic& sent = mapSent[strCommand];
+        const CMessageTraffic& recv = mapRecv[strCommand];
+        obj.push_back(Pair("msgssent", (int64_t)sent.nMessages));
+        obj.push_back(Pair("bytessent", (int64_t)sent.nBytes));
+        obj.push_back(Pair("msgsrecv", (int64_t)recv.nMessages));
+        obj.push_back(Pair("bytesrecv", (int64_t)recv.nBytes));
+
+        ProcessTimeMap::iterator mi = mapTimes.find(strCommand);
+        if (mi != mapTimes.end() && mi->second.nMessages > 0)
+        {
+            const CProcessTime& times = mi->second;
+            obj.push_back(Pair("processms", times.nTotalUsec / 1000.0));
+            obj.push_back(Pair("avgprocessms", times.nTotalUsec / 1000.0 / times.nMessages));
+            obj.push_back(Pair("maxprocessms", times.nMaxUsec / 1000.0));
+            if (times.nMainHeldUsec > 0)
+            {
+                obj.push_back(Pair("mainwaitms", times.nMainWaitUsec / 1000.0));
+                obj.push_back(Pair("mainheldms", times.nMainHeldUsec / 1000.0));
+                obj.push_back(Pair("maxmainheldms", times.nMaxMainHeldUsec / 1000.0));
+            }
+            Array arrBuckets;
+            for (int i = 0; i < CProcessTime::BUCKETS; i++)
+                arrBuckets.push_back((int64_t)times.vBuckets[i]);
+            obj.push_back(Pair("processtimes", arrBuckets));
+        }
+        ret.push_back(Pair(strCommand, obj));
+    }
+    return ret;
+}
+
 /*
 05:53:45 ntptime
 05:53:48
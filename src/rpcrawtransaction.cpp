@@ -18,111 +18,133 @@ using namespace boost;
 using namespace boost::assign;
 using namespace json_spirit;
 
-void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
+// Write the members of scriptPubKey's object, which the caller opens
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, CJSONWriter& writer, bool fIncludeHex)
 {
     txnouttype type;
     vector<CTxDestination> addresses;
     int nRequired;
 
-    out.push_back(Pair("asm", scriptPubKey.ToString()));
+    writer.Key("asm").String(scriptPubKey.ToString());
 
     if (fIncludeHex)
-        out.push_back(Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end())));
+        writer.Key("hex").String(HexStr(scriptPubKey.begin(), scriptPubKey.end()));
 
     if (!ExtractDestinations(scriptPubKey, type, addresses, nRequired))
     {
-        out.push_back(Pair("type", GetTxnOutputType(TX_NONSTANDARD)));
+        writer.Key("type").String(GetTxnOutputType(TX_NONSTANDARD));
         return;
     }
 
     if (type != TX_NULL_DATA)
     {
-        out.push_back(Pair("reqSigs", nRequired));
-        out.push_back(Pair("type", GetTxnOutputType(type)));
+        writer.Key("reqSigs").Int(nRequired);
+        writer.Key("type").String(GetTxnOutputType(type));
 
         if (type == TX_PUBKEY_DROP)
         {
             vector<valtype> vSolutions;
             Solver(scriptPubKey, type, vSolutions);
-            out.push_back(Pair("keyVariant", HexStr(vSolutions[0])));
-            out.push_back(Pair("R", HexStr(vSolutions[1])));
+            writer.Key("keyVariant").String(HexStr(vSolutions[0]));
+            writer.Key("R").String(HexStr(vSolutions[1]));
 
             CMalleableKeyView view;
-            if (pwalletMain->CheckOwnership(CPubKey(vSolutions[0]), CPubKey(vSolutions[1]), view))
-                out.push_back(Pair("pubkeyPair", CBitcoinAddress(view.GetMalleablePubKey()).ToString()));
+            if (GetRPCWallet()->CheckOwnership(CPubKey(vSolutions[0]), CPubKey(vSolutions[1]), view))
+                writer.Key("pubkeyPair").String(CBitcoinAddress(view.GetMalleablePubKey()).ToString());
         }
         else
         {
-            Array a;
+            writer.Key("addresses").BeginArray();
             BOOST_FOREACH(const CTxDestination& addr, addresses)
-                a.push_back(CBitcoinAddress(addr).ToString());
-            out.push_back(Pair("addresses", a));
+                writer.String(CBitcoinAddress(addr).ToString());
+            writer.EndArray();
         }
     }
     else
     {
-        out.push_back(Pair("type", GetTxnOutputType(type)));
+        writer.Key("type").String(GetTxnOutputType(type));
     }
 }
 
-void TxToJSON(const CTransaction& tx, const uint256& hashBlock, Object& entry)
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-    entry.push_back(Pair("version", tx.nVersion));
-    entry.push_back(Pair("time", (int64_t)tx.nTime));
-    entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
-    Array vin;
+    CJSONWriter writer;
+    writer.BeginObject();
+    ScriptPubKeyToJSON(scriptPubKey, writer, fIncludeHex);
+    writer.EndObject();
+    AppendJSON(out, writer);
+}
+
+// Write the members of tx's object, which the caller opens. With a nonzero
+// hashBlock the confirmations come from the block index, so the caller must
+// hold cs_main; without one nothing outside tx is read.
+void TxToJSON(const CTransaction& tx, const uint256& hashBlock, CJSONWriter& writer)
+{
+    writer.Key("txid").String(tx.GetHash().GetHex());
+    writer.Key("version").Int(tx.nVersion);
+    writer.Key("time").Int(tx.nTime);
+    writer.Key("locktime").Int(tx.nLockTime);
+    writer.Key("vin").BeginArray();
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        Object in;
+        writer.BeginObject();
         if (tx.IsCoinBase())
-            in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
+            writer.Key("coinbase").String(HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
         else
         {
-            in.push_back(Pair("txid", txin.prevout.hash.GetHex()));
-            in.push_back(Pair("vout", (int64_t)txin.prevout.n));
-            Object o;
-            o.push_back(Pair("asm", txin.scriptSig.ToString()));
-            o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
-            in.push_back(Pair("scriptSig", o));
+            writer.Key("txid").String(txin.prevout.hash.GetHex());
+            writer.Key("vout").Int(txin.prevout.n);
+            writer.Key("scriptSig").BeginObject();
+            writer.Key("asm").String(txin.scriptSig.ToString());
+            writer.Key("hex").String(HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+            writer.EndObject();
         }
-        in.push_back(Pair("sequence", (int64_t)txin.nSequence));
-        vin.push_back(in);
+        writer.Key("sequence").Int(txin.nSequence);
+        writer.EndObject();
     }
-    entry.push_back(Pair("vin", vin));
-    Array vout;
+    writer.EndArray();
+    writer.Key("vout").BeginArray();
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
         const CTxOut& txout = tx.vout[i];
-        Object out;
-        out.push_back(Pair("value", ValueFromAmount(txout.nValue)));
-        out.push_back(Pair("n", (int64_t)i));
-        Object o;
-        ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
-        out.push_back(Pair("scriptPubKey", o));
-        vout.push_back(out);
+        writer.BeginObject();
+        writer.Key("value").Real(ValueFromAmount(txout.nValue).get_real());
+        writer.Key("n").Int(i);
+        writer.Key("scriptPubKey").BeginObject();
+        ScriptPubKeyToJSON(txout.scriptPubKey, writer, true);
+        writer.EndObject();
+        writer.EndObject();
     }
-    entry.push_back(Pair("vout", vout));
+    writer.EndArray();
 
     if (hashBlock != 0)
     {
-        entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        writer.Key("blockhash").String(hashBlock.GetHex());
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
             if (pindex->IsInMainChain())
             {
-                entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
-                entry.push_back(Pair("time", (int64_t)pindex->nTime));
-                entry.push_back(Pair("blocktime", (int64_t)pindex->nTime));
+                writer.Key("confirmations").Int(1 + nBestHeight - pindex->nHeight);
+                writer.Key("time").Int(pindex->nTime);
+                writer.Key("blocktime").Int(pindex->nTime);
             }
             else
-                entry.push_back(Pair("confirmations", 0));
+                writer.Key("confirmations").Int(0);
         }
     }
 }
 
+void TxToJSON(const CTransaction& tx, const uint256& hashBlock, Object& entry)
+{
+    CJSONWriter writer;
+    writer.BeginObject();
+    TxToJSON(tx, hashBlock, writer);
+    writer.EndObject();
+    AppendJSON(entry, writer);
+}
+
 Value getrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -152,24 +174,114 @@ Value getrawtransaction(const Array& params, bool fHelp)
     if (!fVerbose)
         return strHex;
 
+    CJSONWriter writer;
+    writer.BeginObject();
+    writer.Key("hex").String(strHex);
+    TxToJSON(tx, hashBlock, writer);
+    writer.EndObject();
+    return RawJSON(writer);
+}
+
+static bool CompareHeightTx(const pair<uint256, int>& a, const pair<uint256, int>& b)
+{
+    if (a.second != b.second)
+        return a.second < b.second;
+    return a.first < b.first;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids <address>\n"
+            "Returns the transactions of the best chain paying to or\n"
+            "spending from <address>, oldest first, as an array of\n"
+            "{txid, height} Objects. Requires -addrindex.");
+
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "The address index is disabled, restart with -addrindex");
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid 42 address");
+
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(address.Get());
+    CAddrIndexKey key;
+    if (!key.SetDestination(scriptPubKey))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address is not indexed");
+
+    vector<pair<uint256, int> > vTxs;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        if (!txdb.ReadAddrIndex(key.nAddrType, key.hashAddr, vTxs))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+    }
+    sort(vTxs.begin(), vTxs.end(), CompareHeightTx);
+
+    Array result;
+    for (unsigned int i = 0; i < vTxs.size(); i++)
+    {
+        Object entry;
+        entry.push_back(Pair("txid", vTxs[i].first.GetHex()));
+        entry.push_back(Pair("height", vTxs[i].second));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <n>\n"
+            "Returns the input of the best chain spending output <n> of <txid>\n"
+            "as an Object {txid, vin, height}. Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "The spent output index is disabled, restart with -spentindex");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    int nOut = params[1].get_int();
+    if (nOut < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be positive");
+
+    CSpentIndexValue value;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        if (!txdb.ReadSpentIndex(COutPoint(hash, nOut), value))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Output is unspent or unknown");
+    }
+
     Object result;
-    result.push_back(Pair("hex", strHex));
-    TxToJSON(tx, hashBlock, result);
+    result.push_back(Pair("txid", value.hashTx.GetHex()));
+    result.push_back(Pair("vin", (int)value.nIn));
+    result.push_back(Pair("height", value.nHeight));
     return result;
 }
 
 Value listunspent(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 3)
+    if (fHelp || params.size() > 4)
         throw runtime_error(
-            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
+            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...] [options]\n"
             "Returns array of unspent transaction outputs\n"
             "with between minconf and maxconf (inclusive) confirmations.\n"
             "Optionally filtered to only include txouts paid to specified addresses.\n"
+            "options is an object which may have:\n"
+            "  \"minimumAmount\" : only outputs of at least this value\n"
+            "  \"maximumAmount\" : only outputs of at most this value\n"
+            "  \"limit\" : at most this many outputs\n"
+            "  \"cursor\" : \"txid:vout\" of the last output of the previous page\n"
+            "Outputs come in block order, so a limited call is continued\n"
+            "by passing its last output as the cursor of the next.\n"
             "Results are an array of Objects, each of which has:\n"
             "{txid, vout, scriptPubKey, amount, confirmations}");
 
-    RPCTypeCheck(params, list_of(int_type)(int_type)(array_type));
+    RPCTypeCheck(params, list_of(int_type)(int_type)(array_type)(obj_type));
 
     int nMinDepth = 1;
     if (params.size() > 0)
@@ -179,7 +291,7 @@ Value listunspent(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMaxDepth = params[1].get_int();
 
-    set<CBitcoinAddress> setAddress;
+    set<CTxDestination> setAddress;
     if (params.size() > 2)
     {
         Array inputs = params[2].get_array();
@@ -188,30 +300,55 @@ Value listunspent(const Array& params, bool fHelp)
             CBitcoinAddress address(input.get_str());
             if (!address.IsValid())
                 throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid 42 address: ")+input.get_str());
-            if (setAddress.count(address))
+            if (setAddress.count(address.Get()))
                 throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ")+input.get_str());
-           setAddress.insert(address);
+           setAddress.insert(address.Get());
         }
     }
 
-    Array results;
-    vector<COutput> vecOutputs;
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs)
+    int64_t nMinValue = 0;
+    int64_t nMaxValue = MAX_MONEY;
+    unsigned int nLimit = 0;
+    COutPoint cursor;
+    bool fCursor = false;
+    if (params.size() > 3)
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
-
-        if(setAddress.size())
+        const Object& options = params[3].get_obj();
+        RPCTypeCheck(options, map_list_of("limit", int_type)("cursor", str_type), true);
+
+        const Value& minValue = find_value(options, "minimumAmount");
+        if (minValue.type() != null_type)
+            nMinValue = AmountFromValue(minValue);
+        const Value& maxValue = find_value(options, "maximumAmount");
+        if (maxValue.type() != null_type)
+            nMaxValue = AmountFromValue(maxValue);
+
+        const Value& limitValue = find_value(options, "limit");
+        if (limitValue.type() != null_type)
         {
-            CTxDestination address;
-            if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-                continue;
+            if (limitValue.get_int() < 0)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, negative limit");
+            nLimit = limitValue.get_int();
+        }
 
-            if (!setAddress.count(address))
-                continue;
+        const Value& cursorValue = find_value(options, "cursor");
+        if (cursorValue.type() != null_type)
+        {
+            const string& strCursor = cursorValue.get_str();
+            size_t nColon = strCursor.find(':');
+            if (nColon != 64 || !IsHex(strCursor.substr(0, 64)) || strCursor.size() == 65)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, cursor must be txid:vout");
+            cursor = COutPoint(uint256(strCursor.substr(0, 64)), atoi(strCursor.substr(65)));
+            fCursor = true;
         }
+    }
 
+    Array results;
+    vector<COutput> vecOutputs;
+    if (!GetRPCWallet()->ListUnspentCoins(vecOutputs, nMinDepth, nMaxDepth, setAddress, nMinValue, nMaxValue, fCursor ? &cursor : NULL, nLimit))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, cursor transaction is not in the wallet");
+    BOOST_FOREACH(const COutput& out, vecOutputs)
+    {
         int64_t nValue = out.tx->vout[out.i].nValue;
         const CScript& pk = out.tx->vout[out.i].scriptPubKey;
         Object entry;
@@ -221,8 +358,8 @@ Value listunspent(const Array& params, bool fHelp)
         if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
         {
             entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+            if (GetRPCWallet()->mapAddressBook.count(address))
+                entry.push_back(Pair("account", GetRPCWallet()->mapAddressBook[address]));
         }
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
         if (pk.IsPayToScriptHash())
@@ -232,7 +369,7 @@ Value listunspent(const Array& params, bool fHelp)
             {
                 const CScriptID& hash = boost::get<CScriptID>(address);
                 CScript redeemScript;
-                if (pwalletMain->GetCScript(hash, redeemScript))
+                if (GetRPCWallet()->GetCScript(hash, redeemScript))
                     entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
             }
         }
@@ -348,10 +485,12 @@ Value decoderawtransaction(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
     }
 
-    Object result;
-    TxToJSON(tx, 0, result);
+    CJSONWriter writer;
+    writer.BeginObject();
+    TxToJSON(tx, 0, writer);
+    writer.EndObject();
 
-    return result;
+    return RawJSON(writer);
 }
 
 Value decodescript(const Array& params, bool fHelp)
@@ -417,6 +556,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
     // mergedTx will end up with all the signatures; it
     // starts as a clone of the rawtx:
     CTransaction mergedTx(txVariants[0]);
+    mergedTx.ClearCache();
     bool fComplete = true;
 
     // Fetch previous transactions (inputs):
@@ -525,7 +665,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
         }
     }
 
-    const CKeyStore& keystore = (fGivenKeys ? tempKeystore : *pwalletMain);
+    const CKeyStore& keystore = (fGivenKeys ? tempKeystore : *GetRPCWallet());
 
     int nHashType = SIGHASH_ALL;
     if (params.size() > 3 && params[3].type() != null_type)
@@ -569,6 +709,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
+        mergedTx.ClearCache();
         if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, STRICT_FLAGS, 0))
             fComplete = false;
     }
@@ -607,25 +748,26 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 
     // See if the transaction is already in a block
     // or in the memory pool:
-    CTransaction existingTx;
-    uint256 hashBlock = 0;
-    if (GetTransaction(hashTx, existingTx, hashBlock))
-    {
-        if (hashBlock != 0)
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("transaction already in block ")+hashBlock.GetHex());
-        // Not in block, but already in the memory pool; will drop
-        // through to re-relay it.
-    }
-    else
     {
-        // push to local node
-        CTxDB txdb("r");
-        if (!tx.AcceptToMemoryPool(txdb))
-            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX rejected");
+        LOCK(cs_main);
+        CTransaction existingTx;
+        uint256 hashBlock = 0;
+        if (GetTransaction(hashTx, existingTx, hashBlock))
+        {
+            if (hashBlock != 0)
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("transaction already in block ")+hashBlock.GetHex());
 
-        SyncWithWallets(tx, NULL, true);
+            // Not in block, but already in the memory pool; re-relay it
+            RelayTransaction(tx, hashTx);
+            return hashTx.GetHex();
+        }
     }
-    RelayTransaction(tx, hashTx);
+
+    // push to local node, batched with the other submissions; it is synced
+    // with the wallets and relayed once accepted
+    CTxSubmitResult result = SubmitTransactionAndWait(tx);
+    if (!result.fAccepted)
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, result.fMissingInputs ? "TX rejected, missing inputs" : "TX rejected");
 
     return hashTx.GetHex();
 }
@@ -667,7 +809,7 @@ Value createmultisig(const Array& params, bool fHelp)
                 throw runtime_error(
                     strprintf("%s does not refer to a key",ks.c_str()));
             CPubKey vchPubKey;
-            if (!pwalletMain->GetPubKey(keyID, vchPubKey))
+            if (!GetRPCWallet()->GetPubKey(keyID, vchPubKey))
                 throw runtime_error(
                     strprintf("no full public key for address %s",ks.c_str()));
             if (!vchPubKey.IsFullyValid())
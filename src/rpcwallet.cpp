@@ -4,17 +4,22 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "walletnotify.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
 #include "init.h"
 #include "util.h"
 #include "ntp.h"
 #include "base58.h"
+#include "scheduler.h"
+
+#include <boost/bind.hpp>
 
 using namespace json_spirit;
 using namespace std;
 
-int64_t nWalletUnlockTime;
+// When each unlocked wallet is to be locked again, in milliseconds
+static map<CWallet*, int64_t> mapWalletUnlockTime;
 static CCriticalSection cs_nWalletUnlockTime;
 
 extern int64_t nReserveBalance;
@@ -22,14 +27,14 @@ extern void TxToJSON(const CTransaction& tx, const uint256& hashBlock, json_spir
 
 std::string HelpRequiringPassphrase()
 {
-    return pwalletMain->IsCrypted()
+    return GetRPCWallet()->IsCrypted()
         ? "\n\nRequires wallet passphrase to be set with walletpassphrase first"
         : "";
 }
 
 void EnsureWalletIsUnlocked()
 {
-    if (pwalletMain->IsLocked())
+    if (GetRPCWallet()->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
     if (fWalletUnlockMintOnly)
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Wallet unlocked for block minting only.");
@@ -45,7 +50,7 @@ void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
     {
         entry.push_back(Pair("blockhash", wtx.hashBlock.GetHex()));
         entry.push_back(Pair("blockindex", wtx.nIndex));
-        entry.push_back(Pair("blocktime", (int64_t)(mapBlockIndex[wtx.hashBlock]->nTime)));
+        entry.push_back(Pair("blocktime", (int64_t)(LookupBlockIndex(wtx.hashBlock)->nTime)));
     }
     entry.push_back(Pair("txid", wtx.GetHash().GetHex()));
     entry.push_back(Pair("time", (int64_t)wtx.GetTxTime()));
@@ -72,15 +77,29 @@ Value getinfo(const Array& params, bool fHelp)
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
 
+    // Chain state comes from the tip snapshot and the wallet takes only
+    // cs_wallet, so this doesn't wait on block connection
+    boost::shared_ptr<const CChainTip> ptip = GetChainTip();
+    CWalletBalances balances;
+    GetRPCWallet()->GetBalances(balances);
+
     Object obj, diff, timestamping;
     obj.push_back(Pair("version",       FormatFullVersion()));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
-    obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
-    obj.push_back(Pair("unspendable",       ValueFromAmount(pwalletMain->GetWatchOnlyBalance())));
-    obj.push_back(Pair("newmint",       ValueFromAmount(pwalletMain->GetNewMint())));
-    obj.push_back(Pair("stake",         ValueFromAmount(pwalletMain->GetStake())));
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("walletversion", GetRPCWallet()->GetVersion()));
+    obj.push_back(Pair("balance",       ValueFromAmount(balances.nBalance)));
+    obj.push_back(Pair("unspendable",       ValueFromAmount(balances.nWatchOnlyBalance)));
+    obj.push_back(Pair("newmint",       ValueFromAmount(balances.nNewMint)));
+    obj.push_back(Pair("stake",         ValueFromAmount(balances.nStake)));
+    obj.push_back(Pair("blocks",        ptip->nHeight));
+    if (hashAssumeValid != 0)
+    {
+        Object assumevalid;
+        assumevalid.push_back(Pair("hash",    hashAssumeValid.GetHex()));
+        assumevalid.push_back(Pair("height",  nAssumeValidHeight));
+        assumevalid.push_back(Pair("skipped", nAssumeValidSkipped));
+        obj.push_back(Pair("assumevalid", assumevalid));
+    }
 
     timestamping.push_back(Pair("systemclock", GetTime()));
     timestamping.push_back(Pair("adjustedtime", GetAdjustedTime()));
@@ -93,22 +112,28 @@ Value getinfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("timestamping", timestamping));
 
-    obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
+    obj.push_back(Pair("moneysupply",   ValueFromAmount(ptip->nMoneySupply)));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.IsValid() ? proxy.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            addrSeenByPeer.ToStringIP()));
 
-    diff.push_back(Pair("proof-of-work",  GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",  GetTipDifficulty(ptip->pindexLastPoW)));
+    diff.push_back(Pair("proof-of-stake", GetTipDifficulty(ptip->pindexLastPoS)));
     obj.push_back(Pair("difficulty",    diff));
 
     obj.push_back(Pair("testnet",       fTestNet));
-    obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
-    obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+    {
+        LOCK(GetRPCWallet()->cs_wallet);
+        obj.push_back(Pair("keypoololdest", (int64_t)GetRPCWallet()->GetOldestKeyPoolTime()));
+        obj.push_back(Pair("keypoolsize",   (int)GetRPCWallet()->GetKeyPoolSize()));
+    }
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
-    if (pwalletMain->IsCrypted())
-        obj.push_back(Pair("unlocked_until", (int64_t)nWalletUnlockTime / 1000));
+    if (GetRPCWallet()->IsCrypted())
+    {
+        LOCK(cs_nWalletUnlockTime);
+        obj.push_back(Pair("unlocked_until", mapWalletUnlockTime[GetRPCWallet()] / 1000));
+    }
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     return obj;
 }
@@ -127,16 +152,16 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    if (!GetRPCWallet()->IsLocked())
+        GetRPCWallet()->TopUpKeyPool();
 
     // Generate a new key that is added to wallet
     CPubKey newKey;
-    if (!pwalletMain->GetKeyFromPool(newKey, false))
+    if (!GetRPCWallet()->GetKeyFromPool(newKey, false))
         throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
     CBitcoinAddress address(newKey.GetID());
 
-    pwalletMain->SetAddressBookName(address, strAccount);
+    GetRPCWallet()->SetAddressBookName(address, strAccount);
 
     return address.ToString();
 }
@@ -144,7 +169,7 @@ Value getnewaddress(const Array& params, bool fHelp)
 
 CBitcoinAddress GetAccountAddress(string strAccount, bool bForceNew=false)
 {
-    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletDB walletdb(GetRPCWallet()->strWalletFile);
 
     CAccount account;
     walletdb.ReadAccount(strAccount, account);
@@ -156,11 +181,12 @@ CBitcoinAddress GetAccountAddress(string strAccount, bool bForceNew=false)
     {
         CScript scriptPubKey;
         scriptPubKey.SetDestination(account.vchPubKey.GetID());
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin();
-             it != pwalletMain->mapWallet.end() && account.vchPubKey.IsValid();
-             ++it)
+        vector<const CWalletTx*> vTx;
+        list<CWalletTx> listArchived;
+        GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+        BOOST_FOREACH(const CWalletTx* pwtx, vTx)
         {
-            const CWalletTx& wtx = (*it).second;
+            const CWalletTx& wtx = *pwtx;
             BOOST_FOREACH(const CTxOut& txout, wtx.vout)
                 if (txout.scriptPubKey == scriptPubKey)
                     bKeyUsed = true;
@@ -170,10 +196,10 @@ CBitcoinAddress GetAccountAddress(string strAccount, bool bForceNew=false)
     // Generate a new key
     if (!account.vchPubKey.IsValid() || bForceNew || bKeyUsed)
     {
-        if (!pwalletMain->GetKeyFromPool(account.vchPubKey, false))
+        if (!GetRPCWallet()->GetKeyFromPool(account.vchPubKey, false))
             throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
 
-        pwalletMain->SetAddressBookName(account.vchPubKey.GetID(), strAccount);
+        GetRPCWallet()->SetAddressBookName(account.vchPubKey.GetID(), strAccount);
         walletdb.WriteAccount(strAccount, account);
     }
 
@@ -216,14 +242,14 @@ Value setaccount(const Array& params, bool fHelp)
         strAccount = AccountFromValue(params[1]);
 
     // Detect when changing the account of an address that is the 'unused current key' of another account:
-    if (pwalletMain->mapAddressBook.count(address))
+    if (GetRPCWallet()->mapAddressBook.count(address))
     {
-        string strOldAccount = pwalletMain->mapAddressBook[address];
+        string strOldAccount = GetRPCWallet()->mapAddressBook[address];
         if (address == GetAccountAddress(strOldAccount))
             GetAccountAddress(strOldAccount, true);
     }
 
-    pwalletMain->SetAddressBookName(address, strAccount);
+    GetRPCWallet()->SetAddressBookName(address, strAccount);
 
     return Value::null;
 }
@@ -241,8 +267,8 @@ Value getaccount(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid 42 address");
 
     string strAccount;
-    map<CBitcoinAddress, string>::iterator mi = pwalletMain->mapAddressBook.find(address);
-    if (mi != pwalletMain->mapAddressBook.end() && !(*mi).second.empty())
+    map<CBitcoinAddress, string>::iterator mi = GetRPCWallet()->mapAddressBook.find(address);
+    if (mi != GetRPCWallet()->mapAddressBook.end() && !(*mi).second.empty())
         strAccount = (*mi).second;
     return strAccount;
 }
@@ -259,7 +285,7 @@ Value getaddressesbyaccount(const Array& params, bool fHelp)
 
     // Find all addresses that have the given account
     Array ret;
-    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, pwalletMain->mapAddressBook)
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, GetRPCWallet()->mapAddressBook)
     {
         const CBitcoinAddress& address = item.first;
         const string& strName = item.second;
@@ -269,6 +295,28 @@ Value getaddressesbyaccount(const Array& params, bool fHelp)
     return ret;
 }
 
+static Object MergeStatusToJSON(const CMergeStatus& status)
+{
+    Object result;
+    Array mergedHashes;
+    BOOST_FOREACH(const uint256& txHash, status.listMerged)
+        mergedHashes.push_back(txHash.GetHex());
+
+    result.push_back(Pair("running", status.fRunning));
+    result.push_back(Pair("amount", ValueFromAmount(status.nAmount)));
+    result.push_back(Pair("minvalue", ValueFromAmount(status.nMinValue)));
+    result.push_back(Pair("outputvalue", ValueFromAmount(status.nOutputValue)));
+    result.push_back(Pair("started", status.nTimeStarted));
+    if (!status.fRunning)
+        result.push_back(Pair("finished", status.nTimeFinished));
+    result.push_back(Pair("planned", status.nPlanned));
+    result.push_back(Pair("committed", (int)status.listMerged.size()));
+    result.push_back(Pair("merged", mergedHashes));
+    if (!status.strError.empty())
+        result.push_back(Pair("error", status.strError));
+    return result;
+}
+
 Value mergecoins(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 3)
@@ -277,10 +325,11 @@ Value mergecoins(const Array& params, bool fHelp)
             "<amount> is resulting inputs sum\n"
             "<minvalue> is minimum value of inputs which are used in join process\n"
             "<outputvalue> is resulting value of inputs which will be created\n"
-            "All values are real and and rounded to the nearest " + FormatMoney(nMinimumInputValue)
+            "All values are real and and rounded to the nearest " + FormatMoney(nMinimumInputValue) + "\n"
+            "Merging runs in the background, use getmergestatus to follow it"
             + HelpRequiringPassphrase());
 
-    if (pwalletMain->IsLocked())
+    if (GetRPCWallet()->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
     // Total amount
@@ -304,15 +353,21 @@ Value mergecoins(const Array& params, bool fHelp)
     if (nOutputValue < nMinValue)
         throw JSONRPCError(-101, "Output value is lower than min value");
 
-    list<uint256> listMerged;
-    if (!pwalletMain->MergeCoins(nAmount, nMinValue, nOutputValue, listMerged))
-        return Value::null;
+    string strError;
+    if (!GetRPCWallet()->StartMergeCoins(nAmount, nMinValue, nOutputValue, strError))
+        throw JSONRPCError(RPC_WALLET_ERROR, strError);
 
-    Array mergedHashes;
-    BOOST_FOREACH(const uint256 txHash, listMerged)
-        mergedHashes.push_back(txHash.GetHex());
+    return MergeStatusToJSON(GetRPCWallet()->GetMergeStatus());
+}
 
-    return mergedHashes;
+Value getmergestatus(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmergestatus\n"
+            "Returns the progress of the last mergecoins job");
+
+    return MergeStatusToJSON(GetRPCWallet()->GetMergeStatus());
 }
 
 Value sendtoaddress(const Array& params, bool fHelp)
@@ -346,10 +401,10 @@ Value sendtoaddress(const Array& params, bool fHelp)
     if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
         wtx.mapValue["to"]      = params[3].get_str();
 
-    if (pwalletMain->IsLocked())
+    if (GetRPCWallet()->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
-    string strError = pwalletMain->SendMoney(scriptPubKey, nAmount, wtx);
+    string strError = GetRPCWallet()->SendMoney(scriptPubKey, nAmount, wtx);
     if (!strError.empty())
         throw JSONRPCError(RPC_WALLET_ERROR, strError);
 
@@ -366,8 +421,8 @@ Value listaddressgroupings(const Array& params, bool fHelp)
             "in past transactions");
 
     Array jsonGroupings;
-    map<CBitcoinAddress, int64_t> balances = pwalletMain->GetAddressBalances();
-    BOOST_FOREACH(set<CBitcoinAddress> grouping, pwalletMain->GetAddressGroupings())
+    map<CBitcoinAddress, int64_t> balances = GetRPCWallet()->GetAddressBalances();
+    BOOST_FOREACH(set<CBitcoinAddress> grouping, GetRPCWallet()->GetAddressGroupings())
     {
         Array jsonGrouping;
         BOOST_FOREACH(CBitcoinAddress address, grouping)
@@ -376,9 +431,9 @@ Value listaddressgroupings(const Array& params, bool fHelp)
             addressInfo.push_back(address.ToString());
             addressInfo.push_back(ValueFromAmount(balances[address]));
             {
-                LOCK(pwalletMain->cs_wallet);
-                if (pwalletMain->mapAddressBook.find(address) != pwalletMain->mapAddressBook.end())
-                    addressInfo.push_back(pwalletMain->mapAddressBook.find(address)->second);
+                LOCK(GetRPCWallet()->cs_wallet);
+                if (GetRPCWallet()->mapAddressBook.find(address) != GetRPCWallet()->mapAddressBook.end())
+                    addressInfo.push_back(GetRPCWallet()->mapAddressBook.find(address)->second);
             }
             jsonGrouping.push_back(addressInfo);
         }
@@ -408,7 +463,7 @@ Value signmessage(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to key");
 
     CKey key;
-    if (!pwalletMain->GetKey(keyID, key))
+    if (!GetRPCWallet()->GetKey(keyID, key))
         throw JSONRPCError(RPC_WALLET_ERROR, "Private key not available");
 
     CDataStream ss(SER_GETHASH, 0);
@@ -470,7 +525,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
     CBitcoinAddress address = CBitcoinAddress(params[0].get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid 42 address");
-    if (!IsMine(*pwalletMain,address))
+    if (!IsMine(*GetRPCWallet(),address))
         return 0.0;
 
     // Minimum confirmations
@@ -479,15 +534,18 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     int64_t nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
         if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
             continue;
         BOOST_FOREACH(const CTxOut& txout, wtx.vout)
         {
             CBitcoinAddress addressRet;
-            if (!ExtractAddress(*pwalletMain, txout.scriptPubKey, addressRet))
+            if (!ExtractAddress(*GetRPCWallet(), txout.scriptPubKey, addressRet))
                 continue;
             if (addressRet == address)
                 if (wtx.GetDepthInMainChain() >= nMinDepth)
@@ -500,7 +558,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
 void GetAccountAddresses(string strAccount, set<CBitcoinAddress>& setAddress)
 {
-    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, pwalletMain->mapAddressBook)
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, GetRPCWallet()->mapAddressBook)
     {
         const CBitcoinAddress& address = item.first;
         const string& strName = item.second;
@@ -528,16 +586,19 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64_t nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
         if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
             continue;
 
         BOOST_FOREACH(const CTxOut& txout, wtx.vout)
         {
             CBitcoinAddress address;
-            if (ExtractAddress(*pwalletMain, txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
+            if (ExtractAddress(*GetRPCWallet(), txout.scriptPubKey, address) && IsMine(*GetRPCWallet(), address) && setAddress.count(address))
                 if (wtx.GetDepthInMainChain() >= nMinDepth)
                     nAmount += txout.nValue;
         }
@@ -552,9 +613,12 @@ int64_t GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMi
     int64_t nBalance = 0;
 
     // Tally wallet transactions
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
         if (!wtx.IsFinal())
             continue;
 
@@ -574,7 +638,7 @@ int64_t GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMi
 
 int64_t GetAccountBalance(const string& strAccount, int nMinDepth, const isminefilter& filter)
 {
-    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletDB walletdb(GetRPCWallet()->strWalletFile);
     return GetAccountBalance(walletdb, strAccount, nMinDepth, filter);
 }
 
@@ -589,7 +653,7 @@ Value getbalance(const Array& params, bool fHelp)
             "if [includeWatchonly] is specified, include balance in watchonly addresses (see 'importaddress').");
 
     if (params.size() == 0)
-        return  ValueFromAmount(pwalletMain->GetBalance());
+        return  ValueFromAmount(GetRPCWallet()->GetBalance());
 
     int nMinDepth = 1;
     if (params.size() > 1)
@@ -604,9 +668,12 @@ Value getbalance(const Array& params, bool fHelp)
         // (GetBalance() sums up all unspent TxOuts)
         // getbalance and getbalance '*' 0 should return the same number.
         int64_t nBalance = 0;
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+        vector<const CWalletTx*> vTx;
+        list<CWalletTx> listArchived;
+        GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+        BOOST_FOREACH(const CWalletTx* pwtx, vTx)
         {
-            const CWalletTx& wtx = (*it).second;
+            const CWalletTx& wtx = *pwtx;
             if (!wtx.IsTrusted())
                 continue;
 
@@ -659,7 +726,7 @@ Value movecmd(const Array& params, bool fHelp)
     if (params.size() > 4)
         strComment = params[4].get_str();
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletDB walletdb(GetRPCWallet()->strWalletFile);
     if (!walletdb.TxnBegin())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
@@ -667,7 +734,7 @@ Value movecmd(const Array& params, bool fHelp)
 
     // Debit
     CAccountingEntry debit;
-    debit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    debit.nOrderPos = GetRPCWallet()->IncOrderPosNext(&walletdb);
     debit.strAccount = strFrom;
     debit.nCreditDebit = -nAmount;
     debit.nTime = nNow;
@@ -677,7 +744,7 @@ Value movecmd(const Array& params, bool fHelp)
 
     // Credit
     CAccountingEntry credit;
-    credit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    credit.nOrderPos = GetRPCWallet()->IncOrderPosNext(&walletdb);
     credit.strAccount = strTo;
     credit.nCreditDebit = nAmount;
     credit.nTime = nNow;
@@ -737,7 +804,7 @@ Value sendfrom(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
 
     // Send
-    string strError = pwalletMain->SendMoney(scriptPubKey, nAmount, wtx);
+    string strError = GetRPCWallet()->SendMoney(scriptPubKey, nAmount, wtx);
     if (!strError.empty())
         throw JSONRPCError(RPC_WALLET_ERROR, strError);
 
@@ -801,17 +868,17 @@ Value sendmany(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
 
     // Send
-    CReserveKey keyChange(pwalletMain);
+    CReserveKey keyChange(GetRPCWallet());
     int64_t nFeeRequired = 0;
-    bool fCreated = pwalletMain->CreateTransaction(vecSend, wtx, keyChange, nFeeRequired);
+    bool fCreated = GetRPCWallet()->CreateTransaction(vecSend, wtx, keyChange, nFeeRequired);
     if (!fCreated)
     {
-        int64_t nTotal = pwalletMain->GetBalance(), nWatchOnly = pwalletMain->GetWatchOnlyBalance();
+        int64_t nTotal = GetRPCWallet()->GetBalance(), nWatchOnly = GetRPCWallet()->GetWatchOnlyBalance();
         if (totalAmount + nFeeRequired > nTotal - nWatchOnly)
             throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds");
         throw JSONRPCError(RPC_WALLET_ERROR, "Transaction creation failed");
     }
-    if (!pwalletMain->CommitTransaction(wtx, keyChange))
+    if (!GetRPCWallet()->CommitTransaction(wtx, keyChange))
         throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
 
     return wtx.GetHash().GetHex();
@@ -858,7 +925,7 @@ Value addmultisigaddress(const Array& params, bool fHelp)
                 throw runtime_error(
                     strprintf("%s does not refer to a key",ks.c_str()));
             CPubKey vchPubKey;
-            if (!pwalletMain->GetPubKey(keyID, vchPubKey))
+            if (!GetRPCWallet()->GetPubKey(keyID, vchPubKey))
                 throw runtime_error(
                     strprintf("no full public key for address %s",ks.c_str()));
             if (!vchPubKey.IsValid())
@@ -888,10 +955,10 @@ Value addmultisigaddress(const Array& params, bool fHelp)
     throw runtime_error(
         strprintf("redeemScript exceeds size limit: %" PRIszu " > %d", inner.size(), MAX_SCRIPT_ELEMENT_SIZE));
 
-    pwalletMain->AddCScript(inner);
+    GetRPCWallet()->AddCScript(inner);
     CBitcoinAddress address(inner.GetID());
 
-    pwalletMain->SetAddressBookName(address, strAccount);
+    GetRPCWallet()->SetAddressBookName(address, strAccount);
     return address.ToString();
 }
 
@@ -912,10 +979,10 @@ Value addredeemscript(const Array& params, bool fHelp)
     // Construct using pay-to-script-hash:
     vector<unsigned char> innerData = ParseHexV(params[0], "redeemScript");
     CScript inner(innerData.begin(), innerData.end());
-    pwalletMain->AddCScript(inner);
+    GetRPCWallet()->AddCScript(inner);
     CBitcoinAddress address(inner.GetID());
 
-    pwalletMain->SetAddressBookName(address, strAccount);
+    GetRPCWallet()->SetAddressBookName(address, strAccount);
     return address.ToString();
 }
 
@@ -944,9 +1011,12 @@ Value ListReceived(const Array& params, bool fByAccounts)
 
     // Tally
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
 
         if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
             continue;
@@ -958,7 +1028,7 @@ Value ListReceived(const Array& params, bool fByAccounts)
         BOOST_FOREACH(const CTxOut& txout, wtx.vout)
         {
             CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*pwalletMain, address))
+            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*GetRPCWallet(), address))
                 continue;
 
             tallyitem& item = mapTally[address];
@@ -970,7 +1040,7 @@ Value ListReceived(const Array& params, bool fByAccounts)
     // Reply
     Array ret;
     map<string, tallyitem> mapAccountTally;
-    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, pwalletMain->mapAddressBook)
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& item, GetRPCWallet()->mapAddressBook)
     {
         const CBitcoinAddress& address = item.first;
         const string& strAccount = item.second;
@@ -1095,7 +1165,7 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
         {
             Object entry;
             entry.push_back(Pair("account", strSentAccount));
-            if(involvesWatchonly || (::IsMine(*pwalletMain, s.first) & MINE_WATCH_ONLY))
+            if(involvesWatchonly || (::IsMine(*GetRPCWallet(), s.first) & MINE_WATCH_ONLY))
                 entry.push_back(Pair("involvesWatchonly", true));
             MaybePushAddress(entry, s.first);
 
@@ -1119,13 +1189,13 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
         BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64_t)& r, listReceived)
         {
             string account;
-            if (pwalletMain->mapAddressBook.count(r.first))
-                account = pwalletMain->mapAddressBook[r.first];
+            if (GetRPCWallet()->mapAddressBook.count(r.first))
+                account = GetRPCWallet()->mapAddressBook[r.first];
             if (fAllAccounts || (account == strAccount))
             {
                 Object entry;
                 entry.push_back(Pair("account", account));
-                if(involvesWatchonly || (::IsMine(*pwalletMain, r.first) & MINE_WATCH_ONLY))
+                if(involvesWatchonly || (::IsMine(*GetRPCWallet(), r.first) & MINE_WATCH_ONLY))
                     entry.push_back(Pair("involvesWatchonly", true));
                 MaybePushAddress(entry, r.first);
                 if (wtx.IsCoinBase())
@@ -1195,15 +1265,16 @@ Value listtransactions(const Array& params, bool fHelp)
     Array ret;
 
     std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    CWalletDB(GetRPCWallet()->strWalletFile).ListAccountCreditDebit(strAccount, acentries);
+    CReverseTxItemsReader reader(GetRPCWallet(), acentries);
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    CWalletTx* pwtx;
+    CAccountingEntry* pacentry;
+    while (reader.Next(pwtx, pacentry))
     {
-        CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
-        CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
 
@@ -1246,14 +1317,17 @@ Value listaccounts(const Array& params, bool fHelp)
 
 
     map<string, int64_t> mapAccountBalances;
-    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& entry, pwalletMain->mapAddressBook) {
-        if (IsMine(*pwalletMain, entry.first)) // This address belongs to me
+    BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, string)& entry, GetRPCWallet()->mapAddressBook) {
+        if (IsMine(*GetRPCWallet(), entry.first)) // This address belongs to me
             mapAccountBalances[entry.second] = 0;
     }
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
         int64_t nGeneratedImmature, nGeneratedMature, nFee;
         string strSentAccount;
         list<pair<CBitcoinAddress, int64_t> > listReceived;
@@ -1266,15 +1340,15 @@ Value listaccounts(const Array& params, bool fHelp)
         {
             mapAccountBalances[""] += nGeneratedMature;
             BOOST_FOREACH(const PAIRTYPE(CBitcoinAddress, int64_t)& r, listReceived)
-                if (pwalletMain->mapAddressBook.count(r.first))
-                    mapAccountBalances[pwalletMain->mapAddressBook[r.first]] += r.second;
+                if (GetRPCWallet()->mapAddressBook.count(r.first))
+                    mapAccountBalances[GetRPCWallet()->mapAddressBook[r.first]] += r.second;
                 else
                     mapAccountBalances[""] += r.second;
         }
     }
 
     list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
+    CWalletDB(GetRPCWallet()->strWalletFile).ListAccountCreditDebit("*", acentries);
     BOOST_FOREACH(const CAccountingEntry& entry, acentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
@@ -1285,6 +1359,44 @@ Value listaccounts(const Array& params, bool fHelp)
     return ret;
 }
 
+Value waitfortx(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "waitfortx [sequence=0] [timeout=60]\n"
+            "Waits up to [timeout] seconds for wallet transactions to be added or updated\n"
+            "after notification number [sequence]. Returns the number of the latest\n"
+            "notification, to pass on to the next call, and the txids notified since\n"
+            "[sequence], oldest first. \"missed\" is true when some were already forgotten.");
+
+    uint64_t nSince = 0;
+    if (params.size() > 0)
+    {
+        if (params[0].get_int64() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence");
+        nSince = params[0].get_int64();
+    }
+    int64_t nTimeout = 60;
+    if (params.size() > 1)
+        nTimeout = params[1].get_int64();
+    if (nTimeout < 0 || nTimeout > 3600)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Timeout out of range");
+
+    vector<uint256> vHash;
+    bool fMissed;
+    uint64_t nSequence = walletNotifyQueue.Wait(nSince, nTimeout * 1000, vHash, fMissed);
+
+    Array txids;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        txids.push_back(hash.GetHex());
+
+    Object ret;
+    ret.push_back(Pair("sequence", (boost::int64_t)nSequence));
+    ret.push_back(Pair("txids", txids));
+    ret.push_back(Pair("missed", fMissed));
+    return ret;
+}
+
 Value listsinceblock(const Array& params, bool fHelp)
 {
     if (fHelp)
@@ -1320,12 +1432,25 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    vector<const CWalletTx*> vTx;
+    list<CWalletTx> listArchived;
+    if (depth == -1)
+        GetRPCWallet()->GetHistoryTxs(vTx, listArchived);
+    else
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        // Only the transactions above the block or out of the main chain can qualify
+        GetRPCWallet()->GetTxsSince(pindex, vTx);
+        GetRPCWallet()->GetArchivedTxsSince(pindex->nHeight, listArchived);
+        BOOST_FOREACH(const CWalletTx& wtx, listArchived)
+            vTx.push_back(&wtx);
+    }
+    map<uint256, const CWalletTx*> mapSince;
+    BOOST_FOREACH(const CWalletTx* pwtx, vTx)
+        mapSince.insert(make_pair(pwtx->GetHash(), pwtx));
+    for (map<uint256, const CWalletTx*>::iterator it = mapSince.begin(); it != mapSince.end(); it++)
+    {
+        if (depth == -1 || (*it).second->GetDepthInMainChain() < depth)
+            ListTransactions(*(*it).second, "*", 0, true, transactions, filter);
     }
 
     uint256 lastblock;
@@ -1370,9 +1495,10 @@ Value gettransaction(const Array& params, bool fHelp)
 
     Object entry;
 
-    if (pwalletMain->mapWallet.count(hash))
+    CWalletTx wtxArchived;
+    if (GetRPCWallet()->mapWallet.count(hash) || GetRPCWallet()->ReadArchivedTx(hash, wtxArchived))
     {
-        const CWalletTx& wtx = pwalletMain->mapWallet[hash];
+        const CWalletTx& wtx = GetRPCWallet()->mapWallet.count(hash) ? GetRPCWallet()->mapWallet[hash] : wtxArchived;
 
         TxToJSON(wtx, 0, entry);
 
@@ -1388,7 +1514,7 @@ Value gettransaction(const Array& params, bool fHelp)
         WalletTxToJSON(wtx, entry);
 
         Array details;
-        ListTransactions(pwalletMain->mapWallet[hash], "*", 0, false, details, filter);
+        ListTransactions(wtx, "*", 0, false, details, filter);
         entry.push_back(Pair("details", details));
     }
     else
@@ -1403,7 +1529,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1430,7 +1556,7 @@ Value backupwallet(const Array& params, bool fHelp)
             "Safely copies wallet.dat to destination, which can be a directory or a path with filename.");
 
     string strDest = params[0].get_str();
-    if (!BackupWallet(*pwalletMain, strDest))
+    if (!BackupWallet(*GetRPCWallet(), strDest))
         throw JSONRPCError(RPC_WALLET_ERROR, "Error: Wallet backup failed!");
 
     return Value::null;
@@ -1456,9 +1582,9 @@ Value keypoolrefill(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
-    pwalletMain->TopUpKeyPool(nSize);
+    GetRPCWallet()->TopUpKeyPool(nSize);
 
-    if (pwalletMain->GetKeyPoolSize() < nSize)
+    if (GetRPCWallet()->GetKeyPoolSize() < nSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
     return Value::null;
@@ -1483,80 +1609,66 @@ Value keypoolreset(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
-    pwalletMain->NewKeyPool(nSize);
+    GetRPCWallet()->NewKeyPool(nSize);
 
-    if (pwalletMain->GetKeyPoolSize() < nSize)
+    if (GetRPCWallet()->GetKeyPoolSize() < nSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
     return Value::null;
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
+// Lock the wallet once its unlock time has passed. If the unlock was
+// extended meanwhile, check again then.
+static void WalletRelockTimer(CWallet* pwallet)
 {
-    // Make this thread recognisable as the key-topping-up thread
-    RenameThread("42-key-top");
+    LOCK(cs_nWalletUnlockTime);
+    int64_t& nWalletUnlockTime = mapWalletUnlockTime[pwallet];
 
-    pwalletMain->TopUpKeyPool();
+    // Locked by walletlock already
+    if (nWalletUnlockTime == 0)
+        return;
+
+    int64_t nToSleep = nWalletUnlockTime - GetTimeMillis();
+    if (nToSleep > 0)
+    {
+        scheduler.Schedule(boost::bind(WalletRelockTimer, pwallet), nToSleep);
+        return;
+    }
+
+    nWalletUnlockTime = 0;
+    pwallet->Lock();
 }
 
-void ThreadCleanWalletPassphrase(void* parg)
+static void LockWalletAfter(CWallet* pwallet, int64_t nSeconds)
 {
-    // Make this thread recognisable as the wallet relocking thread
-    RenameThread("42-lock-wa");
-
-    int64_t nMyWakeTime = GetTimeMillis() + *((int64_t*)parg) * 1000;
+    int64_t nMyWakeTime = GetTimeMillis() + nSeconds * 1000;
 
-    ENTER_CRITICAL_SECTION(cs_nWalletUnlockTime);
+    LOCK(cs_nWalletUnlockTime);
+    int64_t& nWalletUnlockTime = mapWalletUnlockTime[pwallet];
 
     if (nWalletUnlockTime == 0)
     {
         nWalletUnlockTime = nMyWakeTime;
-
-        for ( ; ; )
-        {
-            if (nWalletUnlockTime==0)
-                break;
-            int64_t nToSleep = nWalletUnlockTime - GetTimeMillis();
-            if (nToSleep <= 0)
-                break;
-
-            LEAVE_CRITICAL_SECTION(cs_nWalletUnlockTime);
-            Sleep(nToSleep);
-            ENTER_CRITICAL_SECTION(cs_nWalletUnlockTime);
-
-        };
-
-        if (nWalletUnlockTime)
-        {
-            nWalletUnlockTime = 0;
-            pwalletMain->Lock();
-        }
-    }
-    else
-    {
-        if (nWalletUnlockTime < nMyWakeTime)
-            nWalletUnlockTime = nMyWakeTime;
+        scheduler.Schedule(boost::bind(WalletRelockTimer, pwallet), nSeconds * 1000);
     }
-
-    LEAVE_CRITICAL_SECTION(cs_nWalletUnlockTime);
-
-    delete (int64_t*)parg;
+    else if (nWalletUnlockTime < nMyWakeTime)
+        nWalletUnlockTime = nMyWakeTime;
 }
 
 Value walletpassphrase(const Array& params, bool fHelp)
 {
-    if (pwalletMain->IsCrypted() && (fHelp || params.size() < 2 || params.size() > 3))
+    if (GetRPCWallet()->IsCrypted() && (fHelp || params.size() < 2 || params.size() > 3))
         throw runtime_error(
             "walletpassphrase <passphrase> <timeout> [mintonly]\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.\n"
             "mintonly is optional true/false allowing only block minting.");
     if (fHelp)
         return true;
-    if (!pwalletMain->IsCrypted())
+    if (!GetRPCWallet()->IsCrypted())
         throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an unencrypted wallet, but walletpassphrase was called.");
 
-    if (!pwalletMain->IsLocked())
+    if (!GetRPCWallet()->IsLocked())
         throw JSONRPCError(RPC_WALLET_ALREADY_UNLOCKED, "Error: Wallet is already unlocked, use walletlock first if need to change unlock settings.");
     // Note that the walletpassphrase is stored in params[0] which is not mlock()ed
     SecureString strWalletPass;
@@ -1567,7 +1679,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
 
     if (strWalletPass.length() > 0)
     {
-        if (!pwalletMain->Unlock(strWalletPass))
+        if (!GetRPCWallet()->Unlock(strWalletPass))
             throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
     }
     else
@@ -1575,9 +1687,8 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    NewThread(ThreadTopUpKeyPool, NULL);
-    int64_t* pnSleepTime = new int64_t(params[1].get_int64());
-    NewThread(ThreadCleanWalletPassphrase, pnSleepTime);
+    scheduler.Schedule(boost::bind(&CWallet::TopUpKeyPool, GetRPCWallet(), 0));
+    LockWalletAfter(GetRPCWallet(), params[1].get_int64());
 
     // ppcoin: if user OS account compromised prevent trivial sendmoney commands
     if (params.size() > 2)
@@ -1591,13 +1702,13 @@ Value walletpassphrase(const Array& params, bool fHelp)
 
 Value walletpassphrasechange(const Array& params, bool fHelp)
 {
-    if (pwalletMain->IsCrypted() && (fHelp || params.size() != 2))
+    if (GetRPCWallet()->IsCrypted() && (fHelp || params.size() != 2))
         throw runtime_error(
             "walletpassphrasechange <oldpassphrase> <newpassphrase>\n"
             "Changes the wallet passphrase from <oldpassphrase> to <newpassphrase>.");
     if (fHelp)
         return true;
-    if (!pwalletMain->IsCrypted())
+    if (!GetRPCWallet()->IsCrypted())
         throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an unencrypted wallet, but walletpassphrasechange was called.");
 
     // TODO: get rid of these .c_str() calls by implementing SecureString::operator=(std::string)
@@ -1615,7 +1726,7 @@ Value walletpassphrasechange(const Array& params, bool fHelp)
             "walletpassphrasechange <oldpassphrase> <newpassphrase>\n"
             "Changes the wallet passphrase from <oldpassphrase> to <newpassphrase>.");
 
-    if (!pwalletMain->ChangeWalletPassphrase(strOldWalletPass, strNewWalletPass))
+    if (!GetRPCWallet()->ChangeWalletPassphrase(strOldWalletPass, strNewWalletPass))
         throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
 
     return Value::null;
@@ -1624,7 +1735,7 @@ Value walletpassphrasechange(const Array& params, bool fHelp)
 
 Value walletlock(const Array& params, bool fHelp)
 {
-    if (pwalletMain->IsCrypted() && (fHelp || params.size() != 0))
+    if (GetRPCWallet()->IsCrypted() && (fHelp || params.size() != 0))
         throw runtime_error(
             "walletlock\n"
             "Removes the wallet encryption key from memory, locking the wallet.\n"
@@ -1632,13 +1743,13 @@ Value walletlock(const Array& params, bool fHelp)
             "before being able to call any methods which require the wallet to be unlocked.");
     if (fHelp)
         return true;
-    if (!pwalletMain->IsCrypted())
+    if (!GetRPCWallet()->IsCrypted())
         throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an unencrypted wallet, but walletlock was called.");
 
     {
         LOCK(cs_nWalletUnlockTime);
-        pwalletMain->Lock();
-        nWalletUnlockTime = 0;
+        GetRPCWallet()->Lock();
+        mapWalletUnlockTime[GetRPCWallet()] = 0;
     }
 
     return Value::null;
@@ -1647,13 +1758,13 @@ Value walletlock(const Array& params, bool fHelp)
 
 Value encryptwallet(const Array& params, bool fHelp)
 {
-    if (!pwalletMain->IsCrypted() && (fHelp || params.size() != 1))
+    if (!GetRPCWallet()->IsCrypted() && (fHelp || params.size() != 1))
         throw runtime_error(
             "encryptwallet <passphrase>\n"
             "Encrypts the wallet with <passphrase>.");
     if (fHelp)
         return true;
-    if (pwalletMain->IsCrypted())
+    if (GetRPCWallet()->IsCrypted())
         throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an encrypted wallet, but encryptwallet was called.");
 
     // TODO: get rid of this .c_str() by implementing SecureString::operator=(std::string)
@@ -1667,7 +1778,7 @@ Value encryptwallet(const Array& params, bool fHelp)
             "encryptwallet <passphrase>\n"
             "Encrypts the wallet with <passphrase>.");
 
-    if (!pwalletMain->EncryptWallet(strWalletPass))
+    if (!GetRPCWallet()->EncryptWallet(strWalletPass))
         throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: Failed to encrypt the wallet.");
 
     // BDB seems to have a bad habit of writing old data into
@@ -1688,10 +1799,10 @@ public:
     Object operator()(const CKeyID &keyID) const {
         Object obj;
         CPubKey vchPubKey;
-        pwalletMain->GetPubKey(keyID, vchPubKey);
+        GetRPCWallet()->GetPubKey(keyID, vchPubKey);
         obj.push_back(Pair("isscript", false));
         if (mine == MINE_SPENDABLE) {
-            pwalletMain->GetPubKey(keyID, vchPubKey);
+            GetRPCWallet()->GetPubKey(keyID, vchPubKey);
             obj.push_back(Pair("pubkey", HexStr(vchPubKey.begin(), vchPubKey.end())));
             obj.push_back(Pair("iscompressed", vchPubKey.IsCompressed()));
         }
@@ -1703,7 +1814,7 @@ public:
         obj.push_back(Pair("isscript", true));
         if (mine == MINE_SPENDABLE) {
             CScript subscript;
-            pwalletMain->GetCScript(scriptID, subscript);
+            GetRPCWallet()->GetCScript(scriptID, subscript);
             std::vector<CTxDestination> addresses;
             txnouttype whichType;
             int nRequired;
@@ -1742,7 +1853,7 @@ Value validateaddress(const Array& params, bool fHelp)
             ret.push_back(Pair("ispair", true));
 
             CMalleableKeyView view;
-            bool isMine = pwalletMain->GetMalleableView(mpk, view);
+            bool isMine = GetRPCWallet()->GetMalleableView(mpk, view);
             ret.push_back(Pair("ismine", isMine));
             ret.push_back(Pair("PubkeyPair", mpk.ToString()));
 
@@ -1754,15 +1865,15 @@ Value validateaddress(const Array& params, bool fHelp)
             string currentAddress = address.ToString();
             CTxDestination dest = address.Get();
             ret.push_back(Pair("address", currentAddress));
-			isminetype mine = IsMine(*pwalletMain, address);
+			isminetype mine = IsMine(*GetRPCWallet(), address);
             ret.push_back(Pair("ismine", mine != MINE_NO));
             if (mine != MINE_NO) {
                 ret.push_back(Pair("watchonly", mine == MINE_WATCH_ONLY));
                 Object detail = boost::apply_visitor(DescribeAddressVisitor(mine), dest);
                 ret.insert(ret.end(), detail.begin(), detail.end());
             }
-            if (pwalletMain->mapAddressBook.count(address))
-                ret.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+            if (GetRPCWallet()->mapAddressBook.count(address))
+                ret.push_back(Pair("account", GetRPCWallet()->mapAddressBook[address]));
         }
     }
     return ret;
@@ -1819,7 +1930,7 @@ Value checkwallet(const Array& params, bool fHelp)
 
     int nMismatchSpent;
     int64_t nBalanceInQuestion;
-    pwalletMain->FixSpentCoins(nMismatchSpent, nBalanceInQuestion, true);
+    GetRPCWallet()->FixSpentCoins(nMismatchSpent, nBalanceInQuestion, true);
     Object result;
     if (nMismatchSpent == 0)
         result.push_back(Pair("wallet check passed", true));
@@ -1842,7 +1953,7 @@ Value repairwallet(const Array& params, bool fHelp)
 
     int nMismatchSpent;
     int64_t nBalanceInQuestion;
-    pwalletMain->FixSpentCoins(nMismatchSpent, nBalanceInQuestion);
+    GetRPCWallet()->FixSpentCoins(nMismatchSpent, nBalanceInQuestion);
     Object result;
     if (nMismatchSpent == 0)
         result.push_back(Pair("wallet check passed", true));
@@ -1879,9 +1990,9 @@ Value resendwallettransactions(const Array& params, bool fHelp)
             "Returns array of transaction ids that were re-broadcast.\n"
             );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    LOCK2(cs_main, GetRPCWallet()->cs_wallet);
 
-    std::vector<uint256> txids = pwalletMain->ResendWalletTransactionsBefore(GetTime());
+    std::vector<uint256> txids = GetRPCWallet()->ResendWalletTransactionsBefore(GetTime());
     Array result;
     BOOST_FOREACH(const uint256& txid, txids)
     {
@@ -1930,16 +2041,16 @@ Value newmalleablekey(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    CMalleableKeyView keyView = pwalletMain->GenerateNewMalleableKey();
+    CMalleableKeyView keyView = GetRPCWallet()->GenerateNewMalleableKey();
 
     CMalleableKey mKey;
-    if (!pwalletMain->GetMalleableKey(keyView, mKey))
+    if (!GetRPCWallet()->GetMalleableKey(keyView, mKey))
         throw runtime_error("Unable to generate new malleable key");
 
     CMalleablePubKey mPubKey = mKey.GetMalleablePubKey();
     CBitcoinAddress address(mPubKey);
 
-    pwalletMain->SetAddressBookName(address, strAccount);
+    GetRPCWallet()->SetAddressBookName(address, strAccount);
 
     Object result;
     result.push_back(Pair("PublicPair", mPubKey.ToString()));
@@ -1978,6 +2089,38 @@ Value adjustmalleablekey(const Array& params, bool fHelp)
     return result;
 }
 
+// Malleable public key from a malleable address, key view or public key pair
+static CMalleablePubKey ParseMalleablePubKey(const string& strData)
+{
+    CBitcoinAddress addr(strData);
+    if (addr.IsValid() && addr.IsPair())
+    {
+        // Initialize malleable pubkey with address data
+        return CMalleablePubKey(addr.GetData());
+    }
+    CMalleableKeyView viewTmp(strData);
+    if (viewTmp.IsValid())
+    {
+        // Shazaam, we have a valid key view here.
+        return viewTmp.GetMalleablePubKey();
+    }
+    CMalleablePubKey malleablePubKey;
+    if (malleablePubKey.SetString(strData))
+        return malleablePubKey; // A valid public key pair
+
+    throw runtime_error("Though your data seems a valid Base58 string, we were unable to recognize it.");
+}
+
+static Object KeyVariantToJSON(const CPubKey& R, const CPubKey& vchPubKeyVariant)
+{
+    Object result;
+    result.push_back(Pair("R", HexStr(R.begin(), R.end())));
+    result.push_back(Pair("PubkeyVariant", HexStr(vchPubKeyVariant.begin(), vchPubKeyVariant.end())));
+    result.push_back(Pair("KeyVariantID", CBitcoinAddress(vchPubKeyVariant.GetID()).ToString()));
+
+    return result;
+}
+
 Value adjustmalleablepubkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2 || params.size() == 0)
@@ -1985,39 +2128,47 @@ Value adjustmalleablepubkey(const Array& params, bool fHelp)
             "adjustmalleablepubkey <Malleable address, key view or public key pair>\n"
             "Calculate new public key using provided data.\n");
 
-    string strData = params[0].get_str();
-    CMalleablePubKey malleablePubKey;
+    CMalleablePubKey malleablePubKey = ParseMalleablePubKey(params[0].get_str());
+
+    CPubKey R, vchPubKeyVariant;
+    malleablePubKey.GetVariant(R, vchPubKeyVariant);
+
+    return KeyVariantToJSON(R, vchPubKeyVariant);
+}
+
+Value adjustmalleablepubkeys(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "adjustmalleablepubkeys <Malleable address, key view or public key pair> <count>\n"
+            "Calculate <count> new public keys using provided data, up to 10000 at once.\n");
+
+    CMalleablePubKey malleablePubKey = ParseMalleablePubKey(params[0].get_str());
+
+    int nCount = params[1].get_int();
+    if (nCount < 1 || nCount > 10000)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid count, must be from 1 to 10000");
 
-    do
+    // Tabulating L costs about four variants, below that the plain way is faster
+    Array result;
+    if (nCount < 4)
     {
-        CBitcoinAddress addr(strData);
-        if (addr.IsValid() && addr.IsPair())
-        {
-            // Initialize malleable pubkey with address data
-            malleablePubKey = CMalleablePubKey(addr.GetData());
-            break;
-        }
-        CMalleableKeyView viewTmp(strData);
-        if (viewTmp.IsValid())
+        for (int i = 0; i < nCount; i++)
         {
-            // Shazaam, we have a valid key view here.
-            malleablePubKey = viewTmp.GetMalleablePubKey();
-            break;
+            CPubKey R, vchPubKeyVariant;
+            malleablePubKey.GetVariant(R, vchPubKeyVariant);
+            result.push_back(KeyVariantToJSON(R, vchPubKeyVariant));
         }
-        if (malleablePubKey.SetString(strData))
-            break; // A valid public key pair
-
-        throw runtime_error("Though your data seems a valid Base58 string, we were unable to recognize it.");
+        return result;
     }
-    while(false);
-
-    CPubKey R, vchPubKeyVariant;
-    malleablePubKey.GetVariant(R, vchPubKeyVariant);
 
-    Object result;
-    result.push_back(Pair("R", HexStr(R.begin(), R.end())));
-    result.push_back(Pair("PubkeyVariant", HexStr(vchPubKeyVariant.begin(), vchPubKeyVariant.end())));
-    result.push_back(Pair("KeyVariantID", CBitcoinAddress(vchPubKeyVariant.GetID()).ToString()));
+    CMalleableVariantGenerator generator(malleablePubKey);
+    for (int i = 0; i < nCount; i++)
+    {
+        CPubKey R, vchPubKeyVariant;
+        generator.GetVariant(R, vchPubKeyVariant);
+        result.push_back(KeyVariantToJSON(R, vchPubKeyVariant));
+    }
 
     return result;
 }
@@ -2030,7 +2181,7 @@ Value listmalleableviews(const Array& params, bool fHelp)
             "Get list of views for generated malleable keys.\n");
 
     std::list<CMalleableKeyView> keyViewList;
-    pwalletMain->ListMalleableViews(keyViewList);
+    GetRPCWallet()->ListMalleableViews(keyViewList);
 
     Array result;
     BOOST_FOREACH(const CMalleableKeyView &keyView, keyViewList)
@@ -0,0 +1,100 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scheduler.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+using namespace std;
+
+CScheduler scheduler("sched");
+
+void CScheduler::Start(int nThreads)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStopping = false;
+    }
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CScheduler::ThreadWorker, this));
+}
+
+void CScheduler::Schedule(Function f, int64_t nDelay)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fStopping)
+            return;
+        taskQueue.insert(make_pair(boost::get_system_time() + boost::posix_time::milliseconds(nDelay), f));
+    }
+    cond.notify_one();
+}
+
+void CScheduler::Repeat(Function f, int64_t nInterval)
+{
+    f();
+    Schedule(boost::bind(&CScheduler::Repeat, this, f, nInterval), nInterval);
+}
+
+void CScheduler::ScheduleEvery(Function f, int64_t nInterval)
+{
+    Schedule(boost::bind(&CScheduler::Repeat, this, f, nInterval), nInterval);
+}
+
+void CScheduler::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStopping = true;
+        taskQueue.clear();
+    }
+    cond.notify_all();
+    threads.join_all();
+}
+
+void CScheduler::GetQueueInfo(size_t& nQueuedRet, int& nRunningRet)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nQueuedRet = taskQueue.size();
+    nRunningRet = nRunning;
+}
+
+void CScheduler::ThreadWorker()
+{
+    RenameThread(("42-" + strName).c_str());
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fStopping)
+    {
+        if (taskQueue.empty())
+        {
+            cond.wait(lock);
+            continue;
+        }
+        // Sleep until the first task is due, or an earlier one is added
+        boost::system_time timeDue = taskQueue.begin()->first;
+        if (boost::get_system_time() < timeDue)
+        {
+            cond.timed_wait(lock, timeDue);
+            continue;
+        }
+
+        Function f = taskQueue.begin()->second;
+        taskQueue.erase(taskQueue.begin());
+        nRunning++;
+        lock.unlock();
+        try
+        {
+            f();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "CScheduler::ThreadWorker()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "CScheduler::ThreadWorker()");
+        }
+        lock.lock();
+        nRunning--;
+    }
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SCHEDULER_H
+#define BITCOIN_SCHEDULER_H
+
+#include <map>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Fixed pool of threads running short tasks, now or after a delay.
+ *
+ * Used instead of starting a thread per event (a dial, a -blocknotify
+ * command, a wallet relock timer) and instead of threads which only sleep
+ * between periodic jobs. The tasks are kept ordered by the time they are due,
+ * tasks due at the same time run in the order they were scheduled.
+ *
+ * A task that blocks holds up the others on the same pool, so long running
+ * loops keep their own threads.
+ */
+class CScheduler
+{
+public:
+    typedef boost::function<void(void)> Function;
+
+    explicit CScheduler(const std::string& strNameIn) : strName(strNameIn), fStopping(false), nRunning(0) { }
+
+    // Start nThreads workers, named 42-<name>
+    void Start(int nThreads);
+
+    // Run f on a worker in nDelay milliseconds, or as soon as one is free
+    void Schedule(Function f, int64_t nDelay = 0);
+
+    // Run f every nInterval milliseconds, the first time after one interval
+    void ScheduleEvery(Function f, int64_t nInterval);
+
+    // Drop the tasks not started yet and wait for the running ones
+    void Stop();
+
+    // Tasks waiting (including the ones not due yet) and running, for diagnostics
+    void GetQueueInfo(size_t& nQueuedRet, int& nRunningRet);
+
+private:
+    const std::string strName;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::multimap<boost::system_time, Function> taskQueue;
+    boost::thread_group threads;
+    bool fStopping;
+    int nRunning;
+
+    void ThreadWorker();
+    void Repeat(Function f, int64_t nInterval);
+};
+
+// Short jobs and timers
+extern CScheduler scheduler;
+
+#endif
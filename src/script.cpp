@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,15 +15,13 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* pSigHash=NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
 static const size_t nMaxNumSize = 4;
 
 
@@ -415,9 +412,8 @@ bool CheckSequence(const int64_t& nSequence, const CTransaction &txTo, unsigned
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* pSigHash)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
@@ -489,7 +485,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -571,16 +567,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 1)
                         return false;
 
-                    CBigNum nLockTime = CastToBigNum(stacktop(-1));
+                    CScriptNum nLockTime(stacktop(-1));
 
                     // In the rare event that the argument may be < 0 due to
                     // some arithmetic being done first, you can always use
                     // 0 MAX CHECKLOCKTIMEVERIFY.
-                    if (nLockTime < 0)
+                    if (nLockTime < bnZero)
                         return false;
 
                     // Actually compare the specified lock time with the transaction.
-                    if (!CheckLockTime(nLockTime.getuint64(), txTo, nIn))
+                    if (!CheckLockTime(nLockTime.GetInt64(), txTo, nIn))
                         return false;
 
                     break;
@@ -599,12 +595,12 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // nSequence, like nLockTime, is a 32-bit unsigned integer
                     // field. See the comment in CHECKLOCKTIMEVERIFY regarding
                     // 5-byte numeric operands.
-                    CBigNum nSequence = CastToBigNum(stacktop(-1));
+                    CScriptNum nSequence(stacktop(-1));
 
                     // In the rare event that the argument may be < 0 due to
                     // some arithmetic being done first, you can always use
                     // 0 MAX CHECKSEQUENCEVERIFY.
-                    if (nSequence < 0)
+                    if (nSequence < bnZero)
                         return false;
 
                     // To provide for future soft-fork extensibility, if the
@@ -614,7 +610,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         break;
 
                     // Compare the specified sequence number with the input.
-                    if (!CheckSequence(nSequence.getuint64(), txTo, nIn))
+                    if (!CheckSequence(nSequence.GetInt64(), txTo, nIn))
                         return false;
 
                     break;
@@ -656,10 +652,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-2));
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -668,12 +662,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
                 }
                 break;
 
@@ -682,10 +673,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-4));
+                    stack.push_back(stacktop(-4));
                 }
                 break;
 
@@ -694,11 +683,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    std::rotate(stack.end()-6, stack.end()-4, stack.end());
                 }
                 break;
 
@@ -717,16 +702,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        stack.push_back(stacktop(-1));
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn((uint16_t) stack.size());
+                    CScriptNum bn(stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -745,8 +729,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -764,8 +747,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -776,14 +758,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint32();
+                    int n = CScriptNum(stacktop(-1)).getint32();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                        std::rotate(stack.end()-n-1, stack.end()-n, stack.end());
+                    else
+                        stack.push_back(stacktop(-n-1));
                 }
                 break;
 
@@ -824,7 +806,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn((uint16_t) stacktop(-1).size());
+                    CScriptNum bn(stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -875,19 +857,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_1ADD:       bn = bn + bnOne; break;
+                    case OP_1SUB:       bn = bn - bnOne; break;
                     case OP_NEGATE:     bn = -bn; break;
                     case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_NOT:        bn = CScriptNum(bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    bn.Encode(stacktop(-1));
                 }
                 break;
 
@@ -908,9 +889,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -921,22 +902,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    bn.Encode(stacktop(-1));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -953,9 +933,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -978,25 +958,26 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 1)
                         return false;
                     valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    unsigned char pchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(&vch[0], vch.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(&vch[0], vch.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        sha256(&vch[0], vch.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
                         uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        memcpy(pchHash, &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    // Replace the input in place, its buffer is usually large enough
+                    vch.assign(pchHash, pchHash + nHashSize);
                 }
                 break;
 
@@ -1028,7 +1009,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHash);
 
                     popstack(stack);
                     popstack(stack);
@@ -1052,7 +1033,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint32();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint32();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -1063,7 +1044,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint32();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint32();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1089,7 +1070,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHash);
 
                         if (fOk) {
                             isig++;
@@ -1160,6 +1141,54 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
+// Serialize the transaction the way it is signed: the other inputs' scripts
+//   blanked and the outputs and sequence numbers masked by the hash type.
+//   The result is the same as serializing a modified copy of the transaction.
+static void SerializeSignatureTx(CHashWriter& ss, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY) != 0;
+    bool fHashNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    bool fHashSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+
+    ss << txTo.nVersion << txTo.nTime;
+
+    // Blank out other inputs completely, not recommended for open transactions
+    unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int n = 0; n < nInputs; n++)
+    {
+        unsigned int i = fAnyoneCanPay ? nIn : n;
+        const CTxIn& txin = txTo.vin[i];
+        ss << txin.prevout;
+
+        // Blank out other inputs' signatures
+        if (i == nIn)
+            ss << scriptCode;
+        else
+            ss << CScript();
+
+        // Let the others update at will
+        if (i != nIn && (fHashNone || fHashSingle))
+            ss << (unsigned int)0;
+        else
+            ss << txin.nSequence;
+    }
+
+    // Blank out some of the outputs
+    unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+    WriteCompactSize(ss, nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        // Only lock-in the txout payee at same index as txin
+        if (fHashSingle && i != nIn)
+            ss << CTxOut();
+        else
+            ss << txTo.vout[i];
+    }
+
+    ss << txTo.nLockTime;
+}
+
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     if (nIn >= txTo.vin.size())
@@ -1167,59 +1196,82 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
+
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    // Serialize and hash
+    CHashWriter ss(SER_GETHASH, 0);
+    SerializeSignatureTx(ss, scriptCode, txTo, nIn, nHashType);
+    ss << nHashType;
+    return ss.GetHash();
+}
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
-    {
-        // Wildcard payee
-        txTmp.vout.clear();
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : ptxTo(&txToIn)
+{
+    const CTransaction& txTo = *ptxTo;
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
-    }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &ss[0], ss.size());
+
+    // Every input as it is hashed when another input is signed with SIGHASH_ALL
+    CDataStream ssTail(SER_GETHASH, 0);
+    vMidstates.reserve(txTo.vin.size());
+    vInputOffset.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        vMidstates.push_back(ctx);
+        vInputOffset.push_back(ssTail.size());
+        ssTail << txin.prevout << CScript() << txin.nSequence;
+        sha256_update(&ctx, &ssTail[vInputOffset.back()], ssTail.size() - vInputOffset.back());
     }
+    vInputOffset.push_back(ssTail.size());
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
-    {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
-    }
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    // Only SIGHASH_ALL hashes all inputs and outputs unchanged
+    if (nIn >= vMidstates.size() || (nHashType & SIGHASH_ANYONECANPAY) ||
+        (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Serialize and hash
     CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    ss << scriptCode;
+
+    // Blanked input is prevout (36 bytes), empty script (1 byte) and sequence (4 bytes)
+    const unsigned char* pInput = &vchTail[vInputOffset[nIn]];
+    sha256_ctx ctx = vMidstates[nIn];
+    sha256_update(&ctx, pInput, 36);
+    sha256_update(&ctx, &ss[0], ss.size());
+    sha256_update(&ctx, pInput + 37, 4);
+    sha256_update(&ctx, &vchTail[vInputOffset[nIn + 1]], vchTail.size() - vInputOffset[nIn + 1]);
+
+    ss.clear();
+    ss << nHashType;
+    sha256_update(&ctx, &ss[0], ss.size());
+
+    uint256 hash1;
+    sha256_final(&ctx, hash1.begin());
+    uint256 hash2;
+    sha256(hash1.begin(), hash1.size(), hash2.begin());
+    return hash2;
 }
 
 
@@ -1230,34 +1282,50 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey > sigdata_type;
-    std::set< sigdata_type> setValid;
+    // Entries are hashes of (signature hash, signature, public key), together
+    // with a random salt, which keeps the entries small and makes them impossible
+    // to predict by the would-be DoS attackers
+    std::set<uint256> setValid;
+    uint256 nSalt;
+    int64_t nMaxCacheSize;
     boost::shared_mutex cs_sigcache;
 
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nSalt << hash << vchSig << pubKey;
+        return ss.GetHash();
+    }
+
 public:
+    CSignatureCache()
+    {
+        nSalt = GetRandHash();
+
+        // DoS prevention: limit cache size to a few MB
+        // (~80 bytes per cache entry including the set node times 50,000 entries)
+        // Since there are a maximum of 20,000 signature operations per block
+        // 50,000 is a reasonable default.
+        nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.count(entry) > 0;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
         if (nMaxCacheSize <= 0) return;
 
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+
+        // Writers need exclusive access, script checks run in parallel
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
 
         while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
         {
@@ -1265,22 +1333,18 @@ public:
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
             if (it == setValid.end())
                 it = setValid.begin();
-            setValid.erase(*it);
+            setValid.erase(it);
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        setValid.insert(entry);
     }
 };
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* pSigHash)
 {
     static CSignatureCache signatureCache;
 
@@ -1297,7 +1361,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = pSigHash ? pSigHash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1312,6 +1376,40 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 }
 
 
+// Bare multisig with directly pushed 33 or 65 byte keys:
+//   OP_m <pubkey>... OP_n OP_CHECKMULTISIG
+// Anything else, including m > n, is left to the template matcher.
+static bool SolveMultisig(const CScript& script, vector<valtype>& vSolutionsRet)
+{
+    unsigned int nSize = script.size();
+    if (nSize < 3 || script[nSize-1] != OP_CHECKMULTISIG)
+        return false;
+    opcodetype opM = (opcodetype)script[0];
+    opcodetype opN = (opcodetype)script[nSize-2];
+    if (opM < OP_1 || opM > OP_16 || opN < OP_1 || opN > OP_16 || opM > opN)
+        return false;
+
+    int nKeys = 0;
+    unsigned int i = 1;
+    while (i < nSize - 2)
+    {
+        unsigned int nLen = script[i];
+        if ((nLen != 33 && nLen != 65) || i + 1 + nLen > nSize - 2)
+            return false;
+        i += 1 + nLen;
+        nKeys++;
+    }
+    if (nKeys != CScript::DecodeOP_N(opN))
+        return false;
+
+    vSolutionsRet.reserve(nKeys + 2);
+    vSolutionsRet.push_back(valtype(1, (unsigned char)CScript::DecodeOP_N(opM)));
+    for (i = 1; i < nSize - 2; i += 1 + script[i])
+        vSolutionsRet.push_back(valtype(script.begin() + i + 1, script.begin() + i + 1 + script[i]));
+    vSolutionsRet.push_back(valtype(1, (unsigned char)nKeys));
+    return true;
+}
+
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
@@ -1359,6 +1457,29 @@ bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsi
         return true;
     }
 
+    // Shortcuts for the usual forms of the other standard types, with the
+    // data pushed directly. They give the same solutions as the templates
+    // below, without walking the script once per template.
+    unsigned int nSize = scriptPubKey.size();
+    if (nSize == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == 20 &&
+        scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEYHASH;
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin()+3, scriptPubKey.begin()+23));
+        return true;
+    }
+    if (((nSize == 35 && scriptPubKey[0] == 33) || (nSize == 67 && scriptPubKey[0] == 65)) && scriptPubKey[nSize-1] == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEY;
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin()+1, scriptPubKey.begin()+nSize-1));
+        return true;
+    }
+    if (SolveMultisig(scriptPubKey, vSolutionsRet))
+    {
+        typeRet = TX_MULTISIG;
+        return true;
+    }
+
     // Scan templates
     const CScript& script1 = scriptPubKey;
     BOOST_FOREACH(const PAIRTYPE(txnouttype, CScript)& tplate, mTemplates)
@@ -1855,14 +1976,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashContext* pSigHash)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pSigHash))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pSigHash))
         return false;
     if (stack.empty())
         return false;
@@ -1885,7 +2006,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pSigHash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1895,14 +2016,14 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* pSigHash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = pSigHash ? pSigHash->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1916,21 +2037,21 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = pSigHash ? pSigHash->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        txin.scriptSig << valtype(subscript.begin(), subscript.end());
         if (!fSolved) return false;
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0, pSigHash);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* pSigHash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1938,7 +2059,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pSigHash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -2117,9 +2238,9 @@ bool CScript::IsPayToScriptHash() const
 {
     // Extra-fast test for pay-to-script-hash CScripts:
     return (this->size() == 23 &&
-            this->at(0) == OP_HASH160 &&
-            this->at(1) == 0x14 &&
-            this->at(22) == OP_EQUAL);
+            (*this)[0] == OP_HASH160 &&
+            (*this)[1] == 0x14 &&
+            (*this)[22] == OP_EQUAL);
 }
 
 bool CScript::HasCanonicalPushes() const
@@ -5,14 +5,18 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <openssl/sha.h>
 
 #include "keystore.h"
 #include "bignum.h"
 #include "base58.h"
+#include "sha256.h"
 
 typedef std::vector<uint8_t> valtype;
 
@@ -258,6 +262,95 @@ enum opcodetype
 
 const char* GetOpName(opcodetype opcode);
 
+/** Numeric operand of the script interpreter. The values fit in 64 bits
+ *  since operands are at most 4 bytes long, the encoding is the same as
+ *  CBigNum::getvch()/setvch() so it can replace CBigNum in EvalScript.
+ */
+class CScriptNum
+{
+public:
+    static const size_t nDefaultMaxNumSize = 4;
+
+    explicit CScriptNum(int64_t n) : nValue(n) { }
+
+    explicit CScriptNum(const valtype& vch, size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw std::runtime_error("CScriptNum() : overflow");
+        nValue = Decode(vch);
+    }
+
+    bool operator==(const CScriptNum& rhs) const { return nValue == rhs.nValue; }
+    bool operator!=(const CScriptNum& rhs) const { return nValue != rhs.nValue; }
+    bool operator<=(const CScriptNum& rhs) const { return nValue <= rhs.nValue; }
+    bool operator< (const CScriptNum& rhs) const { return nValue <  rhs.nValue; }
+    bool operator>=(const CScriptNum& rhs) const { return nValue >= rhs.nValue; }
+    bool operator> (const CScriptNum& rhs) const { return nValue >  rhs.nValue; }
+
+    CScriptNum operator+(const CScriptNum& rhs) const { return CScriptNum(nValue + rhs.nValue); }
+    CScriptNum operator-(const CScriptNum& rhs) const { return CScriptNum(nValue - rhs.nValue); }
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+
+    int64_t GetInt64() const { return nValue; }
+
+    // Same clamping as CBigNum::getint32()
+    int getint32() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    valtype getvch() const
+    {
+        valtype vch;
+        Encode(vch);
+        return vch;
+    }
+
+    // Encode into an existing stack element, reusing its buffer
+    void Encode(valtype& vch) const
+    {
+        vch.clear();
+        if (nValue == 0)
+            return;
+
+        bool fNegative = nValue < 0;
+        uint64_t nAbs = fNegative ? -(uint64_t)nValue : (uint64_t)nValue;
+        while (nAbs)
+        {
+            vch.push_back(nAbs & 0xff);
+            nAbs >>= 8;
+        }
+
+        // The most significant bit is the sign, add a byte if it is taken
+        if (vch.back() & 0x80)
+            vch.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            vch.back() |= 0x80;
+    }
+
+private:
+    static int64_t Decode(const valtype& vch)
+    {
+        if (vch.empty())
+            return 0;
+
+        int64_t n = 0;
+        for (size_t i = 0; i < vch.size(); i++)
+            n |= (int64_t)vch[i] << (8 * i);
+
+        // Sign and magnitude, negative zero is zero
+        if (vch.back() & 0x80)
+            return -(int64_t)(n & ~((int64_t)0x80 << (8 * (vch.size() - 1))));
+        return n;
+    }
+
+    int64_t nValue;
+};
+
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
@@ -278,8 +371,9 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
     return str;
 }
 
-// Serialized script, used inside transaction inputs and outputs
-class CScript : public std::vector<uint8_t>
+/** Serialized script, used inside transaction inputs and outputs. Scripts
+ * up to 28 bytes, which covers most of them, are kept inline. */
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64_t n)
@@ -312,11 +406,8 @@ protected:
 
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<uint8_t>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<uint8_t>(pbegin, pend) { }
-#ifndef _MSC_VER
-    CScript(const uint8_t* pbegin, const uint8_t* pend) : std::vector<uint8_t>(pbegin, pend) { }
-#endif
+    CScript(const_iterator pbegin, const_iterator pend) : CScriptBase(pbegin, pend) { }
+    CScript(std::vector<uint8_t>::const_iterator pbegin, std::vector<uint8_t>::const_iterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -628,11 +719,32 @@ public:
     }
 };
 
+/** Signature hashing data of a transaction, computed once and shared by all
+ *  its inputs. Holds the SHA256 midstates of the serialization up to every
+ *  input and the serialized remainder, so a SIGHASH_ALL hash only hashes the
+ *  part after the input being signed. The scriptSigs of the transaction may
+ *  change after construction, they are blanked in the signature hash anyway.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction* ptxTo;
+    std::vector<sha256_ctx> vMidstates; // state before input i
+    std::vector<unsigned char> vchTail; // blanked inputs, outputs and lock time
+    std::vector<unsigned int> vInputOffset; // position of input i in vchTail
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsDERSignature(const valtype &vchSig, bool fWithHashType=false, bool fCheckLow=false);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* pSigHash=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -643,9 +755,9 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractAddress(const CKeyStore &keystore, const CScript& scriptPubKey, CBitcoinAddress& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* pSigHash=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* pSigHash=NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* pSigHash=NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -7,6 +7,15 @@
 
 #define SCRYPT_BUFFER_SIZE (131072 + 63)
 
+// A 64-byte aligned scratchpad of at least nSize bytes owned by the calling
+//   thread, valid until its next call
+void *scrypt_scratchpad(size_t nSize);
+
 uint256 scrypt_blockhash(const uint8_t* input);
 
+// Hash n block headers at once, interleaving them over the lanes of a
+//   vector scrypt core where the CPU has one
+void scrypt_blockhash_n(const uint8_t *const *pinputs, uint256 *phashes, unsigned int n);
+const char *scrypt_blockhash_impl();
+
 #endif // SCRYPT_H
@@ -27,10 +27,12 @@
 #include <inttypes.h>
 
 #include "allocators.h"
+#include "prevector.h"
 #include "version.h"
 
 
 class CScript;
+typedef prevector<28, unsigned char> CScriptBase; // storage of CScript
 class CDataStream;
 class CAutoFile;
 static const unsigned int MAX_SIZE = 0x02000000;
@@ -388,6 +390,11 @@ template<typename Stream, typename T, typename A> void Unserialize_impl(Stream&
 template<typename Stream, typename T, typename A> void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const boost::false_type&);
 template<typename Stream, typename T, typename A> inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersion);
 
+// prevector
+template<unsigned int N, typename T> unsigned int GetSerializeSize(const prevector<N, T>& v, int nType, int nVersion);
+template<typename Stream, unsigned int N, typename T> void Serialize(Stream& os, const prevector<N, T>& v, int nType, int nVersion);
+template<typename Stream, unsigned int N, typename T> void Unserialize(Stream& is, prevector<N, T>& v, int nType, int nVersion);
+
 // others derived from vector
 extern inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion);
 template<typename Stream> void Serialize(Stream& os, const CScript& v, int nType, int nVersion);
@@ -561,24 +568,59 @@ inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersio
 
 
 
+//
+// prevector, same encoding as a vector of fundamental types
+//
+template<unsigned int N, typename T>
+unsigned int GetSerializeSize(const prevector<N, T>& v, int nType, int nVersion)
+{
+    return (unsigned int)(GetSizeOfCompactSize(v.size()) + v.size() * sizeof(T));
+}
+
+template<typename Stream, unsigned int N, typename T>
+void Serialize(Stream& os, const prevector<N, T>& v, int nType, int nVersion)
+{
+    WriteCompactSize(os, v.size());
+    if (!v.empty())
+        os.write((char*)v.data(), (int)(v.size() * sizeof(T)));
+}
+
+template<typename Stream, unsigned int N, typename T>
+void Unserialize(Stream& is, prevector<N, T>& v, int nType, int nVersion)
+{
+    // Limit size per read so bogus size value won't cause out of memory
+    v.clear();
+    unsigned int nSize = (unsigned int)(ReadCompactSize(is));
+    unsigned int i = 0;
+    while (i < nSize)
+    {
+        unsigned int blk = std::min(nSize - i, (unsigned int)(1 + 4999999 / sizeof(T)));
+        v.resize(i + blk);
+        is.read((char*)&v[i], blk * sizeof(T));
+        i += blk;
+    }
+}
+
+
+
 //
 // others derived from vector
 //
 inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
 {
-    return GetSerializeSize((const std::vector<unsigned char>&)v, nType, nVersion);
+    return GetSerializeSize((const CScriptBase&)v, nType, nVersion);
 }
 
 template<typename Stream>
 void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
 {
-    Serialize(os, (const std::vector<unsigned char>&)v, nType, nVersion);
+    Serialize(os, (const CScriptBase&)v, nType, nVersion);
 }
 
 template<typename Stream>
 void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
 {
-    Unserialize(is, (std::vector<unsigned char>&)v, nType, nVersion);
+    Unserialize(is, (CScriptBase&)v, nType, nVersion);
 }
 
 
@@ -806,6 +848,13 @@ public:
         Init(nTypeIn, nVersionIn);
     }
 
+protected:
+    CDataStream(int nTypeIn, int nVersionIn, const allocator_type& alloc) : vch(alloc)
+    {
+        Init(nTypeIn, nVersionIn);
+    }
+
+public:
     void Init(int nTypeIn, int nVersionIn)
     {
         nReadPos = 0;
@@ -1054,7 +1103,18 @@ public:
 
     void GetAndClear(CSerializeData &data) {
         vch.swap(data);
-        CSerializeData().swap(vch);
+        CSerializeData(vch.get_allocator()).swap(vch);
+    }
+};
+
+/** A CDataStream for data that is public anyway, like blocks, transactions,
+ *  network messages and the chain database. Its buffers are not wiped when
+ *  freed, which CDataStream does in case they held key material. */
+class CPublicDataStream : public CDataStream
+{
+public:
+    explicit CPublicDataStream(int nTypeIn, int nVersionIn) : CDataStream(nTypeIn, nVersionIn, allocator_type(false))
+    {
     }
 };
 
@@ -1182,6 +1242,70 @@ public:
     }
 };
 
+/** Read-only stream over memory it does not own, like a memory mapped file,
+ *  a database value or a buffer that outlives the parse. Objects are
+ *  unserialized straight from the memory, without a copy. It takes anything
+ *  a CDataStream can be read into. */
+class CMemoryReader
+{
+protected:
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pcur = pbegin;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    bool eof() const             { return pcur == pend; }
+    const char* data() const     { return pcur; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Wrapper around a FILE* that implements a ring buffer to
  *  deserialize from. It guarantees the ability to rewind
  *  a given number of bytes. */
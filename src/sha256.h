@@ -0,0 +1,47 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "uint256.h"
+
+// Maximum number of kernel hashes computed by one sha256d_kernel_n() call
+#define SHA256_KERNEL_LANES 8
+
+// Precalculated context for the 28-byte stake kernel
+typedef struct
+{
+    uint32_t W[6];     // static part of the message (first 24 bytes of kernel)
+    uint32_t state[8]; // state after the first six rounds of compression
+} sha256_kernel_ctx;
+
+/* Precalculate context for the kernel with given 24-byte static part */
+void sha256_kernel_init(sha256_kernel_ctx *ctx, const uint8_t *kernel);
+
+/* Compute double SHA256 of up to SHA256_KERNEL_LANES kernels which only differ by the trailing nTimeTx field */
+void sha256d_kernel_n(const sha256_kernel_ctx *ctx, const uint32_t *pnTimeTx, uint256 *phashes, unsigned int n);
+
+/* Name of the kernel hashing implementation selected at runtime */
+const char *sha256_kernel_impl();
+
+// Streaming SHA256, the compression function is selected at runtime
+typedef struct
+{
+    uint32_t state[8];
+    uint8_t buf[64];
+    uint64_t nBytes;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+/* Write the 32-byte digest, ctx has to be initialized again for reuse */
+void sha256_final(sha256_ctx *ctx, uint8_t *hash);
+void sha256(const void *data, size_t len, uint8_t *hash);
+
+/* Double SHA256 of n consecutive 64-byte inputs, e.g. pairs of merkle tree nodes */
+void sha256d64(uint8_t *out, const uint8_t *in, size_t n);
+
+/* Name of the SHA256 implementation selected at runtime */
+const char *sha256_impl();
+
+#endif // SHA256_H
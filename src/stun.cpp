@@ -50,6 +50,7 @@
 
 #include "ministun.h"
 #include "netbase.h"
+#include "util.h"
 
 extern int GetRandInt(int nMax);
 extern uint64_t GetRand(uint64_t nMax);
@@ -559,6 +560,9 @@ static struct StunSrv StunSrvList[] = {
 
 static const int StunSrvListQty = sizeof(StunSrvList) / sizeof(StunSrv);
 
+// Servers asked at once
+static const int STUN_PARALLEL = 4;
+
 /* wrapper to send an STUN message */
 static int stun_send(int s, struct sockaddr_in *dst, struct stun_header *resp)
 {
@@ -677,79 +681,121 @@ static int stun_get_mapped(struct stun_attr *attr, void *arg)
 }
 
 /*---------------------------------------------------------------------*/
+// Asks the nQty servers at pos[] at once, from one socket, and waits for
+// their answers together until STUN_TIMEOUT. The mapped address reported
+// by most of them is taken, as soon as two agree or all have answered.
+// Retval: number of servers which reported it, <0 on failure
 
-static int StunRequest2(int sock, struct sockaddr_in *server, struct sockaddr_in *mapped) {
+static int StunRequestRound(const uint16_t *pos, int nQty, struct sockaddr_in *mapped, const char **srv) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock == INVALID_SOCKET)
+        return -2;
 
-    struct stun_header *req;
-    unsigned char reqdata[1024];
+    struct sockaddr_in client = {};
+    client.sin_family = AF_INET;
+    client.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(sock, (struct sockaddr*)&client, sizeof(client)) < 0) {
+        CloseSocket(sock);
+        return -3;
+    }
 
-    req = (struct stun_header *)reqdata;
-    stun_req_id(req);
-    unsigned short reqlen = 0;
-    req->msgtype = 0;
-    req->msglen = 0;
-    req->msglen = htons(reqlen);
-    req->msgtype = htons(STUN_BINDREQ);
+    struct stun_header req;
+    stun_req_id(&req);
+    req.msglen = htons(0);
+    req.msgtype = htons(STUN_BINDREQ);
+
+    struct sockaddr_in servers[STUN_PARALLEL];
+    const char *names[STUN_PARALLEL];
+    bool answered[STUN_PARALLEL];
+    int nSent = 0;
+    for(int i = 0; i < nQty && nSent < STUN_PARALLEL; i++) {
+        struct hostent *hostinfo = gethostbyname(StunSrvList[pos[i]].name);
+        if(hostinfo == NULL)
+            continue;
+        struct sockaddr_in &server = servers[nSent];
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_addr = *(struct in_addr*) hostinfo->h_addr;
+        server.sin_port = htons(StunSrvList[pos[i]].port);
+        if(stun_send(sock, &server, &req) < 0)
+            continue;
+        names[nSent] = StunSrvList[pos[i]].name;
+        answered[nSent] = false;
+        nSent++;
+    }
 
-    unsigned char reply_buf[1024];
-    fd_set rfds;
-    struct timeval to = { STUN_TIMEOUT, 0 };
+    // Distinct mapped addresses, and how many servers reported each
+    struct sockaddr_in results[STUN_PARALLEL];
+    int votes[STUN_PARALLEL];
+    int nResults = 0, nAnswered = 0, best = -1;
+    int64_t nDeadline = GetTimeMillis() + STUN_TIMEOUT * 1000;
+    while(nAnswered < nSent && (best < 0 || votes[best] < 2)) {
+        int64_t nWait = nDeadline - GetTimeMillis();
+        if(nWait <= 0)
+            break;
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        struct timeval to = { (long)(nWait / 1000), (long)(nWait % 1000) * 1000 };
+        if(select(sock + 1, &rfds, NULL, NULL, &to) <= 0)  /* timeout or error */
+            break;
+
+        unsigned char reply_buf[1024];
+        struct sockaddr_in src = {};
 #ifdef WIN32
-    int srclen;
+        int srclen = sizeof(src);
 #else
-    socklen_t srclen;
+        socklen_t srclen = sizeof(src);
 #endif
+        /* XXX pass -1 in the size, because stun_handle_packet might
+       * write past the end of the buffer.
+       */
+        int res = recvfrom(sock, (char *)reply_buf, sizeof(reply_buf) - 1,
+                           0, (struct sockaddr *)&src, &srclen);
+        if(res < (int)sizeof(struct stun_header))
+            continue;
+
+        // Only the first answer of a server asked, to this request
+        int i;
+        for(i = 0; i < nSent; i++)
+            if(servers[i].sin_addr.s_addr == src.sin_addr.s_addr && servers[i].sin_port == src.sin_port)
+                break;
+        if(i == nSent || answered[i] || memcmp(&((struct stun_header *)reply_buf)->id, &req.id, sizeof(req.id)) != 0)
+            continue;
+        answered[i] = true;
+        nAnswered++;
+
+        struct sockaddr_in addr = {};
+        if(stun_handle_packet(sock, &src, reply_buf, res, stun_get_mapped, &addr) < 0 || addr.sin_addr.s_addr == 0)
+            continue;
+        int j;
+        for(j = 0; j < nResults; j++)
+            if(results[j].sin_addr.s_addr == addr.sin_addr.s_addr)
+                break;
+        if(j == nResults) {
+            results[nResults] = addr;
+            votes[nResults++] = 0;
+        }
+        if(++votes[j] > (best < 0 ? 0 : votes[best])) {
+            best = j;
+            *srv = names[i];
+        }
+    }
+    CloseSocket(sock);
 
-    int res = stun_send(sock, server, req);
-    if(res < 0)
-        return -10;
-    FD_ZERO(&rfds);
-    FD_SET(sock, &rfds);
-    res = select(sock + 1, &rfds, NULL, NULL, &to);
-    if (res <= 0)  /* timeout or error */
-        return -11;
-    struct sockaddr_in src = {};
-    srclen = sizeof(src);
-    /* XXX pass -1 in the size, because stun_handle_packet might
-   * write past the end of the buffer.
-   */
-    res = recvfrom(sock, (char *)reply_buf, sizeof(reply_buf) - 1,
-                   0, (struct sockaddr *)&src, &srclen);
-    if (res <= 0)
-        return -12;
-    return stun_handle_packet(sock, &src, reply_buf, res, stun_get_mapped, mapped);
-} // StunRequest2
-
-/*---------------------------------------------------------------------*/
-static int StunRequest(const char *host, uint16_t port, struct sockaddr_in *mapped) {
-    struct hostent *hostinfo = gethostbyname(host);
-    if(hostinfo == NULL)
+    if(nSent == 0)
         return -1;
-
-    SOCKET sock = INVALID_SOCKET;
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if(sock == INVALID_SOCKET)
-        return -2;
-
-    struct sockaddr_in server = {}, client = {};
-
-    server.sin_family = client.sin_family = AF_INET;
-    server.sin_addr = *(struct in_addr*) hostinfo->h_addr;
-    server.sin_port = htons(port);
-    client.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    int rc = -3;
-    if(bind(sock, (struct sockaddr*)&client, sizeof(client)) >= 0)
-        rc = StunRequest2(sock, &server, mapped);
-    CloseSocket(sock);
-    return rc;
-} // StunRequest
+    if(best < 0)
+        return -11;
+    *mapped = results[best];
+    return votes[best];
+} // StunRequestRound
 
 /*---------------------------------------------------------------------*/
 // Input: two random values (pos, step) for generate uniuqe way over server
 // list
 // Output: populate struct struct mapped
-// Retval:
+// Retval: the round which found it, STUN_PARALLEL servers are asked in each
 
 int GetExternalIPbySTUN(uint64_t rnd, struct sockaddr_in *mapped, const char **srv) {
     randfiller    = rnd;
@@ -766,14 +812,14 @@ int GetExternalIPbySTUN(uint64_t rnd, struct sockaddr_in *mapped, const char **s
        } while(b != 0);
   } while(a != 1);
 
-    uint16_t attempt;
-    for(attempt = 1; attempt < StunSrvListQty * 2; attempt++) {
-        pos = (pos + step) % StunSrvListQty;
-        int rc = StunRequest(*srv = StunSrvList[pos].name, StunSrvList[pos].port, mapped);
-        if(rc >= 0)
-            return attempt;
-        // fprintf(stderr, "Lookup: %s:%u\t%s\t%d\n", StunSrvList[pos].name,
-        // StunSrvList[pos].port, inet_ntoa(mapped->sin_addr), rc);
+    int round;
+    for(round = 1; round <= StunSrvListQty * 2 / STUN_PARALLEL; round++) {
+        uint16_t vPos[STUN_PARALLEL];
+        for(int i = 0; i < STUN_PARALLEL; i++)
+            vPos[i] = pos = (pos + step) % StunSrvListQty;
+        int rc = StunRequestRound(vPos, STUN_PARALLEL, mapped, srv);
+        if(rc > 0)
+            return round;
     }
     return -1;
 }
@@ -15,6 +15,80 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+#ifdef DEBUG_LOCKSTATS
+//
+// Lock contention profiling: the wait for and the hold of every lock taken
+// through LOCK, LOCK2 and TRY_LOCK are added up per place in the code.
+// The places are told apart by the __FILE__ and lock name pointers and the
+// line, a lock in an inline function may so show up once for every file
+// including it.
+//
+typedef std::pair<std::pair<const char*, const char*>, int> LockSiteKey;
+typedef std::map<LockSiteKey, CLockSiteStats> LockStatsMap;
+
+static boost::mutex* pmutexLockStats = NULL;
+static LockStatsMap* pmapLockStats = NULL;
+static boost::once_flag lockStatsInitFlag = BOOST_ONCE_INIT;
+
+// On the heap, locks are still taken by global destructors
+static void InitLockStats()
+{
+    pmutexLockStats = new boost::mutex();
+    pmapLockStats = new LockStatsMap();
+}
+
+int64_t LockStatsTime()
+{
+    return GetTimeMicros();
+}
+
+void RecordLockStats(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWaitUsec, int64_t nHoldUsec)
+{
+    boost::call_once(InitLockStats, lockStatsInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexLockStats);
+    CLockSiteStats& stats = (*pmapLockStats)[std::make_pair(std::make_pair(pszFile, pszName), nLine)];
+    if (stats.nLocks == 0)
+    {
+        stats.strName = pszName;
+        stats.strFile = pszFile;
+        stats.nLine = nLine;
+    }
+    stats.nLocks++;
+    if (fContended)
+        stats.nContended++;
+    stats.nWaitUsec += nWaitUsec;
+    stats.nMaxWaitUsec = std::max(stats.nMaxWaitUsec, nWaitUsec);
+    stats.nHoldUsec += nHoldUsec;
+    stats.nMaxHoldUsec = std::max(stats.nMaxHoldUsec, nHoldUsec);
+}
+
+void GetLockStats(std::vector<CLockSiteStats>& vStats)
+{
+    boost::call_once(InitLockStats, lockStatsInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexLockStats);
+    vStats.clear();
+    vStats.reserve(pmapLockStats->size());
+    BOOST_FOREACH(const LockStatsMap::value_type& item, *pmapLockStats)
+        vStats.push_back(item.second);
+}
+
+void ResetLockStats()
+{
+    boost::call_once(InitLockStats, lockStatsInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexLockStats);
+    pmapLockStats->clear();
+}
+#else
+void GetLockStats(std::vector<CLockSiteStats>& vStats)
+{
+    vStats.clear();
+}
+
+void ResetLockStats()
+{
+}
+#endif /* DEBUG_LOCKSTATS */
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
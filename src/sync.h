@@ -9,7 +9,11 @@
 #include <boost/thread/recursive_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
+#include <string>
+#include <vector>
+#include <stdint.h>
 
 
 
@@ -19,6 +23,9 @@ typedef boost::recursive_mutex CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef boost::mutex CWaitableCriticalSection;
 
+/** Wrapped boost shared mutex: many readers or one writer, not recursive */
+typedef boost::shared_mutex CSharedCriticalSection;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -31,12 +38,79 @@ void static inline LeaveCritical() {}
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Totals of the waits for and holds of a lock at one place in the code */
+struct CLockSiteStats
+{
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nLocks;
+    uint64_t nContended; // had to wait for another thread
+    int64_t nWaitUsec;
+    int64_t nMaxWaitUsec;
+    int64_t nHoldUsec;
+    int64_t nMaxHoldUsec;
+
+    CLockSiteStats() : nLine(0), nLocks(0), nContended(0), nWaitUsec(0), nMaxWaitUsec(0), nHoldUsec(0), nMaxHoldUsec(0) {}
+};
+
+#ifdef DEBUG_LOCKSTATS
+int64_t LockStatsTime();
+void RecordLockStats(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWaitUsec, int64_t nHoldUsec);
+
+/** Times one hold of a lock taken by LOCK, LOCK2 or TRY_LOCK */
+class CLockTimer
+{
+private:
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    int64_t nStart;
+    int64_t nAcquired;
+    bool fActive;
+
+public:
+    bool fContended;
+
+    CLockTimer() : fActive(false), fContended(false) {}
+
+    void Begin(const char* pszNameIn, const char* pszFileIn, int nLineIn)
+    {
+        pszName = pszNameIn;
+        pszFile = pszFileIn;
+        nLine = nLineIn;
+        fContended = false;
+        nStart = LockStatsTime();
+    }
+
+    void Acquired()
+    {
+        nAcquired = LockStatsTime();
+        fActive = true;
+    }
+
+    void End()
+    {
+        if (fActive)
+            RecordLockStats(pszName, pszFile, nLine, fContended, nAcquired - nStart, LockStatsTime() - nAcquired);
+        fActive = false;
+    }
+};
+#endif
+
+// Statistics per lock site, empty unless built with DEBUG_LOCKSTATS
+void GetLockStats(std::vector<CLockSiteStats>& vStats);
+void ResetLockStats();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template<typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+#ifdef DEBUG_LOCKSTATS
+    CLockTimer timer;
+#endif
 public:
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
@@ -44,14 +118,25 @@ public:
         if (!lock.owns_lock())
         {
             EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
+#ifdef DEBUG_LOCKSTATS
+            timer.Begin(pszName, pszFile, nLine);
+#endif
+#if defined(DEBUG_LOCKCONTENTION) || defined(DEBUG_LOCKSTATS)
             if (!lock.try_lock())
             {
+#ifdef DEBUG_LOCKCONTENTION
                 PrintLockContention(pszName, pszFile, nLine);
 #endif
-            lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+#ifdef DEBUG_LOCKSTATS
+                timer.fContended = true;
+#endif
+                lock.lock();
             }
+#else
+            lock.lock();
+#endif
+#ifdef DEBUG_LOCKSTATS
+            timer.Acquired();
 #endif
         }
     }
@@ -60,6 +145,9 @@ public:
     {
         if (lock.owns_lock())
         {
+#ifdef DEBUG_LOCKSTATS
+            timer.End();
+#endif
             lock.unlock();
             LeaveCritical();
         }
@@ -70,9 +158,16 @@ public:
         if (!lock.owns_lock())
         {
             EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()), true);
+#ifdef DEBUG_LOCKSTATS
+            timer.Begin(pszName, pszFile, nLine);
+#endif
             lock.try_lock();
             if (!lock.owns_lock())
                 LeaveCritical();
+#ifdef DEBUG_LOCKSTATS
+            else
+                timer.Acquired();
+#endif
         }
         return lock.owns_lock();
     }
@@ -88,7 +183,12 @@ public:
     ~CMutexLock()
     {
         if (lock.owns_lock())
+        {
+#ifdef DEBUG_LOCKSTATS
+            timer.End();
+#endif
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -108,6 +208,9 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> readlock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> writelock(cs)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
@@ -16,6 +16,7 @@ private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
 public:
+    void CompactAfterBulkLoad() { }
 
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
@@ -37,7 +38,19 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool ReadModifierUpgradeTime(unsigned int& nUpgradeTime);
     bool WriteModifierUpgradeTime(const unsigned int& nUpgradeTime);
+    // The optional address and spent output indexes need LevelDB range scans
+    bool ReadIndexFlag(const std::string& strName, bool& fValue) { fValue = false; return false; }
+    bool WriteIndexFlag(const std::string& strName, bool fValue) { return false; }
+    bool WriteAddrIndex(const CAddrIndexKey& key, int nHeight) { return false; }
+    bool EraseAddrIndex(const CAddrIndexKey& key) { return false; }
+    bool ReadAddrIndex(unsigned char nAddrType, const uint160& hashAddr, std::vector<std::pair<uint256, int> >& vTxs) { return false; }
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value) { return false; }
+    bool WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value) { return false; }
+    bool EraseSpentIndex(const COutPoint& outpoint) { return false; }
+    bool EraseIndex(const std::string& strName) { return false; }
+    bool ForEachTxIndex(const boost::function<bool (const uint256&, const CTxIndex&)>& func) { return false; }
     bool LoadBlockIndex();
+    static void GetMemoryUsage(MemoryUsageMap& mapUsage) {}
 private:
     bool LoadBlockIndexGuts();
 };
@@ -8,6 +8,7 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -19,20 +20,409 @@
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
+#include "metrics.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Node-wide cache of the transaction index entries in front of LevelDB.
+//
+// It only ever holds committed data: the writes of a batch are applied when
+// the batch is written at TxnCommit, i.e. on block boundaries, and are simply
+// dropped by TxnAbort. Readers that miss fill the cache with what they read
+// from disk, unless a commit happened in the meantime and their value may be
+// stale already.
+class CTxIndexCache
+{
+private:
+    std::map<uint256, CTxIndex> mapTxIndex;
+    size_t nUsage;
+    size_t nMaxUsage;
+    uint64_t nGeneration;
+    CCriticalSection cs_txindexcache;
+
+    static size_t Usage(const CTxIndex& txindex)
+    {
+        // Rough estimation of a map node holding this entry
+        return sizeof(uint256) + sizeof(CTxIndex) + 4 * sizeof(void*) +
+            txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+    }
+
+    void EraseEntry(std::map<uint256, CTxIndex>::iterator it)
+    {
+        nUsage -= Usage(it->second);
+        mapTxIndex.erase(it);
+    }
+
+    void Store(const uint256& hash, const CTxIndex& txindex)
+    {
+        std::map<uint256, CTxIndex>::iterator it = mapTxIndex.find(hash);
+        if (it != mapTxIndex.end())
+        {
+            nUsage -= Usage(it->second);
+            it->second = txindex;
+        }
+        else
+            it = mapTxIndex.insert(make_pair(hash, txindex)).first;
+        nUsage += Usage(it->second);
+
+        // Evict random entries, the same way the signature cache does
+        while (nUsage > nMaxUsage && mapTxIndex.size() > 1)
+        {
+            std::map<uint256, CTxIndex>::iterator itEvict = mapTxIndex.lower_bound(GetRandHash());
+            if (itEvict == mapTxIndex.end())
+                itEvict = mapTxIndex.begin();
+            if (itEvict->first == hash)
+                continue;
+            EraseEntry(itEvict);
+        }
+    }
+
+public:
+    CTxIndexCache() : nUsage(0), nMaxUsage(0), nGeneration(0) {}
+
+    void GetMemoryUsage(CMemoryUsage& usage)
+    {
+        LOCK(cs_txindexcache);
+        usage.nEntries = mapTxIndex.size();
+        usage.nUsage = nUsage;
+        usage.nLimit = nMaxUsage;
+    }
+
+    void SetMaxUsage(size_t nMaxUsageIn)
+    {
+        LOCK(cs_txindexcache);
+        nMaxUsage = nMaxUsageIn;
+    }
+
+    bool Get(const uint256& hash, CTxIndex& txindex)
+    {
+        LOCK(cs_txindexcache);
+        std::map<uint256, CTxIndex>::const_iterator it = mapTxIndex.find(hash);
+        if (it == mapTxIndex.end())
+        {
+            AddMetric(METRIC_TXINDEX_CACHE_MISSES, 1);
+            return false;
+        }
+        AddMetric(METRIC_TXINDEX_CACHE_HITS, 1);
+        txindex = it->second;
+        return true;
+    }
+
+    uint64_t GetGeneration()
+    {
+        LOCK(cs_txindexcache);
+        return nGeneration;
+    }
+
+    // Add an entry read from disk at the given generation
+    void Fill(const uint256& hash, const CTxIndex& txindex, uint64_t nGenerationRead)
+    {
+        LOCK(cs_txindexcache);
+        if (nMaxUsage == 0 || nGenerationRead != nGeneration)
+            return;
+        if (mapTxIndex.count(hash) == 0)
+            Store(hash, txindex);
+    }
+
+    // Apply an entry written to disk
+    void Update(const uint256& hash, const CTxIndex& txindex)
+    {
+        LOCK(cs_txindexcache);
+        nGeneration++;
+        if (nMaxUsage == 0)
+            return;
+        Store(hash, txindex);
+    }
+
+    // Apply an entry erased from disk
+    void Erase(const uint256& hash)
+    {
+        LOCK(cs_txindexcache);
+        nGeneration++;
+        std::map<uint256, CTxIndex>::iterator it = mapTxIndex.find(hash);
+        if (it != mapTxIndex.end())
+            EraseEntry(it);
+    }
+
+    void Clear()
+    {
+        LOCK(cs_txindexcache);
+        nGeneration++;
+        mapTxIndex.clear();
+        nUsage = 0;
+    }
+};
+
+static CTxIndexCache txIndexCache;
+
+// Compact on-disk encoding of the transaction index records, used from
+// DATABASE_VERSION 70508 on. The positions are varints and the spent flags
+// a bitmap, only the outputs actually spent store the position of their
+// spender, which leaves most records at a fraction of the fixed width size.
+class CTxIndexCompressor
+{
+private:
+    CTxIndex& txindex;
+
+    static unsigned int GetPosSize(const CDiskTxPos& pos)
+    {
+        if (pos.IsNull())
+            return 1;
+        return GetSizeOfVarInt(pos.nFile + 1) + GetSizeOfVarInt(pos.nBlockPos) + GetSizeOfVarInt(pos.nTxPos);
+    }
+
+    // The null position has nFile at its maximum, which becomes 0 here
+    template<typename Stream>
+    static void WritePos(Stream& s, const CDiskTxPos& pos)
+    {
+        WriteVarInt<Stream, uint32_t>(s, pos.nFile + 1);
+        if (pos.IsNull())
+            return;
+        WriteVarInt<Stream, uint32_t>(s, pos.nBlockPos);
+        WriteVarInt<Stream, uint32_t>(s, pos.nTxPos);
+    }
+
+    template<typename Stream>
+    static void ReadPos(Stream& s, CDiskTxPos& pos)
+    {
+        pos.nFile = ReadVarInt<Stream, uint32_t>(s) - 1;
+        if (pos.IsNull()) {
+            pos.SetNull();
+            return;
+        }
+        pos.nBlockPos = ReadVarInt<Stream, uint32_t>(s);
+        pos.nTxPos = ReadVarInt<Stream, uint32_t>(s);
+    }
+
+public:
+    CTxIndexCompressor(CTxIndex& txindexIn) : txindex(txindexIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = GetPosSize(txindex.pos) + GetSizeOfVarInt(txindex.vSpent.size());
+        nSize += (txindex.vSpent.size() + 7) / 8;
+        BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+            if (!pos.IsNull())
+                nSize += GetPosSize(pos);
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WritePos(s, txindex.pos);
+        unsigned int nOutputs = txindex.vSpent.size();
+        WriteVarInt<Stream, unsigned int>(s, nOutputs);
+
+        vector<unsigned char> vBits((nOutputs + 7) / 8, 0);
+        for (unsigned int i = 0; i < nOutputs; i++)
+            if (!txindex.vSpent[i].IsNull())
+                vBits[i / 8] |= 1 << (i % 8);
+        if (!vBits.empty())
+            s.write((const char*)&vBits[0], vBits.size());
+
+        BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+            if (!pos.IsNull())
+                WritePos(s, pos);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ReadPos(s, txindex.pos);
+        unsigned int nOutputs = ReadVarInt<Stream, unsigned int>(s);
+        if (nOutputs > MAX_BLOCK_SIZE)
+            throw std::ios_base::failure("CTxIndexCompressor::Unserialize() : too many outputs");
+
+        vector<unsigned char> vBits((nOutputs + 7) / 8, 0);
+        if (!vBits.empty())
+            s.read((char*)&vBits[0], vBits.size());
+
+        txindex.vSpent.assign(nOutputs, CDiskTxPos());
+        for (unsigned int i = 0; i < nOutputs; i++)
+            if (vBits[i / 8] & (1 << (i % 8)))
+                ReadPos(s, txindex.vSpent[i]);
+    }
+};
+
+// Rewrites the fixed width transaction index records of a version 70507
+// database with the compact encoding, committing in chunks. Each chunk
+// records the last key it rewrote so an interrupted upgrade resumes after
+// it, and the last one sets the new version in the same write.
+static bool UpgradeTxIndexRecords(leveldb::DB* pdb)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("tx");
+    string strPrefix = ssPrefix.str();
+
+    CDataStream ssProgressKey(SER_DISK, CLIENT_VERSION);
+    ssProgressKey << string("txUpgradeProgress");
+    CDataStream ssVersionKey(SER_DISK, CLIENT_VERSION);
+    ssVersionKey << string("version");
+    CDataStream ssVersion(SER_DISK, CLIENT_VERSION);
+    ssVersion << DATABASE_VERSION;
+
+    string strResume;
+    string strProgress;
+    if (pdb->Get(leveldb::ReadOptions(), ssProgressKey.str(), &strProgress).ok())
+    {
+        CDataStream ssProgress(strProgress.data(), strProgress.data() + strProgress.size(), SER_DISK, CLIENT_VERSION);
+        ssProgress >> strResume;
+    }
+
+    printf("%s the transaction index to the compact encoding...\n", strResume.empty() ? "Upgrading" : "Resuming the upgrade of");
+    int64_t nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
+    size_t nSizeBefore = 0, nSizeAfter = 0;
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    leveldb::WriteBatch batch;
+    try
+    {
+        if (strResume.empty())
+            iterator->Seek(strPrefix);
+        else
+        {
+            iterator->Seek(strResume);
+            if (iterator->Valid() && iterator->key() == leveldb::Slice(strResume))
+                iterator->Next();
+        }
+        for (; iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+        {
+            CMemoryReader ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            CTxIndex txindex;
+            ssValue >> txindex;
+
+            CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+            ssCompact << CTxIndexCompressor(txindex);
+            batch.Put(iterator->key(), ssCompact.str());
+            nSizeBefore += iterator->value().size();
+            nSizeAfter += ssCompact.size();
+
+            if (++nRecords % 10000 == 0)
+            {
+                CDataStream ssProgress(SER_DISK, CLIENT_VERSION);
+                ssProgress << iterator->key().ToString();
+                batch.Put(ssProgressKey.str(), ssProgress.str());
+                leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+                if (!status.ok())
+                    throw runtime_error(status.ToString());
+                batch.Clear();
+            }
+        }
+        batch.Delete(ssProgressKey.str());
+        batch.Put(ssVersionKey.str(), ssVersion.str());
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            throw runtime_error(status.ToString());
+    }
+    catch (std::exception& e) {
+        delete iterator;
+        return error("UpgradeTxIndexRecords() : %s", e.what());
+    }
+    delete iterator;
+
+    printf("Upgraded %u transaction index records from %" PRIszu " to %" PRIszu " bytes in %" PRId64 "ms\n",
+        nRecords, nSizeBefore, nSizeAfter, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Serialized size of the ("tx", hash) keys of the transaction index
+static const size_t TXINDEX_KEY_SIZE = 3 + sizeof(uint256);
+
+static bool ParseTxIndexKey(const leveldb::Slice& key, uint256& hash)
+{
+    if (key.size() != TXINDEX_KEY_SIZE || key[0] != 2 || key[1] != 't' || key[2] != 'x')
+        return false;
+    memcpy(&hash, key.data() + 3, sizeof(hash));
+    return true;
+}
+
+// Applies the transaction index changes of a committed batch to the cache
+static void UpdateTxIndexCache(const map<string, string>& mapPuts, const set<string>& setDeletes)
+{
+    uint256 hash;
+    for (map<string, string>::const_iterator it = mapPuts.begin(); it != mapPuts.end(); ++it)
+    {
+        if (!ParseTxIndexKey(it->first, hash))
+            continue;
+        CTxIndex txindex;
+        try {
+            CMemoryReader ssValue(it->second.data(), it->second.data() + it->second.size(), SER_DISK, CLIENT_VERSION);
+            CTxIndexCompressor compressor(txindex);
+            ssValue >> compressor;
+        }
+        catch (const std::exception&) {
+            txIndexCache.Erase(hash);
+            continue;
+        }
+        txIndexCache.Update(hash, txindex);
+    }
+    for (set<string>::const_iterator it = setDeletes.begin(); it != setDeletes.end(); ++it)
+        if (ParseTxIndexKey(*it, hash))
+            txIndexCache.Erase(hash);
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArgInt("-dbcache", 25);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.write_buffer_size = (size_t)std::max(1, GetArgInt("-dbwritebuffer", 4)) * 1048576;
+    options.max_open_files = std::max(16, GetArgInt("-dbmaxopenfiles", 1000));
+    options.block_size = (size_t)std::max(1, GetArgInt("-dbblocksize", 4)) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
+// Bulk load mode: while the chain is far behind, the database is opened with
+// a larger write buffer so that fewer and larger level-0 files get merged
+// down the levels, and the whole key range is compacted once synced.
+static bool fBulkLoad = false;
+static size_t nWriteBufferSize = 0;
+static boost::thread* pthreadCompact = NULL;
+
+// Whether the best block recorded in the database is missing or older than a
+// day, i.e. the node is going to download a large part of the chain
+static bool IsBestChainBehind(leveldb::DB* pdb)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("hashBestChain");
+    string strValue;
+    if (!pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok())
+        return true;
+
+    try {
+        uint256 hashBest;
+        CMemoryReader ssHash(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssHash >> hashBest;
+
+        CDataStream ssIndexKey(SER_DISK, CLIENT_VERSION);
+        ssIndexKey << make_pair(string("blockindex"), hashBest);
+        if (!pdb->Get(leveldb::ReadOptions(), ssIndexKey.str(), &strValue).ok())
+            return true;
+        CMemoryReader ssIndex(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        CDiskBlockIndex diskindex;
+        ssIndex >> diskindex;
+        return diskindex.nTime < GetTime() - nOneDay;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+static void ThreadCompactTxDB(leveldb::DB* pdb)
+{
+    RenameThread("42-dbcompact");
+    int64_t nStart = GetTimeMillis();
+    printf("ThreadCompactTxDB() : compacting the transaction database after the bulk load\n");
+    pdb->CompactRange(NULL, NULL);
+    printf("ThreadCompactTxDB() : done in %" PRId64 "ms\n", GetTimeMillis() - nStart);
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -57,10 +447,12 @@ void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
 
     filesystem::create_directory(directory);
     printf("Opening LevelDB in %s\n", directory.string().c_str());
+    int64_t nStart = GetTimeMillis();
     leveldb::Status status = leveldb::DB::Open(options, directory.string(), &txdb);
     if (!status.ok()) {
         throw runtime_error(strprintf("init_blockindex(): error opening database environment %s", status.ToString().c_str()));
     }
+    LogStartupPhase("leveldb open", nStart);
 }
 
 // CDB subclasses are created and destroyed VERY OFTEN. That's why
@@ -79,8 +471,8 @@ CTxDB::CTxDB(const char* pszMode)
     bool fCreate = strchr(pszMode, 'c');
 
     options = GetOptions();
+    txIndexCache.SetMaxUsage((size_t)GetArgInt("-dbcache", 25) * 1048576);
     options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
 
     init_blockindex(options); // Init directory
     pdb = txdb;
@@ -90,15 +482,22 @@ CTxDB::CTxDB(const char* pszMode)
         ReadVersion(nVersion);
         printf("Transaction index version is %d\n", nVersion);
 
-        if (nVersion < DATABASE_VERSION)
+        if (nVersion == 70507)
+        {
+            // Only the encoding of the transaction index changed since,
+            //   the upgrade sets the new version as it completes
+            if (!UpgradeTxIndexRecords(txdb))
+                throw runtime_error("CTxDB() : failed to upgrade the transaction index");
+            nVersion = DATABASE_VERSION;
+        }
+        else if (nVersion < DATABASE_VERSION)
         {
             printf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
             // Leveldb instance destruction
             delete txdb;
             txdb = pdb = NULL;
-            delete activeBatch;
-            activeBatch = NULL;
+            ClearBatch();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -117,19 +516,58 @@ CTxDB::CTxDB(const char* pszMode)
         fReadOnly = fTmp;
     }
 
+    // The write buffer of an open database cannot be resized, so the bulk
+    // load buffer is chosen here for the whole session
+    size_t nBulkWriteBuffer = (size_t)std::max(0, GetArgInt("-dbbulkwritebuffer", 64)) * 1048576;
+    if (nBulkWriteBuffer > options.write_buffer_size && IsBestChainBehind(txdb))
+    {
+        printf("Reopening LevelDB with a %" PRIszu "MB write buffer for the initial download\n", nBulkWriteBuffer / 1048576);
+        delete txdb;
+        txdb = pdb = NULL;
+        options.write_buffer_size = nBulkWriteBuffer;
+        options.create_if_missing = false;
+        init_blockindex(options);
+        pdb = txdb;
+        fBulkLoad = true;
+    }
+
+    nWriteBufferSize = options.write_buffer_size;
     printf("Opened LevelDB successfully\n");
 }
 
+void CTxDB::GetMemoryUsage(MemoryUsageMap& mapUsage)
+{
+    txIndexCache.GetMemoryUsage(mapUsage["txindexcache"]);
+
+    // LevelDB doesn't tell how full its block cache and write buffers are,
+    // so only their limits are known: one memtable and one being written out
+    CMemoryUsage& dbcache = mapUsage["leveldb"];
+    dbcache.nLimit = (uint64_t)GetArgInt("-dbcache", 25) * 1048576 + 2 * nWriteBufferSize;
+}
+
 void CTxDB::Close()
 {
+    if (pthreadCompact) {
+        pthreadCompact->join();
+        delete pthreadCompact;
+        pthreadCompact = NULL;
+    }
+    txIndexCache.Clear();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
     delete options.block_cache;
     options.block_cache = NULL;
-    delete activeBatch;
-    activeBatch = NULL;
+    ClearBatch();
+}
+
+void CTxDB::CompactAfterBulkLoad()
+{
+    if (!fBulkLoad || pthreadCompact)
+        return;
+    fBulkLoad = false;
+    pthreadCompact = new boost::thread(ThreadCompactTxDB, txdb);
 }
 
 bool CTxDB::TxnBegin()
@@ -143,8 +581,9 @@ bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
+    if (status.ok())
+        UpdateTxIndexCache(mapBatchPuts, setBatchDeletes);
+    ClearBatch();
     if (!status.ok()) {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
@@ -152,61 +591,62 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch index
+// keeps that a single lookup however large the batch grows.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    string strKey = key.str();
+    map<string, string>::const_iterator it = mapBatchPuts.find(strKey);
+    if (it != mapBatchPuts.end()) {
+        *value = it->second;
+        return true;
     }
-    return scanner.foundEntry;
+    if (setBatchDeletes.count(strKey)) {
+        *deleted = true;
+        return true;
+    }
+    return false;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(TXINDEX_KEY_SIZE);
+    ssKey << make_pair(string("tx"), hash);
+    string strValue;
+
+    // Pending changes of our own batch come first, then the cache
+    CTxIndexCompressor compressor(txindex);
+    if (activeBatch) {
+        bool deleted = false;
+        if (ScanBatch(ssKey, &strValue, &deleted))
+            return !deleted && ParseValue(strValue, compressor);
+    }
+    if (txIndexCache.Get(hash, txindex))
+        return true;
+
+    uint64_t nGeneration = txIndexCache.GetGeneration();
+    if (!ReadDb(ssKey, strValue) || !ParseValue(strValue, compressor))
+        return false;
+    txIndexCache.Fill(hash, txindex, nGeneration);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), CTxIndexCompressor(REF(txindex))))
+        return false;
+    // Batched writes reach the cache on commit
+    if (!activeBatch)
+        txIndexCache.Update(hash, txindex);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -216,7 +656,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -224,12 +664,19 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (!Erase(make_pair(string("tx"), hash)))
+        return false;
+    if (!activeBatch)
+        txIndexCache.Erase(hash);
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    CTxIndex txindex;
+    if (!activeBatch && txIndexCache.Get(hash, txindex))
+        return true;
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -314,26 +761,480 @@ bool CTxDB::WriteModifierUpgradeTime(const unsigned int& nUpgradeTime)
     return Write(string("nUpgradeTime"), nUpgradeTime);
 }
 
+bool CTxDB::ReadIndexFlag(const string& strName, bool& fValue)
+{
+    fValue = false;
+    return Read(make_pair(string("flag"), strName), fValue);
+}
+
+bool CTxDB::WriteIndexFlag(const string& strName, bool fValue)
+{
+    return Write(make_pair(string("flag"), strName), fValue);
+}
+
+bool CTxDB::WriteAddrIndex(const CAddrIndexKey& key, int nHeight)
+{
+    return Write(make_pair(string("addr"), key), nHeight);
+}
+
+bool CTxDB::EraseAddrIndex(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("addr"), key));
+}
+
+// The entries of an address share the serialized type and hash as a key
+// prefix, so they are found with a single range scan of the committed data.
+bool CTxDB::ReadAddrIndex(unsigned char nAddrType, const uint160& hashAddr, vector<pair<uint256, int> >& vTxs)
+{
+    vTxs.clear();
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(string("addr"), make_pair(nAddrType, hashAddr));
+    string strPrefix = ssPrefix.str();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    try
+    {
+        for (iterator->Seek(strPrefix); iterator->Valid(); iterator->Next())
+        {
+            if (!iterator->key().starts_with(strPrefix))
+                break;
+
+            CMemoryReader ssKey(iterator->key().data(), iterator->key().data() + iterator->key().size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            CAddrIndexKey key;
+            ssKey >> strType >> key;
+
+            CMemoryReader ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            int nHeight;
+            ssValue >> nHeight;
+
+            vTxs.push_back(make_pair(key.hashTx, nHeight));
+        }
+    }
+    catch (std::exception& e) {
+        delete iterator;
+        return error("ReadAddrIndex() : %s", e.what());
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value)
+{
+    return Write(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::EraseSpentIndex(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("spent"), outpoint));
+}
+
+// Drops every record of an optional index, committing the deletes in chunks
+// so that the whole index needs not be held in memory.
+bool CTxDB::EraseIndex(const string& strName)
+{
+    assert(!activeBatch);
+    if (fReadOnly)
+        assert(!"EraseIndex called on database in read-only mode");
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << strName;
+    string strPrefix = ssPrefix.str();
+
+    bool fDone = false;
+    while (!fDone)
+    {
+        leveldb::WriteBatch batch;
+        unsigned int nKeys = 0;
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        for (iterator->Seek(strPrefix); ; iterator->Next())
+        {
+            if (!iterator->Valid() || !iterator->key().starts_with(strPrefix))
+            {
+                fDone = true;
+                break;
+            }
+            if (nKeys++ >= 100000)
+                break;
+            batch.Delete(iterator->key());
+        }
+        delete iterator;
+
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            return error("EraseIndex() : %s", status.ToString().c_str());
+    }
+    return true;
+}
+
+bool CTxDB::ForEachTxIndex(const boost::function<bool (const uint256&, const CTxIndex&)>& func)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("tx");
+    string strPrefix = ssPrefix.str();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    try
+    {
+        for (iterator->Seek(strPrefix); iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+        {
+            uint256 hash;
+            if (!ParseTxIndexKey(iterator->key(), hash))
+                continue;
+            CTxIndex txindex;
+            CMemoryReader ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            CTxIndexCompressor compressor(txindex);
+            ssValue >> compressor;
+            if (!func(hash, txindex))
+                break;
+        }
+    }
+    catch (std::exception& e) {
+        delete iterator;
+        return error("ForEachTxIndex() : %s", e.what());
+    }
+    delete iterator;
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new(nothrow) CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = AllocBlockIndex();
+    WRITE_LOCK(cs_blockIndex);
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Block index records of one key range, read and unserialized by a loading thread
+struct CBlockIndexRange
+{
+    struct CEntry
+    {
+        uint256 hash;
+        uint256 hashPrev;
+        uint256 hashNext;
+        CBlockIndex index;
+        CBlockIndex* pindex; // final location, once linked
+    };
+
+    std::string strBegin;
+    std::string strEnd; // empty for the last range
+    std::vector<CEntry> vEntries;
+    bool fError;
+
+    CBlockIndexRange() : fError(false) {}
+};
+
+static bool CompareEntryHeight(const CBlockIndexRange::CEntry* a, const CBlockIndexRange::CEntry* b)
+{
+    return a->index.nHeight < b->index.nHeight;
+}
+
+static void LoadBlockIndexRange(leveldb::DB* pdb, const std::string& strPrefix, CBlockIndexRange* prange)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    try
+    {
+        for (iterator->Seek(prange->strBegin); iterator->Valid(); iterator->Next())
+        {
+            // Did we reach the end of the range?
+            if (fRequestShutdown || !iterator->key().starts_with(strPrefix))
+                break;
+            if (!prange->strEnd.empty() && iterator->key().compare(prange->strEnd) >= 0)
+                break;
+
+            CMemoryReader ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Construct block index object, it is linked to the others later
+            prange->vEntries.push_back(CBlockIndexRange::CEntry());
+            CBlockIndexRange::CEntry& entry = prange->vEntries.back();
+            CBlockIndex* pindexNew    = &entry.index;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            entry.hash = diskindex.GetBlockHash();
+            entry.hashPrev = diskindex.hashPrev;
+            entry.hashNext = diskindex.hashNext;
+            entry.pindex = NULL;
+        }
+    }
+    catch (std::exception& e) {
+        printf("LoadBlockIndex() : %s\n", e.what());
+        prange->fError = true;
+    }
+    delete iterator;
+}
+
+// The top of the best chain as it was under cs_main. The checks run against
+// it rather than the block index, which changes while they run.
+struct CBestChainSnapshot
+{
+    struct CEntry
+    {
+        CBlockIndex* pindex;
+        uint256 hash;
+        int nHeight;
+        unsigned int nFile;
+        unsigned int nBlockPos;
+    };
+    std::vector<CEntry> vBlocks; // best block first
+    std::map<std::pair<unsigned int, unsigned int>, int> mapHeightByPos;
+
+    // Takes the blocks down to nDepth below the best one, cs_main must be held
+    void Take(int nDepth)
+    {
+        vBlocks.clear();
+        mapHeightByPos.clear();
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && pindex->nHeight >= nBestHeight-nDepth; pindex = pindex->pprev)
+        {
+            CEntry entry;
+            entry.pindex = pindex;
+            entry.hash = pindex->GetBlockHash();
+            entry.nHeight = pindex->nHeight;
+            entry.nFile = pindex->nFile;
+            entry.nBlockPos = pindex->nBlockPos;
+            vBlocks.push_back(entry);
+            mapHeightByPos[make_pair(entry.nFile, entry.nBlockPos)] = entry.nHeight;
+        }
+    }
+};
+
+// Runs the -checklevel checks on one block of the snapshot, false if it is
+// bad. fReadError is set if the block itself can't be read.
+static bool CheckBestChainBlock(CTxDB& txdb, const CBestChainSnapshot& snapshot, unsigned int nBlock, int nCheckLevel, bool& fReadError)
+{
+    const CBestChainSnapshot::CEntry& entry = snapshot.vBlocks[nBlock];
+    CBlock block;
+    if (!block.ReadFromDisk(entry.nFile, entry.nBlockPos) || block.GetHash() != entry.hash)
+    {
+        fReadError = true;
+        return error("LoadBlockIndex() : block.ReadFromDisk failed at %d", entry.nHeight);
+    }
+    bool fGood = true;
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+    {
+        printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", entry.nHeight, entry.hash.ToString().c_str());
+        fGood = false;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel>1)
+    {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
+            {
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || entry.nFile != txindex.pos.nFile || entry.nBlockPos != txindex.pos.nBlockPos)
+                {
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
+                    {
+                        printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
+                        fGood = false;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        {
+                            printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                            fGood = false;
+                        }
+                }
+                // check level 4: check whether spent txouts were spent within the main chain
+                unsigned int nOutput = 0;
+                if (nCheckLevel>3)
+                {
+                    BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                    {
+                        if (!txpos.IsNull())
+                        {
+                            // spent by this block or one above it in the best chain
+                            std::map<std::pair<unsigned int, unsigned int>, int>::const_iterator mi = snapshot.mapHeightByPos.find(make_pair(txpos.nFile, txpos.nBlockPos));
+                            if (mi == snapshot.mapHeightByPos.end() || mi->second < entry.nHeight)
+                            {
+                                printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", entry.nHeight, entry.hash.ToString().c_str(), hashTx.ToString().c_str());
+                                fGood = false;
+                            }
+                            // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                            if (nCheckLevel>5)
+                            {
+                                CTransaction txSpend;
+                                if (!txSpend.ReadFromDisk(txpos))
+                                {
+                                    printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
+                                    fGood = false;
+                                }
+                                else if (!txSpend.CheckTransaction())
+                                {
+                                    printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
+                                    fGood = false;
+                                }
+                                else
+                                {
+                                    bool fFound = false;
+                                    BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                        if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                            fFound = true;
+                                    if (!fFound)
+                                    {
+                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                        fGood = false;
+                                    }
+                                }
+                            }
+                        }
+                        nOutput++;
+                    }
+                }
+            }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                 {
+                      CTxIndex txindex;
+                      if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                          if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          {
+                              printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                              fGood = false;
+                          }
+                 }
+            }
+        }
+    }
+    return fGood;
+}
+
+// Checks every nStep-th block of the snapshot, starting with nStart. vBad
+// gets 1 for bad blocks and 2 for blocks which can't be read.
+static void CheckBestChainBlocks(const CBestChainSnapshot* psnapshot, int nCheckLevel, unsigned int nStart, unsigned int nStep, vector<char>* pvBad)
+{
+    CTxDB txdb("r");
+    for (unsigned int i = nStart; i < psnapshot->vBlocks.size() && !fRequestShutdown; i += nStep)
+    {
+        bool fReadError = false;
+        if (!CheckBestChainBlock(txdb, *psnapshot, i, nCheckLevel, fReadError))
+            (*pvBad)[i] = fReadError ? 2 : 1;
+    }
+}
+
+// Verifies the last -checkblocks blocks of the best chain at -checklevel.
+// The blocks are independent of each other, so they are spread over as many
+// threads as the script checks use. pindexBad is set to the lowest bad
+// block, or NULL. Returns false if a block can't be read.
+static bool VerifyBestChain(CBlockIndex*& pindexBad)
+{
+    int nCheckLevel = GetArgInt("-checklevel", 1);
+    int nCheckDepth = GetArgInt( "-checkblocks", 2500);
+    CBestChainSnapshot snapshot;
+    {
+        LOCK(cs_main);
+        if (nCheckDepth == 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        snapshot.Take(nCheckDepth);
+    }
+
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    printf("Verifying last %i blocks at level %i using %u threads\n", nCheckDepth, nCheckLevel, nThreads);
+    vector<char> vBad(snapshot.vBlocks.size(), 0);
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CheckBestChainBlocks, &snapshot, nCheckLevel, i, nThreads, &vBad));
+    CheckBestChainBlocks(&snapshot, nCheckLevel, 0, nThreads, &vBad);
+    threads.join_all();
+
+    pindexBad = NULL;
+    for (unsigned int i = 0; i < snapshot.vBlocks.size(); i++)
+    {
+        if (vBad[i] == 2)
+            return false;
+        if (vBad[i])
+            pindexBad = snapshot.vBlocks[i].pindex;
+    }
+    return true;
+}
+
+// Reorganizes back to the parent of a bad block of the best chain
+static bool MoveBackFromBadBlock(CBlockIndex* pindexBad)
+{
+    CBlockIndex* pindexFork = pindexBad->pprev;
+    printf("MoveBackFromBadBlock() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+    CBlock block;
+    if (!block.ReadFromDisk(pindexFork))
+        return error("MoveBackFromBadBlock() : block.ReadFromDisk failed");
+    CTxDB txdb;
+    block.SetBestChain(txdb, pindexFork);
+    return true;
+}
+
+void ThreadCheckBlocks(void* parg)
+{
+    RenameThread("42-checkblocks");
+
+    int64_t nStart = GetTimeMillis();
+    CBlockIndex* pindexBad = NULL;
+    if (!VerifyBestChain(pindexBad))
+    {
+        strMiscWarning = _("Warning: a block of the best chain can't be read, the block files may be damaged!");
+        return;
+    }
+    if (pindexBad && !fRequestShutdown)
+    {
+        // The chain may have moved on meanwhile, the block is only given up
+        // if it still fails with the chain held still
+        LOCK(cs_main);
+        if (pindexBad->IsInMainChain())
+        {
+            CBestChainSnapshot snapshot;
+            snapshot.Take(nBestHeight - pindexBad->nHeight);
+            CTxDB txdb("r");
+            bool fReadError = false;
+            if (!CheckBestChainBlock(txdb, snapshot, snapshot.vBlocks.size() - 1, GetArgInt("-checklevel", 1), fReadError))
+                MoveBackFromBadBlock(pindexBad);
+        }
+    }
+    printf("ThreadCheckBlocks() : done in %" PRId64 "ms\n", GetTimeMillis() - nStart);
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -344,70 +1245,99 @@ bool CTxDB::LoadBlockIndex()
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
+    //
+    // The records are read and unserialized by several threads, each taking a
+    // range of keys. The first serialized byte of a block hash is its lowest
+    // one, which is evenly distributed, so the ranges split on it.
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("blockindex");
+    const string strPrefix = ssPrefix.str();
+
+    int nRanges = std::max(1, std::min(nScriptCheckThreads, 256));
+    vector<CBlockIndexRange> vRanges(nRanges);
+    for (int i = 0; i < nRanges; i++)
+    {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
+        uint256 hashBegin = i * 256 / nRanges;
+        ssKey << make_pair(string("blockindex"), hashBegin);
+        vRanges[i].strBegin = ssKey.str();
+        if (i > 0)
+            vRanges[i - 1].strEnd = vRanges[i].strBegin;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    if (nRanges == 1)
+        LoadBlockIndexRange(pdb, strPrefix, &vRanges[0]);
+    else
+    {
+        boost::thread_group group;
+        for (int i = 0; i < nRanges; i++)
+            group.create_thread(boost::bind(&LoadBlockIndexRange, pdb, boost::cref(strPrefix), &vRanges[i]));
+        group.join_all();
+    }
+
+    // Second pass: register all the loaded entries, then link them. The
+    // entries are moved to the block index arena in height order, so that
+    // walks along the chain stay within neighbouring memory.
+    vector<CBlockIndexRange::CEntry*> vEntries;
+    bool fError = false;
+    BOOST_FOREACH(CBlockIndexRange& range, vRanges)
+    {
+        fError |= range.fError;
+        BOOST_FOREACH(CBlockIndexRange::CEntry& entry, range.vEntries)
+            vEntries.push_back(&entry);
+    }
+    if (fError)
+        return error("LoadBlockIndex() : failed to read the block index");
+    if (fDebug)
+        printf("LoadBlockIndex() : loaded %" PRIszu " block index entries using %d threads\n", vEntries.size(), nRanges);
+    LogStartupPhase("index read", nStart);
+
+    nStart = GetTimeMillis();
+    stable_sort(vEntries.begin(), vEntries.end(), CompareEntryHeight);
+    {
+        WRITE_LOCK(cs_blockIndex);
+        mapBlockIndex.reserve(vEntries.size());
+        BOOST_FOREACH(CBlockIndexRange::CEntry* pentry, vEntries)
+        {
+            pentry->pindex = AllocBlockIndex();
+            *pentry->pindex = pentry->index;
+            BlockMap::iterator mi = mapBlockIndex.insert(make_pair(pentry->hash, pentry->pindex)).first;
+            pentry->pindex->phashBlock = &((*mi).first);
+        }
+    }
+
+    BOOST_FOREACH(const CBlockIndexRange::CEntry* pentry, vEntries)
+    {
+        CBlockIndex* pindexNew = pentry->pindex;
+        CBlockIndex* pindexPrev = InsertBlockIndex(pentry->hashPrev);
+        CBlockIndex* pindexNext = InsertBlockIndex(pentry->hashNext);
+        {
+            WRITE_LOCK(cs_blockIndex);
+            pindexNew->pprev = pindexPrev;
+            pindexNew->pnext = pindexNext;
+        }
 
         // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+        if (pindexGenesisBlock == NULL && pentry->hash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
             pindexGenesisBlock = pindexNew;
 
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
+        if (!pindexNew->CheckIndex())
             return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
         // 42: build setStakeSeen
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-        iterator->Next();
+        AddBlockIndexPos(pindexNew);
     }
-    delete iterator;
+    LogStartupPhase("index link", nStart);
 
     if (fRequestShutdown)
         return true;
 
     // Calculate nChainTrust
+    nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -420,11 +1350,13 @@ bool CTxDB::LoadBlockIndex()
     {
         CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->BuildSkip();
         // 42: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016" PRIx64, pindex->nHeight, pindex->nStakeModifier);
     }
+    LogStartupPhase("chain trust", nStart);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -435,9 +1367,13 @@ bool CTxDB::LoadBlockIndex()
     }
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
-    pindexBest = mapBlockIndex[hashBestChain];
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexBest->nChainTrust;
+    {
+        WRITE_LOCK(cs_blockIndex);
+        pindexBest = LookupBlockIndex(hashBestChain);
+        SetBestChainByHeight(pindexBest);
+        nBestHeight = pindexBest->nHeight;
+        nBestChainTrust = pindexBest->nChainTrust;
+    }
 
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
@@ -453,130 +1389,16 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArgInt("-checklevel", 1);
-    int nCheckDepth = GetArgInt( "-checkblocks", 2500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
-    {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork && !fRequestShutdown)
+    // Verify blocks in the best chain, or leave it to ThreadCheckBlocks
+    if (!GetBoolArg("-asynccheckblocks"))
     {
-        // Reorg back to the fork
-        printf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
+        nStart = GetTimeMillis();
+        CBlockIndex* pindexBad = NULL;
+        if (!VerifyBestChain(pindexBad))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
+        if (pindexBad && !fRequestShutdown && !MoveBackFromBadBlock(pindexBad))
+            return false;
+        LogStartupPhase("checkblocks", nStart);
     }
 
     return true;
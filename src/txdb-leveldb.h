@@ -9,6 +9,7 @@
 #include "main.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -40,27 +41,74 @@ public:
     // Destroys the underlying shared global state accessed by this TxDB.
     void Close();
 
+    // Compacts the database in the background once, if it was opened for a
+    // bulk load at startup. Called when the initial download is over.
+    void CompactAfterBulkLoad();
+
 private:
     leveldb::DB *pdb;  // Points to the global instance.
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // Index of the pending puts and deletes of activeBatch, so that reads
+    // inside a transaction need not walk the whole serialized batch.
+    std::map<std::string, std::string> mapBatchPuts;
+    std::set<std::string> setBatchDeletes;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
+    // Drops the active batch and its index.
+    void ClearBatch()
+    {
+        delete activeBatch;
+        activeBatch = NULL;
+        mapBatchPuts.clear();
+        setBatchDeletes.clear();
+    }
+
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Unserializes a value read from the batch or the database.
+    template<typename T>
+    static bool ParseValue(const std::string& strValue, T& value)
+    {
+        try {
+            CMemoryReader ssValue(strValue.data(), strValue.data() + strValue.size(),
+                                  SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // Reads the committed value of a key, ignoring the active batch.
+    bool ReadDb(const CDataStream& ssKey, std::string& strValue) const
+    {
+        leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
+                                          ssKey.str(), &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            // Some unexpected error.
+            printf("LevelDB read failure: %s\n", status.ToString().c_str());
+            return false;
+        }
+        return true;
+    }
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CPublicDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         std::string strValue;
 
@@ -74,27 +122,9 @@ protected:
                 return false;
             }
         }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                printf("LevelDB read failure: %s\n", status.ToString().c_str());
-                return false;
-            }
-        }
-        // Unserialize value
-        try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
-            ssValue >> value;
-        }
-        catch (const std::exception&) {
+        if (readFromDb && !ReadDb(ssKey, strValue))
             return false;
-        }
-        return true;
+        return ParseValue(strValue, value);
     }
 
     template<typename K, typename T>
@@ -103,15 +133,19 @@ protected:
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CPublicDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
+        CPublicDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(ssValue.GetSerializeSize(value));
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::string strValue = ssValue.str();
+            activeBatch->Put(strKey, strValue);
+            setBatchDeletes.erase(strKey);
+            mapBatchPuts[strKey].swap(strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -130,11 +164,14 @@ protected:
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CPublicDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            activeBatch->Delete(strKey);
+            mapBatchPuts.erase(strKey);
+            setBatchDeletes.insert(strKey);
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -144,8 +181,8 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CPublicDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         std::string unused;
 
@@ -167,8 +204,7 @@ public:
     bool TxnCommit();
     bool TxnAbort()
     {
-        delete activeBatch;
-        activeBatch = NULL;
+        ClearBatch();
         return true;
     }
 
@@ -203,8 +239,26 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool ReadModifierUpgradeTime(unsigned int& nUpgradeTime);
     bool WriteModifierUpgradeTime(const unsigned int& nUpgradeTime);
+    bool ReadIndexFlag(const std::string& strName, bool& fValue);
+    bool WriteIndexFlag(const std::string& strName, bool fValue);
+    bool WriteAddrIndex(const CAddrIndexKey& key, int nHeight);
+    bool EraseAddrIndex(const CAddrIndexKey& key);
+    bool ReadAddrIndex(unsigned char nAddrType, const uint160& hashAddr, std::vector<std::pair<uint256, int> >& vTxs);
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+    bool WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value);
+    bool EraseSpentIndex(const COutPoint& outpoint);
+    bool EraseIndex(const std::string& strName);
+    // Calls func for every committed transaction index record in key order,
+    // until it returns false
+    bool ForEachTxIndex(const boost::function<bool (const uint256&, const CTxIndex&)>& func);
     bool LoadBlockIndex();
+
+    // Memory of the transaction index cache, and the limits of LevelDB's
+    static void GetMemoryUsage(MemoryUsageMap& mapUsage);
 };
 
+// Verifies the last -checkblocks blocks after startup, with -asynccheckblocks
+void ThreadCheckBlocks(void* parg);
+
 
 #endif // BITCOIN_DB_H
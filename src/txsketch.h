@@ -0,0 +1,151 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXSKETCH_H
+#define BITCOIN_TXSKETCH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "serialize.h"
+
+/** Invertible bloom lookup table of 64-bit short transaction ids. Every id
+ * is added to one cell in each third of the table. Subtracting the sketch
+ * of another set cell by cell leaves the sketch of the difference between
+ * the two, which can be listed back as long as it is small for the size:
+ * about two cells for each id in one set and not the other. */
+class CTxSketch
+{
+private:
+    static const unsigned int HASH_FUNCS = 3;
+
+    class CCell
+    {
+    public:
+        int32_t nCount;
+        uint64_t nIdSum;
+        uint32_t nCheckSum;
+
+        CCell() : nCount(0), nIdSum(0), nCheckSum(0) {}
+
+        IMPLEMENT_SERIALIZE
+        (
+            READWRITE(nCount);
+            READWRITE(nIdSum);
+            READWRITE(nCheckSum);
+        )
+
+        bool IsEmpty() const { return nCount == 0 && nIdSum == 0 && nCheckSum == 0; }
+        bool IsPure() const { return (nCount == 1 || nCount == -1) && nCheckSum == CheckSum(nIdSum); }
+    };
+
+    std::vector<CCell> vCells;
+
+    static uint64_t Mix(uint64_t x)
+    {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static uint32_t CheckSum(uint64_t nId)
+    {
+        return (uint32_t)(Mix(nId ^ 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    unsigned int Index(uint64_t nId, unsigned int n) const
+    {
+        unsigned int nPart = vCells.size() / HASH_FUNCS;
+        return nPart * n + (unsigned int)(Mix(nId + n) % nPart);
+    }
+
+    static void Update(std::vector<CCell>& vCellsIn, unsigned int nPos, uint64_t nId, int nSign)
+    {
+        vCellsIn[nPos].nCount += nSign;
+        vCellsIn[nPos].nIdSum ^= nId;
+        vCellsIn[nPos].nCheckSum ^= CheckSum(nId);
+    }
+
+public:
+    CTxSketch() {}
+
+    // At least nCells, rounded up to fill each third of the table
+    explicit CTxSketch(unsigned int nCells) : vCells(std::max((nCells + HASH_FUNCS - 1) / HASH_FUNCS, 1u) * HASH_FUNCS) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vCells);
+    )
+
+    unsigned int size() const { return vCells.size(); }
+
+    bool IsValid() const { return !vCells.empty() && vCells.size() % HASH_FUNCS == 0; }
+
+    void Add(uint64_t nId)
+    {
+        for (unsigned int n = 0; n < HASH_FUNCS; n++)
+            Update(vCells, Index(nId, n), nId, 1);
+    }
+
+    // Leaves the sketch of what is only here, counted up, and what is only
+    // in the other, counted down
+    bool Subtract(const CTxSketch& other)
+    {
+        if (other.vCells.size() != vCells.size())
+            return false;
+        for (unsigned int i = 0; i < vCells.size(); i++)
+        {
+            vCells[i].nCount -= other.vCells[i].nCount;
+            vCells[i].nIdSum ^= other.vCells[i].nIdSum;
+            vCells[i].nCheckSum ^= other.vCells[i].nCheckSum;
+        }
+        return true;
+    }
+
+    // List the ids of a subtracted sketch, false if there are too many
+    bool Decode(std::vector<uint64_t>& vOursRet, std::vector<uint64_t>& vTheirsRet) const
+    {
+        vOursRet.clear();
+        vTheirsRet.clear();
+        if (!IsValid())
+            return false;
+
+        std::vector<CCell> vWork(vCells);
+        std::vector<unsigned int> vPure;
+        for (unsigned int i = 0; i < vWork.size(); i++)
+            if (vWork[i].IsPure())
+                vPure.push_back(i);
+
+        // Each id taken out may leave other cells pure. A made-up sketch can't
+        // run this longer than it has cells.
+        while (!vPure.empty() && vOursRet.size() + vTheirsRet.size() <= vWork.size())
+        {
+            unsigned int nPos = vPure.back();
+            vPure.pop_back();
+            if (!vWork[nPos].IsPure())
+                continue;
+
+            uint64_t nId = vWork[nPos].nIdSum;
+            int nSign = vWork[nPos].nCount;
+            if (nSign > 0)
+                vOursRet.push_back(nId);
+            else
+                vTheirsRet.push_back(nId);
+
+            for (unsigned int n = 0; n < HASH_FUNCS; n++)
+            {
+                unsigned int i = Index(nId, n);
+                Update(vWork, i, nId, -nSign);
+                if (vWork[i].IsPure())
+                    vPure.push_back(i);
+            }
+        }
+
+        for (unsigned int i = 0; i < vWork.size(); i++)
+            if (!vWork[i].IsEmpty())
+                return false;
+        return true;
+    }
+};
+
+#endif
@@ -78,6 +78,9 @@ public:
     /** Progress message during initialization. */
     boost::signals2::signal<void (const std::string &message)> InitMessage;
 
+    /** Progress of a long operation, like a wallet rescan, in percent (100 when done). */
+    boost::signals2::signal<void (const std::string &title, int nProgress)> ShowProgress;
+
     /** Initiate client shutdown. */
     boost::signals2::signal<void ()> QueueShutdown;
 
@@ -8,16 +8,27 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <stdint.h>
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
 
 
 /** Base class without constructors for uint256 and uint160.
  * This makes the compiler let u use it in a union.
+ *
+ * Stored as little endian 32-bit words, which is also the serialized
+ * layout. Comparison and addition go through them 64 bits at a time,
+ * uint160 has one odd word at the top.
  */
 template<unsigned int BITS>
 class base_uint
@@ -25,14 +36,35 @@ class base_uint
 protected:
     enum { WIDTH=BITS/32 };
     uint32_t pn[WIDTH];
+
+    void Set64(int n, uint64_t b)
+    {
+        pn[2*n] = (uint32_t)b;
+        pn[2*n+1] = (uint32_t)(b >> 32);
+    }
+
+    // Returns <0, 0 or >0 as *this is less than, equal to or greater than b
+    int CompareTo(const base_uint& b) const
+    {
+        if (WIDTH % 2 != 0 && pn[WIDTH-1] != b.pn[WIDTH-1])
+            return pn[WIDTH-1] < b.pn[WIDTH-1] ? -1 : 1;
+        for (int n = WIDTH/2 - 1; n >= 0; n--)
+        {
+            uint64_t x = Get64(n), y = b.Get64(n);
+            if (x != y)
+                return x < y ? -1 : 1;
+        }
+        return 0;
+    }
+
 public:
 
     bool operator!() const
     {
+        uint32_t acc = 0;
         for (int i = 0; i < WIDTH; i++)
-            if (pn[i] != 0)
-                return false;
-        return true;
+            acc |= pn[i];
+        return acc == 0;
     }
 
     const base_uint operator~() const
@@ -107,36 +139,36 @@ public:
         return *this;
     }
 
+    // Shifts work in place, whole words first, each word is built from
+    //   the two source words it straddles
     base_uint& operator<<=(unsigned int shift)
     {
-        base_uint a(*this);
-        for (int i = 0; i < WIDTH; i++)
-            pn[i] = 0;
         int k = shift / 32;
         shift = shift % 32;
-        for (int i = 0; i < WIDTH; i++)
+        for (int i = WIDTH - 1; i >= 0; i--)
         {
-            if (i+k+1 < WIDTH && shift != 0)
-                pn[i+k+1] |= (a.pn[i] >> (32-shift));
-            if (i+k < WIDTH)
-                pn[i+k] |= (a.pn[i] << shift);
+            uint32_t n = 0;
+            if (i - k >= 0)
+                n = pn[i-k] << shift;
+            if (i - k - 1 >= 0 && shift != 0)
+                n |= pn[i-k-1] >> (32-shift);
+            pn[i] = n;
         }
         return *this;
     }
 
     base_uint& operator>>=(unsigned int shift)
     {
-        base_uint a(*this);
-        for (int i = 0; i < WIDTH; i++)
-            pn[i] = 0;
         int k = shift / 32;
         shift = shift % 32;
         for (int i = 0; i < WIDTH; i++)
         {
-            if (i-k-1 >= 0 && shift != 0)
-                pn[i-k-1] |= (a.pn[i] << (32-shift));
-            if (i-k >= 0)
-                pn[i-k] |= (a.pn[i] >> shift);
+            uint32_t n = 0;
+            if (i + k < WIDTH)
+                n = pn[i+k] >> shift;
+            if (i + k + 1 < WIDTH && shift != 0)
+                n |= pn[i+k+1] << (32-shift);
+            pn[i] = n;
         }
         return *this;
     }
@@ -144,12 +176,16 @@ public:
     base_uint& operator+=(const base_uint& b)
     {
         uint64_t carry = 0;
-        for (int i = 0; i < WIDTH; i++)
+        for (int n = 0; n < WIDTH/2; n++)
         {
-            uint64_t n = carry + pn[i] + b.pn[i];
-            pn[i] = n & 0xffffffff;
-            carry = n >> 32;
+            uint64_t x = Get64(n) + carry;
+            carry = x < carry;
+            x += b.Get64(n);
+            carry += x < b.Get64(n);
+            Set64(n, x);
         }
+        if (WIDTH % 2 != 0)
+            pn[WIDTH-1] += b.pn[WIDTH-1] + (uint32_t)carry;
         return *this;
     }
 
@@ -176,6 +212,95 @@ public:
     }
 
 
+    // Multiplies in place modulo 2^BITS, returns whether the full product was larger
+    bool MulOverflow(const base_uint& b)
+    {
+        uint32_t a[WIDTH];
+        memcpy(a, pn, sizeof(a));
+        bool fOverflow = false;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            if (b.pn[j] == 0)
+                continue;
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64_t n = carry + pn[i + j] + (uint64_t)a[i] * b.pn[j];
+                pn[i + j] = (uint32_t)n;
+                carry = n >> 32;
+            }
+            if (carry != 0)
+                fOverflow = true;
+            for (int i = WIDTH - j; i < WIDTH && !fOverflow; i++)
+                if (a[i] != 0)
+                    fOverflow = true;
+        }
+        return fOverflow;
+    }
+
+    base_uint& operator*=(const base_uint& b)
+    {
+        MulOverflow(b);
+        return *this;
+    }
+
+    // Truncating division, a divisor that fits in 32 bits takes a word at a time
+    base_uint& operator/=(const base_uint& b)
+    {
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        unsigned int nNumBits = num.bits();
+        unsigned int nDivBits = div.bits();
+        if (nDivBits == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+        if (nDivBits > nNumBits)
+            return *this;
+        if (nDivBits <= 32)
+        {
+            uint64_t rem = 0;
+            for (int i = WIDTH - 1; i >= 0; i--)
+            {
+                uint64_t cur = (rem << 32) | num.pn[i];
+                pn[i] = (uint32_t)(cur / div.pn[0]);
+                rem = cur % div.pn[0];
+            }
+            return *this;
+        }
+        int shift = nNumBits - nDivBits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // Number of significant bits
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
     base_uint& operator++()
     {
         // prefix operator
@@ -213,70 +338,37 @@ public:
 
     friend inline bool operator<(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
-        }
-        return false;
+        return a.CompareTo(b) < 0;
     }
 
     friend inline bool operator<=(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
-        }
-        return true;
+        return a.CompareTo(b) <= 0;
     }
 
     friend inline bool operator>(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
-        }
-        return false;
+        return a.CompareTo(b) > 0;
     }
 
     friend inline bool operator>=(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
-        }
-        return true;
+        return a.CompareTo(b) >= 0;
     }
 
     friend inline bool operator==(const base_uint& a, const base_uint& b)
     {
-        for (int i = 0; i < base_uint::WIDTH; i++)
-            if (a.pn[i] != b.pn[i])
-                return false;
-        return true;
+        return memcmp(a.pn, b.pn, sizeof(a.pn)) == 0;
     }
 
     friend inline bool operator==(const base_uint& a, uint64_t b)
     {
-        if (a.pn[0] != (uint32_t)b)
-            return false;
-        if (a.pn[1] != (uint32_t)(b >> 32))
+        if (a.Get64() != b)
             return false;
+        uint32_t acc = 0;
         for (int i = 2; i < base_uint::WIDTH; i++)
-            if (a.pn[i] != 0)
-                return false;
-        return true;
+            acc |= a.pn[i];
+        return acc == 0;
     }
 
     friend inline bool operator!=(const base_uint& a, const base_uint& b)
@@ -291,9 +383,15 @@ public:
 
     std::string GetHex() const
     {
-        char psz[sizeof(pn)*2 + 1];
+        static const char hexdigits[] = "0123456789abcdef";
+        char psz[sizeof(pn)*2];
+        const unsigned char* p = (const unsigned char*)pn + sizeof(pn);
         for (unsigned int i = 0; i < sizeof(pn); i++)
-            sprintf(psz + i*2, "%02x", ((unsigned char*)pn)[sizeof(pn) - i - 1]);
+        {
+            unsigned char c = *--p;
+            psz[i*2] = hexdigits[c >> 4];
+            psz[i*2+1] = hexdigits[c & 15];
+        }
         return std::string(psz, psz + sizeof(pn)*2);
     }
 
@@ -349,6 +447,16 @@ public:
         return (unsigned char*)&pn[WIDTH];
     }
 
+    const unsigned char* begin() const
+    {
+        return (const unsigned char*)&pn[0];
+    }
+
+    const unsigned char* end() const
+    {
+        return (const unsigned char*)&pn[WIDTH];
+    }
+
     std::vector<unsigned char> getBytes()
     {
         return std::vector<unsigned char>(begin(), end());
@@ -575,6 +683,57 @@ public:
         else
             *this = 0;
     }
+
+    // The "compact" format of nBits, a 3 byte mantissa with a sign bit and a byte
+    //   count, decoded the way CBigNum::SetCompact does. The sign and whether the
+    //   number needs more than 256 bits are reported separately.
+    uint256& SetCompact(uint32_t nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    uint32_t GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8 * (3 - nSize);
+        else
+        {
+            uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.Get64();
+        }
+        // The 0x00800000 bit denotes the sign, so if it is already set,
+        //   divide the mantissa by 256 and increase the exponent
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        if (fNegative && (nCompact & 0x007fffff) != 0)
+            nCompact |= 0x00800000;
+        return nCompact;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64_t b)                           { return (base_uint256)a == b; }
@@ -625,5 +784,7 @@ inline const uint256 operator&(const uint256& a, const uint256& b)      { return
 inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const uint256& a, const uint256& b)      { return uint256(a) *= b; }
+inline const uint256 operator/(const uint256& a, const uint256& b)      { return uint256(a) /= b; }
 
 #endif
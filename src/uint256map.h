@@ -0,0 +1,145 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_UINT256MAP_H
+#define BITCOIN_UINT256MAP_H
+
+#include <deque>
+#include <limits>
+#include <vector>
+
+#include "uint256.h"
+#include "util.h"
+
+/** Hash function for boost::unordered containers keyed by transaction or
+ * block hashes, or by objects made of one. Those keys are random already,
+ * the salt only keeps anyone from choosing them to collide. */
+class SaltedHasher
+{
+protected:
+    uint64_t nSalt;
+
+    size_t Mix(uint64_t n) const
+    {
+        uint64_t h = (n ^ nSalt) * 0x9e3779b97f4a7c15ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+public:
+    SaltedHasher() : nSalt(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    size_t operator()(const uint256& hash) const { return Mix(hash.Get64(0)); }
+    size_t operator()(const uint160& hash) const { return Mix(hash.Get64(0)); }
+};
+
+/** STL-like map container keyed by random 256-bit hashes, like block hashes.
+ *
+ * It is an open-addressing hash table with linear probing: the slots only
+ * hold the positions of the entries, which are kept in insertion order in a
+ * deque. References to the entries stay valid when the table grows, so a
+ * pointer to a key may be kept for as long as the map lives, like with
+ * std::map. Iterators are invalidated by insert however, and entries are
+ * never erased one by one.
+ */
+template <typename T> class uint256map
+{
+public:
+    typedef uint256 key_type;
+    typedef T mapped_type;
+    typedef std::pair<const uint256, T> value_type;
+    typedef typename std::deque<value_type>::iterator iterator;
+    typedef typename std::deque<value_type>::const_iterator const_iterator;
+    typedef size_t size_type;
+
+protected:
+    std::deque<value_type> entries;
+    std::vector<uint32_t> vSlots; // 1 + position of the entry, 0 for an empty slot
+    SaltedHasher hasher;
+
+    size_type Slot(const uint256& key) const
+    {
+        return hasher(key) & (vSlots.size() - 1);
+    }
+
+    // Returns the slot holding key, or the empty slot where it belongs
+    size_type Lookup(const uint256& key) const
+    {
+        size_type nMask = vSlots.size() - 1;
+        for (size_type i = Slot(key); ; i = (i + 1) & nMask)
+        {
+            uint32_t n = vSlots[i];
+            if (n == 0 || entries[n - 1].first == key)
+                return i;
+        }
+    }
+
+    void Rehash(size_type nSlots)
+    {
+        vSlots.assign(nSlots, 0);
+        for (size_type n = 0; n < entries.size(); n++)
+            vSlots[Lookup(entries[n].first)] = n + 1;
+    }
+
+public:
+    uint256map() {}
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    size_type size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    void clear() { entries.clear(); vSlots.clear(); }
+    size_t allocated_memory() const { return entries.size() * sizeof(value_type) + vSlots.capacity() * sizeof(uint32_t); }
+
+    iterator find(const key_type& k)
+    {
+        if (entries.empty())
+            return entries.end();
+        uint32_t n = vSlots[Lookup(k)];
+        return n ? entries.begin() + (n - 1) : entries.end();
+    }
+
+    const_iterator find(const key_type& k) const
+    {
+        if (entries.empty())
+            return entries.end();
+        uint32_t n = vSlots[Lookup(k)];
+        return n ? entries.begin() + (n - 1) : entries.end();
+    }
+
+    size_type count(const key_type& k) const { return find(k) != end() ? 1 : 0; }
+
+    void reserve(size_type n)
+    {
+        // Keep the table at most half full
+        size_type nSlots = 16;
+        while (nSlots < 2 * n)
+            nSlots *= 2;
+        if (nSlots > vSlots.size())
+            Rehash(nSlots);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& x)
+    {
+        // An existing key leaves the map untouched, the table only grows
+        // for an entry actually added
+        iterator it = find(x.first);
+        if (it != entries.end())
+            return std::make_pair(it, false);
+        reserve(entries.size() + 1);
+        size_type i = Lookup(x.first);
+        entries.push_back(x);
+        vSlots[i] = entries.size();
+        return std::make_pair(entries.end() - 1, true);
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        iterator it = find(k);
+        if (it != entries.end())
+            return it->second;
+        return insert(value_type(k, mapped_type())).first->second;
+    }
+};
+
+#endif
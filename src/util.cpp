@@ -10,6 +10,8 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 
 // Work around clang compilation problem in Boost 1.46:
 // /usr/include/boost/program_options/detail/config_file.hpp:163:17: error: call to function 'to_internal' that is neither visible in the template definition nor found by argument-dependent lookup
@@ -48,9 +50,19 @@ namespace boost {
 #include <io.h> /* for _commit */
 #include "shlobj.h"
 #elif defined(__linux__)
+# include <sched.h>
 # include <sys/prctl.h>
 #endif
 
+#ifndef WIN32
+#include <fcntl.h> /* for posix_fadvise */
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <set>
+
 #if !defined(WIN32) && !defined(ANDROID)
 #include <execinfo.h>
 #endif
@@ -216,6 +228,134 @@ uint256 GetRandHash()
 
 static FILE* fileout = NULL;
 
+// Lines for debug.log are formatted by the logging thread and queued, a
+// writer thread appends them to the file, so logging costs a short lock and
+// no disk access. Before the writer starts and after it stops, the logging
+// thread writes to the file itself. The queue is bounded, a burst beyond the
+// bound is dropped and counted rather than holding up the threads logging.
+//
+// This routine may be called by global destructors during shutdown. Since
+// the order of destruction of static/global objects is undefined, the state
+// is allocated on the heap the first time it is needed.
+static const size_t MAX_DEBUG_LOG_QUEUE = 4 << 20;
+
+struct CDebugLogState
+{
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::string strQueue;
+    unsigned int nDropped;
+    bool fStartedNewLine;
+    int64_t nTimestamp;
+    std::string strTimestamp;
+    bool fWriterRunning;
+    bool fWriterStop;
+    boost::thread* pthreadWriter;
+
+    CDebugLogState() : nDropped(0), fStartedNewLine(true), nTimestamp(0), fWriterRunning(false), fWriterStop(false), pthreadWriter(NULL) {}
+};
+
+static CDebugLogState* pdebugLog = NULL;
+static boost::once_flag debugLogInitFlag = BOOST_ONCE_INIT;
+
+static void InitDebugLogState()
+{
+    pdebugLog = new CDebugLogState();
+}
+
+static CDebugLogState& DebugLogState()
+{
+    boost::call_once(InitDebugLogState, debugLogInitFlag);
+    return *pdebugLog;
+}
+
+// Only one thread at a time writes: the writer, or a logging thread holding
+// the mutex while there is no writer
+static void WriteDebugLog(const std::string& str)
+{
+    if (!fileout)
+    {
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        fileout = fopen(pathDebug.string().c_str(), "a");
+        if (fileout) setbuf(fileout, NULL); // unbuffered
+    }
+    if (!fileout)
+        return;
+
+    // reopen the log file, if requested
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+
+    fwrite(str.data(), 1, str.size(), fileout);
+}
+
+static void ThreadDebugLogWriter()
+{
+    RenameThread("42-logwriter");
+
+    CDebugLogState& state = DebugLogState();
+    std::string strWrite;
+    boost::unique_lock<boost::mutex> lock(state.mutex);
+    for ( ; ; )
+    {
+        while (state.strQueue.empty() && state.nDropped == 0 && !state.fWriterStop)
+            state.cond.wait(lock);
+        if (state.strQueue.empty() && state.nDropped == 0)
+            break;
+
+        strWrite.swap(state.strQueue);
+        if (state.nDropped)
+            strWrite += strprintf("(%u debug log messages dropped)\n", state.nDropped);
+        state.nDropped = 0;
+
+        lock.unlock();
+        WriteDebugLog(strWrite);
+        strWrite.clear();
+        lock.lock();
+    }
+    // Logging threads write directly from here on
+    state.fWriterRunning = false;
+}
+
+void StartDebugLogWriter()
+{
+    if (fPrintToConsole || fPrintToDebugger)
+        return;
+    CDebugLogState& state = DebugLogState();
+    boost::unique_lock<boost::mutex> lock(state.mutex);
+    if (state.pthreadWriter)
+        return;
+    try {
+        state.pthreadWriter = new boost::thread(&ThreadDebugLogWriter);
+        state.fWriterRunning = true;
+        state.fWriterStop = false;
+    } catch (boost::thread_resource_error&) {
+        // Keep writing directly
+    }
+}
+
+void StopDebugLogWriter()
+{
+    CDebugLogState& state = DebugLogState();
+    boost::thread* pthread = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(state.mutex);
+        std::swap(pthread, state.pthreadWriter);
+        state.fWriterStop = true;
+        state.cond.notify_one();
+    }
+    if (pthread)
+    {
+        // Everything queued so far is written before the writer exits
+        pthread->join();
+        delete pthread;
+    }
+}
+
 inline int OutputDebugStringF(const char* pszFormat, ...)
 {
     int ret = 0;
@@ -229,46 +369,45 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     }
     else if (!fPrintToDebugger)
     {
-        // print to debug.log
+        // print to debug.log, formatting before taking the lock
+        va_list arg_ptr;
+        va_start(arg_ptr, pszFormat);
+        std::string str = vstrprintf(pszFormat, arg_ptr);
+        va_end(arg_ptr);
+        ret = str.size();
 
-        if (!fileout)
-        {
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            fileout = fopen(pathDebug.string().c_str(), "a");
-            if (fileout) setbuf(fileout, NULL); // unbuffered
-        }
-        if (fileout)
+        CDebugLogState& state = DebugLogState();
+        boost::unique_lock<boost::mutex> lock(state.mutex);
+
+        // Debug print useful for profiling
+        std::string strTimestamp;
+        if (fLogTimestamps && state.fStartedNewLine)
         {
-            static bool fStartedNewLine = true;
-
-            // This routine may be called by global destructors during shutdown.
-            // Since the order of destruction of static/global objects is undefined,
-            // allocate mutexDebugLog on the heap the first time this routine
-            // is called to avoid crashes during shutdown.
-            static boost::mutex* mutexDebugLog = NULL;
-            if (mutexDebugLog == NULL) mutexDebugLog = new boost::mutex();
-            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-            // reopen the log file, if requested
-            if (fReopenDebugLog) {
-                fReopenDebugLog = false;
-                boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-                if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                    setbuf(fileout, NULL); // unbuffered
+            int64_t nTime = GetTime();
+            if (nTime != state.nTimestamp)
+            {
+                state.nTimestamp = nTime;
+                state.strTimestamp = DateTimeStrFormat("%x %H:%M:%S", nTime) + " ";
             }
+            strTimestamp = state.strTimestamp;
+        }
+        state.fStartedNewLine = (!str.empty() && str[str.size() - 1] == '\n');
 
-            // Debug print useful for profiling
-            if (fLogTimestamps && fStartedNewLine)
-                fprintf(fileout, "%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-            if (pszFormat[strlen(pszFormat) - 1] == '\n')
-                fStartedNewLine = true;
-            else
-                fStartedNewLine = false;
-
-            va_list arg_ptr;
-            va_start(arg_ptr, pszFormat);
-            ret = vfprintf(fileout, pszFormat, arg_ptr);
-            va_end(arg_ptr);
+        if (!state.fWriterRunning)
+        {
+            WriteDebugLog(strTimestamp + str);
+        }
+        else if (state.strQueue.size() + strTimestamp.size() + str.size() > MAX_DEBUG_LOG_QUEUE)
+        {
+            state.nDropped++;
+        }
+        else
+        {
+            bool fWasEmpty = state.strQueue.empty();
+            state.strQueue += strTimestamp;
+            state.strQueue += str;
+            if (fWasEmpty)
+                state.cond.notify_one();
         }
     }
 
@@ -1252,6 +1391,22 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+void FileReadAhead(FILE *file, int64_t nPos, int64_t nLength)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    if (nPos >= 0)
+        posix_fadvise(fileno(file), nPos, nLength, POSIX_FADV_WILLNEED);
+#elif defined(MAC_OSX)
+    if (nPos >= 0 && nLength <= std::numeric_limits<int>::max())
+    {
+        radvisory advice;
+        advice.ra_offset = nPos;
+        advice.ra_count = (int)nLength;
+        fcntl(fileno(file), F_RDADVISE, &advice);
+    }
+#endif
+}
+
 int GetFilesize(FILE* file)
 {
     int nSavePos = ftell(file);
@@ -1449,6 +1604,291 @@ void runCommand(std::string strCommand)
         printf("runCommand error: system(%s) returned %d\n", strCommand.c_str(), nErr);
 }
 
+//
+// Thread accounting: a thread is counted from the time it names itself with
+// RenameThread, and when it exits its CPU and wall time are added to the
+// totals of its name. The CPU time of the running threads is read from their
+// CPU clocks where the platform has them.
+//
+#if !defined(WIN32) && !defined(MAC_OSX) && defined(_POSIX_THREAD_CPUTIME) && _POSIX_THREAD_CPUTIME >= 0
+#define HAVE_THREAD_CPUCLOCK
+#endif
+
+struct CThreadEntry
+{
+    std::string strName;
+    int64_t nStart;
+#if defined(WIN32)
+    HANDLE hThread;
+#elif defined(HAVE_THREAD_CPUCLOCK)
+    bool fClock;
+    clockid_t clockid;
+#endif
+};
+
+// CPU time of a running thread in microseconds, -1 if unknown
+static int64_t ThreadCPUTime(const CThreadEntry& entry)
+{
+#if defined(WIN32)
+    FILETIME ftCreation, ftExit, ftKernel, ftUser;
+    if (!GetThreadTimes(entry.hThread, &ftCreation, &ftExit, &ftKernel, &ftUser))
+        return -1;
+    // In units of 100ns
+    uint64_t nKernel = ((uint64_t)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+    uint64_t nUser = ((uint64_t)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+    return (nKernel + nUser) / 10;
+#elif defined(HAVE_THREAD_CPUCLOCK)
+    struct timespec ts;
+    if (!entry.fClock || clock_gettime(entry.clockid, &ts) != 0)
+        return -1;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return -1;
+#endif
+}
+
+static void ThreadExited(CThreadEntry* pentry);
+
+struct CThreadRegistry
+{
+    boost::mutex mutex;
+    std::set<CThreadEntry*> setRunning;
+    std::map<std::string, CThreadStats> mapExited;
+    boost::thread_specific_ptr<CThreadEntry> current;
+    std::map<std::string, std::vector<int> > mapCPUs; // by thread name, see SetThreadCPUs
+
+    CThreadRegistry() : current(ThreadExited) {}
+};
+
+static CThreadRegistry* pthreadRegistry = NULL;
+static boost::once_flag threadRegistryInitFlag = BOOST_ONCE_INIT;
+
+// On the heap, threads may exit after the global destructors ran
+static void InitThreadRegistry()
+{
+    pthreadRegistry = new CThreadRegistry();
+}
+
+// Runs in the exiting thread, so its clock is still readable
+static void ThreadExited(CThreadEntry* pentry)
+{
+    int64_t nCPUTime = ThreadCPUTime(*pentry);
+    {
+        boost::mutex::scoped_lock lock(pthreadRegistry->mutex);
+        CThreadStats& stats = pthreadRegistry->mapExited[pentry->strName];
+        stats.nExited++;
+        if (stats.nCPUTime >= 0)
+            stats.nCPUTime = nCPUTime >= 0 ? stats.nCPUTime + nCPUTime : -1;
+        stats.nWallTime += GetTimeMicros() - pentry->nStart;
+        pthreadRegistry->setRunning.erase(pentry);
+    }
+#ifdef WIN32
+    CloseHandle(pentry->hThread);
+#endif
+    delete pentry;
+}
+
+static void RegisterThread(const char* pszName)
+{
+    boost::call_once(InitThreadRegistry, threadRegistryInitFlag);
+    boost::mutex::scoped_lock lock(pthreadRegistry->mutex);
+    CThreadEntry* pentry = pthreadRegistry->current.get();
+    if (pentry)
+    {
+        // Renamed, the time so far goes to the new name
+        pentry->strName = pszName;
+        return;
+    }
+
+    pentry = new CThreadEntry();
+    pentry->strName = pszName;
+    pentry->nStart = GetTimeMicros();
+#if defined(WIN32)
+    DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &pentry->hThread, 0, FALSE, DUPLICATE_SAME_ACCESS);
+#elif defined(HAVE_THREAD_CPUCLOCK)
+    pentry->fClock = (pthread_getcpuclockid(pthread_self(), &pentry->clockid) == 0);
+#endif
+    pthreadRegistry->current.reset(pentry);
+    pthreadRegistry->setRunning.insert(pentry);
+}
+
+void SetThreadCPUs(const std::string& strName, const std::vector<int>& vCPUs)
+{
+    boost::call_once(InitThreadRegistry, threadRegistryInitFlag);
+    boost::mutex::scoped_lock lock(pthreadRegistry->mutex);
+    pthreadRegistry->mapCPUs[strName] = vCPUs;
+}
+
+// Pins the calling thread to the CPUs set for its name. What it allocates
+// and touches first from then on, like the batches of a queue worker, ends
+// up on the NUMA node of those CPUs by the first-touch policy of the OS.
+static void PlaceThread(const char* pszName)
+{
+    std::vector<int> vCPUs;
+    {
+        boost::mutex::scoped_lock lock(pthreadRegistry->mutex);
+        std::map<std::string, std::vector<int> >::const_iterator it = pthreadRegistry->mapCPUs.find(pszName);
+        if (it == pthreadRegistry->mapCPUs.end())
+            return;
+        vCPUs = it->second;
+    }
+
+#if defined(WIN32)
+    DWORD_PTR nMask = 0;
+    BOOST_FOREACH(int nCPU, vCPUs)
+        if (nCPU < (int)(8 * sizeof(nMask)))
+            nMask |= (DWORD_PTR)1 << nCPU;
+    if (!SetThreadAffinityMask(GetCurrentThread(), nMask))
+        printf("PlaceThread(%s) : SetThreadAffinityMask failed, error %d\n", pszName, (int)GetLastError());
+#elif defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    BOOST_FOREACH(int nCPU, vCPUs)
+        if (nCPU < CPU_SETSIZE)
+            CPU_SET(nCPU, &cpus);
+    int nErr = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (nErr != 0)
+        printf("PlaceThread(%s) : pthread_setaffinity_np failed, error %d\n", pszName, nErr);
+#else
+    printf("PlaceThread(%s) : pinning threads to CPUs is not supported on this platform\n", pszName);
+#endif
+}
+
+bool ParseCPUList(const std::string& str, std::vector<int>& vCPUs)
+{
+    vCPUs.clear();
+    std::vector<std::string> vRanges;
+    boost::split(vRanges, str, boost::is_any_of(","));
+    BOOST_FOREACH(const std::string& strRange, vRanges)
+    {
+        size_t nDash = strRange.find('-');
+        std::string strFirst = strRange.substr(0, nDash);
+        std::string strLast = nDash == std::string::npos ? strFirst : strRange.substr(nDash + 1);
+        if (strFirst.empty() || strLast.empty() ||
+            strFirst.find_first_not_of("0123456789") != std::string::npos ||
+            strLast.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        int nFirst = atoi(strFirst), nLast = atoi(strLast);
+        if (nFirst > nLast || nLast >= 1024)
+            return false;
+        for (int nCPU = nFirst; nCPU <= nLast; nCPU++)
+            vCPUs.push_back(nCPU);
+    }
+    return !vCPUs.empty();
+}
+
+void GetThreadStats(std::vector<CThreadStats>& vStats)
+{
+    boost::call_once(InitThreadRegistry, threadRegistryInitFlag);
+    boost::mutex::scoped_lock lock(pthreadRegistry->mutex);
+    std::map<std::string, CThreadStats> mapStats = pthreadRegistry->mapExited;
+    int64_t nNow = GetTimeMicros();
+    BOOST_FOREACH(CThreadEntry* pentry, pthreadRegistry->setRunning)
+    {
+        CThreadStats& stats = mapStats[pentry->strName];
+        int64_t nCPUTime = ThreadCPUTime(*pentry);
+        stats.nRunning++;
+        if (stats.nCPUTime >= 0)
+            stats.nCPUTime = nCPUTime >= 0 ? stats.nCPUTime + nCPUTime : -1;
+        stats.nWallTime += nNow - pentry->nStart;
+    }
+
+    vStats.clear();
+    vStats.reserve(mapStats.size());
+    for (std::map<std::string, CThreadStats>::iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        it->second.strName = it->first;
+        vStats.push_back(it->second);
+    }
+}
+
+#ifdef DEBUG_PROFILE
+//
+// Scoped timers: the calls and wall time of every PROFILE_SCOPE are added up
+// per place in the code, told apart like the lock sites of DEBUG_LOCKSTATS.
+//
+typedef std::pair<std::pair<const char*, const char*>, int> ProfileScopeKey;
+typedef std::map<ProfileScopeKey, CProfileScopeStats> ProfileScopeMap;
+
+static boost::mutex* pmutexProfileScopes = NULL;
+static ProfileScopeMap* pmapProfileScopes = NULL;
+static boost::once_flag profileScopesInitFlag = BOOST_ONCE_INIT;
+
+static void InitProfileScopes()
+{
+    pmutexProfileScopes = new boost::mutex();
+    pmapProfileScopes = new ProfileScopeMap();
+}
+
+void RecordProfileScope(const char* pszName, const char* pszFile, int nLine, int64_t nUsec)
+{
+    boost::call_once(InitProfileScopes, profileScopesInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexProfileScopes);
+    CProfileScopeStats& stats = (*pmapProfileScopes)[std::make_pair(std::make_pair(pszFile, pszName), nLine)];
+    if (stats.nCalls == 0)
+    {
+        stats.strName = pszName;
+        stats.strFile = pszFile;
+        stats.nLine = nLine;
+    }
+    stats.nCalls++;
+    stats.nTotalUsec += nUsec;
+    stats.nMaxUsec = std::max(stats.nMaxUsec, nUsec);
+}
+
+void GetProfileScopeStats(std::vector<CProfileScopeStats>& vStats)
+{
+    boost::call_once(InitProfileScopes, profileScopesInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexProfileScopes);
+    vStats.clear();
+    vStats.reserve(pmapProfileScopes->size());
+    BOOST_FOREACH(const ProfileScopeMap::value_type& item, *pmapProfileScopes)
+        vStats.push_back(item.second);
+}
+
+void ResetProfileScopeStats()
+{
+    boost::call_once(InitProfileScopes, profileScopesInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexProfileScopes);
+    pmapProfileScopes->clear();
+}
+#else
+void GetProfileScopeStats(std::vector<CProfileScopeStats>& vStats)
+{
+    vStats.clear();
+}
+
+void ResetProfileScopeStats()
+{
+}
+#endif /* DEBUG_PROFILE */
+
+static boost::mutex* pmutexStartupPhases = NULL;
+static std::vector<std::pair<std::string, int64_t> >* pvStartupPhases = NULL;
+static boost::once_flag startupPhasesInitFlag = BOOST_ONCE_INIT;
+
+static void InitStartupPhases()
+{
+    pmutexStartupPhases = new boost::mutex();
+    pvStartupPhases = new std::vector<std::pair<std::string, int64_t> >();
+}
+
+void LogStartupPhase(const std::string& strName, int64_t nStartMillis)
+{
+    int64_t nTime = GetTimeMillis() - nStartMillis;
+    printf(" %-12s%15" PRId64 "ms\n", strName.c_str(), nTime);
+    boost::call_once(InitStartupPhases, startupPhasesInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexStartupPhases);
+    pvStartupPhases->push_back(std::make_pair(strName, nTime));
+}
+
+void GetStartupPhases(std::vector<std::pair<std::string, int64_t> >& vPhases)
+{
+    boost::call_once(InitStartupPhases, startupPhasesInitFlag);
+    boost::mutex::scoped_lock lock(*pmutexStartupPhases);
+    vPhases = *pvStartupPhases;
+}
+
 void RenameThread(const char* name)
 {
 #if defined(PR_SET_NAME)
@@ -1468,6 +1908,9 @@ void RenameThread(const char* name)
     // Prevent warnings for unused parameters...
     (void)name;
 #endif
+
+    RegisterThread(name);
+    PlaceThread(name);
 }
 
 bool NewThread(void(*pfn)(void*), void* parg)
@@ -1482,6 +1925,27 @@ bool NewThread(void(*pfn)(void*), void* parg)
     return true;
 }
 
+static boost::mutex mutexSleep;
+static boost::condition_variable condSleep;
+
+bool InterruptibleSleep(int64_t n)
+{
+    boost::unique_lock<boost::mutex> lock(mutexSleep);
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(n);
+    while (!fShutdown)
+        if (!condSleep.timed_wait(lock, timeout))
+            return !fShutdown;
+    return false;
+}
+
+void WakeSleepingThreads()
+{
+    // Taking the mutex makes sure a sleeper is either waiting already, or
+    // will see fShutdown before it waits
+    boost::unique_lock<boost::mutex> lock(mutexSleep);
+    condSleep.notify_all();
+}
+
 std::string DateTimeStrFormat(const char* pszFormat, int64_t nTime)
 {
     // std::locale takes ownership of the pointer
@@ -6,6 +6,7 @@
 #define BITCOIN_UTIL_H
 
 
+#include "prevector.h"
 #include "uint256.h"
 
 #ifndef WIN32
@@ -166,6 +167,9 @@ extern bool fReopenDebugLog;
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int ATTR_WARN_PRINTF(1,2) OutputDebugStringF(const char* pszFormat, ...);
+// Hand debug.log writes to a background thread, and flush and stop it
+void StartDebugLogWriter();
+void StopDebugLogWriter();
 
 /*
   Rationale for the real_strprintf / strprintf construction:
@@ -218,6 +222,8 @@ void ParseParameters(int argc, const char*const argv[]);
 bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 void FileCommit(FILE *fileout);
+// Has the system start reading a part of the file that will be needed soon
+void FileReadAhead(FILE *file, int64_t nPos, int64_t nLength);
 int GetFilesize(FILE* file);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 boost::filesystem::path GetDefaultDataDir();
@@ -349,6 +355,12 @@ inline std::string HexStr(const std::vector<unsigned char>& vch, bool fSpaces=fa
     return HexStr(vch.begin(), vch.end(), fSpaces);
 }
 
+template<unsigned int N>
+inline std::string HexStr(const prevector<N, unsigned char>& vch, bool fSpaces=false)
+{
+    return HexStr(vch.begin(), vch.end(), fSpaces);
+}
+
 template<typename T>
 void PrintHex(const T pbegin, const T pend, const char* pszFormat="%s", bool fSpaces=true)
 {
@@ -373,16 +385,28 @@ inline int64_t GetPerformanceCounter()
     return nCounter;
 }
 
-inline int64_t GetTimeMillis()
+// Wall clock in microseconds since the epoch. This is called for every
+// message processed, so it reads the clock directly (gettimeofday is served
+// from the vDSO on Linux) instead of going through boost::posix_time and its
+// calendar arithmetic.
+inline int64_t GetTimeMicros()
 {
-    return (boost::posix_time::microsec_clock::universal_time() -
-            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
+#ifdef WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100ns intervals since 1601-01-01
+    int64_t nTime = ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return nTime / 10 - 11644473600000000LL;
+#else
+    timeval t;
+    gettimeofday(&t, NULL);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+#endif
 }
 
-inline int64_t GetTimeMicros()
+inline int64_t GetTimeMillis()
 {
-    return (boost::posix_time::microsec_clock::universal_time() -
-                   boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+    return GetTimeMicros() / 1000;
 }
 
 std::string DateTimeStrFormat(const char* pszFormat, int64_t nTime);
@@ -546,6 +570,13 @@ public:
 
 bool NewThread(void(*pfn)(void*), void* parg);
 
+// Sleep for n milliseconds like Sleep(), but return early, with false, once
+// the node is shutting down. For the sleeps in thread loops, so that they
+// don't hold up StopNode.
+bool InterruptibleSleep(int64_t n);
+// Wake the threads in InterruptibleSleep, after fShutdown has been set
+void WakeSleepingThreads();
+
 #ifdef WIN32
 inline void SetThreadPriority(int nPriority)
 {
@@ -575,8 +606,100 @@ inline void ExitThread(size_t nExitCode)
 }
 #endif
 
+// Names the calling thread, threads are accounted by name in GetThreadStats
 void RenameThread(const char* name);
 
+// Pins the threads of a name to CPUs, as they name themselves with
+// RenameThread. Set up before the threads are started.
+void SetThreadCPUs(const std::string& strName, const std::vector<int>& vCPUs);
+// Parses a CPU list like "0-3,8,10-11"
+bool ParseCPUList(const std::string& str, std::vector<int>& vCPUs);
+
+/** CPU and wall time of the threads of one name since startup, in microseconds.
+ *  nCPUTime is -1 where the platform can't tell the CPU time of a thread. */
+struct CThreadStats
+{
+    std::string strName;
+    int nRunning;
+    int nExited;
+    int64_t nCPUTime;
+    int64_t nWallTime;
+
+    CThreadStats() : nRunning(0), nExited(0), nCPUTime(0), nWallTime(0) {}
+};
+
+void GetThreadStats(std::vector<CThreadStats>& vStats);
+
+/** Estimated heap memory of the containers of one subsystem, from their
+ *  element counts and sizes rather than from the allocator, see getmemoryinfo.
+ *  nLimit is the configured cap of the subsystem, 0 if it has none. */
+struct CMemoryUsage
+{
+    uint64_t nUsage;
+    uint64_t nEntries;
+    uint64_t nLimit;
+
+    CMemoryUsage() : nUsage(0), nEntries(0), nLimit(0) {}
+};
+
+typedef std::map<std::string, CMemoryUsage> MemoryUsageMap;
+
+// Per element overhead of the standard containers: a tree node keeps three
+// pointers and a color beside the value, a hash table node a next pointer
+// and the cached hash, and the table about one bucket pointer per element
+static const size_t MEMORY_TREE_NODE = 4 * sizeof(void*);
+static const size_t MEMORY_HASH_NODE = 3 * sizeof(void*);
+
+/** Calls and wall time of one PROFILE_SCOPE place, in microseconds */
+struct CProfileScopeStats
+{
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nCalls;
+    int64_t nTotalUsec;
+    int64_t nMaxUsec;
+
+    CProfileScopeStats() : nLine(0), nCalls(0), nTotalUsec(0), nMaxUsec(0) {}
+};
+
+// Statistics per PROFILE_SCOPE place, empty unless built with DEBUG_PROFILE
+void GetProfileScopeStats(std::vector<CProfileScopeStats>& vStats);
+void ResetProfileScopeStats();
+
+#ifdef DEBUG_PROFILE
+void RecordProfileScope(const char* pszName, const char* pszFile, int nLine, int64_t nUsec);
+
+/** Times the rest of the enclosing scope */
+class CProfileScopeTimer
+{
+private:
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    int64_t nStart;
+
+public:
+    CProfileScopeTimer(const char* pszNameIn, const char* pszFileIn, int nLineIn) :
+        pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn), nStart(GetTimeMicros()) {}
+    ~CProfileScopeTimer()
+    {
+        RecordProfileScope(pszName, pszFile, nLine, GetTimeMicros() - nStart);
+    }
+};
+
+#define PROFILE_SCOPE_CAT2(a, b) a##b
+#define PROFILE_SCOPE_CAT(a, b) PROFILE_SCOPE_CAT2(a, b)
+#define PROFILE_SCOPE(name) CProfileScopeTimer PROFILE_SCOPE_CAT(profilescope, __LINE__)(name, __FILE__, __LINE__)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+/** Logs how long one phase of the startup took, from nStartMillis until now,
+ *  and keeps it for getstartuptimes. Phases are kept in the order they end. */
+void LogStartupPhase(const std::string& strName, int64_t nStartMillis);
+void GetStartupPhases(std::vector<std::pair<std::string, int64_t> >& vPhases);
+
 inline uint32_t ByteReverse(uint32_t value)
 {
     value = ((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8);
@@ -24,13 +24,13 @@ extern const std::string CLIENT_DATE;
 //
 // database format versioning
 //
-static const int DATABASE_VERSION = 70507;
+static const int DATABASE_VERSION = 70508;
 
 //
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 60019;
+static const int PROTOCOL_VERSION = 60031;
 
 // earlier versions not supported and disconnected
 static const int MIN_PROTO_VERSION = 209;
@@ -39,10 +39,22 @@ static const int MIN_PROTO_VERSION = 209;
 // if possible, avoid requesting addresses nodes older than this
 static const int CADDR_TIME_VERSION = 31402;
 
+// BIP 0031, pong message, is enabled for all versions AFTER this one
+static const int BIP0031_VERSION = 60000;
+
 // only request blocks from nodes outside this range of versions
 static const int NOBLKS_VERSION_START = 60002;
 static const int NOBLKS_VERSION_END = 60006;
 
+// new blocks are relayed in compact form, starting with this version
+static const int COMPACT_BLOCKS_VERSION = 60020;
+
+// transactions may be reconciled instead of announced, starting with this version
+static const int TXRECON_VERSION = 60030;
+
+// blocks and transactions may be sent compressed, starting with this version
+static const int COMPRESS_VERSION = 60031;
+
 #define DISPLAY_VERSION_MAJOR       0
 #define DISPLAY_VERSION_MINOR       11
 #define DISPLAY_VERSION_REVISION    1
@@ -5,6 +5,7 @@
 
 #include "txdb.h"
 #include "wallet.h"
+#include "walletnotify.h"
 #include "walletdb.h"
 #include "crypter.h"
 #include "ui_interface.h"
@@ -46,6 +47,22 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
+void CWallet::GetMemoryUsage(CMemoryUsage& usage) const
+{
+    LOCK(cs_wallet);
+    usage.nEntries += mapWallet.size();
+    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        usage.nUsage += sizeof(uint256) + MEMORY_TREE_NODE + sizeof(CWalletTx) - sizeof(CTransaction) + GetTransactionMemoryUsage(wtx);
+        usage.nUsage += (wtx.vMerkleBranch.capacity() + wtx.vhashPrev.capacity()) * sizeof(uint256) + wtx.vfSpent.capacity();
+        usage.nUsage += wtx.mapValue.size() * (sizeof(mapValue_t::value_type) + MEMORY_TREE_NODE);
+        BOOST_FOREACH(const CMerkleTx& txPrev, wtx.vtxPrev)
+            usage.nUsage += sizeof(CMerkleTx) - sizeof(CTransaction) + GetTransactionMemoryUsage(txPrev) + txPrev.vMerkleBranch.capacity() * sizeof(uint256);
+    }
+    usage.nUsage += mapAddressBook.size() * (sizeof(std::pair<const CBitcoinAddress, std::string>) + MEMORY_TREE_NODE);
+}
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -71,6 +88,74 @@ CPubKey CWallet::GenerateNewKey()
     return key.GetPubKey();
 }
 
+struct CNewKey
+{
+    CKey key;
+    std::vector<unsigned char> vchCryptedSecret;
+    bool fGood;
+};
+
+static void MakeNewKeys(std::vector<CNewKey>* pvKeys, bool fCompressed, CKeyingMaterial* pMasterKey, unsigned int nOffset, unsigned int nStride)
+{
+    for (unsigned int i = nOffset; i < pvKeys->size(); i += nStride)
+    {
+        CNewKey& entry = (*pvKeys)[i];
+        entry.key.MakeNewKey(fCompressed);
+        entry.fGood = true;
+        if (pMasterKey)
+        {
+            bool fKeyCompressed;
+            CPubKey pubkey = entry.key.GetPubKey();
+            entry.fGood = EncryptSecret(*pMasterKey, entry.key.GetSecret(fKeyCompressed), pubkey.GetHash(), entry.vchCryptedSecret);
+        }
+    }
+}
+
+void CWallet::GenerateNewKeys(unsigned int nCount, std::vector<CPubKey>& vPubKeysRet)
+{
+    vPubKeysRet.clear();
+    if (nCount == 0)
+        return;
+
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+
+    // Encrypted wallets get the secrets encrypted by the workers too
+    CKeyingMaterial vMasterKeyCopy;
+    bool fCrypted = IsCrypted();
+    if (fCrypted && !GetMasterKey(vMasterKeyCopy))
+        throw std::runtime_error("CWallet::GenerateNewKeys() : wallet is locked");
+
+    RandAddSeedPerfmon();
+    std::vector<CNewKey> vKeys(nCount);
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    nThreads = std::min(nThreads, 1 + nCount / 64);
+
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&MakeNewKeys, &vKeys, fCompressed, fCrypted ? &vMasterKeyCopy : NULL, i, nThreads));
+    MakeNewKeys(&vKeys, fCompressed, fCrypted ? &vMasterKeyCopy : NULL, 0, nThreads);
+    threads.join_all();
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    LOCK(cs_wallet);
+    int64_t nCreationTime = GetTime();
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+    BOOST_FOREACH(const CNewKey& entry, vKeys)
+    {
+        if (!entry.fGood)
+            throw std::runtime_error("CWallet::GenerateNewKeys() : EncryptSecret failed");
+        CPubKey pubkey = entry.key.GetPubKey();
+        mapKeyMetadata[CBitcoinAddress(pubkey.GetID())] = CKeyMetadata(nCreationTime);
+        if (fCrypted ? !AddCryptedKey(pubkey, entry.vchCryptedSecret) : !AddKey(entry.key))
+            throw std::runtime_error("CWallet::GenerateNewKeys() : AddKey failed");
+        vPubKeysRet.push_back(pubkey);
+    }
+}
+
 CMalleableKeyView CWallet::GenerateNewMalleableKey()
 {
     RandAddSeedPerfmon();
@@ -98,6 +183,8 @@ bool CWallet::AddKey(const CKey& key)
     CPubKey pubkey = key.GetPubKey();
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    InvalidateFilters();
+    InvalidateAddressGroupings();
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -111,6 +198,7 @@ bool CWallet::AddKey(const CMalleableKey& mKey)
     CSecret vchSecretH = mKey.GetSecretH();
     if (!CCryptoKeyStore::AddMalleableKey(keyView, vchSecretH))
         return false;
+    InvalidateAddressGroupings();
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -122,6 +210,7 @@ bool CWallet::AddCryptedMalleableKey(const CMalleableKeyView& keyView, const std
 {
     if (!CCryptoKeyStore::AddCryptedMalleableKey(keyView, vchCryptedSecretH))
         return false;
+    InvalidateAddressGroupings();
 
     if (!fFileBacked)
         return true;
@@ -142,6 +231,8 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    InvalidateFilters();
+    InvalidateAddressGroupings();
 
     // check if we need to remove from watch-only
     CScript script;
@@ -184,6 +275,8 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    InvalidateFilters();
+    InvalidateAddressGroupings();
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -211,6 +304,10 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    InvalidateBalanceCache();
+    InvalidateUnspentIndex();
+    InvalidateFilters();
+    InvalidateAddressGroupings();
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -222,6 +319,9 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     LOCK(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    InvalidateBalanceCache();
+    InvalidateUnspentIndex();
+    InvalidateAddressGroupings();
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -240,6 +340,9 @@ bool CWallet::LoadWatchOnly(const CScript &dest)
 //         serves to disable the trivial sendmoney when OS account compromised
 bool fWalletUnlockMintOnly = false;
 
+// Store the supporting transactions of the wallet transactions by txid only
+bool fSupportingTxids = false;
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     if (!IsLocked())
@@ -311,10 +414,21 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
     return false;
 }
 
+// Blocks between two archival runs while -walletarchive is on
+static const int ARCHIVE_INTERVAL = 500;
+
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    {
+        CWalletDB walletdb(strWalletFile);
+        walletdb.WriteBestBlock(loc);
+    }
+
+    if (nArchiveDepth > 0 && pindexBest && pindexBest->nHeight >= nArchiveHeight + ARCHIVE_INTERVAL)
+    {
+        nArchiveHeight = pindexBest->nHeight;
+        ArchiveTransactions(nArchiveDepth);
+    }
 }
 
 // This class implements an addrIncoming entry that causes pre-0.4
@@ -578,6 +692,142 @@ CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries,
     return txOrdered;
 }
 
+const multimap<int64_t, CWalletTx*>& CWallet::GetOrderedTxs()
+{
+    LOCK(cs_wallet);
+    if (!fTxOrderedValid)
+    {
+        mapTxOrdered.clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            mapTxOrdered.insert(mapTxOrdered.end(), make_pair((*it).second.nOrderPos, &((*it).second)));
+        fTxOrderedValid = true;
+    }
+    return mapTxOrdered;
+}
+
+void CWallet::InvalidateTxIndexes()
+{
+    LOCK(cs_wallet);
+    fTxOrderedValid = false;
+    mapTxOrdered.clear();
+    fTxHeightValid = false;
+    pindexTxHeightTip = NULL;
+    mapTxByHeight.clear();
+    mapTxHeight.clear();
+}
+
+void CWallet::UnindexTxHeight(const CWalletTx* pwtx)
+{
+    map<const CWalletTx*, int>::iterator mi = mapTxHeight.find(pwtx);
+    if (mi == mapTxHeight.end())
+        return;
+    map<int, set<const CWalletTx*> >::iterator bi = mapTxByHeight.find(mi->second);
+    bi->second.erase(pwtx);
+    if (bi->second.empty())
+        mapTxByHeight.erase(bi);
+    mapTxHeight.erase(mi);
+}
+
+void CWallet::IndexTxHeight(const CWalletTx* pwtx)
+{
+    if (!fTxHeightValid)
+        return;
+    UnindexTxHeight(pwtx);
+
+    int nHeight = std::numeric_limits<int>::max();
+    if (pwtx->hashBlock != 0)
+    {
+        BlockMap::iterator bi = mapBlockIndex.find(pwtx->hashBlock);
+        if (bi != mapBlockIndex.end() && bi->second->IsInMainChain())
+            nHeight = bi->second->nHeight;
+    }
+    mapTxHeight[pwtx] = nHeight;
+    mapTxByHeight[nHeight].insert(pwtx);
+}
+
+void CWallet::GetTxsSince(const CBlockIndex* pindex, vector<const CWalletTx*>& vTx)
+{
+    LOCK2(cs_main, cs_wallet);
+    vTx.clear();
+
+    // A reorganization below the checked tip may have moved any entry
+    if (fTxHeightValid && (!pindexTxHeightTip || !pindexTxHeightTip->IsInMainChain()))
+    {
+        fTxHeightValid = false;
+        mapTxByHeight.clear();
+        mapTxHeight.clear();
+    }
+
+    if (!fTxHeightValid)
+    {
+        fTxHeightValid = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            IndexTxHeight(&(*it).second);
+    }
+    else
+    {
+        // Blocks above the checked tip may have been disconnected since, so the
+        // few transactions of the recent blocks are looked up again
+        vector<const CWalletTx*> vRecent;
+        map<int, set<const CWalletTx*> >::const_iterator bi = mapTxByHeight.upper_bound(pindexTxHeightTip->nHeight);
+        for (; bi != mapTxByHeight.end() && bi->first != std::numeric_limits<int>::max(); ++bi)
+            vRecent.insert(vRecent.end(), bi->second.begin(), bi->second.end());
+        BOOST_FOREACH(const CWalletTx* pwtx, vRecent)
+            IndexTxHeight(pwtx);
+    }
+    pindexTxHeightTip = pindexBest;
+
+    int nHeight = pindex ? pindex->nHeight : -1;
+    for (map<int, set<const CWalletTx*> >::const_iterator bi = mapTxByHeight.upper_bound(nHeight); bi != mapTxByHeight.end(); ++bi)
+        vTx.insert(vTx.end(), bi->second.begin(), bi->second.end());
+}
+
+static bool CompareAcentryNewestFirst(const CAccountingEntry* a, const CAccountingEntry* b)
+{
+    return a->nOrderPos > b->nOrderPos;
+}
+
+CReverseTxItemsReader::CReverseTxItemsReader(CWallet* pwalletIn, std::list<CAccountingEntry>& acentries) : pwallet(pwalletIn)
+{
+    const multimap<int64_t, CWalletTx*>& mapTxOrdered = pwallet->GetOrderedTxs();
+    wi = mapTxOrdered.rbegin();
+    wend = mapTxOrdered.rend();
+    ai = pwallet->GetArchivedOrdered().rbegin();
+    aend = pwallet->GetArchivedOrdered().rend();
+    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+        vEntries.push_back(&entry);
+    std::stable_sort(vEntries.begin(), vEntries.end(), CompareAcentryNewestFirst);
+    nEntry = 0;
+}
+
+bool CReverseTxItemsReader::Next(CWalletTx*& pwtxRet, CAccountingEntry*& pacentryRet)
+{
+    pwtxRet = NULL;
+    pacentryRet = NULL;
+    for ( ; ; )
+    {
+        // At equal positions the accounting entries come first, as in the reversed OrderedTxItems
+        bool fArchived = ai != aend && (wi == wend || ai->first > wi->first);
+        int64_t nTxPos = fArchived ? ai->first : (wi != wend ? wi->first : 0);
+        if (nEntry < vEntries.size() && ((wi == wend && ai == aend) || vEntries[nEntry]->nOrderPos >= nTxPos))
+            pacentryRet = vEntries[nEntry++];
+        else if (fArchived)
+        {
+            const uint256& hash = (ai++)->second;
+            CWalletTx wtx;
+            if (!pwallet->ReadArchivedTx(hash, wtx))
+                continue;
+            listArchived.push_back(wtx);
+            pwtxRet = &listArchived.back();
+        }
+        else if (wi != wend)
+            pwtxRet = (wi++)->second;
+        else
+            return false;
+        return true;
+    }
+}
+
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
 {
     // Anytime a signature is successfully verified, it's proof the outpoint is spent.
@@ -600,6 +850,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                     vMintingWalletUpdated.push_back(txin.prevout.hash);
+                    setStakeInputsUpdated.insert(txin.prevout.hash);
                 }
             }
         }
@@ -618,6 +869,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                     vMintingWalletUpdated.push_back(hash);
+                    setStakeInputsUpdated.insert(hash);
                 }
             }
         }
@@ -629,6 +881,8 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        InvalidateBalanceCache();
+        InvalidateUnspentIndex();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
@@ -646,6 +900,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            if (fBalanceCacheValid)
+                setBalanceVolatile.insert(&wtx);
+            if (fFilterValid && !filterTxs.Insert(hash.Get64()))
+                fFilterValid = false;
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
 
@@ -660,13 +918,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
                         std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        CWalletDB(strWalletFile).ListAccountCreditDebit("", acentries);
+                        CReverseTxItemsReader reader(this, acentries);
+                        CWalletTx* pwtx;
+                        CAccountingEntry* pacentry;
+                        while (reader.Next(pwtx, pacentry))
                         {
-                            CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
                                 continue;
-                            CAccountingEntry *const pacentry = (*it).second.second;
                             int64_t nSmartTime;
                             if (pwtx)
                             {
@@ -686,7 +945,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                         }
                     }
 
-                    unsigned int& blocktime = mapBlockIndex[wtxIn.hashBlock]->nTime;
+                    unsigned int& blocktime = LookupBlockIndex(wtxIn.hashBlock)->nTime;
                     wtx.nTimeSmart = std::max(latestEntry, std::min(blocktime, latestNow));
                 }
                 else
@@ -718,6 +977,28 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        if (fInsertedNew && fTxOrderedValid)
+            mapTxOrdered.insert(make_pair(wtx.nOrderPos, &wtx));
+        if (fInsertedNew && fGroupingsValid)
+        {
+            AddToGroupings(&wtx);
+            map<uint256, vector<const CWalletTx*> >::iterator pi = mapGroupingPending.find(hash);
+            if (pi != mapGroupingPending.end())
+            {
+                vector<const CWalletTx*> vSpenders;
+                vSpenders.swap(pi->second);
+                mapGroupingPending.erase(pi);
+                BOOST_FOREACH(const CWalletTx* pspender, vSpenders)
+                    AddToGroupings(pspender);
+            }
+        }
+        if (fInsertedNew || fUpdated)
+        {
+            IndexUnspentCoins(&wtx);
+            IndexTxHeight(&wtx);
+        }
+        if (fInsertedNew && fResendValid)
+            AddToResendPending(&wtx);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -749,14 +1030,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
         vMintingWalletUpdated.push_back(hash);
-        // notify an external script when a wallet transaction comes in or is updated
-        std::string strCmd = GetArg("-walletnotify", "");
-
-        if ( !strCmd.empty())
-        {
-            boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
-            boost::thread t(runCommand, strCmd); // thread runs free
-        }
+        setStakeInputsUpdated.insert(hash);
+        // notify an external script when a wallet transaction comes in or is updated,
+        // and the waitfortx pollers
+        walletNotifyQueue.Push(hash);
 
     }
     return true;
@@ -765,11 +1042,90 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 // Add a transaction to the wallet, or update it.
 // pblock is optional, but should be provided if the transaction is known to be in a block.
 // If fUpdate is true, existing transactions will be updated.
+// The id an output is looked up by in the wallet filter: the key id of pay to
+//   pubkey and pay to pubkey hash outputs, the script id of pay to script hash
+//   ones. Other outputs have none and always go through IsMine.
+static bool GetFilterID(const CScript& script, uint160& id)
+{
+    unsigned int nSize = script.size();
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+    {
+        memcpy(id.begin(), &script[3], 20);
+        return true;
+    }
+    if (nSize == 23 && script[0] == OP_HASH160 && script[1] == 20 && script[22] == OP_EQUAL)
+    {
+        memcpy(id.begin(), &script[2], 20);
+        return true;
+    }
+    if (((nSize == 35 && script[0] == 33) || (nSize == 67 && script[0] == 65)) && script[nSize - 1] == OP_CHECKSIG)
+    {
+        id = Hash160(script.begin() + 1, script.end() - 1);
+        return true;
+    }
+    return false;
+}
+
+void CWallet::InvalidateFilters()
+{
+    LOCK(cs_wallet);
+    fFilterValid = false;
+}
+
+void CWallet::RebuildFilters()
+{
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+
+    LOCK(cs_KeyStore);
+    filterIDs.Reset(2 * (setKeys.size() + mapScripts.size() + setWatchOnly.size()) + 1024);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        filterIDs.Insert(keyID.Get64());
+    for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); ++mi)
+        filterIDs.Insert(mi->first.Get64());
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+    {
+        uint160 id;
+        if (GetFilterID(script, id))
+            filterIDs.Insert(id.Get64());
+    }
+
+    filterTxs.Reset(2 * mapWallet.size() + 1024);
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        filterTxs.Insert(it->first.Get64());
+
+    fFilterValid = true;
+}
+
+// Whether the transaction could be in the wallet, spend from it or pay to it.
+//   False positives are sorted out by the exact checks of the caller.
+bool CWallet::MayBeInvolvingMe(const CTransaction& tx, const uint256& hash)
+{
+    if (!fFilterValid)
+        RebuildFilters();
+
+    if (filterTxs.Contains(hash.Get64()))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (filterTxs.Contains(txin.prevout.hash.Get64()))
+            return true;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        uint160 id;
+        if (!GetFilterID(txout.scriptPubKey, id) || filterIDs.Contains(id.Get64()))
+            return true;
+    }
+    return false;
+}
+
 bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
 {
     uint256 hash = tx.GetHash();
     {
         LOCK(cs_wallet);
+        if (!MayBeInvolvingMe(tx, hash) || mapArchived.count(hash))
+            return false;
         bool fExisted = mapWallet.count(hash) != 0;
         if (fExisted && !fUpdate) return false;
         if (fExisted || IsMine(tx) || IsFromMe(tx))
@@ -792,25 +1148,184 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            UnindexWalletTx(&mi->second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+            setStakeInputsUpdated.insert(hash);
+        }
+    }
+    return true;
+}
+
+void CWallet::UnindexWalletTx(CWalletTx* pwtx)
+{
+    MarkBalanceDirty(pwtx);
+    setBalanceVolatile.erase(pwtx);
+    setResendPending.erase(make_pair(pwtx->nTimeReceived, (const CWalletTx*)pwtx));
+    UnindexUnspentCoins(pwtx);
+    UnindexTxHeight(pwtx);
+    InvalidateAddressGroupings();
+    if (fTxOrderedValid)
+    {
+        pair<multimap<int64_t, CWalletTx*>::iterator, multimap<int64_t, CWalletTx*>::iterator> range = mapTxOrdered.equal_range(pwtx->nOrderPos);
+        for (multimap<int64_t, CWalletTx*>::iterator it = range.first; it != range.second; ++it)
+            if (it->second == pwtx)
+            {
+                mapTxOrdered.erase(it);
+                break;
+            }
     }
+}
+
+const CTxOut* CWallet::GetPrevOut(const COutPoint& prevout) const
+{
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(prevout.hash);
+    if (mi != mapWallet.end())
+        return prevout.n < mi->second.vout.size() ? &mi->second.vout[prevout.n] : NULL;
+    map<uint256, CArchivedTx>::const_iterator ai = mapArchived.find(prevout.hash);
+    if (ai != mapArchived.end() && prevout.n < ai->second.vout.size())
+        return &ai->second.vout[prevout.n];
+    return NULL;
+}
+
+bool CWallet::LoadArchivedTx(const uint256& hash, const CArchivedTx& atx)
+{
+    if (!mapArchived.insert(make_pair(hash, atx)).second)
+        return true;
+    mapArchivedOrdered.insert(make_pair(atx.nOrderPos, hash));
     return true;
 }
 
+bool CWallet::IsArchived(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    return mapArchived.count(hash) != 0;
+}
 
-isminetype CWallet::IsMine(const CTxIn &txin) const
+unsigned int CWallet::GetArchiveSize() const
+{
+    LOCK(cs_wallet);
+    return mapArchived.size();
+}
+
+bool CWallet::ReadArchivedTx(const uint256& hash, CWalletTx& wtx)
+{
+    if (!fFileBacked || !IsArchived(hash))
+        return false;
+    if (!CWalletDB(strWalletFile, "r").ReadTx(hash, wtx))
+        return error("CWallet::ReadArchivedTx() : cannot read %s", hash.ToString().c_str());
+    wtx.BindWallet(this);
+    return true;
+}
+
+void CWallet::GetHistoryTxs(vector<const CWalletTx*>& vTxRet, list<CWalletTx>& listArchivedRet)
 {
+    LOCK(cs_wallet);
+    vTxRet.clear();
+    listArchivedRet.clear();
+    vTxRet.reserve(mapWallet.size() + mapArchived.size());
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vTxRet.push_back(&(*it).second);
+    for (map<uint256, CArchivedTx>::const_iterator it = mapArchived.begin(); it != mapArchived.end(); ++it)
     {
-        LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
-        if (mi != mapWallet.end())
+        CWalletTx wtx;
+        if (!ReadArchivedTx((*it).first, wtx))
+            continue;
+        listArchivedRet.push_back(wtx);
+        vTxRet.push_back(&listArchivedRet.back());
+    }
+}
+
+void CWallet::GetArchivedTxsSince(int nHeight, list<CWalletTx>& listRet)
+{
+    LOCK(cs_wallet);
+    listRet.clear();
+    for (map<uint256, CArchivedTx>::const_iterator it = mapArchived.begin(); it != mapArchived.end(); ++it)
+    {
+        CWalletTx wtx;
+        if ((*it).second.nHeight > nHeight && ReadArchivedTx((*it).first, wtx))
+            listRet.push_back(wtx);
+    }
+}
+
+int CWallet::ArchiveTransactions(int nDepth)
+{
+    if (!fFileBacked)
+        return 0;
+    // Deep enough for the transactions to stay put, and for the stakes to be mature
+    nDepth = std::max(nDepth, nCoinbaseMaturity);
+
+    LOCK2(cs_main, cs_wallet);
+
+    // Who spends each output, to make sure our spent outputs can't come back
+    map<COutPoint, const CWalletTx*> mapSpenders;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CTxIn& txin, (*it).second.vin)
+            mapSpenders[txin.prevout] = &(*it).second;
+
+    vector<uint256> vArchive;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = (*it).second;
+        if (wtx.nOrderPos == -1 || wtx.GetDepthInMainChain() < nDepth)
+            continue;
+        bool fSpent = true;
+        for (unsigned int i = 0; i < wtx.vout.size() && fSpent; i++)
+        {
+            if (!IsMine(wtx.vout[i]))
+                continue;
+            map<COutPoint, const CWalletTx*>::const_iterator si = mapSpenders.find(COutPoint((*it).first, i));
+            fSpent = wtx.IsSpent(i) && si != mapSpenders.end() && (*si).second->GetDepthInMainChain() >= nDepth;
+        }
+        if (fSpent)
+            vArchive.push_back((*it).first);
+    }
+    if (vArchive.empty())
+        return 0;
+
+    int nArchived = 0;
+    {
+        CWalletDBBatch batch(strWalletFile);
+        CWalletDB walletdb(strWalletFile);
+        BOOST_FOREACH(const uint256& hash, vArchive)
         {
-            const CWalletTx& prev = (*mi).second;
-            if (txin.prevout.n < prev.vout.size())
-                return IsMine(prev.vout[txin.prevout.n]);
+            CWalletTx& wtx = mapWallet[hash];
+            CArchivedTx atx;
+            atx.nOrderPos = wtx.nOrderPos;
+            atx.nHeight = LookupBlockIndex(wtx.hashBlock)->nHeight;
+            atx.vout = wtx.vout;
+            BOOST_FOREACH(CTxOut& txout, atx.vout)
+                if (!IsMine(txout))
+                    txout.scriptPubKey.clear();
+            if (!walletdb.WriteArchivedTx(hash, atx))
+            {
+                printf("CWallet::ArchiveTransactions() : cannot write %s\n", hash.ToString().c_str());
+                break;
+            }
+
+            UnindexWalletTx(&wtx);
+            mapWallet.erase(hash);
+            LoadArchivedTx(hash, atx);
+            NotifyTransactionChanged(this, hash, CT_DELETED);
+            nArchived++;
         }
     }
+    printf("CWallet::ArchiveTransactions() : %d transactions archived, %" PRIszu " in the archive\n", nArchived, mapArchived.size());
+    return nArchived;
+}
+
+
+isminetype CWallet::IsMine(const CTxIn &txin) const
+{
+    {
+        LOCK(cs_wallet);
+        const CTxOut* pprevout = GetPrevOut(txin.prevout);
+        if (pprevout)
+            return IsMine(*pprevout);
+    }
     return MINE_NO;
 }
 
@@ -831,6 +1346,8 @@ bool CWalletTx::UpdateSpent(const std::vector<char>& vfNewSpent)
             fAvailableCreditCached = fAvailableWatchCreditCached = false;
         }
     }
+    if (fReturn && pwallet)
+        pwallet->MarkBalanceDirty(this);
     return fReturn;
 }
 
@@ -841,6 +1358,8 @@ void CWalletTx::MarkDirty()
     fAvailableCreditCached = fAvailableWatchCreditCached = false;
     fDebitCached = fWatchDebitCached = false;
     fChangeCached = false;
+    if (pwallet)
+        pwallet->MarkBalanceDirty(this);
 }
 
 void CWalletTx::BindWallet(CWallet *pwalletIn)
@@ -858,6 +1377,8 @@ void CWalletTx::MarkSpent(unsigned int nOut)
     {
         vfSpent[nOut] = true;
         fAvailableCreditCached = fAvailableWatchCreditCached = false;
+        if (pwallet)
+            pwallet->MarkBalanceDirty(this);
     }
 }
 
@@ -870,6 +1391,11 @@ void CWalletTx::MarkUnspent(unsigned int nOut)
     {
         vfSpent[nOut] = false;
         fAvailableCreditCached = fAvailableWatchCreditCached = false;
+        if (pwallet)
+        {
+            pwallet->MarkBalanceDirty(this);
+            pwallet->IndexUnspentCoins(this);
+        }
     }
 }
 
@@ -886,14 +1412,9 @@ int64_t CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 {
     {
         LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
-        if (mi != mapWallet.end())
-        {
-            const CWalletTx& prev = (*mi).second;
-            if (txin.prevout.n < prev.vout.size())
-                if (IsMine(prev.vout[txin.prevout.n]) & filter)
-                    return prev.vout[txin.prevout.n].nValue;
-        }
+        const CTxOut* pprevout = GetPrevOut(txin.prevout);
+        if (pprevout && (IsMine(*pprevout) & filter))
+            return pprevout->nValue;
     }
     return 0;
 }
@@ -1334,6 +1855,7 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64_t& nGenerated,
 void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 {
     vtxPrev.clear();
+    vhashPrev.clear();
 
     const int COPY_DEPTH = 3;
     if (SetMerkleBranch() < COPY_DEPTH)
@@ -1370,6 +1892,13 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
                 {
                     ;
                 }
+                else if (mempool.exists(hash))
+                {
+                    // The wallet transactions with their txids only don't carry
+                    // their unconfirmed ancestors
+                    LOCK(mempool.cs);
+                    tx = CMerkleTx(mempool.lookup(hash));
+                }
                 else
                 {
                     printf("ERROR: AddSupportingTransactions() : unsupported transaction\n");
@@ -1389,41 +1918,162 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
     }
 
     reverse(vtxPrev.begin(), vtxPrev.end());
+
+    if (fSupportingTxids)
+        DropSupportingTransactions();
 }
 
-bool CWalletTx::WriteToDisk()
+void CWalletTx::DropSupportingTransactions()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    if (vtxPrev.empty())
+        return;
+    vhashPrev.clear();
+    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+        vhashPrev.push_back(tx.GetHash());
+    vtxPrev.clear();
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+void CWalletTx::GetSupportingTransactions(CTxDB& txdb, vector<CMerkleTx>& vtxRet) const
 {
-    int ret = 0;
+    vtxRet.clear();
+    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+        if (!txdb.ContainsTx(tx.GetHash()))
+            vtxRet.push_back(tx);
+    if (vhashPrev.empty())
+        return;
 
-    CBlockIndex* pindex = pindexStart;
+    // The ones in the block chain need nothing done, the others are ours or
+    // still in the memory pool
+    LOCK(pwallet->cs_wallet);
+    BOOST_FOREACH(const uint256& hash, vhashPrev)
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        if (txdb.ContainsTx(hash))
+            continue;
+        map<uint256, CWalletTx>::const_iterator mi = pwallet->mapWallet.find(hash);
+        if (mi != pwallet->mapWallet.end())
+            vtxRet.push_back((*mi).second);
+        else
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = pindex->pnext;
+            LOCK(mempool.cs);
+            if (mempool.exists(hash))
+                vtxRet.push_back(CMerkleTx(mempool.lookup(hash)));
         }
     }
-    return ret;
 }
 
-int CWallet::ScanForWalletTransaction(const uint256& hashTx)
+bool CWalletTx::WriteToDisk()
 {
-    CTransaction tx;
+    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+}
+
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated.
+// Number of blocks read ahead by the rescan threads
+static const unsigned int RESCAN_BATCH_SIZE = 256;
+
+struct CRescanBlock
+{
+    const CBlockIndex* pindex;
+    bool fRead;
+    CBlock block;
+    std::vector<uint256> vHash;
+    std::vector<char> vfMine; // whether the transaction pays to us
+};
+
+// Read every nStride-th block of vBlocks from nOffset on and find the transactions
+//   paying to the wallet. It only looks up keys, so it runs while cs_wallet is held
+static void ReadRescanBlocks(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks, unsigned int nOffset, unsigned int nStride)
+{
+    for (unsigned int i = nOffset; i < pvBlocks->size(); i += nStride)
+    {
+        CRescanBlock& entry = (*pvBlocks)[i];
+        entry.fRead = entry.block.ReadFromDisk(entry.pindex->nFile, entry.pindex->nBlockPos);
+        if (!entry.fRead)
+            continue;
+        entry.vHash.resize(entry.block.vtx.size());
+        entry.vfMine.assign(entry.block.vtx.size(), false);
+        for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+        {
+            const CTransaction& tx = entry.block.vtx[j];
+            entry.vHash[j] = tx.GetHash();
+            BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            {
+                if (pwallet->IsMine(txout) != MINE_NO)
+                {
+                    entry.vfMine[j] = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Scan the blocks in batches: the script thread budget reads and filters them
+//   in parallel, then the matches are added to the wallet in chain order, which
+//   also catches the transactions spending our coins received in the same batch
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    int ret = 0;
+
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    int nStartHeight = pindexStart ? pindexStart->nHeight : 0;
+    int nBlocks = std::max(1, nBestHeight - nStartHeight + 1);
+    int nLastProgress = -1;
+
+    CBlockIndex* pindex = pindexStart;
+    {
+        LOCK(cs_wallet);
+        std::vector<CRescanBlock> vBlocks;
+        while (pindex)
+        {
+            vBlocks.clear();
+            for (; pindex && vBlocks.size() < RESCAN_BATCH_SIZE; pindex = pindex->pnext)
+            {
+                vBlocks.push_back(CRescanBlock());
+                vBlocks.back().pindex = pindex;
+            }
+
+            boost::thread_group threads;
+            for (unsigned int i = 1; i < nThreads; i++)
+                threads.create_thread(boost::bind(&ReadRescanBlocks, this, &vBlocks, i, nThreads));
+            ReadRescanBlocks(this, &vBlocks, 0, nThreads);
+            threads.join_all();
+
+            {
+                // Transactions found in the whole batch of blocks are written at once
+                CWalletDBBatch batch(strWalletFile);
+                BOOST_FOREACH(const CRescanBlock& entry, vBlocks)
+                {
+                    if (!entry.fRead)
+                        continue;
+                    for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+                    {
+                        const CTransaction& tx = entry.block.vtx[j];
+                        bool fCandidate = entry.vfMine[j] || mapWallet.count(entry.vHash[j]);
+                        for (unsigned int k = 0; k < tx.vin.size() && !fCandidate; k++)
+                            fCandidate = mapWallet.count(tx.vin[k].prevout.hash);
+                        if (fCandidate && AddToWalletIfInvolvingMe(tx, &entry.block, fUpdate))
+                            ret++;
+                    }
+                }
+            }
+
+            int nProgress = std::min(99, (vBlocks.back().pindex->nHeight - nStartHeight) * 100 / nBlocks);
+            if (nProgress != nLastProgress)
+            {
+                uiInterface.ShowProgress(_("Rescanning..."), nProgress);
+                nLastProgress = nProgress;
+            }
+        }
+        uiInterface.ShowProgress(_("Rescanning..."), 100);
+    }
+    return ret;
+}
+
+int CWallet::ScanForWalletTransaction(const uint256& hashTx)
+{
+    CTransaction tx;
     tx.ReadFromDisk(COutPoint(hashTx, 0));
     if (AddToWalletIfInvolvingMe(tx, NULL, true))
         return 1;
@@ -1471,6 +2121,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %s42 %s\n", FormatMoney(wtx.GetCredit(MINE_ALL)).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    setStakeInputsUpdated.insert(wtx.GetHash());
                 }
             }
             else
@@ -1495,7 +2146,9 @@ bool CWalletTx::RelayWalletTransaction(CTxDB& txdb)
     if (IsCoinBase() || IsCoinStake() || txdb.ContainsTx(hash) || !InMempool())
         return false;
 
-    for(std::vector<CMerkleTx>::const_iterator it = vtxPrev.begin(); it != vtxPrev.end(); it++)
+    vector<CMerkleTx> vtxSupporting;
+    GetSupportingTransactions(txdb, vtxSupporting);
+    for(std::vector<CMerkleTx>::const_iterator it = vtxSupporting.begin(); it != vtxSupporting.end(); it++)
     {
         const CMerkleTx& tx = *it;
         uint256 hash = tx.GetHash();
@@ -1503,8 +2156,7 @@ bool CWalletTx::RelayWalletTransaction(CTxDB& txdb)
         if (tx.IsCoinBase() || tx.IsCoinStake())
             continue;
 
-        if (!txdb.ContainsTx(hash))
-            RelayTransaction((CTransaction)tx, hash);
+        RelayTransaction((CTransaction)tx, hash);
     }
 
     printf("Relaying wtx %s\n", hash.ToString().substr(0,10).c_str());
@@ -1518,27 +2170,80 @@ bool CWalletTx::RelayWalletTransaction()
    return RelayWalletTransaction(txdb);
 }
 
+void CWallet::AddToResendPending(const CWalletTx* pwtx)
+{
+    if (!pwtx->IsCoinBase() && !pwtx->IsCoinStake() && pwtx->GetDepthInMainChain() == 0)
+        setResendPending.insert(make_pair(pwtx->nTimeReceived, pwtx));
+}
+
 std::vector<uint256> CWallet::ResendWalletTransactionsBefore(int64_t nTime)
 {
     std::vector<uint256> result;
 
     LOCK(cs_wallet);
-    // Sort them in chronological order
-    map<unsigned int, CWalletTx*> mapSorted;
-    BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+    // A reorganization may have taken transactions out of their blocks
+    if (fResendValid && (!pindexResendTip || !pindexResendTip->IsInMainChain()))
+        fResendValid = false;
+    if (!fResendValid)
+    {
+        fResendValid = true;
+        setResendPending.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddToResendPending(&(*it).second);
+    }
+    pindexResendTip = pindexBest;
+
+    // Oldest first, each after the unconfirmed transactions it spends, all in
+    // one inv per peer. What the memory pool holds is not in the block chain,
+    // so the transaction database is not needed.
+    vector<CInv> vInv;
+    set<uint256> setQueued;
+    for (set<pair<unsigned int, const CWalletTx*> >::iterator it = setResendPending.begin(); it != setResendPending.end(); )
     {
-        CWalletTx& wtx = item.second;
+        const CWalletTx& wtx = *it->second;
         // Don't rebroadcast if newer than nTime:
         if (wtx.nTimeReceived > nTime)
+            break;
+        // In a block, or in conflict with one
+        if (wtx.GetDepthInMainChain() != 0)
+        {
+            setResendPending.erase(it++);
             continue;
-        mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
-    }
-    BOOST_FOREACH(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
-    {
-        CWalletTx& wtx = *item.second;
-        if (wtx.RelayWalletTransaction())
-            result.push_back(wtx.GetHash());
+        }
+        ++it;
+
+        if (!wtx.InMempool())
+            continue;
+        uint256 hash = wtx.GetHash();
+        result.push_back(hash);
+        if (!setQueued.insert(hash).second)
+            continue; // already queued as the input of another
+
+        vector<uint256> vSupporting = wtx.vhashPrev;
+        BOOST_FOREACH(const CMerkleTx& tx, wtx.vtxPrev)
+            vSupporting.push_back(tx.GetHash());
+        BOOST_FOREACH(const uint256& hashPrev, vSupporting)
+        {
+            if (setQueued.count(hashPrev))
+                continue;
+            CSendBuffer pmsg;
+            {
+                LOCK(mempool.cs);
+                if (mempool.exists(hashPrev))
+                    pmsg = MakeSendBuffer("tx", mempool.lookup(hashPrev));
+            }
+            if (!pmsg)
+                continue;
+            setQueued.insert(hashPrev);
+            vInv.push_back(CInv(MSG_TX, hashPrev));
+            AddRelayMessage(vInv.back(), pmsg);
+        }
+
+        vInv.push_back(CInv(MSG_TX, hash));
+        AddRelayMessage(vInv.back(), MakeSendBuffer("tx", (CTransaction)wtx));
     }
+    if (!vInv.empty())
+        RelayInventory(vInv);
     return result;
 }
 
@@ -1574,94 +2279,227 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
 //
 
 
-int64_t CWallet::GetBalance() const
+// A transaction is stable once it is final, confirmed and mature: from then on it
+// only counts towards the available balance, and its available credit can only
+// change through the hooks calling MarkBalanceDirty or through a reorganization
+static bool IsBalanceStable(const CWalletTx& wtx)
 {
-    int64_t nTotal = 0;
+    if (!wtx.IsFinal() || wtx.GetDepthInMainChain() < 1)
+        return false;
+    return !((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0);
+}
+
+void CWallet::InvalidateBalanceCache() const
+{
+    LOCK(cs_wallet);
+    fBalanceCacheValid = false;
+    pindexBalanceTip = NULL;
+    nStableBalance = nStableWatchOnlyBalance = 0;
+    mapBalanceStable.clear();
+    setBalanceVolatile.clear();
+}
+
+// Called when the credit of a wallet transaction may have changed
+void CWallet::MarkBalanceDirty(const CWalletTx* pwtx) const
+{
+    LOCK(cs_wallet);
+    // Spending an output can only take it out of the spendable output index
+    if (fUnspentIndexValid && mapUnspentHeight.count(pwtx))
+        IndexUnspentCoins(pwtx);
+    if (!fBalanceCacheValid)
+        return;
+    map<const CWalletTx*, pair<int64_t, int64_t> >::iterator mi = mapBalanceStable.find(pwtx);
+    if (mi == mapBalanceStable.end())
+        return;
+    nStableBalance -= mi->second.first;
+    nStableWatchOnlyBalance -= mi->second.second;
+    mapBalanceStable.erase(mi);
+    setBalanceVolatile.insert(pwtx);
+}
+
+void CWallet::UpdateBalanceCache() const
+{
+    const CBlockIndex* pindexTip = pindexBest;
+
+    // Stable transactions can only become volatile again when their block is
+    // disconnected, so a tip which doesn't extend the last one forces a recount
+    if (fBalanceCacheValid && pindexTip != pindexBalanceTip)
+    {
+        if (pindexTip == NULL || pindexBalanceTip == NULL || pindexTip->nHeight < pindexBalanceTip->nHeight ||
+            pindexTip->GetAncestor(pindexBalanceTip->nHeight) != pindexBalanceTip)
+            InvalidateBalanceCache();
+    }
+
+    if (!fBalanceCacheValid)
     {
-        LOCK(cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setBalanceVolatile.insert(&(*it).second);
+        fBalanceCacheValid = true;
+    }
+    pindexBalanceTip = pindexTip;
+
+    for (set<const CWalletTx*>::iterator it = setBalanceVolatile.begin(); it != setBalanceVolatile.end(); )
+    {
+        const CWalletTx* pcoin = *it;
+        if (!IsBalanceStable(*pcoin))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            ++it;
+            continue;
         }
+        int64_t nCredit = pcoin->GetAvailableCredit(), nWatchCredit = pcoin->GetAvailableWatchCredit();
+        mapBalanceStable[pcoin] = make_pair(nCredit, nWatchCredit);
+        nStableBalance += nCredit;
+        nStableWatchOnlyBalance += nWatchCredit;
+        setBalanceVolatile.erase(it++);
     }
-
-    return nTotal;
 }
 
-int64_t CWallet::GetWatchOnlyBalance() const
+void CWallet::GetBalances(CWalletBalances& balances) const
 {
-    int64_t nTotal = 0;
+    balances = CWalletBalances();
+
+    LOCK(cs_wallet);
+    UpdateBalanceCache();
+    balances.nBalance = nStableBalance;
+    balances.nWatchOnlyBalance = nStableWatchOnlyBalance;
+
+    BOOST_FOREACH(const CWalletTx* pcoin, setBalanceVolatile)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+        {
+            balances.nBalance += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyBalance += pcoin->GetAvailableWatchCredit();
+        }
+        if (!fTrusted || !pcoin->IsFinal())
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchCredit();
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+            balances.nUnconfirmedWatchOnly += pcoin->GetAvailableWatchCredit();
+        }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nImmatureWatchOnly += pcoin->GetImmatureWatchOnlyCredit();
+
+        if ((pcoin->IsCoinStake() || pcoin->IsCoinBase()) && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
+        {
+            int64_t nCredit = CWallet::GetCredit(*pcoin, MINE_ALL), nWatchCredit = CWallet::GetCredit(*pcoin, MINE_WATCH_ONLY);
+            if (pcoin->IsCoinStake())
+            {
+                balances.nStake += nCredit;
+                balances.nWatchOnlyStake += nWatchCredit;
+            }
+            else
+            {
+                balances.nNewMint += nCredit;
+                balances.nWatchOnlyNewMint += nWatchCredit;
+            }
         }
     }
+}
 
-    return nTotal;
+int64_t CWallet::GetBalance() const
+{
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nBalance;
+}
+
+int64_t CWallet::GetWatchOnlyBalance() const
+{
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nWatchOnlyBalance;
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nUnconfirmed;
 }
 
 int64_t CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchCredit();
-        }
-    }
-    return nTotal;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nUnconfirmedWatchOnly;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nImmature;
+}
+
+int64_t CWallet::GetImmatureWatchOnlyBalance() const
+{
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nImmatureWatchOnly;
+}
+
+void CWallet::InvalidateUnspentIndex() const
+{
+    LOCK(cs_wallet);
+    fUnspentIndexValid = false;
+    mapUnspentByHeight.clear();
+    mapUnspentHeight.clear();
+}
+
+void CWallet::UnindexUnspentCoins(const CWalletTx* pwtx) const
+{
+    map<const CWalletTx*, int>::iterator mi = mapUnspentHeight.find(pwtx);
+    if (mi == mapUnspentHeight.end())
+        return;
+    map<int, set<const CWalletTx*> >::iterator bi = mapUnspentByHeight.find(mi->second);
+    bi->second.erase(pwtx);
+    if (bi->second.empty())
+        mapUnspentByHeight.erase(bi);
+    mapUnspentHeight.erase(mi);
+}
+
+// Re-evaluate the entry of a wallet transaction in the spendable output index,
+// after it was added or updated or the spent flags of its outputs changed
+void CWallet::IndexUnspentCoins(const CWalletTx* pwtx) const
+{
+    LOCK(cs_wallet);
+    if (!fUnspentIndexValid)
+        return;
+    UnindexUnspentCoins(pwtx);
+
+    bool fUnspent = false;
+    for (unsigned int i = 0; i < pwtx->vout.size() && !fUnspent; i++)
+        fUnspent = !pwtx->IsSpent(i) && IsMine(pwtx->vout[i]) != MINE_NO;
+    if (!fUnspent)
+        return;
+
+    // The height only has to bound the depth from above: a transaction whose
+    // block gets disconnected is filtered out by the depth checks of the callers,
+    // and one confirmed again goes through AddToWallet with the new block
+    int nHeight = std::numeric_limits<int>::max();
+    if (pwtx->hashBlock != 0)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
+        BlockMap::iterator bi = mapBlockIndex.find(pwtx->hashBlock);
+        if (bi != mapBlockIndex.end() && bi->second->IsInMainChain())
+            nHeight = bi->second->nHeight;
     }
-    return nTotal;
+    mapUnspentHeight[pwtx] = nHeight;
+    mapUnspentByHeight[nHeight].insert(pwtx);
 }
 
-int64_t CWallet::GetImmatureWatchOnlyBalance() const
+// Wallet transactions with unspent outputs in a block at most nMaxHeight high
+void CWallet::GetUnspentTxs(int nMaxHeight, vector<const CWalletTx*>& vTx) const
 {
-    int64_t nTotal = 0;
+    if (!fUnspentIndexValid)
     {
-        LOCK(cs_wallet);
+        fUnspentIndexValid = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+            IndexUnspentCoins(&(*it).second);
     }
-    return nTotal;
+
+    map<int, set<const CWalletTx*> >::const_iterator end = mapUnspentByHeight.upper_bound(nMaxHeight);
+    for (map<int, set<const CWalletTx*> >::const_iterator bi = mapUnspentByHeight.begin(); bi != end; ++bi)
+        vTx.insert(vTx.end(), bi->second.begin(), bi->second.end());
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1671,10 +2509,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<const CWalletTx*> vTx;
+        GetUnspentTxs(std::numeric_limits<int>::max(), vTx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vTx)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
             if (!pcoin->IsFinal())
                 continue;
 
@@ -1687,11 +2525,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
                 continue;
 
+            uint256 hash = pcoin->GetHash();
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(pcoin->IsSpent(i)) && mine != MINE_NO && 
                     pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(hash, i)))
                 {
                     vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain(), mine == MINE_SPENDABLE));
                 }
@@ -1706,10 +2545,12 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf, int64_t
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Only the blocks deep enough can hold transactions with nConf confirmations
+        int nMaxHeight = nConf > 0 ? nBestHeight - nConf + 1 : std::numeric_limits<int>::max();
+        vector<const CWalletTx*> vTx;
+        GetUnspentTxs(nMaxHeight, vTx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vTx)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
             if (!pcoin->IsFinal())
                 continue;
 
@@ -1731,97 +2572,186 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf, int64_t
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
-                                  vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
+static bool CompareWalletTxHash(const CWalletTx* a, const CWalletTx* b)
 {
-    vector<char> vfIncluded;
+    return a->GetHash() < b->GetHash();
+}
 
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
+// A page of at most nLimit (0 for all) spendable outputs, walked from the
+// index in the order of block height, txid and output number and starting
+// after pCursor. Filters are applied before an output is added, so a small
+// page stops the walk early. False if the cursor is not a wallet transaction.
+bool CWallet::ListUnspentCoins(vector<COutput>& vCoins, int nMinDepth, int nMaxDepth, const set<CTxDestination>& setAddress,
+                               int64_t nMinValue, int64_t nMaxValue, const COutPoint* pCursor, unsigned int nLimit) const
+{
+    vCoins.clear();
+
+    LOCK(cs_wallet);
+    if (!fUnspentIndexValid)
+    {
+        fUnspentIndexValid = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            IndexUnspentCoins(&(*it).second);
+    }
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    // The cursor transaction may have no unspent outputs left, so its place
+    // comes from its block when it is out of the index
+    int nHeightStart = 0;
+    uint256 hashCursor = 0;
+    if (pCursor)
     {
-        vfIncluded.assign(vValue.size(), false);
-        int64_t nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(pCursor->hash);
+        if (it == mapWallet.end())
+            return false;
+        hashCursor = pCursor->hash;
+        map<const CWalletTx*, int>::const_iterator mi = mapUnspentHeight.find(&(*it).second);
+        if (mi != mapUnspentHeight.end())
+            nHeightStart = mi->second;
+        else
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            nHeightStart = std::numeric_limits<int>::max();
+            BlockMap::iterator bi = mapBlockIndex.find(it->second.hashBlock);
+            if (bi != mapBlockIndex.end() && bi->second->IsInMainChain())
+                nHeightStart = bi->second->nHeight;
+        }
+    }
+
+    // Heights in the index only bound the depth from above, so nMaxDepth is
+    // checked per transaction
+    int nMaxHeight = nMinDepth > 0 ? nBestHeight - nMinDepth + 1 : std::numeric_limits<int>::max();
+    map<int, set<const CWalletTx*> >::const_iterator end = mapUnspentByHeight.upper_bound(nMaxHeight);
+    for (map<int, set<const CWalletTx*> >::const_iterator bi = mapUnspentByHeight.lower_bound(nHeightStart); bi != end; ++bi)
+    {
+        vector<const CWalletTx*> vTx(bi->second.begin(), bi->second.end());
+        sort(vTx.begin(), vTx.end(), CompareWalletTxHash);
+        BOOST_FOREACH(const CWalletTx* pcoin, vTx)
+        {
+            uint256 hash = pcoin->GetHash();
+            if (pCursor && bi->first == nHeightStart && hash < hashCursor)
+                continue;
+
+            if (!pcoin->IsFinal())
+                continue;
+
+            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+                continue;
+
+            int nDepth = pcoin->GetDepthInMainChain();
+            if (nDepth < nMinDepth || nDepth > nMaxDepth)
+                continue;
+
+            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                if (pCursor && bi->first == nHeightStart && hash == hashCursor && i <= pCursor->n)
+                    continue;
+
+                const CTxOut& txout = pcoin->vout[i];
+                if (txout.nValue < nMinimumInputValue || txout.nValue < nMinValue || txout.nValue > nMaxValue)
+                    continue;
+
+                isminetype mine = IsMine(txout);
+                if (pcoin->IsSpent(i) || mine == MINE_NO)
+                    continue;
+
+                if (!setAddress.empty())
                 {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
+                    CTxDestination address;
+                    if (!ExtractDestination(txout.scriptPubKey, address) || !setAddress.count(address))
+                        continue;
                 }
+
+                vCoins.push_back(COutput(pcoin, i, nDepth, mine == MINE_SPENDABLE));
+                if (nLimit && vCoins.size() >= nLimit)
+                    return true;
             }
         }
     }
+    return true;
 }
 
-int64_t CWallet::GetStake() const
+// Find the subset of vValue (sorted by decreasing value) with the smallest total
+// reaching nTargetValue, by a depth-first branch and bound search. A branch is
+// cut as soon as the coins left cannot reach the target or the total cannot beat
+// the best one found; the search stops at an exact match or after nMaxTries steps.
+static void SelectBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
+                             vector<char>& vfBest, int64_t& nBest, int nMaxTries = 100000)
 {
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    // vRemaining[i] is the total of the coins from i on
+    vector<int64_t> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i-- > 0; )
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+
+    // Every coin from i on is always excluded
+    vector<char> vfIncluded(vValue.size(), false);
     int64_t nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < nMaxTries && nBest != nTargetValue; nTries++)
     {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, MINE_ALL);
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal >= nBest)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            nBest = nTotal;
+            vfBest = vfIncluded;
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Exclude the last included coin and go on from the one after it
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                break;
+            vfIncluded[i - 1] = false;
+            nTotal -= vValue[i - 1].first;
+            continue;
+        }
+
+        // Including a coin right after an excluded one of the same value would
+        // only repeat the branch already explored
+        if (i == 0 || vfIncluded[i - 1] || vValue[i].first != vValue[i - 1].first)
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+        }
+        i++;
     }
-    return nTotal;
+}
+
+int64_t CWallet::GetStake() const
+{
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nStake;
 }
 
 int64_t CWallet::GetWatchOnlyStake() const
 {
-    int64_t nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, MINE_WATCH_ONLY);
-    }
-    return nTotal;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nWatchOnlyStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, MINE_ALL);
-    }
-    return nTotal;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nNewMint;
 }
 
 int64_t CWallet::GetWatchOnlyNewMint() const
 {
-    int64_t nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, MINE_WATCH_ONLY);
-    }
-    return nTotal;
+    CWalletBalances balances;
+    GetBalances(balances);
+    return balances.nWatchOnlyNewMint;
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1830,11 +2760,10 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64_t>::max();
     coinLowestLarger.second.first = NULL;
-    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
+    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vCandidates, vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
+    vCandidates.reserve(vCoins.size());
     BOOST_FOREACH(const COutput &output, vCoins)
     {
         if (!output.fSpendable)
@@ -1851,9 +2780,14 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         if (pcoin->nTime > nSpendTime)
             continue;
 
-        int64_t n = pcoin->vout[i].nValue;
+        vCandidates.push_back(make_pair(pcoin->vout[i].nValue, make_pair(pcoin, i)));
+    }
 
-        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+    random_shuffle(vCandidates.begin(), vCandidates.end(), GetRandInt);
+
+    BOOST_FOREACH(const PAIRTYPE(int64_t, PAIRTYPE(const CWalletTx*, unsigned int))& coin, vCandidates)
+    {
+        int64_t n = coin.first;
 
         if (n == nTargetValue)
         {
@@ -1891,17 +2825,17 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Solve subset sum by branch and bound
     std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
     std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     int64_t nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    SelectBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        SelectBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest);
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    // If we have a bigger coin and (either the subset search didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
@@ -2004,6 +2938,90 @@ bool CWallet::SelectCoinsSimple(int64_t nTargetValue, int64_t nMinValue, int64_t
     return true;
 }
 
+// Inputs a signing thread gets at least, below that starting it costs more than it saves
+static const unsigned int SIGN_INPUTS_PER_THREAD = 8;
+
+static void SignInputs(const CKeyStore* pkeystore, const vector<const CTransaction*>* pvFrom, CTransaction* ptxTo,
+                       const CSignatureHashContext* psighash, unsigned int nOffset, unsigned int nStride, vector<char>* pvfGood)
+{
+    for (unsigned int i = nOffset; i < pvFrom->size(); i += nStride)
+    {
+        if (!SignSignature(*pkeystore, *(*pvFrom)[i], *ptxTo, i, SIGHASH_ALL, psighash))
+        {
+            (*pvfGood)[nOffset] = false;
+            return;
+        }
+    }
+}
+
+// Sign every input of txTo, input i spending an output of vFrom[i]. The signature
+// hashes come from a context made before any signing, and each input only writes
+// its own scriptSig, so the inputs are signed across the script check threads.
+static bool SignTransaction(const CKeyStore& keystore, const vector<const CTransaction*>& vFrom, CTransaction& txTo)
+{
+    CSignatureHashContext sighash(txTo);
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    nThreads = std::min<unsigned int>(nThreads, 1 + vFrom.size() / SIGN_INPUTS_PER_THREAD);
+
+    vector<char> vfGood(nThreads, true);
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&SignInputs, &keystore, &vFrom, &txTo, &sighash, i, nThreads, &vfGood));
+    SignInputs(&keystore, &vFrom, &txTo, &sighash, 0, nThreads, &vfGood);
+    threads.join_all();
+
+    return std::find(vfGood.begin(), vfGood.end(), false) == vfGood.end();
+}
+
+// Upper bound of the size txTo will have once signed, from the templates of the
+// outputs it spends; false if one of them is not a template of a known size
+static bool EstimateSignedSize(const CKeyStore& keystore, const vector<const CTransaction*>& vFrom, const CTransaction& txTo, unsigned int& nBytesRet)
+{
+    // A DER signature is at most 72 bytes, plus the hash type and its push opcode
+    static const unsigned int nMaxSigPush = 1 + 72 + 1;
+
+    nBytesRet = ::GetSerializeSize(txTo, SER_NETWORK, PROTOCOL_VERSION);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        const CTxIn& txin = txTo.vin[i];
+        if (!txin.scriptSig.empty() || txin.prevout.n >= vFrom[i]->vout.size())
+            return false;
+
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(vFrom[i]->vout[txin.prevout.n].scriptPubKey, whichType, vSolutions))
+            return false;
+
+        unsigned int nScriptSig;
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+        case TX_PUBKEY_DROP:
+            nScriptSig = nMaxSigPush;
+            break;
+        case TX_PUBKEYHASH:
+        {
+            CPubKey vchPubKey;
+            unsigned int nPubKeySize = 65;
+            if (keystore.GetPubKey(CKeyID(uint160(vSolutions[0])), vchPubKey))
+                nPubKeySize = vchPubKey.size();
+            nScriptSig = nMaxSigPush + 1 + nPubKeySize;
+            break;
+        }
+        case TX_MULTISIG:
+            // OP_0 and the required signatures
+            nScriptSig = 1 + vSolutions.front()[0] * nMaxSigPush;
+            break;
+        default:
+            return false;
+        }
+
+        // The empty scriptSig already counted one byte of length
+        nBytesRet += nScriptSig + GetSizeOfCompactSize(nScriptSig) - 1;
+    }
+    return true;
+}
+
 bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl* coinControl)
 {
     int64_t nValue = 0;
@@ -2086,14 +3104,21 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
-                // Sign
-                int nIn = 0;
+                // The fee is settled on the estimated size of the signed transaction, so
+                // that it is only signed once. Inputs of other kinds are signed to be measured.
+                vector<const CTransaction*> vFrom;
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    vFrom.push_back(coin.first);
+                unsigned int nBytes;
+                bool fEstimated = EstimateSignedSize(*this, vFrom, wtxNew, nBytes);
+                if (!fEstimated)
+                {
+                    if (!SignTransaction(*this, vFrom, wtxNew))
                         return false;
+                    nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                }
 
                 // Limit size
-                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
                 if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
                     return false;
                 dPriority /= nBytes;
@@ -2109,6 +3134,10 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                     continue;
                 }
 
+                // Sign
+                if (fEstimated && !SignTransaction(*this, vFrom, wtxNew))
+                    return false;
+
                 // Fill vtxPrev by copying from previous transactions vtxPrev
                 wtxNew.AddSupportingTransactions(txdb);
                 wtxNew.fTimeReceivedIsTxTime = true;
@@ -2142,171 +3171,308 @@ void CWallet::GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValu
     nWeight = bnCoinDayWeight.getuint64();
 }
 
-bool CWallet::MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nOutputValue, list<uint256>& listMerged)
+// Merge transaction waiting to be signed, with copies of the transactions it spends
+struct CMergeTx
 {
-    int64_t nBalance = GetBalance();
-
-    if (nAmount > nBalance)
-        return false;
+    CWalletTx wtx;
+    std::vector<CTransaction> vPrev;
+    bool fSigned;
 
-    listMerged.clear();
-    int64_t nValueIn = 0;
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    CMergeTx() : fSigned(false) { }
+};
 
-    // Simple coins selection - no randomization
-    if (!SelectCoinsSimple(nAmount, nMinValue, nOutputValue, GetTime(), 1, setCoins, nValueIn))
-        return false;
+static void SignMergeTxs(const CWallet* pwallet, std::vector<CMergeTx>* pvMerges, unsigned int nOffset, unsigned int nStride)
+{
+    for (unsigned int n = nOffset; n < pvMerges->size(); n += nStride)
+    {
+        CMergeTx& merge = (*pvMerges)[n];
+        CSignatureHashContext sighash(merge.wtx);
+        merge.fSigned = true;
+        for (unsigned int i = 0; i < merge.wtx.vin.size() && merge.fSigned; i++)
+            merge.fSigned = SignSignature(*pwallet, merge.vPrev[i], merge.wtx, i, SIGHASH_ALL, &sighash);
+    }
+}
 
-    if (setCoins.empty())
-        return false;
+// Pause between the commits of a merge job, so it doesn't starve sends and staking of the wallet lock
+static const int64_t MERGE_COMMIT_INTERVAL = 100;
 
-    CWalletTx wtxNew;
-    vector<const CWalletTx*> vwtxPrev;
+bool CWallet::MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nOutputValue, list<uint256>& listMerged)
+{
+    listMerged.clear();
+    std::vector<CMergeTx> vMerges;
 
     // Reserve a new key pair from key pool
     CReserveKey reservekey(this);
-    CPubKey vchPubKey = reservekey.GetReservedKey();
 
-    // Output script
-    CScript scriptOutput;
-    scriptOutput.SetDestination(vchPubKey.GetID());
+    // The merge transactions are laid out, with their fees, under the lock
+    // and only signed and committed afterwards
+    {
+        LOCK2(cs_main, cs_wallet);
 
-    // Insert output
-    wtxNew.vout.push_back(CTxOut(0, scriptOutput));
+        int64_t nBalance = GetBalance();
 
-    double dWeight = 0;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-    {
-        int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
+        if (nAmount > nBalance)
+            return false;
 
-        // Add current coin to inputs list and add its credit to transaction output
-        wtxNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-        wtxNew.vout[0].nValue += nCredit;
-        vwtxPrev.push_back(pcoin.first);
+        int64_t nValueIn = 0;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
 
-/*
-        // Replaced with estimation for performance purposes
+        // Simple coins selection - no randomization
+        if (!SelectCoinsSimple(nAmount, nMinValue, nOutputValue, GetTime(), 1, setCoins, nValueIn))
+            return false;
 
-        for (unsigned int i = 0; i < wtxNew.vin.size(); i++) {
-            const CWalletTx *txin = vwtxPrev[i];
+        if (setCoins.empty())
+            return false;
 
-            // Sign scripts to get actual transaction size for fee calculation
-            if (!SignSignature(*this, *txin, wtxNew, i))
-                return false;
-        }
-*/
+        CPubKey vchPubKey = reservekey.GetReservedKey();
 
-        // Assuming that average scriptsig size is 110 bytes
-        int64_t nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION) + wtxNew.vin.size() * 110;
-        dWeight += (double)nCredit * pcoin.first->GetDepthInMainChain();
+        // Output script
+        CScript scriptOutput;
+        scriptOutput.SetDestination(vchPubKey.GetID());
 
-        double dFinalPriority = dWeight /= nBytes;
-        bool fAllowFree = CTransaction::AllowFree(dFinalPriority);
+        CMergeTx merge;
 
-        // Get actual transaction fee according to its estimated size and priority
-        int64_t nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND, nBytes);
+        // Insert output
+        merge.wtx.vout.push_back(CTxOut(0, scriptOutput));
 
-        // Prepare transaction for commit if sum is enough ot its size is too big
-        if (nBytes >= MAX_BLOCK_SIZE_GEN/6 || wtxNew.vout[0].nValue >= nOutputValue)
+        double dWeight = 0;
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
         {
-            wtxNew.vout[0].nValue -= nMinFee; // Set actual fee
+            int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
 
-            for (unsigned int i = 0; i < wtxNew.vin.size(); i++) {
-                const CWalletTx *txin = vwtxPrev[i];
+            // Add current coin to inputs list and add its credit to transaction output
+            merge.wtx.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+            merge.wtx.vout[0].nValue += nCredit;
+            merge.vPrev.push_back(*pcoin.first);
 
-                // Sign all scripts
-                if (!SignSignature(*this, *txin, wtxNew, i))
-                    return false;
-            }
+            // Assuming that average scriptsig size is 110 bytes
+            int64_t nBytes = ::GetSerializeSize(*(CTransaction*)&merge.wtx, SER_NETWORK, PROTOCOL_VERSION) + merge.wtx.vin.size() * 110;
+            dWeight += (double)nCredit * pcoin.first->GetDepthInMainChain();
 
-            // Try to commit, return false on failure
-            if (!CommitTransaction(wtxNew, reservekey))
-                return false;
+            double dFinalPriority = dWeight /= nBytes;
+            bool fAllowFree = CTransaction::AllowFree(dFinalPriority);
+
+            // Get actual transaction fee according to its estimated size and priority
+            int64_t nMinFee = merge.wtx.GetMinFee(1, fAllowFree, GMF_SEND, nBytes);
 
-            listMerged.push_back(wtxNew.GetHash()); // Add to hashes list
+            // Prepare transaction for commit if sum is enough ot its size is too big
+            if (nBytes >= MAX_BLOCK_SIZE_GEN/6 || merge.wtx.vout[0].nValue >= nOutputValue)
+            {
+                merge.wtx.vout[0].nValue -= nMinFee; // Set actual fee
+                vMerges.push_back(merge);
 
-            dWeight = 0;  // Reset all temporary values
-            vwtxPrev.clear();
-            wtxNew.SetNull();
-            wtxNew.vout.push_back(CTxOut(0, scriptOutput));
+                dWeight = 0;  // Reset all temporary values
+                merge = CMergeTx();
+                merge.wtx.vout.push_back(CTxOut(0, scriptOutput));
+            }
         }
-    }
 
-    // Create transactions if there are some unhandled coins left
-    if (wtxNew.vout[0].nValue > 0) {
-        int64_t nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION) + wtxNew.vin.size() * 110;
+        // Create transactions if there are some unhandled coins left
+        if (merge.wtx.vout[0].nValue > 0) {
+            int64_t nBytes = ::GetSerializeSize(*(CTransaction*)&merge.wtx, SER_NETWORK, PROTOCOL_VERSION) + merge.wtx.vin.size() * 110;
 
-        double dFinalPriority = dWeight /= nBytes;
-        bool fAllowFree = CTransaction::AllowFree(dFinalPriority);
+            double dFinalPriority = dWeight /= nBytes;
+            bool fAllowFree = CTransaction::AllowFree(dFinalPriority);
 
-        // Get actual transaction fee according to its size and priority
-        int64_t nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND, nBytes);
+            // Get actual transaction fee according to its size and priority
+            int64_t nMinFee = merge.wtx.GetMinFee(1, fAllowFree, GMF_SEND, nBytes);
 
-        wtxNew.vout[0].nValue -= nMinFee; // Set actual fee
+            merge.wtx.vout[0].nValue -= nMinFee; // Set actual fee
 
-        if (wtxNew.vout[0].nValue <= 0)
-            return false;
+            if (merge.wtx.vout[0].nValue > 0)
+                vMerges.push_back(merge);
+        }
+    }
+
+    {
+        LOCK(cs_merge);
+        mergeStatus.nPlanned = vMerges.size();
+    }
 
-        for (unsigned int i = 0; i < wtxNew.vin.size(); i++) {
-            const CWalletTx *txin = vwtxPrev[i];
+    // The merge transactions spend distinct coins, so they are signed side by side
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    nThreads = std::min<unsigned int>(nThreads, vMerges.size());
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&SignMergeTxs, this, &vMerges, i, nThreads));
+    SignMergeTxs(this, &vMerges, 0, nThreads);
+    threads.join_all();
 
-            // Sign all scripts again
-            if (!SignSignature(*this, *txin, wtxNew, i))
+    for (unsigned int n = 0; n < vMerges.size(); n++)
+    {
+        if (fShutdown)
+            return false;
+        if (!vMerges[n].fSigned)
+            return false;
+        if (n > 0)
+            Sleep(MERGE_COMMIT_INTERVAL);
+
+        // Try to commit, return false on failure
+        {
+            LOCK2(cs_main, cs_wallet);
+            CWalletDBBatch batch(strWalletFile);
+            if (!CommitTransaction(vMerges[n].wtx, reservekey))
                 return false;
         }
 
-        // Try to commit, return false on failure
-        if (!CommitTransaction(wtxNew, reservekey))
-            return false;
+        listMerged.push_back(vMerges[n].wtx.GetHash()); // Add to hashes list
+        {
+            LOCK(cs_merge);
+            mergeStatus.listMerged.push_back(vMerges[n].wtx.GetHash());
+        }
+    }
+
+    // Nothing left to merge
+    if (vMerges.empty())
+        return false;
+
+    return true;
+}
+
+static void ThreadMergeCoins(void* parg)
+{
+    // Make this thread recognisable as the coin merging thread
+    RenameThread("42-merge");
+
+    CWallet* pwallet = (CWallet*)parg;
+    CMergeStatus status = pwallet->GetMergeStatus();
 
-        listMerged.push_back(wtxNew.GetHash()); // Add to hashes list
+    list<uint256> listMerged;
+    bool fSuccess = false;
+    try
+    {
+        fSuccess = pwallet->MergeCoins(status.nAmount, status.nMinValue, status.nOutputValue, listMerged);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadMergeCoins()");
+    } catch (...) {
+        PrintException(NULL, "ThreadMergeCoins()");
+    }
+
+    {
+        LOCK(pwallet->cs_merge);
+        pwallet->mergeStatus.fRunning = false;
+        pwallet->mergeStatus.nTimeFinished = GetTime();
+        if (!fSuccess)
+            pwallet->mergeStatus.strError = pwallet->mergeStatus.listMerged.empty() ? "Nothing was merged" : "Merging stopped before all transactions were committed";
+    }
+}
+
+bool CWallet::StartMergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nOutputValue, std::string& strError)
+{
+    LOCK(cs_merge);
+    if (mergeStatus.fRunning)
+    {
+        strError = "A merge is already in progress";
+        return false;
     }
 
+    mergeStatus.SetNull();
+    mergeStatus.fRunning = true;
+    mergeStatus.nAmount = nAmount;
+    mergeStatus.nMinValue = nMinValue;
+    mergeStatus.nOutputValue = nOutputValue;
+    mergeStatus.nTimeStarted = GetTime();
+    if (!NewThread(ThreadMergeCoins, this))
+    {
+        mergeStatus.fRunning = false;
+        strError = "Unable to start the merging thread";
+        return false;
+    }
     return true;
 }
 
-bool CWallet::CreateCoinStake(uint256 &hashTx, uint32_t nOut, uint32_t nGenerationTime, uint32_t nBits, CTransaction &txNew, CKey& key)
+CMergeStatus CWallet::GetMergeStatus() const
 {
-    CWalletTx wtx;
-    if (!GetTransaction(hashTx, wtx))
-        return error("Transaction %s is not found\n", hashTx.GetHex().c_str());
+    LOCK(cs_merge);
+    return mergeStatus;
+}
+
+// Resolve the kernel script and key of a stake input, everything of the
+//   coinstake which doesn't depend on the time the kernel is found at
+bool CWallet::PrepareCoinStake(const CWalletTx& wtx, unsigned int nOut, CCoinStakeSkeleton& skeleton) const
+{
+    if (nOut >= wtx.vout.size())
+        return false;
 
     vector<valtype> vSolutions;
     txnouttype whichType;
-    CScript scriptPubKeyOut;
-    CScript scriptPubKeyKernel = wtx.vout[nOut].scriptPubKey;
+    const CScript& scriptPubKeyKernel = wtx.vout[nOut].scriptPubKey;
     if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-        return error("CreateCoinStake : failed to parse kernel\n");
+        return error("PrepareCoinStake : failed to parse kernel\n");
 
     if (fDebug && GetBoolArg("-printcoinstake"))
-        printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        printf("PrepareCoinStake : parsed kernel type=%d\n", whichType);
 
     if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-        return error("CreateCoinStake : no support for kernel type=%d\n", whichType);
+        return error("PrepareCoinStake : no support for kernel type=%d\n", whichType);
+
+    skeleton.hashTx = wtx.GetHash();
+    skeleton.nOut = nOut;
+    skeleton.scriptPubKeyKernel = scriptPubKeyKernel;
+    skeleton.scriptPubKeyOut.clear();
 
     if (whichType == TX_PUBKEYHASH) // pay to address type
     {
         // convert to pay to public key type
-        if (!GetKey(uint160(vSolutions[0]), key))
-            return error("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+        CPubKey vchPubKey;
+        skeleton.keyID = CKeyID(uint160(vSolutions[0]));
+        if (!HaveKey(skeleton.keyID) || !GetPubKey(skeleton.keyID, vchPubKey))
+            return error("PrepareCoinStake : failed to get key for kernel type=%d\n", whichType);
 
-        scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        skeleton.scriptPubKeyOut << vchPubKey << OP_CHECKSIG;
     }
     if (whichType == TX_PUBKEY)
     {
-        valtype& vchPubKey = vSolutions[0];
-        if (!GetKey(Hash160(vchPubKey), key))
-            return error("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-        if (key.GetPubKey() != vchPubKey)
-            return error("CreateCoinStake : invalid key for kernel type=%d\n", whichType); // keys mismatch
-        scriptPubKeyOut = scriptPubKeyKernel;
+        CPubKey vchPubKey;
+        skeleton.keyID = CKeyID(Hash160(vSolutions[0]));
+        if (!HaveKey(skeleton.keyID) || !GetPubKey(skeleton.keyID, vchPubKey))
+            return error("PrepareCoinStake : failed to get key for kernel type=%d\n", whichType);
+        if (vchPubKey != CPubKey(vSolutions[0]))
+            return error("PrepareCoinStake : invalid key for kernel type=%d\n", whichType); // keys mismatch
+        skeleton.scriptPubKeyOut = scriptPubKeyKernel;
+    }
+
+    return true;
+}
+
+bool CWallet::CreateCoinStake(uint256 &hashTx, uint32_t nOut, uint32_t nGenerationTime, uint32_t nBits, CTransaction &txNew, CKey& key)
+{
+    CCoinStakeSkeleton skeleton;
+    {
+        LOCK(cs_wallet);
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+        if (mi == mapWallet.end())
+            return error("Transaction %s is not found\n", hashTx.GetHex().c_str());
+        if (!PrepareCoinStake(mi->second, nOut, skeleton))
+            return false;
     }
 
+    return CreateCoinStake(skeleton, nGenerationTime, nBits, txNew, key);
+}
+
+bool CWallet::CreateCoinStake(const CCoinStakeSkeleton& skeleton, uint32_t nGenerationTime, uint32_t nBits, CTransaction &txNew, CKey& key)
+{
+    CWalletTx wtx;
+    if (!GetTransaction(skeleton.hashTx, wtx))
+        return error("Transaction %s is not found\n", skeleton.hashTx.GetHex().c_str());
+
+    const uint256& hashTx = skeleton.hashTx;
+    unsigned int nOut = skeleton.nOut;
+    if (nOut >= wtx.vout.size() || wtx.IsSpent(nOut))
+        return error("CreateCoinStake : kernel input %s:%u is not available\n", hashTx.GetHex().c_str(), nOut);
+
+    // The private key is only needed now, so locking the wallet still stops minting
+    if (!GetKey(skeleton.keyID, key))
+        return error("CreateCoinStake : failed to get key for kernel\n");
+
+    const CScript& scriptPubKeyKernel = skeleton.scriptPubKeyKernel;
+    const CScript& scriptPubKeyOut = skeleton.scriptPubKeyOut;
+
     // The following combine threshold is important to security
     // Should not be adjusted if you don't understand the consequences
     int64_t nCombineThreshold = 1 * CENT;
 
-    int64_t nBalance = GetBalance();
     int64_t nCredit = wtx.vout[nOut].nValue;
 
     txNew.vin.clear();
@@ -2326,19 +3492,21 @@ bool CWallet::CreateCoinStake(uint256 &hashTx, uint32_t nOut, uint32_t nGenerati
     txNew.vout.push_back(CTxOut(0, scriptEmpty));
 
     if (fDebug && GetBoolArg("-printcoinstake"))
-        printf("CreateCoinStake : added kernel type=%d\n", whichType);
-
-    int64_t nValueIn = 0;
-    CoinsSet setCoins;
-    if (!SelectCoinsSimple(nBalance - nReserveBalance, MIN_TX_FEE, MAX_MONEY, nGenerationTime, nCoinbaseMaturity, setCoins, nValueIn))
-        return false;
-
-    if (setCoins.empty())
-        return false;
+        printf("CreateCoinStake : added kernel %s:%u\n", hashTx.GetHex().c_str(), nOut);
 
     bool fDontSplitCoins = false;
     if (GetWeight((int64_t)wtx.nTime, (int64_t)nGenerationTime) == nStakeMaxAge)
     {
+        // Walking the whole wallet is only needed when there are inputs to combine
+        int64_t nBalance = GetBalance();
+        int64_t nValueIn = 0;
+        CoinsSet setCoins;
+        if (!SelectCoinsSimple(nBalance - nReserveBalance, MIN_TX_FEE, MAX_MONEY, nGenerationTime, nCoinbaseMaturity, setCoins, nValueIn))
+            return false;
+
+        if (setCoins.empty())
+            return false;
+
         // Only one output for old kernel inputs
         txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
@@ -2424,12 +3592,9 @@ bool CWallet::CreateCoinStake(uint256 &hashTx, uint32_t nOut, uint32_t nGenerati
         }
 
         // Sign
-        int nIn = 0;
-        BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
-        {
-            if (!SignSignature(*this, *pcoin, txNew, nIn++))
-                return error("CreateCoinStake : failed to sign coinstake\n");
-        }
+        vector<const CTransaction*> vFrom(vwtxPrev.begin(), vwtxPrev.end());
+        if (!SignTransaction(*this, vFrom, txNew))
+            return error("CreateCoinStake : failed to sign coinstake\n");
 
         // Limit size
         unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -2497,6 +3662,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
                 vMintingWalletUpdated.push_back(coin.GetHash());
+                setStakeInputsUpdated.insert(coin.GetHash());
             }
 
             if (fFileBacked)
@@ -2680,10 +3846,14 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 // Mark old keypool keys as used,
 // and generate all new keys
 //
+// Keys generated, and committed to the wallet file, at a time by the key pool refills
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+
 bool CWallet::NewKeyPool(unsigned int nSize)
 {
     {
         LOCK(cs_wallet);
+        CWalletDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
@@ -2698,11 +3868,17 @@ bool CWallet::NewKeyPool(unsigned int nSize)
         else
             nKeys = max<uint64_t>(GetArg("-keypool", 100), 0);
 
-        for (uint64_t i = 0; i < nKeys; i++)
+        std::vector<CPubKey> vPubKeys;
+        for (uint64_t i = 0; i < nKeys; )
         {
-            uint64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            GenerateNewKeys(std::min<uint64_t>(nKeys - i, KEYPOOL_BATCH_SIZE), vPubKeys);
+            BOOST_FOREACH(const CPubKey& pubkey, vPubKeys)
+            {
+                uint64_t nIndex = ++i;
+                walletdb.WritePool(nIndex, CKeyPool(pubkey));
+                setKeyPool.insert(nIndex);
+            }
+            batch.Flush();
         }
         printf("CWallet::NewKeyPool wrote %" PRIu64 " new keys\n", nKeys);
     }
@@ -2717,6 +3893,7 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         if (IsLocked())
             return false;
 
+        CWalletDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
 
         // Top up key pool
@@ -2726,15 +3903,23 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         else
             nTargetSize = max<uint64_t>(GetArg("-keypool", 100), 0);
 
+        std::vector<CPubKey> vPubKeys;
         while (setKeyPool.size() < (nTargetSize + 1))
         {
-            uint64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %" PRIu64 ", size=%" PRIszu "\n", nEnd, setKeyPool.size());
+            GenerateNewKeys(std::min<uint64_t>(nTargetSize + 1 - setKeyPool.size(), KEYPOOL_BATCH_SIZE), vPubKeys);
+            BOOST_FOREACH(const CPubKey& pubkey, vPubKeys)
+            {
+                uint64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(pubkey)))
+                    throw runtime_error("TopUpKeyPool() : writing generated key failed");
+                setKeyPool.insert(nEnd);
+                printf("keypool added key %" PRIu64 ", size=%" PRIszu "\n", nEnd, setKeyPool.size());
+            }
+
+            // Keep the transaction, and the lock table with it, bounded
+            batch.Flush();
         }
     }
     return true;
@@ -2832,10 +4017,11 @@ std::map<CBitcoinAddress, int64_t> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        // Transactions without unspent outputs of ours add nothing
+        vector<const CWalletTx*> vTx;
+        GetUnspentTxs(std::numeric_limits<int>::max(), vTx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vTx)
         {
-            CWalletTx *pcoin = &walletEntry.second;
-
             if (!pcoin->IsFinal() || !pcoin->IsTrusted())
                 continue;
 
@@ -2866,94 +4052,118 @@ std::map<CBitcoinAddress, int64_t> CWallet::GetAddressBalances()
     return balances;
 }
 
-set< set<CBitcoinAddress> > CWallet::GetAddressGroupings()
+void CWallet::InvalidateAddressGroupings()
 {
-    set< set<CBitcoinAddress> > groupings;
-    set<CBitcoinAddress> grouping;
+    LOCK(cs_wallet);
+    fGroupingsValid = false;
+    mapGroupingIDs.clear();
+    vGroupingAddresses.clear();
+    vGroupingParent.clear();
+    mapGroupingPending.clear();
+}
+
+int CWallet::GetGroupingID(const CBitcoinAddress& address)
+{
+    pair<map<CBitcoinAddress, int>::iterator, bool> ret = mapGroupingIDs.insert(make_pair(address, (int)vGroupingParent.size()));
+    if (ret.second)
+    {
+        vGroupingAddresses.push_back(address);
+        vGroupingParent.push_back(ret.first->second);
+    }
+    return ret.first->second;
+}
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+int CWallet::GetGroupingRoot(int nID)
+{
+    while (vGroupingParent[nID] != nID)
     {
-        CWalletTx *pcoin = &walletEntry.second;
+        // Path halving
+        vGroupingParent[nID] = vGroupingParent[vGroupingParent[nID]];
+        nID = vGroupingParent[nID];
+    }
+    return nID;
+}
 
-        if (pcoin->vin.size() > 0)
+// Merge the addresses a wallet transaction links together into one group
+void CWallet::AddToGroupings(const CWalletTx* pcoin)
+{
+    vector<int> vGroup;
+
+    if (pcoin->vin.size() > 0)
+    {
+        bool any_mine = false;
+        // group all input addresses with each other
+        BOOST_FOREACH(const CTxIn& txin, pcoin->vin)
         {
-            bool any_mine = false;
-            // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
+            const CTxOut* pprevout = GetPrevOut(txin.prevout);
+            if (!pprevout)
             {
-                CBitcoinAddress address;
-                if(!IsMine(txin)) // If this input isn't mine, ignore it
-                    continue;
-                if(!ExtractAddress(*this, mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                any_mine = true;
+                // Looked at again if the spent transaction ever comes in
+                if (!mapWallet.count(txin.prevout.hash))
+                    mapGroupingPending[txin.prevout.hash].push_back(pcoin);
+                continue;
             }
+            CBitcoinAddress address;
+            if(!IsMine(*pprevout)) // If this input isn't mine, ignore it
+                continue;
+            if(!ExtractAddress(*this, pprevout->scriptPubKey, address))
+                continue;
+            vGroup.push_back(GetGroupingID(address));
+            any_mine = true;
+        }
 
-            // group change with input addresses
-            if (any_mine)
-            {
-                BOOST_FOREACH(CTxOut txout, pcoin->vout)
+        // group change with input addresses
+        if (any_mine)
+        {
+            BOOST_FOREACH(const CTxOut& txout, pcoin->vout)
                 if (IsChange(txout))
                 {
                     CBitcoinAddress txoutAddr;
                     if(!ExtractAddress(*this, txout.scriptPubKey, txoutAddr))
                         continue;
-                        grouping.insert(txoutAddr);
+                    vGroup.push_back(GetGroupingID(txoutAddr));
                 }
-            }
-            if (!grouping.empty())
-            {
-                groupings.insert(grouping);
-                grouping.clear();
-            }
         }
 
-        // group lone addrs by themselves
-        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            if (IsMine(pcoin->vout[i]))
-            {
-                CBitcoinAddress address;
-                if(!ExtractAddress(*this, pcoin->vout[i].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
-            }
+        for (unsigned int i = 1; i < vGroup.size(); i++)
+        {
+            int nRoot = GetGroupingRoot(vGroup[0]);
+            int nOther = GetGroupingRoot(vGroup[i]);
+            if (nRoot != nOther)
+                vGroupingParent[std::max(nRoot, nOther)] = std::min(nRoot, nOther);
+        }
     }
 
-    set< set<CBitcoinAddress>* > uniqueGroupings; // a set of pointers to groups of addresses
-    map< CBitcoinAddress, set<CBitcoinAddress>* > setmap;  // map addresses to the unique group containing it
-    BOOST_FOREACH(set<CBitcoinAddress> grouping, groupings)
-    {
-        // make a set of all the groups hit by this new group
-        set< set<CBitcoinAddress>* > hits;
-        map< CBitcoinAddress, set<CBitcoinAddress>* >::iterator it;
-        BOOST_FOREACH(CBitcoinAddress address, grouping)
-            if ((it = setmap.find(address)) != setmap.end())
-                hits.insert((*it).second);
-
-        // merge all hit groups into a new single group and delete old groups
-        set<CBitcoinAddress>* merged = new set<CBitcoinAddress>(grouping);
-        BOOST_FOREACH(set<CBitcoinAddress>* hit, hits)
+    // group lone addrs by themselves
+    for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        if (IsMine(pcoin->vout[i]))
         {
-            merged->insert(hit->begin(), hit->end());
-            uniqueGroupings.erase(hit);
-            delete hit;
+            CBitcoinAddress address;
+            if(!ExtractAddress(*this, pcoin->vout[i].scriptPubKey, address))
+                continue;
+            GetGroupingID(address);
         }
-        uniqueGroupings.insert(merged);
+}
 
-        // update setmap
-        BOOST_FOREACH(CBitcoinAddress element, *merged)
-            setmap[element] = merged;
+set< set<CBitcoinAddress> > CWallet::GetAddressGroupings()
+{
+    LOCK(cs_wallet);
+    if (!fGroupingsValid || nGroupingsBookSize != mapAddressBook.size())
+    {
+        InvalidateAddressGroupings();
+        fGroupingsValid = true;
+        nGroupingsBookSize = mapAddressBook.size();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddToGroupings(&(*it).second);
     }
 
+    map<int, set<CBitcoinAddress> > mapGroups;
+    for (unsigned int nID = 0; nID < vGroupingParent.size(); nID++)
+        mapGroups[GetGroupingRoot(nID)].insert(vGroupingAddresses[nID]);
+
     set< set<CBitcoinAddress> > ret;
-    BOOST_FOREACH(set<CBitcoinAddress>* uniqueGrouping, uniqueGroupings)
-    {
-        ret.insert(*uniqueGrouping);
-        delete uniqueGrouping;
-    }
+    for (map<int, set<CBitcoinAddress> >::iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+        ret.insert((*it).second);
 
     return ret;
 }
@@ -2990,6 +4200,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    setStakeInputsUpdated.insert(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3002,6 +4213,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    setStakeInputsUpdated.insert(pcoin->GetHash());
                 }
             }
 
@@ -3035,6 +4247,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                setStakeInputsUpdated.insert(txin.prevout.hash);
             }
         }
     }
@@ -21,6 +21,7 @@
 extern unsigned int nStakeMaxAge;
 extern bool fWalletUnlockMintOnly;
 extern bool fConfChange;
+extern bool fSupportingTxids;
 
 class CAccountingEntry;
 class CWalletTx;
@@ -72,6 +73,155 @@ public:
     )
 };
 
+/** Compact filter over random 256 or 160 bit identifiers, used by the wallet
+ * to reject unrelated transactions in a few probes. It is a bloom filter with
+ * two probes and 16 bits per element: it never misses an element which was
+ * inserted, and answers true for about 1.5% of the others.
+ */
+class CWalletFilter
+{
+private:
+    std::vector<uint64_t> vBits;
+    unsigned int nElements;
+    unsigned int nCapacity;
+    uint64_t nSalt;
+
+    void Probe(uint64_t nKey, size_t& nPos1, size_t& nPos2) const
+    {
+        uint64_t h = (nKey ^ nSalt) * 0x9e3779b97f4a7c15ULL;
+        size_t nMask = vBits.size() * 64 - 1;
+        nPos1 = (size_t)(h >> 32) & nMask;
+        nPos2 = (size_t)((h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL) & nMask;
+    }
+
+public:
+    CWalletFilter() : nElements(0), nCapacity(0), nSalt(0) {}
+
+    void Reset(unsigned int nCapacityIn)
+    {
+        size_t nWords = 1;
+        while (nWords * 64 < 16 * (size_t)nCapacityIn)
+            nWords *= 2;
+        vBits.assign(nWords, 0);
+        nElements = 0;
+        nCapacity = nCapacityIn;
+        nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+
+    // Returns false when the filter is full and has to be rebuilt larger
+    bool Insert(uint64_t nKey)
+    {
+        if (vBits.empty() || nElements >= nCapacity)
+            return false;
+        size_t nPos1, nPos2;
+        Probe(nKey, nPos1, nPos2);
+        vBits[nPos1 / 64] |= 1ULL << (nPos1 % 64);
+        vBits[nPos2 / 64] |= 1ULL << (nPos2 % 64);
+        nElements++;
+        return true;
+    }
+
+    bool Contains(uint64_t nKey) const
+    {
+        if (vBits.empty())
+            return true;
+        size_t nPos1, nPos2;
+        Probe(nKey, nPos1, nPos2);
+        return (vBits[nPos1 / 64] >> (nPos1 % 64) & 1) && (vBits[nPos2 / 64] >> (nPos2 % 64) & 1);
+    }
+
+    unsigned int size() const { return nElements; }
+};
+
+/** Balance totals of a wallet, as returned by CWallet::GetBalances */
+struct CWalletBalances
+{
+    int64_t nBalance;
+    int64_t nWatchOnlyBalance;
+    int64_t nUnconfirmed;
+    int64_t nUnconfirmedWatchOnly;
+    int64_t nImmature;
+    int64_t nImmatureWatchOnly;
+    int64_t nStake;
+    int64_t nWatchOnlyStake;
+    int64_t nNewMint;
+    int64_t nWatchOnlyNewMint;
+
+    CWalletBalances() : nBalance(0), nWatchOnlyBalance(0), nUnconfirmed(0), nUnconfirmedWatchOnly(0), nImmature(0),
+        nImmatureWatchOnly(0), nStake(0), nWatchOnlyStake(0), nNewMint(0), nWatchOnlyNewMint(0) {}
+};
+
+/** Progress of a background coin merging job */
+class CMergeStatus
+{
+public:
+    bool fRunning;
+    int64_t nAmount;
+    int64_t nMinValue;
+    int64_t nOutputValue;
+    int64_t nTimeStarted;
+    int64_t nTimeFinished;
+    int nPlanned;                   // merge transactions laid out
+    std::list<uint256> listMerged;  // merge transactions committed so far
+    std::string strError;
+
+    CMergeStatus()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        fRunning = false;
+        nAmount = nMinValue = nOutputValue = 0;
+        nTimeStarted = nTimeFinished = 0;
+        nPlanned = 0;
+        listMerged.clear();
+        strError.clear();
+    }
+};
+
+/** Part of a coinstake transaction which depends only on its kernel input. The
+ * stake miner prepares one for every input it scans, so a found kernel only needs
+ * the time, amounts and signatures filled in.
+ */
+class CCoinStakeSkeleton
+{
+public:
+    uint256 hashTx;
+    unsigned int nOut;
+    CKeyID keyID;               // key signing the block and the kernel input
+    CScript scriptPubKeyKernel;
+    CScript scriptPubKeyOut;    // pay to public key form of the kernel script
+
+    CCoinStakeSkeleton() : nOut(0) { }
+};
+
+/** What is kept in memory of an archived wallet transaction, a fully spent and
+ * deeply confirmed one which was dropped from mapWallet. Its full record stays in
+ * the wallet file, where the history RPCs read it back from.
+ */
+class CArchivedTx
+{
+public:
+    std::vector<CTxOut> vout;   // for the debits of its spenders, scripts only kept for our outputs
+    int64_t nOrderPos;
+    int nHeight;
+
+    CArchivedTx()
+    {
+        nOrderPos = -1;
+        nHeight = -1;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vout);
+        READWRITE(nOrderPos);
+        READWRITE(nHeight);
+    )
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -95,9 +245,94 @@ private:
     uint64_t nKernelsTried;
     uint64_t nCoinDaysTried;
 
+    // Balance cache: the available credit of confirmed and mature transactions
+    // is summed once, only the other (volatile) ones are counted on every query
+    mutable bool fBalanceCacheValid;
+    mutable const CBlockIndex* pindexBalanceTip;
+    mutable int64_t nStableBalance;
+    mutable int64_t nStableWatchOnlyBalance;
+    mutable std::map<const CWalletTx*, std::pair<int64_t, int64_t> > mapBalanceStable;
+    mutable std::set<const CWalletTx*> setBalanceVolatile;
+
+    void UpdateBalanceCache() const;
+
+    // Spendable output index: the transactions with unspent outputs we own,
+    // bucketed by the height of their block (INT_MAX when not in the main chain)
+    mutable bool fUnspentIndexValid;
+    mutable std::map<int, std::set<const CWalletTx*> > mapUnspentByHeight;
+    mutable std::map<const CWalletTx*, int> mapUnspentHeight;
+
+    void UnindexUnspentCoins(const CWalletTx* pwtx) const;
+
+    // Filters of the key and script ids and watch-only destinations which can
+    // make an output ours, and of the wallet transaction ids
+    bool fFilterValid;
+    CWalletFilter filterIDs;
+    CWalletFilter filterTxs;
+
+    void RebuildFilters();
+    bool MayBeInvolvingMe(const CTransaction& tx, const uint256& hash);
+
+    void GetUnspentTxs(int nMaxHeight, std::vector<const CWalletTx*>& vTx) const;
+
+    // Order index: every wallet transaction by its nOrderPos
+    bool fTxOrderedValid;
+    std::multimap<int64_t, CWalletTx*> mapTxOrdered;
+
+    // Height index: every wallet transaction by the height of its block (INT_MAX
+    // when not in the main chain). Entries up to the height of pindexTxHeightTip
+    // are known to be right while that block stays in the main chain.
+    bool fTxHeightValid;
+    const CBlockIndex* pindexTxHeightTip;
+    std::map<int, std::set<const CWalletTx*> > mapTxByHeight;
+    std::map<const CWalletTx*, int> mapTxHeight;
+
+    void IndexTxHeight(const CWalletTx* pwtx);
+    void UnindexTxHeight(const CWalletTx* pwtx);
+
+    // Resend set: the wallet transactions that may still have to be rebroadcast,
+    // in the order they were received. Built on the first resend and added to by
+    // AddToWallet; the ones found in a block leave it on the next resend, and it
+    // is built again when pindexResendTip is taken out of the main chain.
+    bool fResendValid;
+    const CBlockIndex* pindexResendTip;
+    std::set<std::pair<unsigned int, const CWalletTx*> > setResendPending;
+
+    void AddToResendPending(const CWalletTx* pwtx);
+
+    // Address groupings: a union-find over the addresses of the wallet transactions,
+    // extended as transactions are added and rebuilt when the keys change. Change
+    // detection depends on the address book, which is only ever added to with
+    // operator[] outside of SetAddressBookName, so its size is compared too.
+    bool fGroupingsValid;
+    unsigned int nGroupingsBookSize;
+    std::map<CBitcoinAddress, int> mapGroupingIDs;
+    std::vector<CBitcoinAddress> vGroupingAddresses;
+    std::vector<int> vGroupingParent;
+    std::map<uint256, std::vector<const CWalletTx*> > mapGroupingPending; // spenders of transactions not in the wallet yet
+
+    // Archive: the transactions moved out of mapWallet by ArchiveTransactions
+    int nArchiveDepth;
+    int nArchiveHeight;
+    std::map<uint256, CArchivedTx> mapArchived;
+    std::multimap<int64_t, uint256> mapArchivedOrdered;
+
+    // The spent output, from mapWallet or the archive
+    const CTxOut* GetPrevOut(const COutPoint& prevout) const;
+    // Drop the transaction from the balance cache and the indexes, before it leaves mapWallet
+    void UnindexWalletTx(CWalletTx* pwtx);
+
+    int GetGroupingID(const CBitcoinAddress& address);
+    int GetGroupingRoot(int nID);
+    void AddToGroupings(const CWalletTx* pwtx);
+
 public:
     mutable CCriticalSection cs_wallet;
 
+    // Background coin merging
+    mutable CCriticalSection cs_merge;
+    CMergeStatus mergeStatus;
+
     bool fFileBacked;
     std::string strWalletFile;
 
@@ -138,10 +373,26 @@ public:
         nKernelsTried = 0;
         nCoinDaysTried = 0;
         nTimeFirstKey = 0;
+        fBalanceCacheValid = false;
+        pindexBalanceTip = NULL;
+        nStableBalance = 0;
+        nStableWatchOnlyBalance = 0;
+        fUnspentIndexValid = false;
+        fFilterValid = false;
+        fTxOrderedValid = false;
+        fTxHeightValid = false;
+        pindexTxHeightTip = NULL;
+        fResendValid = false;
+        pindexResendTip = NULL;
+        fGroupingsValid = false;
+        nGroupingsBookSize = 0;
+        nArchiveDepth = 0;
+        nArchiveHeight = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     std::vector<uint256> vMintingWalletUpdated;
+    std::set<uint256> setStakeInputsUpdated; // transactions whose outputs the stake miner has to re-examine
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -151,13 +402,17 @@ public:
     int64_t nTimeFirstKey;
 
     const CWalletTx* GetWalletTx(const uint256& hash) const;
+    // Adds the estimated memory of the transactions and address book, see getmemoryinfo
+    void GetMemoryUsage(CMemoryUsage& usage) const;
 
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoinsMinConf(std::vector<COutput>& vCoins, int nConf, int64_t nMinValue, int64_t nMaxValue) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    bool ListUnspentCoins(std::vector<COutput>& vCoins, int nMinDepth, int nMaxDepth, const std::set<CTxDestination>& setAddress,
+                          int64_t nMinValue, int64_t nMaxValue, const COutPoint* pCursor, unsigned int nLimit) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     // Simple select (without randomization)
     bool SelectCoinsSimple(int64_t nTargetValue, int64_t nMinValue, int64_t nMaxValue, unsigned int nSpendTime, int nMinConf, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
@@ -165,6 +420,8 @@ public:
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    // Generate nCount new keys at once, spreading the work over the script check threads
+    void GenerateNewKeys(unsigned int nCount, std::vector<CPubKey>& vPubKeysRet);
     CMalleableKeyView GenerateNewMalleableKey();
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
@@ -218,7 +475,42 @@ public:
      */
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
+    /** Get the wallet transactions ordered by nOrderPos, kept up to date as they are added */
+    const std::multimap<int64_t, CWalletTx*>& GetOrderedTxs();
+
+    /** Get the wallet transactions which are not in a block of the main chain up
+        to pindex, from the transactions in the blocks above it and the unconfirmed ones */
+    void GetTxsSince(const CBlockIndex* pindex, std::vector<const CWalletTx*>& vTx);
+
+    void InvalidateTxIndexes();
+    void InvalidateAddressGroupings();
+    /** Move the fully spent transactions, which are at least nDepth blocks deep
+        and whose spenders are too, out of mapWallet into the archive
+        @return number of transactions archived
+     */
+    int ArchiveTransactions(int nDepth);
+    // Archive again every ARCHIVE_INTERVAL blocks (0 to stop)
+    void SetArchiveDepth(int nDepth) { nArchiveDepth = nDepth; }
+    bool LoadArchivedTx(const uint256& hash, const CArchivedTx& atx);
+    bool IsArchived(const uint256& hash) const;
+    unsigned int GetArchiveSize() const;
+    // Read an archived transaction back from the wallet file
+    bool ReadArchivedTx(const uint256& hash, CWalletTx& wtx);
+    const std::multimap<int64_t, uint256>& GetArchivedOrdered() const { return mapArchivedOrdered; }
+    /** Get all the wallet transactions, with the archived ones read back into listArchivedRet
+        @warning Returned pointers are *only* valid within the scope of passed listArchivedRet
+     */
+    void GetHistoryTxs(std::vector<const CWalletTx*>& vTxRet, std::list<CWalletTx>& listArchivedRet);
+    // Read back the archived transactions from the blocks above nHeight
+    void GetArchivedTxsSince(int nHeight, std::list<CWalletTx>& listRet);
+
+
     void MarkDirty();
+    void InvalidateBalanceCache() const;
+    void MarkBalanceDirty(const CWalletTx* pwtx) const;
+    void InvalidateUnspentIndex() const;
+    void IndexUnspentCoins(const CWalletTx* pwtx) const;
+    void InvalidateFilters();
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false);
     bool EraseFromWallet(uint256 hash);
@@ -229,6 +521,7 @@ public:
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
+    void GetBalances(CWalletBalances& balances) const;
     int64_t GetBalance() const;
     int64_t GetWatchOnlyBalance() const;
     int64_t GetUnconfirmedBalance() const;
@@ -244,8 +537,13 @@ public:
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
 
     void GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValue, uint64_t& nWeight);
+    bool PrepareCoinStake(const CWalletTx& wtx, unsigned int nOut, CCoinStakeSkeleton& skeleton) const;
+    bool CreateCoinStake(const CCoinStakeSkeleton& skeleton, uint32_t nTime, uint32_t nBits, CTransaction &txNew, CKey& key);
     bool CreateCoinStake(uint256 &hashTx, uint32_t nOut, uint32_t nTime, uint32_t nBits, CTransaction &txNew, CKey& key);
     bool MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nMaxValue, std::list<uint256>& listMerged);
+    // Run MergeCoins on a thread of its own, reporting its progress in mergeStatus
+    bool StartMergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nMaxValue, std::string& strError);
+    CMergeStatus GetMergeStatus() const;
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
@@ -327,6 +625,31 @@ public:
     boost::signals2::signal<void (bool fHaveWatchOnly)> NotifyWatchonlyChanged;
 };
 
+/** Reads the wallet's activity log backwards, from the newest wallet transaction
+ * or accounting entry, without building the whole log like OrderedTxItems does.
+ * Archived transactions are read back from the wallet file when they are reached.
+ * cs_wallet must be held while it is used.
+ */
+class CReverseTxItemsReader
+{
+private:
+    CWallet* pwallet;
+    std::multimap<int64_t, CWalletTx*>::const_reverse_iterator wi;
+    std::multimap<int64_t, CWalletTx*>::const_reverse_iterator wend;
+    std::multimap<int64_t, uint256>::const_reverse_iterator ai;
+    std::multimap<int64_t, uint256>::const_reverse_iterator aend;
+    std::list<CWalletTx> listArchived; // read back from the wallet file as they are reached
+    std::vector<CAccountingEntry*> vEntries; // newest first
+    unsigned int nEntry;
+
+public:
+    CReverseTxItemsReader(CWallet* pwallet, std::list<CAccountingEntry>& acentries);
+
+    // false at the end of the log, otherwise exactly one of the two is set. The
+    // transactions stay valid as long as the reader.
+    bool Next(CWalletTx*& pwtxRet, CAccountingEntry*& pacentryRet);
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey
 {
@@ -385,6 +708,7 @@ private:
 
 public:
     std::vector<CMerkleTx> vtxPrev;
+    std::vector<uint256> vhashPrev; // the txids of vtxPrev instead, with -supportingtxids
     mapValue_t mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
     unsigned int fTimeReceivedIsTxTime;
@@ -439,6 +763,7 @@ public:
     {
         pwallet = pwalletIn;
         vtxPrev.clear();
+        vhashPrev.clear();
         mapValue.clear();
         vOrderForm.clear();
         fTimeReceivedIsTxTime = false;
@@ -492,6 +817,14 @@ public:
 
             if (nTimeSmart)
                 pthis->mapValue["timesmart"] = strprintf("%u", nTimeSmart);
+
+            if (!vhashPrev.empty())
+            {
+                std::string strPrev;
+                BOOST_FOREACH(const uint256& hash, vhashPrev)
+                    strPrev += (strPrev.empty() ? "" : ",") + hash.GetHex();
+                pthis->mapValue["prevtxs"] = strPrev;
+            }
         }
 
         nSerSize += SerReadWrite(s, *(CMerkleTx*)this, nType, nVersion,ser_action);
@@ -516,6 +849,14 @@ public:
             ReadOrderPos(pthis->nOrderPos, pthis->mapValue);
 
             pthis->nTimeSmart = mapValue.count("timesmart") ? (unsigned int)strtoll(pthis->mapValue["timesmart"]) : 0;
+
+            if (mapValue.count("prevtxs"))
+            {
+                // Comma separated txids, 64 hex digits each
+                const std::string& strPrev = pthis->mapValue["prevtxs"];
+                for (unsigned int i = 0; i + 64 <= strPrev.size(); i += 65)
+                    pthis->vhashPrev.push_back(uint256(strPrev.substr(i, 64)));
+            }
         }
 
         pthis->mapValue.erase("fromaccount");
@@ -523,6 +864,7 @@ public:
         pthis->mapValue.erase("spent");
         pthis->mapValue.erase("n");
         pthis->mapValue.erase("timesmart");
+        pthis->mapValue.erase("prevtxs");
     )
 
     // marks certain txout's as spent
@@ -564,6 +906,11 @@ public:
     int GetRequestCount() const;
 
     void AddSupportingTransactions(CTxDB& txdb);
+    // Keep only the txids of the supporting transactions
+    void DropSupportingTransactions();
+    // The supporting transactions which aren't in the block chain yet, in vtxPrev order.
+    // Those only known by their txid are looked up in the wallet and the memory pool.
+    void GetSupportingTransactions(CTxDB& txdb, std::vector<CMerkleTx>& vtxRet) const;
 
     bool AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs=true);
     bool AcceptWalletTransaction();
@@ -32,7 +32,7 @@ extern bool fWalletUnlockMintOnly;
 
 bool CWalletDB::WriteName(const string& strAddress, const string& strName)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(make_pair(string("name"), strAddress), strName);
 }
 
@@ -40,7 +40,7 @@ bool CWalletDB::EraseName(const string& strAddress)
 {
     // This should only be used for sending addresses, never for receiving addresses,
     // receiving addresses must always have an address book entry if they're not change return.
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(make_pair(string("name"), strAddress));
 }
 
@@ -125,6 +125,7 @@ DBErrors
 CWalletDB::ReorderTransactions(CWallet* pwallet)
 {
     LOCK(pwallet->cs_wallet);
+    pwallet->InvalidateTxIndexes();
     // Old wallets didn't have any defined order for transactions
     // Probably a bad idea to change the output of this
 
@@ -193,6 +194,19 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
     return DB_LOAD_OK;
 }
 
+// Plaintext key record, validated after the scan
+class CDeferredKey {
+public:
+    CPubKey vchPubKey;
+    CPrivKey vchPrivKey;
+    bool fWalletKey;
+    CKey key;
+    string strErr;
+
+    CDeferredKey(const CPubKey& vchPubKeyIn, const CPrivKey& vchPrivKeyIn, bool fWalletKeyIn) :
+        vchPubKey(vchPubKeyIn), vchPrivKey(vchPrivKeyIn), fWalletKey(fWalletKeyIn) { }
+};
+
 class CWalletScanState {
 public:
     unsigned int nKeys;
@@ -200,17 +214,76 @@ public:
     unsigned int nKeyMeta;
     bool fIsEncrypted;
     bool fAnyUnordered;
+    int64_t nOrderPosMax;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    bool fDeferKeys;
+    vector<CDeferredKey> vDeferredKeys;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = 0;
         fIsEncrypted = false;
         fAnyUnordered = false;
+        nOrderPosMax = -1;
         nFileVersion = 0;
+        fDeferKeys = false;
     }
 };
 
+// Rebuilds the keys from their private parts and checks them against the stored
+// public keys. That is an EC multiplication per key, so the work is split over
+// the script check threads.
+static void ValidateDeferredKeys(vector<CDeferredKey>* pvKeys, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvKeys->size(); i += nStride)
+    {
+        CDeferredKey& entry = (*pvKeys)[i];
+        const char* pszRecord = entry.fWalletKey ? "CWalletKey" : "CPrivKey";
+        if (!entry.key.SetPrivKey(entry.vchPrivKey))
+        {
+            entry.strErr = "Error reading wallet database: CPrivKey corrupt";
+            continue;
+        }
+        if (entry.key.GetPubKey() != entry.vchPubKey)
+        {
+            entry.strErr = strprintf("Error reading wallet database: %s pubkey inconsistency", pszRecord);
+            continue;
+        }
+        entry.key.SetCompressedPubKey(entry.vchPubKey.IsCompressed());
+        if (!entry.key.IsValid())
+            entry.strErr = strprintf("Error reading wallet database: invalid %s", pszRecord);
+    }
+}
+
+static bool LoadDeferredKeys(CWallet* pwallet, CWalletScanState& wss)
+{
+    unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+    nThreads = std::min<unsigned int>(nThreads, 1 + wss.vDeferredKeys.size() / 1000);
+
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ValidateDeferredKeys, &wss.vDeferredKeys, i, nThreads));
+    ValidateDeferredKeys(&wss.vDeferredKeys, 0, nThreads);
+    threads.join_all();
+
+    bool fGood = true;
+    BOOST_FOREACH(const CDeferredKey& entry, wss.vDeferredKeys)
+    {
+        if (entry.strErr.empty() && !pwallet->LoadKey(entry.key))
+        {
+            printf("Error reading wallet database: LoadKey failed\n");
+            fGood = false;
+        }
+        else if (!entry.strErr.empty())
+        {
+            printf("%s\n", entry.strErr.c_str());
+            fGood = false;
+        }
+    }
+    wss.vDeferredKeys.clear();
+    return fGood;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -231,6 +304,9 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             uint256 hash;
             ssKey >> hash;
+            // Only the outputs of the archived ones are kept in memory
+            if (pwallet->IsArchived(hash))
+                return true;
             CWalletTx& wtx = pwallet->mapWallet[hash];
             ssValue >> wtx;
             if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
@@ -261,8 +337,16 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 wss.vWalletUpgrade.push_back(hash);
             }
 
+            // Rewritten with the txids of the supporting transactions only
+            if (fSupportingTxids && !wtx.vtxPrev.empty())
+            {
+                wtx.DropSupportingTransactions();
+                wss.vWalletUpgrade.push_back(hash);
+            }
+
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
+            wss.nOrderPosMax = std::max(wss.nOrderPosMax, wtx.nOrderPos);
 
             //// debug print
             //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
@@ -287,6 +371,7 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 ssValue >> acentry;
                 if (acentry.nOrderPos == -1)
                     wss.fAnyUnordered = true;
+                wss.nOrderPosMax = std::max(wss.nOrderPosMax, acentry.nOrderPos);
             }
         }
         else if (strType == "watchs")
@@ -342,6 +427,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 wss.nKeys++;
                 CPrivKey pkey;
                 ssValue >> pkey;
+                if (wss.fDeferKeys)
+                {
+                    wss.vDeferredKeys.push_back(CDeferredKey(vchPubKey, pkey, false));
+                    return true;
+                }
                 if (!key.SetPrivKey(pkey))
                 {
                     strErr = "Error reading wallet database: CPrivKey corrupt";
@@ -363,6 +453,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             {
                 CWalletKey wkey;
                 ssValue >> wkey;
+                if (wss.fDeferKeys)
+                {
+                    wss.vDeferredKeys.push_back(CDeferredKey(vchPubKey, wkey.vchPrivKey, true));
+                    return true;
+                }
                 if (!key.SetPrivKey(wkey.vchPrivKey))
                 {
                     strErr = "Error reading wallet database: CPrivKey corrupt";
@@ -483,6 +578,15 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
         }
+        else if (strType == "archtx")
+        {
+            uint256 hash;
+            ssKey >> hash;
+            CArchivedTx atx;
+            ssValue >> atx;
+            pwallet->LoadArchivedTx(hash, atx);
+            wss.nOrderPosMax = std::max(wss.nOrderPosMax, atx.nOrderPos);
+        }
         else if (strType == "orderposnext")
         {
             ssValue >> pwallet->nOrderPosNext;
@@ -500,6 +604,47 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey" || strType == "malpair" || strType == "malcpair");
 }
 
+// The "archtx" records sort after the "tx" ones, so they are read first on
+// their own, for the archived transactions to be skipped in the main pass
+bool CWalletDB::LoadArchivedTxs(CWallet* pwallet)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    unsigned int fFlags = DB_SET_RANGE;
+    for ( ; ; )
+    {
+        // Read next record
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << string("archtx");
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        // Unserialize
+        string strType;
+        ssKey >> strType;
+        if (strType != "archtx")
+            break;
+        uint256 hash;
+        ssKey >> hash;
+        CArchivedTx atx;
+        ssValue >> atx;
+        pwallet->LoadArchivedTx(hash, atx);
+    }
+
+    pcursor->close();
+    return true;
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -507,6 +652,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    // Plaintext keys are checked together once all the records are read
+    wss.fDeferKeys = true;
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
@@ -517,6 +665,12 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             pwallet->LoadMinVersion(nMinVersion);
         }
 
+        if (!LoadArchivedTxs(pwallet))
+        {
+            printf("Error reading the wallet transaction archive\n");
+            return DB_CORRUPT;
+        }
+
         // Get cursor
         Dbc* pcursor = GetCursor();
         if (!pcursor)
@@ -560,6 +714,10 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 printf("%s\n", strErr.c_str());
         }
         pcursor->close();
+
+        // losing keys is considered a catastrophic error
+        if (!LoadDeferredKeys(pwallet, wss))
+            result = DB_CORRUPT;
     }
     catch (...)
     {
@@ -594,8 +752,15 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     if (wss.nFileVersion < CLIENT_VERSION) // Update
         WriteVersion(CLIENT_VERSION);
 
+    // Renumbering every transaction is only needed when some have no position
+    // yet. Otherwise a counter behind the stored positions is just moved forward.
     if (wss.fAnyUnordered)
         result = ReorderTransactions(pwallet);
+    else if (pwallet->nOrderPosNext <= wss.nOrderPosMax)
+    {
+        pwallet->nOrderPosNext = wss.nOrderPosMax + 1;
+        WriteOrderPosNext(pwallet->nOrderPosNext);
+    }
 
     return result;
 }
@@ -680,12 +845,40 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet)
     return DB_LOAD_OK;
 }
 
+// Files of the loaded wallets, all flushed by the first flushing thread
+static CCriticalSection cs_setFlushWalletFiles;
+static set<string> setFlushWalletFiles;
+
+// Guards nWalletDBUpdated for the flush thread's wait
+static boost::mutex mutexWalletDBUpdated;
+static boost::condition_variable condWalletDBUpdated;
+
+void MarkWalletDBUpdated()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWalletDBUpdated);
+        nWalletDBUpdated++;
+    }
+    condWalletDBUpdated.notify_all();
+}
+
+void InterruptFlushWalletDB()
+{
+    // Taking the mutex makes sure the thread is either waiting, or will see
+    // fShutdown before it waits
+    boost::unique_lock<boost::mutex> lock(mutexWalletDBUpdated);
+    condWalletDBUpdated.notify_all();
+}
+
 void ThreadFlushWalletDB(void* parg)
 {
     // Make this thread recognisable as the wallet flushing thread
     RenameThread("42-wallet");
 
-    const string& strFile = ((const string*)parg)[0];
+    {
+        LOCK(cs_setFlushWalletFiles);
+        setFlushWalletFiles.insert(((const string*)parg)[0]);
+    }
     static bool fOneThread;
     if (fOneThread)
         return;
@@ -693,20 +886,34 @@ void ThreadFlushWalletDB(void* parg)
     if (!GetBoolArg("-flushwallet", true))
         return;
 
-    unsigned int nLastSeen = nWalletDBUpdated;
-    unsigned int nLastFlushed = nWalletDBUpdated;
-    int64_t nLastWalletUpdate = GetTime();
+    // Flush once the wallet has seen no writes for this long, so a burst of
+    // writes is flushed together
+    int64_t nDelay = std::max((int64_t)1, GetArg("-flushwalletdelay", 2)) * 1000;
+    unsigned int nLastFlushed;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWalletDBUpdated);
+        nLastFlushed = nWalletDBUpdated;
+    }
     while (!fShutdown)
     {
-        Sleep(500);
-
-        if (nLastSeen != nWalletDBUpdated)
         {
-            nLastSeen = nWalletDBUpdated;
-            nLastWalletUpdate = GetTime();
+            boost::unique_lock<boost::mutex> lock(mutexWalletDBUpdated);
+            while (!fShutdown && nWalletDBUpdated == nLastFlushed)
+                condWalletDBUpdated.wait(lock);
+
+            unsigned int nLastSeen;
+            do
+            {
+                nLastSeen = nWalletDBUpdated;
+                boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nDelay);
+                while (!fShutdown && nWalletDBUpdated == nLastSeen)
+                    if (!condWalletDBUpdated.timed_wait(lock, timeout))
+                        break;
+            } while (!fShutdown && nWalletDBUpdated != nLastSeen);
         }
+        if (fShutdown)
+            break;
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -722,19 +929,30 @@ void ThreadFlushWalletDB(void* parg)
 
                 if (nRefCount == 0 && !fShutdown)
                 {
-                    map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
-                    if (mi != bitdb.mapFileUseCount.end())
+                    set<string> setFiles;
                     {
-                        printf("Flushing wallet.dat\n");
+                        LOCK(cs_setFlushWalletFiles);
+                        setFiles = setFlushWalletFiles;
+                    }
+                    {
+                        boost::unique_lock<boost::mutex> lock(mutexWalletDBUpdated);
                         nLastFlushed = nWalletDBUpdated;
+                    }
+                    BOOST_FOREACH(const string& strFile, setFiles)
+                    {
+                        map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
+                        if (mi == bitdb.mapFileUseCount.end())
+                            continue;
+
+                        printf("Flushing %s\n", strFile.c_str());
                         int64_t nStart = GetTimeMillis();
 
-                        // Flush wallet.dat so it's self contained
+                        // Flush the wallet file so it's self contained
                         bitdb.CloseDb(strFile);
                         bitdb.CheckpointLSN(strFile);
 
-                        bitdb.mapFileUseCount.erase(mi++);
-                        printf("Flushed wallet.dat %" PRId64 "ms\n", GetTimeMillis() - nStart);
+                        bitdb.mapFileUseCount.erase(mi);
+                        printf("Flushed %s %" PRId64 "ms\n", strFile.c_str(), GetTimeMillis() - nStart);
                     }
                 }
             }
@@ -782,6 +1000,10 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
     return false;
 }
 
+// Keys written or imported per hold of the wallet lock, so that staking and
+// the other wallet users only wait for one chunk at a time
+static const unsigned int WALLET_DUMP_CHUNK_SIZE = 1000;
+
 bool DumpWallet(CWallet* pwallet, const string& strDest)
 {
     if (!pwallet->fFileBacked)
@@ -790,7 +1012,10 @@ bool DumpWallet(CWallet* pwallet, const string& strDest)
     std::map<CBitcoinAddress, int64_t> mapAddresses;
     std::set<CKeyID> setKeyPool;
 
-    pwallet->GetAddresses(mapAddresses);
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->GetAddresses(mapAddresses);
+    }
     pwallet->GetAllReserveKeys(setKeyPool);
 
     // sort time/key pairs
@@ -808,48 +1033,60 @@ bool DumpWallet(CWallet* pwallet, const string& strDest)
        return false;
 
     // produce output
+    boost::shared_ptr<const CChainTip> tip = GetChainTip();
     file << strprintf("# Wallet dump created by 42 %s (%s)\n", CLIENT_BUILD.c_str(), CLIENT_DATE.c_str());
     file << strprintf("# * Created on %s\n", EncodeDumpTime(GetTime()).c_str());
-    file << strprintf("# * Best block at time of backup was %i (%s),\n", nBestHeight, hashBestChain.ToString().c_str());
-    file << strprintf("#   mined on %s\n", EncodeDumpTime(pindexBest->nTime).c_str());
+    file << strprintf("# * Best block at time of backup was %i (%s),\n", tip->nHeight, tip->hashBlock.ToString().c_str());
+    file << strprintf("#   mined on %s\n", EncodeDumpTime(tip->pindex ? tip->pindex->nTime : 0).c_str());
     file << "\n";
 
-    for (std::vector<std::pair<int64_t, CBitcoinAddress> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
-        const CBitcoinAddress &addr = it->second;
-        std::string strTime = EncodeDumpTime(it->first);
-        std::string strAddr = addr.ToString();
-
-        if (addr.IsPair()) {
-            // Pubkey pair address
-            CMalleableKeyView keyView;
-            CMalleablePubKey mPubKey(addr.GetData());
-            if (!pwallet->GetMalleableView(mPubKey, keyView))
-                continue;
-            CMalleableKey mKey;
-            pwallet->GetMalleableKey(keyView, mKey);
-            file << mKey.ToString();
-            if (pwallet->mapAddressBook.count(addr))
-                file << strprintf(" %s label=%s # view=%s addr=%s\n", strTime.c_str(), EncodeDumpString(pwallet->mapAddressBook[addr]).c_str(), keyView.ToString().c_str(), strAddr.c_str());
-            else
-                file << strprintf(" %s # view=%s addr=%s\n", strTime.c_str(), keyView.ToString().c_str(), strAddr.c_str());
-        }
-        else {
-            // Pubkey hash address
-            CKeyID keyid;
-            addr.GetKeyID(keyid);
-            bool IsCompressed;
-            CKey key;
-            if (!pwallet->GetKey(keyid, key))
-                continue;
-            CSecret secret = key.GetSecret(IsCompressed);
-            file << CBitcoinSecret(secret, IsCompressed).ToString();
-            if (pwallet->mapAddressBook.count(addr))
-                file << strprintf(" %s label=%s # addr=%s\n", strTime.c_str(), EncodeDumpString(pwallet->mapAddressBook[addr]).c_str(), strAddr.c_str());
-            else if (setKeyPool.count(keyid))
-                file << strprintf(" %s reserve=1 # addr=%s\n", strTime.c_str(), strAddr.c_str());
-            else
-                file << strprintf(" %s change=1 # addr=%s\n", strTime.c_str(), strAddr.c_str());
+    for (unsigned int nStart = 0; nStart < vAddresses.size(); nStart += WALLET_DUMP_CHUNK_SIZE) {
+        unsigned int nEnd = std::min<unsigned int>(nStart + WALLET_DUMP_CHUNK_SIZE, vAddresses.size());
+        std::string strChunk;
+        {
+            LOCK(pwallet->cs_wallet);
+            for (unsigned int i = nStart; i < nEnd; i++) {
+                const CBitcoinAddress &addr = vAddresses[i].second;
+                std::string strTime = EncodeDumpTime(vAddresses[i].first);
+                std::string strAddr = addr.ToString();
+
+                if (addr.IsPair()) {
+                    // Pubkey pair address
+                    CMalleableKeyView keyView;
+                    CMalleablePubKey mPubKey(addr.GetData());
+                    if (!pwallet->GetMalleableView(mPubKey, keyView))
+                        continue;
+                    CMalleableKey mKey;
+                    pwallet->GetMalleableKey(keyView, mKey);
+                    strChunk += mKey.ToString();
+                    if (pwallet->mapAddressBook.count(addr))
+                        strChunk += strprintf(" %s label=%s # view=%s addr=%s\n", strTime.c_str(), EncodeDumpString(pwallet->mapAddressBook[addr]).c_str(), keyView.ToString().c_str(), strAddr.c_str());
+                    else
+                        strChunk += strprintf(" %s # view=%s addr=%s\n", strTime.c_str(), keyView.ToString().c_str(), strAddr.c_str());
+                }
+                else {
+                    // Pubkey hash address
+                    CKeyID keyid;
+                    addr.GetKeyID(keyid);
+                    bool IsCompressed;
+                    CKey key;
+                    if (!pwallet->GetKey(keyid, key))
+                        continue;
+                    CSecret secret = key.GetSecret(IsCompressed);
+                    strChunk += CBitcoinSecret(secret, IsCompressed).ToString();
+                    if (pwallet->mapAddressBook.count(addr))
+                        strChunk += strprintf(" %s label=%s # addr=%s\n", strTime.c_str(), EncodeDumpString(pwallet->mapAddressBook[addr]).c_str(), strAddr.c_str());
+                    else if (setKeyPool.count(keyid))
+                        strChunk += strprintf(" %s reserve=1 # addr=%s\n", strTime.c_str(), strAddr.c_str());
+                    else
+                        strChunk += strprintf(" %s change=1 # addr=%s\n", strTime.c_str(), strAddr.c_str());
+                }
+            }
         }
+        // Written with the lock released
+        file << strChunk;
+        if (!file.good())
+            return false;
     }
 
     file << "\n";
@@ -859,6 +1096,52 @@ bool DumpWallet(CWallet* pwallet, const string& strDest)
     return true;
 }
 
+// One key line of a wallet dump
+class CImportEntry {
+public:
+    std::string strKey;
+    int64_t nTime;
+    std::string strLabel;
+    bool fLabel;
+
+    // Filled in by DecodeImportEntries
+    bool fValid;
+    bool fPair;
+    CKey key;
+    CKeyID keyid;
+    CMalleableKey mKey;
+    CMalleablePubKey mPubKey;
+    CBitcoinAddress addr;
+
+    CImportEntry() : nTime(0), fLabel(true), fValid(false), fPair(false) { }
+};
+
+// Decoding a private key and deriving its address costs an EC multiplication,
+// so the lines are split over the script check threads
+static void DecodeImportEntries(vector<CImportEntry>* pvEntries, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvEntries->size(); i += nStride)
+    {
+        CImportEntry& entry = (*pvEntries)[i];
+        CBitcoinSecret vchSecret;
+        if (vchSecret.SetString(entry.strKey)) {
+            // Simple private key
+            bool fCompressed;
+            CSecret secret = vchSecret.GetSecret(fCompressed);
+            entry.key.SetSecret(secret, fCompressed);
+            entry.keyid = entry.key.GetPubKey().GetID();
+            entry.addr = CBitcoinAddress(entry.keyid);
+            entry.fValid = true;
+        } else if (entry.mKey.SetString(entry.strKey)) {
+            // A pair of private keys
+            entry.mPubKey = entry.mKey.GetMalleablePubKey();
+            entry.addr = CBitcoinAddress(entry.mPubKey);
+            entry.fPair = true;
+            entry.fValid = true;
+        }
+    }
+}
+
 bool ImportWallet(CWallet *pwallet, const string& strLocation)
 {
 
@@ -871,10 +1154,8 @@ bool ImportWallet(CWallet *pwallet, const string& strLocation)
    if (!file.is_open())
        return false;
 
-   bool fGood = true;
-   int64_t nTimeBegin = pindexBest->nTime;
-
-   // read through input file checking and importing keys into wallet.
+   // read through input file collecting the key lines
+   vector<CImportEntry> vEntries;
    while (file.good()) {
        std::string line;
        std::getline(file, line);
@@ -887,74 +1168,76 @@ bool ImportWallet(CWallet *pwallet, const string& strLocation)
        if (vstr.size() < 2)
            continue;
 
-       int64_t nTime = DecodeDumpTime(vstr[1]);
-       std::string strLabel;
-       bool fLabel = true;
+       vEntries.push_back(CImportEntry());
+       CImportEntry& entry = vEntries.back();
+       entry.strKey = vstr[0];
+       entry.nTime = DecodeDumpTime(vstr[1]);
        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
            if (boost::algorithm::starts_with(vstr[nStr], "#"))
                break;
            if (vstr[nStr] == "change=1")
-               fLabel = false;
+               entry.fLabel = false;
            if (vstr[nStr] == "reserve=1")
-               fLabel = false;
+               entry.fLabel = false;
            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-               strLabel = DecodeDumpString(vstr[nStr].substr(6));
-               fLabel = true;
-           }
-       }
-
-       CBitcoinAddress addr;
-       CBitcoinSecret vchSecret;
-       if (vchSecret.SetString(vstr[0])) {
-           // Simple private key
-
-           bool fCompressed;
-           CKey key;
-           CSecret secret = vchSecret.GetSecret(fCompressed);
-           key.SetSecret(secret, fCompressed);
-           CKeyID keyid = key.GetPubKey().GetID();
-           addr = CBitcoinAddress(keyid);
-
-           if (pwallet->HaveKey(keyid)) {
-               printf("Skipping import of %s (key already present)\n", addr.ToString().c_str());
-               continue;
-           }
-
-           printf("Importing %s...\n", addr.ToString().c_str());
-           if (!pwallet->AddKey(key)) {
-               fGood = false;
-               continue;
-           }
-       } else {
-           // A pair of private keys
-
-           CMalleableKey mKey;
-           if (!mKey.SetString(vstr[0]))
-               continue;
-           CMalleablePubKey mPubKey = mKey.GetMalleablePubKey();
-           addr = CBitcoinAddress(mPubKey);
-
-           if (pwallet->CheckOwnership(mPubKey)) {
-               printf("Skipping import of %s (key already present)\n", addr.ToString().c_str());
-               continue;
-           }
-
-           printf("Importing %s...\n", addr.ToString().c_str());
-           if (!pwallet->AddKey(mKey)) {
-               fGood = false;
-               continue;
+               entry.strLabel = DecodeDumpString(vstr[nStr].substr(6));
+               entry.fLabel = true;
            }
        }
+   }
+   file.close();
 
-       pwallet->mapKeyMetadata[addr].nCreateTime = nTime;
-       if (fLabel)
-           pwallet->SetAddressBookName(addr, strLabel);
+   unsigned int nThreads = std::max(1, std::min(nScriptCheckThreads, 128));
+   nThreads = std::min<unsigned int>(nThreads, 1 + vEntries.size() / 1000);
+   {
+       boost::thread_group threads;
+       for (unsigned int i = 1; i < nThreads; i++)
+           threads.create_thread(boost::bind(&DecodeImportEntries, &vEntries, i, nThreads));
+       DecodeImportEntries(&vEntries, 0, nThreads);
+       threads.join_all();
+   }
 
-       nTimeBegin = std::min(nTimeBegin, nTime);
+   bool fGood = true;
+   int64_t nTimeBegin = std::numeric_limits<int64_t>::max();
+   unsigned int nImported = 0;
+
+   for (unsigned int nStart = 0; nStart < vEntries.size(); nStart += WALLET_DUMP_CHUNK_SIZE) {
+      unsigned int nEnd = std::min<unsigned int>(nStart + WALLET_DUMP_CHUNK_SIZE, vEntries.size());
+
+      // The keys of a chunk and their labels are written in one transaction
+      LOCK(pwallet->cs_wallet);
+      CWalletDBBatch batch(pwallet->strWalletFile);
+      for (unsigned int i = nStart; i < nEnd; i++) {
+          const CImportEntry& entry = vEntries[i];
+          if (!entry.fValid)
+              continue;
+
+          if (entry.fPair ? pwallet->CheckOwnership(entry.mPubKey) : pwallet->HaveKey(entry.keyid)) {
+              printf("Skipping import of %s (key already present)\n", entry.addr.ToString().c_str());
+              continue;
+          }
+
+          printf("Importing %s...\n", entry.addr.ToString().c_str());
+          if (!(entry.fPair ? pwallet->AddKey(entry.mKey) : pwallet->AddKey(entry.key))) {
+              fGood = false;
+              continue;
+          }
+
+          pwallet->mapKeyMetadata[entry.addr].nCreateTime = entry.nTime;
+          if (entry.fLabel)
+              pwallet->SetAddressBookName(entry.addr, entry.strLabel);
+
+          nTimeBegin = std::min(nTimeBegin, entry.nTime);
+          nImported++;
+      }
    }
-   file.close();
 
-   // rescan block chain looking for coins from new keys
+   if (nImported == 0)
+       return fGood;
+
+   // rescan block chain looking for coins from new keys, from the earliest
+   // birthday among them
+   LOCK2(cs_main, pwallet->cs_wallet);
    CBlockIndex *pindex = pindexBest;
    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
        pindex = pindex->pprev;
@@ -12,6 +12,7 @@
 class CKeyPool;
 class CAccount;
 class CAccountingEntry;
+class CArchivedTx;
 
 /** Error statuses for the wallet database */
 enum DBErrors
@@ -56,6 +57,35 @@ public:
 };
 
 
+/** Precalculated stake kernels, kept by the stake miner between restarts */
+class CStakeKernelCache
+{
+public:
+    // Best chain tip at the moment of the last update
+    uint256 hashBestBlock;
+
+    // (txid, vout.n) => (block hash, kernel)
+    std::map<std::pair<uint256, unsigned int>, std::pair<uint256, std::vector<unsigned char> > > mapKernels;
+
+    CStakeKernelCache()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBestBlock);
+        READWRITE(mapKernels);
+    )
+
+    void SetNull()
+    {
+        hashBestBlock = 0;
+        mapKernels.clear();
+    }
+};
+
+
 /** Access to the wallet database (wallet.dat) */
 class CWalletDB : public CDB
 {
@@ -73,19 +103,30 @@ public:
 
     bool WriteTx(uint256 hash, const CWalletTx& wtx)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::make_pair(std::string("tx"), hash), wtx);
     }
 
+    bool ReadTx(uint256 hash, CWalletTx& wtx)
+    {
+        return Read(std::make_pair(std::string("tx"), hash), wtx);
+    }
+
     bool EraseTx(uint256 hash)
     {
-        nWalletDBUpdated++;
-        return Erase(std::make_pair(std::string("tx"), hash));
+        MarkWalletDBUpdated();
+        return Erase(std::make_pair(std::string("tx"), hash)) && Erase(std::make_pair(std::string("archtx"), hash));
+    }
+
+    bool WriteArchivedTx(uint256 hash, const CArchivedTx& atx)
+    {
+        MarkWalletDBUpdated();
+        return Write(std::make_pair(std::string("archtx"), hash), atx);
     }
 
     bool WriteKey(const CPubKey& key, const CPrivKey& vchPrivKey, const CKeyMetadata &keyMeta)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         if(!Write(std::make_pair(std::string("keymeta"), key), keyMeta))
             return false;
 
@@ -97,7 +138,7 @@ public:
 
     bool WriteMalleableKey(const CMalleableKeyView& keyView, const CSecret& vchSecretH, const CKeyMetadata &keyMeta)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         if(!Write(std::make_pair(std::string("malmeta"), keyView.ToString()), keyMeta))
             return false;
 
@@ -109,7 +150,7 @@ public:
 
     bool WriteCryptedMalleableKey(const CMalleableKeyView& keyView, const std::vector<unsigned char>& vchCryptedSecretH, const CKeyMetadata &keyMeta)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         if(!Write(std::make_pair(std::string("malmeta"), keyView.ToString()), keyMeta))
             return false;
 
@@ -124,7 +165,7 @@ public:
 
     bool WriteCryptedKey(const CPubKey& key, const std::vector<unsigned char>& vchCryptedSecret, const CKeyMetadata &keyMeta)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         bool fEraseUnencryptedKey = true;
 
         if(!Write(std::make_pair(std::string("keymeta"), key), keyMeta))
@@ -142,13 +183,13 @@ public:
 
     bool WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true);
     }
 
     bool EraseMasterKey(unsigned int nID)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Erase(std::make_pair(std::string("mkey"), nID));
     }
 
@@ -164,25 +205,25 @@ public:
 
     bool WriteCScript(const uint160& hash, const CScript& redeemScript)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::make_pair(std::string("cscript"), hash), redeemScript, false);
     }
 
     bool WriteWatchOnly(const CScript &dest)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::make_pair(std::string("watchs"), dest), '1');
     }
 
     bool EraseWatchOnly(const CScript &dest)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Erase(std::make_pair(std::string("watchs"), dest));
     }
 
     bool WriteBestBlock(const CBlockLocator& locator)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::string("bestblock"), locator);
     }
 
@@ -191,15 +232,26 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    bool WriteStakeKernelCache(const CStakeKernelCache& cache)
+    {
+        MarkWalletDBUpdated();
+        return Write(std::string("stakecache"), cache);
+    }
+
+    bool ReadStakeKernelCache(CStakeKernelCache& cache)
+    {
+        return Read(std::string("stakecache"), cache);
+    }
+
     bool WriteOrderPosNext(int64_t nOrderPosNext)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::string("orderposnext"), nOrderPosNext);
     }
 
     bool WriteDefaultKey(const CPubKey& key)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::string("defaultkey"), key);
     }
 
@@ -210,13 +262,13 @@ public:
 
     bool WritePool(int64_t nPool, const CKeyPool& keypool)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Write(std::make_pair(std::string("pool"), nPool), keypool);
     }
 
     bool ErasePool(int64_t nPool)
     {
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
         return Erase(std::make_pair(std::string("pool"), nPool));
     }
 
@@ -235,6 +287,9 @@ public:
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 
     DBErrors ReorderTransactions(CWallet*);
+private:
+    bool LoadArchivedTxs(CWallet* pwallet);
+public:
     DBErrors LoadWallet(CWallet* pwallet);
     DBErrors FindWalletTx(CWallet* pwallet, std::vector<uint256>& vTxHash);
     DBErrors ZapWalletTx(CWallet* pwallet);
@@ -243,4 +298,39 @@ public:
     static bool Recover(CDBEnv& dbenv, std::string filename);
 };
 
+/** Groups the writes made to a wallet file while it is in scope into one
+ * database transaction, so a long run of writes costs a single commit and
+ * checkpoint instead of one per record. The handle keeps the file in use,
+ * which holds off the periodic flush until the batch is committed.
+ */
+class CWalletDBBatch
+{
+private:
+    std::string strFile;
+    CWalletDB walletdb;
+    bool fActive;
+
+    CWalletDBBatch(const CWalletDBBatch&);
+    void operator=(const CWalletDBBatch&);
+
+public:
+    CWalletDBBatch(const std::string& strFileIn) : strFile(strFileIn), walletdb(strFileIn)
+    {
+        fActive = bitdb.BatchBegin(strFile);
+    }
+
+    ~CWalletDBBatch()
+    {
+        if (fActive)
+            bitdb.BatchEnd(strFile);
+    }
+
+    // Commits what was written so far, without ending the batch. Only call where
+    // no cursor on the file is open.
+    bool Flush()
+    {
+        return fActive && bitdb.BatchFlush(strFile);
+    }
+};
+
 #endif // BITCOIN_WALLETDB_H
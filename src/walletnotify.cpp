@@ -0,0 +1,79 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletnotify.h"
+#include "util.h"
+
+#include <boost/algorithm/string/replace.hpp>
+
+using namespace std;
+
+CWalletNotifyQueue walletNotifyQueue;
+
+void CWalletNotifyQueue::Push(const uint256& hash)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        if (!setQueued.count(hash))
+        {
+            if (queue.size() < MAX_QUEUED)
+            {
+                queue.push_back(hash);
+                setQueued.insert(hash);
+            }
+            else if (nDropped++ % 1000 == 0)
+                printf("CWalletNotifyQueue::Push() : queue full, %" PRIu64 " notifications dropped\n", nDropped);
+        }
+    }
+    cond.notify_all();
+    history.Push(hash);
+}
+
+bool CWalletNotifyQueue::Pop(uint256& hashRet, int64_t nTimeout)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nTimeout);
+    while (queue.empty())
+    {
+        if (fShutdown || !cond.timed_wait(lock, timeout))
+            break;
+    }
+    if (queue.empty())
+        return false;
+
+    hashRet = queue.front();
+    queue.pop_front();
+    setQueued.erase(hashRet);
+    return true;
+}
+
+uint64_t CWalletNotifyQueue::Wait(uint64_t nSince, int64_t nTimeout, vector<uint256>& vHashRet, bool& fMissedRet)
+{
+    return history.Wait(nSince, nTimeout, vHashRet, fMissedRet);
+}
+
+void CWalletNotifyQueue::Interrupt()
+{
+    cond.notify_all();
+    history.Interrupt();
+}
+
+void ThreadWalletNotify(void* parg)
+{
+    // Make this thread recognisable as the wallet notification thread
+    RenameThread("42-walletnotify");
+
+    const string strCmdTemplate = GetArg("-walletnotify", "");
+    while (!fShutdown)
+    {
+        uint256 hash;
+        if (!walletNotifyQueue.Pop(hash, 1000))
+            continue;
+
+        string strCmd = strCmdTemplate;
+        boost::replace_all(strCmd, "%s", hash.GetHex());
+        runCommand(strCmd);
+    }
+}
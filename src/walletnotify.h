@@ -0,0 +1,61 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_WALLETNOTIFY_H
+#define BITCOIN_WALLETNOTIFY_H
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "notify.h"
+#include "uint256.h"
+
+/** Queue of the wallet transactions which were added or updated.
+ *
+ * The wallet only pushes the txid, under its lock, and a single thread runs
+ * the -walletnotify command for the queued ones, one at a time. A txid which
+ * is still queued isn't queued again, and the queue is bounded, so a rescan
+ * or a big block can't start thousands of shells. The latest notifications
+ * are also kept numbered, for the waitfortx long poll.
+ */
+class CWalletNotifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    std::deque<uint256> queue;      // waiting for the command
+    std::set<uint256> setQueued;
+    uint64_t nDropped;
+
+    CNotifyHistory history;
+
+public:
+    static const unsigned int MAX_QUEUED = 10000;
+    static const unsigned int MAX_HISTORY = 10000;
+
+    CWalletNotifyQueue() : nDropped(0), history(MAX_HISTORY) { }
+
+    void Push(const uint256& hash);
+
+    // Wait up to nTimeout milliseconds for the next txid to run the command for
+    bool Pop(uint256& hashRet, int64_t nTimeout);
+
+    // Wait up to nTimeout milliseconds for notifications after nSince, which
+    // are returned oldest first. Returns the number of the latest one.
+    uint64_t Wait(uint64_t nSince, int64_t nTimeout, std::vector<uint256>& vHashRet, bool& fMissedRet);
+
+    // Wake the waiting threads up, so they notice the shutdown
+    void Interrupt();
+};
+
+extern CWalletNotifyQueue walletNotifyQueue;
+
+void ThreadWalletNotify(void* parg);
+
+#endif